@@ -1,13 +1,19 @@
 #ifndef WHISPERLIB_BASE_FREE_LIST_H_
 #define WHISPERLIB_BASE_FREE_LIST_H_
 
+#include <algorithm>
 #include <atomic>
+#include <cstdint>
 #include <memory>
+#include <string>
 #include <utility>
 #include <vector>
 
+#include "absl/base/optimization.h"
+#include "absl/container/flat_hash_map.h"
 #include "absl/log/check.h"
 #include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
 #include "absl/synchronization/mutex.h"
 
 namespace whisper {
@@ -144,6 +150,301 @@ class ThreadSafeFreeList {
   absl::Mutex mutex_;
 };
 
+namespace internal {
+// The part of a ThreadCachedFreeList thread cache seen by the thread.
+struct FreeListThreadCache {
+  // Cleared when the owner thread exits - the cache can be then reused
+  // by another thread.
+  std::atomic_bool in_use = ATOMIC_VAR_INIT(true);
+  // Set when the free list is destroyed.
+  std::atomic_bool orphaned = ATOMIC_VAR_INIT(false);
+};
+
+// The thread caches of all ThreadCachedFreeList used by a thread.
+class FreeListThreadCaches {
+ public:
+  ~FreeListThreadCaches() {
+    for (const auto& it : caches_) {
+      it.second->in_use.store(false, std::memory_order_release);
+    }
+  }
+  // Returns the cache of the free list with the given id, or nullptr.
+  FreeListThreadCache* Find(uint64_t list_id) {
+    if (ABSL_PREDICT_TRUE(last_id_ == list_id)) {
+      return last_cache_;
+    }
+    auto it = caches_.find(list_id);
+    if (it == caches_.end()) {
+      return nullptr;
+    }
+    last_id_ = list_id;
+    last_cache_ = it->second.get();
+    return last_cache_;
+  }
+  void Add(uint64_t list_id, std::shared_ptr<FreeListThreadCache> cache) {
+    absl::erase_if(caches_, [](const auto& it) {
+      return it.second->orphaned.load(std::memory_order_acquire);
+    });
+    last_id_ = list_id;
+    last_cache_ = cache.get();
+    caches_.emplace(list_id, std::move(cache));
+  }
+
+ private:
+  uint64_t last_id_ = 0;
+  FreeListThreadCache* last_cache_ = nullptr;
+  absl::flat_hash_map<uint64_t, std::shared_ptr<FreeListThreadCache>> caches_;
+};
+
+inline FreeListThreadCaches* CurrentFreeListThreadCaches() {
+  static thread_local FreeListThreadCaches caches;
+  return &caches;
+}
+inline uint64_t NextFreeListId() {
+  static std::atomic<uint64_t> next_id = ATOMIC_VAR_INIT(0);
+  return next_id.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+}  // namespace internal
+
+// A free list usable from many threads without contention: each thread
+// keeps the free objects in its own cache of two magazines (arrays of up to
+// magazine_size objects). Only when both magazines are empty (or full) a
+// thread exchanges a whole magazine with a shared depot, under a lock.
+// Unlike the lists above, the objects are constructed on New (with the
+// provided arguments), and destroyed on Dispose - only their memory is
+// recycled, so any type can be used.
+//
+// The depot keeps at most max_size objects (in whole magazines), and each
+// thread up to 2 * magazine_size more. The cache of an exited thread is
+// reused by the next thread that starts using the list.
+// The objects still in use when the list is destroyed must not be disposed.
+template <typename T>
+class ThreadCachedFreeList {
+  static_assert(!std::is_array<T>::value, "array types are unsupported");
+  static_assert(std::is_object<T>::value, "non-object types are unsupported");
+
+ public:
+  using PtrType =
+      std::unique_ptr<T, _FreeListDeleter<T, ThreadCachedFreeList<T>>>;
+
+  struct Stats {
+    // New calls served from the thread cache.
+    uint64_t hits = 0;
+    // New calls for which the thread cache was empty.
+    uint64_t misses = 0;
+    // Objects allocated and deallocated from the memory.
+    uint64_t allocations = 0;
+    uint64_t deallocations = 0;
+    // Full magazines taken from and given to the depot.
+    uint64_t depot_gets = 0;
+    uint64_t depot_puts = 0;
+
+    std::string ToString() const {
+      return absl::StrCat("hits: ", hits, " misses: ", misses,
+                          " allocations: ", allocations,
+                          " deallocations: ", deallocations,
+                          " depot_gets: ", depot_gets,
+                          " depot_puts: ", depot_puts);
+    }
+  };
+
+  explicit ThreadCachedFreeList(size_t max_size, size_t magazine_size = 32)
+      : max_size_(max_size),
+        magazine_size_(std::max<size_t>(magazine_size, 1)),
+        id_(internal::NextFreeListId()) {}
+  ~ThreadCachedFreeList() {
+    absl::MutexLock ml(&mutex_);
+    for (const auto& cache : caches_) {
+      Deallocate(&cache->loaded);
+      Deallocate(&cache->previous);
+      cache->orphaned.store(true, std::memory_order_release);
+    }
+    for (Magazine& magazine : full_) {
+      Deallocate(&magazine);
+    }
+  }
+
+  template <typename... Args>
+  PtrType New(Args&&... args) {
+    Cache* const cache = GetCache();
+    Increment(&cache->outstanding, 1);
+    if (cache->loaded.empty() && !cache->previous.empty()) {
+      std::swap(cache->loaded, cache->previous);
+    }
+    void* storage;
+    if (ABSL_PREDICT_TRUE(!cache->loaded.empty())) {
+      Increment(&cache->hits, 1);
+      storage = cache->loaded.back();
+      cache->loaded.pop_back();
+    } else {
+      Increment(&cache->misses, 1);
+      if (GetFromDepot(&cache->loaded)) {
+        storage = cache->loaded.back();
+        cache->loaded.pop_back();
+      } else {
+        Increment(&cache->allocations, 1);
+        storage = std::allocator<T>().allocate(1);
+      }
+    }
+    PtrType ptr(new (storage) T(std::forward<Args>(args)...));
+    ptr.get_deleter().free_list = this;
+    return ptr;
+  }
+  // Destroys the object, and keeps its memory for reuse. Returns true if
+  // the memory was deallocated instead.
+  bool Dispose(T* ptr) {
+    if (!ptr) {
+      return false;
+    }
+    Cache* const cache = GetCache();
+    Increment(&cache->outstanding, -1);
+    ptr->~T();
+    if (cache->loaded.size() >= magazine_size_) {
+      if (cache->previous.empty() || PutToDepot(&cache->previous)) {
+        std::swap(cache->loaded, cache->previous);
+      } else {
+        Increment(&cache->deallocations, 1);
+        std::allocator<T>().deallocate(ptr, 1);
+        return true;
+      }
+    }
+    cache->loaded.push_back(ptr);
+    return false;
+  }
+
+  size_t max_size() const { return max_size_; }
+  size_t magazine_size() const { return magazine_size_; }
+  // Number of objects created and not disposed yet.
+  size_t outstanding() const {
+    absl::MutexLock ml(&mutex_);
+    int64_t outstanding = 0;
+    for (const auto& cache : caches_) {
+      outstanding += cache->outstanding.load(std::memory_order_relaxed);
+    }
+    return static_cast<size_t>(outstanding);
+  }
+  // Statistics aggregated from all the threads - approximate while the
+  // list is in use.
+  Stats stats() const {
+    absl::MutexLock ml(&mutex_);
+    Stats stats;
+    for (const auto& cache : caches_) {
+      stats.hits += cache->hits.load(std::memory_order_relaxed);
+      stats.misses += cache->misses.load(std::memory_order_relaxed);
+      stats.allocations += cache->allocations.load(std::memory_order_relaxed);
+      stats.deallocations +=
+          cache->deallocations.load(std::memory_order_relaxed);
+    }
+    stats.depot_gets = depot_gets_;
+    stats.depot_puts = depot_puts_;
+    return stats;
+  }
+
+ private:
+  using Magazine = std::vector<void*>;
+  struct Cache : public internal::FreeListThreadCache {
+    Magazine loaded;
+    Magazine previous;
+    // Written only by the owner thread, so no atomic read-modify-write
+    // is needed. The outstanding can be negative, for objects created in
+    // other threads.
+    std::atomic<int64_t> outstanding = ATOMIC_VAR_INIT(0);
+    std::atomic<uint64_t> hits = ATOMIC_VAR_INIT(0);
+    std::atomic<uint64_t> misses = ATOMIC_VAR_INIT(0);
+    std::atomic<uint64_t> allocations = ATOMIC_VAR_INIT(0);
+    std::atomic<uint64_t> deallocations = ATOMIC_VAR_INIT(0);
+  };
+
+  template <typename V>
+  static void Increment(std::atomic<V>* value,
+                        typename std::atomic<V>::value_type delta) {
+    value->store(value->load(std::memory_order_relaxed) + delta,
+                 std::memory_order_relaxed);
+  }
+  static void Deallocate(Magazine* magazine) {
+    for (void* storage : *magazine) {
+      std::allocator<T>().deallocate(static_cast<T*>(storage), 1);
+    }
+    magazine->clear();
+  }
+
+  Cache* GetCache() {
+    internal::FreeListThreadCaches* const caches =
+        internal::CurrentFreeListThreadCaches();
+    internal::FreeListThreadCache* const cache = caches->Find(id_);
+    if (ABSL_PREDICT_TRUE(cache != nullptr)) {
+      return static_cast<Cache*>(cache);
+    }
+    return NewCache(caches);
+  }
+  Cache* NewCache(internal::FreeListThreadCaches* caches) {
+    std::shared_ptr<Cache> cache;
+    {
+      absl::MutexLock ml(&mutex_);
+      for (const auto& c : caches_) {
+        bool in_use = false;
+        if (c->in_use.compare_exchange_strong(in_use, true,
+                                              std::memory_order_acquire)) {
+          cache = c;
+          break;
+        }
+      }
+      if (cache == nullptr) {
+        cache = std::make_shared<Cache>();
+        caches_.push_back(cache);
+      }
+    }
+    cache->loaded.reserve(magazine_size_);
+    cache->previous.reserve(magazine_size_);
+    caches->Add(id_, cache);
+    return cache.get();
+  }
+  // Exchanges the provided empty magazine with a full one from the depot.
+  bool GetFromDepot(Magazine* magazine) {
+    absl::MutexLock ml(&mutex_);
+    if (full_.empty()) {
+      return false;
+    }
+    ++depot_gets_;
+    std::swap(*magazine, full_.back());
+    empty_.emplace_back(std::move(full_.back()));
+    full_.pop_back();
+    return true;
+  }
+  // Exchanges the provided full magazine with an empty one, if the depot
+  // has room for it.
+  bool PutToDepot(Magazine* magazine) {
+    {
+      absl::MutexLock ml(&mutex_);
+      if ((full_.size() + 1) * magazine_size_ > max_size_) {
+        return false;
+      }
+      ++depot_puts_;
+      full_.emplace_back(std::move(*magazine));
+      *magazine = Magazine();
+      if (!empty_.empty()) {
+        std::swap(*magazine, empty_.back());
+        empty_.pop_back();
+      }
+    }
+    magazine->reserve(magazine_size_);
+    return true;
+  }
+
+  const size_t max_size_;
+  const size_t magazine_size_;
+  // Identifies this list in the thread caches.
+  const uint64_t id_;
+  mutable absl::Mutex mutex_;
+  // The caches of the threads that used this list.
+  std::vector<std::shared_ptr<Cache>> caches_ ABSL_GUARDED_BY(mutex_);
+  // The depot - full magazines, and empty ones for reuse.
+  std::vector<Magazine> full_ ABSL_GUARDED_BY(mutex_);
+  std::vector<Magazine> empty_ ABSL_GUARDED_BY(mutex_);
+  uint64_t depot_gets_ ABSL_GUARDED_BY(mutex_) = 0;
+  uint64_t depot_puts_ ABSL_GUARDED_BY(mutex_) = 0;
+};
+
 }  // namespace base
 }  // namespace whisper
 
@@ -0,0 +1,74 @@
+#include <memory>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "whisperlib/base/free_list.h"
+
+namespace whisper {
+namespace base {
+namespace {
+
+struct Object {
+  char data[256];
+};
+
+constexpr size_t kMaxFree = 1 << 12;
+
+// Plain heap allocation, for reference.
+class HeapAdapter {
+ public:
+  using PtrType = std::unique_ptr<Object>;
+  PtrType New() { return PtrType(new Object()); }
+};
+
+template <typename List>
+class ListAdapter {
+ public:
+  using PtrType = typename List::PtrType;
+  PtrType New() { return list_.New(); }
+
+ private:
+  List list_{kMaxFree};
+};
+
+// Shared by the benchmark threads.
+template <typename Allocator>
+Allocator* GetAllocator() {
+  static Allocator* const allocator = new Allocator();
+  return allocator;
+}
+
+// Allocates range(0) objects, then frees them all, per iteration - a
+// batch size of 1 is the best case (always the same object), while the
+// larger ones cycle through the free list.
+template <typename Allocator>
+void BM_NewDispose(benchmark::State& state) {
+  Allocator* const allocator = GetAllocator<Allocator>();
+  const size_t batch_size = state.range(0);
+  std::vector<typename Allocator::PtrType> objects;
+  objects.reserve(batch_size);
+  for (auto _ : state) {
+    for (size_t i = 0; i < batch_size; ++i) {
+      objects.emplace_back(allocator->New());
+    }
+    benchmark::DoNotOptimize(objects.data());
+    objects.clear();
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+
+using FreeListAdapter = ListAdapter<FreeList<Object>>;
+using ThreadSafeAdapter = ListAdapter<ThreadSafeFreeList<Object>>;
+using ThreadCachedAdapter = ListAdapter<ThreadCachedFreeList<Object>>;
+
+BENCHMARK_TEMPLATE(BM_NewDispose, HeapAdapter)->Arg(1)->Arg(64);
+BENCHMARK_TEMPLATE(BM_NewDispose, HeapAdapter)->Arg(64)->Threads(4);
+BENCHMARK_TEMPLATE(BM_NewDispose, FreeListAdapter)->Arg(1)->Arg(64);
+BENCHMARK_TEMPLATE(BM_NewDispose, ThreadSafeAdapter)->Arg(1)->Arg(64);
+BENCHMARK_TEMPLATE(BM_NewDispose, ThreadSafeAdapter)->Arg(64)->Threads(4);
+BENCHMARK_TEMPLATE(BM_NewDispose, ThreadCachedAdapter)->Arg(1)->Arg(64);
+BENCHMARK_TEMPLATE(BM_NewDispose, ThreadCachedAdapter)->Arg(64)->Threads(4);
+
+}  // namespace
+}  // namespace base
+}  // namespace whisper
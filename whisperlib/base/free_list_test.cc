@@ -1,5 +1,10 @@
 #include "whisperlib/base/free_list.h"
 
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "gtest/gtest.h"
 
 namespace whisper {
@@ -47,5 +52,106 @@ TEST(ThreadSafeFreeList, Simple) {
   TestSimpleFreeList(&fl, 10);
 }
 
+// Counts the live instances.
+class Counted {
+ public:
+  explicit Counted(std::string name) : name_(std::move(name)) {
+    num_live_.fetch_add(1);
+  }
+  ~Counted() { num_live_.fetch_sub(1); }
+  const std::string& name() const { return name_; }
+  static int num_live() { return num_live_.load(); }
+
+ private:
+  const std::string name_;
+  static std::atomic<int> num_live_;
+};
+std::atomic<int> Counted::num_live_{0};
+
+TEST(ThreadCachedFreeList, Simple) {
+  ThreadCachedFreeList<Counted> fl(8, 4);
+  EXPECT_EQ(fl.max_size(), 8);
+  EXPECT_EQ(fl.magazine_size(), 4);
+  std::vector<ThreadCachedFreeList<Counted>::PtrType> v;
+  for (int i = 0; i < 20; ++i) {
+    v.emplace_back(fl.New(std::to_string(i)));
+    EXPECT_EQ(v.back()->name(), std::to_string(i));
+  }
+  EXPECT_EQ(fl.outstanding(), 20);
+  EXPECT_EQ(Counted::num_live(), 20);
+  // 2 magazines in the thread cache, 2 in the depot, and the rest deleted.
+  std::vector<Counted*> kept;
+  for (int i = 0; i < 20; ++i) {
+    Counted* const p = v[i].release();
+    if (i < 16) {
+      kept.push_back(p);
+      EXPECT_FALSE(fl.Dispose(p));
+    } else {
+      EXPECT_TRUE(fl.Dispose(p));
+    }
+  }
+  EXPECT_EQ(fl.outstanding(), 0);
+  EXPECT_EQ(Counted::num_live(), 0);
+  v.clear();
+  for (int i = 0; i < 16; ++i) {
+    v.emplace_back(fl.New("x"));
+    EXPECT_EQ(v.back().get(), kept.back());
+    kept.pop_back();
+  }
+  auto stats = fl.stats();
+  EXPECT_EQ(stats.allocations, 20);
+  EXPECT_EQ(stats.deallocations, 4);
+  EXPECT_EQ(stats.depot_puts, 2);
+  EXPECT_EQ(stats.depot_gets, 2);
+  EXPECT_EQ(stats.misses, 22);
+  EXPECT_EQ(stats.hits, 14);
+  v.clear();  // back through the deleter
+  EXPECT_EQ(fl.outstanding(), 0);
+  EXPECT_EQ(Counted::num_live(), 0);
+}
+
+TEST(ThreadCachedFreeList, ManyThreads) {
+  static constexpr int kNumThreads = 4;
+  static constexpr int kNumRounds = 1000;
+  ThreadCachedFreeList<Counted> fl(256, 16);
+  // Objects created in a thread are disposed in the next one.
+  std::vector<std::vector<ThreadCachedFreeList<Counted>::PtrType>> passed(
+      kNumThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&fl, &passed, t]() {
+      std::vector<ThreadCachedFreeList<Counted>::PtrType> v;
+      for (int round = 0; round < kNumRounds; ++round) {
+        for (int i = 0; i < 50; ++i) {
+          v.emplace_back(fl.New("x"));
+        }
+        v.resize(10);
+      }
+      passed[t] = std::move(v);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(fl.outstanding(), kNumThreads * 10);
+  threads.clear();
+  // New threads reuse the caches of the exited ones.
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&passed, t]() {
+      passed[(t + 1) % kNumThreads].clear();
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(fl.outstanding(), 0);
+  EXPECT_EQ(Counted::num_live(), 0);
+  const auto stats = fl.stats();
+  EXPECT_EQ(stats.hits + stats.misses, kNumThreads * kNumRounds * 50);
+  EXPECT_GT(stats.hits, stats.misses);
+  EXPECT_LT(stats.allocations, kNumThreads * kNumRounds * 50);
+  EXPECT_LE(stats.depot_gets, stats.depot_puts) << stats.ToString();
+}
+
 }  // namespace base
 }  // namespace whisper
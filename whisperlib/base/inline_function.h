@@ -0,0 +1,178 @@
+#ifndef WHISPERLIB_BASE_INLINE_FUNCTION_H_
+#define WHISPERLIB_BASE_INLINE_FUNCTION_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace whisper {
+namespace base {
+
+// Counts the InlineFunction objects constructed from callables too large
+// for their inline storage, which needed a heap allocation.
+// Useful to catch (in tests or monitoring) the fallback on hot paths.
+inline std::atomic<uint64_t>& InlineFunctionHeapAllocations() {
+  static std::atomic<uint64_t> num_allocations = ATOMIC_VAR_INIT(0);
+  return num_allocations;
+}
+
+template <typename Signature, size_t kInlineSize = 48>
+class InlineFunction;
+
+// A move only function wrapper (similar to absl::AnyInvocable) that stores
+// its callable in an inline buffer of kInlineSize bytes, avoiding the
+// heap allocation std::function does for all but the smallest captures.
+// Callables that do not fit inline (or are not nothrow movable) are heap
+// allocated, and counted in InlineFunctionHeapAllocations().
+// Use InlineFunction<...>::kFitsInline<F> for a compile time check.
+//
+// Example:
+//   InlineFunction<void(int)> f = [this, x](int y) { Process(x, y); };
+//   f(2);
+template <typename R, typename... Args, size_t kInlineSize>
+class InlineFunction<R(Args...), kInlineSize> {
+ public:
+  template <typename F>
+  static constexpr bool kFitsInline =
+      sizeof(F) <= kInlineSize &&
+      alignof(F) <= alignof(std::max_align_t) &&
+      std::is_nothrow_move_constructible<F>::value;
+
+  InlineFunction() noexcept = default;
+  InlineFunction(std::nullptr_t) noexcept {}
+
+  template <typename F, typename FD = typename std::decay<F>::type,
+            typename = typename std::enable_if<
+                !std::is_same<FD, InlineFunction>::value &&
+                std::is_invocable_r<R, FD&, Args...>::value>::type>
+  InlineFunction(F&& f) {
+    Set<FD>(std::forward<F>(f));
+  }
+
+  InlineFunction(InlineFunction&& other) noexcept { MoveFrom(&other); }
+  InlineFunction& operator=(InlineFunction&& other) noexcept {
+    if (this != &other) {
+      Reset();
+      MoveFrom(&other);
+    }
+    return *this;
+  }
+  InlineFunction& operator=(std::nullptr_t) noexcept {
+    Reset();
+    return *this;
+  }
+  template <typename F, typename FD = typename std::decay<F>::type,
+            typename = typename std::enable_if<
+                !std::is_same<FD, InlineFunction>::value &&
+                std::is_invocable_r<R, FD&, Args...>::value>::type>
+  InlineFunction& operator=(F&& f) {
+    Reset();
+    Set<FD>(std::forward<F>(f));
+    return *this;
+  }
+
+  InlineFunction(const InlineFunction&) = delete;
+  InlineFunction& operator=(const InlineFunction&) = delete;
+
+  ~InlineFunction() { Reset(); }
+
+  // Like std::function, calling is const, but the callable is invoked
+  // as non-const (so mutable lambdas are fine).
+  R operator()(Args... args) const {
+    return ops_->invoke(const_cast<Storage*>(&storage_),
+                        std::forward<Args>(args)...);
+  }
+
+  explicit operator bool() const noexcept { return ops_ != nullptr; }
+  friend bool operator==(const InlineFunction& f, std::nullptr_t) noexcept {
+    return f.ops_ == nullptr;
+  }
+  friend bool operator!=(const InlineFunction& f, std::nullptr_t) noexcept {
+    return f.ops_ != nullptr;
+  }
+
+ private:
+  using Storage = typename std::aligned_storage<
+      kInlineSize, alignof(std::max_align_t)>::type;
+
+  // Type erased operations for the stored callable.
+  struct Ops {
+    R (*invoke)(Storage* storage, Args&&... args);
+    // Move constructs in dst from src, and destroys src.
+    void (*relocate)(Storage* dst, Storage* src) noexcept;
+    void (*destroy)(Storage* storage) noexcept;
+  };
+
+  template <typename F>
+  struct InlineOps {
+    static F* Get(Storage* storage) {
+      return std::launder(reinterpret_cast<F*>(storage));
+    }
+    static R Invoke(Storage* storage, Args&&... args) {
+      return (*Get(storage))(std::forward<Args>(args)...);
+    }
+    static void Relocate(Storage* dst, Storage* src) noexcept {
+      new (dst) F(std::move(*Get(src)));
+      Get(src)->~F();
+    }
+    static void Destroy(Storage* storage) noexcept { Get(storage)->~F(); }
+    static constexpr Ops kOps = {&Invoke, &Relocate, &Destroy};
+  };
+
+  template <typename F>
+  struct HeapOps {
+    static F*& Get(Storage* storage) {
+      return *std::launder(reinterpret_cast<F**>(storage));
+    }
+    static R Invoke(Storage* storage, Args&&... args) {
+      return (*Get(storage))(std::forward<Args>(args)...);
+    }
+    static void Relocate(Storage* dst, Storage* src) noexcept {
+      new (dst) F*(Get(src));
+    }
+    static void Destroy(Storage* storage) noexcept { delete Get(storage); }
+    static constexpr Ops kOps = {&Invoke, &Relocate, &Destroy};
+  };
+
+  template <typename FD, typename F>
+  void Set(F&& f) {
+    if constexpr (std::is_pointer<FD>::value ||
+                  std::is_member_pointer<FD>::value) {
+      if (f == nullptr) {
+        return;
+      }
+    }
+    if constexpr (kFitsInline<FD>) {
+      new (&storage_) FD(std::forward<F>(f));
+      ops_ = &InlineOps<FD>::kOps;
+    } else {
+      InlineFunctionHeapAllocations().fetch_add(1, std::memory_order_relaxed);
+      new (&storage_) FD*(new FD(std::forward<F>(f)));
+      ops_ = &HeapOps<FD>::kOps;
+    }
+  }
+  void MoveFrom(InlineFunction* other) noexcept {
+    if (other->ops_ != nullptr) {
+      other->ops_->relocate(&storage_, &other->storage_);
+      ops_ = other->ops_;
+      other->ops_ = nullptr;
+    }
+  }
+  void Reset() noexcept {
+    if (ops_ != nullptr) {
+      ops_->destroy(&storage_);
+      ops_ = nullptr;
+    }
+  }
+
+  Storage storage_;
+  const Ops* ops_ = nullptr;
+};
+
+}  // namespace base
+}  // namespace whisper
+
+#endif  // WHISPERLIB_BASE_INLINE_FUNCTION_H_
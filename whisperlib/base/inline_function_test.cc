@@ -0,0 +1,87 @@
+#include "whisperlib/base/inline_function.h"
+
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace whisper {
+namespace base {
+
+TEST(InlineFunction, Basic) {
+  InlineFunction<int(int)> f;
+  EXPECT_FALSE(f);
+  EXPECT_TRUE(f == nullptr);
+  const int x = 3;
+  f = [x](int y) { return x + y; };
+  EXPECT_TRUE(f);
+  EXPECT_EQ(f(2), 5);
+
+  InlineFunction<int(int)> g(std::move(f));
+  EXPECT_FALSE(f);
+  EXPECT_EQ(g(4), 7);
+  f = std::move(g);
+  EXPECT_EQ(f(1), 4);
+  f = nullptr;
+  EXPECT_FALSE(f);
+}
+
+int Twice(int x) { return 2 * x; }
+
+TEST(InlineFunction, FunctionPointers) {
+  InlineFunction<int(int)> f(&Twice);
+  EXPECT_EQ(f(21), 42);
+  int (*null_function)(int) = nullptr;
+  InlineFunction<int(int)> g(null_function);
+  EXPECT_FALSE(g);
+}
+
+TEST(InlineFunction, MoveOnlyAndMutable) {
+  auto p = std::make_unique<std::string>("foo");
+  InlineFunction<std::string()> f([p = std::move(p)]() mutable {
+    *p += "bar";
+    return *p;
+  });
+  EXPECT_EQ(f(), "foobar");
+  EXPECT_EQ(f(), "foobarbar");
+}
+
+TEST(InlineFunction, DestroysCapture) {
+  auto p = std::make_shared<int>(1);
+  {
+    InlineFunction<void()> f([p]() {});
+    EXPECT_EQ(p.use_count(), 2);
+    InlineFunction<void()> g(std::move(f));
+    EXPECT_EQ(p.use_count(), 2);
+  }
+  EXPECT_EQ(p.use_count(), 1);
+}
+
+TEST(InlineFunction, HeapFallback) {
+  using Small = std::array<char, 40>;
+  using Large = std::array<char, 100>;
+  auto small = [s = Small()]() { return s.size(); };
+  auto large = [l = Large()]() { return l.size(); };
+  static_assert(InlineFunction<size_t()>::kFitsInline<decltype(small)>);
+  static_assert(!InlineFunction<size_t()>::kFitsInline<decltype(large)>);
+
+  const uint64_t allocations = InlineFunctionHeapAllocations().load();
+  InlineFunction<size_t()> f(small);
+  EXPECT_EQ(InlineFunctionHeapAllocations().load(), allocations);
+  InlineFunction<size_t()> g(large);
+  EXPECT_EQ(InlineFunctionHeapAllocations().load(), allocations + 1);
+  EXPECT_EQ(f(), 40);
+  EXPECT_EQ(g(), 100);
+  std::vector<InlineFunction<size_t()>> v;
+  v.emplace_back(std::move(f));
+  v.emplace_back(std::move(g));
+  v.resize(100);
+  EXPECT_EQ(v[0](), 40);
+  EXPECT_EQ(v[1](), 100);
+  EXPECT_EQ(InlineFunctionHeapAllocations().load(), allocations + 1);
+}
+
+}  // namespace base
+}  // namespace whisper
@@ -0,0 +1,276 @@
+#include "whisperlib/io/buffered_file_writer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <utility>
+
+#include "absl/log/log.h"
+#include "absl/memory/memory.h"
+#include "whisperlib/io/errno.h"
+#include "whisperlib/status/status.h"
+
+namespace whisper {
+namespace io {
+
+namespace {
+constexpr std::align_val_t kBufferAlignment =
+    std::align_val_t(BufferedFileWriter::kDirectIoAlignment);
+
+uint64_t RoundUp(uint64_t value, uint64_t alignment) {
+  return ((value + alignment - 1) / alignment) * alignment;
+}
+uint64_t RoundDown(uint64_t value, uint64_t alignment) {
+  return (value / alignment) * alignment;
+}
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<BufferedFileWriter>> BufferedFileWriter::Open(
+    absl::string_view filename, Params params) {
+  auto writer = absl::WrapUnique(
+      new BufferedFileWriter(std::string(filename), std::move(params)));
+  RETURN_IF_ERROR(writer->Initialize());
+  return writer;
+}
+
+BufferedFileWriter::BufferedFileWriter(std::string filename, Params params)
+    : filename_(std::move(filename)),
+      params_(std::move(params)),
+      buffer_size_(std::max<size_t>(
+          RoundUp(params_.buffer_size, kDirectIoAlignment),
+          kDirectIoAlignment)) {}
+
+BufferedFileWriter::~BufferedFileWriter() {
+  const absl::Status status = Close();
+  LOG_IF(WARNING, !status.ok())
+      << "Closing buffered file writer for: `" << filename_
+      << "`: " << status;
+  absl::MutexLock l(&mutex_);
+  if (buffer_ != nullptr) {
+    ::operator delete(buffer_, kBufferAlignment);
+  }
+}
+
+absl::Status BufferedFileWriter::Initialize() {
+  absl::MutexLock l(&mutex_);
+  int flags = O_RDWR | O_CREAT | O_NOCTTY | O_CLOEXEC;
+  if (params_.truncate) {
+    flags |= O_TRUNC;
+  }
+  if (params_.direct_io) {
+#if defined(O_DIRECT)
+    flags |= O_DIRECT;
+#elif !defined(F_NOCACHE)
+    return status::UnimplementedErrorBuilder()
+           << "Direct I/O not supported on this system.";
+#endif  // O_DIRECT
+  }
+  const int fd = ::open(filename_.c_str(), flags, 00644);
+  if (fd < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Cannot open file `" << filename_ << "` for appending"
+           << (params_.direct_io ? " w/ direct I/O." : ".");
+  }
+  file_ = absl::make_unique<File>();
+  RETURN_IF_ERROR(file_->Set(filename_, fd));
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+  if (params_.direct_io && ::fcntl(fd, F_NOCACHE, 1) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Setting F_NOCACHE for file `" << filename_ << "`.";
+  }
+#endif  // !O_DIRECT && F_NOCACHE
+  buffer_ =
+      static_cast<char*>(::operator new(buffer_size_, kBufferAlignment));
+  const uint64_t size = file_->Size();
+  written_size_.store(size);
+  synced_size_.store(size);
+  allocated_size_ = size;
+  buffer_offset_ = size;
+  if (params_.direct_io) {
+    // We continue writing from the last (partial) block of the file.
+    buffer_offset_ = RoundDown(size, kDirectIoAlignment);
+    buffer_used_ = size - buffer_offset_;
+    if (buffer_used_ > 0) {
+      ASSIGN_OR_RETURN(
+          const size_t cb,
+          file_->ReadAt(buffer_offset_, buffer_, kDirectIoAlignment),
+          _ << "Reading the last block of the file.");
+      RET_CHECK(cb == buffer_used_)
+          << "File `" << filename_ << "` changed while opening.";
+    }
+  }
+  return absl::OkStatus();
+}
+
+uint64_t BufferedFileWriter::size() const {
+  absl::MutexLock l(&mutex_);
+  return buffer_offset_ + buffer_used_;
+}
+
+absl::Status BufferedFileWriter::Append(absl::string_view data) {
+  absl::MutexLock l(&mutex_);
+  RET_CHECK(file_ != nullptr) << "Appending to closed file: `" << filename_
+                              << "`";
+  if (!params_.direct_io && data.size() >= buffer_size_) {
+    RETURN_IF_ERROR(WriteBuffer());
+    return AppendDirectly(data);
+  }
+  while (!data.empty()) {
+    const size_t size = std::min(data.size(), buffer_size_ - buffer_used_);
+    memcpy(buffer_ + buffer_used_, data.data(), size);
+    buffer_used_ += size;
+    data.remove_prefix(size);
+    if (buffer_used_ == buffer_size_) {
+      RETURN_IF_ERROR(WriteBuffer());
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::Status BufferedFileWriter::Append(const absl::Cord& data) {
+  absl::MutexLock l(&mutex_);
+  RET_CHECK(file_ != nullptr) << "Appending to closed file: `" << filename_
+                              << "`";
+  if (!params_.direct_io && data.size() >= buffer_size_) {
+    // Written w/ vectored I/O, w/o copying.
+    RETURN_IF_ERROR(WriteBuffer());
+    return AppendDirectly(data);
+  }
+  for (absl::string_view chunk : data.Chunks()) {
+    while (!chunk.empty()) {
+      const size_t size = std::min(chunk.size(), buffer_size_ - buffer_used_);
+      memcpy(buffer_ + buffer_used_, chunk.data(), size);
+      buffer_used_ += size;
+      chunk.remove_prefix(size);
+      if (buffer_used_ == buffer_size_) {
+        RETURN_IF_ERROR(WriteBuffer());
+      }
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::Status BufferedFileWriter::AppendDirectly(absl::string_view data) {
+  RET_CHECK(buffer_used_ == 0);
+  RETURN_IF_ERROR(Preallocate(buffer_offset_ + data.size()));
+  ASSIGN_OR_RETURN(const size_t cb,
+                   file_->WriteAt(buffer_offset_, data.data(), data.size()));
+  num_writes_.fetch_add(1);
+  buffer_offset_ += cb;
+  written_size_.store(buffer_offset_);
+  return absl::OkStatus();
+}
+
+absl::Status BufferedFileWriter::AppendDirectly(const absl::Cord& data) {
+  RET_CHECK(buffer_used_ == 0);
+  RETURN_IF_ERROR(Preallocate(buffer_offset_ + data.size()));
+  ASSIGN_OR_RETURN(const size_t cb, file_->WriteCordAt(buffer_offset_, data));
+  num_writes_.fetch_add(1);
+  buffer_offset_ += cb;
+  written_size_.store(buffer_offset_);
+  return absl::OkStatus();
+}
+
+absl::Status BufferedFileWriter::WriteBuffer() {
+  const uint64_t end = buffer_offset_ + buffer_used_;
+  if (end == written_size_.load()) {
+    return absl::OkStatus();
+  }
+  size_t write_size = buffer_used_;
+  size_t done_size = buffer_used_;
+  if (params_.direct_io) {
+    write_size = RoundUp(buffer_used_, kDirectIoAlignment);
+    done_size = RoundDown(buffer_used_, kDirectIoAlignment);
+    memset(buffer_ + buffer_used_, 0, write_size - buffer_used_);
+  }
+  RETURN_IF_ERROR(Preallocate(buffer_offset_ + write_size));
+  RETURN_IF_ERROR(
+      file_->WriteAt(buffer_offset_, buffer_, write_size).status());
+  num_writes_.fetch_add(1);
+  written_size_.store(end);
+  if (done_size < buffer_used_) {
+    memmove(buffer_, buffer_ + done_size, buffer_used_ - done_size);
+  }
+  buffer_offset_ += done_size;
+  buffer_used_ -= done_size;
+  return absl::OkStatus();
+}
+
+absl::Status BufferedFileWriter::Preallocate(uint64_t end) {
+  if (params_.preallocate_size == 0 || end <= allocated_size_) {
+    return absl::OkStatus();
+  }
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+  const uint64_t size = RoundUp(end, params_.preallocate_size);
+  if (::fallocate(file_->fd(), FALLOC_FL_KEEP_SIZE, allocated_size_,
+                  size - allocated_size_) < 0) {
+    if (errno != EOPNOTSUPP) {
+      return error::ErrnoToStatus(error::Errno())
+             << "Pre-allocating space for file `" << filename_ << "`.";
+    }
+    // Not supported by the file system - we stop trying.
+    allocated_size_ = std::numeric_limits<uint64_t>::max();
+    return absl::OkStatus();
+  }
+  allocated_size_ = size;
+#endif  // __linux__ && FALLOC_FL_KEEP_SIZE
+  return absl::OkStatus();
+}
+
+absl::Status BufferedFileWriter::Flush() {
+  absl::MutexLock l(&mutex_);
+  RET_CHECK(file_ != nullptr) << "Flushing closed file: `" << filename_
+                              << "`";
+  return WriteBuffer();
+}
+
+absl::Status BufferedFileWriter::Sync() {
+  uint64_t target;
+  File* file;
+  {
+    absl::MutexLock l(&mutex_);
+    RET_CHECK(file_ != nullptr)
+        << "Syncing closed file: `" << filename_ << "`";
+    target = buffer_offset_ + buffer_used_;
+    if (synced_size_.load() >= target) {
+      return absl::OkStatus();
+    }
+    RETURN_IF_ERROR(WriteBuffer());
+    file = file_.get();
+  }
+  absl::MutexLock l(&sync_mutex_);
+  if (synced_size_.load() >= target) {
+    // Synced by someone else while we were waiting.
+    return absl::OkStatus();
+  }
+  // Covers all the data written up to now, including by other threads.
+  const uint64_t written = written_size_.load();
+  RETURN_IF_ERROR(file->Flush());
+  num_syncs_.fetch_add(1);
+  synced_size_.store(std::max(synced_size_.load(), written));
+  return absl::OkStatus();
+}
+
+absl::Status BufferedFileWriter::Close() {
+  absl::MutexLock l(&mutex_);
+  if (file_ == nullptr) {
+    return absl::OkStatus();
+  }
+  absl::Status status = WriteBuffer();
+  if (status.ok() && params_.direct_io &&
+      ::ftruncate(file_->fd(), buffer_offset_ + buffer_used_) < 0) {
+    // Removes the padding of the last block.
+    status = error::ErrnoToStatus(error::Errno())
+             << "Truncating file `" << filename_ << "` to its size.";
+  }
+  status.Update(file_->Close());
+  file_.reset();
+  return status;
+}
+
+}  // namespace io
+}  // namespace whisper
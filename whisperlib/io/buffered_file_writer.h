@@ -0,0 +1,147 @@
+#ifndef WHISPERLIB_IO_BUFFERED_FILE_WRITER_H_
+#define WHISPERLIB_IO_BUFFERED_FILE_WRITER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/cord.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "whisperlib/io/file.h"
+
+namespace whisper {
+namespace io {
+
+// Appends data to a file (e.g. the records of a journal) through a large
+// buffer, so small appends do not end up in a system call each.
+//
+// Sync() makes the appended data durable, w/ group commit: the concurrent
+// Sync() calls from multiple threads are coalesced, so a single
+// ::fdatasync covers all the data appended before it started - while the
+// sync is in progress, the other threads can keep appending.
+//
+// Optionally the file can be opened w/ O_DIRECT (bypassing the page
+// cache), in which case all writes are done in blocks aligned to
+// kDirectIoAlignment, and the space for the file can be pre-allocated in
+// large chunks (::fallocate), to reduce the metadata updates on sync.
+//
+// All methods are thread safe (but see Close()).
+class BufferedFileWriter {
+ public:
+  // Alignment of the buffer, file offsets, and sizes for direct I/O.
+  static constexpr size_t kDirectIoAlignment = 4096;
+
+  struct Params {
+    // Size of the buffer - it is written to the file when full.
+    // Rounded up to kDirectIoAlignment.
+    size_t buffer_size = 1 << 20;
+    // Truncates the file upon opening - else we append to it.
+    bool truncate = false;
+    // Opens the file w/ O_DIRECT (Linux) / F_NOCACHE (macOS).
+    // Not supported by all file systems (e.g. tmpfs).
+    bool direct_io = false;
+    // If non-zero, the file space is allocated in chunks of this size
+    // ahead of the writes (Linux). The file size is not changed by this.
+    uint64_t preallocate_size = 0;
+
+    Params& set_buffer_size(size_t value) {
+      buffer_size = value;
+      return *this;
+    }
+    Params& set_truncate(bool value) {
+      truncate = value;
+      return *this;
+    }
+    Params& set_direct_io(bool value) {
+      direct_io = value;
+      return *this;
+    }
+    Params& set_preallocate_size(uint64_t value) {
+      preallocate_size = value;
+      return *this;
+    }
+  };
+
+  // Opens (or creates) the file for appending.
+  static absl::StatusOr<std::unique_ptr<BufferedFileWriter>> Open(
+      absl::string_view filename, Params params);
+  // Closes the file - w/o syncing it.
+  ~BufferedFileWriter();
+
+  // Appends data to the file. Data larger than the buffer is written
+  // directly (unless w/ direct_io).
+  absl::Status Append(absl::string_view data);
+  absl::Status Append(const absl::Cord& data);
+  // Writes the buffered data to the file - w/o syncing it.
+  absl::Status Flush();
+  // Writes the buffered data to the file and flushes it to the disk.
+  // Returns when all data appended before the call is durable.
+  absl::Status Sync();
+  // Writes the buffered data and closes the file - w/o syncing it.
+  // Should not be called concurrently w/ the other operations.
+  absl::Status Close();
+
+  const std::string& filename() const { return filename_; }
+  // Size of the file, including the appended data.
+  uint64_t size() const;
+  // Size of the file known to be durable.
+  uint64_t synced_size() const { return synced_size_.load(); }
+  // Number of write system calls.
+  size_t num_writes() const { return num_writes_.load(); }
+  // Number of file syncs.
+  size_t num_syncs() const { return num_syncs_.load(); }
+
+ private:
+  BufferedFileWriter(std::string filename, Params params);
+
+  absl::Status Initialize();
+  // Writes the data at the end of the file, bypassing the buffer - which
+  // must be empty.
+  absl::Status AppendDirectly(absl::string_view data)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  absl::Status AppendDirectly(const absl::Cord& data)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  // Writes the buffered data to the file. For direct I/O, the last partial
+  // block is padded w/ zeros for writing, and kept in the buffer.
+  absl::Status WriteBuffer() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  // Pre-allocates file space for writing up to end.
+  absl::Status Preallocate(uint64_t end) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const std::string filename_;
+  const Params params_;
+  const size_t buffer_size_;
+
+  mutable absl::Mutex mutex_;
+  std::unique_ptr<File> file_ ABSL_GUARDED_BY(mutex_);
+  // Aligned to kDirectIoAlignment.
+  char* buffer_ ABSL_GUARDED_BY(mutex_) = nullptr;
+  // Number of bytes used in buffer_.
+  size_t buffer_used_ ABSL_GUARDED_BY(mutex_) = 0;
+  // Offset in the file of the start of buffer_.
+  uint64_t buffer_offset_ ABSL_GUARDED_BY(mutex_) = 0;
+  // End of the pre-allocated file space.
+  uint64_t allocated_size_ ABSL_GUARDED_BY(mutex_) = 0;
+  // Size of the data written to the file.
+  std::atomic<uint64_t> written_size_ = ATOMIC_VAR_INIT(0);
+
+  // Serializes the syncs - the ones waiting here can find their data
+  // already synced by the one before.
+  absl::Mutex sync_mutex_;
+  std::atomic<uint64_t> synced_size_ = ATOMIC_VAR_INIT(0);
+
+  std::atomic<size_t> num_writes_ = ATOMIC_VAR_INIT(0);
+  std::atomic<size_t> num_syncs_ = ATOMIC_VAR_INIT(0);
+
+  BufferedFileWriter(const BufferedFileWriter&) = delete;
+  BufferedFileWriter& operator=(const BufferedFileWriter&) = delete;
+};
+
+}  // namespace io
+}  // namespace whisper
+
+#endif  // WHISPERLIB_IO_BUFFERED_FILE_WRITER_H_
@@ -0,0 +1,146 @@
+#include "whisperlib/io/buffered_file_writer.h"
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/barrier.h"
+#include "gtest/gtest.h"
+#include "whisperlib/io/file.h"
+#include "whisperlib/io/path.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace io {
+
+TEST(BufferedFileWriter, Append) {
+  const std::string filename =
+      path::Join(testing::TempDir(), "buffered_file_writer_append");
+  ASSERT_OK_AND_ASSIGN(
+      auto writer,
+      BufferedFileWriter::Open(filename, BufferedFileWriter::Params()
+                                             .set_buffer_size(8192)
+                                             .set_truncate(true)
+                                             .set_preallocate_size(1 << 16)));
+  std::string expected;
+  for (int i = 0; i < 1000; ++i) {
+    const std::string record = absl::StrCat("record ", i, "\n");
+    ASSERT_OK(writer->Append(record));
+    expected.append(record);
+  }
+  EXPECT_EQ(writer->size(), expected.size());
+  // Fewer writes than appends.
+  EXPECT_LT(writer->num_writes(), 5);
+  // Large cords are written directly.
+  absl::Cord cord(std::string(5000, 'a'));
+  cord.Append(std::string(5000, 'b'));
+  ASSERT_OK(writer->Append(cord));
+  expected.append(std::string(cord));
+  ASSERT_OK(writer->Sync());
+  EXPECT_EQ(writer->synced_size(), expected.size());
+  EXPECT_EQ(writer->num_syncs(), 1);
+  // Nothing new to sync.
+  ASSERT_OK(writer->Sync());
+  EXPECT_EQ(writer->num_syncs(), 1);
+  ASSERT_OK_AND_ASSIGN(std::string content, File::ReadAsString(filename));
+  EXPECT_EQ(content, expected);
+  ASSERT_OK(writer->Append("tail"));
+  ASSERT_OK(writer->Close());
+  EXPECT_FALSE(writer->Append("more").ok());
+
+  // Appends to the existing file.
+  ASSERT_OK_AND_ASSIGN(writer, BufferedFileWriter::Open(filename, {}));
+  EXPECT_EQ(writer->size(), expected.size() + 4);
+  ASSERT_OK(writer->Append("!"));
+  writer.reset();
+  ASSERT_OK_AND_ASSIGN(content, File::ReadAsString(filename));
+  EXPECT_EQ(content, expected + "tail!");
+}
+
+TEST(BufferedFileWriter, GroupCommit) {
+  const std::string filename =
+      path::Join(testing::TempDir(), "buffered_file_writer_group_commit");
+  ASSERT_OK_AND_ASSIGN(
+      auto writer,
+      BufferedFileWriter::Open(
+          filename, BufferedFileWriter::Params().set_truncate(true)));
+  constexpr int kNumThreads = 8;
+  constexpr int kNumRecords = 50;
+  // In each round all threads append a record, then all sync: the first
+  // sync covers all the records of the round, so the others are coalesced.
+  // The second barrier keeps the next round appends out of this round.
+  std::vector<std::unique_ptr<absl::Barrier>> barriers;
+  for (int j = 0; j < 2 * kNumRecords; ++j) {
+    barriers.emplace_back(absl::make_unique<absl::Barrier>(kNumThreads));
+  }
+  std::vector<std::thread> threads;
+  std::vector<int> failures(kNumThreads, 0);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([i, &writer, &barriers, &failures]() {
+      for (int j = 0; j < kNumRecords; ++j) {
+        if (!writer->Append(std::string(100, 'a' + i)).ok()) {
+          ++failures[i];
+        }
+        barriers[2 * j]->Block();
+        if (!writer->Sync().ok()) {
+          ++failures[i];
+        }
+        barriers[2 * j + 1]->Block();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (int failure : failures) {
+    EXPECT_EQ(failure, 0);
+  }
+  EXPECT_EQ(writer->synced_size(), kNumThreads * kNumRecords * 100);
+  EXPECT_LT(writer->num_syncs(), kNumThreads * kNumRecords);
+  EXPECT_EQ(writer->num_syncs(), kNumRecords);
+  ASSERT_OK(writer->Close());
+  ASSERT_OK_AND_ASSIGN(std::string content, File::ReadAsString(filename));
+  EXPECT_EQ(content.size(), kNumThreads * kNumRecords * 100);
+}
+
+TEST(BufferedFileWriter, DirectIo) {
+  const std::string filename =
+      path::Join(testing::TempDir(), "buffered_file_writer_direct");
+  auto result = BufferedFileWriter::Open(
+      filename, BufferedFileWriter::Params()
+                    .set_buffer_size(3 * BufferedFileWriter::kDirectIoAlignment)
+                    .set_truncate(true)
+                    .set_direct_io(true));
+  if (!result.ok()) {
+    GTEST_SKIP() << "Direct I/O not supported: " << result.status();
+  }
+  auto writer = std::move(result).value();
+  std::string expected;
+  for (int i = 0; i < 2000; ++i) {
+    const std::string record = absl::StrCat("record ", i, "\n");
+    ASSERT_OK(writer->Append(record));
+    expected.append(record);
+    if (i % 500 == 0) {
+      ASSERT_OK(writer->Sync());
+    }
+  }
+  ASSERT_OK(writer->Close());
+  ASSERT_OK_AND_ASSIGN(std::string content,
+                       File::ReadAsString(filename, 1 << 20));
+  EXPECT_EQ(content, expected);
+
+  // Continues from the last partial block.
+  ASSERT_OK_AND_ASSIGN(
+      writer, BufferedFileWriter::Open(
+                  filename, BufferedFileWriter::Params().set_direct_io(true)));
+  ASSERT_OK(writer->Append("end"));
+  ASSERT_OK(writer->Close());
+  ASSERT_OK_AND_ASSIGN(content, File::ReadAsString(filename, 1 << 20));
+  EXPECT_EQ(content, expected + "end");
+}
+
+}  // namespace io
+}  // namespace whisper
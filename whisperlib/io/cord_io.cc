@@ -1,5 +1,9 @@
 #include "whisperlib/io/cord_io.h"
 
+#include <cstring>
+
+#include "absl/log/check.h"
+
 namespace whisper {
 namespace io {
 
@@ -33,5 +37,60 @@ std::pair<std::vector<struct ::iovec>, size_t> CordIo::ToIovec(
   return std::make_pair(std::move(result), cb);
 }
 
+CordIo::IovecBuilder::IovecBuilder(const absl::Cord& cord, size_t size)
+    : it_(cord.chunk_begin()),
+      end_it_(cord.chunk_end()),
+      to_fill_(SizeToWrite(cord, size)) {
+  Fill();
+}
+
+void CordIo::IovecBuilder::PrepareMsghdr(struct ::msghdr* msg) const {
+  memset(msg, 0, sizeof(*msg));
+  msg->msg_iov = const_cast<struct ::iovec*>(iovecs());
+  msg->msg_iovlen = count();
+}
+
+void CordIo::IovecBuilder::Consume(size_t size) {
+  CHECK_LE(size, batch_size_);
+  batch_size_ -= size;
+  while (size > 0) {
+    struct ::iovec* const v = &iovecs_[begin_];
+    if (size < v->iov_len) {
+      // Partially written chunk - we continue from inside of it.
+      v->iov_base = reinterpret_cast<char*>(v->iov_base) + size;
+      v->iov_len -= size;
+      break;
+    }
+    size -= v->iov_len;
+    ++begin_;
+  }
+  if (batch_size_ == 0) {
+    Fill();
+  }
+}
+
+void CordIo::IovecBuilder::Fill() {
+  begin_ = 0;
+  end_ = 0;
+  while (to_fill_ > 0 && end_ < kMaxIovecs && it_ != end_it_) {
+    absl::string_view chunk = *it_;
+    const bool partial_chunk = chunk.size() > to_fill_;
+    if (partial_chunk) {
+      chunk = chunk.substr(0, to_fill_);
+    }
+    if (!chunk.empty()) {
+      struct ::iovec* const v = &iovecs_[end_++];
+      v->iov_base =
+          const_cast<void*>(reinterpret_cast<const void*>(chunk.data()));
+      v->iov_len = chunk.size();
+      batch_size_ += chunk.size();
+      to_fill_ -= chunk.size();
+    }
+    if (!partial_chunk) {
+      ++it_;
+    }
+  }
+}
+
 }  // namespace io
 }  // namespace whisper
@@ -1,8 +1,11 @@
 #ifndef WHISPERLIB_IO_CORD_IO_H_
 #define WHISPERLIB_IO_CORD_IO_H_
 
+#include <limits.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
 
+#include <algorithm>
 #include <utility>
 #include <vector>
 
@@ -24,8 +27,63 @@ class CordIo {
   // Returns the chunks in the cord, up to the provided size, as a vector
   // of iovec structures to be used for Write operations.
   // Returns the prepare iovec structures and the size prepared.
+  // Note: prefer the IovecBuilder below, which does not allocate, and
+  // respects IOV_MAX.
   static std::pair<std::vector<struct ::iovec>, size_t> ToIovec(
       const absl::Cord& cord, size_t size);
+
+  // Prepares, in batches of at most kMaxIovecs, the iovec structures for
+  // writing the chunks of a cord, up to a size. The structures are kept
+  // inline, so no heap allocation happens. The cord must not change while
+  // the builder is in use. E.g.
+  //
+  //   CordIo::IovecBuilder builder(cord, size);
+  //   while (!builder.done()) {
+  //     const ssize_t cb = ::writev(fd, builder.iovecs(), builder.count());
+  //     ... check cb for errors ...
+  //     builder.Consume(cb);
+  //   }
+  class IovecBuilder {
+   public:
+#ifdef IOV_MAX
+    static constexpr size_t kMaxIovecs = std::min<size_t>(IOV_MAX, 1024);
+#else
+    static constexpr size_t kMaxIovecs = 16;  // the POSIX minimum
+#endif  // IOV_MAX
+
+    IovecBuilder(const absl::Cord& cord, size_t size);
+    IovecBuilder(const IovecBuilder&) = delete;
+    IovecBuilder& operator=(const IovecBuilder&) = delete;
+
+    // The structures for the next batch of data to write.
+    const struct ::iovec* iovecs() const { return &iovecs_[begin_]; }
+    int count() const { return end_ - begin_; }
+    // Number of bytes in the current batch.
+    size_t batch_size() const { return batch_size_; }
+    // Number of bytes still to write, including the current batch.
+    size_t remaining() const { return batch_size_ + to_fill_; }
+    bool done() const { return remaining() == 0; }
+
+    // Points the provided message to the current batch, for ::sendmsg.
+    void PrepareMsghdr(struct ::msghdr* msg) const;
+
+    // Marks the first size bytes of the current batch as written (i.e. what
+    // writev returned), and prepares the next batch if this one is done.
+    void Consume(size_t size);
+
+   private:
+    // Prepares the next batch, from the chunks not consumed yet.
+    void Fill();
+
+    absl::Cord::ChunkIterator it_;
+    const absl::Cord::ChunkIterator end_it_;
+    // Bytes of the cord not yet in the iovecs_.
+    size_t to_fill_;
+    size_t batch_size_ = 0;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+    struct ::iovec iovecs_[kMaxIovecs];
+  };
 };
 
 }  // namespace io
@@ -0,0 +1,102 @@
+#include "whisperlib/io/cord_io.h"
+
+#include <string>
+
+#include "absl/strings/cord.h"
+#include "absl/strings/str_cat.h"
+#include "gtest/gtest.h"
+
+namespace whisper {
+namespace io {
+
+namespace {
+// A cord with num_chunks separate chunks, of chunk_size bytes each, that
+// point in the returned content. Note: small external chunks would be
+// copied in flat chunks by the cord.
+absl::Cord MakeChunkedCord(size_t num_chunks, size_t chunk_size,
+                           std::string* content) {
+  content->reserve(num_chunks * chunk_size);  // no reallocation below
+  absl::Cord cord;
+  for (size_t i = 0; i < num_chunks; ++i) {
+    content->append(chunk_size, 'a' + i % 26);
+    cord.Append(absl::MakeCordFromExternal(
+        absl::string_view(content->data() + i * chunk_size, chunk_size),
+        [](absl::string_view) {}));
+  }
+  return cord;
+}
+
+// Appends the data in the current batch of the builder.
+std::string BatchData(const CordIo::IovecBuilder& builder) {
+  std::string result;
+  for (int i = 0; i < builder.count(); ++i) {
+    result.append(reinterpret_cast<const char*>(builder.iovecs()[i].iov_base),
+                  builder.iovecs()[i].iov_len);
+  }
+  return result;
+}
+}  // namespace
+
+TEST(CordIo, IovecBuilderEmpty) {
+  absl::Cord cord;
+  CordIo::IovecBuilder builder(cord, 100);
+  EXPECT_TRUE(builder.done());
+  EXPECT_EQ(builder.count(), 0);
+  EXPECT_EQ(builder.remaining(), 0);
+}
+
+TEST(CordIo, IovecBuilderBatches) {
+  static constexpr size_t kNumChunks = 3 * CordIo::IovecBuilder::kMaxIovecs + 7;
+  std::string content;
+  const absl::Cord cord = MakeChunkedCord(kNumChunks, 1000, &content);
+  ASSERT_EQ(cord.size(), content.size());
+
+  CordIo::IovecBuilder builder(cord, cord.size());
+  EXPECT_EQ(builder.remaining(), cord.size());
+  std::string data;
+  size_t num_batches = 0;
+  while (!builder.done()) {
+    EXPECT_LE(size_t(builder.count()), CordIo::IovecBuilder::kMaxIovecs);
+    const std::string batch = BatchData(builder);
+    EXPECT_EQ(batch.size(), builder.batch_size());
+    data.append(batch);
+    builder.Consume(batch.size());
+    ++num_batches;
+  }
+  EXPECT_EQ(num_batches, 4);
+  EXPECT_EQ(data, content);
+}
+
+TEST(CordIo, IovecBuilderPartialConsume) {
+  std::string content;
+  const absl::Cord cord = MakeChunkedCord(100, 1001, &content);
+  // Limited size, which ends inside a chunk.
+  const size_t size = cord.size() - 50;
+  CordIo::IovecBuilder builder(cord, size);
+  EXPECT_EQ(builder.remaining(), size);
+  std::string data;
+  size_t step = 1;
+  while (!builder.done()) {
+    // Consume odd amounts, which split the chunks.
+    const std::string batch = BatchData(builder);
+    const size_t cb = std::min(step, batch.size());
+    data.append(batch.substr(0, cb));
+    builder.Consume(cb);
+    step += 97;
+  }
+  EXPECT_EQ(data, content.substr(0, size));
+}
+
+TEST(CordIo, IovecBuilderMsghdr) {
+  const absl::Cord cord(absl::StrCat(std::string(5000, 'x'), "y"));
+  CordIo::IovecBuilder builder(cord, 100);
+  struct ::msghdr msg;
+  builder.PrepareMsghdr(&msg);
+  EXPECT_EQ(msg.msg_iov, builder.iovecs());
+  EXPECT_EQ(msg.msg_iovlen, builder.count());
+  EXPECT_EQ(msg.msg_name, nullptr);
+  EXPECT_EQ(builder.batch_size(), 100);
+}
+
+}  // namespace io
+}  // namespace whisper
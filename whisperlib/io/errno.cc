@@ -1,5 +1,8 @@
 #include "whisperlib/io/errno.h"
 
+#include <array>
+
+#include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
 
@@ -241,37 +244,22 @@ absl::string_view ErrnoName(int error) {
   }
   return "";
 }
-}  // namespace
-
-std::string ErrnoToString(int error) {
-  char errmsg[512] = {
-      '\0',
-  };
-  return absl::StrCat(
-      "Errno: ", error, " [", ErrnoName(error), "] ",
-      ErrorBuffer(errmsg, strerror_r(error, errmsg, sizeof(errmsg))), " ");
-}
-
-bool IsUnavailableAndShouldRetry(int error) {
-  return error == EWOULDBLOCK || error == EAGAIN;
-}
 
-status::StatusWriter ErrnoToStatus(int error) {
-  const std::string error_str(ErrnoToString(error));
+absl::StatusCode ErrnoToCode(int error) {
   // Cover same values for this error in the switch.
   if (error == EWOULDBLOCK) {
     error = EAGAIN;
   }
 
-  switch (errno) {
+  switch (error) {
     case EAGAIN:         // Resource temporarily unavailable.
     case EADDRNOTAVAIL:  // Address not available.
-      return status::UnavailableErrorBuilder() << error_str;
+      return absl::StatusCode::kUnavailable;
     case ECANCELED:  // Operation canceled
-      return status::CancelledErrorBuilder() << error_str;
+      return absl::StatusCode::kCancelled;
     case EACCES:  // Permission denied.
     case EPERM:   // Operation not permitted.
-      return status::PermissionDeniedErrorBuilder() << error_str;
+      return absl::StatusCode::kPermissionDenied;
 #ifdef ECHRNG
     case ECHRNG:  // Channel number out of range.
 #endif            // ECHRNG
@@ -279,7 +267,7 @@ status::StatusWriter ErrnoToStatus(int error) {
 #ifdef ELNRANGE
     case ELNRANGE:  // Link number out of range.
 #endif
-      return status::OutOfRangeErrorBuilder() << error_str;
+      return absl::StatusCode::kOutOfRange;
 #ifdef EBADE
     case EBADE:  // Invalid exchange.
 #endif           // EBADE
@@ -310,15 +298,15 @@ status::StatusWriter ErrnoToStatus(int error) {
     case EFBIG:     // File too large.
     case ENOTSOCK:  // Not a socket.
     case ENXIO:     // No such device or address.
-      return status::InvalidArgumentErrorBuilder() << error_str;
+      return absl::StatusCode::kInvalidArgument;
     case ECONNABORTED:  // Connection aborted.
-      return status::AbortedErrorBuilder() << error_str;
+      return absl::StatusCode::kAborted;
     case EADDRINUSE:  // Address already in use.
     case EEXIST:      // File exists.
-      return status::AlreadyExistsErrorBuilder() << error_str;
+      return absl::StatusCode::kAlreadyExists;
     case ENOENT:  // No such file or directory.
     case ESRCH:   // No such process.
-      return status::NotFoundErrorBuilder() << error_str;
+      return absl::StatusCode::kNotFound;
     case ENFILE:  // Too many open files in system.
     case EDQUOT:  // Disk quota exceeded.
     case EMLINK:  // Too many links.
@@ -330,7 +318,7 @@ status::StatusWriter ErrnoToStatus(int error) {
 #endif
     case ENOLCK:  // No locks available.
     case ENOMEM:  // Not enough space/cannot allocate memory.
-      return status::ResourceExhaustedErrorBuilder() << error_str;
+      return absl::StatusCode::kResourceExhausted;
     case ESOCKTNOSUPPORT:  // Socket type not supported.
     case EAFNOSUPPORT:     // Address family not supported.
     case ENOPROTOOPT:      // Protocol not available.
@@ -338,11 +326,49 @@ status::StatusWriter ErrnoToStatus(int error) {
     case ENOTSUP:          // Operation not supported.
     case EPFNOSUPPORT:     // Protocol family not supported.
     case EPROTONOSUPPORT:  // Protocol not supported.
-      return status::UnimplementedErrorBuilder() << error_str;
+      return absl::StatusCode::kUnimplemented;
     default:
-      return status::InternalErrorBuilder() << error_str;
+      return absl::StatusCode::kInternal;
+  }
+}
+
+// Errno values below this have their status preallocated - covers all of
+// them on the usual systems.
+constexpr int kNumCachedErrno = 256;
+
+}  // namespace
+
+std::string ErrnoToString(int error) {
+  char errmsg[512] = {
+      '\0',
+  };
+  return absl::StrCat(
+      "Errno: ", error, " [", ErrnoName(error), "] ",
+      ErrorBuffer(errmsg, strerror_r(error, errmsg, sizeof(errmsg))), " ");
+}
+
+bool IsUnavailableAndShouldRetry(int error) {
+  return error == EWOULDBLOCK || error == EAGAIN;
+}
+
+absl::Status ErrnoStatus(int error) {
+  static const auto* const kStatuses = []() {
+    auto* statuses = new std::array<absl::Status, kNumCachedErrno>();
+    for (int i = 0; i < kNumCachedErrno; ++i) {
+      (*statuses)[i] = absl::Status(ErrnoToCode(i), ErrnoToString(i));
+    }
+    return statuses;
+  }();
+  if (ABSL_PREDICT_TRUE(error >= 0 && error < kNumCachedErrno)) {
+    return (*kStatuses)[error];
   }
+  return absl::Status(ErrnoToCode(error), ErrnoToString(error));
 }
+
+status::StatusWriter ErrnoToStatus(int error) {
+  return status::StatusWriter(ErrnoStatus(error));
+}
+
 int Errno() { return errno; }
 
 }  // namespace error
@@ -12,6 +12,12 @@ namespace error {
 // Returns the last system error encountered.
 int Errno();
 
+// Returns the status for the provided system error number, w/ its
+// description and no annotation. The statuses of the common error numbers
+// are preallocated, so this is cheap (a reference count increment) on the
+// hot error paths.
+absl::Status ErrnoStatus(int error);
+
 // Creates a status stream-like writer from the provided system error number.
 status::StatusWriter ErrnoToStatus(int error);
 
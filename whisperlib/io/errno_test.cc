@@ -0,0 +1,32 @@
+#include "whisperlib/io/errno.h"
+
+#include <cerrno>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "gtest/gtest.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace error {
+
+TEST(Errno, ErrnoToStatus) {
+  // The code follows the provided error, not the last system error.
+  errno = ENOENT;
+  EXPECT_RAISES(absl::Status(ErrnoToStatus(ECONNRESET)), Internal);
+  EXPECT_RAISES(absl::Status(ErrnoToStatus(EAGAIN)), Unavailable);
+  EXPECT_RAISES(absl::Status(ErrnoToStatus(EWOULDBLOCK)), Unavailable);
+  EXPECT_RAISES(absl::Status(ErrnoToStatus(EACCES)), PermissionDenied);
+  EXPECT_RAISES(absl::Status(ErrnoToStatus(EMFILE)), ResourceExhausted);
+  EXPECT_RAISES(absl::Status(ErrnoToStatus(errno)), NotFound);
+  EXPECT_EQ(ErrnoStatus(ECONNRESET).message(), ErrnoToString(ECONNRESET));
+  EXPECT_EQ(ErrnoStatus(100000).message(), ErrnoToString(100000));
+  EXPECT_RAISES_WITH_MESSAGE(
+      absl::Status(ErrnoToStatus(EPIPE) << "Writing: " << 3), Internal,
+      absl::StrCat("INTERNAL: ",
+                   absl::StripTrailingAsciiWhitespace(ErrnoToString(EPIPE)),
+                   "; Writing: 3"));
+}
+
+}  // namespace error
+}  // namespace whisper
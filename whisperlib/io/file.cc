@@ -17,6 +17,56 @@
 namespace whisper {
 namespace io {
 
+namespace {
+// Runs a positional vectored operation (::preadv / ::pwritev) until all
+// the buffers are transferred, or the operation returns zero (end of file).
+// Passes the buffers in batches of at most kMaxIovecs.
+template <typename Operation>
+absl::StatusOr<size_t> TransferVecAt(int fd, int64_t offset,
+                                     absl::Span<const struct ::iovec> iovecs,
+                                     Operation operation) {
+  constexpr size_t kMaxIovecs = CordIo::IovecBuilder::kMaxIovecs;
+  struct ::iovec batch[kMaxIovecs];
+  size_t transferred = 0;
+  size_t index = 0;
+  size_t skip = 0;  // already transferred from iovecs[index]
+  while (index < iovecs.size()) {
+    int count = 0;
+    for (size_t i = index; i < iovecs.size() && count < int(kMaxIovecs);
+         ++i) {
+      const size_t begin = (i == index ? skip : 0);
+      if (iovecs[i].iov_len > begin) {
+        batch[count].iov_base =
+            reinterpret_cast<char*>(iovecs[i].iov_base) + begin;
+        batch[count].iov_len = iovecs[i].iov_len - begin;
+        ++count;
+      }
+    }
+    if (count == 0) {
+      break;
+    }
+    ssize_t cb;
+    do {
+      cb = operation(fd, batch, count, offset + transferred);
+    } while (cb < 0 && errno == EINTR);
+    if (ABSL_PREDICT_FALSE(cb < 0)) {
+      return absl::Status(error::ErrnoToStatus(error::Errno()));
+    }
+    if (cb == 0) {
+      break;
+    }
+    transferred += cb;
+    size_t left = cb + skip;
+    while (index < iovecs.size() && left >= iovecs[index].iov_len) {
+      left -= iovecs[index].iov_len;
+      ++index;
+    }
+    skip = left;
+  }
+  return transferred;
+}
+}  // namespace
+
 absl::string_view File::AccessName(Access access) {
   switch (access) {
     case GENERIC_READ:
@@ -327,26 +377,125 @@ absl::StatusOr<size_t> File::WriteCord(const absl::Cord& cord,
 
 absl::StatusOr<size_t> File::WriteCordVec(const absl::Cord& cord,
                                           absl::optional<size_t> size) {
-  const size_t size_to_write = CordIo::SizeToWrite(cord, size);
-  auto io_vec_pair = CordIo::ToIovec(cord, size_to_write);
-  const ssize_t cb = ::writev(fd_, &io_vec_pair.first[0], io_vec_pair.second);
-  if (ABSL_PREDICT_FALSE(cb < 0)) {
-    absl::Status status = error::ErrnoToStatus(error::Errno())
-                          << "::writeev() failed for file: `" << filename_
-                          << "` with: " << io_vec_pair.first.size()
-                          << " chunks and: " << io_vec_pair.second << " bytes.";
+  RET_CHECK(is_open());
+  CordIo::IovecBuilder builder(cord, CordIo::SizeToWrite(cord, size));
+  size_t written = 0;
+  while (!builder.done()) {
+    const ssize_t cb = ::writev(fd_, builder.iovecs(), builder.count());
+    if (ABSL_PREDICT_FALSE(cb < 0)) {
+      absl::Status status = error::ErrnoToStatus(error::Errno())
+                            << "::writev() failed for file: `" << filename_
+                            << "` with: " << builder.count()
+                            << " chunks and: " << builder.batch_size()
+                            << " bytes.";
+      // don't know where the file pointer ended-up
+      UpdatePosition().IgnoreError();
+      return status;
+    }
+    position_ += cb;
+    size_ = std::max(size_, position_);
+    written += cb;
+    builder.Consume(cb);
   }
-  position_ += cb;
-  size_ = std::max(size_, position_);
-  if (ABSL_PREDICT_FALSE(size_t(cb) != io_vec_pair.second)) {
-    return status::InternalErrorBuilder()
-           << "::writeev() file operation failed. Expected a write of "
-           << io_vec_pair.second << " bytes, but: " << cb
-           << " bytes were written "
-              "to file `"
-           << filename_ << "`";
+  return written;
+}
+
+absl::StatusOr<size_t> File::ReadAt(int64_t offset, void* buffer,
+                                    size_t size) const {
+  RET_CHECK(is_open());
+  size_t read = 0;
+  while (read < size) {
+    const ssize_t cb = ::pread(fd_, reinterpret_cast<char*>(buffer) + read,
+                               size - read, offset + read);
+    if (ABSL_PREDICT_FALSE(cb < 0)) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return error::ErrnoToStatus(error::Errno())
+             << "::pread() failed for file: `" << filename_
+             << "` at offset: " << offset + read;
+    }
+    if (cb == 0) {
+      break;
+    }
+    read += cb;
+  }
+  return read;
+}
+
+absl::StatusOr<size_t> File::ReadToCordAt(int64_t offset, absl::Cord* cord,
+                                          size_t size) const {
+  RET_CHECK(is_open());
+  char* buffer = new char[size];
+  base::CallOnReturn clear_buffer([buffer]() { delete[] buffer; });
+  ASSIGN_OR_RETURN(size_t cb, ReadAt(offset, buffer, size));
+  cord->Append(absl::MakeCordFromExternal(absl::string_view(buffer, cb),
+                                          clear_buffer.reset()));
+  return cb;
+}
+
+absl::StatusOr<size_t> File::ReadVecAt(
+    int64_t offset, absl::Span<const struct ::iovec> iovecs) const {
+  RET_CHECK(is_open());
+  ASSIGN_OR_RETURN(size_t cb, TransferVecAt(fd_, offset, iovecs, ::preadv),
+                   _ << "::preadv() failed for file: `" << filename_
+                     << "` from offset: " << offset);
+  return cb;
+}
+
+absl::StatusOr<size_t> File::WriteAt(int64_t offset, const void* buffer,
+                                     size_t size) {
+  RET_CHECK(is_open());
+  size_t written = 0;
+  while (written < size) {
+    const ssize_t cb =
+        ::pwrite(fd_, reinterpret_cast<const char*>(buffer) + written,
+                 size - written, offset + written);
+    if (ABSL_PREDICT_FALSE(cb < 0)) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return error::ErrnoToStatus(error::Errno())
+             << "::pwrite() failed for file: `" << filename_
+             << "` at offset: " << offset + written;
+    }
+    written += cb;
+  }
+  return written;
+}
+
+absl::StatusOr<size_t> File::WriteVecAt(
+    int64_t offset, absl::Span<const struct ::iovec> iovecs) {
+  RET_CHECK(is_open());
+  ASSIGN_OR_RETURN(size_t cb, TransferVecAt(fd_, offset, iovecs, ::pwritev),
+                   _ << "::pwritev() failed for file: `" << filename_
+                     << "` from offset: " << offset);
+  return cb;
+}
+
+absl::StatusOr<size_t> File::WriteCordAt(int64_t offset,
+                                         const absl::Cord& cord,
+                                         absl::optional<size_t> size) {
+  RET_CHECK(is_open());
+  CordIo::IovecBuilder builder(cord, CordIo::SizeToWrite(cord, size));
+  size_t written = 0;
+  while (!builder.done()) {
+    const ssize_t cb = ::pwritev(fd_, builder.iovecs(), builder.count(),
+                                 offset + written);
+    if (ABSL_PREDICT_FALSE(cb < 0)) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return error::ErrnoToStatus(error::Errno())
+             << "::pwritev() failed for file: `" << filename_
+             << "` with: " << builder.count()
+             << " chunks and: " << builder.batch_size()
+             << " bytes at offset: " << offset + written;
+    }
+    written += cb;
+    builder.Consume(cb);
   }
-  return io_vec_pair.second;
+  return written;
 }
 
 absl::Status File::Flush() {
@@ -1,6 +1,8 @@
 #ifndef WHISPERLIB_IO_FILE_H_
 #define WHISPERLIB_IO_FILE_H_
 
+#include <sys/uio.h>
+
 #include <memory>
 #include <string>
 
@@ -9,6 +11,7 @@
 #include "absl/strings/cord.h"
 #include "absl/strings/string_view.h"
 #include "absl/types/optional.h"
+#include "absl/types/span.h"
 
 static_assert(sizeof(off_t) == sizeof(int64_t));
 
@@ -145,6 +148,40 @@ class File {
   absl::StatusOr<size_t> WriteCordVec(const absl::Cord& cord,
                                       absl::optional<size_t> size = {});
 
+  // Positional operations: these read / write at the provided offset,
+  // w/o using or changing the current file position - so they can be
+  // called concurrently from multiple threads on the same open file
+  // (e.g. for serving random access reads), and need no ::lseek.
+  // NOTE: they do not update the cached Size() either.
+
+  // Reads at most "size" bytes of data from the given offset to buffer.
+  // Returns the number of bytes read - less than size only at end of file.
+  absl::StatusOr<size_t> ReadAt(int64_t offset, void* buffer,
+                                size_t size) const;
+  // Reads at most size bytes from the given offset, and appends them to
+  // the provided cord.
+  absl::StatusOr<size_t> ReadToCordAt(int64_t offset, absl::Cord* cord,
+                                      size_t size) const;
+  // Reads from the given offset in the scatter list of buffers, filling
+  // them in order (using ::preadv).
+  // Returns the number of bytes read - less than the total size of the
+  // buffers only at end of file.
+  absl::StatusOr<size_t> ReadVecAt(
+      int64_t offset, absl::Span<const struct ::iovec> iovecs) const;
+
+  // Writes "size" bytes of data from buffer at the given offset.
+  // Returns the number of bytes written.
+  absl::StatusOr<size_t> WriteAt(int64_t offset, const void* buffer,
+                                 size_t size);
+  // Writes the buffers of the gather list, in order, at the given offset
+  // (using ::pwritev). Returns the number of bytes written.
+  absl::StatusOr<size_t> WriteVecAt(int64_t offset,
+                                    absl::Span<const struct ::iovec> iovecs);
+  // Writes the cord (at most size bytes of it) at the given offset, using
+  // vectorized operations, as WriteCordVec.
+  absl::StatusOr<size_t> WriteCordAt(int64_t offset, const absl::Cord& cord,
+                                     absl::optional<size_t> size = {});
+
   // Forces a disk flush
   absl::Status Flush();
 
@@ -0,0 +1,103 @@
+#include "whisperlib/io/file.h"
+
+#include <sys/uio.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "whisperlib/io/path.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace io {
+
+TEST(File, ReadAt) {
+  const std::string filename = path::Join(testing::TempDir(), "file_read_at");
+  std::string content;
+  for (int i = 0; i < 10000; ++i) {
+    content.append(std::to_string(i));
+  }
+  ASSERT_OK(File::WriteFromString(filename, content).status());
+  ASSERT_OK_AND_ASSIGN(auto file, File::Open(filename));
+  char buffer[100];
+  ASSERT_OK_AND_ASSIGN(size_t cb, file->ReadAt(1000, buffer, sizeof(buffer)));
+  EXPECT_EQ(std::string(buffer, cb), content.substr(1000, sizeof(buffer)));
+  // The position is not changed.
+  EXPECT_EQ(file->Position(), 0);
+  ASSERT_OK_AND_ASSIGN(cb, file->ReadAt(content.size() - 10, buffer,
+                                        sizeof(buffer)));
+  EXPECT_EQ(std::string(buffer, cb), content.substr(content.size() - 10));
+  ASSERT_OK_AND_ASSIGN(cb, file->ReadAt(content.size() + 10, buffer,
+                                        sizeof(buffer)));
+  EXPECT_EQ(cb, 0);
+
+  absl::Cord cord;
+  ASSERT_OK_AND_ASSIGN(cb, file->ReadToCordAt(20, &cord, 30));
+  EXPECT_EQ(cb, 30);
+  EXPECT_EQ(std::string(cord), content.substr(20, 30));
+
+  char first[10];
+  char second[3000];
+  std::vector<struct ::iovec> iovecs = {{first, sizeof(first)},
+                                        {buffer, 0},
+                                        {second, sizeof(second)}};
+  ASSERT_OK_AND_ASSIGN(cb, file->ReadVecAt(500, iovecs));
+  EXPECT_EQ(cb, sizeof(first) + sizeof(second));
+  EXPECT_EQ(std::string(first, sizeof(first)), content.substr(500, 10));
+  EXPECT_EQ(std::string(second, sizeof(second)),
+            content.substr(510, sizeof(second)));
+
+  // Concurrent readers of the same file.
+  std::vector<std::thread> threads;
+  std::vector<int> matches(8, 0);
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([i, &file, &content, &matches]() {
+      bool match = true;
+      for (size_t offset = i; offset + 64 < content.size(); offset += 97) {
+        char data[64];
+        auto result = file->ReadAt(offset, data, sizeof(data));
+        match = match && result.ok() &&
+                std::string(data, *result) == content.substr(offset, 64);
+      }
+      matches[i] = match;
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (int match : matches) {
+    EXPECT_TRUE(match);
+  }
+}
+
+TEST(File, WriteAt) {
+  const std::string filename = path::Join(testing::TempDir(), "file_write_at");
+  File file;
+  ASSERT_OK(file.Open(filename, File::GENERIC_READ_WRITE, File::CREATE_ALWAYS));
+  ASSERT_OK_AND_ASSIGN(size_t cb, file.WriteAt(5, "world", 5));
+  EXPECT_EQ(cb, 5);
+  ASSERT_OK_AND_ASSIGN(cb, file.WriteAt(0, "hello", 5));
+  EXPECT_EQ(cb, 5);
+  EXPECT_EQ(file.Position(), 0);
+
+  char a[] = "abc";
+  char b[] = "def";
+  std::vector<struct ::iovec> iovecs = {{a, 3}, {b, 3}};
+  ASSERT_OK_AND_ASSIGN(cb, file.WriteVecAt(10, iovecs));
+  EXPECT_EQ(cb, 6);
+
+  absl::Cord cord("-x");
+  cord.Append(std::string(5000, 'y'));
+  ASSERT_OK_AND_ASSIGN(cb, file.WriteCordAt(16, cord, 100));
+  EXPECT_EQ(cb, 100);
+
+  char buffer[200];
+  ASSERT_OK_AND_ASSIGN(cb, file.ReadAt(0, buffer, sizeof(buffer)));
+  EXPECT_EQ(std::string(buffer, cb),
+            "helloworldabcdef-x" + std::string(98, 'y'));
+}
+
+}  // namespace io
+}  // namespace whisper
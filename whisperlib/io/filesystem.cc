@@ -1,14 +1,26 @@
 #include "whisperlib/io/filesystem.h"
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif  // __linux__
+
+#include <atomic>
+#include <memory>
 #include <utility>
 
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "whisperlib/base/call_on_return.h"
 #include "whisperlib/io/errno.h"
 #include "whisperlib/io/path.h"
 #include "whisperlib/status/status.h"
+#include "whisperlib/sync/thread_pool.h"
 
 namespace whisper {
 namespace io {
@@ -155,33 +167,32 @@ absl::Status RmDir(absl::string_view path) {
 }
 
 absl::Status RmFilesUnder(absl::string_view path, bool rm_dirs) {
-  int options = 0;
-  if (rm_dirs) {
-    options = LIST_DIRS | LIST_FILES | LIST_RECURSIVE;
-  } else {
-    options = LIST_FILES | LIST_RECURSIVE;
-  }
   if (!IsDir(path)) {
     return status::NotFoundErrorBuilder()
            << "RmFilesUnder directory `" << path << "` - cannot be found.";
   }
-  ASSIGN_OR_RETURN(std::vector<std::string> files, DirList(path, options),
-                   _ << "While trying to delete files under: `" << path << "`");
+  // Files are removed as we find them - only the directories are kept.
   absl::Status rm_status;
   std::vector<std::string> dirs;
-  for (const auto& file : files) {
-    std::string f(path::Join(path, absl::string_view(file)));
-    if (IsDir(f)) {
-      if (rm_dirs) {
-        dirs.emplace_back(std::move(f));
-      }
-    } else {
-      auto file_rm_status = RmFile(f);
-      if (!file_rm_status.ok()) {
-        status::UpdateOrAnnotate(rm_status, file_rm_status);
-      }
-    }
-  }
+  RETURN_IF_ERROR(
+      WalkDir(path,
+              DirWalkParams().set_list_attr(
+                  LIST_FILES | LIST_RECURSIVE | (rm_dirs ? LIST_DIRS : 0)),
+              [path, rm_dirs, &rm_status, &dirs](const DirEntry& entry) {
+                std::string f(path::Join(path, entry.path));
+                if (entry.type == DirEntry::Type::DIR) {
+                  if (rm_dirs) {
+                    dirs.emplace_back(std::move(f));
+                  }
+                } else {
+                  auto file_rm_status = RmFile(f);
+                  if (!file_rm_status.ok()) {
+                    status::UpdateOrAnnotate(rm_status, file_rm_status);
+                  }
+                }
+                return true;
+              }))
+      << "While trying to delete files under: `" << path << "`";
   // Reverse the dirs - so we remove the deep ones first :)
   std::reverse(dirs.begin(), dirs.end());
   for (const auto& dir : dirs) {
@@ -274,50 +285,281 @@ absl::Status Symlink(absl::string_view link_path,
 absl::StatusOr<std::vector<std::string>> DirList(absl::string_view dir,
                                                  uint32_t list_attr,
                                                  size_t max_depth) {
-  std::string dir_str(dir);
-  DIR* dirp = ::opendir(dir_str.c_str());
+  std::vector<std::string> out;
+  RETURN_IF_ERROR(WalkDir(dir,
+                          DirWalkParams()
+                              .set_list_attr(list_attr)
+                              .set_max_depth(max_depth),
+                          [&out](const DirEntry& entry) {
+                            out.push_back(entry.path);
+                            return true;
+                          }));
+  return out;
+}
 
-  if (dirp == nullptr) {
-    return error::ErrnoToStatus(errno)
-           << "::opendir failed for dir: `" << dir << "`";
+absl::string_view DirEntry::TypeName(Type type) {
+  switch (type) {
+    case Type::FILE:
+      return "FILE";
+    case Type::DIR:
+      return "DIR";
+    case Type::SYMLINK:
+      return "SYMLINK";
+    case Type::OTHER:
+      return "OTHER";
   }
-  std::vector<std::string> out;
+  return "UNKNOWN";
+}
+
+namespace {
+DirEntry::Type ModeToType(mode_t mode) {
+  if (S_ISREG(mode)) {
+    return DirEntry::Type::FILE;
+  }
+  if (S_ISDIR(mode)) {
+    return DirEntry::Type::DIR;
+  }
+  if (S_ISLNK(mode)) {
+    return DirEntry::Type::SYMLINK;
+  }
+  return DirEntry::Type::OTHER;
+}
+
+// Reads the entries of the directory opened at fd, calling
+// callback(name, d_type) for each, until it returns false.
+template <typename Callback>
+absl::Status ReadDirEntries(int fd, absl::string_view dir,
+                            Callback callback) {
+#if defined(__linux__) && defined(SYS_getdents64)
+  // The layout of the records returned by ::getdents64.
+  struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+  };
+  constexpr size_t kBufferSize = 32 << 10;
+  std::unique_ptr<char[]> buffer(new char[kBufferSize]);
   while (true) {
-    struct dirent* entry = ::readdir(dirp);
-    if (entry == nullptr) {
+    const long cb = ::syscall(SYS_getdents64, fd, buffer.get(), kBufferSize);
+    if (cb < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return error::ErrnoToStatus(error::Errno())
+             << "::getdents64 failed for dir: `" << dir << "`";
+    }
+    if (cb == 0) {
+      break;
+    }
+    for (long offset = 0; offset < cb;) {
+      const LinuxDirent64* const entry =
+          reinterpret_cast<const LinuxDirent64*>(buffer.get() + offset);
+      offset += entry->d_reclen;
+      if (!callback(absl::string_view(entry->d_name), entry->d_type)) {
+        return absl::OkStatus();
+      }
+    }
+  }
+  return absl::OkStatus();
+#else
+  // ::fdopendir takes ownership of the fd - we keep ours.
+  const int dup_fd = ::dup(fd);
+  DIR* dirp = dup_fd < 0 ? nullptr : ::fdopendir(dup_fd);
+  if (dirp == nullptr) {
+    absl::Status status = error::ErrnoToStatus(error::Errno())
+                          << "::fdopendir failed for dir: `" << dir << "`";
+    if (dup_fd >= 0) {
+      ::close(dup_fd);
+    }
+    return status;
+  }
+  base::CallOnReturn close_dir([dirp]() { ::closedir(dirp); });
+  while (struct dirent* entry = ::readdir(dirp)) {
+    if (!callback(absl::string_view(entry->d_name), entry->d_type)) {
       break;
     }
-    absl::string_view basename(entry->d_name);
-    // Skip dots - self / parent directories:
-    if (basename.empty() || basename == "." || basename == "..") {
-      continue;
+  }
+  return absl::OkStatus();
+#endif  // __linux__ && SYS_getdents64
+}
+
+// Walks a directory tree - possibly in parallel in a pool.
+class DirWalker {
+ public:
+  DirWalker(absl::string_view root, const DirWalkParams& params,
+            DirVisitor visitor)
+      : root_(root), params_(params), visitor_(visitor) {}
+
+  // Walks the directory at relative path (opened at fd, which is closed
+  // here), whose entries are at the provided depth.
+  void Walk(int fd, const std::string& path, size_t depth) {
+    base::CallOnReturn close_fd([fd]() { ::close(fd); });
+    const bool recursive =
+        (params_.list_attr & LIST_RECURSIVE) && depth < params_.max_depth;
+    const absl::Status status = ReadDirEntries(
+        fd, path, [this, fd, &path, depth, recursive](
+                      absl::string_view name, unsigned char d_type) {
+          if (stopped_.load(std::memory_order_relaxed)) {
+            return false;
+          }
+          // Skip dots - self / parent directories:
+          if (name.empty() || name == "." || name == "..") {
+            return true;
+          }
+          DirEntry entry;
+          entry.path = path.empty() ? std::string(name)
+                                    : path::Join(path, name);
+          entry.depth = depth;
+          if (!SetType(fd, name, d_type, &entry)) {
+            // We just skip this error, as DirList did.
+            return true;
+          }
+          if (Listed(entry.type) && !visitor_(entry)) {
+            stopped_.store(true);
+            return false;
+          }
+          if (recursive && entry.type == DirEntry::Type::DIR) {
+            WalkSubdir(fd, name, std::move(entry.path), depth + 1);
+          }
+          return true;
+        });
+    if (!status.ok()) {
+      UpdateStatus(status);
     }
+  }
+
+  // Waits for the walks running in the pool, and returns the first error.
+  absl::Status Wait() {
+    DonePending();
+    done_.WaitForNotification();
+    absl::MutexLock l(&mutex_);
+    return status_;
+  }
 
-    struct stat st;
-    const std::string abs_path = path::Join(dir, basename);
-    // ::lstat does not follow symlinks. It returns stats for the link itself.
-    if (0 != ::lstat(abs_path.c_str(), &st)) {
-      // We just skip this error for now.
-      continue;
+ private:
+  // Sets the type (and the size, if requested) of the entry.
+  bool SetType(int fd, absl::string_view name, unsigned char d_type,
+               DirEntry* entry) const {
+    switch (d_type) {
+#ifdef DT_REG
+      case DT_REG:
+        entry->type = DirEntry::Type::FILE;
+        break;
+      case DT_DIR:
+        entry->type = DirEntry::Type::DIR;
+        break;
+      case DT_LNK:
+        entry->type = DirEntry::Type::SYMLINK;
+        break;
+      case DT_UNKNOWN:
+        break;
+#endif  // DT_REG
+      default:
+        entry->type = DirEntry::Type::OTHER;
+        return true;
+    }
+    const bool need_size =
+        params_.with_size && entry->type == DirEntry::Type::FILE;
+#ifdef DT_UNKNOWN
+    const bool need_type = d_type == DT_UNKNOWN;
+#else
+    const bool need_type = true;
+#endif  // DT_UNKNOWN
+    if (need_size || need_type) {
+      const std::string name_str(name);
+      struct stat st;
+      // Does not follow symlinks.
+      if (0 != ::fstatat(fd, name_str.c_str(), &st, AT_SYMLINK_NOFOLLOW)) {
+        return false;
+      }
+      entry->type = ModeToType(st.st_mode);
+      if (params_.with_size && entry->type == DirEntry::Type::FILE) {
+        entry->size = st.st_size;
+      }
     }
-    // maybe accumulate entry
-    if ((list_attr & LIST_EVERYTHING) == LIST_EVERYTHING ||
-        ((list_attr & LIST_FILES) &&
-         (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))) ||
-        ((list_attr & LIST_DIRS) && S_ISDIR(st.st_mode))) {
-      out.push_back(std::string(basename));
+    return true;
+  }
+
+  bool Listed(DirEntry::Type type) const {
+    return (params_.list_attr & LIST_EVERYTHING) == LIST_EVERYTHING ||
+           ((params_.list_attr & LIST_FILES) &&
+            (type == DirEntry::Type::FILE ||
+             type == DirEntry::Type::SYMLINK)) ||
+           ((params_.list_attr & LIST_DIRS) && type == DirEntry::Type::DIR);
+  }
+
+  void WalkSubdir(int parent_fd, absl::string_view name, std::string path,
+                  size_t depth) {
+    if (params_.pool == nullptr) {
+      const std::string name_str(name);
+      const int fd =
+          ::openat(parent_fd, name_str.c_str(),
+                   O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (fd < 0) {
+        UpdateStatus(error::ErrnoToStatus(error::Errno())
+                     << "::openat failed for dir: `"
+                     << path::Join(root_, path) << "`");
+        return;
+      }
+      Walk(fd, path, depth);
+      return;
     }
-    // recursive listing
-    if (max_depth > 0 && (list_attr & LIST_RECURSIVE) && S_ISDIR(st.st_mode)) {
-      ASSIGN_OR_RETURN(std::vector<std::string> subitems,
-                       DirList(abs_path, list_attr, max_depth - 1));
-      for (absl::string_view subitem : subitems) {
-        out.emplace_back(path::Join(basename, subitem));
+    // The sub-directory is opened in the pool, so the queued walks do
+    // not hold open file descriptors.
+    num_pending_.fetch_add(1);
+    params_.pool->Submit([this, path = std::move(path), depth]() {
+      const std::string full_path = path::Join(root_, path);
+      const int fd = ::open(full_path.c_str(),
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (fd < 0) {
+        UpdateStatus(error::ErrnoToStatus(error::Errno())
+                     << "::open failed for dir: `" << full_path << "`");
+      } else if (!stopped_.load(std::memory_order_relaxed)) {
+        Walk(fd, path, depth);
+      } else {
+        ::close(fd);
       }
+      DonePending();
+    });
+  }
+
+  void DonePending() {
+    if (num_pending_.fetch_sub(1) == 1) {
+      done_.Notify();
     }
   }
-  ::closedir(dirp);
-  return out;
+
+  void UpdateStatus(const absl::Status& status) {
+    stopped_.store(true);
+    absl::MutexLock l(&mutex_);
+    status_.Update(status);
+  }
+
+  const std::string root_;
+  const DirWalkParams& params_;
+  DirVisitor visitor_;
+  std::atomic_bool stopped_ = ATOMIC_VAR_INIT(false);
+  absl::Mutex mutex_;
+  absl::Status status_ ABSL_GUARDED_BY(mutex_);
+  // One for the initial walk, plus the walks queued in the pool.
+  std::atomic<size_t> num_pending_ = ATOMIC_VAR_INIT(1);
+  absl::Notification done_;
+};
+}  // namespace
+
+absl::Status WalkDir(absl::string_view dir, const DirWalkParams& params,
+                     DirVisitor visitor) {
+  const std::string dir_str(dir);
+  const int fd = ::open(dir_str.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::open failed for dir: `" << dir << "`";
+  }
+  DirWalker walker(dir, params, visitor);
+  walker.Walk(fd, "", 0);
+  return walker.Wait();
 }
 
 }  // namespace io
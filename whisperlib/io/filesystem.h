@@ -7,12 +7,17 @@
 #include <string>
 #include <vector>
 
+#include "absl/functional/function_ref.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/string_view.h"
 #include "absl/time/time.h"
 
 namespace whisper {
+namespace work {
+class ThreadPool;
+}  // namespace work
+
 namespace io {
 
 // Returns true if provided path exists, and is a directory.
@@ -89,6 +94,63 @@ absl::StatusOr<std::vector<std::string>> DirList(absl::string_view dir,
                                                  uint32_t list_attr,
                                                  size_t max_depth = 20);
 
+// An entry found while walking a directory with WalkDir.
+struct DirEntry {
+  enum class Type { FILE, DIR, SYMLINK, OTHER };
+  static absl::string_view TypeName(Type type);
+
+  // Path of the entry, relative to the walked directory.
+  std::string path;
+  Type type = Type::OTHER;
+  // Depth of the entry: 0 for the entries directly in the walked directory.
+  size_t depth = 0;
+  // Size of regular files, if requested by DirWalkParams::with_size,
+  // else -1.
+  int64_t size = -1;
+};
+
+struct DirWalkParams {
+  // What entries to pass to the visitor, and if to look into the
+  // sub-directories - a combination of DirListAttributes.
+  uint32_t list_attr = LIST_EVERYTHING | LIST_RECURSIVE;
+  // Maximum depth of the sub-directories to look into - as for DirList.
+  size_t max_depth = 20;
+  // Stats the regular files for their size - else no ::stat is done per
+  // entry (on file systems that return the entry types when listing).
+  bool with_size = false;
+  // If set, the sub-directories are walked in parallel in this pool.
+  // The visitor is then called concurrently, from the pool threads, and in
+  // no particular order. WalkDir must not be called from the pool threads.
+  work::ThreadPool* pool = nullptr;
+
+  DirWalkParams& set_list_attr(uint32_t value) {
+    list_attr = value;
+    return *this;
+  }
+  DirWalkParams& set_max_depth(size_t value) {
+    max_depth = value;
+    return *this;
+  }
+  DirWalkParams& set_with_size(bool value) {
+    with_size = value;
+    return *this;
+  }
+  DirWalkParams& set_pool(work::ThreadPool* value) {
+    pool = value;
+    return *this;
+  }
+};
+// Receives the entries found by WalkDir - returns false to stop the walk.
+using DirVisitor = absl::FunctionRef<bool(const DirEntry&)>;
+
+// Walks the directory tree under dir, streaming the entries to visitor as
+// they are read, w/o materializing the full list of paths.
+// Symlinks are not followed. Parents are visited before their children.
+// Uses ::openat relative to the parent directories, and the entry types
+// returned with the directory entries (::getdents64 on Linux).
+absl::Status WalkDir(absl::string_view dir, const DirWalkParams& params,
+                     DirVisitor visitor);
+
 }  // namespace io
 }  // namespace whisper
 
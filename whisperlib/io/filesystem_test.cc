@@ -2,7 +2,9 @@
 
 #include <algorithm>
 
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_replace.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "gtest/gtest.h"
@@ -10,6 +12,7 @@
 #include "whisperlib/io/path.h"
 #include "whisperlib/status/status.h"
 #include "whisperlib/status/testing.h"
+#include "whisperlib/sync/thread_pool.h"
 
 namespace whisper {
 namespace io {
@@ -155,6 +158,81 @@ TEST_F(FilesystemTest, FilesystemOps) {
                                      _p("d2/hh2"), _p("d2/hh3"), "d3"));
   }
 }
+TEST_F(FilesystemTest, WalkDir) {
+  std::string tmp_dir(path::Join(test_dir_, "WalkDir"));
+  ASSERT_OK(MkDir(tmp_dir));
+  ASSERT_OK(RmFilesUnder(tmp_dir, true));
+  std::vector<std::string> expected;
+  for (int i = 0; i < 10; ++i) {
+    const std::string dir = absl::StrCat("d", i);
+    ASSERT_OK(MkDir(path::Join(tmp_dir, dir)));
+    expected.push_back(dir);
+    for (int j = 0; j < 20; ++j) {
+      const std::string file = path::Join(dir, absl::StrCat("f", j));
+      ASSERT_OK(File::WriteFromString(path::Join(tmp_dir, file),
+                                      std::string(j, 'x'))
+                    .status());
+      expected.push_back(file);
+    }
+  }
+  ASSERT_OK(Symlink(path::Join(tmp_dir, "link"), path::Join(tmp_dir, "d0")));
+  expected.push_back("link");
+  std::sort(expected.begin(), expected.end());
+
+  std::vector<std::string> paths;
+  int64_t total_size = 0;
+  ASSERT_OK(WalkDir(tmp_dir, DirWalkParams().set_with_size(true),
+                    [&paths, &total_size](const DirEntry& entry) {
+                      paths.push_back(entry.path);
+                      if (entry.type == DirEntry::Type::FILE) {
+                        EXPECT_EQ(entry.depth, 1);
+                        total_size += entry.size;
+                      } else {
+                        EXPECT_EQ(entry.depth, 0);
+                        EXPECT_EQ(entry.size, -1);
+                      }
+                      return true;
+                    }));
+  std::sort(paths.begin(), paths.end());
+  EXPECT_EQ(paths, expected);
+  EXPECT_EQ(total_size, 10 * (19 * 20 / 2));
+
+  // Not looking into the sub-directories.
+  size_t num_entries = 0;
+  ASSERT_OK(WalkDir(tmp_dir, DirWalkParams().set_list_attr(LIST_EVERYTHING),
+                    [&num_entries](const DirEntry& entry) {
+                      ++num_entries;
+                      return true;
+                    }));
+  EXPECT_EQ(num_entries, 11);
+  // Stopping early.
+  num_entries = 0;
+  ASSERT_OK(WalkDir(tmp_dir, DirWalkParams(),
+                    [&num_entries](const DirEntry& entry) {
+                      return ++num_entries < 5;
+                    }));
+  EXPECT_EQ(num_entries, 5);
+
+  // In parallel.
+  ASSERT_OK_AND_ASSIGN(
+      auto pool, work::ThreadPool::Create(
+                     work::ThreadPool::Params().set_num_threads(4)));
+  absl::Mutex mutex;
+  paths.clear();
+  ASSERT_OK(WalkDir(tmp_dir,
+                    DirWalkParams()
+                        .set_list_attr(LIST_FILES | LIST_RECURSIVE)
+                        .set_pool(pool.get()),
+                    [&mutex, &paths](const DirEntry& entry) {
+                      absl::MutexLock l(&mutex);
+                      paths.push_back(entry.path);
+                      return true;
+                    }));
+  EXPECT_EQ(paths.size(), 10 * 20 + 1);
+  EXPECT_RAISES(WalkDir(path::Join(tmp_dir, "none"), DirWalkParams(),
+                        [](const DirEntry& entry) { return true; }),
+                NotFound);
+}
 }  // namespace
 }  // namespace io
 }  // namespace whisper
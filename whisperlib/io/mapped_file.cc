@@ -0,0 +1,174 @@
+#include "whisperlib/io/mapped_file.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "whisperlib/io/errno.h"
+#include "whisperlib/io/file.h"
+#include "whisperlib/status/status.h"
+
+namespace whisper {
+namespace io {
+
+namespace {
+int AdviceValue(MappedFile::Advice advice) {
+  switch (advice) {
+    case MappedFile::Advice::NORMAL:
+      return MADV_NORMAL;
+    case MappedFile::Advice::SEQUENTIAL:
+      return MADV_SEQUENTIAL;
+    case MappedFile::Advice::RANDOM:
+      return MADV_RANDOM;
+    case MappedFile::Advice::WILLNEED:
+      return MADV_WILLNEED;
+    case MappedFile::Advice::DONTNEED:
+      return MADV_DONTNEED;
+  }
+  return MADV_NORMAL;
+}
+}  // namespace
+
+absl::string_view MappedFile::AdviceName(Advice advice) {
+  switch (advice) {
+    case Advice::NORMAL:
+      return "NORMAL";
+    case Advice::SEQUENTIAL:
+      return "SEQUENTIAL";
+    case Advice::RANDOM:
+      return "RANDOM";
+    case Advice::WILLNEED:
+      return "WILLNEED";
+    case Advice::DONTNEED:
+      return "DONTNEED";
+  }
+  return "UNKNOWN";
+}
+
+absl::StatusOr<std::shared_ptr<MappedFile>> MappedFile::Open(
+    absl::string_view filename, Params params) {
+  File file;
+  RETURN_IF_ERROR(file.Open(
+      filename, params.writable ? File::GENERIC_READ_WRITE : File::GENERIC_READ,
+      File::OPEN_EXISTING));
+  std::shared_ptr<MappedFile> mapped(
+      new MappedFile(std::string(filename), std::move(params)));
+  RETURN_IF_ERROR(mapped->Map(file.fd(), file.Size()));
+  RETURN_IF_ERROR(file.Close());
+  return mapped;
+}
+
+absl::StatusOr<std::shared_ptr<MappedFile>> MappedFile::Create(
+    absl::string_view filename, size_t size, Params params) {
+  params.writable = true;
+  File file;
+  RETURN_IF_ERROR(
+      file.Open(filename, File::GENERIC_READ_WRITE, File::CREATE_ALWAYS));
+  RETURN_IF_ERROR(file.Truncate(size));
+  std::shared_ptr<MappedFile> mapped(
+      new MappedFile(std::string(filename), std::move(params)));
+  RETURN_IF_ERROR(mapped->Map(file.fd(), size));
+  RETURN_IF_ERROR(file.Close());
+  return mapped;
+}
+
+MappedFile::MappedFile(std::string filename, Params params)
+    : filename_(std::move(filename)), params_(std::move(params)) {}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    ::munmap(data_, size_);
+  }
+}
+
+absl::Status MappedFile::Map(int fd, size_t size) {
+  if (size == 0) {
+    // Cannot map empty files - we just have no data.
+    return absl::OkStatus();
+  }
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if (params_.populate) {
+    flags |= MAP_POPULATE;
+  }
+#endif  // MAP_POPULATE
+  const int prot = params_.writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+  void* const data = ::mmap(nullptr, size, prot, flags, fd, 0);
+  if (data == MAP_FAILED) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::mmap failed for file: `" << filename_ << "` of size: " << size;
+  }
+  data_ = static_cast<char*>(data);
+  size_ = size;
+#ifdef MADV_HUGEPAGE
+  if (params_.huge_pages) {
+    // Best effort - not supported by all file systems.
+    ::madvise(data_, size_, MADV_HUGEPAGE);
+  }
+#endif  // MADV_HUGEPAGE
+  if (params_.advice != Advice::NORMAL) {
+    RETURN_IF_ERROR(Advise(params_.advice));
+  }
+  return absl::OkStatus();
+}
+
+absl::string_view MappedFile::View(size_t offset, size_t size) const {
+  if (offset >= size_) {
+    return {};
+  }
+  return absl::string_view(data_ + offset, std::min(size, size_ - offset));
+}
+
+absl::Cord MappedFile::ToCord(size_t offset, size_t size) {
+  const absl::string_view view = View(offset, size);
+  if (view.empty()) {
+    return absl::Cord();
+  }
+  return absl::MakeCordFromExternal(
+      view, [mapped = shared_from_this()](absl::string_view) {});
+}
+
+absl::StatusOr<std::pair<char*, size_t>> MappedFile::PageRegion(
+    size_t offset, size_t size) const {
+  if (ABSL_PREDICT_FALSE(offset > size_)) {
+    return status::OutOfRangeErrorBuilder()
+           << "Offset: " << offset << " beyond the mapping of file: `"
+           << filename_ << "` of size: " << size_;
+  }
+  static const size_t kPageSize = ::sysconf(_SC_PAGESIZE);
+  const size_t begin = offset - offset % kPageSize;
+  const size_t end = offset + std::min(size, size_ - offset);
+  return std::make_pair(data_ + begin, end - begin);
+}
+
+absl::Status MappedFile::Advise(Advice advice, size_t offset, size_t size) {
+  ASSIGN_OR_RETURN(auto region, PageRegion(offset, size));
+  if (region.second == 0) {
+    return absl::OkStatus();
+  }
+  if (::madvise(region.first, region.second, AdviceValue(advice)) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::madvise with " << AdviceName(advice)
+           << " failed for file: `" << filename_ << "`";
+  }
+  return absl::OkStatus();
+}
+
+absl::Status MappedFile::Sync(size_t offset, size_t size, bool wait) {
+  RET_CHECK(params_.writable)
+      << "Syncing a read only mapping of file: `" << filename_ << "`";
+  ASSIGN_OR_RETURN(auto region, PageRegion(offset, size));
+  if (region.second == 0) {
+    return absl::OkStatus();
+  }
+  if (::msync(region.first, region.second, wait ? MS_SYNC : MS_ASYNC) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::msync failed for file: `" << filename_ << "`";
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace io
+}  // namespace whisper
@@ -0,0 +1,124 @@
+#ifndef WHISPERLIB_IO_MAPPED_FILE_H_
+#define WHISPERLIB_IO_MAPPED_FILE_H_
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/cord.h"
+#include "absl/strings/string_view.h"
+
+namespace whisper {
+namespace io {
+
+// A file mapped in memory - for scanning large files w/o copying their
+// data through user buffers.
+// The regions of the mapping can be exposed as absl::Cord external chunks,
+// which keep the mapping alive, so the data can be passed directly to
+// e.g. a Connection::Write.
+//
+// NOTE: if the file is truncated by someone else while mapped, accessing
+// the data past its end raises SIGBUS.
+class MappedFile : public std::enable_shared_from_this<MappedFile> {
+ public:
+  // Hints for the kernel on how the mapped data is to be accessed.
+  enum class Advice {
+    NORMAL,      // no special treatment
+    SEQUENTIAL,  // aggressive read ahead, and early drop of the read pages
+    RANDOM,      // no read ahead
+    WILLNEED,    // read ahead the pages now
+    DONTNEED,    // the pages are not needed soon
+  };
+  static absl::string_view AdviceName(Advice advice);
+
+  struct Params {
+    // Maps the file for reading and writing (shared w/ the file) - else
+    // it is mapped read only.
+    bool writable = false;
+    // Reads in all the pages of the file upon mapping (Linux).
+    bool populate = false;
+    // Asks the kernel to back the mapping w/ transparent huge pages (Linux)
+    // - only supported for some file systems, and ignored if not.
+    bool huge_pages = false;
+    // Initial advice for the whole mapping.
+    Advice advice = Advice::NORMAL;
+
+    Params& set_writable(bool value) {
+      writable = value;
+      return *this;
+    }
+    Params& set_populate(bool value) {
+      populate = value;
+      return *this;
+    }
+    Params& set_huge_pages(bool value) {
+      huge_pages = value;
+      return *this;
+    }
+    Params& set_advice(Advice value) {
+      advice = value;
+      return *this;
+    }
+  };
+
+  // Maps the entire existing file.
+  static absl::StatusOr<std::shared_ptr<MappedFile>> Open(
+      absl::string_view filename, Params params);
+  // Creates (or truncates) the file to the provided size, and maps it
+  // for writing.
+  static absl::StatusOr<std::shared_ptr<MappedFile>> Create(
+      absl::string_view filename, size_t size, Params params);
+
+  ~MappedFile();
+
+  // The mapped data - null for empty files.
+  const char* data() const { return data_; }
+  // The mapped data for writing - null if not writable.
+  char* mutable_data() { return params_.writable ? data_ : nullptr; }
+  // The size of the mapping (i.e. of the file when mapped).
+  size_t size() const { return size_; }
+  absl::string_view filename() const { return filename_; }
+  const Params& params() const { return params_; }
+
+  // Returns the data in the [offset, offset + size) region, trimmed to
+  // the size of the mapping.
+  absl::string_view View(size_t offset,
+                         size_t size = std::string::npos) const;
+  // Returns the data in the [offset, offset + size) region as a cord, w/o
+  // copying it. The cord keeps this mapping alive.
+  absl::Cord ToCord(size_t offset = 0, size_t size = std::string::npos);
+
+  // Advises the kernel on how the [offset, offset + size) region is to be
+  // accessed.
+  absl::Status Advise(Advice advice, size_t offset = 0,
+                      size_t size = std::string::npos);
+  // Writes to the file the changes in the [offset, offset + size) region
+  // of a writable mapping. If wait is false, the writes are just scheduled.
+  absl::Status Sync(size_t offset = 0, size_t size = std::string::npos,
+                    bool wait = true);
+
+ private:
+  MappedFile(std::string filename, Params params);
+
+  // Maps size bytes of the opened fd.
+  absl::Status Map(int fd, size_t size);
+  // Returns the region [offset, offset + size) extended to page boundaries
+  // - for the system calls that require that.
+  absl::StatusOr<std::pair<char*, size_t>> PageRegion(size_t offset,
+                                                      size_t size) const;
+
+  const std::string filename_;
+  const Params params_;
+  char* data_ = nullptr;
+  size_t size_ = 0;
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+};
+
+}  // namespace io
+}  // namespace whisper
+
+#endif  // WHISPERLIB_IO_MAPPED_FILE_H_
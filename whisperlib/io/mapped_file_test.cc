@@ -0,0 +1,85 @@
+#include "whisperlib/io/mapped_file.h"
+
+#include <cstring>
+#include <string>
+
+#include "gtest/gtest.h"
+#include "whisperlib/io/file.h"
+#include "whisperlib/io/path.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace io {
+
+TEST(MappedFile, ReadOnly) {
+  const std::string filename =
+      path::Join(testing::TempDir(), "mapped_file_test_read");
+  std::string content;
+  for (int i = 0; i < 10000; ++i) {
+    content.append(std::to_string(i));
+  }
+  ASSERT_OK(File::WriteFromString(filename, content).status());
+  ASSERT_OK_AND_ASSIGN(
+      auto mapped,
+      MappedFile::Open(filename, MappedFile::Params()
+                                     .set_advice(MappedFile::Advice::SEQUENTIAL)
+                                     .set_populate(true)
+                                     .set_huge_pages(true)));
+  EXPECT_EQ(mapped->size(), content.size());
+  EXPECT_EQ(absl::string_view(mapped->data(), mapped->size()), content);
+  EXPECT_EQ(mapped->mutable_data(), nullptr);
+  EXPECT_EQ(mapped->View(10, 5), content.substr(10, 5));
+  EXPECT_EQ(mapped->View(content.size() - 2),
+            content.substr(content.size() - 2));
+  EXPECT_TRUE(mapped->View(content.size() + 1).empty());
+  ASSERT_OK(mapped->Advise(MappedFile::Advice::RANDOM, 5000, 100));
+  ASSERT_OK(mapped->Advise(MappedFile::Advice::WILLNEED));
+  EXPECT_FALSE(mapped->Advise(MappedFile::Advice::RANDOM, content.size() + 1)
+                   .ok());
+  EXPECT_FALSE(mapped->Sync().ok());
+
+  // The cord references the mapped data, and keeps the mapping alive.
+  absl::Cord cord = mapped->ToCord(1000, 20000);
+  EXPECT_EQ(cord.size(), 20000);
+  EXPECT_EQ(cord.TryFlat().value().data(), mapped->data() + 1000);
+  mapped.reset();
+  EXPECT_EQ(std::string(cord), content.substr(1000, 20000));
+}
+
+TEST(MappedFile, Writable) {
+  const std::string filename =
+      path::Join(testing::TempDir(), "mapped_file_test_write");
+  {
+    ASSERT_OK_AND_ASSIGN(auto mapped, MappedFile::Create(filename, 8192, {}));
+    ASSERT_NE(mapped->mutable_data(), nullptr);
+    memset(mapped->mutable_data(), 'a', 8192);
+    memcpy(mapped->mutable_data() + 4096, "foobar", 6);
+    ASSERT_OK(mapped->Sync(4096, 6));
+  }
+  ASSERT_OK_AND_ASSIGN(std::string content, File::ReadAsString(filename));
+  ASSERT_EQ(content.size(), 8192);
+  EXPECT_EQ(content.substr(4090, 16), "aaaaaafoobaraaaa");
+  ASSERT_OK_AND_ASSIGN(
+      auto mapped,
+      MappedFile::Open(filename, MappedFile::Params().set_writable(true)));
+  memcpy(mapped->mutable_data(), "bar", 3);
+  ASSERT_OK(mapped->Sync(0, std::string::npos, false));
+  mapped.reset();
+  ASSERT_OK_AND_ASSIGN(content, File::ReadAsString(filename));
+  EXPECT_EQ(content.substr(0, 4), "bara");
+}
+
+TEST(MappedFile, Empty) {
+  const std::string filename =
+      path::Join(testing::TempDir(), "mapped_file_test_empty");
+  ASSERT_OK(File::WriteFromString(filename, "").status());
+  ASSERT_OK_AND_ASSIGN(auto mapped, MappedFile::Open(filename, {}));
+  EXPECT_EQ(mapped->size(), 0);
+  EXPECT_EQ(mapped->data(), nullptr);
+  EXPECT_TRUE(mapped->ToCord().empty());
+  EXPECT_FALSE(
+      MappedFile::Open(path::Join(testing::TempDir(), "not_there"), {}).ok());
+}
+
+}  // namespace io
+}  // namespace whisper
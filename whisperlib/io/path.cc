@@ -22,103 +22,166 @@ absl::string_view Dirname(absl::string_view path) {
 }
 
 std::string Normalize(absl::string_view path, char sep) {
-  std::string s(path);
+  return PathBuilder(path, sep).Normalize().ToString();
+}
+
+std::string Join(absl::string_view path1, absl::string_view path2,
+                 char path_separator) {
+  if (path1.empty()) {
+    return std::string(path2);
+  }
+  if (path2.empty()) {
+    return std::string(path1);
+  }
+  if ((path1.size() == 1 && *path1.begin() == path_separator) ||
+      *path2.begin() == path_separator || *path1.rbegin() == path_separator) {
+    return absl::StrCat(path1, path2);
+  }
+  return absl::StrCat(path1, absl::string_view(&path_separator, 1), path2);
+}
+
+std::string Join(absl::Span<std::string> paths) {
+  PathBuilder builder;
+  for (absl::string_view path : paths) {
+    builder.Append(path);
+  }
+  return builder.ToString();
+}
+std::string Join(std::initializer_list<absl::string_view> paths) {
+  PathBuilder builder;
+  for (absl::string_view path : paths) {
+    builder.Append(path);
+  }
+  return builder.ToString();
+}
+
+PathBuilder::PathBuilder(char sep) : sep_(sep), buffer_(1, '\0') {}
+
+PathBuilder::PathBuilder(absl::string_view path, char sep) : sep_(sep) {
+  Assign(path);
+}
+
+PathBuilder& PathBuilder::Assign(absl::string_view path) {
+  buffer_.assign(path.begin(), path.end());
+  buffer_.push_back('\0');
+  return *this;
+}
+
+void PathBuilder::Erase(size_t begin, size_t end) {
+  buffer_.erase(buffer_.begin() + begin, buffer_.begin() + end);
+}
+
+void PathBuilder::Resize(size_t size) {
+  buffer_.resize(size + 1);
+  buffer_[size] = '\0';
+}
+
+PathBuilder& PathBuilder::Append(absl::string_view component) {
+  if (component.empty()) {
+    return *this;
+  }
+  if (!empty() && component.front() != sep_ && view().back() != sep_) {
+    buffer_.insert(buffer_.end() - 1, sep_);
+  }
+  buffer_.insert(buffer_.end() - 1, component.begin(), component.end());
+  return *this;
+}
+
+PathBuilder& PathBuilder::RemoveLast() {
+  const size_t pos = view().rfind(sep_);
+  Resize(pos == absl::string_view::npos ? 0 : pos);
+  return *this;
+}
+
+// Same steps as the original string based Normalize, but done in place.
+PathBuilder& PathBuilder::Normalize() {
+  const char sep = sep_;
   const char sep_str[] = {sep, '\0'};
   // Normalize the slashes and add leading slash if necessary
-  for (size_t i = 0; i < s.size(); ++i) {
-    if (s[i] == '\\') {
-      s[i] = sep;
+  for (size_t i = 0; i < size(); ++i) {
+    if (buffer_[i] == '\\') {
+      buffer_[i] = sep;
     }
   }
   bool slash_added = false;
-  if (s[0] != sep) {
-    s = sep_str + s;
+  if (buffer_[0] != sep) {
+    buffer_.insert(buffer_.begin(), sep);
     slash_added = true;
   }
 
   // Resolve occurrences of "///" in the normalized path
   const char triple_sep[] = {sep, sep, sep, '\0'};
   while (true) {
-    const size_t index = s.find(triple_sep);
-    if (index == std::string::npos) break;
-    s = s.substr(0, index) + s.substr(index + 2);
+    const size_t index = view().find(triple_sep);
+    if (index == absl::string_view::npos) break;
+    Erase(index, index + 2);
   }
   // Resolve occurrences of "//" in the normalized path (but not beginning !)
   const char* double_sep = triple_sep + 1;
   while (true) {
-    const size_t index = s.find(double_sep, 1);
-    if (index == std::string::npos) break;
-    s = s.substr(0, index) + s.substr(index + 1);
+    const size_t index = view().find(double_sep, 1);
+    if (index == absl::string_view::npos) break;
+    Erase(index, index + 1);
   }
   // Resolve occurrences of "/./" in the normalized path
   const char sep_dot_sep[] = {sep, '.', sep, '\0'};
   while (true) {
-    const size_t index = s.find(sep_dot_sep);
-    if (index == std::string::npos) break;
-    s = s.substr(0, index) + s.substr(index + 2);
+    const size_t index = view().find(sep_dot_sep);
+    if (index == absl::string_view::npos) break;
+    Erase(index, index + 2);
   }
   // Resolve occurrences of "/../" in the normalized path
   const char sep_dotdot_sep[] = {sep, '.', '.', sep, '\0'};
   while (true) {
-    const size_t index = s.find(sep_dotdot_sep);
-    if (index == std::string::npos) break;
-    if (index == 0) return slash_added ? "" : sep_str;
+    const size_t index = view().find(sep_dotdot_sep);
+    if (index == absl::string_view::npos) break;
+    if (index == 0) return Assign(slash_added ? "" : sep_str);
     // The only left path is the root.
-    const size_t index2 = s.find_last_of(sep, index - 1);
-    if (index2 == std::string::npos) return slash_added ? "" : sep_str;
-    s = s.substr(0, index2) + s.substr(index + 3);
+    const size_t index2 = view().find_last_of(sep, index - 1);
+    if (index2 == absl::string_view::npos) {
+      return Assign(slash_added ? "" : sep_str);
+    }
+    Erase(index2, index + 3);
   }
   // Resolve ending "/.." and "/."
   {
     const char sep_dot[] = {sep, '.', '\0'};
-    const size_t index = s.rfind(sep_dot);
-    if (index != std::string::npos && index == s.length() - 2) {
-      s = s.substr(0, index);
+    const size_t index = view().rfind(sep_dot);
+    if (index != absl::string_view::npos && index == size() - 2) {
+      Resize(index);
     }
   }
   {
     const char sep_dotdot[] = {sep, '.', '.', '\0'};
-    size_t index = s.rfind(sep_dotdot);
-    if (index != std::string::npos && index == s.length() - 3) {
-      if (index == 0) return slash_added ? "" : sep_str;
-      const size_t index2 = s.find_last_of(sep, index - 1);
-      if (index2 == std::string::npos) return slash_added ? "" : sep_str;
-      s = s.substr(0, index2);
+    size_t index = view().rfind(sep_dotdot);
+    if (index != absl::string_view::npos && index == size() - 3) {
+      if (index == 0) return Assign(slash_added ? "" : sep_str);
+      const size_t index2 = view().find_last_of(sep, index - 1);
+      if (index2 == absl::string_view::npos) {
+        return Assign(slash_added ? "" : sep_str);
+      }
+      Resize(index2);
     }
-    if (!slash_added && s.empty()) s = sep_str;
+    if (!slash_added && empty()) Assign(sep_str);
   }
-  if (!slash_added || s.empty()) return s;
-  return s.substr(1);
-}
-
-std::string Join(absl::string_view path1, absl::string_view path2,
-                 char path_separator) {
-  if (path1.empty()) {
-    return std::string(path2);
+  if (slash_added && !empty()) {
+    Erase(0, 1);
   }
-  if (path2.empty()) {
-    return std::string(path1);
-  }
-  if ((path1.size() == 1 && *path1.begin() == path_separator) ||
-      *path2.begin() == path_separator || *path1.rbegin() == path_separator) {
-    return absl::StrCat(path1, path2);
-  }
-  return absl::StrCat(path1, absl::string_view(&path_separator, 1), path2);
+  return *this;
 }
 
-std::string Join(absl::Span<std::string> paths) {
-  std::string result_path;
-  for (absl::string_view path : paths) {
-    result_path = Join(result_path, path);
-  }
-  return result_path;
-}
-std::string Join(std::initializer_list<absl::string_view> paths) {
-  std::string result_path;
-  for (absl::string_view path : paths) {
-    result_path = Join(result_path, path);
+void Components::const_iterator::Next() {
+  while (!rest_.empty()) {
+    const size_t pos = rest_.find(sep_);
+    absl::string_view component = rest_.substr(0, pos);
+    rest_.remove_prefix(pos == absl::string_view::npos ? rest_.size()
+                                                       : pos + 1);
+    if (!component.empty()) {
+      current_ = component;
+      return;
+    }
   }
-  return result_path;
+  current_ = absl::string_view();
 }
 
 }  // namespace path
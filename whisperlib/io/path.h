@@ -1,8 +1,12 @@
 #ifndef WHISPERLIB_IO_PATH_H_
 #define WHISPERLIB_IO_PATH_H_
 
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
 #include <string>
 
+#include "absl/container/inlined_vector.h"
 #include "absl/strings/string_view.h"
 #include "absl/types/span.h"
 
@@ -42,6 +46,113 @@ std::string Join(std::initializer_list<absl::string_view> paths);
 // all the prefix '/'  ( with a custom path separator character ).
 std::string Normalize(absl::string_view path, char sep = kDirSeparator);
 
+// Builds a path in place, in an inline buffer - so, for the usual path
+// lengths, joining components and normalizing needs no heap allocation
+// (unlike Join / Normalize, which return new strings).
+// The path is always NUL terminated, so it can be passed directly to the
+// system calls. E.g.
+//   path::PathBuilder builder(root);
+//   builder.Append(request_path).Normalize();
+//   const int fd = ::open(builder.c_str(), O_RDONLY);
+class PathBuilder {
+ public:
+  // Paths up to this size are kept in the inline buffer.
+  static constexpr size_t kInlineSize = 256;
+
+  explicit PathBuilder(char sep = kDirSeparator);
+  explicit PathBuilder(absl::string_view path, char sep = kDirSeparator);
+
+  // Appends a component to the path - with the same result as Join.
+  PathBuilder& Append(absl::string_view component);
+  // Removes the last component - the result is the same as Dirname.
+  PathBuilder& RemoveLast();
+  // Normalizes the path in place - with the same result as Normalize.
+  PathBuilder& Normalize();
+  // Replaces the path.
+  PathBuilder& Assign(absl::string_view path);
+  void Clear() { Assign(""); }
+
+  absl::string_view view() const {
+    return absl::string_view(buffer_.data(), buffer_.size() - 1);
+  }
+  const char* c_str() const { return buffer_.data(); }
+  size_t size() const { return buffer_.size() - 1; }
+  bool empty() const { return size() == 0; }
+  char separator() const { return sep_; }
+  std::string ToString() const { return std::string(view()); }
+  // If the path is still kept in the inline buffer.
+  bool is_inlined() const { return buffer_.capacity() <= kInlineSize; }
+
+ private:
+  // Removes the characters in [begin, end).
+  void Erase(size_t begin, size_t end);
+  void Resize(size_t size);
+
+  const char sep_;
+  // The path, followed by a NUL.
+  absl::InlinedVector<char, kInlineSize> buffer_;
+};
+
+// Iterates over the non-empty components of a path, w/o copying - the path
+// must outlive the iteration. E.g.
+//   for (absl::string_view component : path::Components("/a//b/c/")) {
+//     // "a", "b", "c"
+//   }
+class Components {
+ public:
+  class const_iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = absl::string_view;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const absl::string_view*;
+    using reference = const absl::string_view&;
+
+    const_iterator() = default;
+
+    reference operator*() const { return current_; }
+    pointer operator->() const { return &current_; }
+    const_iterator& operator++() {
+      Next();
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator it = *this;
+      Next();
+      return it;
+    }
+    bool operator==(const const_iterator& other) const {
+      return current_.data() == other.current_.data();
+    }
+    bool operator!=(const const_iterator& other) const {
+      return !(*this == other);
+    }
+
+   private:
+    friend class Components;
+    const_iterator(absl::string_view path, char sep) : rest_(path), sep_(sep) {
+      Next();
+    }
+    // Advances to the next non-empty component, or to the end.
+    void Next();
+
+    absl::string_view rest_;
+    absl::string_view current_;
+    char sep_ = kDirSeparator;
+  };
+  using iterator = const_iterator;
+
+  explicit Components(absl::string_view path, char sep = kDirSeparator)
+      : path_(path), sep_(sep) {}
+
+  const_iterator begin() const { return const_iterator(path_, sep_); }
+  const_iterator end() const { return const_iterator(); }
+
+ private:
+  const absl::string_view path_;
+  const char sep_;
+};
+
 }  // namespace path
 }  // namespace whisper
 
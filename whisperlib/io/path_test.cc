@@ -184,5 +184,64 @@ TEST(WhisperPath, Join) {
   EXPECT_EQ(Join(absl::Span<std::string>(paths)), _p("a/b/c/"));
 }
 
+TEST(WhisperPath, PathBuilder) {
+  PathBuilder builder;
+  EXPECT_TRUE(builder.empty());
+  EXPECT_EQ(std::string(builder.c_str()), "");
+  builder.Append(_p("/a")).Append("b").Append("").Append(_p("/c/"));
+  EXPECT_EQ(builder.view(), _p("/a/b/c/"));
+  EXPECT_EQ(std::string(builder.c_str()), _p("/a/b/c/"));
+  builder.Append("d");
+  EXPECT_EQ(builder.view(), _p("/a/b/c/d"));
+  builder.RemoveLast();
+  EXPECT_EQ(builder.view(), _p("/a/b/c"));
+  builder.Append(_p("../../e/./f//g/.."));
+  EXPECT_EQ(builder.Normalize().view(), _p("/a/e/f"));
+  EXPECT_EQ(std::string(builder.c_str()), _p("/a/e/f"));
+  EXPECT_TRUE(builder.is_inlined());
+  builder.RemoveLast().RemoveLast().RemoveLast();
+  EXPECT_EQ(builder.view(), "");
+
+  // Same results as Normalize and Join.
+  for (absl::string_view path :
+       {"", "/", "//", "///", "foo/", "../foo", "foo/../../", "foo/bar/../",
+        "//net/", "//..net", "foo/bar/blah/../../bletch", "a/./b/.", "/.."}) {
+    EXPECT_EQ(PathBuilder(_p(path)).Normalize().view(), Normalize(_p(path)))
+        << path;
+    EXPECT_EQ(PathBuilder(_p("x/")).Append(_p(path)).view(),
+              Join(_p("x/"), _p(path)))
+        << path;
+  }
+  EXPECT_EQ(PathBuilder("###net###foo###..###", '#').Normalize().view(),
+            "#net#");
+
+  // Long paths move to the heap.
+  PathBuilder long_builder(_p("/root"));
+  for (int i = 0; i < 100; ++i) {
+    long_builder.Append("component");
+  }
+  EXPECT_FALSE(long_builder.is_inlined());
+  EXPECT_EQ(long_builder.size(), 5 + 100 * 10);
+}
+
+TEST(WhisperPath, Components) {
+  const std::string path = _p("/a//bb/c/");
+  std::vector<std::string> components;
+  for (absl::string_view component : Components(path)) {
+    components.emplace_back(component);
+  }
+  EXPECT_EQ(components, std::vector<std::string>({"a", "bb", "c"}));
+  components.clear();
+  for (absl::string_view component : Components("x#y", '#')) {
+    components.emplace_back(component);
+  }
+  EXPECT_EQ(components, std::vector<std::string>({"x", "y"}));
+  EXPECT_EQ(Components("").begin(), Components("").end());
+  EXPECT_EQ(Components(_p("//")).begin(), Components(_p("//")).end());
+  EXPECT_EQ(std::distance(Components(_p("a/b")).begin(),
+                          Components(_p("a/b")).end()),
+            2);
+}
+
 }  // namespace path
 }  // namespace whisper
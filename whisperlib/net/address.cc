@@ -3,6 +3,9 @@
 #include <arpa/inet.h>
 #include <net/if.h>
 
+#include <cstring>
+
+#include "absl/numeric/bits.h"
 #include "absl/strings/match.h"
 #include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
@@ -67,18 +70,123 @@ in6_addr IpAddress::ipv6_addr() const {
   return *reinterpret_cast<const in6_addr*>(addr_.data());
 }
 
+namespace {
+inline bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+inline int HexDigitValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Parses a dotted decimal IPv4 address in dst[0..3], as
+// ::inet_pton(AF_INET, ..) does: exactly four decimal numbers up to 255,
+// w/o leading zeros.
+bool ParseIpV4(absl::string_view ip, uint8_t* dst) {
+  const char* p = ip.data();
+  const char* const end = p + ip.size();
+  for (size_t i = 0; i < 4; ++i) {
+    if (i > 0) {
+      if (p == end || *p != '.') return false;
+      ++p;
+    }
+    if (p == end || !IsDigit(*p)) return false;
+    uint32_t value = *p++ - '0';
+    while (p != end && IsDigit(*p)) {
+      if (value == 0) return false;  // leading zero
+      value = value * 10 + (*p++ - '0');
+      if (value > 255) return false;
+    }
+    dst[i] = static_cast<uint8_t>(value);
+  }
+  return p == end;
+}
+
+// Parses an IPv6 address in dst[0..15], as ::inet_pton(AF_INET6, ..) does:
+// up to eight groups of up to four hex digits, with one optional '::' for
+// a run of zero groups, and optionally an IPv4 address for the last 32 bits.
+bool ParseIpV6(absl::string_view ip, uint8_t* dst) {
+  uint8_t addr[IpAddress::kIpV6Size] = {};
+  uint8_t* tp = addr;
+  uint8_t* const endp = addr + sizeof(addr);
+  uint8_t* colonp = nullptr;  // where the '::' is
+  const char* p = ip.data();
+  const char* const end = p + ip.size();
+  if (p != end && *p == ':') {
+    ++p;
+    if (p == end || *p != ':') return false;
+  }
+  const char* group = p;
+  uint32_t value = 0;
+  size_t num_digits = 0;
+  while (p != end) {
+    const char c = *p++;
+    const int digit = HexDigitValue(c);
+    if (digit >= 0) {
+      if (num_digits == 4) return false;
+      value = (value << 4) | digit;
+      ++num_digits;
+      continue;
+    }
+    if (c == ':') {
+      group = p;
+      if (num_digits == 0) {
+        if (colonp != nullptr) return false;
+        colonp = tp;
+        continue;
+      }
+      if (p == end || tp + 2 > endp) return false;
+      *tp++ = static_cast<uint8_t>(value >> 8);
+      *tp++ = static_cast<uint8_t>(value);
+      value = 0;
+      num_digits = 0;
+      continue;
+    }
+    if (c == '.' && tp + 4 <= endp &&
+        ParseIpV4(absl::string_view(group, end - group), tp)) {
+      tp += 4;
+      num_digits = 0;
+      break;
+    }
+    return false;
+  }
+  if (num_digits > 0) {
+    if (tp + 2 > endp) return false;
+    *tp++ = static_cast<uint8_t>(value >> 8);
+    *tp++ = static_cast<uint8_t>(value);
+  }
+  if (colonp != nullptr) {
+    if (tp == endp) return false;
+    // Shifts the groups after the '::' to the end.
+    const size_t size = tp - colonp;
+    memmove(endp - size, colonp, size);
+    memset(colonp, 0, endp - size - colonp);
+    tp = endp;
+  }
+  if (tp != endp) return false;
+  memcpy(dst, addr, sizeof(addr));
+  return true;
+}
+
+// The prefix of the v4-mapped IPv6 addresses: ::ffff:0:0/96.
+constexpr uint8_t kIpV4MappedPrefix[] = {0, 0, 0, 0, 0,    0,
+                                         0, 0, 0, 0, 0xff, 0xff};
+constexpr size_t kIpV4MappedBits = 8 * sizeof(kIpV4MappedPrefix);
+}  // namespace
+
 absl::StatusOr<IpAddress> IpAddress::ParseFromString(absl::string_view ip) {
   if (ip.empty()) {
     return absl::InvalidArgumentError("Empty IP address string.");
   }
-  std::string ip_str(ip);
-  in_addr addr;
-  if (inet_pton(AF_INET, ip_str.c_str(), &addr) == 1) {
-    return IpAddress(ntohl(addr.s_addr));
-  }
-  in6_addr addr6;
-  if (inet_pton(AF_INET6, ip_str.c_str(), &addr6) == 1) {
-    return IpAddress(addr6.s6_addr);
+  IpArray addr = {};
+  if (ip.find(':') == absl::string_view::npos) {
+    if (ParseIpV4(ip, &addr[kIpV4Index])) {
+      addr[10] = 0xff;
+      addr[11] = 0xff;
+      return IpAddress(addr);
+    }
+  } else if (ParseIpV6(ip, addr.data())) {
+    return IpAddress(addr);
   }
   return absl::InvalidArgumentError(
       "IP address string could not be parsed "
@@ -91,7 +199,7 @@ absl::StatusOr<IpAddress> IpAddress::ParseFromSockAddr(const sockaddr* saddr,
     RET_CHECK(saddr_len >= sizeof(sockaddr_in))
         << "Insufficient buffer size to parse IPv4 from sockaddr.";
     auto saddr_in = reinterpret_cast<const sockaddr_in*>(saddr);
-    return IpAddress(saddr_in->sin_addr.s_addr);
+    return IpAddress(ntohl(saddr_in->sin_addr.s_addr));
   } else if (saddr->sa_family == AF_INET6) {
     RET_CHECK(saddr_len >= sizeof(sockaddr_in6))
         << "Insufficient buffer size to parse IPv4 from sockaddr.";
@@ -362,5 +470,151 @@ absl::StatusOr<HostPort> HostPort::ParseFromSockAddr(const sockaddr* saddr,
   return hp;
 }
 
+IpPrefixSet::IpPrefixSet() : nodes_(2) {}
+
+absl::Status IpPrefixSet::Add(absl::string_view cidr) {
+  const size_t pos = cidr.find('/');
+  const absl::string_view ip_str = cidr.substr(0, pos);
+  ASSIGN_OR_RETURN(const IpAddress ip, IpAddress::ParseFromString(ip_str),
+                   _ << "Parsing the address of IP prefix: `" << cidr << "`");
+  // The prefix length is in the bits of the notation used for the address,
+  // so "::ffff:10.0.0.0/104" is the same as "10.0.0.0/8".
+  const bool ipv6_notation = ip_str.find(':') != absl::string_view::npos;
+  size_t prefix_len = ipv6_notation ? 8 * IpAddress::kIpV6Size : 32;
+  if (pos != absl::string_view::npos &&
+      !absl::SimpleAtoi(cidr.substr(pos + 1), &prefix_len)) {
+    return status::InvalidArgumentErrorBuilder()
+           << "Invalid IP prefix length in: `" << cidr << "`";
+  }
+  if (ip.is_ipv4() && ipv6_notation) {
+    if (prefix_len < kIpV4MappedBits) {
+      return AddIpV6(ip.ipv6().data(), prefix_len);
+    }
+    prefix_len -= kIpV4MappedBits;
+  }
+  return Add(ip, prefix_len);
+}
+
+absl::Status IpPrefixSet::Add(const IpAddress& ip, size_t prefix_len) {
+  if (ip.is_ipv4()) {
+    if (prefix_len > 32) {
+      return status::InvalidArgumentErrorBuilder()
+             << "IPv4 prefix length too large: " << prefix_len;
+    }
+    AddToTrie(kIpV4Root, ip.ipv6().data() + sizeof(kIpV4MappedPrefix),
+              prefix_len);
+    ++size_;
+    return absl::OkStatus();
+  }
+  return AddIpV6(ip.ipv6().data(), prefix_len);
+}
+
+absl::Status IpPrefixSet::AddIpV6(const uint8_t* bytes, size_t prefix_len) {
+  if (prefix_len > 8 * IpAddress::kIpV6Size) {
+    return status::InvalidArgumentErrorBuilder()
+           << "IPv6 prefix length too large: " << prefix_len;
+  }
+  AddToTrie(kIpV6Root, bytes, prefix_len);
+  // Shorter prefixes may cover all the v4-mapped addresses, which are
+  // checked only against the IPv4 trie.
+  const size_t full_bytes = prefix_len / 8;
+  const size_t rem_bits = prefix_len % 8;
+  if (prefix_len <= kIpV4MappedBits &&
+      memcmp(bytes, kIpV4MappedPrefix, full_bytes) == 0 &&
+      (rem_bits == 0 ||
+       ((bytes[full_bytes] ^ kIpV4MappedPrefix[full_bytes]) >>
+        (8 - rem_bits)) == 0)) {
+    ipv4_match_all_ = true;
+  }
+  ++size_;
+  return absl::OkStatus();
+}
+
+absl::StatusOr<IpPrefixSet> IpPrefixSet::ParseFromStrings(
+    const std::vector<std::string>& cidrs) {
+  IpPrefixSet result;
+  for (const auto& cidr : cidrs) {
+    RETURN_IF_ERROR(result.Add(cidr));
+  }
+  return result;
+}
+
+void IpPrefixSet::AddToTrie(uint32_t root, const uint8_t* bytes,
+                            size_t prefix_len) {
+  if (prefix_len == 0) {
+    (root == kIpV4Root ? ipv4_match_all_ : ipv6_match_all_) = true;
+    return;
+  }
+  // The prefix ends in the node at depth (prefix_len - 1) / 8, where it
+  // matches the 2^(8 - rem_bits) bytes that start w/ its last rem_bits.
+  const size_t depth = (prefix_len - 1) / 8;
+  const size_t rem_bits = prefix_len - 8 * depth;
+  uint32_t node = root;
+  for (size_t i = 0; i < depth; ++i) {
+    node = GetOrAddChild(node, bytes[i]);
+  }
+  const size_t first = bytes[depth] & (0xff << (8 - rem_bits)) & 0xff;
+  const size_t last = first + (size_t(1) << (8 - rem_bits));
+  uint64_t* const match = nodes_[node].match;
+  for (size_t b = first; b < last; ++b) {
+    match[b >> 6] |= uint64_t(1) << (b & 63);
+  }
+}
+
+namespace {
+// The number of bits set in bitmap before bit b - i.e. the index of the
+// child for the byte b in a trie node.
+inline size_t BitmapRank(const uint64_t (&bitmap)[4], uint8_t b) {
+  size_t rank = 0;
+  for (size_t i = 0; i < size_t(b >> 6); ++i) {
+    rank += absl::popcount(bitmap[i]);
+  }
+  return rank +
+         absl::popcount(bitmap[b >> 6] & ((uint64_t(1) << (b & 63)) - 1));
+}
+}  // namespace
+
+uint32_t IpPrefixSet::GetOrAddChild(uint32_t node, uint8_t byte) {
+  const uint64_t bit = uint64_t(1) << (byte & 63);
+  const size_t rank = BitmapRank(nodes_[node].child, byte);
+  if (nodes_[node].child[byte >> 6] & bit) {
+    return nodes_[node].children[rank];
+  }
+  const uint32_t child = static_cast<uint32_t>(nodes_.size());
+  nodes_.emplace_back();  // invalidates the references to nodes_
+  Node& parent = nodes_[node];
+  parent.child[byte >> 6] |= bit;
+  parent.children.insert(parent.children.begin() + rank, child);
+  return child;
+}
+
+bool IpPrefixSet::Contains(const IpAddress& ip) const {
+  const uint8_t* const bytes = ip.ipv6().data();
+  if (ip.is_ipv4()) {
+    return ipv4_match_all_ ||
+           TrieContains(kIpV4Root, bytes + sizeof(kIpV4MappedPrefix), 4);
+  }
+  return ipv6_match_all_ ||
+         TrieContains(kIpV6Root, bytes, IpAddress::kIpV6Size);
+}
+
+bool IpPrefixSet::TrieContains(uint32_t root, const uint8_t* bytes,
+                               size_t size) const {
+  uint32_t node = root;
+  for (size_t i = 0; i < size; ++i) {
+    const Node& n = nodes_[node];
+    const uint8_t b = bytes[i];
+    const uint64_t bit = uint64_t(1) << (b & 63);
+    if (n.match[b >> 6] & bit) {
+      return true;
+    }
+    if (!(n.child[b >> 6] & bit)) {
+      return false;
+    }
+    node = n.children[BitmapRank(n.child, b)];
+  }
+  return false;
+}
+
 }  // namespace net
 }  // namespace whisper
@@ -6,6 +6,8 @@
 
 #include <array>
 #include <cstdint>
+#include <string>
+#include <vector>
 
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
@@ -53,7 +55,8 @@ class IpAddress {
   // to the IP address stored in this object.
   void ToSockAddr(sockaddr_storage* addr) const;
 
-  // Creates an IpAddress from a string representation.
+  // Creates an IpAddress from a string representation - accepts the same
+  // formats as ::inet_pton, but parses in place, w/o copying the string.
   static absl::StatusOr<IpAddress> ParseFromString(absl::string_view ip);
   // Creates an IpAddress from the information contained in provided
   // by the socket address. We expect AF_INET or AF_INET6 family for this.
@@ -170,6 +173,73 @@ class HostPort {
   absl::optional<uint32_t> scope_id_;
 };
 
+// A set of IP address prefixes (CIDR blocks), for fast membership checks -
+// e.g. for allow / deny lists of the peers of an acceptor.
+// IPv4 prefixes (e.g. "10.0.0.0/8") match the IPv4 addresses (which are
+// kept as v4-mapped IPv6), and the IPv6 prefixes covering the v4-mapped
+// range (e.g. "::ffff:10.0.0.0/104") match them too.
+//
+// The prefixes are kept in multibit tries (one for IPv4, one for IPv6),
+// with one address byte per level, as in poptrie: each node has bitmaps of
+// the bytes where a prefix ends (prefixes not on a byte boundary are
+// expanded), and of the bytes w/ a child node, whose index is found
+// by counting the bits before it. Checking an address takes at most 4
+// (IPv4) or 16 (IPv6) node lookups, and stops at the first matching
+// prefix.
+//
+// Not thread safe for Add - build the set, then use it (const) from any
+// number of threads.
+class IpPrefixSet {
+ public:
+  IpPrefixSet();
+
+  // Adds a prefix in CIDR notation: "<ip>/<prefix length>", or just an IP
+  // address, for a single address.
+  absl::Status Add(absl::string_view cidr);
+  // Adds the prefix of prefix_len bits of ip. For IPv4 addresses the
+  // prefix_len is in IPv4 bits (at most 32).
+  absl::Status Add(const IpAddress& ip, size_t prefix_len);
+  // Parses a list of prefixes in CIDR notation.
+  static absl::StatusOr<IpPrefixSet> ParseFromStrings(
+      const std::vector<std::string>& cidrs);
+
+  // If ip is covered by any of the prefixes in this set.
+  bool Contains(const IpAddress& ip) const;
+
+  // Number of prefixes added.
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  // Number of trie nodes - for memory estimation.
+  size_t num_nodes() const { return nodes_.size(); }
+
+ private:
+  struct Node {
+    // Bitmap of the bytes at which a prefix ends.
+    uint64_t match[4] = {};
+    // Bitmap of the bytes w/ a child node.
+    uint64_t child[4] = {};
+    // Indices in nodes_ of the child nodes, ordered by their byte.
+    std::vector<uint32_t> children;
+  };
+  // The roots of the two tries, in nodes_.
+  static constexpr uint32_t kIpV6Root = 0;
+  static constexpr uint32_t kIpV4Root = 1;
+
+  // Adds a prefix of prefix_len bits from an IPv6 address, in the IPv6 trie.
+  absl::Status AddIpV6(const uint8_t* bytes, size_t prefix_len);
+  // Adds the prefix of prefix_len bits from bytes to the trie at root.
+  void AddToTrie(uint32_t root, const uint8_t* bytes, size_t prefix_len);
+  // Returns the child of node for byte, creating it if needed.
+  uint32_t GetOrAddChild(uint32_t node, uint8_t byte);
+  bool TrieContains(uint32_t root, const uint8_t* bytes, size_t size) const;
+
+  std::vector<Node> nodes_;
+  // If the /0 prefix was added to a trie.
+  bool ipv4_match_all_ = false;
+  bool ipv6_match_all_ = false;
+  size_t size_ = 0;
+};
+
 inline std::ostream& operator<<(std::ostream& os, const IpAddress& ip) {
   return os << ip.ToString();
 }
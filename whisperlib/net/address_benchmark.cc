@@ -0,0 +1,115 @@
+#include <arpa/inet.h>
+
+#include <string>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "benchmark/benchmark.h"
+#include "whisperlib/net/address.h"
+
+namespace whisper {
+namespace net {
+namespace {
+
+const std::vector<std::string>& TestAddresses() {
+  static const auto* const kAddresses = new std::vector<std::string>({
+      "127.0.0.1",
+      "192.168.100.200",
+      "10.1.2.3",
+      "::1",
+      "2001:db8:85a3::8a2e:370:7334",
+      "fe80::1ff:fe23:4567:890a",
+      "::ffff:172.16.254.1",
+  });
+  return *kAddresses;
+}
+
+void BM_ParseFromString(benchmark::State& state) {
+  const auto& addresses = TestAddresses();
+  size_t i = 0;
+  for (auto _ : state) {
+    auto ip = IpAddress::ParseFromString(addresses[i++ % addresses.size()]);
+    benchmark::DoNotOptimize(ip);
+  }
+}
+BENCHMARK(BM_ParseFromString);
+
+// The previous implementation, for comparison.
+void BM_ParseWithInetPton(benchmark::State& state) {
+  const auto& addresses = TestAddresses();
+  size_t i = 0;
+  for (auto _ : state) {
+    const std::string ip_str(addresses[i++ % addresses.size()]);
+    in6_addr addr6;
+    in_addr addr;
+    if (inet_pton(AF_INET, ip_str.c_str(), &addr) == 1) {
+      benchmark::DoNotOptimize(IpAddress(ntohl(addr.s_addr)));
+    } else if (inet_pton(AF_INET6, ip_str.c_str(), &addr6) == 1) {
+      benchmark::DoNotOptimize(IpAddress(addr6.s6_addr));
+    }
+  }
+}
+BENCHMARK(BM_ParseWithInetPton);
+
+void BM_HostPortParse(benchmark::State& state) {
+  size_t i = 0;
+  for (auto _ : state) {
+    auto host_port = HostPort::ParseFromString(
+        (i++ & 1) ? "192.168.100.200:8080" : "[2001:db8::1]:443");
+    benchmark::DoNotOptimize(host_port);
+  }
+}
+BENCHMARK(BM_HostPortParse);
+
+// Random IPv4 addresses, in a fixed pool, to check against range(0) random
+// prefixes.
+std::vector<IpAddress> RandomAddresses(uint32_t* seed, size_t count) {
+  std::vector<IpAddress> result;
+  for (size_t i = 0; i < count; ++i) {
+    *seed = *seed * 1103515245 + 12345;
+    result.emplace_back(*seed);
+  }
+  return result;
+}
+
+void BM_PrefixSetContains(benchmark::State& state) {
+  uint32_t seed = 17;
+  IpPrefixSet set;
+  for (const auto& ip : RandomAddresses(&seed, state.range(0))) {
+    CHECK(set.Add(ip, 8 + ip.ipv4() % 25).ok());
+  }
+  const auto addresses = RandomAddresses(&seed, 1024);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(set.Contains(addresses[i++ & 1023]));
+  }
+}
+BENCHMARK(BM_PrefixSetContains)->Arg(16)->Arg(1024)->Arg(65536);
+
+// The linear scan that the prefix set replaces.
+void BM_LinearScanContains(benchmark::State& state) {
+  uint32_t seed = 17;
+  std::vector<std::pair<uint32_t, uint32_t>> prefixes;
+  for (const auto& ip : RandomAddresses(&seed, state.range(0))) {
+    const uint32_t mask = ~uint32_t(0) << (32 - (8 + ip.ipv4() % 25));
+    prefixes.emplace_back(ip.ipv4() & mask, mask);
+  }
+  const auto addresses = RandomAddresses(&seed, 1024);
+  size_t i = 0;
+  for (auto _ : state) {
+    const uint32_t ip = addresses[i++ & 1023].ipv4();
+    bool found = false;
+    for (const auto& prefix : prefixes) {
+      if ((ip & prefix.second) == prefix.first) {
+        found = true;
+        break;
+      }
+    }
+    benchmark::DoNotOptimize(found);
+  }
+}
+BENCHMARK(BM_LinearScanContains)->Arg(16)->Arg(1024)->Arg(65536);
+
+}  // namespace
+}  // namespace net
+}  // namespace whisper
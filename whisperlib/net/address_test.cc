@@ -1,5 +1,10 @@
 #include "whisperlib/net/address.h"
 
+#include <arpa/inet.h>
+
+#include <cstring>
+#include <memory>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "whisperlib/status/testing.h"
@@ -55,6 +60,130 @@ TEST(IpAddress, Parse) {
       testing::HasSubstr("IP address string could not be parsed"));
 }
 
+TEST(IpAddress, ParseLikeInetPton) {
+  // The results should be the same as for ::inet_pton.
+  for (const char* str :
+       {"0.0.0.0", "1.2.3.4", "255.255.255.255", "10.0.0.01", "256.1.1.1",
+        "1.2.3", "1.2.3.4.5", "1..2.3", ".1.2.3", "1.2.3.4.", "1.2.3.4 ",
+        "1.2.3.1000", "a.b.c.d", "::", "::1", "1::", "1:2:3:4:5:6:7:8",
+        "1:2:3:4:5:6:7:8:9", "1:2:3:4:5:6:7::", "::2:3:4:5:6:7:8",
+        "1:2:3:4:5:6::7:8", "1::2::3", ":::", ":1::2", "1::2:", "1:2",
+        "12345::", "ABCD:ef01::FfFf", "::ffff:1.2.3.4", "::1.2.3.4",
+        "1:2:3:4:5:6:1.2.3.4", "1:2:3:4:5:6:7:1.2.3.4", "::ffff:1.2.3",
+        "::ffff:1.2.3.4:5", "::ffff:01.2.3.4", "fe80::1%eth0", "::g",
+        "0000:0000:0000:0000:0000:0000:0000:0001", "1:2:3:4:5:6:7:8::",
+        "::1:2:3:4:5:6:7:8", "::1:2:3:4:5:6:7"}) {
+    SCOPED_TRACE(str);
+    in6_addr addr6;
+    in_addr addr4;
+    auto ip = IpAddress::ParseFromString(str);
+    if (inet_pton(AF_INET, str, &addr4) == 1) {
+      ASSERT_OK(ip.status());
+      EXPECT_TRUE(ip.value().is_ipv4());
+      EXPECT_EQ(ip.value().ipv4(), ntohl(addr4.s_addr));
+    } else if (inet_pton(AF_INET6, str, &addr6) == 1) {
+      ASSERT_OK(ip.status());
+      EXPECT_EQ(0, memcmp(ip.value().ipv6().data(), addr6.s6_addr,
+                          IpAddress::kIpV6Size));
+    } else {
+      EXPECT_RAISES(ip.status(), InvalidArgument);
+    }
+  }
+}
+
+TEST(IpPrefixSet, Contains) {
+  IpPrefixSet set;
+  EXPECT_TRUE(set.empty());
+  ASSERT_OK(set.Add("10.0.0.0/8"));
+  ASSERT_OK(set.Add("192.168.1.0/24"));
+  ASSERT_OK(set.Add("172.16.0.0/12"));
+  ASSERT_OK(set.Add("1.2.3.4"));
+  ASSERT_OK(set.Add("2001:db8::/32"));
+  ASSERT_OK(set.Add("fe80::1/128"));
+  ASSERT_OK(set.Add("::ffff:100.64.0.0/106"));
+  EXPECT_EQ(set.size(), 7);
+
+  auto contains = [&set](absl::string_view str) {
+    auto ip = IpAddress::ParseFromString(str);
+    EXPECT_TRUE(ip.ok()) << str;
+    return ip.ok() && set.Contains(ip.value());
+  };
+  EXPECT_TRUE(contains("10.0.0.0"));
+  EXPECT_TRUE(contains("10.255.255.255"));
+  EXPECT_FALSE(contains("11.0.0.0"));
+  EXPECT_FALSE(contains("9.255.255.255"));
+  EXPECT_TRUE(contains("192.168.1.77"));
+  EXPECT_FALSE(contains("192.168.2.1"));
+  EXPECT_TRUE(contains("172.16.0.1"));
+  EXPECT_TRUE(contains("172.31.255.255"));
+  EXPECT_FALSE(contains("172.32.0.0"));
+  EXPECT_FALSE(contains("172.15.255.255"));
+  EXPECT_TRUE(contains("1.2.3.4"));
+  EXPECT_FALSE(contains("1.2.3.5"));
+  EXPECT_TRUE(contains("100.64.0.1"));
+  EXPECT_TRUE(contains("100.127.255.255"));
+  EXPECT_FALSE(contains("100.128.0.0"));
+  EXPECT_TRUE(contains("2001:db8::1"));
+  EXPECT_TRUE(contains("2001:db8:ffff::1"));
+  EXPECT_FALSE(contains("2001:db9::1"));
+  EXPECT_TRUE(contains("fe80::1"));
+  EXPECT_FALSE(contains("fe80::2"));
+  EXPECT_FALSE(contains("::1"));
+  // IPv4 addresses match only the IPv4 prefixes.
+  EXPECT_FALSE(contains("::10.0.0.1"));
+  EXPECT_TRUE(contains("::ffff:10.0.0.1"));
+
+  // Prefixes covering all the v4-mapped addresses.
+  IpPrefixSet v6_all;
+  ASSERT_OK(v6_all.Add("::/0"));
+  EXPECT_TRUE(v6_all.Contains(IpAddress::kIPv4Localhost));
+  EXPECT_TRUE(v6_all.Contains(IpAddress::kIPv6Localhost));
+  IpPrefixSet v4_all;
+  ASSERT_OK(v4_all.Add("0.0.0.0/0"));
+  EXPECT_TRUE(v4_all.Contains(IpAddress::kIPv4Localhost));
+  EXPECT_FALSE(v4_all.Contains(IpAddress::kIPv6Localhost));
+  IpPrefixSet v4_mapped;
+  ASSERT_OK(v4_mapped.Add("::ffff:0:0/95"));
+  EXPECT_TRUE(v4_mapped.Contains(IpAddress::kIPv4Localhost));
+  EXPECT_FALSE(v4_mapped.Contains(IpAddress::kIPv6Localhost));
+
+  EXPECT_RAISES(set.Add("10.0.0.0/33"), InvalidArgument);
+  EXPECT_RAISES(set.Add("2001:db8::/129"), InvalidArgument);
+  EXPECT_RAISES(set.Add("10.0.0.0/"), InvalidArgument);
+  EXPECT_RAISES(set.Add("10.0.0/8"), InvalidArgument);
+  EXPECT_RAISES(IpPrefixSet::ParseFromStrings({"10.0.0.0/8", "foo"}).status(),
+                InvalidArgument);
+}
+
+TEST(IpPrefixSet, MatchesLinearScan) {
+  // Random prefixes, checked against the straightforward prefix match.
+  std::vector<std::pair<IpAddress, size_t>> prefixes;
+  IpPrefixSet set;
+  uint32_t seed = 17;
+  auto next = [&seed]() {
+    seed = seed * 1103515245 + 12345;
+    return seed;
+  };
+  for (size_t i = 0; i < 200; ++i) {
+    const uint32_t addr = next() & 0x0f0f0f0f;
+    const size_t prefix_len = 4 + next() % 29;
+    prefixes.emplace_back(IpAddress(addr), prefix_len);
+    ASSERT_OK(set.Add(IpAddress(addr), prefix_len));
+  }
+  for (size_t i = 0; i < 10000; ++i) {
+    const IpAddress ip(next() & 0x0f0f0f0f);
+    bool expected = false;
+    for (const auto& prefix : prefixes) {
+      const size_t shift = 32 - prefix.second;
+      if ((ip.ipv4() >> shift) == (prefix.first.ipv4() >> shift)) {
+        expected = true;
+        break;
+      }
+    }
+    EXPECT_EQ(set.Contains(ip), expected) << ip;
+  }
+}
+
 TEST(IpAddress, LocalLink) {
   {
     ASSERT_OK_AND_ASSIGN(auto ip, IpAddress::ParseFromString("127.0.0.3"));
@@ -84,6 +213,11 @@ TEST(IpAddress, SockAddr) {
     EXPECT_EQ(addr.ss_family, AF_INET);
     EXPECT_EQ((reinterpret_cast<struct sockaddr_in*>(&addr))->sin_addr.s_addr,
               htonl(0x7f000003));
+    ASSERT_OK_AND_ASSIGN(
+        auto parsed,
+        IpAddress::ParseFromSockAddr(reinterpret_cast<const sockaddr*>(&addr),
+                                     sizeof(addr)));
+    EXPECT_EQ(parsed, ip);
   }
   {
     ASSERT_OK_AND_ASSIGN(
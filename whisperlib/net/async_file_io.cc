@@ -0,0 +1,395 @@
+#include "whisperlib/net/async_file_io.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif  // __linux__
+
+#include "absl/container/inlined_vector.h"
+#include "absl/log/log.h"
+#include "whisperlib/io/errno.h"
+#include "whisperlib/net/selector_loop.h"
+#include "whisperlib/status/status.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+enum class Operation : uint8_t { READ, WRITE, FSYNC, FDATASYNC };
+
+absl::string_view OperationName(Operation operation) {
+  switch (operation) {
+    case Operation::READ:
+      return "read";
+    case Operation::WRITE:
+      return "write";
+    case Operation::FSYNC:
+      return "fsync";
+    case Operation::FDATASYNC:
+      return "fdatasync";
+  }
+  return "unknown";
+}
+
+absl::StatusOr<size_t> OperationResult(Operation operation, int fd,
+                                       int64_t result, int error) {
+  if (result < 0) {
+    return absl::Status(error::ErrnoToStatus(error)
+                        << "Asynchronous " << OperationName(operation)
+                        << " failed for file descriptor: " << fd);
+  }
+  return size_t(result);
+}
+
+// Runs an operation with blocking calls - for the pool of threads.
+absl::StatusOr<size_t> RunOperation(Operation operation, int fd,
+                                    int64_t offset, uint64_t addr,
+                                    size_t size) {
+  // Set for an invalid operation.
+  int64_t result = -1;
+  errno = EINVAL;
+  do {
+    switch (operation) {
+      case Operation::READ:
+        result = ::pread(fd, reinterpret_cast<void*>(addr), size, offset);
+        break;
+      case Operation::WRITE:
+        result =
+            ::pwrite(fd, reinterpret_cast<const void*>(addr), size, offset);
+        break;
+      case Operation::FSYNC:
+        result = ::fsync(fd);
+        break;
+      case Operation::FDATASYNC:
+#ifdef __linux__
+        result = ::fdatasync(fd);
+#else
+        result = ::fsync(fd);
+#endif  // __linux__
+        break;
+    }
+  } while (result < 0 && errno == EINTR);
+  return OperationResult(operation, fd, result, errno);
+}
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<AsyncFileIo>> AsyncFileIo::Create(
+    Selector* selector, Params params) {
+  auto file_io = absl::WrapUnique(new AsyncFileIo(selector, std::move(params)));
+  RETURN_IF_ERROR(file_io->Initialize());
+  return file_io;
+}
+
+AsyncFileIo::AsyncFileIo(Selector* selector, Params params)
+    : Selectable(selector), params_(std::move(params)) {}
+
+AsyncFileIo::~AsyncFileIo() {
+  Close();
+  pool_.reset();
+}
+
+absl::Status AsyncFileIo::Initialize() {
+  if (params_.use_io_uring) {
+    const absl::Status status = InitializeIoUring();
+    if (status.ok()) {
+      return absl::OkStatus();
+    }
+    LOG(WARNING) << "Cannot use io_uring for asynchronous file operations, "
+                    "using a pool of threads instead: "
+                 << status;
+    Close();
+  }
+  ASSIGN_OR_RETURN(pool_,
+                   work::ThreadPool::Create(work::ThreadPool::Params()
+                                                .set_num_threads(std::max(
+                                                    params_.num_threads,
+                                                    size_t(1)))),
+                   _ << "Creating the pool of threads for file operations.");
+  return absl::OkStatus();
+}
+
+#ifdef HAVE_IO_URING
+absl::Status AsyncFileIo::InitializeIoUring() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  const int ring_fd = ::syscall(
+      __NR_io_uring_setup,
+      std::max<uint32_t>(std::min<size_t>(params_.queue_depth, 4096), 1),
+      &params);
+  if (ring_fd < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Creating io_uring file descriptor during io_uring_setup(..)";
+  }
+  ring_fd_ = ring_fd;
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+  void* sq_ring = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd_,
+                         IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Mapping io_uring submission queue ring.";
+  }
+  sq_ring_ = sq_ring;
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    void* cq_ring = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring_fd_,
+                           IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      return error::ErrnoToStatus(error::Errno())
+             << "Mapping io_uring completion queue ring.";
+    }
+    cq_ring_ = cq_ring;
+  }
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Mapping io_uring submission queue entries.";
+  }
+  sqes_ = sqes;
+
+  char* const sq_ptr = reinterpret_cast<char*>(sq_ring_);
+  sq_head_ = reinterpret_cast<uint32_t*>(sq_ptr + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<uint32_t*>(sq_ptr + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<uint32_t*>(sq_ptr + params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  // We always use the submission entries in order.
+  uint32_t* const sq_array =
+      reinterpret_cast<uint32_t*>(sq_ptr + params.sq_off.array);
+  for (uint32_t i = 0; i < sq_entries_; ++i) {
+    sq_array[i] = i;
+  }
+  char* const cq_ptr = reinterpret_cast<char*>(cq_ring_);
+  cq_head_ = reinterpret_cast<uint32_t*>(cq_ptr + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<uint32_t*>(cq_ptr + params.cq_off.tail);
+  cqes_ = cq_ptr + params.cq_off.cqes;
+  cq_mask_ = *reinterpret_cast<uint32_t*>(cq_ptr + params.cq_off.ring_mask);
+
+  event_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd_ < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Creating ::eventfd(..) for io_uring completions.";
+  }
+#ifdef __NR_io_uring_register
+  if (::syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_EVENTFD,
+                &event_fd_, 1) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Registering the eventfd w/ io_uring.";
+  }
+#else
+  return status::UnimplementedErrorBuilder()
+         << "io_uring_register not available for the completion eventfd.";
+#endif  // __NR_io_uring_register
+  RETURN_IF_ERROR(selector()->Register(this))
+      << "Registering the io_uring eventfd w/ the selector.";
+  return absl::OkStatus();
+}
+
+void AsyncFileIo::Submit(uint8_t opcode, int fd, int64_t offset,
+                         uint64_t addr, size_t size, uint32_t flags,
+                         Callback callback) {
+  const uint32_t tail = *sq_tail_;
+  if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+    // We submit each entry right away, so this is unlikely.
+    selector()->RunInSelectLoop(
+        [callback = std::move(callback)]() mutable {
+          std::move(callback)(status::ResourceExhaustedErrorBuilder()
+                              << "io_uring submission queue is full.");
+        });
+    return;
+  }
+  const uint64_t id = next_id_++;
+  struct io_uring_sqe* const sqe =
+      &reinterpret_cast<struct io_uring_sqe*>(sqes_)[tail & sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->off = offset;
+  sqe->addr = addr;
+  sqe->len = size;
+  sqe->fsync_flags = flags;
+  sqe->user_data = id;
+  callbacks_.emplace(id, std::move(callback));
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  int result;
+  do {
+    result = ::syscall(__NR_io_uring_enter, ring_fd_, 1, 0, 0, nullptr, 0);
+  } while (result < 0 && errno == EINTR);
+  if (result < 1) {
+    // Not consumed by the kernel (which reads the entries only in
+    // io_uring_enter) - we take the entry back, so none is left behind,
+    // and fail the operation.
+    const absl::Status status =
+        error::ErrnoToStatus(result < 0 ? error::Errno() : EAGAIN)
+        << "Submitting to io_uring.";
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    auto it = callbacks_.find(id);
+    selector()->RunInSelectLoop(
+        [callback = std::move(it->second), status]() mutable {
+          std::move(callback)(status);
+        });
+    callbacks_.erase(it);
+  }
+}
+
+void AsyncFileIo::ProcessCompletions() {
+  // The callbacks run after we are done w/ the completion queue, as these
+  // may queue other operations, or even delete us.
+  absl::InlinedVector<std::pair<Callback, absl::StatusOr<size_t>>, 16>
+      completed;
+  uint32_t head = *cq_head_;
+  while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    const struct io_uring_cqe cqe =
+        reinterpret_cast<const struct io_uring_cqe*>(cqes_)[head & cq_mask_];
+    ++head;
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    auto it = callbacks_.find(cqe.user_data);
+    if (it == callbacks_.end()) {
+      continue;
+    }
+    if (cqe.res < 0) {
+      completed.emplace_back(
+          std::move(it->second),
+          absl::Status(error::ErrnoToStatus(-cqe.res)
+                       << "Asynchronous io_uring file operation failed."));
+    } else {
+      completed.emplace_back(std::move(it->second), size_t(cqe.res));
+    }
+    callbacks_.erase(it);
+  }
+  for (auto& [callback, result] : completed) {
+    std::move(callback)(std::move(result));
+  }
+}
+#else
+absl::Status AsyncFileIo::InitializeIoUring() {
+  return status::UnimplementedErrorBuilder(
+      "io_uring not supported on this system");
+}
+void AsyncFileIo::Submit(uint8_t opcode, int fd, int64_t offset,
+                         uint64_t addr, size_t size, uint32_t flags,
+                         Callback callback) {}
+void AsyncFileIo::ProcessCompletions() {}
+#endif  // HAVE_IO_URING
+
+bool AsyncFileIo::HandleReadEvent(SelectorEventData event) {
+  uint64_t value;
+  while (::read(event_fd_, &value, sizeof(value)) > 0) {
+  }
+  ProcessCompletions();
+  return true;
+}
+
+void AsyncFileIo::Close() {
+#ifdef HAVE_IO_URING
+  if (ring_fd_ >= 0 && cq_head_ != nullptr) {
+    // The kernel may still use the buffers of the operations in flight.
+    while (!callbacks_.empty()) {
+      const int result = ::syscall(__NR_io_uring_enter, ring_fd_, 0, 1,
+                                   IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (result < 0 && errno != EINTR) {
+        LOG(WARNING) << "Waiting for io_uring completions: "
+                     << error::ErrnoToString(error::Errno());
+        break;
+      }
+      ProcessCompletions();
+    }
+  }
+#endif  // HAVE_IO_URING
+  if (event_fd_ >= 0) {
+    if (selector() != nullptr) {
+      selector()->Unregister(this).IgnoreError();
+    }
+    ::close(event_fd_);
+    event_fd_ = kInvalidFdValue;
+  }
+  if (sqes_ != nullptr) {
+    ::munmap(sqes_, sqes_size_);
+    sqes_ = nullptr;
+  }
+  if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+    ::munmap(cq_ring_, cq_ring_size_);
+  }
+  cq_ring_ = nullptr;
+  cq_head_ = nullptr;
+  if (sq_ring_ != nullptr) {
+    ::munmap(sq_ring_, sq_ring_size_);
+    sq_ring_ = nullptr;
+  }
+  if (ring_fd_ >= 0) {
+    ::close(ring_fd_);
+    ring_fd_ = kInvalidFdValue;
+  }
+}
+
+void AsyncFileIo::ReadAsync(int fd, int64_t offset, void* buffer, size_t size,
+                            Callback callback) {
+#ifdef HAVE_IO_URING
+  if (uses_io_uring()) {
+    Submit(IORING_OP_READ, fd, offset, reinterpret_cast<uint64_t>(buffer),
+           size, 0, std::move(callback));
+    return;
+  }
+#endif  // HAVE_IO_URING
+  pool_->SubmitWithReply(
+      selector(),
+      [fd, offset, buffer, size]() {
+        return RunOperation(Operation::READ, fd, offset,
+                            reinterpret_cast<uint64_t>(buffer), size);
+      },
+      std::move(callback));
+}
+
+void AsyncFileIo::WriteAsync(int fd, int64_t offset, const void* buffer,
+                             size_t size, Callback callback) {
+#ifdef HAVE_IO_URING
+  if (uses_io_uring()) {
+    Submit(IORING_OP_WRITE, fd, offset, reinterpret_cast<uint64_t>(buffer),
+           size, 0, std::move(callback));
+    return;
+  }
+#endif  // HAVE_IO_URING
+  pool_->SubmitWithReply(
+      selector(),
+      [fd, offset, buffer, size]() {
+        return RunOperation(Operation::WRITE, fd, offset,
+                            reinterpret_cast<uint64_t>(buffer), size);
+      },
+      std::move(callback));
+}
+
+void AsyncFileIo::FsyncAsync(int fd, bool data_only, Callback callback) {
+#ifdef HAVE_IO_URING
+  if (uses_io_uring()) {
+    Submit(IORING_OP_FSYNC, fd, 0, 0, 0,
+           data_only ? IORING_FSYNC_DATASYNC : 0, std::move(callback));
+    return;
+  }
+#endif  // HAVE_IO_URING
+  pool_->SubmitWithReply(
+      selector(),
+      [fd, data_only]() {
+        return RunOperation(
+            data_only ? Operation::FDATASYNC : Operation::FSYNC, fd, 0, 0, 0);
+      },
+      std::move(callback));
+}
+
+}  // namespace net
+}  // namespace whisper
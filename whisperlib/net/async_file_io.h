@@ -0,0 +1,136 @@
+#ifndef WHISPERLIB_NET_ASYNC_FILE_IO_H_
+#define WHISPERLIB_NET_ASYNC_FILE_IO_H_
+
+#include <cstdint>
+#include <memory>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/functional/any_invocable.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "whisperlib/net/selectable.h"
+#include "whisperlib/net/selector.h"
+#include "whisperlib/sync/thread_pool.h"
+
+namespace whisper {
+namespace net {
+
+// Reads, writes and syncs files w/o blocking the select loop of a Selector,
+// with the completion callbacks run in the select loop.
+// Uses an io_uring (on Linux), whose completions are signaled through an
+// eventfd registered w/ the selector, or, where that is not available, a
+// pool of threads doing the blocking calls, which post the completions via
+// Selector::RunInSelectLoop.
+//
+// The operations are positional (as ::pread / ::pwrite), so they do not
+// change, nor depend on, the file position, and the buffers must be kept
+// valid until the completion callback is called.
+// Create one per selector, and call it only from its select loop thread.
+//
+// Example:
+//   file_io->ReadAsync(file->fd(), offset, buffer, size,
+//       [this](absl::StatusOr<size_t> result) {
+//         if (result.ok()) connection_->Write(...);
+//       });
+class AsyncFileIo : private Selectable {
+ public:
+  // Receives the number of bytes read (0 at the end of the file) or written
+  // or 0 for syncs - or the error of the operation.
+  using Callback = absl::AnyInvocable<void(absl::StatusOr<size_t>) &&>;
+
+  struct Params {
+    // Uses an io_uring if available, else a pool of threads.
+    bool use_io_uring = true;
+    // Number of entries in the io_uring submission queue.
+    size_t queue_depth = 128;
+    // Number of threads in the pool, if used.
+    size_t num_threads = 2;
+
+    Params& set_use_io_uring(bool value) {
+      use_io_uring = value;
+      return *this;
+    }
+    Params& set_queue_depth(size_t value) {
+      queue_depth = value;
+      return *this;
+    }
+    Params& set_num_threads(size_t value) {
+      num_threads = value;
+      return *this;
+    }
+  };
+
+  // Creates the engine for the provided selector - call w/ a stopped
+  // selector or from its select loop.
+  static absl::StatusOr<std::unique_ptr<AsyncFileIo>> Create(
+      Selector* selector, Params params);
+  // Waits for the operations in flight to complete - with io_uring their
+  // callbacks are run, while with a pool they are posted to the selector.
+  ~AsyncFileIo();
+
+  // Reads at most size bytes from fd, starting at offset, in buffer.
+  void ReadAsync(int fd, int64_t offset, void* buffer, size_t size,
+                 Callback callback);
+  // Writes at most size bytes from buffer to fd, starting at offset.
+  void WriteAsync(int fd, int64_t offset, const void* buffer, size_t size,
+                  Callback callback);
+  // Flushes the data of fd to the disk - and the metadata, if not
+  // data_only.
+  void FsyncAsync(int fd, bool data_only, Callback callback);
+
+  // If an io_uring is used, else a pool of threads.
+  bool uses_io_uring() const { return ring_fd_ >= 0; }
+  // Number of io_uring operations in flight.
+  size_t num_in_flight() const { return callbacks_.size(); }
+
+ private:
+  AsyncFileIo(Selector* selector, Params params);
+
+  absl::Status Initialize();
+  absl::Status InitializeIoUring();
+
+  ////////// Selectable interface - for the io_uring eventfd.
+  bool HandleReadEvent(SelectorEventData event) override;
+  int GetFd() const override { return event_fd_; }
+  void Close() override;
+
+  // Queues an io_uring operation, and submits it to the kernel.
+  void Submit(uint8_t opcode, int fd, int64_t offset, uint64_t addr,
+              size_t size, uint32_t flags, Callback callback);
+  // Runs the callbacks of the completed io_uring operations.
+  void ProcessCompletions();
+
+  const Params params_;
+
+  // The io_uring, if used.
+  int ring_fd_ = kInvalidFdValue;
+  int event_fd_ = kInvalidFdValue;
+  void* sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  void* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  uint32_t* sq_head_ = nullptr;
+  uint32_t* sq_tail_ = nullptr;
+  uint32_t sq_mask_ = 0;
+  uint32_t sq_entries_ = 0;
+  uint32_t* cq_head_ = nullptr;
+  uint32_t* cq_tail_ = nullptr;
+  void* cqes_ = nullptr;
+  uint32_t cq_mask_ = 0;
+  // Callbacks of the io_uring operations in flight, by their user data.
+  absl::flat_hash_map<uint64_t, Callback> callbacks_;
+  uint64_t next_id_ = 1;
+
+  // Else, the pool of threads.
+  std::unique_ptr<work::ThreadPool> pool_;
+
+  AsyncFileIo(const AsyncFileIo&) = delete;
+  AsyncFileIo& operator=(const AsyncFileIo&) = delete;
+};
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_ASYNC_FILE_IO_H_
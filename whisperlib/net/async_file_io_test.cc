@@ -0,0 +1,104 @@
+#include "whisperlib/net/async_file_io.h"
+
+#include <string>
+
+#include "absl/synchronization/notification.h"
+#include "gtest/gtest.h"
+#include "whisperlib/io/file.h"
+#include "whisperlib/io/path.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+// Runs op in the select loop, waiting for the result in its callback.
+absl::StatusOr<size_t> RunAndWait(
+    Selector* selector,
+    absl::AnyInvocable<void(AsyncFileIo::Callback) &&> op) {
+  absl::StatusOr<size_t> result;
+  absl::Notification done;
+  selector->RunInSelectLoop([&op, &result, &done]() {
+    std::move(op)([&result, &done](absl::StatusOr<size_t> r) {
+      result = std::move(r);
+      done.Notify();
+    });
+  });
+  done.WaitForNotification();
+  return result;
+}
+
+void TestReadWrite(bool use_io_uring, absl::string_view name) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  Selector* const selector = thread->selector();
+  ASSERT_OK_AND_ASSIGN(
+      auto file_io,
+      AsyncFileIo::Create(
+          selector, AsyncFileIo::Params().set_use_io_uring(use_io_uring)));
+  if (!use_io_uring) {
+    EXPECT_FALSE(file_io->uses_io_uring());
+  }
+  ASSERT_TRUE(thread->Start());
+
+  io::File file;
+  ASSERT_OK(file.Open(path::Join(testing::TempDir(), name),
+                      io::File::GENERIC_READ_WRITE, io::File::CREATE_ALWAYS));
+  const int fd = file.fd();
+  const std::string data(10000, 'a');
+  const std::string tail = "0123456789";
+  AsyncFileIo* const io = file_io.get();
+  size_t size;
+  ASSERT_OK_AND_ASSIGN(
+      size, RunAndWait(selector, [&](AsyncFileIo::Callback callback) {
+        io->WriteAsync(fd, 0, data.data(), data.size(), std::move(callback));
+      }));
+  EXPECT_EQ(size, data.size());
+  ASSERT_OK_AND_ASSIGN(
+      size, RunAndWait(selector, [&](AsyncFileIo::Callback callback) {
+        io->WriteAsync(fd, data.size(), tail.data(), tail.size(),
+                       std::move(callback));
+      }));
+  EXPECT_EQ(size, tail.size());
+  ASSERT_OK_AND_ASSIGN(
+      size, RunAndWait(selector, [&](AsyncFileIo::Callback callback) {
+        io->FsyncAsync(fd, true, std::move(callback));
+      }));
+  EXPECT_EQ(size, 0);
+
+  char buffer[100];
+  ASSERT_OK_AND_ASSIGN(
+      size, RunAndWait(selector, [&](AsyncFileIo::Callback callback) {
+        io->ReadAsync(fd, data.size() - 5, buffer, sizeof(buffer),
+                      std::move(callback));
+      }));
+  EXPECT_EQ(std::string(buffer, size), "aaaaa0123456789");
+  // At the end of the file.
+  ASSERT_OK_AND_ASSIGN(
+      size, RunAndWait(selector, [&](AsyncFileIo::Callback callback) {
+        io->ReadAsync(fd, 2 * data.size(), buffer, sizeof(buffer),
+                      std::move(callback));
+      }));
+  EXPECT_EQ(size, 0);
+  // Bad file descriptor.
+  EXPECT_FALSE(RunAndWait(selector, [&](AsyncFileIo::Callback callback) {
+                 io->ReadAsync(-1, 0, buffer, sizeof(buffer),
+                               std::move(callback));
+               }).ok());
+  EXPECT_EQ(file_io->num_in_flight(), 0);
+
+  absl::Notification deleted;
+  selector->RunInSelectLoop([&file_io, &deleted]() {
+    file_io.reset();
+    deleted.Notify();
+  });
+  deleted.WaitForNotification();
+  EXPECT_TRUE(thread->Stop());
+}
+}  // namespace
+
+TEST(AsyncFileIo, IoUring) { TestReadWrite(true, "async_file_io_uring"); }
+
+TEST(AsyncFileIo, ThreadPool) { TestReadWrite(false, "async_file_io_pool"); }
+
+}  // namespace net
+}  // namespace whisper
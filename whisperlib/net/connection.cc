@@ -1,13 +1,23 @@
 #include "whisperlib/net/connection.h"
 
 #include <fcntl.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#endif  // __linux__
 #include <netinet/tcp.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include "absl/functional/bind_front.h"
+#include "absl/synchronization/notification.h"
 #include "whisperlib/base/call_on_return.h"
+#include "whisperlib/io/cord_io.h"
 #include "whisperlib/io/errno.h"
+#include "whisperlib/net/dns_client.h"
 
 namespace whisper {
 namespace net {
@@ -34,6 +44,18 @@ size_t SockAddrLen(const sockaddr_storage& addr) {
   return addr.ss_family == AF_INET ? sizeof(struct sockaddr_in)
                                    : sizeof(struct sockaddr_in6);
 }
+// Like HostPort::ToSockAddr, but also accepts port 0, for binding to a
+// system chosen port.
+absl::Status ToBindSockAddr(const HostPort& host_port,
+                            sockaddr_storage* addr) {
+  if (host_port.ip().has_value() && host_port.port().has_value() &&
+      host_port.port().value() == 0) {
+    memset(addr, 0, sizeof(*addr));
+    host_port.ip().value().ToSockAddr(addr);
+    return absl::OkStatus();
+  }
+  return host_port.ToSockAddr(addr);
+}
 
 Acceptor::~Acceptor() {
   // The super class should call Close() in destructor;
@@ -158,6 +180,16 @@ absl::string_view Connection::CloseDirectiveName(CloseDirective value) {
 }
 
 Connection::Connection(Selector* net_selector) : net_selector_(net_selector) {}
+Connection::~Connection() {
+  if (net_selector_ == nullptr) {
+    return;
+  }
+  if (max_output_close_alarm_.has_value()) {
+    net_selector_->UnregisterAlarm(max_output_close_alarm_.value());
+  }
+  // E.g. for output written after the close, which nobody sends anymore.
+  net_selector_->AddBufferedOutput(-static_cast<int64_t>(accounted_output_));
+}
 
 const Selector* Connection::net_selector() const { return net_selector_; }
 Selector* Connection::net_selector() { return net_selector_; }
@@ -177,6 +209,9 @@ int64_t Connection::count_bytes_read() const {
 }
 absl::Cord* Connection::inbuf() { return &inbuf_; }
 absl::Cord* Connection::outbuf() { return &outbuf_; }
+bool Connection::has_pending_output() const {
+  return !outbuf_.empty() || !out_files_.empty();
+}
 
 Connection& Connection::set_connect_handler(ConnectHandler handler) {
   connect_handler_ = std::move(handler);
@@ -215,24 +250,162 @@ Connection& Connection::clear_all_handlers() {
   read_handler_ = nullptr;
   write_handler_ = nullptr;
   close_handler_ = nullptr;
+  output_watermark_handler_ = nullptr;
+  return *this;
+}
+
+Connection& Connection::set_output_watermarks(size_t low, size_t high) {
+  CHECK_LE(low, high) << "Output watermarks out of order for: " << ToString();
+  output_low_watermark_ = low;
+  output_high_watermark_ = high;
+  return *this;
+}
+Connection& Connection::set_output_watermark_handler(
+    OutputWatermarkHandler handler) {
+  output_watermark_handler_ = std::move(handler);
+  return *this;
+}
+Connection& Connection::clear_output_watermark_handler() {
+  output_watermark_handler_ = nullptr;
+  return *this;
+}
+Connection& Connection::set_max_pending_output(size_t value) {
+  max_pending_output_ = value;
   return *this;
 }
+size_t Connection::PendingOutputSize() const {
+  size_t size = outbuf_.size();
+  for (const auto& out_file : out_files_) {
+    size += out_file->size + out_file->next.size();
+  }
+  return size;
+}
 
 void Connection::Write(const absl::Cord& buffer) {
-  outbuf()->Append(buffer);
-  LOG_IF_ERROR(WARNING, RequestWriteEvents(true));
+  output_tail()->Append(buffer);
+  if (cork_depth_ == 0) {
+    LOG_IF_ERROR(WARNING, RequestWriteEvents(true));
+  }
+  CheckPendingOutput();
 }
 void Connection::Write(absl::Cord&& buffer) {
-  outbuf()->Append(buffer);
-  LOG_IF_ERROR(WARNING, RequestWriteEvents(true));
+  output_tail()->Append(std::move(buffer));
+  if (cork_depth_ == 0) {
+    LOG_IF_ERROR(WARNING, RequestWriteEvents(true));
+  }
+  CheckPendingOutput();
 }
 void Connection::Write(absl::string_view buffer) {
-  outbuf()->Append(buffer);
-  LOG_IF_ERROR(WARNING, RequestWriteEvents(true));
+  output_tail()->Append(buffer);
+  if (cork_depth_ == 0) {
+    LOG_IF_ERROR(WARNING, RequestWriteEvents(true));
+  }
+  CheckPendingOutput();
 }
 void Connection::Write(std::string&& buffer) {
-  outbuf()->Append(buffer);
-  LOG_IF_ERROR(WARNING, RequestWriteEvents(true));
+  output_tail()->Append(std::move(buffer));
+  if (cork_depth_ == 0) {
+    LOG_IF_ERROR(WARNING, RequestWriteEvents(true));
+  }
+  CheckPendingOutput();
+}
+
+absl::Status Connection::WriteFile(const io::File& file, int64_t offset,
+                                   size_t length) {
+  RET_CHECK(file.is_open()) << "Writing a closed file to: " << ToString();
+  RET_CHECK(offset >= 0) << "Invalid file offset: " << offset;
+  if (length == 0) {
+    return absl::OkStatus();
+  }
+  auto out_file = absl::make_unique<OutputFile>();
+  out_file->fd = ::fcntl(file.fd(), F_DUPFD_CLOEXEC, 0);
+  if (out_file->fd < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Duplicating the descriptor of: " << file.filename()
+           << " for writing to: " << ToString();
+  }
+  out_file->offset = offset;
+  out_file->size = length;
+  out_files_.emplace_back(std::move(out_file));
+  if (cork_depth_ == 0) {
+    LOG_IF_ERROR(WARNING, RequestWriteEvents(true));
+  }
+  CheckPendingOutput();
+  return absl::OkStatus();
+}
+
+void Connection::Cork() {
+  if (cork_depth_++ == 0) {
+    LOG_IF_ERROR(WARNING, SetCorked(true));
+  }
+}
+void Connection::Uncork() {
+  if (ABSL_PREDICT_FALSE(cork_depth_ == 0)) {
+    LOG(ERROR) << "Uncork() without Cork() for: " << ToString();
+    return;
+  }
+  if (--cork_depth_ > 0) {
+    return;
+  }
+  LOG_IF_ERROR(WARNING, SetCorked(false));
+  if (has_pending_output()) {
+    LOG_IF_ERROR(WARNING, RequestWriteEvents(true));
+  }
+}
+absl::Status Connection::SetCorked(bool corked) { return absl::OkStatus(); }
+
+Connection::OutputFile::~OutputFile() {
+  if (fd != io::File::kInvalidFdValue) {
+    ::close(fd);
+  }
+}
+absl::Cord* Connection::output_tail() {
+  return out_files_.empty() ? &outbuf_ : &out_files_.back()->next;
+}
+void Connection::ConsumeOutputFile(size_t size) {
+  CHECK(!out_files_.empty());
+  OutputFile* const out_file = out_files_.front().get();
+  CHECK_LE(size, out_file->size);
+  out_file->offset += size;
+  out_file->size -= size;
+  if (out_file->size == 0) {
+    outbuf_.Append(std::move(out_file->next));
+    out_files_.pop_front();
+  }
+}
+absl::StatusOr<size_t> Connection::ReadOutputFile(size_t size) {
+  RET_CHECK(!out_files_.empty());
+  const OutputFile& out_file = *out_files_.front();
+  const size_t to_read = std::min(size, out_file.size);
+  char* buffer = new char[to_read];
+  base::CallOnReturn clear_buffer([buffer]() { delete[] buffer; });
+  const ssize_t cb = ::pread(out_file.fd, buffer, to_read, out_file.offset);
+  if (cb < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Reading queued file for: " << ToString();
+  }
+  if (cb == 0) {
+    return status::OutOfRangeErrorBuilder()
+           << "Queued file ended with: " << out_file.size
+           << " bytes still to send, for: " << ToString();
+  }
+  outbuf_.Append(absl::MakeCordFromExternal(absl::string_view(buffer, cb),
+                                            clear_buffer.reset()));
+  ConsumeOutputFile(cb);
+  return cb;
+}
+size_t Connection::MoveOutputTo(Connection* dest) {
+  size_t size = outbuf_.size();
+  dest->output_tail()->Append(std::move(outbuf_));
+  outbuf_.Clear();
+  for (auto& out_file : out_files_) {
+    size += out_file->size + out_file->next.size();
+    dest->out_files_.emplace_back(std::move(out_file));
+  }
+  out_files_.clear();
+  CheckPendingOutput();
+  dest->CheckPendingOutput();
+  return size;
 }
 
 void Connection::set_net_selector(Selector* value) {
@@ -255,6 +428,55 @@ void Connection::inc_bytes_written(int64_t value) {
   count_bytes_written_.fetch_add(value);
 }
 
+void Connection::CheckPendingOutput() {
+  // Only our own buffers are accounted in the selector - the wrapped
+  // connections (e.g. for SSL) account theirs.
+  const size_t own_size = Connection::PendingOutputSize();
+  if (net_selector_ != nullptr && own_size != accounted_output_) {
+    net_selector_->AddBufferedOutput(static_cast<int64_t>(own_size) -
+                                     static_cast<int64_t>(accounted_output_));
+    accounted_output_ = own_size;
+  }
+  const size_t size = PendingOutputSize();
+  if (state() == DISCONNECTED) {
+    // Nothing to throttle anymore - the close handler is next.
+    output_above_high_ = false;
+    return;
+  }
+  if (max_pending_output_.has_value() && size > *max_pending_output_) {
+    if (!max_output_close_alarm_.has_value()) {
+      set_last_error(status::ResourceExhaustedErrorBuilder()
+                     << "Pending output of: " << size
+                     << " bytes over the maximum of: " << *max_pending_output_
+                     << " for: " << ToString());
+      // We may be called from Write(), w/ the caller still using us.
+      max_output_close_alarm_ = net_selector_->RegisterAlarm(
+          [this]() {
+            max_output_close_alarm_.reset();
+            ForceClose();
+          },
+          absl::ZeroDuration());
+    }
+    return;
+  }
+  if (output_high_watermark_ == 0) {
+    return;
+  }
+  if (!output_above_high_ && size >= output_high_watermark_) {
+    output_above_high_ = true;
+  } else if (output_above_high_ && size <= output_low_watermark_) {
+    output_above_high_ = false;
+  } else {
+    return;
+  }
+  LOG_IF(INFO, detail_log_) << ToString() << " - Pending output of: " << size
+                            << (output_above_high_ ? " above high" : " at low")
+                            << " watermark.";
+  if (output_watermark_handler_ != nullptr) {
+    output_watermark_handler_(output_above_high_);
+  }
+}
+
 void Connection::CallConnectHandler() {
   if (ABSL_PREDICT_TRUE(connect_handler_ != nullptr)) {
     connect_handler_();
@@ -280,7 +502,9 @@ void Connection::CallCloseHandler(const absl::Status& err,
     close_handler_(err, directive);
   } else {
     LOG_IF(INFO, detail_log_) << ToString() << " - No close handler found.";
-    FlushAndClose();
+    if (state() != DISCONNECTED) {
+      FlushAndClose();
+    }
   }
 }
 
@@ -304,11 +528,77 @@ TcpConnectionParams& TcpConnectionParams::set_block_size(size_t value) {
   block_size = value;
   return *this;
 }
+TcpConnectionParams& TcpConnectionParams::set_adaptive_block_size(
+    bool value) {
+  adaptive_block_size = value;
+  return *this;
+}
+TcpConnectionParams& TcpConnectionParams::set_min_block_size(size_t value) {
+  min_block_size = value;
+  return *this;
+}
+TcpConnectionParams& TcpConnectionParams::set_max_block_size(size_t value) {
+  max_block_size = value;
+  return *this;
+}
+TcpConnectionParams& TcpConnectionParams::set_read_available_size(
+    bool value) {
+  read_available_size = value;
+  return *this;
+}
 TcpConnectionParams& TcpConnectionParams::set_shutdown_linger_timeout(
     absl::Duration value) {
   shutdown_linger_timeout = value;
   return *this;
 }
+TcpConnectionParams& TcpConnectionParams::set_zerocopy_threshold(
+    size_t value) {
+  zerocopy_threshold = value;
+  return *this;
+}
+TcpConnectionParams& TcpConnectionParams::set_socket_busy_poll(
+    absl::Duration value) {
+  socket_busy_poll = value;
+  return *this;
+}
+TcpConnectionParams& TcpConnectionParams::set_dns_client(DnsClient* value) {
+  dns_client = value;
+  return *this;
+}
+TcpConnectionParams& TcpConnectionParams::set_happy_eyeballs(bool value) {
+  happy_eyeballs = value;
+  return *this;
+}
+TcpConnectionParams& TcpConnectionParams::set_connection_attempt_delay(
+    absl::Duration value) {
+  connection_attempt_delay = value;
+  return *this;
+}
+TcpConnectionParams& TcpConnectionParams::set_connect_attempt_function(
+    ConnectAttemptFunction value) {
+  connect_attempt_function = std::move(value);
+  return *this;
+}
+TcpConnectionParams& TcpConnectionParams::set_read_rate_limit(
+    TokenBucket::Params value) {
+  read_rate_limit = std::move(value);
+  return *this;
+}
+TcpConnectionParams& TcpConnectionParams::set_write_rate_limit(
+    TokenBucket::Params value) {
+  write_rate_limit = std::move(value);
+  return *this;
+}
+TcpConnectionParams& TcpConnectionParams::set_shared_read_bucket(
+    std::shared_ptr<TokenBucket> value) {
+  shared_read_bucket = std::move(value);
+  return *this;
+}
+TcpConnectionParams& TcpConnectionParams::set_shared_write_bucket(
+    std::shared_ptr<TokenBucket> value) {
+  shared_write_bucket = std::move(value);
+  return *this;
+}
 TcpConnectionParams& TcpConnectionParams::set_detail_log(bool value) {
   detail_log = value;
   return *this;
@@ -332,21 +622,227 @@ TcpAcceptorParams& TcpAcceptorParams::set_detail_log(bool value) {
   detail_log = value;
   return *this;
 }
+TcpAcceptorParams& TcpAcceptorParams::set_max_accepts_per_event(
+    size_t value) {
+  max_accepts_per_event = value;
+  return *this;
+}
+TcpAcceptorParams& TcpAcceptorParams::set_max_pending_initializations(
+    size_t value) {
+  max_pending_initializations = value;
+  return *this;
+}
+TcpAcceptorParams& TcpAcceptorParams::set_reuse_port(bool value) {
+  reuse_port = value;
+  return *this;
+}
+TcpAcceptorParams& TcpAcceptorParams::set_reuse_port_cpu_steering(
+    bool value) {
+  reuse_port_cpu_steering = value;
+  return *this;
+}
+TcpAcceptorParams& TcpAcceptorParams::set_allowed_peers(
+    std::shared_ptr<const IpPrefixSet> value) {
+  allowed_peers = std::move(value);
+  return *this;
+}
+TcpAcceptorParams& TcpAcceptorParams::set_denied_peers(
+    std::shared_ptr<const IpPrefixSet> value) {
+  denied_peers = std::move(value);
+  return *this;
+}
 
 AcceptorThreads& AcceptorThreads::set_client_threads(
     std::vector<SelectorThread*> client_threads) {
   client_threads_ = std::move(client_threads);
   return *this;
 }
+const std::vector<SelectorThread*>& AcceptorThreads::client_threads() const {
+  return client_threads_;
+}
+
+AcceptorThreads& AcceptorThreads::set_placement_policy(PlacementPolicy value) {
+  placement_policy_ = value;
+  return *this;
+}
+AcceptorThreads& AcceptorThreads::set_placement_function(
+    PlacementFunction value) {
+  placement_function_ = std::move(value);
+  return *this;
+}
+
+template <typename Load>
+size_t AcceptorThreads::PickLeastLoaded(Load load) {
+  // Start from a rotating position, so ties are broken round robin.
+  const size_t start = next_client_thread_.fetch_add(1);
+  const size_t num_threads = client_threads_.size();
+  size_t best = start % num_threads;
+  auto best_load = load(client_threads_[best]->selector());
+  for (size_t i = 1; i < num_threads; ++i) {
+    const size_t index = (start + i) % num_threads;
+    const auto crt_load = load(client_threads_[index]->selector());
+    if (crt_load < best_load) {
+      best = index;
+      best_load = crt_load;
+    }
+  }
+  return best;
+}
 
 Selector* AcceptorThreads::GetNextSelector() {
   if (ABSL_PREDICT_FALSE(client_threads_.empty())) {
     return nullptr;
   }
-  return client_threads_[next_client_thread_.fetch_add(1) %
-                         client_threads_.size()]
-      ->selector();
-}
+  size_t index = 0;
+  if (placement_function_ != nullptr) {
+    index = placement_function_(client_threads_);
+    if (ABSL_PREDICT_FALSE(index >= client_threads_.size())) {
+      LOG_EVERY_N(WARNING, 1000)
+          << "Invalid thread index returned by placement function: " << index;
+      index = index % client_threads_.size();
+    }
+  } else {
+    switch (placement_policy_) {
+      case PlacementPolicy::LEAST_CONNECTIONS:
+        index = PickLeastLoaded([](const Selector* selector) {
+          return selector->num_registered();
+        });
+        break;
+      case PlacementPolicy::LEAST_BUSY:
+        index = PickLeastLoaded([](const Selector* selector) {
+          return selector->loop_utilization();
+        });
+        break;
+      case PlacementPolicy::ROUND_ROBIN:
+      default:
+        index = next_client_thread_.fetch_add(1) % client_threads_.size();
+    }
+  }
+  return client_threads_[index]->selector();
+}
+
+namespace {
+// The acceptor running HandleAccept from a ReusePortListener in this thread.
+thread_local const TcpAcceptor* tls_listener_acceptor = nullptr;
+}  // namespace
+
+struct TcpAcceptor::ListenerHandle {
+  absl::Mutex mutex;
+  // Reset when the acceptor closes its listeners.
+  TcpAcceptor* acceptor ABSL_GUARDED_BY(mutex) = nullptr;
+};
+
+// Listens on a SO_REUSEPORT socket in one of the acceptor threads, and
+// accepts connections for its acceptor right there.
+// The acceptor may go away before we are unregistered from our selector,
+// so we reach it only through the handle, which it detaches on close.
+class TcpAcceptor::ReusePortListener : public Selectable {
+ public:
+  ReusePortListener(Selector* selector, std::shared_ptr<ListenerHandle> handle,
+                    int fd)
+      : Selectable(selector),
+        home_selector_(selector),
+        handle_(std::move(handle)),
+        fd_(fd) {}
+  ~ReusePortListener() { Close(); }
+
+  // The selector we run in - selector() is reset upon unregistering.
+  Selector* home_selector() const { return home_selector_; }
+  // Starts listening in the home selector, from its thread if running
+  // (as per thread), waiting for it.
+  absl::Status Register(const SelectorThread* thread) {
+    if (!thread->is_started() || home_selector_->IsInSelectThread()) {
+      return RegisterNow();
+    }
+    absl::Status status;
+    absl::Notification registered;
+    home_selector_->RunInSelectLoop([this, &status, &registered]() {
+      status = RegisterNow();
+      registered.Notify();
+    });
+    registered.WaitForNotification();
+    return status;
+  }
+
+  bool HandleReadEvent(SelectorEventData event) override {
+    absl::ReaderMutexLock l(&handle_->mutex);
+    if (handle_->acceptor == nullptr) {
+      return true;
+    }
+    tls_listener_acceptor = handle_->acceptor;
+    const bool result = handle_->acceptor->HandleAccept(fd_, selector());
+    tls_listener_acceptor = nullptr;
+    return result;
+  }
+  bool HandleWriteEvent(SelectorEventData event) override {
+    LOG(WARNING) << "HandleWriteEvent called on reuse port server socket";
+    return false;
+  }
+  bool HandleErrorEvent(SelectorEventData event) override {
+    const int value = event.internal_event;
+    absl::ReaderMutexLock l(&handle_->mutex);
+    TcpAcceptor* const acceptor = handle_->acceptor;
+    if (acceptor == nullptr) {
+      return true;
+    }
+    if (selector()->IsAnyHangUpEvent(value)) {
+      acceptor->stats_.hang_ups_handled.fetch_add(1);
+      return true;
+    }
+    if (selector()->IsErrorEvent(value)) {
+      acceptor->stats_.errors_handled.fetch_add(1);
+      const absl::Status status =
+          error::ErrnoToStatus(ExtractSocketErrno(fd_))
+          << " - error detected on reuse port accept socket for: "
+          << acceptor->ToString();
+      // The acceptor closes all its listeners, from its own thread - if
+      // still listening by then (i.e. not detached from the handle, which
+      // happens in the same thread).
+      acceptor->selector()->RunInSelectLoop([handle = handle_, status]() {
+        TcpAcceptor* acceptor = nullptr;
+        {
+          absl::ReaderMutexLock l(&handle->mutex);
+          acceptor = handle->acceptor;
+        }
+        if (acceptor != nullptr) {
+          acceptor->InternalClose(status);
+        }
+      });
+      return false;
+    }
+    return true;
+  }
+  int GetFd() const override { return fd_; }
+  void Close() override {
+    if (fd_ != kInvalidFdValue) {
+      if (registered_) {
+        LOG_IF_ERROR(WARNING, home_selector_->Unregister(this))
+            << "Unregistering reuse port listener from selector.";
+        registered_ = false;
+      }
+      if (::close(fd_) < 0) {
+        LOG(WARNING) << " - ::close failed for reuse port listener: "
+                     << error::ErrnoToString(error::Errno());
+      }
+      fd_ = kInvalidFdValue;
+    }
+  }
+
+ private:
+  absl::Status RegisterNow() {
+    RETURN_IF_ERROR(home_selector_->Register(this))
+        << "Registering reuse port listener with selector.";
+    registered_ = true;
+    return absl::OkStatus();
+  }
+
+  Selector* const home_selector_;
+  // Leads to the acceptor we delegate to, while not detached.
+  const std::shared_ptr<ListenerHandle> handle_;
+  // Listening socket.
+  int fd_;
+  bool registered_ = false;
+};
 
 TcpAcceptor::TcpAcceptor(Selector* selector, TcpAcceptorParams params)
     : Acceptor(),
@@ -357,26 +853,79 @@ TcpAcceptor::TcpAcceptor(Selector* selector, TcpAcceptorParams params)
 TcpAcceptor::~TcpAcceptor() {
   CHECK_EQ(state(), DISCONNECTED) << "Can only delete disconnected acceptors.";
   CHECK_EQ(fd_.load(), kInvalidFdValue);
+  CHECK(listeners_.empty());
 }
 
 const TcpAcceptor::Statistics& TcpAcceptor::stats() const { return stats_; }
 
 absl::Status TcpAcceptor::Listen(const HostPort& local_addr) {
-  RET_CHECK(fd_ == kInvalidFdValue)
+  RET_CHECK(fd_ == kInvalidFdValue && listeners_.empty())
       << "Attempting listening again, with valid socket: " << ToString();
   RET_CHECK(state() == DISCONNECTED)
       << "Attempting listening on non-disconnected acceptor: " << ToString();
+  if (params_.reuse_port) {
+    return ListenReusePort(local_addr);
+  }
 
   struct sockaddr_storage addr;
-  RETURN_IF_ERROR(local_addr.ToSockAddr(&addr))
+  RETURN_IF_ERROR(ToBindSockAddr(local_addr, &addr))
       << "Setting listening address for TCP acceptor";
+  ASSIGN_OR_RETURN(const int fd, CreateListeningSocket(addr));
+  return StartListening(fd);
+}
 
-  // create socket
-  const int fd = ::socket(addr.ss_family, SOCK_STREAM, 0);
-  if (fd_ < 0) {
-    return error::ErrnoToStatus(error::Errno())
-           << "::socket failed for: " << ToString();
+absl::Status TcpAcceptor::ListenOnFds(std::vector<int> fds) {
+  base::CallOnReturn close_fds([this, &fds]() {
+    for (const int fd : fds) {
+      if (::close(fd)) {
+        LOG(WARNING) << ToString() << " - ::close failed for Listen error: "
+                     << error::ErrnoToString(error::Errno());
+      }
+    }
+  });
+  RET_CHECK(fd_ == kInvalidFdValue && listeners_.empty())
+      << "Attempting listening again, with valid socket: " << ToString();
+  RET_CHECK(state() == DISCONNECTED)
+      << "Attempting listening on non-disconnected acceptor: " << ToString();
+  for (const int fd : fds) {
+    int accepting = 0;
+    socklen_t len = sizeof(accepting);
+    if (::getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) < 0) {
+      return error::ErrnoToStatus(error::Errno())
+             << "::getsockopt with SO_ACCEPTCONN failed for: " << ToString();
+    }
+    RET_CHECK(accepting) << "Socket: " << fd
+                         << " is not listening, for: " << ToString();
+    RETURN_IF_ERROR(SetSocketOptions(fd));
+  }
+  if (!params_.reuse_port) {
+    RET_CHECK(fds.size() == 1)
+        << "Expecting one listening socket, got: " << fds.size()
+        << " for: " << ToString();
+    close_fds.reset();
+    return StartListening(fds.front());
+  }
+  RET_CHECK(fds.size() == params_.acceptor_threads.client_threads().size())
+      << "Expecting one reuse port socket per acceptor thread, got: "
+      << fds.size() << " for: " << ToString();
+  RETURN_IF_ERROR(InitializeLocalAddress(fds.front()));
+  close_fds.reset();
+  return StartReusePortListeners(std::move(fds));
+}
+
+std::vector<int> TcpAcceptor::listening_fds() const {
+  CHECK(selector()->IsInSelectThread());
+  std::vector<int> fds;
+  if (fd_.load() != kInvalidFdValue) {
+    fds.push_back(fd_.load());
+  }
+  for (const auto& listener : listeners_) {
+    fds.push_back(listener->GetFd());
   }
+  return fds;
+}
+
+absl::Status TcpAcceptor::StartListening(int fd) {
   fd_.store(fd);
   base::CallOnReturn close_fd([this]() {
     if (::close(fd_.load())) {
@@ -387,21 +936,12 @@ absl::Status TcpAcceptor::Listen(const HostPort& local_addr) {
     }
     fd_.store(kInvalidFdValue);
   });
-  RETURN_IF_ERROR(SetSocketOptions());
-  if (::bind(fd_.load(), AsSockAddr(&addr), SockAddrLen(addr)) < 0) {
-    return error::ErrnoToStatus(error::Errno())
-           << "::bind failed for: " << ToString();
-  }
-  if (::listen(fd_, params_.max_backlog)) {
-    return error::ErrnoToStatus(error::Errno())
-           << "::listen failed for: " << ToString();
-  }
   RETURN_IF_ERROR(selector()->Register(this))
       << "Registering acceptor with selector for: " << ToString();
 
   // Initialize local address from socket.
   // In case the user supplied port 0 we learn the system chosen port now.
-  RETURN_IF_ERROR(InitializeLocalAddress());
+  RETURN_IF_ERROR(InitializeLocalAddress(fd));
   LOG_IF(INFO, detail_log_) << ToString() << " - Bound and listening.";
   set_state(LISTENING);
   close_fd.reset();
@@ -409,8 +949,133 @@ absl::Status TcpAcceptor::Listen(const HostPort& local_addr) {
   // Note: Read Events are enabled by default
   return absl::OkStatus();
 }
+
+absl::Status TcpAcceptor::ListenReusePort(const HostPort& local_addr) {
+#ifndef SO_REUSEPORT
+  return status::UnimplementedErrorBuilder()
+         << "SO_REUSEPORT not available on this system for: " << ToString();
+#else
+  const std::vector<SelectorThread*>& client_threads =
+      params_.acceptor_threads.client_threads();
+  RET_CHECK(!client_threads.empty())
+      << "Reuse port listening requires acceptor threads for: " << ToString();
+  struct sockaddr_storage addr;
+  RETURN_IF_ERROR(ToBindSockAddr(local_addr, &addr))
+      << "Setting listening address for TCP acceptor";
+  std::vector<int> fds;
+  base::CallOnReturn close_fds([this, &fds]() {
+    for (const int fd : fds) {
+      if (::close(fd)) {
+        LOG(WARNING) << ToString() << " - ::close failed for Listen error: "
+                     << error::ErrnoToString(error::Errno());
+      }
+    }
+  });
+  for (size_t i = 0; i < client_threads.size(); ++i) {
+    ASSIGN_OR_RETURN(const int fd, CreateListeningSocket(addr));
+    fds.push_back(fd);
+    if (i == 0) {
+      // In case of port 0, the system chose a port for the first socket,
+      // and the rest need to bind to the same one.
+      socklen_t len = sizeof(addr);
+      if (::getsockname(fd, AsSockAddr(&addr), &len) < 0) {
+        return error::ErrnoToStatus(error::Errno())
+               << "::getsockname failed for: " << ToString();
+      }
+    }
+  }
+  if (params_.reuse_port_cpu_steering) {
+    // The program applies to the entire reuse port group.
+    RETURN_IF_ERROR(AttachCpuSteeringProgram(fds.back(), fds.size()));
+  }
+  RETURN_IF_ERROR(InitializeLocalAddress(fds.front()));
+  close_fds.reset();
+  return StartReusePortListeners(std::move(fds));
+#endif  // SO_REUSEPORT
+}
+
+absl::Status TcpAcceptor::StartReusePortListeners(std::vector<int> fds) {
+  const std::vector<SelectorThread*>& client_threads =
+      params_.acceptor_threads.client_threads();
+  CHECK_EQ(fds.size(), client_threads.size());
+  listener_handle_ = std::make_shared<ListenerHandle>();
+  {
+    absl::MutexLock l(&listener_handle_->mutex);
+    listener_handle_->acceptor = this;
+  }
+  // The listeners own the fds from now on.
+  for (size_t i = 0; i < fds.size(); ++i) {
+    listeners_.emplace_back(absl::make_unique<ReusePortListener>(
+        client_threads[i]->selector(), listener_handle_, fds[i]));
+  }
+  base::CallOnReturn close_listeners([this]() { CloseReusePortListeners(); });
+  for (size_t i = 0; i < listeners_.size(); ++i) {
+    RETURN_IF_ERROR(listeners_[i]->Register(client_threads[i]))
+        << "Starting reuse port listener: " << i << " for: " << ToString();
+  }
+  close_listeners.reset();
+  LOG_IF(INFO, detail_log_) << ToString() << " - Bound and listening on "
+                            << fds.size() << " reuse port sockets.";
+  set_state(LISTENING);
+  return absl::OkStatus();
+}
+
+absl::Status TcpAcceptor::AttachCpuSteeringProgram(int fd,
+                                                   size_t num_listeners) {
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+  // Returns the index of the socket in the group: cpu % num_listeners.
+  // The sockets are indexed in the order they started listening.
+  struct sock_filter code[] = {
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, uint32_t(SKF_AD_OFF + SKF_AD_CPU)},
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, uint32_t(num_listeners)},
+      {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog program;
+  program.len = sizeof(code) / sizeof(code[0]);
+  program.filter = code;
+  if (::setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program,
+                   sizeof(program)) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::setsockopt with SO_ATTACH_REUSEPORT_CBPF failed for: "
+           << ToString();
+  }
+  return absl::OkStatus();
+#else
+  return status::UnimplementedErrorBuilder()
+         << "Reuse port cpu steering not available on this system for: "
+         << ToString();
+#endif
+}
+
+absl::StatusOr<int> TcpAcceptor::CreateListeningSocket(
+    const struct sockaddr_storage& addr) {
+  const int fd = ::socket(addr.ss_family, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::socket failed for: " << ToString();
+  }
+  base::CallOnReturn close_fd([this, fd]() {
+    if (::close(fd)) {
+      LOG(WARNING) << ToString() << " - ::close failed for Listen error: "
+                   << error::ErrnoToString(error::Errno());
+    }
+  });
+  RETURN_IF_ERROR(SetSocketOptions(fd));
+  if (::bind(fd, AsSockAddr(&addr), SockAddrLen(addr)) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::bind failed for: " << ToString();
+  }
+  if (::listen(fd, params_.max_backlog)) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::listen failed for: " << ToString();
+  }
+  close_fd.reset();
+  return fd;
+}
+
 void TcpAcceptor::Close() {
-  if (!selector()->IsInSelectThread()) {
+  // From a reuse port listener we cannot close now, while it delegates to us.
+  if (!selector()->IsInSelectThread() || tls_listener_acceptor == this) {
     selector()->RunInSelectLoop(absl::bind_front(&TcpAcceptor::Close, this));
   } else {
     LOG_IF(INFO, detail_log_) << ToString() << " - Closing acceptor.";
@@ -420,59 +1085,142 @@ void TcpAcceptor::Close() {
 
 std::string TcpAcceptor::ToString() const {
   return absl::StrCat("TcpAcceptor [ ", local_address().ToString(),
-                      " state: ", state_name(), " fd: ", fd_.load(), " ]");
+                      " state: ", state_name(), " fd: ", fd_.load(),
+                      params_.reuse_port ? " reuse_port" : "", " ]");
 }
 
 int TcpAcceptor::GetFd() const { return fd_.load(); }
 
 bool TcpAcceptor::HandleReadEvent(SelectorEventData event) {
   CHECK(selector()->IsInSelectThread());
-  // new client connection - perform ::accept
-  struct sockaddr_storage addr;
-  socklen_t addrlen = sizeof(addr);
-  const int client_fd = ::accept(fd_.load(), AsSockAddr(&addr), &addrlen);
-  if (client_fd < 0) {
-    if (error::Errno() == EAGAIN || error::Errno() == EWOULDBLOCK) {
-      // This could happen if the connecting client goes away just before
-      // we execute "accept".
-      return true;
-    }
-    LOG(WARNING) << ToString() << " - ::accept failed: "
-                 << error::ErrnoToString(error::Errno())
-                 << ". It will get closed";
-    return false;  // stop accepting
-  }
-  base::CallOnReturn close_fd([client_fd]() { ::close(client_fd); });
-  auto host_port_result =
-      HostPort::ParseFromSockAddr(AsSockAddr(&addr), SockAddrLen(addr));
-  if (!host_port_result.ok()) {
-    LOG(WARNING) << "Cannot parse remote address from sockaddr: "
-                 << host_port_result.status() << " - closing connection.";
-    stats_.peer_parse_errors.fetch_add(1);
-    return true;  // continue accepting
+  return HandleAccept(fd_.load(), nullptr);
+}
+
+bool TcpAcceptor::IsPeerAllowed(const HostPort& peer_address) const {
+  if (params_.allowed_peers == nullptr && params_.denied_peers == nullptr) {
+    return true;
   }
-  if (!CallFilterHandler(host_port_result.value())) {
-    LOG_IF(INFO, detail_log_) << ToString() << " - Connection filtered out: "
-                              << host_port_result.value().ToString();
-    stats_.filtered_connections.fetch_add(1);
-    return true;  // continue accepting
+  if (!peer_address.ip().has_value()) {
+    return false;
   }
-  close_fd.reset();
-  stats_.connections_accept_scheduled.fetch_add(1);
-  LOG_IF(INFO, detail_log_)
-      << ToString()
-      << " - connection accepted from: " << host_port_result.value().ToString();
+  const IpAddress& ip = peer_address.ip().value();
+  return ((params_.allowed_peers == nullptr ||
+           params_.allowed_peers->Contains(ip)) &&
+          (params_.denied_peers == nullptr ||
+           !params_.denied_peers->Contains(ip)));
+}
+
+bool TcpAcceptor::HandleAccept(int listen_fd, Selector* accept_selector) {
+  DCHECK(accept_selector == nullptr || accept_selector->IsInSelectThread());
+  // Drain the accept queue, up to a batch of connections per event.
+  const size_t max_accepts = std::max<size_t>(params_.max_accepts_per_event, 1);
+  for (size_t i = 0; i < max_accepts && !accept_paused_.load(); ++i) {
+    // new client connection - perform ::accept
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+#ifdef __linux__
+    const int client_fd = ::accept4(listen_fd, AsSockAddr(&addr), &addrlen,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    const int client_fd = ::accept(listen_fd, AsSockAddr(&addr), &addrlen);
+#endif  // __linux__
+    if (client_fd < 0) {
+      const int err = error::Errno();
+      if (err == EAGAIN || err == EWOULDBLOCK) {
+        // Accept queue drained - this could also happen if the connecting
+        // client goes away just before we execute "accept".
+        return true;
+      }
+      if (err == EINTR || err == ECONNABORTED) {
+        continue;
+      }
+      LOG(WARNING) << ToString()
+                   << " - ::accept failed: " << error::ErrnoToString(err)
+                   << ". It will get closed";
+      return false;  // stop accepting
+    }
+    base::CallOnReturn close_fd([client_fd]() { ::close(client_fd); });
+    auto host_port_result =
+        HostPort::ParseFromSockAddr(AsSockAddr(&addr), SockAddrLen(addr));
+    if (!host_port_result.ok()) {
+      LOG(WARNING) << "Cannot parse remote address from sockaddr: "
+                   << host_port_result.status() << " - closing connection.";
+      stats_.peer_parse_errors.fetch_add(1);
+      continue;  // continue accepting
+    }
+    if (!IsPeerAllowed(host_port_result.value()) ||
+        !CallFilterHandler(host_port_result.value())) {
+      LOG_IF(INFO, detail_log_) << ToString() << " - Connection filtered out: "
+                                << host_port_result.value().ToString();
+      stats_.filtered_connections.fetch_add(1);
+      continue;  // continue accepting
+    }
+    close_fd.reset();
+    stats_.connections_accept_scheduled.fetch_add(1);
+    LOG_IF(INFO, detail_log_) << ToString() << " - connection accepted from: "
+                              << host_port_result.value().ToString();
 
-  Selector* const selector_to_use = params_.acceptor_threads.GetNextSelector();
-  if (selector_to_use != nullptr) {
+    if (accept_selector != nullptr) {
+      // Accepted directly in the thread of the connection.
+      InitializeAcceptedConnection(accept_selector, client_fd);
+      continue;
+    }
+    Selector* const selector_to_use =
+        params_.acceptor_threads.GetNextSelector();
+    if (selector_to_use == nullptr) {
+      InitializeAcceptedConnection(selector_, client_fd);
+      continue;
+    }
+    const size_t num_pending = num_pending_initializations_.fetch_add(1) + 1;
     selector_to_use->RunInSelectLoop([this, selector_to_use, client_fd]() {
       InitializeAcceptedConnection(selector_to_use, client_fd);
+      FinishPendingInitialization();
     });
-  } else {
-    InitializeAcceptedConnection(selector_, client_fd);
+    if (params_.max_pending_initializations > 0 &&
+        num_pending >= params_.max_pending_initializations) {
+      PauseAccepting();
+    }
   }
   return true;
 }
+
+void TcpAcceptor::PauseAccepting() {
+  CHECK(selector()->IsInSelectThread());
+  if (accept_paused_.exchange(true)) {
+    return;
+  }
+  stats_.accept_pauses.fetch_add(1);
+  LOG_IF(INFO, detail_log_) << ToString() << " - Pausing accept, with "
+                            << num_pending_initializations_.load()
+                            << " connections pending initialization.";
+  LOG_IF_ERROR(WARNING, selector()->EnableReadCallback(this, false))
+      << "Disabling accept for: " << ToString();
+  // The initializations may have completed in the meantime, before seeing
+  // us paused.
+  MaybeResumeAccepting();
+}
+
+void TcpAcceptor::MaybeResumeAccepting() {
+  CHECK(selector()->IsInSelectThread());
+  if (!accept_paused_.load() || fd_.load() == kInvalidFdValue ||
+      num_pending_initializations_.load() >
+          params_.max_pending_initializations / 2) {
+    return;
+  }
+  accept_paused_.store(false);
+  LOG_IF(INFO, detail_log_) << ToString() << " - Resuming accept.";
+  LOG_IF_ERROR(WARNING, selector()->EnableReadCallback(this, true))
+      << "Enabling accept for: " << ToString();
+}
+
+void TcpAcceptor::FinishPendingInitialization() {
+  const size_t num_pending = num_pending_initializations_.fetch_sub(1) - 1;
+  if (accept_paused_.load() &&
+      num_pending <= params_.max_pending_initializations / 2) {
+    selector()->RunInSelectLoop([this]() { MaybeResumeAccepting(); });
+  }
+}
+
 bool TcpAcceptor::HandleWriteEvent(SelectorEventData event) {
   CHECK(selector()->IsInSelectThread());
   LOG(WARNING) << ToString() << " - HandleWriteEvent called on server socket";
@@ -498,8 +1246,7 @@ bool TcpAcceptor::HandleErrorEvent(SelectorEventData event) {
   return true;  // continue accepting
 }
 
-absl::Status TcpAcceptor::SetSocketOptions() {
-  const int fd = fd_.load();
+absl::Status TcpAcceptor::SetSocketOptions(int fd) {
   RET_CHECK(fd != kInvalidFdValue);
   const int flags = ::fcntl(fd, F_GETFL, 0);
   if (flags < 0) {
@@ -521,6 +1268,16 @@ absl::Status TcpAcceptor::SetSocketOptions() {
     return error::ErrnoToStatus(error::Errno())
            << "::setsockopt with SO_REUSEADDR failed for: " << ToString();
   }
+#ifdef SO_REUSEPORT
+  // Multiple sockets listening on the same port, with the connections
+  // distributed between them.
+  if (params_.reuse_port &&
+      ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &true_flag,
+                   sizeof(true_flag)) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::setsockopt with SO_REUSEPORT failed for: " << ToString();
+  }
+#endif  // SO_REUSEPORT
 #ifdef SO_NOSIGPIPE
   // Also disable the SIGPIPE for systems that support it (e.g. OSX & IOS)
   if (::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &true_flag,
@@ -532,10 +1289,10 @@ absl::Status TcpAcceptor::SetSocketOptions() {
   return absl::OkStatus();
 }
 
-absl::Status TcpAcceptor::InitializeLocalAddress() {
+absl::Status TcpAcceptor::InitializeLocalAddress(int fd) {
   struct sockaddr_storage addr;
   socklen_t len = sizeof(addr);
-  if (::getsockname(fd_.load(), AsSockAddr(&addr), &len) < 0) {
+  if (::getsockname(fd, AsSockAddr(&addr), &len) < 0) {
     return error::ErrnoToStatus(error::Errno())
            << "::getsockname failed for: " << ToString();
   }
@@ -559,7 +1316,12 @@ void TcpAcceptor::InitializeAcceptedConnection(Selector* net_selector,
   // file descriptor.
   auto client = absl::make_unique<TcpConnection>(net_selector,
                                                  params_.tcp_connection_params);
-  auto wrap_status = client->Wrap(client_fd);
+#ifdef __linux__
+  // accept4 already made the socket non blocking.
+  auto wrap_status = client->Wrap(client_fd, true);
+#else
+  auto wrap_status = client->Wrap(client_fd, false);
+#endif  // __linux__
   if (!wrap_status.ok()) {
     stats_.connection_wrap_errors.fetch_add(1);
     LOG(WARNING) << "Failed to wrap incoming client fd: " << client_fd << " - "
@@ -580,20 +1342,40 @@ void TcpAcceptor::InitializeAcceptedConnection(Selector* net_selector,
   CallAcceptHandler(std::move(client));
 }
 
+void TcpAcceptor::CloseReusePortListeners() {
+  if (listener_handle_ != nullptr) {
+    // Waits for the accepts in progress in the listeners.
+    absl::MutexLock l(&listener_handle_->mutex);
+    listener_handle_->acceptor = nullptr;
+  }
+  listener_handle_.reset();
+  // The listeners are closed and deleted in their threads.
+  for (auto& listener : listeners_) {
+    Selector* const home_selector = listener->home_selector();
+    home_selector->DeleteInSelectLoop(std::move(listener));
+  }
+  listeners_.clear();
+}
+
 void TcpAcceptor::InternalClose(const absl::Status& status) {
   CHECK(selector()->IsInSelectThread());
-  const int fd = fd_.exchange(kInvalidFdValue);
+  const int fd = fd_.load();
   set_last_error(status);
-  if (fd == kInvalidFdValue) {
+  if (fd == kInvalidFdValue && listeners_.empty()) {
     CHECK_EQ(state(), DISCONNECTED);
     return;
   }
-  LOG_IF_ERROR(WARNING, selector()->Unregister(this))
-      << "Unregistering acceptor from selector: " << ToString();
-  if (::close(fd) < 0) {
-    LOG(WARNING) << ToString() << " - ::close failed: "
-                 << error::ErrnoToString(error::Errno());
+  if (fd != kInvalidFdValue) {
+    // Unregister while GetFd() still returns the fd.
+    LOG_IF_ERROR(WARNING, selector()->Unregister(this))
+        << "Unregistering acceptor from selector: " << ToString();
+    fd_.store(kInvalidFdValue);
+    if (::close(fd) < 0) {
+      LOG(WARNING) << ToString() << " - ::close failed: "
+                   << error::ErrnoToString(error::Errno());
+    }
   }
+  CloseReusePortListeners();
   set_state(DISCONNECTED);
   CallCloseHandler(status);
 }
@@ -605,8 +1387,20 @@ TcpConnection::TcpConnection(Selector* selector, TcpConnectionParams params)
       Selectable(ABSL_DIE_IF_NULL(selector)),
       params_(std::move(params)),
       timeouter_(selector,
-                 absl::bind_front(&TcpConnection::HandleTimeoutEvent, this)) {
+                 absl::bind_front(&TcpConnection::HandleTimeoutEvent, this)),
+      read_block_size_(params_.block_size) {
   detail_log_ = params_.detail_log;
+  read_stats_.block_size.store(read_block_size_);
+  if (params_.read_rate_limit.has_value()) {
+    read_limiter_.AddBucket(
+        std::make_shared<TokenBucket>(params_.read_rate_limit.value()));
+  }
+  read_limiter_.AddBucket(params_.shared_read_bucket);
+  if (params_.write_rate_limit.has_value()) {
+    write_limiter_.AddBucket(
+        std::make_shared<TokenBucket>(params_.write_rate_limit.value()));
+  }
+  write_limiter_.AddBucket(params_.shared_write_bucket);
 }
 
 TcpConnection::~TcpConnection() {
@@ -615,16 +1409,17 @@ TcpConnection::~TcpConnection() {
   CHECK_EQ(fd_.load(), kInvalidFdValue);
 }
 
-absl::Status TcpConnection::Wrap(int fd) {
+absl::Status TcpConnection::Wrap(int fd, bool is_nonblocking) {
   CHECK(selector()->IsInSelectThread());
   RET_CHECK(fd_.load() == kInvalidFdValue)
       << "Should wrap only on unconnected connection.";
   fd_.store(fd);
   base::CallOnReturn close_fd([this]() { fd_.store(kInvalidFdValue); });
-  RETURN_IF_ERROR(SetSocketOptions());
-  RETURN_IF_ERROR(selector()->Register(this));
+  RETURN_IF_ERROR(SetSocketOptions(!is_nonblocking));
   RETURN_IF_ERROR(InitializeLocalAddress());
   RETURN_IF_ERROR(InitializeRemoteAddress());
+  // Register last, so we do not stay registered with an invalid fd on errors.
+  RETURN_IF_ERROR(selector()->Register(this));
   RETURN_IF_ERROR(RequestReadEvents(true));
   close_fd.reset();
 
@@ -644,6 +1439,9 @@ absl::Status TcpConnection::Connect(const HostPort& remote_addr) {
            << "Hostport for TCP connection has no port specified: "
            << remote_addr.ToString();
   }
+  if (state() == DISCONNECTED) {
+    num_connect_attempts_ = 0;
+  }
   // maybe start DNS resolve
   if (state() == DISCONNECTED && !remote_addr.IsResolved()) {
     if (!remote_addr.host().has_value()) {
@@ -657,9 +1455,20 @@ absl::Status TcpConnection::Connect(const HostPort& remote_addr) {
     }
     LOG_IF(INFO, detail_log_) << ToString() << " - Starting DNS resolve.";
     set_state(RESOLVING);
-    DnsResolver::Default().ResolveAsync(
-        remote_addr.host().value(),
-        absl::bind_front(&TcpConnection::HandleDnsResult, this));
+    // The cached results come back right away, from the resolve call - these
+    // are deferred to the select loop by HandleDnsResult, so no handler runs
+    // before we return.
+    resolve_in_connect_ = true;
+    if (params_.dns_client != nullptr) {
+      params_.dns_client->Resolve(
+          remote_addr.host().value(),
+          absl::bind_front(&TcpConnection::HandleDnsResult, this));
+    } else {
+      DnsResolver::Default().ResolveAsync(
+          remote_addr.host().value(),
+          absl::bind_front(&TcpConnection::HandleDnsResult, this));
+    }
+    resolve_in_connect_ = false;
     return absl::OkStatus();  // for now
   }
 
@@ -668,11 +1477,12 @@ absl::Status TcpConnection::Connect(const HostPort& remote_addr) {
       << "Setting listening address for TCP connection.";
 
   const int fd = ::socket(addr.ss_family, SOCK_STREAM, 0);
-  if (fd_ < 0) {
+  if (fd < 0) {
     return error::ErrnoToStatus(error::Errno())
            << "::socket failed for connecting to: " << remote_addr.ToString();
   }
   fd_.store(fd);
+  ++num_connect_attempts_;
   base::CallOnReturn close_fd([this]() {
     if (::close(fd_.load())) {
       LOG(WARNING) << ToString()
@@ -682,7 +1492,7 @@ absl::Status TcpConnection::Connect(const HostPort& remote_addr) {
     }
     fd_.store(kInvalidFdValue);
   });
-  RETURN_IF_ERROR(SetSocketOptions());
+  RETURN_IF_ERROR(SetSocketOptions(true));
   RETURN_IF_ERROR(selector()->Register(this));
   close_fd.reset();
 
@@ -726,6 +1536,9 @@ void TcpConnection::FlushAndClose() {
   }
 }
 void TcpConnection::ForceClose() {
+  if (state() == DISCONNECTED) {
+    return;  // already closed, and unregistered from the selector.
+  }
   if (!selector()->IsInSelectThread()) {
     selector()->RunInSelectLoop(
         absl::bind_front(&TcpConnection::ForceClose, this));
@@ -752,9 +1565,17 @@ absl::Status TcpConnection::SetRecvBufferSize(int size) {
   return absl::OkStatus();
 }
 absl::Status TcpConnection::RequestReadEvents(bool enable) {
+  read_events_requested_ = enable;
+  if (enable && read_throttled_) {
+    return absl::OkStatus();  // enabled when the throttling ends
+  }
   return selector()->EnableReadCallback(this, enable);
 }
 absl::Status TcpConnection::RequestWriteEvents(bool enable) {
+  write_events_requested_ = enable;
+  if (enable && write_throttled_) {
+    return absl::OkStatus();  // enabled when the throttling ends
+  }
   return selector()->EnableWriteCallback(this, enable);
 }
 HostPort TcpConnection::GetLocalAddress() const {
@@ -781,26 +1602,49 @@ int TcpConnection::GetFd() const { return fd_.load(); }
 bool TcpConnection::HandleReadEvent(SelectorEventData event) {
   CHECK(selector()->IsInSelectThread());
   CHECK(state() != DISCONNECTED) << "Invalid state: " << state_name();
+  // Events synthesized for edge triggered mode do not mean that the
+  // socket is ready - for connecting, wait the actual connect event.
   if (state() == CONNECTING) {
-    return PerformConnectOnFirstOperation();
+    return event.synthesized || PerformConnectOnFirstOperation();
   }
   CHECK(state() == CONNECTED || state() == FLUSHING)
       << "Illegal state during read: " << state_name();
-  auto read_result = PerformRead();
-  if (!read_result.ok()) {
-    InternalClose(read_result.status(), true);
-    return false;
-  }
-  const ssize_t cb = read_result.value();
-  // Call application level data processing for a non-zero read.
-  if (cb > 0) {
-    auto read_handler_status = CallReadHandler();
-    if (ABSL_PREDICT_FALSE(!read_handler_status.ok())) {
-      InternalClose(read_handler_status, true);
+  if (event.synthesized && !IsReadable()) {
+    return true;
+  }
+  ssize_t cb = 0;
+  // The errno of the last read - the read handler may change errno.
+  int read_errno = 0;
+  do {
+    size_t max_read = SIZE_MAX;
+    if (read_limiter_.enabled()) {
+      max_read = read_limiter_.Acquire(read_block_size_ + kReadOverflowSize,
+                                       selector()->now());
+      if (max_read == 0) {
+        ThrottleReads();
+        break;
+      }
+    }
+    auto read_result = PerformRead(max_read);
+    read_errno = error::Errno();
+    if (!read_result.ok()) {
+      InternalClose(read_result.status(), true);
       return false;
     }
-  }
-  if (write_closed() || state() == FLUSHING || IsProperError(error::Errno())) {
+    cb = read_result.value();
+    if (read_limiter_.enabled()) {
+      read_limiter_.Release(max_read - std::min<size_t>(cb, max_read));
+    }
+    // Call application level data processing for a non-zero read.
+    if (cb > 0) {
+      auto read_handler_status = CallReadHandler();
+      if (ABSL_PREDICT_FALSE(!read_handler_status.ok())) {
+        InternalClose(read_handler_status, true);
+        return false;
+      }
+    }
+  } while (ShouldContinueReading(cb));
+  if (write_closed() || state() == FLUSHING || IsProperError(read_errno)) {
     // Previous read returned 0 bytes, READ half closed.
     set_read_closed(true);
   }
@@ -825,30 +1669,39 @@ bool TcpConnection::HandleWriteEvent(SelectorEventData event) {
   CHECK(selector()->IsInSelectThread());
   CHECK(state() != DISCONNECTED) << "Invalid state: " << state_name();
   if (state() == CONNECTING) {
-    return PerformConnectOnFirstOperation();
+    // Synthesized in edge triggered mode - wait the actual connect event.
+    return event.synthesized || PerformConnectOnFirstOperation();
   }
   CHECK(state() == CONNECTED || state() == FLUSHING)
       << "Illegal state during write: " << state_name();
 
-  auto write_result = Selectable::WriteCord(*outbuf(), params_.write_limit);
-  if (!write_result.ok()) {
-    InternalClose(write_result.status(), true);
-    return false;
-  }
-  const ssize_t cb = write_result.value();
-  outbuf()->RemovePrefix(cb);
-  inc_bytes_written(cb);
-  last_write_ts_.store(absl::ToUnixNanos(selector()->now()));
-
-  // Call application level data write processing.
-  if (state() != FLUSHING) {
-    auto write_handler_status = CallWriteHandler();
-    if (ABSL_PREDICT_FALSE(!write_handler_status.ok())) {
-      InternalClose(write_handler_status, true);
+  // In edge triggered mode we continue to write until we fill the socket
+  // buffer, as we get no more events until then.
+  bool fully_written = false;
+  do {
+    auto write_result = WriteOutputRateLimited(params_.write_limit);
+    if (!write_result.ok()) {
+      InternalClose(write_result.status(), true);
       return false;
     }
+    fully_written = write_result.value();
+
+    // Call application level data write processing.
+    if (state() != FLUSHING) {
+      auto write_handler_status = CallWriteHandler();
+      if (ABSL_PREDICT_FALSE(!write_handler_status.ok())) {
+        InternalClose(write_handler_status, true);
+        return false;
+      }
+    }
+  } while (edge_triggered() && fully_written && has_pending_output() &&
+           fd_.load() != kInvalidFdValue &&
+           (state() == CONNECTED || state() == FLUSHING));
+  CheckPendingOutput();
+  if (state() == DISCONNECTED) {
+    return false;  // Closed by the watermark handler.
   }
-  if (!outbuf()->empty()) {
+  if (has_pending_output()) {
     return true;  // Continue writing & the connection - we have more data.
   }
   // Stop write events for now.
@@ -895,12 +1748,23 @@ bool TcpConnection::HandleErrorEvent(SelectorEventData event) {
   //
   // Note: Similar for poll.
   if (selector()->IsErrorEvent(value)) {
+    if (zerocopy_enabled_) {
+      // The completions of the MSG_ZEROCOPY sends come in the error queue,
+      // and signal an error event, with no socket error.
+      const absl::Status status = ProcessZerocopyCompletions();
+      if (!status.ok()) {
+        InternalClose(status, true);
+        return false;
+      }
+    }
     const int err = ExtractSocketErrno(fd_.load());
-    InternalClose(absl::Status(error::ErrnoToStatus(err)
-                               << " - error detected on connection socket for: "
-                               << ToString()),
-                  true);
-    return false;
+    if (err != 0 || !zerocopy_enabled_) {
+      InternalClose(absl::Status(error::ErrnoToStatus(err)
+                                 << " - error detected on connection socket"
+                                 << " for: " << ToString()),
+                    true);
+      return false;
+    }
   }
 
   // IMPORTANT:
@@ -985,19 +1849,21 @@ void TcpConnection::CloseCommunication(CloseDirective directive) {
   }
 }
 
-absl::Status TcpConnection::SetSocketOptions() {
+absl::Status TcpConnection::SetSocketOptions(bool set_nonblocking) {
   const int fd = fd_.load();
   RET_CHECK(fd != kInvalidFdValue);
-  const int flags = fcntl(fd, F_GETFL, 0);
-  if (flags < 0) {
-    return error::ErrnoToStatus(error::Errno())
-           << "::fcntl with F_GETFL failed for: " << ToString();
-  }
-  const int new_flags = flags | O_NONBLOCK;
-  if (::fcntl(fd, F_SETFL, new_flags)) {
-    return error::ErrnoToStatus(error::Errno())
-           << "::fcntl with F_SETFL, " << new_flags
-           << " failed for: " << ToString();
+  if (set_nonblocking) {
+    const int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+      return error::ErrnoToStatus(error::Errno())
+             << "::fcntl with F_GETFL failed for: " << ToString();
+    }
+    const int new_flags = flags | O_NONBLOCK;
+    if (::fcntl(fd, F_SETFL, new_flags)) {
+      return error::ErrnoToStatus(error::Errno())
+             << "::fcntl with F_SETFL, " << new_flags
+             << " failed for: " << ToString();
+    }
   }
   // disable Nagel buffering algorithm:
   const int true_flag = 1;
@@ -1021,6 +1887,57 @@ absl::Status TcpConnection::SetSocketOptions() {
   if (params_.recv_buffer_size.has_value()) {
     RETURN_IF_ERROR(SetRecvBufferSize(params_.recv_buffer_size.value()));
   }
+  if (corked()) {
+    RETURN_IF_ERROR(SetCorked(true));
+  }
+  if (params_.zerocopy_threshold.has_value()) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    // Not an error if unsupported - we just copy the data as usual.
+    zerocopy_enabled_ = ::setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &true_flag,
+                                     sizeof(true_flag)) == 0;
+    LOG_IF(WARNING, !zerocopy_enabled_)
+        << "::setsockopt with SO_ZEROCOPY failed: "
+        << error::ErrnoToString(error::Errno()) << " for: " << ToString();
+#endif  // SO_ZEROCOPY && MSG_ZEROCOPY
+  }
+  if (params_.socket_busy_poll.has_value()) {
+#ifdef SO_BUSY_POLL
+    const int busy_poll_usec = static_cast<int>(
+        absl::ToInt64Microseconds(params_.socket_busy_poll.value()));
+    LOG_IF(WARNING, ::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_usec,
+                                 sizeof(busy_poll_usec)) < 0)
+        << "::setsockopt with SO_BUSY_POLL failed: "
+        << error::ErrnoToString(error::Errno()) << " for: " << ToString();
+#endif  // SO_BUSY_POLL
+  }
+  return absl::OkStatus();
+}
+
+absl::Status TcpConnection::SetCorked(bool corked) {
+  const int fd = fd_.load();
+  if (fd == kInvalidFdValue) {
+    // Applied by SetSocketOptions() when we get a socket.
+    return absl::OkStatus();
+  }
+  if (!corked && state() == CONNECTED) {
+    // Hand everything to the kernel while still corked, so the last partial
+    // segment goes out together with the rest on uncorking.
+    RETURN_IF_ERROR(FlushOutbuf().status());
+  }
+  const int flag = corked ? 1 : 0;
+#ifdef TCP_CORK
+  if (::setsockopt(fd, IPPROTO_TCP, TCP_CORK, &flag, sizeof(flag)) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::setsockopt with TCP_CORK: " << flag
+           << " failed for: " << ToString();
+  }
+#elif defined(TCP_NOPUSH)
+  if (::setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &flag, sizeof(flag)) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::setsockopt with TCP_NOPUSH: " << flag
+           << " failed for: " << ToString();
+  }
+#endif  // TCP_CORK
   return absl::OkStatus();
 }
 
@@ -1042,7 +1959,7 @@ absl::Status TcpConnection::InitializeLocalAddress() {
 absl::Status TcpConnection::InitializeRemoteAddress() {
   struct sockaddr_storage addr;
   socklen_t len = sizeof(addr);
-  if (!::getpeername(fd_.load(), AsSockAddr(&addr), &len)) {
+  if (::getpeername(fd_.load(), AsSockAddr(&addr), &len) < 0) {
     return error::ErrnoToStatus(error::Errno())
            << "::getpeername failed for: " << ToString();
   }
@@ -1076,30 +1993,48 @@ void TcpConnection::InternalClose(const absl::Status& status,
       LOG(WARNING) << ToString() << " - ::shutdown failed: "
                    << error::ErrnoToString(error::Errno());
     }
-    if (::close(fd_) < 0) {
+    if (!zerocopy_pending_.empty()) {
+      StartZerocopyDrain();
+    } else if (::close(fd_) < 0) {
       LOG(WARNING) << ToString() << " - ::close failed: "
                    << error::ErrnoToString(error::Errno());
     }
     fd_.store(kInvalidFdValue);
   }
+  ClearConnectAttempts();
   set_state(DISCONNECTED);
   set_read_closed(true);
   set_write_closed(true);
   timeouter_.ClearAllTimeouts();
+  read_throttled_ = false;
+  write_throttled_ = false;
   LOG_IF(WARNING, ABSL_PREDICT_FALSE(!inbuf()->empty()))
       << "Connection: " << ToString()
       << " is closed w/o all in bytes read: " << inbuf()->size();
   LOG_IF(WARNING, ABSL_PREDICT_FALSE(!outbuf()->empty()))
       << "Connection: " << ToString()
       << " is closed w/o all out bytes written: " << outbuf()->size();
+  LOG_IF(WARNING, ABSL_PREDICT_FALSE(!out_files_.empty()))
+      << "Connection: " << ToString()
+      << " is closed w/o sending all queued files: " << out_files_.size();
   inbuf()->Clear();
   outbuf()->Clear();
+  out_files_.clear();
+  CheckPendingOutput();
   if (call_close_handler) {
     CallCloseHandler(status, CLOSE_READ_WRITE);
   }
 }
 
 void TcpConnection::HandleTimeoutEvent(int64_t timeout_id) {
+  if (timeout_id == kReadThrottleTimeoutId) {
+    ResumeReads();
+    return;
+  }
+  if (timeout_id == kWriteThrottleTimeoutId) {
+    ResumeWrites();
+    return;
+  }
   LOG_IF(WARNING, ABSL_PREDICT_FALSE(timeout_id != kShutdownTimeoutId))
       << "Unknown timeout_id received by " << ToString() << ": " << timeout_id;
   InternalClose(absl::OkStatus(), true);
@@ -1107,8 +2042,10 @@ void TcpConnection::HandleTimeoutEvent(int64_t timeout_id) {
 
 void TcpConnection::HandleDnsResult(
     absl::StatusOr<std::shared_ptr<DnsHostInfo>> info) {
-  if (!selector()->IsInSelectThread()) {
-    selector()->RunInSelectLoop([this, &info]() { HandleDnsResult(info); });
+  if (!selector()->IsInSelectThread() || resolve_in_connect_) {
+    selector()->RunInSelectLoop([this, info = std::move(info)]() mutable {
+      HandleDnsResult(std::move(info));
+    });
     return;
   }
   CHECK(state() == RESOLVING);
@@ -1120,9 +2057,16 @@ void TcpConnection::HandleDnsResult(
     return;
   }
   absl::Status status = info.status();
+  if (status.ok() && params_.happy_eyeballs &&
+      info.value()->ipv4().size() + info.value()->ipv6().size() > 1) {
+    LOG_IF(INFO, detail_log_)
+        << ToString() << " - Resolve completed OK, connecting in parallel.";
+    StartHappyEyeballs(*info.value());
+    return;
+  }
   if (status.ok()) {
     auto ip = info.value()->PickNextAddress();
-    if (ABSL_PREDICT_FALSE(ip.has_value())) {
+    if (ABSL_PREDICT_FALSE(!ip.has_value())) {
       status = status::InternalErrorBuilder()
                << "No valid IP address was resolved for " << ToString();
     } else {
@@ -1137,10 +2081,233 @@ void TcpConnection::HandleDnsResult(
     }
   }
   if (ABSL_PREDICT_FALSE(!status.ok())) {
+    if (state() == RESOLVING) {
+      // Else the close would wait for the resolve that just completed.
+      set_state(CONNECTING);
+    }
+    InternalClose(status, true);
+  }
+}
+
+class TcpConnection::ConnectAttempt : public Selectable {
+ public:
+  ConnectAttempt(TcpConnection* connection, HostPort address)
+      : Selectable(nullptr),  // set upon registration
+        connection_(connection),
+        address_(std::move(address)) {}
+  ~ConnectAttempt() { Close(); }
+
+  const HostPort& address() const { return address_; }
+
+  // Starts connecting - on success, the completion is notified to the
+  // connection on the first event of the socket.
+  absl::Status Start() {
+    const auto& connect = connection_->params_.connect_attempt_function;
+    if (connect) {
+      ASSIGN_OR_RETURN(fd_, connect(address_));
+    } else {
+      RETURN_IF_ERROR(StartConnect());
+    }
+    RETURN_IF_ERROR(connection_->selector()->Register(this));
+    return selector()->EnableWriteCallback(this, true);
+  }
+
+  // Unregisters, and hands over the connected socket.
+  int ReleaseFd() {
+    LOG_IF_ERROR(WARNING, selector()->Unregister(this))
+        << "Unregistering connect attempt to: " << address_.ToString();
+    const int fd = fd_;
+    fd_ = kInvalidFdValue;
+    return fd;
+  }
+
+  bool HandleReadEvent(SelectorEventData event) override {
+    return Completed(ExtractSocketErrno(fd_));
+  }
+  bool HandleWriteEvent(SelectorEventData event) override {
+    return Completed(ExtractSocketErrno(fd_));
+  }
+  bool HandleErrorEvent(SelectorEventData event) override {
+    if (!selector()->IsErrorEvent(event.internal_event) &&
+        !selector()->IsAnyHangUpEvent(event.internal_event)) {
+      return true;
+    }
+    const int err = ExtractSocketErrno(fd_);
+    return Completed(err != 0 ? err : ECONNRESET);
+  }
+  int GetFd() const override { return fd_; }
+  void Close() override {
+    if (fd_ == kInvalidFdValue) {
+      return;
+    }
+    if (selector() != nullptr) {
+      LOG_IF_ERROR(WARNING, selector()->Unregister(this))
+          << "Unregistering connect attempt to: " << address_.ToString();
+    }
+    if (::close(fd_) < 0) {
+      LOG(WARNING) << "::close failed for connect attempt to: "
+                   << address_.ToString() << ": "
+                   << error::ErrnoToString(error::Errno());
+    }
+    fd_ = kInvalidFdValue;
+  }
+
+ private:
+  // Opens the socket, and starts connecting w/o blocking.
+  absl::Status StartConnect() {
+    struct sockaddr_storage addr;
+    RETURN_IF_ERROR(address_.ToSockAddr(&addr));
+    fd_ = ::socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd_ < 0) {
+      return error::ErrnoToStatus(error::Errno())
+             << "::socket failed for connecting to: " << address_.ToString();
+    }
+    const int flags = ::fcntl(fd_, F_GETFL, 0);
+    if (flags < 0 || ::fcntl(fd_, F_SETFL, flags | O_NONBLOCK) < 0) {
+      return error::ErrnoToStatus(error::Errno())
+             << "::fcntl failed for connecting to: " << address_.ToString();
+    }
+    if (::connect(fd_, AsSockAddr(&addr), SockAddrLen(addr)) < 0 &&
+        error::Errno() != EINPROGRESS) {
+      return error::ErrnoToStatus(error::Errno())
+             << "::connect failed for: " << address_.ToString();
+    }
+    return absl::OkStatus();
+  }
+
+  bool Completed(int err) {
+    // The connection closes us - no more events for this round.
+    connection_->HandleConnectAttempt(this, err);
+    return false;
+  }
+  TcpConnection* const connection_;
+  const HostPort address_;
+  int fd_ = kInvalidFdValue;
+};
+
+void TcpConnection::StartHappyEyeballs(const DnsHostInfo& info) {
+  set_state(CONNECTING);
+  set_read_closed(false);
+  set_write_closed(false);
+  // Alternate the address families, IPv6 first (RFC 8305, section 4).
+  connect_candidates_.clear();
+  const auto& ipv4 = info.ipv4();
+  const auto& ipv6 = info.ipv6();
+  for (size_t i = 0; i < std::max(ipv4.size(), ipv6.size()); ++i) {
+    if (i < ipv6.size()) {
+      connect_candidates_.push_back(ipv6[i]);
+    }
+    if (i < ipv4.size()) {
+      connect_candidates_.push_back(ipv4[i]);
+    }
+  }
+  connect_attempt_error_ = absl::OkStatus();
+  StartNextConnectAttempt();
+}
+
+void TcpConnection::StartNextConnectAttempt() {
+  if (connect_attempt_alarm_.has_value()) {
+    selector()->UnregisterAlarm(connect_attempt_alarm_.value());
+    connect_attempt_alarm_.reset();
+  }
+  while (!connect_candidates_.empty()) {
+    HostPort address;
+    {
+      absl::WriterMutexLock l(&mutex_);
+      address = remote_address_;
+    }
+    address.set_ip(connect_candidates_.front());
+    connect_candidates_.pop_front();
+    auto attempt = absl::make_unique<ConnectAttempt>(this, std::move(address));
+    ++num_connect_attempts_;
+    const absl::Status status = attempt->Start();
+    if (!status.ok()) {
+      LOG_IF(INFO, detail_log_)
+          << ToString() << " - Connect attempt failed: " << status;
+      connect_attempt_error_ = status;
+      continue;
+    }
+    LOG_IF(INFO, detail_log_) << ToString() << " - Connect attempt to: "
+                              << attempt->address().ToString();
+    connect_attempts_.emplace_back(std::move(attempt));
+    if (!connect_candidates_.empty()) {
+      connect_attempt_alarm_ = selector()->RegisterAlarm(
+          [this]() {
+            connect_attempt_alarm_.reset();
+            StartNextConnectAttempt();
+          },
+          params_.connection_attempt_delay);
+    }
+    return;
+  }
+  if (connect_attempts_.empty()) {
+    InternalClose(status::Annotate(connect_attempt_error_,
+                                   "All connect attempts failed."),
+                  true);
+  }
+}
+
+void TcpConnection::HandleConnectAttempt(ConnectAttempt* attempt, int err) {
+  CHECK(selector()->IsInSelectThread());
+  auto it = std::find_if(
+      connect_attempts_.begin(), connect_attempts_.end(),
+      [attempt](const std::unique_ptr<ConnectAttempt>& a) {
+        return a.get() == attempt;
+      });
+  CHECK(it != connect_attempts_.end());
+  std::unique_ptr<ConnectAttempt> completed = std::move(*it);
+  connect_attempts_.erase(it);
+  if (err != 0) {
+    connect_attempt_error_ =
+        absl::Status(error::ErrnoToStatus(err)
+                     << "connecting to: " << completed->address().ToString());
+    LOG_IF(INFO, detail_log_) << ToString() << " - Connect attempt failed: "
+                              << connect_attempt_error_;
+    completed->Close();
+    // May still be in the events being dispatched now.
+    selector()->DeleteInSelectLoop(std::move(completed));
+    // No need to wait for the delay - start the next right away.
+    StartNextConnectAttempt();
+    return;
+  }
+  const int fd = completed->ReleaseFd();
+  const HostPort address = completed->address();
+  selector()->DeleteInSelectLoop(std::move(completed));
+  ClearConnectAttempts();
+  {
+    absl::WriterMutexLock l(&mutex_);
+    remote_address_ = address;
+  }
+  fd_.store(fd);
+  // We complete the connect as usual, on the first event of our own.
+  absl::Status status = SetSocketOptions(true);
+  if (status.ok()) {
+    status = selector()->Register(this);
+  }
+  if (status.ok()) {
+    status = RequestWriteEvents(true);
+  }
+  if (status.ok()) {
+    status = RequestReadEvents(true);
+  }
+  if (!status.ok()) {
     InternalClose(status, true);
   }
 }
 
+void TcpConnection::ClearConnectAttempts() {
+  if (connect_attempt_alarm_.has_value()) {
+    selector()->UnregisterAlarm(connect_attempt_alarm_.value());
+    connect_attempt_alarm_.reset();
+  }
+  connect_candidates_.clear();
+  for (auto& attempt : connect_attempts_) {
+    attempt->Close();
+    selector()->DeleteInSelectLoop(std::move(attempt));
+  }
+  connect_attempts_.clear();
+}
+
 bool TcpConnection::PerformConnectOnFirstOperation() {
   set_state(CONNECTED);
   LOG_IF_ERROR(WARNING, InitializeLocalAddress())
@@ -1156,24 +2323,369 @@ bool TcpConnection::PerformConnectOnFirstOperation() {
   return state() == CONNECTED;
 }
 
-absl::StatusOr<ssize_t> TcpConnection::PerformRead() {
-  int count = 0;
-  if (ABSL_PREDICT_FALSE(::ioctl(fd_.load(), FIONREAD, &count) < 0)) {
-    return error::ErrnoToStatus(error::Errno())
-           << " - performing ::ioctl w/ FIONREAD for: " << ToString();
+absl::StatusOr<ssize_t> TcpConnection::PerformRead(size_t max_size) {
+  const absl::Time now = selector()->now();
+  size_t to_read = read_block_size_;
+  if (params_.read_available_size) {
+    int count = 0;
+    if (ABSL_PREDICT_FALSE(::ioctl(fd_.load(), FIONREAD, &count) < 0)) {
+      return error::ErrnoToStatus(error::Errno())
+             << " - performing ::ioctl w/ FIONREAD for: " << ToString();
+    }
+    if (count <= 0) {
+      RETURN_IF_ERROR(CheckReadClosed());
+      return 0;
+    }
+    to_read = count;
+  } else if (params_.adaptive_block_size &&
+             now - absl::FromUnixNanos(last_read_ts_.load()) >
+                 kReadBlockResetPeriod &&
+             read_block_size_ != params_.block_size) {
+    read_block_size_ = params_.block_size;
+    read_stats_.block_size.store(read_block_size_);
+    read_stats_.block_resets.fetch_add(1);
+    to_read = read_block_size_;
+  }
+  const size_t read_limit =
+      std::min(params_.read_limit.value_or(SIZE_MAX), max_size);
+  to_read = std::min(to_read, read_limit);
+  // Room for reading more than the block in one call, up to the limit.
+  const size_t overflow_size =
+      params_.read_available_size || selector()->read_buffer_pool() != nullptr
+          ? 0
+          : std::min(kReadOverflowSize, read_limit - to_read);
+  size_t cb = 0;
+  if (overflow_size == 0) {
+    ASSIGN_OR_RETURN(cb, Selectable::ReadToCord(inbuf(), to_read),
+                     _ << "Reading from input socket for: " << ToString());
+  } else {
+    char* const overflow = selector()->ScratchBuffer(kReadOverflowSize);
+    ASSIGN_OR_RETURN(
+        cb,
+        Selectable::ReadToCordVec(inbuf(), to_read, overflow, overflow_size),
+        _ << "Reading from input socket for: " << ToString());
+    if (cb > to_read) {
+      read_stats_.overflow_reads.fetch_add(1);
+    }
   }
-  if (count <= 0) {
-    return absl::OkStatus();  // nothing to read.
+  read_filled_ = cb == to_read + overflow_size;
+  if (cb == 0) {
+    RETURN_IF_ERROR(CheckReadClosed());
+    return 0;
   }
-  if (params_.read_limit.has_value() &&
-      size_t(count) > params_.read_limit.value()) {
-    count = params_.read_limit.value();
+  if (!params_.read_available_size) {
+    AdaptReadBlockSize(cb);
   }
-  ASSIGN_OR_RETURN(const ssize_t cb, Selectable::ReadToCord(inbuf(), count),
-                   _ << "Reading from input socket for: " << ToString());
+  read_stats_.reads.fetch_add(1);
   inc_bytes_read(cb);
-  last_read_ts_.store(absl::ToUnixNanos(selector()->now()));
+  last_read_ts_.store(absl::ToUnixNanos(now));
+  return cb;
+}
+
+absl::Status TcpConnection::CheckReadClosed() {
+  char c;
+  const ssize_t peek_cb = ::recv(fd_.load(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (peek_cb == 0) {
+    set_read_closed(true);
+  } else if (peek_cb < 0 &&
+             !error::IsUnavailableAndShouldRetry(error::Errno())) {
+    return error::ErrnoToStatus(error::Errno())
+           << " - checking the input socket for: " << ToString();
+  }
+  return absl::OkStatus();
+}
+
+void TcpConnection::AdaptReadBlockSize(size_t cb) {
+  if (cb >= read_block_size_) {
+    read_stats_.full_reads.fetch_add(1);
+  }
+  if (!params_.adaptive_block_size) {
+    return;
+  }
+  if (cb >= read_block_size_) {
+    small_reads_ = 0;
+    if (read_block_size_ < params_.max_block_size) {
+      read_block_size_ = std::min(2 * read_block_size_, params_.max_block_size);
+      read_stats_.block_grows.fetch_add(1);
+    }
+  } else if (cb < read_block_size_ / 4 &&
+             read_block_size_ > params_.min_block_size) {
+    if (++small_reads_ >= kSmallReadsToShrink) {
+      small_reads_ = 0;
+      read_block_size_ = std::max(read_block_size_ / 2, params_.min_block_size);
+      read_stats_.block_shrinks.fetch_add(1);
+    }
+  } else {
+    small_reads_ = 0;
+  }
+  read_stats_.block_size.store(read_block_size_);
+}
+
+absl::StatusOr<bool> TcpConnection::WriteOutput(
+    absl::optional<size_t> limit) {
+  size_t to_write = 0;
+  size_t cb = 0;
+  if (outbuf()->empty() && !out_files_.empty()) {
+    const OutputFile& out_file = *out_files_.front();
+    to_write = std::min(out_file.size, limit.value_or(out_file.size));
+    ASSIGN_OR_RETURN(
+        cb, Selectable::SendFile(out_file.fd, out_file.offset, to_write),
+        _ << "Sending queued file for: " << ToString());
+    ConsumeOutputFile(cb);
+  } else {
+    to_write = std::min(outbuf()->size(), limit.value_or(outbuf()->size()));
+    absl::optional<size_t> zerocopy_cb;
+    if (zerocopy_enabled_) {
+      // The chunks before the first large one are written as usual.
+      const size_t threshold = params_.zerocopy_threshold.value();
+      size_t small_size = 0;
+      size_t num_chunks = 0;
+      for (absl::string_view chunk : outbuf()->Chunks()) {
+        if (chunk.size() >= threshold || small_size >= to_write ||
+            ++num_chunks > io::CordIo::IovecBuilder::kMaxIovecs) {
+          break;
+        }
+        small_size += chunk.size();
+      }
+      if (small_size == 0) {
+        const absl::string_view chunk = *outbuf()->chunk_begin();
+        ASSIGN_OR_RETURN(zerocopy_cb,
+                         WriteZerocopy(chunk.substr(0, to_write)));
+        if (zerocopy_cb.has_value()) {
+          to_write = std::min(to_write, chunk.size());
+        }
+      } else {
+        to_write = std::min(to_write, small_size);
+      }
+    }
+    if (zerocopy_cb.has_value()) {
+      cb = zerocopy_cb.value();
+    } else {
+      ASSIGN_OR_RETURN(cb, Selectable::WriteCordVec(*outbuf(), to_write));
+    }
+    outbuf()->RemovePrefix(cb);
+  }
+  inc_bytes_written(cb);
+  last_write_ts_.store(absl::ToUnixNanos(selector()->now()));
+  return cb == to_write;
+}
+
+absl::StatusOr<absl::optional<size_t>> TcpConnection::WriteZerocopy(
+    absl::string_view data) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+  const ssize_t cb =
+      ::send(fd_.load(), data.data(), data.size(), MSG_ZEROCOPY | MSG_NOSIGNAL);
+  if (cb < 0) {
+    const int send_error = error::Errno();
+    if (error::IsUnavailableAndShouldRetry(send_error)) {
+      return 0;
+    }
+    if (send_error == ENOBUFS) {
+      // Over the limit of memory pinned for this socket - we copy until
+      // the kernel completes some of the sends.
+      return absl::nullopt;
+    }
+    return error::ErrnoToStatus(send_error)
+           << "Sending data with MSG_ZEROCOPY, size: " << data.size();
+  }
+  // The kernel counts each successful call, and reports the completions by
+  // these numbers. Until then, it reads the data from our chunk.
+  zerocopy_pending_.emplace_back(zerocopy_next_id_++, outbuf()->Subcord(0, cb));
+  ++zerocopy_sends_;
   return cb;
+#else
+  return absl::nullopt;
+#endif  // SO_ZEROCOPY && MSG_ZEROCOPY
+}
+
+absl::Status TcpConnection::ProcessZerocopyCompletions() {
+  RETURN_IF_ERROR(ReadZerocopyCompletions(fd_.load(), &zerocopy_pending_,
+                                          &zerocopy_completed_,
+                                          &zerocopy_copied_))
+      << "Reading the socket error queue for: " << ToString();
+  return absl::OkStatus();
+}
+
+absl::Status TcpConnection::ReadZerocopyCompletions(int fd,
+                                                    ZerocopyPending* pending,
+                                                    size_t* num_completed,
+                                                    size_t* num_copied) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+  while (true) {
+    char control[128];
+    struct msghdr msg = {};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      const int recv_error = error::Errno();
+      if (error::IsUnavailableAndShouldRetry(recv_error)) {
+        return absl::OkStatus();  // all processed.
+      }
+      return error::ErrnoToStatus(recv_error);
+    }
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+            (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+        continue;
+      }
+      const auto* err =
+          reinterpret_cast<const struct sock_extended_err*>(CMSG_DATA(cm));
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      // The completed sends, from ee_info to ee_data, can be reported out
+      // of order.
+      const uint32_t first = err->ee_info;
+      const size_t count = err->ee_data - first + 1;
+      *num_completed += count;
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        *num_copied += count;
+      }
+      pending->erase(std::remove_if(pending->begin(), pending->end(),
+                                    [first, count](const auto& send) {
+                                      return send.first - first < count;
+                                    }),
+                     pending->end());
+    }
+  }
+#else
+  return absl::OkStatus();
+#endif  // SO_ZEROCOPY && MSG_ZEROCOPY
+}
+
+struct TcpConnection::ZerocopyDrain {
+  int fd;
+  ZerocopyPending pending;
+  absl::Time deadline;
+};
+
+void TcpConnection::StartZerocopyDrain() {
+  LOG_IF(INFO, detail_log_)
+      << ToString() << " - Closing, w/ MSG_ZEROCOPY sends not completed: "
+      << zerocopy_pending_.size();
+  // Already unregistered from the selector.
+  Selector* const selector = net_selector();
+  auto* const drain =
+      new ZerocopyDrain{fd_.load(), std::move(zerocopy_pending_),
+                        selector->now() + kZerocopyDrainTimeout};
+  zerocopy_pending_.clear();
+  ContinueZerocopyDrain(selector, drain);
+}
+
+void TcpConnection::ContinueZerocopyDrain(Selector* selector,
+                                          ZerocopyDrain* drain) {
+  size_t num_completed = 0;
+  size_t num_copied = 0;
+  const absl::Status status = ReadZerocopyCompletions(
+      drain->fd, &drain->pending, &num_completed, &num_copied);
+  if (status.ok() && !drain->pending.empty() &&
+      selector->now() < drain->deadline) {
+    selector->RegisterAlarm(
+        [selector, drain]() { ContinueZerocopyDrain(selector, drain); },
+        kZerocopyDrainPeriod);
+    return;
+  }
+  if (!drain->pending.empty()) {
+    // Better leaked than freed while the kernel may still read them.
+    LOG(WARNING) << "Leaking the data of " << drain->pending.size()
+                 << " MSG_ZEROCOPY sends not completed on close: "
+                 << (status.ok() ? "timeout" : status.ToString());
+    new ZerocopyPending(std::move(drain->pending));
+  }
+  if (::close(drain->fd) < 0) {
+    LOG(WARNING) << "::close failed for a socket w/ MSG_ZEROCOPY sends: "
+                 << error::ErrnoToString(error::Errno());
+  }
+  delete drain;
+}
+
+absl::StatusOr<bool> TcpConnection::FlushOutbuf() {
+  while (has_pending_output()) {
+    ASSIGN_OR_RETURN(const bool fully_written, WriteOutputRateLimited({}),
+                     _ << "Flushing the output for: " << ToString());
+    if (!fully_written) {
+      return false;
+    }
+  }
+  return true;
+}
+
+absl::StatusOr<bool> TcpConnection::WriteOutputRateLimited(
+    absl::optional<size_t> limit) {
+  if (!write_limiter_.enabled()) {
+    return WriteOutput(limit);
+  }
+  if (write_throttled_) {
+    return false;
+  }
+  const size_t allowed =
+      write_limiter_.Acquire(limit.value_or(SIZE_MAX), selector()->now());
+  if (allowed == 0) {
+    ThrottleWrites();
+    return false;
+  }
+  const int64_t bytes_written = count_bytes_written();
+  auto result = WriteOutput(allowed);
+  const size_t cb = count_bytes_written() - bytes_written;
+  write_limiter_.Release(allowed - std::min(cb, allowed));
+  return result;
+}
+
+void TcpConnection::ThrottleReads() {
+  ++read_throttles_;
+  read_throttled_ = true;
+  LOG_IF_ERROR(WARNING, selector()->EnableReadCallback(this, false));
+  // We wait for at least a small read worth of tokens.
+  timeouter_.SetTimeout(
+      kReadThrottleTimeoutId,
+      std::clamp(read_limiter_.TimeUntilAvailable(params_.min_block_size,
+                                                  selector()->now()),
+                 kMinThrottleTimeout, kMaxThrottleTimeout));
+}
+
+void TcpConnection::ThrottleWrites() {
+  ++write_throttles_;
+  write_throttled_ = true;
+  LOG_IF_ERROR(WARNING, selector()->EnableWriteCallback(this, false));
+  timeouter_.SetTimeout(
+      kWriteThrottleTimeoutId,
+      std::clamp(write_limiter_.TimeUntilAvailable(params_.min_block_size,
+                                                   selector()->now()),
+                 kMinThrottleTimeout, kMaxThrottleTimeout));
+}
+
+void TcpConnection::ResumeReads() {
+  read_throttled_ = false;
+  if (fd_.load() != kInvalidFdValue && read_events_requested_ &&
+      !read_closed()) {
+    LOG_IF_ERROR(WARNING, selector()->EnableReadCallback(this, true));
+  }
+}
+
+void TcpConnection::ResumeWrites() {
+  write_throttled_ = false;
+  if (fd_.load() != kInvalidFdValue && !write_closed() &&
+      (state() == CONNECTED || state() == FLUSHING) &&
+      (write_events_requested_ || has_pending_output())) {
+    LOG_IF_ERROR(WARNING, selector()->EnableWriteCallback(this, true));
+  }
+}
+
+bool TcpConnection::IsReadable() const {
+  char c;
+  return ::recv(fd_.load(), &c, 1, MSG_PEEK | MSG_DONTWAIT) >= 0 ||
+         !error::IsUnavailableAndShouldRetry(error::Errno());
+}
+
+bool TcpConnection::ShouldContinueReading(ssize_t cb) const {
+  // If the last read did not fill its buffers we read everything available.
+  // Else we read again, until a short read or EAGAIN - w/o checking first if
+  // there is more data, which would cost a system call per read.
+  return edge_triggered() && cb > 0 && read_filled_ &&
+         fd_.load() != kInvalidFdValue &&
+         (desire_ & SelectDesire::kWantRead) &&
+         (state() == CONNECTED || state() == FLUSHING);
 }
 
 void TcpConnection::CallCloseHandler(const absl::Status& status,
@@ -1,16 +1,21 @@
 #ifndef WHISPERLIB_NET_CONNECTION_H_
 #define WHISPERLIB_NET_CONNECTION_H_
 
+#include <deque>
 #include <memory>
+#include <utility>
+#include <vector>
 
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/types/optional.h"
+#include "whisperlib/io/file.h"
 #include "whisperlib/net/address.h"
 #include "whisperlib/net/dns_resolve.h"
 #include "whisperlib/net/selectable.h"
 #include "whisperlib/net/selector.h"
 #include "whisperlib/net/timeouter.h"
+#include "whisperlib/net/token_bucket.h"
 
 namespace whisper {
 namespace net {
@@ -18,6 +23,7 @@ namespace net {
 // Uses ::getsockopt to extract the last socket error from provided socket fd.
 int ExtractSocketErrno(int fd);
 class Connection;
+class DnsClient;
 
 class Acceptor {
  public:
@@ -104,7 +110,7 @@ class Acceptor {
 class Connection {
  public:
   explicit Connection(Selector* net_selector);
-  virtual ~Connection() = default;
+  virtual ~Connection();
 
   // Starts connection to a remote address. If successful, the connection
   // is actually pending, when completed ok, the connect handler will be called,
@@ -163,7 +169,11 @@ class Connection {
   // Then input data from the remote peer.
   absl::Cord* inbuf();
   // Then output data for the remote peer.
+  // Note: after a WriteFile(), use Write() for appending to the output,
+  // as the data appended here would be sent before the file.
   absl::Cord* outbuf();
+  // If we still have data to send - in the outbuf() or in queued files.
+  bool has_pending_output() const;
 
   //////////////////// Connect / Close / Read / Write handlers
 
@@ -202,12 +212,60 @@ class Connection {
 
   // Appends the content of the buffer to the outbuf_ and registers
   // the desire for write I/O operation.
+  // Going over the set_max_pending_output() closes the connection - not
+  // right away, but from the next select loop step.
   void Write(const absl::Cord& buffer);
   void Write(absl::Cord&& buffer);
   void Write(absl::string_view buffer);
   void Write(std::string&& buffer);
+  // Queues `length` bytes of the file, starting at `offset`, to be sent after
+  // the data written so far, and before the data written afterwards.
+  // The TCP connections send it with ::sendfile, without copying it through
+  // user space. The SSL connections read it in chunks for encryption (or
+  // use ::sendfile too, when the kernel encrypts the data - kTLS).
+  // The file descriptor is duplicated, so the file can be closed right
+  // away, but its content is read only as it is sent.
+  absl::Status WriteFile(const io::File& file, int64_t offset, size_t length);
+
+  //////////////////// Corking
+  // While corked, the writes above are only gathered in the outbuf_, and are
+  // sent together, in as few packets as possible, on the matching Uncork().
+  // Useful when a response is assembled from many small pieces (e.g. a
+  // header, then a body). The calls can be nested, and should be made from
+  // the selector thread. An Uncork() w/o a matching Cork() is logged, and
+  // ignored.
+  void Cork();
+  void Uncork();
+  bool corked() const { return cork_depth_ > 0; }
+
+  //////////////////// Write backpressure
+  // When the output not yet sent grows to the high watermark, the output
+  // watermark handler is called with true, and when it drains back to the
+  // low watermark, with false - e.g. a proxy stops reading from the
+  // upstream connection (RequestReadEvents(false)) in between, so a slow
+  // peer does not make us buffer without bounds. The output is checked on
+  // Write() / WriteFile() and as it is sent - data appended directly to the
+  // outbuf() is seen on the next check. Call from the selector thread.
+  // A high watermark of 0 (the default) disables the handler.
+  Connection& set_output_watermarks(size_t low, size_t high);
+  using OutputWatermarkHandler = std::function<void(bool above_high)>;
+  Connection& set_output_watermark_handler(OutputWatermarkHandler handler);
+  Connection& clear_output_watermark_handler();
+  // If set, the connection is force closed, with a ResourceExhausted
+  // last_error(), when its output grows above this. The close is done from
+  // an alarm, so the caller of e.g. Write() still has the connection.
+  Connection& set_max_pending_output(size_t value);
+  // If the output reached the high watermark, and did not drain yet.
+  bool output_above_high_watermark() const { return output_above_high_; }
+  // The size of the output not yet sent: the outbuf() and the queued files
+  // (and e.g. the encrypted data not sent yet, for SSL).
+  virtual size_t PendingOutputSize() const;
 
  protected:
+  // Called when the connection gets corked (by the first Cork()) and
+  // uncorked (by the last Uncork()), for applying it to the transport.
+  virtual absl::Status SetCorked(bool corked);
+
   // Sets the internal selector.
   // Note: can be called when the current selector is null.
   void set_net_selector(Selector* value);
@@ -220,6 +278,38 @@ class Connection {
   // Increments the count of bytes written, by this value.
   void inc_bytes_written(int64_t value);
 
+  // A file region queued by WriteFile(), and the data written after it.
+  struct OutputFile {
+    OutputFile() = default;
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+    ~OutputFile();
+    // Duplicate of the file descriptor, owned by us.
+    int fd = io::File::kInvalidFdValue;
+    // Next offset to send from, and the number of bytes left to send.
+    int64_t offset = 0;
+    size_t size = 0;
+    // The output to send after this file.
+    absl::Cord next;
+  };
+  // Where the data written now goes: the outbuf_, or after the last file.
+  absl::Cord* output_tail();
+  // Marks size bytes of the first file as sent. When the file is done, what
+  // was written after it moves to the (empty) outbuf_.
+  void ConsumeOutputFile(size_t size);
+  // Reads at most size bytes from the first file into the outbuf_, for
+  // connections that cannot send the file directly.
+  // Returns the number of bytes read.
+  absl::StatusOr<size_t> ReadOutputFile(size_t size);
+  // Moves all our output at the end of the output of dest.
+  // Returns the number of bytes moved.
+  size_t MoveOutputTo(Connection* dest);
+
+  // Checks the pending output against the watermarks and the maximum,
+  // and updates the buffered output of the selector. Called when the
+  // output changes - e.g. after sending, and after clearing it on close.
+  void CheckPendingOutput();
+
   // Calls the registered connect handler.
   void CallConnectHandler();
   // Calls the registered read handler and returns the result.
@@ -251,6 +341,23 @@ class Connection {
   // Buffer with data from us to remote address.
   // - should be accessed only from selector thread.
   absl::Cord outbuf_;
+  // Files to send after the outbuf_, in order.
+  // - should be accessed only from selector thread.
+  std::deque<std::unique_ptr<OutputFile>> out_files_;
+  // Number of Cork() calls not matched yet by Uncork().
+  // - should be accessed only from selector thread.
+  size_t cork_depth_ = 0;
+  // Write backpressure settings and state - see set_output_watermarks().
+  // - should be accessed only from selector thread.
+  size_t output_low_watermark_ = 0;
+  size_t output_high_watermark_ = 0;
+  absl::optional<size_t> max_pending_output_;
+  OutputWatermarkHandler output_watermark_handler_ = nullptr;
+  bool output_above_high_ = false;
+  // The pending output accounted in the selector buffered output.
+  size_t accounted_output_ = 0;
+  // Closes the connection for going over the max_pending_output_.
+  absl::optional<Selector::AlarmId> max_output_close_alarm_;
   // Log in detail about this connection.
   bool detail_log_ = false;
 };
@@ -264,10 +371,67 @@ struct TcpConnectionParams {
   absl::optional<size_t> read_limit;
   // Buffered write operations are limited to this size.
   absl::optional<size_t> write_limit;
-  // Block size for buffered reads and writes.
+  // Block size for buffered reads and writes. With adaptive_block_size,
+  // this is the initial block size for reads.
   size_t block_size = 16384UL;
+  // If set, the reads adapt their block size, between min_block_size and
+  // max_block_size: it doubles when a read fills the block, halves after a
+  // few consecutive small reads, and gets back to block_size after a
+  // period of no reads. Either way, reads also use a selector scratch
+  // buffer for what does not fit the block, so one ::readv gets all the
+  // available data.
+  // Note: when the selector has a read buffer pool, its buffers are used
+  // for the reads, as many as the block size needs.
+  bool adaptive_block_size = false;
+  size_t min_block_size = 1024UL;
+  size_t max_block_size = 262144UL;
+  // Query the available data size (with FIONREAD) before each read and read
+  // exactly that, instead of adapting the block size. One more system call
+  // per read, but no memory is allocated in advance.
+  bool read_available_size = false;
   // During unconfirmed shutdown, linger this long before closing.
   absl::Duration shutdown_linger_timeout = absl::Seconds(5);
+  // If set, the outbuf chunks of at least this size are sent with
+  // MSG_ZEROCOPY (where supported, i.e. Linux), so the kernel transmits them
+  // from our memory instead of copying them. The chunks are kept until the
+  // kernel reports the completion. Worth it only for large chunks (e.g.
+  // above 16KiB), and the kernel still copies the data for the loopback.
+  absl::optional<size_t> zerocopy_threshold;
+  // If set, the socket is set with SO_BUSY_POLL (Linux), so the kernel busy
+  // polls the device queue for this long when there is no data to read,
+  // instead of waiting for the interrupt. Best paired with the selector
+  // busy_poll_duration. Values above net.core.busy_read need CAP_NET_ADMIN,
+  // and failing to set it is not an error (just a warning).
+  absl::optional<absl::Duration> socket_busy_poll;
+  // If set, the host names are resolved by this client, instead of the
+  // threads of DnsResolver::Default(). Not owned. When running in the same
+  // selector as the connection, the resolve completes with no thread handoff.
+  DnsClient* dns_client = nullptr;
+  // When the host name resolves to several addresses, connect to them in
+  // parallel, per the Happy Eyeballs algorithm (RFC 8305): the attempts
+  // start connection_attempt_delay apart (or right away when the previous
+  // one fails), alternating IPv6 and IPv4 addresses, starting with IPv6.
+  // We keep the first socket that connects, and close the others.
+  bool happy_eyeballs = false;
+  absl::Duration connection_attempt_delay = absl::Milliseconds(250);
+  // If set, opens the sockets of the happy_eyeballs connect attempts,
+  // instead of ::socket + ::connect: returns a non-blocking socket
+  // connecting to the address, which is writable when the connect
+  // completes. Mostly for tests, to control how each attempt goes.
+  using ConnectAttemptFunction =
+      std::function<absl::StatusOr<int>(const HostPort& address)>;
+  ConnectAttemptFunction connect_attempt_function;
+  // If set, the reads / writes of each connection are limited to this rate
+  // (in bytes per second), w/ bursts up to the bucket size, by a token
+  // bucket of its own.
+  absl::optional<TokenBucket::Params> read_rate_limit;
+  absl::optional<TokenBucket::Params> write_rate_limit;
+  // If set, the reads / writes are also limited by these token buckets,
+  // shared w/ other connections - e.g. all the connections of a tenant.
+  // When a bucket is empty, the connection stops listening for the read /
+  // write events, and resumes, on a selector alarm, when it refills.
+  std::shared_ptr<TokenBucket> shared_read_bucket;
+  std::shared_ptr<TokenBucket> shared_write_bucket;
   // If detail description should be logged about this connection.
   bool detail_log = false;
 
@@ -276,31 +440,86 @@ struct TcpConnectionParams {
   TcpConnectionParams& set_read_limit(size_t value);
   TcpConnectionParams& set_write_limit(size_t value);
   TcpConnectionParams& set_block_size(size_t value);
+  TcpConnectionParams& set_adaptive_block_size(bool value);
+  TcpConnectionParams& set_min_block_size(size_t value);
+  TcpConnectionParams& set_max_block_size(size_t value);
+  TcpConnectionParams& set_read_available_size(bool value);
   TcpConnectionParams& set_shutdown_linger_timeout(absl::Duration value);
+  TcpConnectionParams& set_zerocopy_threshold(size_t value);
+  TcpConnectionParams& set_socket_busy_poll(absl::Duration value);
+  TcpConnectionParams& set_dns_client(DnsClient* value);
+  TcpConnectionParams& set_happy_eyeballs(bool value);
+  TcpConnectionParams& set_connection_attempt_delay(absl::Duration value);
+  TcpConnectionParams& set_connect_attempt_function(
+      ConnectAttemptFunction value);
+  TcpConnectionParams& set_read_rate_limit(TokenBucket::Params value);
+  TcpConnectionParams& set_write_rate_limit(TokenBucket::Params value);
+  TcpConnectionParams& set_shared_read_bucket(
+      std::shared_ptr<TokenBucket> value);
+  TcpConnectionParams& set_shared_write_bucket(
+      std::shared_ptr<TokenBucket> value);
   TcpConnectionParams& set_detail_log(bool value);
 };
 
+// The selector threads in which an acceptor places its accepted
+// connections, and the policy for choosing between them.
 class AcceptorThreads {
  public:
+  enum class PlacementPolicy {
+    // Each thread in turn.
+    ROUND_ROBIN,
+    // The thread with the fewest registered selectables (i.e. connections).
+    LEAST_CONNECTIONS,
+    // The thread with the lowest loop utilization, in the last
+    // measurement window of its selector.
+    LEAST_BUSY,
+  };
+  // Custom placement - returns the index of the thread to use, from the
+  // provided (non empty) threads.
+  using PlacementFunction =
+      std::function<size_t(const std::vector<SelectorThread*>&)>;
+
   AcceptorThreads() = default;
   AcceptorThreads(AcceptorThreads&& other)
       : next_client_thread_(other.next_client_thread_.load()),
-        client_threads_(std::move(other.client_threads_)) {}
+        client_threads_(std::move(other.client_threads_)),
+        placement_policy_(other.placement_policy_),
+        placement_function_(std::move(other.placement_function_)) {}
   AcceptorThreads(const AcceptorThreads& other)
       : next_client_thread_(other.next_client_thread_.load()),
-        client_threads_(other.client_threads_) {}
+        client_threads_(other.client_threads_),
+        placement_policy_(other.placement_policy_),
+        placement_function_(other.placement_function_) {}
   AcceptorThreads& operator=(AcceptorThreads&& other) {
     next_client_thread_.store(other.next_client_thread_.load());
     client_threads_ = std::move(other.client_threads_);
+    placement_policy_ = other.placement_policy_;
+    placement_function_ = std::move(other.placement_function_);
     return *this;
   }
   AcceptorThreads& set_client_threads(
       std::vector<SelectorThread*> client_threads);
+  const std::vector<SelectorThread*>& client_threads() const;
+  AcceptorThreads& set_placement_policy(PlacementPolicy value);
+  // When set, this is used instead of the placement policy.
+  AcceptorThreads& set_placement_function(PlacementFunction value);
+
+  // Returns the selector for the next connection, per placement policy.
+  // Null if no client threads are set.
+  // Note: the connection counts are updated only when the connections get
+  // registered in their selectors, so during bursts of connections the
+  // choice works with slightly stale counts. Ties are broken round robin.
   Selector* GetNextSelector();
 
  private:
+  // Returns the index of the least loaded thread, per provided load.
+  template <typename Load>
+  size_t PickLeastLoaded(Load load);
+
   std::atomic_size_t next_client_thread_ = ATOMIC_VAR_INIT(0);
   std::vector<SelectorThread*> client_threads_;
+  PlacementPolicy placement_policy_ = PlacementPolicy::ROUND_ROBIN;
+  PlacementFunction placement_function_;
 };
 
 struct TcpAcceptorParams {
@@ -312,11 +531,45 @@ struct TcpAcceptorParams {
   size_t max_backlog = 100;
   // If detail description should be logged about this acceptor.
   bool detail_log = false;
+  // If set, instead of one listening socket that passes the accepted
+  // connections to the acceptor_threads, we listen with one SO_REUSEPORT
+  // socket in each of the acceptor_threads. The kernel distributes the
+  // incoming connections between them, and each connection is accepted
+  // and initialized in the selector thread that it is going to run on.
+  // Requires non empty acceptor_threads. Listen() waits for the sockets to
+  // register in the (running) acceptor threads.
+  bool reuse_port = false;
+  // In reuse_port mode, attaches a BPF program to the listening sockets
+  // that steers the incoming connections to the listener with the index
+  // of the cpu that handles the connection packets (modulo the number of
+  // listeners). Makes sense only with the acceptor threads pinned to the
+  // cpus that handle the network queues. Linux only.
+  bool reuse_port_cpu_steering = false;
+  // Maximum number of connections accepted in a row, on one read event.
+  size_t max_accepts_per_event = 64;
+  // If non zero, we stop accepting while this many accepted connections
+  // wait to be initialized in the acceptor threads, and resume when half
+  // of them were initialized. Protects overloaded client threads from
+  // piling up more work.
+  size_t max_pending_initializations = 0;
+  // If set, only the connections from peers in this set are accepted.
+  std::shared_ptr<const IpPrefixSet> allowed_peers;
+  // If set, the connections from peers in this set are rejected.
+  // Both checks are done before calling the filter handler, and the
+  // rejected connections are counted in the filtered_connections stat.
+  std::shared_ptr<const IpPrefixSet> denied_peers;
 
   TcpAcceptorParams& set_acceptor_threads(AcceptorThreads value);
   TcpAcceptorParams& set_tcp_connection_params(TcpConnectionParams value);
   TcpAcceptorParams& set_max_backlog(size_t value);
   TcpAcceptorParams& set_detail_log(bool value);
+  TcpAcceptorParams& set_max_accepts_per_event(size_t value);
+  TcpAcceptorParams& set_max_pending_initializations(size_t value);
+  TcpAcceptorParams& set_reuse_port(bool value);
+  TcpAcceptorParams& set_reuse_port_cpu_steering(bool value);
+  TcpAcceptorParams& set_allowed_peers(
+      std::shared_ptr<const IpPrefixSet> value);
+  TcpAcceptorParams& set_denied_peers(std::shared_ptr<const IpPrefixSet> value);
 };
 
 class TcpAcceptor : public Acceptor, private Selectable {
@@ -343,6 +596,8 @@ class TcpAcceptor : public Acceptor, private Selectable {
     std::atomic_size_t connection_wrap_errors = ATOMIC_VAR_INIT(0);
     // Successfully accepted and initialized clients.
     std::atomic_size_t connections_initialized = ATOMIC_VAR_INIT(0);
+    // Times we stopped accepting, for too many pending initializations.
+    std::atomic_size_t accept_pauses = ATOMIC_VAR_INIT(0);
   };
   const Statistics& stats() const;
 
@@ -352,6 +607,16 @@ class TcpAcceptor : public Acceptor, private Selectable {
   void Close() override;
   std::string ToString() const override;
 
+  // Starts accepting on sockets that are already bound and listening - e.g.
+  // received from the previous process of a restarting server (see
+  // NetRuntime). Takes the ownership of fds, which are one socket, or in
+  // reuse_port mode, one socket of the reuse port group for each of the
+  // acceptor threads.
+  absl::Status ListenOnFds(std::vector<int> fds);
+  // The listening sockets, still owned by the acceptor - as expected by
+  // ListenOnFds(). Call from the selector thread.
+  std::vector<int> listening_fds() const;
+
  private:
   ////////// Selectable interface override - private.
   // - Should be called from the selector thread.
@@ -361,12 +626,44 @@ class TcpAcceptor : public Acceptor, private Selectable {
   int GetFd() const override;
   // Close is already defined above under the same signature.
 
+  // A SO_REUSEPORT listening socket, in reuse_port mode.
+  class ReusePortListener;
+  // Leads the reuse port listeners, and the callbacks they post, to the
+  // acceptor - until it closes them.
+  struct ListenerHandle;
+  // Accepts a connection on the listening `listen_fd`. If `accept_selector`
+  // is provided, the connection is initialized in it (we are in its thread),
+  // else in the next selector of the acceptor threads.
+  // Returns false if we should stop accepting.
+  bool HandleAccept(int listen_fd, Selector* accept_selector);
+  // Checks the peer against the allowed_peers / denied_peers of params_.
+  bool IsPeerAllowed(const HostPort& peer_address) const;
   // Initializes a new connection in the provided selector.
   void InitializeAcceptedConnection(Selector* selector, int client_fd);
+  // Stops accepting, for too many pending connection initializations.
+  void PauseAccepting();
+  // Resumes accepting, if paused and enough initializations completed.
+  void MaybeResumeAccepting();
+  // Called in the client thread after a scheduled initialization.
+  void FinishPendingInitialization();
   // Reads local_address from associate file descriptor socket.
-  absl::Status InitializeLocalAddress();
+  absl::Status InitializeLocalAddress(int fd);
   // Sets normal socket options: non-blocking, fast bind reusing.
-  absl::Status SetSocketOptions();
+  absl::Status SetSocketOptions(int fd);
+  // Creates a socket, bound on addr and listening.
+  absl::StatusOr<int> CreateListeningSocket(
+      const struct sockaddr_storage& addr);
+  // Starts accepting on the listening socket fd, which we own.
+  absl::Status StartListening(int fd);
+  // Listen implementation for the reuse_port mode.
+  absl::Status ListenReusePort(const HostPort& local_addr);
+  // Starts the listeners on the reuse port sockets, which we own, in the
+  // acceptor threads - and waits for them to register there.
+  absl::Status StartReusePortListeners(std::vector<int> fds);
+  // Detaches from the reuse port listeners, and deletes them in their threads.
+  void CloseReusePortListeners();
+  // Attaches the cpu steering BPF program to the reuse port listeners.
+  absl::Status AttachCpuSteeringProgram(int fd, size_t num_listeners);
   // Close internal socket fd_.
   void InternalClose(const absl::Status& status);
 
@@ -374,6 +671,16 @@ class TcpAcceptor : public Acceptor, private Selectable {
   TcpAcceptorParams params_;
   // The fd of the socket
   std::atomic_int fd_ = ATOMIC_VAR_INIT(kInvalidFdValue);
+  // Connections accepted, that wait for initialization in the acceptor
+  // threads.
+  std::atomic_size_t num_pending_initializations_ = ATOMIC_VAR_INIT(0);
+  // If we stopped accepting, for too many pending initializations.
+  std::atomic_bool accept_paused_ = ATOMIC_VAR_INIT(false);
+  // In reuse_port mode, the listeners, in each of the acceptor threads.
+  // Modified only from our selector thread.
+  std::vector<std::unique_ptr<ReusePortListener>> listeners_;
+  // Shared w/ the listeners, while listening in reuse_port mode.
+  std::shared_ptr<ListenerHandle> listener_handle_;
   // Statistics of our run.
   Statistics stats_;
 };
@@ -383,6 +690,11 @@ class TcpConnection : public Connection, private Selectable {
   TcpConnection(Selector* selector, TcpConnectionParams params);
   virtual ~TcpConnection();
 
+  // When created in a select loop w/ an arena, the connection is allocated
+  // from it (see Selector::Params::arena_slab_size).
+  static void* operator new(size_t size) { return SelectorArena::New(size); }
+  static void operator delete(void* p) { SelectorArena::Delete(p); }
+
   ////////// Connection interface methods
   absl::Status Connect(const HostPort& remote_addr) override;
   void FlushAndClose() override;
@@ -399,6 +711,46 @@ class TcpConnection : public Connection, private Selectable {
   // eventual closing of the connection, for a connected connection.
   void CloseCommunication(CloseDirective directive);
 
+  // Use an already connected fd - this is the way the TcpAcceptor initializes
+  // the connection, and the way to adopt a socket accepted by another
+  // process (e.g. received w/ UnixConnection::TakeReceivedFds()).
+  // The local and peer addresses are obtained from fd. If is_nonblocking,
+  // the fd is already set as non blocking. Call from the selector thread.
+  absl::Status Wrap(int fd, bool is_nonblocking);
+
+  // With a zerocopy_threshold, counts of the sends done with MSG_ZEROCOPY,
+  // of those that completed, and of the completed ones that the kernel
+  // copied anyway. Should be called from the selector thread.
+  size_t zerocopy_sends() const { return zerocopy_sends_; }
+  size_t zerocopy_completed() const { return zerocopy_completed_; }
+  size_t zerocopy_copied() const { return zerocopy_copied_; }
+
+  // Sockets used for connecting by the last Connect() to a host name - more
+  // than one only in happy_eyeballs mode. Call from the selector thread.
+  size_t connect_attempts() const { return num_connect_attempts_; }
+
+  // Times the reading / writing was paused for rate limiting.
+  // Call from the selector thread.
+  size_t read_throttles() const { return read_throttles_; }
+  size_t write_throttles() const { return write_throttles_; }
+
+  // For tuning the read block size parameters.
+  struct ReadStatistics {
+    // Reads that returned data.
+    std::atomic_size_t reads = ATOMIC_VAR_INIT(0);
+    // Reads that filled their block.
+    std::atomic_size_t full_reads = ATOMIC_VAR_INIT(0);
+    // Reads that also used the stack buffer, past the block.
+    std::atomic_size_t overflow_reads = ATOMIC_VAR_INIT(0);
+    // Times the block size grew / shrank / got reset after no reads.
+    std::atomic_size_t block_grows = ATOMIC_VAR_INIT(0);
+    std::atomic_size_t block_shrinks = ATOMIC_VAR_INIT(0);
+    std::atomic_size_t block_resets = ATOMIC_VAR_INIT(0);
+    // The current read block size.
+    std::atomic_size_t block_size = ATOMIC_VAR_INIT(0);
+  };
+  const ReadStatistics& read_stats() const { return read_stats_; }
+
  private:
   ////////// Selectable interface methods
   // - Should be called from the selector thread.
@@ -407,13 +759,15 @@ class TcpConnection : public Connection, private Selectable {
   bool HandleErrorEvent(SelectorEventData event) override;
   int GetFd() const override;
   void Close() override;
+  // We read and write until EAGAIN in the event handlers.
+  bool SupportsEdgeTriggered() const override { return true; }
 
   //////////////////////////////////////////////////////////////////////
 
-  // Use an already connected fd - this is the way the TcpAcceptor initializes
-  // the connection. The local and peer addresses are obtained from fd.
-  absl::Status Wrap(int fd);
   friend class TcpAcceptor;
+  // Wraps us, and may need to flush the outbuf() and access the socket
+  // directly, when offloading TLS to the kernel.
+  friend class SslConnection;
 
   bool read_closed() const { return read_closed_.load(); }
   bool write_closed() const { return write_closed_.load(); }
@@ -428,8 +782,24 @@ class TcpConnection : public Connection, private Selectable {
   // The DNS resolve handler:
   void HandleDnsResult(absl::StatusOr<std::shared_ptr<DnsHostInfo>> info);
 
-  // Sets normal socket options: non-blocking, disable Nagel, apply tcp params.
-  absl::Status SetSocketOptions();
+  // A socket connecting to one of the resolved addresses, in happy_eyeballs
+  // mode. Registered in our selector until it connects or fails.
+  class ConnectAttempt;
+  // Starts connecting in parallel to the resolved addresses.
+  void StartHappyEyeballs(const DnsHostInfo& info);
+  // Starts connecting to the next address, and schedules the one after it.
+  void StartNextConnectAttempt();
+  // Called when the attempt completed, with the socket error (0 = connected).
+  void HandleConnectAttempt(ConnectAttempt* attempt, int err);
+  // Closes the attempts in progress, and cancels the next ones.
+  void ClearConnectAttempts();
+
+  // Sets normal socket options: non-blocking (if set_nonblocking), disable
+  // Nagel, apply tcp params and corking.
+  absl::Status SetSocketOptions(bool set_nonblocking);
+  // Sets TCP_CORK (TCP_NOPUSH on BSD) on the socket, so the kernel sends
+  // only full segments while corked. Flushes the outbuf() before uncorking.
+  absl::Status SetCorked(bool corked) override;
 
   // Reads the local address from the socket and sets it into local_address_.
   absl::Status InitializeLocalAddress();
@@ -439,11 +809,81 @@ class TcpConnection : public Connection, private Selectable {
   void CallCloseHandler(const absl::Status& status, CloseDirective directive);
   // A deferred connect completion, that is scheduled on the first i/o event/
   bool PerformConnectOnFirstOperation();
-  // Helper for reading from the input fd_.
-  absl::StatusOr<ssize_t> PerformRead();
+  // Helper for reading from the input fd_ - at most max_size bytes.
+  absl::StatusOr<ssize_t> PerformRead(size_t max_size);
+  // After a read of nothing, checks if the peer closed its side.
+  absl::Status CheckReadClosed();
+  // Adapts the read block size after a read of cb bytes.
+  void AdaptReadBlockSize(size_t cb);
+  // Writes the next part of the output to the socket, at most limit bytes:
+  // from the outbuf(), or from the first queued file if the outbuf() is
+  // empty. Returns true if all that was attempted (maybe nothing) got
+  // written.
+  absl::StatusOr<bool> WriteOutput(absl::optional<size_t> limit);
+  // WriteOutput() within the tokens of the write_limiter_. When out of
+  // tokens, pauses the write events and returns false.
+  absl::StatusOr<bool> WriteOutputRateLimited(absl::optional<size_t> limit);
+  // Pause the read / write events until the rate limiter buckets refill.
+  void ThrottleReads();
+  void ThrottleWrites();
+  // Called when the read rate limiter buckets refilled.
+  void ResumeReads();
+  // Called when the write rate limiter buckets refilled - re-enables the
+  // write events of a connection still sending.
+  void ResumeWrites();
+  // Writes right away to the socket as much as possible from the output,
+  // without waiting for a write event. Returns true if the output was
+  // completely written.
+  absl::StatusOr<bool> FlushOutbuf();
+  // Sends the data (at most the first outbuf() chunk) with MSG_ZEROCOPY.
+  // Returns the number of bytes sent, or nullopt if the kernel cannot do it
+  // now, and a normal write should be used.
+  absl::StatusOr<absl::optional<size_t>> WriteZerocopy(absl::string_view data);
+  // Releases the chunks for the completions in the socket error queue.
+  absl::Status ProcessZerocopyCompletions();
+  // The data of the MSG_ZEROCOPY sends, by the send sequence number of the
+  // kernel.
+  using ZerocopyPending = std::deque<std::pair<uint32_t, absl::Cord>>;
+  // Reads the completions in the error queue of fd, and releases their
+  // chunks from pending. Adds to the completed / copied send counts.
+  static absl::Status ReadZerocopyCompletions(int fd, ZerocopyPending* pending,
+                                              size_t* num_completed,
+                                              size_t* num_copied);
+  // On close, with MSG_ZEROCOPY sends not completed yet: the kernel may
+  // still read their data from our chunks, so these are kept, along with
+  // the (shut down) socket that reports the completions, until all
+  // complete. Takes over fd_.
+  struct ZerocopyDrain;
+  void StartZerocopyDrain();
+  static void ContinueZerocopyDrain(Selector* selector, ZerocopyDrain* drain);
+  // If a read from fd_ would not block - i.e. there is data or an end of
+  // stream pending. Used when edge triggered, to avoid reading on
+  // synthesized events.
+  bool IsReadable() const;
+  // If, in edge triggered mode, we need to continue reading after a read
+  // of cb bytes.
+  bool ShouldContinueReading(ssize_t cb) const;
 
   // Id for the timeout raised by this connection.
   static constexpr int64_t kShutdownTimeoutId = -100;
+  static constexpr int64_t kReadThrottleTimeoutId = -101;
+  static constexpr int64_t kWriteThrottleTimeoutId = -102;
+  // Size of the selector scratch buffer for reading past the block, in one
+  // call.
+  static constexpr size_t kReadOverflowSize = 65536;
+  // We shrink the read block after these many consecutive small reads.
+  static constexpr size_t kSmallReadsToShrink = 4;
+  // And get back to the initial block size after no reads for this long.
+  static constexpr absl::Duration kReadBlockResetPeriod = absl::Seconds(1);
+  // Bounds of the pauses of the reads / writes for rate limiting - we check
+  // the buckets again at least this often (e.g. for changed rates).
+  static constexpr absl::Duration kMinThrottleTimeout = absl::Milliseconds(1);
+  static constexpr absl::Duration kMaxThrottleTimeout = absl::Seconds(1);
+  // How often, and for how long, we wait for the MSG_ZEROCOPY completions
+  // of a closed connection.
+  static constexpr absl::Duration kZerocopyDrainPeriod =
+      absl::Milliseconds(10);
+  static constexpr absl::Duration kZerocopyDrainTimeout = absl::Seconds(60);
 
   // parameters for this connection
   TcpConnectionParams params_;
@@ -467,6 +907,48 @@ class TcpConnection : public Connection, private Selectable {
   Timeouter timeouter_;
   // Set if a close is requested while doing dns resolve.
   absl::optional<bool> close_on_resolve_;
+  // Set while Connect() starts the resolve, for deferring the results that
+  // come back right away.
+  bool resolve_in_connect_ = false;
+
+  // Size of the next read, with adaptive_block_size.
+  size_t read_block_size_;
+  // Consecutive reads much smaller than the read block.
+  size_t small_reads_ = 0;
+  // If the last read got all the data it asked for.
+  bool read_filled_ = false;
+  ReadStatistics read_stats_;
+
+  // If SO_ZEROCOPY was enabled on the socket, per zerocopy_threshold.
+  bool zerocopy_enabled_ = false;
+  // The data of the MSG_ZEROCOPY sends, kept until their completion.
+  ZerocopyPending zerocopy_pending_;
+  // Sequence number of the next MSG_ZEROCOPY send.
+  uint32_t zerocopy_next_id_ = 0;
+  size_t zerocopy_sends_ = 0;
+  size_t zerocopy_completed_ = 0;
+  size_t zerocopy_copied_ = 0;
+
+  // In happy_eyeballs mode: the addresses we still need to try, the
+  // attempts in progress, the alarm for the next one, and the last error.
+  std::deque<IpAddress> connect_candidates_;
+  std::vector<std::unique_ptr<ConnectAttempt>> connect_attempts_;
+  absl::optional<Selector::AlarmId> connect_attempt_alarm_;
+  absl::Status connect_attempt_error_;
+  size_t num_connect_attempts_ = 0;
+
+  // Rate limiting, per the read / write rate params.
+  RateLimiter read_limiter_;
+  RateLimiter write_limiter_;
+  // If the read / write events are paused for rate limiting.
+  bool read_throttled_ = false;
+  bool write_throttled_ = false;
+  // The read / write events last requested by RequestReadEvents() /
+  // RequestWriteEvents(), restored when the throttling ends.
+  bool read_events_requested_ = true;
+  bool write_events_requested_ = false;
+  size_t read_throttles_ = 0;
+  size_t write_throttles_ = 0;
 };
 
 }  // namespace net
@@ -0,0 +1,179 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "absl/memory/memory.h"
+#include "absl/synchronization/notification.h"
+#include "benchmark/benchmark.h"
+#include "whisperlib/net/connection.h"
+#include "whisperlib/net/testing_util.h"
+
+namespace whisper {
+namespace net {
+namespace {
+void WriteFully(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    const ssize_t cb = ::write(fd, data, size);
+    CHECK_GT(cb, 0);
+    data += cb;
+    size -= cb;
+  }
+}
+
+void ReadFully(int fd, char* data, size_t size) {
+  while (size > 0) {
+    const ssize_t cb = ::read(fd, data, size);
+    CHECK_GT(cb, 0);
+    data += cb;
+    size -= cb;
+  }
+}
+
+// A TCP echo server in its own selector thread, and a blocking client
+// socket connected to it.
+class EchoServer {
+ public:
+  explicit EchoServer(Selector::Params params) {
+    auto thread = SelectorThread::Create(std::move(params));
+    if (!thread.ok()) {
+      return;
+    }
+    thread_ = std::move(thread).value();
+    CHECK(thread_->Start());
+    acceptor_ = absl::make_unique<TcpAcceptor>(thread_->selector(),
+                                               TcpAcceptorParams());
+    acceptor_->set_accept_handler([this](std::unique_ptr<Connection> c) {
+      server_ = std::move(c);
+      Connection* const connection = server_.get();
+      connection->set_read_handler([connection]() {
+        connection->Write(std::move(*connection->inbuf()));
+        connection->inbuf()->Clear();
+        return absl::OkStatus();
+      });
+      connection->set_write_handler([]() { return absl::OkStatus(); });
+    });
+    RunAndWait(thread_.get(), [this]() {
+      CHECK(acceptor_
+                ->Listen(HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0))
+                .ok());
+    });
+    client_fd_ = ConnectToLocalPort(acceptor_->local_address().port().value());
+    CHECK_GE(client_fd_, 0);
+    const int one = 1;
+    CHECK_EQ(::setsockopt(client_fd_, IPPROTO_TCP, TCP_NODELAY, &one,
+                          sizeof(one)),
+             0);
+  }
+  ~EchoServer() {
+    if (thread_ == nullptr) {
+      return;
+    }
+    ::close(client_fd_);
+    RunAndWait(thread_.get(), [this]() {
+      if (server_ != nullptr) {
+        server_->ForceClose();
+        server_.reset();
+      }
+      acceptor_->Close();
+    });
+    thread_->Stop();
+  }
+  bool ok() const { return thread_ != nullptr; }
+  int client_fd() const { return client_fd_; }
+
+ private:
+  std::unique_ptr<SelectorThread> thread_;
+  std::unique_ptr<TcpAcceptor> acceptor_;
+  std::unique_ptr<Connection> server_;  // accessed from the select loop
+  int client_fd_ = -1;
+};
+
+Selector::Params EchoParams(Selector::LoopType loop_type, bool edge_triggered) {
+  return Selector::Params()
+      .set_loop_type(loop_type)
+      .set_edge_triggered(edge_triggered);
+}
+
+// Round trip of a message of range(0) bytes through the echo server.
+void BM_EchoLatency(benchmark::State& state, Selector::LoopType loop_type,
+                    bool edge_triggered) {
+  EchoServer server(EchoParams(loop_type, edge_triggered));
+  if (!server.ok()) {
+    state.SkipWithError("Loop type not available.");
+    return;
+  }
+  const size_t size = state.range(0);
+  std::string message(size, 'x');
+  std::string reply(size, 0);
+  for (auto _ : state) {
+    WriteFully(server.client_fd(), message.data(), size);
+    ReadFully(server.client_fd(), &reply[0], size);
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+}
+
+// Throughput of the echo server: writes chunks of range(0) bytes, while a
+// separate thread reads them back.
+void BM_EchoThroughput(benchmark::State& state, Selector::LoopType loop_type,
+                       bool edge_triggered) {
+  EchoServer server(EchoParams(loop_type, edge_triggered));
+  if (!server.ok()) {
+    state.SkipWithError("Loop type not available.");
+    return;
+  }
+  const size_t size = state.range(0);
+  std::string chunk(size, 'x');
+  std::atomic<int64_t> to_read(0);
+  std::atomic_bool writing_done(false);
+  std::thread reader([&server, &to_read, &writing_done]() {
+    std::vector<char> buffer(1 << 16);
+    while (!writing_done.load() || to_read.load() > 0) {
+      const ssize_t cb =
+          ::read(server.client_fd(), buffer.data(), buffer.size());
+      CHECK_GT(cb, 0);
+      to_read.fetch_sub(cb);
+    }
+  });
+  for (auto _ : state) {
+    to_read.fetch_add(size);
+    WriteFully(server.client_fd(), chunk.data(), size);
+  }
+  writing_done.store(true);
+  if (to_read.load() == 0) {
+    // Wakes up the reader, in case it is blocked after the last chunk.
+    to_read.fetch_add(1);
+    WriteFully(server.client_fd(), chunk.data(), 1);
+  }
+  reader.join();
+  state.SetBytesProcessed(state.iterations() * size);
+}
+
+#define ECHO_BENCHMARKS(name, loop_type, edge_triggered)                  \
+  BENCHMARK_CAPTURE(BM_EchoLatency, name, loop_type, edge_triggered)      \
+      ->Arg(64)                                                           \
+      ->Arg(4096)                                                         \
+      ->UseRealTime();                                                    \
+  BENCHMARK_CAPTURE(BM_EchoThroughput, name, loop_type, edge_triggered)   \
+      ->Arg(4096)                                                         \
+      ->Arg(65536)                                                        \
+      ->UseRealTime()
+
+ECHO_BENCHMARKS(poll, Selector::LoopType::POLL, false);
+ECHO_BENCHMARKS(epoll, Selector::LoopType::EPOLL, false);
+ECHO_BENCHMARKS(epoll_edge_triggered, Selector::LoopType::EPOLL, true);
+ECHO_BENCHMARKS(io_uring, Selector::LoopType::IO_URING, false);
+
+#undef ECHO_BENCHMARKS
+
+}  // namespace
+}  // namespace net
+}  // namespace whisper
@@ -0,0 +1,344 @@
+#include "whisperlib/net/connection_pool.h"
+
+#include <utility>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "absl/log/log.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "whisperlib/status/status.h"
+
+namespace whisper {
+namespace net {
+
+ConnectionPool::Params& ConnectionPool::Params::set_max_idle_per_host(
+    size_t value) {
+  max_idle_per_host = value;
+  return *this;
+}
+ConnectionPool::Params& ConnectionPool::Params::set_max_idle(size_t value) {
+  max_idle = value;
+  return *this;
+}
+ConnectionPool::Params& ConnectionPool::Params::set_max_per_host(
+    size_t value) {
+  max_per_host = value;
+  return *this;
+}
+ConnectionPool::Params& ConnectionPool::Params::set_idle_timeout(
+    absl::Duration value) {
+  idle_timeout = value;
+  return *this;
+}
+ConnectionPool::Params& ConnectionPool::Params::set_health_check(
+    std::function<bool(Connection*)> value) {
+  health_check = std::move(value);
+  return *this;
+}
+
+ConnectionPool::ConnectionPool(Selector* selector, ConnectionFactory factory,
+                               Params params)
+    : selector_(ABSL_DIE_IF_NULL(selector)),
+      factory_(ABSL_DIE_IF_NULL(std::move(factory))),
+      params_(std::move(params)),
+      timeouter_(selector, [this](Timeouter::TimeoutId id) {
+        CloseIdle(id, &stats_.idle_timeouts);
+      }) {}
+
+ConnectionPool::~ConnectionPool() {
+  LOG_IF(WARNING, !in_use_.empty())
+      << "ConnectionPool destroyed with " << in_use_.size()
+      << " connections still in use.";
+  timeouter_.ClearAllTimeouts();
+  for (auto& it : idle_) {
+    it.second.connection->clear_all_handlers();
+    it.second.connection->ForceClose();
+    selector_->DeleteInSelectLoop(std::move(it.second.connection));
+  }
+  for (auto& it : pending_) {
+    it.second.connection->clear_all_handlers();
+    it.second.connection->ForceClose();
+    selector_->DeleteInSelectLoop(std::move(it.second.connection));
+  }
+}
+
+size_t ConnectionPool::idle_size(const HostPort& address) const {
+  auto it = hosts_.find(address.ToString());
+  return it == hosts_.end() ? 0 : it->second->idle_ids.size();
+}
+
+ConnectionPool::Host* ConnectionPool::GetHost(const std::string& key,
+                                              const HostPort& address) {
+  auto it = hosts_.find(key);
+  if (it == hosts_.end()) {
+    auto host = absl::make_unique<Host>();
+    host->address = address;
+    it = hosts_.emplace(key, std::move(host)).first;
+  }
+  return it->second.get();
+}
+
+void ConnectionPool::MaybeEraseHost(const std::string& key) {
+  auto it = hosts_.find(key);
+  if (it != hosts_.end() && it->second->num_connections == 0 &&
+      it->second->waiters.empty()) {
+    hosts_.erase(it);
+  }
+}
+
+bool ConnectionPool::CanConnect(const Host& host) const {
+  return params_.max_per_host == 0 ||
+         host.num_connections < params_.max_per_host;
+}
+
+bool ConnectionPool::IsReusable(Connection* connection) const {
+  return connection->state() == Connection::CONNECTED &&
+         connection->inbuf()->empty() && !connection->has_pending_output();
+}
+
+void ConnectionPool::Get(const HostPort& address, Callback callback) {
+  CHECK(selector_->IsInSelectThread());
+  const std::string key = address.ToString();
+  Host* host = GetHost(key, address);
+  // The most recently used first - the least likely to be closed by the peer.
+  while (!host->idle_ids.empty()) {
+    auto connection = TakeIdle(*host->idle_ids.rbegin());
+    if (!IsReusable(connection.get()) ||
+        (params_.health_check != nullptr &&
+         !params_.health_check(connection.get()))) {
+      stats_.health_check_failures.fetch_add(1);
+      Discard(key, std::move(connection));
+      host = GetHost(key, address);  // may have been erased
+      continue;
+    }
+    stats_.reused.fetch_add(1);
+    HandOver(key, std::move(connection), std::move(callback));
+    return;
+  }
+  if (!CanConnect(*host)) {
+    stats_.waits.fetch_add(1);
+    host->waiters.emplace_back(std::move(callback));
+    return;
+  }
+  StartConnect(key, host, std::move(callback));
+}
+
+void ConnectionPool::Release(std::unique_ptr<Connection> connection) {
+  CHECK(selector_->IsInSelectThread());
+  auto it = in_use_.find(connection.get());
+  if (ABSL_PREDICT_FALSE(it == in_use_.end())) {
+    LOG(WARNING) << "Connection released to a pool that does not own it: "
+                 << connection->ToString();
+    connection->clear_all_handlers();
+    connection->ForceClose();
+    selector_->DeleteInSelectLoop(std::move(connection));
+    return;
+  }
+  const std::string key = std::move(it->second);
+  in_use_.erase(it);
+  connection->clear_all_handlers();
+  if (!IsReusable(connection.get())) {
+    Discard(key, std::move(connection));
+    return;
+  }
+  AddIdle(key, std::move(connection));
+}
+
+void ConnectionPool::PreConnect(const HostPort& address, size_t count) {
+  CHECK(selector_->IsInSelectThread());
+  const std::string key = address.ToString();
+  Host* host = GetHost(key, address);
+  size_t num_pending = 0;
+  for (const auto& it : pending_) {
+    if (it.second.callback == nullptr && it.second.key == key) {
+      ++num_pending;
+    }
+  }
+  for (size_t i = host->idle_ids.size() + num_pending;
+       i < count && CanConnect(*host); ++i) {
+    StartConnect(key, host, nullptr);
+    // A synchronous connect failure may erase the host.
+    auto it = hosts_.find(key);
+    if (it == hosts_.end()) {
+      return;
+    }
+    host = it->second.get();
+  }
+  MaybeEraseHost(key);
+}
+
+void ConnectionPool::Clear() {
+  CHECK(selector_->IsInSelectThread());
+  while (!idle_.empty()) {
+    CloseIdle(idle_.begin()->first, nullptr);
+  }
+}
+
+void ConnectionPool::StartConnect(const std::string& key, Host* host,
+                                  Callback callback) {
+  auto connection = factory_(selector_);
+  Connection* const c = connection.get();
+  ++host->num_connections;
+  stats_.connects.fetch_add(1);
+  c->set_connect_handler([this, c]() { HandleConnected(c); });
+  c->set_close_handler(
+      [this, c](const absl::Status& status, Connection::CloseDirective) {
+        HandleConnectError(
+            c, status.ok() ? absl::UnavailableError("Connection closed.")
+                           : status);
+      });
+  pending_.emplace(c, PendingConnection{key, std::move(connection),
+                                        std::move(callback)});
+  const HostPort address = host->address;
+  const absl::Status status = c->Connect(address);
+  if (!status.ok() && pending_.contains(c)) {
+    HandleConnectError(c, status);
+  }
+}
+
+void ConnectionPool::HandleConnected(Connection* connection) {
+  auto it = pending_.find(connection);
+  CHECK(it != pending_.end());
+  PendingConnection pending = std::move(it->second);
+  pending_.erase(it);
+  connection->clear_all_handlers();
+  if (pending.callback == nullptr) {
+    AddIdle(pending.key, std::move(pending.connection));
+    return;
+  }
+  HandOver(pending.key, std::move(pending.connection),
+           std::move(pending.callback));
+}
+
+void ConnectionPool::HandOver(const std::string& key,
+                              std::unique_ptr<Connection> connection,
+                              Callback callback) {
+  // No write handler to call until the user sets one, and writes.
+  const absl::Status status = connection->RequestWriteEvents(false);
+  if (!status.ok()) {
+    Discard(key, std::move(connection));
+    callback(status);
+    return;
+  }
+  in_use_.emplace(connection.get(), key);
+  callback(std::move(connection));
+}
+
+void ConnectionPool::HandleConnectError(Connection* connection,
+                                        const absl::Status& status) {
+  auto it = pending_.find(connection);
+  CHECK(it != pending_.end());
+  PendingConnection pending = std::move(it->second);
+  pending_.erase(it);
+  stats_.connect_errors.fetch_add(1);
+  LOG_EVERY_N(WARNING, 100) << "Pool connect failed for "
+                            << pending.key << ": " << status;
+  Discard(pending.key, std::move(pending.connection));
+  if (pending.callback != nullptr) {
+    pending.callback(status::Annotate(
+        status, absl::StrCat("Connecting to ", pending.key)));
+  }
+}
+
+void ConnectionPool::ServeWaiters(const std::string& key) {
+  auto it = hosts_.find(key);
+  while (it != hosts_.end() && !it->second->waiters.empty() &&
+         CanConnect(*it->second)) {
+    Host* host = it->second.get();
+    Callback callback = std::move(host->waiters.front());
+    host->waiters.pop_front();
+    StartConnect(key, host, std::move(callback));
+    it = hosts_.find(key);
+  }
+  MaybeEraseHost(key);
+}
+
+void ConnectionPool::AddIdle(const std::string& key,
+                             std::unique_ptr<Connection> connection) {
+  Host* host = hosts_.find(key)->second.get();
+  if (!host->waiters.empty()) {
+    // Someone is waiting for the max_per_host limit - hand it over directly.
+    Callback callback = std::move(host->waiters.front());
+    host->waiters.pop_front();
+    stats_.reused.fetch_add(1);
+    HandOver(key, std::move(connection), std::move(callback));
+    return;
+  }
+  if (params_.max_idle == 0 || params_.max_idle_per_host == 0) {
+    Discard(key, std::move(connection));
+    return;
+  }
+  while (host->idle_ids.size() >= params_.max_idle_per_host) {
+    CloseIdle(*host->idle_ids.begin(), &stats_.evictions);
+  }
+  while (idle_.size() >= params_.max_idle) {
+    CloseIdle(idle_.begin()->first, &stats_.evictions);
+  }
+  const Timeouter::TimeoutId id = next_idle_id_++;
+  Connection* const c = connection.get();
+  // Any data, or a close from the peer, make the connection useless.
+  c->set_read_handler([]() {
+    return absl::FailedPreconditionError(
+        "Unexpected data received on an idle connection.");
+  });
+  c->set_close_handler([this, id](const absl::Status&,
+                                  Connection::CloseDirective) {
+    CloseIdle(id, &stats_.idle_closed);
+  });
+  absl::Status status = c->RequestReadEvents(true);
+  if (status.ok()) {
+    status = c->RequestWriteEvents(false);
+  }
+  if (!status.ok()) {
+    LOG(WARNING) << "Cannot watch idle connection " << c->ToString() << ": "
+                 << status;
+    c->clear_all_handlers();
+    Discard(key, std::move(connection));
+    return;
+  }
+  host->idle_ids.insert(id);
+  idle_.emplace(id, IdleConnection{key, std::move(connection)});
+  timeouter_.SetTimeout(id, params_.idle_timeout);
+}
+
+std::unique_ptr<Connection> ConnectionPool::TakeIdle(
+    Timeouter::TimeoutId id) {
+  auto it = idle_.find(id);
+  CHECK(it != idle_.end());
+  std::unique_ptr<Connection> connection = std::move(it->second.connection);
+  hosts_.find(it->second.key)->second->idle_ids.erase(id);
+  idle_.erase(it);
+  timeouter_.ClearTimeout(id);
+  connection->clear_all_handlers();
+  return connection;
+}
+
+void ConnectionPool::CloseIdle(Timeouter::TimeoutId id,
+                               std::atomic_size_t* counter) {
+  auto it = idle_.find(id);
+  if (it == idle_.end()) {
+    return;
+  }
+  const std::string key = it->second.key;
+  if (counter != nullptr) {
+    counter->fetch_add(1);
+  }
+  Discard(key, TakeIdle(id));
+}
+
+void ConnectionPool::Discard(const std::string& key,
+                             std::unique_ptr<Connection> connection) {
+  connection->clear_all_handlers();
+  connection->ForceClose();
+  // We may be called from the handlers of this connection.
+  selector_->DeleteInSelectLoop(std::move(connection));
+  auto it = hosts_.find(key);
+  CHECK(it != hosts_.end());
+  CHECK_GT(it->second->num_connections, 0UL);
+  --it->second->num_connections;
+  ServeWaiters(key);
+}
+
+}  // namespace net
+}  // namespace whisper
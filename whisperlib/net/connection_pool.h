@@ -0,0 +1,188 @@
+#ifndef WHISPERLIB_NET_CONNECTION_POOL_H_
+#define WHISPERLIB_NET_CONNECTION_POOL_H_
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/time/time.h"
+#include "whisperlib/net/address.h"
+#include "whisperlib/net/connection.h"
+#include "whisperlib/net/selector.h"
+#include "whisperlib/net/timeouter.h"
+
+namespace whisper {
+namespace net {
+
+// A pool of outbound connections, keyed by the remote HostPort, that keeps
+// the connections returned after use open, for reusing them with the next
+// requests to the same host - saving the DNS resolve, and the TCP / TLS
+// handshakes.
+//
+// A pool works in one selector, and all its methods should be called from
+// the selector thread - use a pool per selector for a multi-threaded client.
+// The connections are created by the provided factory (e.g. TcpConnection or
+// SslConnection), and all need to be returned by Release() - in whatever
+// state they are - before the pool is destroyed.
+//
+// While idle, the pool owns the connection handlers: a connection closed by
+// the peer, or that receives unexpected data, is dropped from the pool.
+//
+// Usage example:
+//   ConnectionPool pool(selector, [](Selector* selector) {
+//     return absl::make_unique<TcpConnection>(selector, TcpConnectionParams());
+//   });
+//   pool.Get(HostPort("backend", absl::nullopt, 8080),
+//            [&pool](ConnectionPool::Result result) {
+//     ... set the handlers, talk on result.value(), then:
+//     pool.Release(std::move(result).value());
+//   });
+//
+class ConnectionPool {
+ public:
+  struct Params {
+    // Maximum number of idle connections kept for a host.
+    size_t max_idle_per_host = 8;
+    // Maximum number of idle connections kept in total.
+    size_t max_idle = 256;
+    // Maximum number of connections to a host - idle, in use or connecting.
+    // When reached, Get() waits for a connection to be released.
+    // Zero means no limit.
+    size_t max_per_host = 0;
+    // Idle connections are closed after this time.
+    absl::Duration idle_timeout = absl::Seconds(60);
+    // If set, idle connections are checked with this upon checkout, and
+    // closed if it returns false.
+    std::function<bool(Connection*)> health_check;
+
+    Params& set_max_idle_per_host(size_t value);
+    Params& set_max_idle(size_t value);
+    Params& set_max_per_host(size_t value);
+    Params& set_idle_timeout(absl::Duration value);
+    Params& set_health_check(std::function<bool(Connection*)> value);
+  };
+  // Creates a new, not connected, connection working in the selector.
+  using ConnectionFactory =
+      std::function<std::unique_ptr<Connection>(Selector*)>;
+
+  ConnectionPool(Selector* selector, ConnectionFactory factory,
+                 Params params);
+  // Closes the idle connections, and the ones still connecting.
+  ~ConnectionPool();
+
+  ConnectionPool(const ConnectionPool&) = delete;
+  ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+  using Result = absl::StatusOr<std::unique_ptr<Connection>>;
+  using Callback = std::function<void(Result)>;
+
+  // Calls the callback with a connected connection to the address: an idle
+  // one, if we have a healthy one, else a new one, once connected. The
+  // connection has no handlers set, and read events enabled - the handlers
+  // should be set right away.
+  // The callback may be called before returning.
+  void Get(const HostPort& address, Callback callback);
+  // Returns a connection obtained from Get(). It is kept for reuse if still
+  // connected, with nothing left to read or to write - else it is closed.
+  void Release(std::unique_ptr<Connection> connection);
+  // Opens connections to the address, in the background, until we have
+  // `count` of them idle or connecting (within the limits).
+  void PreConnect(const HostPort& address, size_t count);
+  // Closes all the idle connections.
+  void Clear();
+
+  // Number of idle connections, in total or for an address.
+  size_t idle_size() const { return idle_.size(); }
+  size_t idle_size(const HostPort& address) const;
+
+  struct Statistics {
+    // Get() served with an idle connection, or with a new one.
+    std::atomic_size_t reused = ATOMIC_VAR_INIT(0);
+    std::atomic_size_t connects = ATOMIC_VAR_INIT(0);
+    // New connections that failed to connect.
+    std::atomic_size_t connect_errors = ATOMIC_VAR_INIT(0);
+    // Get() calls that waited for the max_per_host limit.
+    std::atomic_size_t waits = ATOMIC_VAR_INIT(0);
+    // Idle connections found broken at checkout.
+    std::atomic_size_t health_check_failures = ATOMIC_VAR_INIT(0);
+    // Idle connections closed by the peer, or that received data.
+    std::atomic_size_t idle_closed = ATOMIC_VAR_INIT(0);
+    // Idle connections closed for idle_timeout.
+    std::atomic_size_t idle_timeouts = ATOMIC_VAR_INIT(0);
+    // Idle connections closed for the max_idle limits.
+    std::atomic_size_t evictions = ATOMIC_VAR_INIT(0);
+  };
+  const Statistics& stats() const { return stats_; }
+
+ private:
+  // The connections to a remote address.
+  struct Host {
+    HostPort address;
+    // Idle connections, by id - higher for the more recently released.
+    std::set<Timeouter::TimeoutId> idle_ids;
+    // All connections - idle, in use or connecting.
+    size_t num_connections = 0;
+    // Get() calls waiting for the max_per_host limit.
+    std::deque<Callback> waiters;
+  };
+  struct IdleConnection {
+    std::string key;
+    std::unique_ptr<Connection> connection;
+  };
+  struct PendingConnection {
+    std::string key;
+    std::unique_ptr<Connection> connection;
+    // Null when pre-connecting.
+    Callback callback;
+  };
+
+  Host* GetHost(const std::string& key, const HostPort& address);
+  // Erases the host if it has no connections and no waiters.
+  void MaybeEraseHost(const std::string& key);
+  bool CanConnect(const Host& host) const;
+  void StartConnect(const std::string& key, Host* host, Callback callback);
+  void HandleConnected(Connection* connection);
+  void HandleConnectError(Connection* connection, const absl::Status& status);
+  // Starts connecting for the waiters of the host, as the limit permits.
+  void ServeWaiters(const std::string& key);
+  // Hands the connection to a waiter of its host, if any, else starts
+  // tracking it as idle.
+  void AddIdle(const std::string& key, std::unique_ptr<Connection> connection);
+  // Takes out an idle connection.
+  std::unique_ptr<Connection> TakeIdle(Timeouter::TimeoutId id);
+  // Closes an idle connection, and accounts for it in the counter.
+  void CloseIdle(Timeouter::TimeoutId id, std::atomic_size_t* counter);
+  // Gives the connection to the user.
+  void HandOver(const std::string& key, std::unique_ptr<Connection> connection,
+                Callback callback);
+  // Closes and deletes a connection that leaves the pool.
+  void Discard(const std::string& key, std::unique_ptr<Connection> connection);
+  bool IsReusable(Connection* connection) const;
+
+  Selector* const selector_;
+  const ConnectionFactory factory_;
+  const Params params_;
+  // Keyed by HostPort::ToString().
+  absl::flat_hash_map<std::string, std::unique_ptr<Host>> hosts_;
+  // Ordered by id, i.e. the oldest idle connection first.
+  std::map<Timeouter::TimeoutId, IdleConnection> idle_;
+  Timeouter::TimeoutId next_idle_id_ = 1;
+  absl::flat_hash_map<Connection*, PendingConnection> pending_;
+  // Connections handed out by Get(), to the key of their host.
+  absl::flat_hash_map<Connection*, std::string> in_use_;
+  Timeouter timeouter_;
+
+  Statistics stats_;
+};
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_CONNECTION_POOL_H_
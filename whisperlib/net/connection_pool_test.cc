@@ -0,0 +1,232 @@
+#include "whisperlib/net/connection_pool.h"
+
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/synchronization/notification.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "whisperlib/net/testing_util.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+// Evaluates the condition in the select loop, until true or timeout.
+bool WaitFor(SelectorThread* thread, std::function<bool()> condition) {
+  const absl::Time deadline = absl::Now() + absl::Seconds(10);
+  while (absl::Now() < deadline) {
+    bool result = false;
+    RunAndWait(thread, [&]() { result = condition(); });
+    if (result) {
+      return true;
+    }
+    absl::SleepFor(absl::Milliseconds(5));
+  }
+  return false;
+}
+
+class ConnectionPoolTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_OK_AND_ASSIGN(thread_, SelectorThread::Create());
+    thread_->Start();
+    acceptor_ = absl::make_unique<TcpAcceptor>(thread_->selector(),
+                                               TcpAcceptorParams());
+    acceptor_->set_accept_handler([this](std::unique_ptr<Connection> c) {
+      c->set_read_handler([]() { return absl::OkStatus(); });
+      accepted_.emplace_back(std::move(c));
+    });
+    RunAndWait(thread_.get(), [this]() {
+      EXPECT_OK(acceptor_->Listen(
+          HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+    });
+    address_ = HostPort(absl::nullopt, IpAddress::kIPv4Localhost,
+                        acceptor_->local_address().port().value());
+  }
+  void TearDown() override {
+    RunAndWait(thread_.get(), [this]() {
+      pool_.reset();
+      for (auto& c : accepted_) {
+        c->ForceClose();
+      }
+      accepted_.clear();
+      if (acceptor_->state() != Acceptor::DISCONNECTED) {
+        acceptor_->Close();
+      }
+    });
+    thread_->Stop();
+  }
+
+  void CreatePool(ConnectionPool::Params params) {
+    pool_ = absl::make_unique<ConnectionPool>(
+        thread_->selector(),
+        [](Selector* selector) {
+          return absl::make_unique<TcpConnection>(selector,
+                                                  TcpConnectionParams());
+        },
+        std::move(params));
+  }
+  // Gets a connection from the pool, waiting for it.
+  ConnectionPool::Result Get(const HostPort& address) {
+    absl::Notification done;
+    ConnectionPool::Result result;
+    RunAndWait(thread_.get(), [&]() {
+      pool_->Get(address, [&](ConnectionPool::Result r) {
+        result = std::move(r);
+        done.Notify();
+      });
+    });
+    EXPECT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(10)));
+    return result;
+  }
+  void Release(std::unique_ptr<Connection> connection) {
+    RunAndWait(thread_.get(),
+               [&]() { pool_->Release(std::move(connection)); });
+  }
+
+  std::unique_ptr<SelectorThread> thread_;
+  std::unique_ptr<TcpAcceptor> acceptor_;
+  std::vector<std::unique_ptr<Connection>> accepted_;
+  HostPort address_;
+  std::unique_ptr<ConnectionPool> pool_;
+};
+}  // namespace
+
+TEST_F(ConnectionPoolTest, Reuse) {
+  CreatePool(ConnectionPool::Params());
+  ASSERT_OK_AND_ASSIGN(auto connection, Get(address_));
+  EXPECT_EQ(connection->state(), Connection::CONNECTED);
+  Connection* const first = connection.get();
+  Release(std::move(connection));
+  EXPECT_EQ(pool_->idle_size(), 1);
+  EXPECT_EQ(pool_->idle_size(address_), 1);
+
+  ASSERT_OK_AND_ASSIGN(connection, Get(address_));
+  EXPECT_EQ(connection.get(), first);
+  EXPECT_EQ(pool_->idle_size(), 0);
+  // A second one, while the first is in use.
+  ASSERT_OK_AND_ASSIGN(auto second, Get(address_));
+  EXPECT_NE(second.get(), first);
+  EXPECT_EQ(pool_->stats().connects.load(), 2);
+  EXPECT_EQ(pool_->stats().reused.load(), 1);
+
+  // Connections with pending input are not reused.
+  RunAndWait(thread_.get(), [&]() { second->inbuf()->Append("leftover"); });
+  Release(std::move(second));
+  Release(std::move(connection));
+  EXPECT_EQ(pool_->idle_size(), 1);
+}
+
+TEST_F(ConnectionPoolTest, IdleClosing) {
+  CreatePool(ConnectionPool::Params()
+                 .set_idle_timeout(absl::Milliseconds(200))
+                 .set_max_idle_per_host(2));
+  std::vector<std::unique_ptr<Connection>> connections;
+  for (size_t i = 0; i < 3; ++i) {
+    ASSERT_OK_AND_ASSIGN(auto connection, Get(address_));
+    connections.emplace_back(std::move(connection));
+  }
+  for (auto& connection : connections) {
+    Release(std::move(connection));
+  }
+  EXPECT_EQ(pool_->idle_size(), 2);
+  EXPECT_EQ(pool_->stats().evictions.load(), 1);
+  ASSERT_TRUE(
+      WaitFor(thread_.get(), [this]() { return accepted_.size() == 3; }));
+
+  // The peer closes them.
+  RunAndWait(thread_.get(), [this]() {
+    for (auto& c : accepted_) {
+      c->ForceClose();
+    }
+  });
+  ASSERT_TRUE(
+      WaitFor(thread_.get(), [this]() { return pool_->idle_size() == 0; }));
+  EXPECT_EQ(pool_->stats().idle_closed.load(), 2);
+
+  // And a new one times out.
+  ASSERT_OK_AND_ASSIGN(auto connection, Get(address_));
+  Release(std::move(connection));
+  EXPECT_EQ(pool_->idle_size(), 1);
+  ASSERT_TRUE(
+      WaitFor(thread_.get(), [this]() { return pool_->idle_size() == 0; }));
+  EXPECT_EQ(pool_->stats().idle_timeouts.load(), 1);
+}
+
+TEST_F(ConnectionPoolTest, MaxPerHost) {
+  CreatePool(ConnectionPool::Params().set_max_per_host(1));
+  ASSERT_OK_AND_ASSIGN(auto connection, Get(address_));
+  Connection* const first = connection.get();
+  absl::Notification done;
+  ConnectionPool::Result waited;
+  RunAndWait(thread_.get(), [&]() {
+    pool_->Get(address_, [&](ConnectionPool::Result r) {
+      waited = std::move(r);
+      done.Notify();
+    });
+  });
+  EXPECT_FALSE(done.HasBeenNotified());
+  EXPECT_EQ(pool_->stats().waits.load(), 1);
+  // Handed over directly, upon release.
+  Release(std::move(connection));
+  ASSERT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  ASSERT_OK(waited.status());
+  EXPECT_EQ(waited.value().get(), first);
+  EXPECT_EQ(pool_->stats().connects.load(), 1);
+
+  // A closed connection frees the slot for a new one.
+  absl::Notification done2;
+  ConnectionPool::Result waited2;
+  RunAndWait(thread_.get(), [&]() {
+    pool_->Get(address_, [&](ConnectionPool::Result r) {
+      waited2 = std::move(r);
+      done2.Notify();
+    });
+    waited.value()->ForceClose();
+  });
+  Release(std::move(waited).value());
+  ASSERT_TRUE(done2.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  ASSERT_OK(waited2.status());
+  EXPECT_EQ(pool_->stats().connects.load(), 2);
+  Release(std::move(waited2).value());
+}
+
+TEST_F(ConnectionPoolTest, PreConnectAndHealthCheck) {
+  size_t num_checks = 0;
+  CreatePool(ConnectionPool::Params().set_health_check(
+      [&num_checks](Connection* connection) {
+        // Fails the first check only.
+        return num_checks++ > 0;
+      }));
+  RunAndWait(thread_.get(), [this]() { pool_->PreConnect(address_, 2); });
+  ASSERT_TRUE(
+      WaitFor(thread_.get(), [this]() { return pool_->idle_size() == 2; }));
+  // Nothing more to do.
+  RunAndWait(thread_.get(), [this]() { pool_->PreConnect(address_, 2); });
+  EXPECT_EQ(pool_->stats().connects.load(), 2);
+
+  ASSERT_OK_AND_ASSIGN(auto connection, Get(address_));
+  EXPECT_EQ(num_checks, 2);
+  EXPECT_EQ(pool_->stats().health_check_failures.load(), 1);
+  EXPECT_EQ(pool_->stats().reused.load(), 1);
+  EXPECT_EQ(pool_->idle_size(), 0);
+  Release(std::move(connection));
+  RunAndWait(thread_.get(), [this]() { pool_->Clear(); });
+  EXPECT_EQ(pool_->idle_size(), 0);
+}
+
+TEST_F(ConnectionPoolTest, ConnectError) {
+  CreatePool(ConnectionPool::Params());
+  // Nobody listens on this one.
+  HostPort address = address_;
+  RunAndWait(thread_.get(), [&]() { acceptor_->Close(); });
+  auto result = Get(address);
+  EXPECT_FALSE(result.ok());
+  EXPECT_EQ(pool_->stats().connect_errors.load(), 1);
+  EXPECT_EQ(pool_->idle_size(), 0);
+}
+
+}  // namespace net
+}  // namespace whisper
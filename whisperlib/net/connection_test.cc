@@ -0,0 +1,1161 @@
+#include "whisperlib/net/connection.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "whisperlib/io/file.h"
+#include "whisperlib/net/dns_resolve.h"
+#include "whisperlib/net/testing_util.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+class TcpAcceptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_OK_AND_ASSIGN(main_thread_, SelectorThread::Create());
+    main_thread_->Start();
+    for (size_t i = 0; i < kNumClientThreads; ++i) {
+      ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+      thread->Start();
+      client_threads_.emplace_back(std::move(thread));
+    }
+  }
+  void TearDown() override {
+    for (auto& thread : client_threads_) {
+      thread->Stop();
+    }
+    if (main_thread_ != nullptr) {
+      main_thread_->Stop();
+    }
+  }
+  AcceptorThreads GetAcceptorThreads() const {
+    std::vector<SelectorThread*> threads;
+    for (const auto& thread : client_threads_) {
+      threads.push_back(thread.get());
+    }
+    return std::move(AcceptorThreads().set_client_threads(threads));
+  }
+  // Accepts connections, counting in which selector they were accepted.
+  void AcceptConnection(std::unique_ptr<Connection> connection) {
+    Selector* const selector = connection->net_selector();
+    {
+      absl::MutexLock l(&mutex_);
+      accepted_[selector] += selector->IsInSelectThread() ? 1 : 0;
+      ++num_accepted_;
+    }
+    Connection* const pconnection = connection.release();
+    selector->RunInSelectLoop([pconnection]() {
+      pconnection->ForceClose();
+      delete pconnection;
+    });
+  }
+  void WaitForAccepted(size_t num) {
+    absl::MutexLock l(&mutex_);
+    num_expected_ = num;
+    mutex_.Await(absl::Condition(
+        +[](TcpAcceptorTest* t) ABSL_NO_THREAD_SAFETY_ANALYSIS {
+          return t->num_accepted_ >= t->num_expected_;
+        },
+        this));
+  }
+
+  static constexpr size_t kNumClientThreads = 3;
+  std::unique_ptr<SelectorThread> main_thread_;
+  std::vector<std::unique_ptr<SelectorThread>> client_threads_;
+  absl::Mutex mutex_;
+  absl::flat_hash_map<Selector*, size_t> accepted_ ABSL_GUARDED_BY(mutex_);
+  size_t num_accepted_ ABSL_GUARDED_BY(mutex_) = 0;
+  size_t num_expected_ ABSL_GUARDED_BY(mutex_) = 0;
+};
+
+// Parametrized on reuse_port mode.
+class TcpAcceptorModeTest : public TcpAcceptorTest,
+                            public ::testing::WithParamInterface<bool> {};
+
+}  // namespace
+
+TEST_P(TcpAcceptorModeTest, AcceptInClientThreads) {
+  const bool reuse_port = GetParam();
+  TcpAcceptor acceptor(main_thread_->selector(),
+                       TcpAcceptorParams()
+                           .set_acceptor_threads(GetAcceptorThreads())
+                           .set_reuse_port(reuse_port));
+  acceptor.set_accept_handler([this](std::unique_ptr<Connection> connection) {
+    AcceptConnection(std::move(connection));
+  });
+  HostPort local_addr(absl::nullopt, IpAddress::kIPv4Localhost, 0);
+  RunAndWait(main_thread_.get(),
+             [&]() { EXPECT_OK(acceptor.Listen(local_addr)); });
+  ASSERT_EQ(acceptor.state(), Acceptor::LISTENING);
+  ASSERT_TRUE(acceptor.local_address().port().has_value());
+  const uint16_t port = acceptor.local_address().port().value();
+  EXPECT_NE(port, 0);
+
+  static constexpr size_t kNumConnections = 30;
+  std::vector<int> fds;
+  for (size_t i = 0; i < kNumConnections; ++i) {
+    const int fd = ConnectToLocalPort(port);
+    ASSERT_GE(fd, 0);
+    fds.push_back(fd);
+  }
+  WaitForAccepted(kNumConnections);
+  {
+    absl::MutexLock l(&mutex_);
+    size_t num_in_thread = 0;
+    for (const auto& it : accepted_) {
+      EXPECT_NE(it.first, main_thread_->selector());
+      num_in_thread += it.second;
+    }
+    // Accept handlers are called in the connection selector thread.
+    EXPECT_EQ(num_in_thread, kNumConnections);
+  }
+  EXPECT_EQ(acceptor.stats().connections_initialized.load(), kNumConnections);
+  for (const int fd : fds) {
+    ::close(fd);
+  }
+  RunAndWait(main_thread_.get(), [&acceptor]() { acceptor.Close(); });
+  EXPECT_EQ(acceptor.state(), Acceptor::DISCONNECTED);
+}
+
+INSTANTIATE_TEST_SUITE_P(ReusePort, TcpAcceptorModeTest, ::testing::Bool());
+
+TEST(TcpAcceptor, ReusePortRequiresAcceptorThreads) {
+  ASSERT_OK_AND_ASSIGN(auto selector, Selector::Create(Selector::Params()));
+  TcpAcceptor acceptor(selector.get(),
+                       TcpAcceptorParams().set_reuse_port(true));
+  EXPECT_FALSE(
+      acceptor.Listen(HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0))
+          .ok());
+  EXPECT_EQ(acceptor.state(), Acceptor::DISCONNECTED);
+}
+
+namespace {
+// Registers a file descriptor that it does not own in a selector.
+class FdHolder : public Selectable {
+ public:
+  FdHolder(Selector* selector, int fd) : Selectable(selector), fd_(fd) {}
+  int GetFd() const override { return fd_; }
+  void Close() override {}
+
+ private:
+  const int fd_;
+};
+}  // namespace
+
+TEST_F(TcpAcceptorTest, ReusePortRegisterError) {
+  std::vector<int> fds;
+  for (size_t i = 0; i < kNumClientThreads; ++i) {
+    const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_GE(fd, 0);
+    fds.push_back(fd);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(::bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                     sizeof(addr)),
+              0);
+    ASSERT_EQ(::listen(fd, 10), 0);
+  }
+  // The last fd is already in the selector of its listener, which fails
+  // to register.
+  SelectorThread* const thread = client_threads_.back().get();
+  FdHolder holder(thread->selector(), fds.back());
+  RunAndWait(thread,
+             [&]() { EXPECT_OK(thread->selector()->Register(&holder)); });
+  TcpAcceptor acceptor(main_thread_->selector(),
+                       TcpAcceptorParams()
+                           .set_acceptor_threads(GetAcceptorThreads())
+                           .set_reuse_port(true));
+  RunAndWait(main_thread_.get(), [&]() {
+    EXPECT_FALSE(acceptor.ListenOnFds(fds).ok());
+    EXPECT_EQ(acceptor.state(), Acceptor::DISCONNECTED);
+    EXPECT_TRUE(acceptor.listening_fds().empty());
+  });
+  // The fd was closed w/ the listeners.
+  RunAndWait(thread, [&]() {
+    thread->selector()->Unregister(&holder).IgnoreError();
+  });
+  // And we can listen again.
+  RunAndWait(main_thread_.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+    EXPECT_EQ(acceptor.listening_fds().size(), kNumClientThreads);
+    acceptor.Close();
+  });
+  EXPECT_EQ(acceptor.state(), Acceptor::DISCONNECTED);
+}
+
+TEST_F(TcpAcceptorTest, ReusePortCpuSteering) {
+  TcpAcceptor acceptor(main_thread_->selector(),
+                       TcpAcceptorParams()
+                           .set_acceptor_threads(GetAcceptorThreads())
+                           .set_reuse_port(true)
+                           .set_reuse_port_cpu_steering(true));
+  acceptor.set_accept_handler([this](std::unique_ptr<Connection> connection) {
+    AcceptConnection(std::move(connection));
+  });
+  RunAndWait(main_thread_.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  const uint16_t port = acceptor.local_address().port().value();
+  static constexpr size_t kNumConnections = 10;
+  std::vector<int> fds;
+  for (size_t i = 0; i < kNumConnections; ++i) {
+    const int fd = ConnectToLocalPort(port);
+    ASSERT_GE(fd, 0);
+    fds.push_back(fd);
+  }
+  WaitForAccepted(kNumConnections);
+  for (const int fd : fds) {
+    ::close(fd);
+  }
+  RunAndWait(main_thread_.get(), [&acceptor]() { acceptor.Close(); });
+  EXPECT_EQ(acceptor.state(), Acceptor::DISCONNECTED);
+}
+
+// Registers in a selector just to be counted.
+class IdleSelectable : public Selectable {
+ public:
+  IdleSelectable() { CHECK_EQ(::pipe(fds_), 0); }
+  ~IdleSelectable() {
+    Close();
+    ::close(fds_[1]);
+  }
+  bool HandleReadEvent(SelectorEventData event) override { return true; }
+  int GetFd() const override { return fds_[0]; }
+  void Close() override {
+    if (fds_[0] != kInvalidFdValue) {
+      if (selector() != nullptr) {
+        selector()->Unregister(this).IgnoreError();
+      }
+      ::close(fds_[0]);
+      fds_[0] = kInvalidFdValue;
+    }
+  }
+
+ private:
+  int fds_[2];
+};
+
+TEST(AcceptorThreads, Placement) {
+  std::vector<std::unique_ptr<SelectorThread>> threads;
+  std::vector<SelectorThread*> client_threads;
+  for (size_t i = 0; i < 3; ++i) {
+    ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+    client_threads.push_back(thread.get());
+    threads.emplace_back(std::move(thread));
+  }
+  {
+    AcceptorThreads round_robin;
+    round_robin.set_client_threads(client_threads);
+    EXPECT_EQ(round_robin.GetNextSelector(), threads[0]->selector());
+    EXPECT_EQ(round_robin.GetNextSelector(), threads[1]->selector());
+    EXPECT_EQ(round_robin.GetNextSelector(), threads[2]->selector());
+    EXPECT_EQ(round_robin.GetNextSelector(), threads[0]->selector());
+  }
+  // The selector threads are stopped, so we can register from here.
+  IdleSelectable s0, s1, s2;
+  ASSERT_OK(threads[0]->selector()->Register(&s0));
+  ASSERT_OK(threads[0]->selector()->Register(&s1));
+  ASSERT_OK(threads[2]->selector()->Register(&s2));
+  EXPECT_EQ(threads[0]->selector()->num_registered(), 2);
+  {
+    AcceptorThreads least_connections;
+    least_connections.set_client_threads(client_threads)
+        .set_placement_policy(
+            AcceptorThreads::PlacementPolicy::LEAST_CONNECTIONS);
+    for (size_t i = 0; i < 5; ++i) {
+      EXPECT_EQ(least_connections.GetNextSelector(), threads[1]->selector());
+    }
+    // The copies keep the policy.
+    AcceptorThreads copy(least_connections);
+    EXPECT_EQ(copy.GetNextSelector(), threads[1]->selector());
+  }
+  s0.Close();
+  s1.Close();
+  s2.Close();
+  {
+    // Ties broken round robin.
+    AcceptorThreads least_connections;
+    least_connections.set_client_threads(client_threads)
+        .set_placement_policy(
+            AcceptorThreads::PlacementPolicy::LEAST_CONNECTIONS);
+    absl::flat_hash_map<Selector*, size_t> counts;
+    for (size_t i = 0; i < 6; ++i) {
+      ++counts[least_connections.GetNextSelector()];
+    }
+    EXPECT_EQ(counts.size(), 3);
+  }
+  {
+    AcceptorThreads custom;
+    custom.set_client_threads(client_threads)
+        .set_placement_function(
+            [](const std::vector<SelectorThread*>& threads) {
+              return threads.size() - 1;
+            });
+    EXPECT_EQ(custom.GetNextSelector(), threads[2]->selector());
+  }
+}
+
+TEST(AcceptorThreads, LeastBusy) {
+  std::vector<std::unique_ptr<SelectorThread>> threads;
+  std::vector<SelectorThread*> client_threads;
+  for (size_t i = 0; i < 2; ++i) {
+    ASSERT_OK_AND_ASSIGN(auto thread,
+                         SelectorThread::Create(
+                             Selector::Params().set_loop_utilization_window(
+                                 absl::Milliseconds(20))));
+    client_threads.push_back(thread.get());
+    threads.emplace_back(std::move(thread));
+    threads.back()->Start();
+  }
+  // Keeps the first selector busy, for a few utilization windows.
+  Selector* const busy = threads[0]->selector();
+  std::atomic_bool stop = ATOMIC_VAR_INIT(false);
+  std::function<void()> spin = [&]() {
+    const absl::Time end = absl::Now() + absl::Milliseconds(5);
+    while (absl::Now() < end) {
+    }
+    if (!stop.load()) {
+      busy->RunInSelectLoop([&spin]() { spin(); });
+    }
+  };
+  busy->RunInSelectLoop([&spin]() { spin(); });
+  const absl::Time deadline = absl::Now() + absl::Seconds(10);
+  while (busy->loop_utilization() < 0.5 && absl::Now() < deadline) {
+    absl::SleepFor(absl::Milliseconds(5));
+  }
+  EXPECT_GE(busy->loop_utilization(), 0.5);
+  AcceptorThreads least_busy;
+  least_busy.set_client_threads(client_threads)
+      .set_placement_policy(AcceptorThreads::PlacementPolicy::LEAST_BUSY);
+  EXPECT_EQ(least_busy.GetNextSelector(), threads[1]->selector());
+  EXPECT_EQ(least_busy.GetNextSelector(), threads[1]->selector());
+  stop.store(true);
+  for (auto& thread : threads) {
+    thread->Stop();
+  }
+}
+
+TEST_F(TcpAcceptorTest, PauseOnPendingInitializations) {
+  // The client thread is stopped, so the accepted connections pile up
+  // waiting for their initialization.
+  ASSERT_OK_AND_ASSIGN(auto client_thread, SelectorThread::Create());
+  TcpAcceptor acceptor(
+      main_thread_->selector(),
+      TcpAcceptorParams()
+          .set_acceptor_threads(std::move(
+              AcceptorThreads().set_client_threads({client_thread.get()})))
+          .set_max_pending_initializations(2));
+  acceptor.set_accept_handler([this](std::unique_ptr<Connection> connection) {
+    AcceptConnection(std::move(connection));
+  });
+  RunAndWait(main_thread_.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  const uint16_t port = acceptor.local_address().port().value();
+  static constexpr size_t kNumConnections = 6;
+  std::vector<int> fds;
+  for (size_t i = 0; i < kNumConnections; ++i) {
+    // Completed by the kernel, even if not accepted.
+    const int fd = ConnectToLocalPort(port);
+    ASSERT_GE(fd, 0);
+    fds.push_back(fd);
+  }
+  while (acceptor.stats().accept_pauses.load() == 0) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  absl::SleepFor(absl::Milliseconds(20));
+  EXPECT_EQ(acceptor.stats().connections_accept_scheduled.load(), 2);
+  EXPECT_EQ(acceptor.stats().connections_initialized.load(), 0);
+
+  client_thread->Start();
+  WaitForAccepted(kNumConnections);
+  EXPECT_EQ(acceptor.stats().connections_initialized.load(), kNumConnections);
+  EXPECT_GE(acceptor.stats().accept_pauses.load(), 1);
+  for (const int fd : fds) {
+    ::close(fd);
+  }
+  RunAndWait(main_thread_.get(), [&acceptor]() { acceptor.Close(); });
+  client_thread->Stop();
+}
+
+TEST_F(TcpAcceptorTest, PeerPrefixFilters) {
+  auto loopback = std::make_shared<IpPrefixSet>();
+  ASSERT_OK(loopback->Add("127.0.0.0/8"));
+  auto others = std::make_shared<IpPrefixSet>();
+  ASSERT_OK(others->Add("10.0.0.0/8"));
+  ASSERT_OK(others->Add("2000::/3"));
+  // The first one denies the loopback peers, the other allows only them.
+  TcpAcceptor denying(main_thread_->selector(),
+                      TcpAcceptorParams().set_denied_peers(loopback));
+  TcpAcceptor allowing(main_thread_->selector(),
+                       TcpAcceptorParams()
+                           .set_allowed_peers(loopback)
+                           .set_denied_peers(others));
+  for (TcpAcceptor* acceptor : {&denying, &allowing}) {
+    acceptor->set_accept_handler(
+        [this](std::unique_ptr<Connection> connection) {
+          AcceptConnection(std::move(connection));
+        });
+    RunAndWait(main_thread_.get(), [acceptor]() {
+      EXPECT_OK(acceptor->Listen(
+          HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+    });
+  }
+  const int denied_fd =
+      ConnectToLocalPort(denying.local_address().port().value());
+  ASSERT_GE(denied_fd, 0);
+  const int allowed_fd =
+      ConnectToLocalPort(allowing.local_address().port().value());
+  ASSERT_GE(allowed_fd, 0);
+  WaitForAccepted(1);
+  while (denying.stats().filtered_connections.load() == 0) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  EXPECT_EQ(denying.stats().connections_accept_scheduled.load(), 0);
+  EXPECT_EQ(allowing.stats().filtered_connections.load(), 0);
+  EXPECT_EQ(allowing.stats().connections_accept_scheduled.load(), 1);
+  ::close(denied_fd);
+  ::close(allowed_fd);
+  RunAndWait(main_thread_.get(), [&]() {
+    denying.Close();
+    allowing.Close();
+  });
+}
+
+// Parametrized on the edge triggered mode of the selector.
+class TcpConnectionTransferTest : public ::testing::TestWithParam<bool> {};
+
+TEST_P(TcpConnectionTransferTest, EchoTransfer) {
+  ASSERT_OK_AND_ASSIGN(auto thread,
+                       SelectorThread::Create(
+                           Selector::Params()
+                               .set_loop_type(Selector::LoopType::EPOLL)
+                               .set_edge_triggered(GetParam())));
+  thread->Start();
+  // Small limits, so we need multiple reads / writes per event.
+  const TcpConnectionParams connection_params =
+      TcpConnectionParams().set_read_limit(1000).set_write_limit(4096);
+  TcpAcceptor acceptor(
+      thread->selector(),
+      TcpAcceptorParams().set_tcp_connection_params(connection_params));
+  std::unique_ptr<Connection> server;
+  acceptor.set_accept_handler([&server](std::unique_ptr<Connection> c) {
+    server = std::move(c);
+    Connection* const connection = server.get();
+    connection->set_read_handler([connection]() {
+      connection->Write(std::move(*connection->inbuf()));
+      connection->inbuf()->Clear();
+      return absl::OkStatus();
+    });
+    connection->set_write_handler([]() { return absl::OkStatus(); });
+  });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  const uint16_t port = acceptor.local_address().port().value();
+
+  static constexpr size_t kSize = 1 << 20;
+  std::string data(kSize, ' ');
+  for (size_t i = 0; i < kSize; ++i) {
+    data[i] = 'a' + (i * 7) % 26;
+  }
+  TcpConnection tcp_client(thread->selector(), connection_params);
+  Connection& client = tcp_client;
+  std::string received;
+  absl::Notification done;
+  client.set_connect_handler([&client, &data]() { client.Write(data); });
+  client.set_write_handler([]() { return absl::OkStatus(); });
+  client.set_read_handler([&]() {
+    received.append(std::string(*client.inbuf()));
+    client.inbuf()->Clear();
+    if (received.size() >= kSize && !done.HasBeenNotified()) {
+      done.Notify();
+    }
+    return absl::OkStatus();
+  });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(client.Connect(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, port)));
+  });
+  ASSERT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(30)));
+  EXPECT_TRUE(received == data);
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_EQ(client.count_bytes_written(), kSize);
+    EXPECT_EQ(server->count_bytes_read(), kSize);
+    client.ForceClose();
+    server->ForceClose();
+    server.reset();
+    acceptor.Close();
+  });
+  thread->Stop();
+}
+
+INSTANTIATE_TEST_SUITE_P(EdgeTriggered, TcpConnectionTransferTest,
+                         ::testing::Bool());
+
+// Parametrized on the loop type of the selector - skipped for the ones not
+// available here.
+class TcpConnectionLoopTypeTest
+    : public ::testing::TestWithParam<Selector::LoopType> {
+ protected:
+  void SetUp() override {
+    auto thread =
+        SelectorThread::Create(Selector::Params().set_loop_type(GetParam()));
+    if (IsLoopTypeUnavailable(thread.status())) {
+      GTEST_SKIP() << "Loop type not available: " << thread.status();
+    }
+    ASSERT_OK(thread.status());
+    thread_ = std::move(thread).value();
+    ASSERT_TRUE(thread_->Start());
+  }
+  void TearDown() override {
+    if (thread_ != nullptr) {
+      thread_->Stop();
+    }
+  }
+
+  std::unique_ptr<SelectorThread> thread_;
+};
+
+TEST_P(TcpConnectionLoopTypeTest, EchoRoundTrip) {
+  TcpAcceptor acceptor(thread_->selector(), TcpAcceptorParams());
+  std::unique_ptr<Connection> server;
+  acceptor.set_accept_handler([&server](std::unique_ptr<Connection> c) {
+    server = std::move(c);
+    Connection* const connection = server.get();
+    connection->set_read_handler([connection]() {
+      connection->Write(std::move(*connection->inbuf()));
+      connection->inbuf()->Clear();
+      return absl::OkStatus();
+    });
+    connection->set_write_handler([]() { return absl::OkStatus(); });
+  });
+  RunAndWait(thread_.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  const uint16_t port = acceptor.local_address().port().value();
+
+  static constexpr size_t kSize = 1 << 16;
+  const std::string data(kSize, 'x');
+  TcpConnection tcp_client(thread_->selector(), TcpConnectionParams());
+  Connection& client = tcp_client;
+  std::string received;
+  absl::Notification done;
+  client.set_connect_handler([&client, &data]() { client.Write(data); });
+  client.set_write_handler([]() { return absl::OkStatus(); });
+  client.set_read_handler([&]() {
+    received.append(std::string(*client.inbuf()));
+    client.inbuf()->Clear();
+    if (received.size() >= kSize && !done.HasBeenNotified()) {
+      done.Notify();
+    }
+    return absl::OkStatus();
+  });
+  RunAndWait(thread_.get(), [&]() {
+    EXPECT_OK(client.Connect(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, port)));
+  });
+  ASSERT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(30)));
+  EXPECT_EQ(received, data);
+  RunAndWait(thread_.get(), [&]() {
+    client.ForceClose();
+    server->ForceClose();
+    server.reset();
+    acceptor.Close();
+  });
+}
+
+// The connect completes on the first actual event of the socket, and only
+// the events synthesized for edge triggered mode are skipped.
+TEST_P(TcpConnectionLoopTypeTest, ConnectCompletes) {
+  for (const bool edge_triggered : {false, true}) {
+    ASSERT_OK_AND_ASSIGN(auto thread,
+                         SelectorThread::Create(
+                             Selector::Params()
+                                 .set_loop_type(GetParam())
+                                 .set_edge_triggered(edge_triggered)));
+    ASSERT_TRUE(thread->Start());
+    TcpAcceptor acceptor(thread->selector(), TcpAcceptorParams());
+    std::unique_ptr<Connection> server;
+    acceptor.set_accept_handler(
+        [&server](std::unique_ptr<Connection> c) { server = std::move(c); });
+    RunAndWait(thread.get(), [&]() {
+      EXPECT_OK(acceptor.Listen(
+          HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+    });
+    TcpConnection client(thread->selector(), TcpConnectionParams());
+    absl::Notification connected;
+    client.set_connect_handler([&connected]() { connected.Notify(); });
+    client.set_write_handler([]() { return absl::OkStatus(); });
+    RunAndWait(thread.get(), [&]() {
+      EXPECT_OK(client.Connect(HostPort(absl::nullopt,
+                                        IpAddress::kIPv4Localhost,
+                                        acceptor.local_address().port())));
+    });
+    EXPECT_TRUE(connected.WaitForNotificationWithTimeout(absl::Seconds(10)))
+        << "Edge triggered: " << edge_triggered;
+    RunAndWait(thread.get(), [&]() {
+      EXPECT_EQ(client.state(), Connection::CONNECTED)
+          << "Edge triggered: " << edge_triggered;
+      client.ForceClose();
+      if (server != nullptr) {
+        server->ForceClose();
+        server.reset();
+      }
+      acceptor.Close();
+    });
+    thread->Stop();
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(LoopTypes, TcpConnectionLoopTypeTest,
+                         ::testing::Values(Selector::LoopType::POLL,
+                                           Selector::LoopType::EPOLL,
+                                           Selector::LoopType::KQUEUE,
+                                           Selector::LoopType::IO_URING));
+
+TEST(TcpConnection, CorkedWrites) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  TcpAcceptor acceptor(thread->selector(), TcpAcceptorParams());
+  std::unique_ptr<Connection> server;
+  absl::Notification accepted;
+  acceptor.set_accept_handler(
+      [&server, &accepted](std::unique_ptr<Connection> c) {
+        server = std::move(c);
+        server->set_write_handler([]() { return absl::OkStatus(); });
+        accepted.Notify();
+      });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  const int fd = ConnectToLocalPort(acceptor.local_address().port().value());
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(accepted.WaitForNotificationWithTimeout(absl::Seconds(10)));
+
+  static constexpr size_t kNumWrites = 100;
+  std::string expected;
+  RunAndWait(thread.get(), [&]() {
+    server->Cork();
+    server->Cork();
+    for (size_t i = 0; i < kNumWrites; ++i) {
+      const std::string piece = absl::StrCat("piece ", i, "\n");
+      server->Write(piece);
+      expected.append(piece);
+    }
+    EXPECT_TRUE(server->corked());
+    server->Uncork();
+    EXPECT_TRUE(server->corked());
+  });
+  // Nothing is sent while still corked.
+  absl::SleepFor(absl::Milliseconds(100));
+  char buffer[4096];
+  EXPECT_LT(::recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT), 0);
+  RunAndWait(thread.get(), [&]() {
+    server->Uncork();
+    EXPECT_FALSE(server->corked());
+    EXPECT_TRUE(server->outbuf()->empty());
+    // Not matched by a Cork() - ignored.
+    server->Uncork();
+    EXPECT_FALSE(server->corked());
+  });
+  std::string received;
+  while (received.size() < expected.size()) {
+    const ssize_t cb = ::recv(fd, buffer, sizeof(buffer), 0);
+    ASSERT_GT(cb, 0);
+    received.append(buffer, cb);
+  }
+  EXPECT_EQ(received, expected);
+  ::close(fd);
+  RunAndWait(thread.get(), [&]() {
+    server->ForceClose();
+    server.reset();
+    acceptor.Close();
+  });
+  thread->Stop();
+}
+
+TEST(TcpConnection, ZerocopyWrites) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  TcpAcceptor acceptor(
+      thread->selector(),
+      TcpAcceptorParams().set_tcp_connection_params(
+          TcpConnectionParams().set_zerocopy_threshold(32768)));
+  std::unique_ptr<Connection> server;
+  absl::Notification accepted;
+  acceptor.set_accept_handler(
+      [&server, &accepted](std::unique_ptr<Connection> c) {
+        server = std::move(c);
+        server->set_write_handler([]() { return absl::OkStatus(); });
+        accepted.Notify();
+      });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  const int fd = ConnectToLocalPort(acceptor.local_address().port().value());
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(accepted.WaitForNotificationWithTimeout(absl::Seconds(10)));
+
+  // Large chunks, sent with MSG_ZEROCOPY, between small ones.
+  std::string expected;
+  RunAndWait(thread.get(), [&]() {
+    for (size_t i = 0; i < 8; ++i) {
+      const std::string small = absl::StrCat("small ", i);
+      server->Write(absl::string_view(small));
+      std::string large(1 << 20, 'a' + i);
+      expected.append(small).append(large);
+      server->Write(std::move(large));
+    }
+  });
+  std::string received;
+  char buffer[16384];
+  while (received.size() < expected.size()) {
+    const ssize_t cb = ::recv(fd, buffer, sizeof(buffer), 0);
+    ASSERT_GT(cb, 0);
+    received.append(buffer, cb);
+  }
+  EXPECT_TRUE(received == expected);
+  auto* const tcp_server = static_cast<TcpConnection*>(server.get());
+  size_t sends = 0;
+  size_t completed = 0;
+  for (size_t i = 0; i < 100 && (sends == 0 || completed < sends); ++i) {
+    RunAndWait(thread.get(), [&]() {
+      sends = tcp_server->zerocopy_sends();
+      completed = tcp_server->zerocopy_completed();
+    });
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  // Unless the kernel does not support it.
+  if (sends > 0) {
+    EXPECT_EQ(completed, sends);
+  }
+  ::close(fd);
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_EQ(server->count_bytes_written(), expected.size());
+    server->ForceClose();
+    server.reset();
+    acceptor.Close();
+  });
+  thread->Stop();
+}
+
+TEST(TcpConnection, ZerocopyClose) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  TcpAcceptor acceptor(
+      thread->selector(),
+      TcpAcceptorParams().set_tcp_connection_params(
+          TcpConnectionParams().set_zerocopy_threshold(32768)));
+  std::unique_ptr<Connection> server;
+  absl::Notification accepted;
+  acceptor.set_accept_handler(
+      [&server, &accepted](std::unique_ptr<Connection> c) {
+        server = std::move(c);
+        server->set_write_handler([]() { return absl::OkStatus(); });
+        accepted.Notify();
+      });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  const int fd = ConnectToLocalPort(acceptor.local_address().port().value());
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(accepted.WaitForNotificationWithTimeout(absl::Seconds(10)));
+
+  // Closed right after sending, w/ the sends likely not completed - the
+  // data is kept until they are.
+  std::string expected;
+  RunAndWait(thread.get(), [&]() {
+    for (size_t i = 0; i < 2; ++i) {
+      std::string large(1 << 20, 'a' + i);
+      expected.append(large);
+      server->Write(std::move(large));
+    }
+  });
+  for (size_t i = 0; i < 1000; ++i) {
+    size_t written = 0;
+    RunAndWait(thread.get(),
+               [&]() { written = server->count_bytes_written(); });
+    if (written == expected.size()) {
+      break;
+    }
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_EQ(server->count_bytes_written(), expected.size());
+    server->ForceClose();
+    server.reset();
+    acceptor.Close();
+  });
+  std::string received;
+  char buffer[16384];
+  while (true) {
+    const ssize_t cb = ::recv(fd, buffer, sizeof(buffer), 0);
+    if (cb <= 0) {
+      break;
+    }
+    received.append(buffer, cb);
+  }
+  EXPECT_TRUE(received == expected);
+  ::close(fd);
+  thread->Stop();
+}
+
+TEST(TcpConnection, AdaptiveReadBlockSize) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  TcpAcceptor acceptor(thread->selector(),
+                       TcpAcceptorParams().set_tcp_connection_params(
+                           TcpConnectionParams()
+                               .set_block_size(4096)
+                               .set_adaptive_block_size(true)
+                               .set_min_block_size(1024)
+                               .set_max_block_size(65536)));
+  std::unique_ptr<Connection> server;
+  absl::Notification accepted;
+  absl::Mutex mutex;
+  size_t received = 0;
+  acceptor.set_accept_handler([&](std::unique_ptr<Connection> c) {
+    server = std::move(c);
+    Connection* const connection = server.get();
+    connection->set_read_handler([&mutex, &received, connection]() {
+      absl::MutexLock l(&mutex);
+      received += connection->inbuf()->size();
+      connection->inbuf()->Clear();
+      return absl::OkStatus();
+    });
+    accepted.Notify();
+  });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  const int fd = ConnectToLocalPort(acceptor.local_address().port().value());
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(accepted.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  auto wait_received = [&mutex, &received](size_t size) {
+    absl::MutexLock l(&mutex);
+    const auto done = [&received, size]() { return received >= size; };
+    return mutex.AwaitWithTimeout(absl::Condition(&done), absl::Seconds(10));
+  };
+  const auto& stats = static_cast<TcpConnection*>(server.get())->read_stats();
+  EXPECT_EQ(stats.block_size.load(), 4096);
+
+  // Bulk data: the block grows up to the maximum.
+  const std::string data(4 << 20, 'x');
+  size_t sent = 0;
+  while (sent < data.size()) {
+    const ssize_t cb = ::send(fd, data.data() + sent, data.size() - sent, 0);
+    ASSERT_GT(cb, 0);
+    sent += cb;
+  }
+  ASSERT_TRUE(wait_received(sent));
+  EXPECT_GT(stats.block_grows.load(), 0);
+  EXPECT_GT(stats.full_reads.load(), 0);
+  EXPECT_LE(stats.block_size.load(), 65536);
+  const size_t bulk_block_size = stats.block_size.load();
+
+  // Small messages, one at a time: the block shrinks.
+  for (size_t i = 0; i < 40; ++i) {
+    ASSERT_EQ(::send(fd, "ping", 4, 0), 4);
+    sent += 4;
+    ASSERT_TRUE(wait_received(sent));
+  }
+  EXPECT_GT(stats.block_shrinks.load(), 0);
+  EXPECT_LT(stats.block_size.load(), bulk_block_size);
+  EXPECT_GE(stats.block_size.load(), 1024);
+
+  ::close(fd);
+  RunAndWait(thread.get(), [&]() {
+    server->ForceClose();
+    server.reset();
+    acceptor.Close();
+  });
+  thread->Stop();
+}
+
+TEST(TcpConnection, RateLimits) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  // 200KB/s per connection, in bursts of up to 16KB - and the writes are
+  // limited by a bucket shared w/ other connections too.
+  const auto rate_limit =
+      TokenBucket::Params().set_rate(200000).set_burst(16384);
+  auto shared_bucket = std::make_shared<TokenBucket>(
+      TokenBucket::Params().set_rate(100000).set_burst(16384));
+  TcpAcceptor acceptor(thread->selector(),
+                       TcpAcceptorParams().set_tcp_connection_params(
+                           TcpConnectionParams()
+                               .set_read_rate_limit(rate_limit)
+                               .set_write_rate_limit(rate_limit)
+                               .set_shared_write_bucket(shared_bucket)));
+  std::unique_ptr<Connection> server;
+  absl::Mutex mutex;
+  size_t received = 0;
+  absl::Notification accepted;
+  acceptor.set_accept_handler([&](std::unique_ptr<Connection> c) {
+    server = std::move(c);
+    Connection* const connection = server.get();
+    connection->set_read_handler([&mutex, &received, connection]() {
+      absl::MutexLock l(&mutex);
+      received += connection->inbuf()->size();
+      connection->inbuf()->Clear();
+      return absl::OkStatus();
+    });
+    connection->set_write_handler([]() { return absl::OkStatus(); });
+    accepted.Notify();
+  });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  const int fd = ConnectToLocalPort(acceptor.local_address().port().value());
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(accepted.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  auto* const tcp_server = static_cast<TcpConnection*>(server.get());
+
+  // Reads: after the first burst, at most 200KB/s.
+  const std::string data(64 << 10, 'x');
+  absl::Time start = absl::Now();
+  ASSERT_EQ(::send(fd, data.data(), data.size(), 0), data.size());
+  {
+    absl::MutexLock l(&mutex);
+    const auto done = [&received, &data]() { return received >= data.size(); };
+    ASSERT_TRUE(
+        mutex.AwaitWithTimeout(absl::Condition(&done), absl::Seconds(10)));
+  }
+  EXPECT_GE(absl::Now() - start, absl::Milliseconds(200));
+  RunAndWait(thread.get(), [tcp_server]() {
+    EXPECT_GT(tcp_server->read_throttles(), 0);
+    EXPECT_EQ(tcp_server->write_throttles(), 0);
+  });
+
+  // Writes: limited by the shared bucket, at 100KB/s.
+  start = absl::Now();
+  RunAndWait(thread.get(), [&server, &data]() { server->Write(data); });
+  char buffer[4096];
+  size_t client_received = 0;
+  while (client_received < data.size()) {
+    const ssize_t cb = ::recv(fd, buffer, sizeof(buffer), 0);
+    ASSERT_GT(cb, 0);
+    client_received += cb;
+  }
+  EXPECT_GE(absl::Now() - start, absl::Milliseconds(400));
+  RunAndWait(thread.get(), [tcp_server]() {
+    EXPECT_GT(tcp_server->write_throttles(), 0);
+  });
+
+  ::close(fd);
+  RunAndWait(thread.get(), [&]() {
+    server->ForceClose();
+    server.reset();
+    acceptor.Close();
+  });
+  thread->Stop();
+}
+
+TEST(TcpConnection, WriteFile) {
+  const std::string filename =
+      absl::StrCat(::testing::TempDir(), "/connection_test_write_file");
+  std::string content(1 << 20, ' ');
+  for (size_t i = 0; i < content.size(); ++i) {
+    content[i] = 'a' + (i * 13) % 26;
+  }
+  ASSERT_OK(io::File::WriteFromString(filename, content).status());
+
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  TcpAcceptor acceptor(
+      thread->selector(),
+      TcpAcceptorParams().set_tcp_connection_params(
+          TcpConnectionParams().set_write_limit(100000)));
+  std::unique_ptr<Connection> server;
+  absl::Notification accepted;
+  acceptor.set_accept_handler(
+      [&server, &accepted](std::unique_ptr<Connection> c) {
+        server = std::move(c);
+        server->set_write_handler([]() { return absl::OkStatus(); });
+        accepted.Notify();
+      });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  const int fd = ConnectToLocalPort(acceptor.local_address().port().value());
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(accepted.WaitForNotificationWithTimeout(absl::Seconds(10)));
+
+  // The file data goes in order with the data written around it, and the
+  // file can be closed right after queuing it.
+  const std::string expected =
+      absl::StrCat("head:", content, ":middle:", content.substr(1000, 5000),
+                   ":tail");
+  RunAndWait(thread.get(), [&]() {
+    ASSERT_OK_AND_ASSIGN(auto file, io::File::Open(filename));
+    server->Write(absl::string_view("head:"));
+    EXPECT_OK(server->WriteFile(*file, 0, content.size()));
+    server->Write(absl::string_view(":middle:"));
+    EXPECT_OK(server->WriteFile(*file, 1000, 5000));
+    EXPECT_OK(server->WriteFile(*file, 0, 0));
+    server->Write(absl::string_view(":tail"));
+    EXPECT_TRUE(server->has_pending_output());
+  });
+  std::string received;
+  char buffer[16384];
+  while (received.size() < expected.size()) {
+    const ssize_t cb = ::recv(fd, buffer, sizeof(buffer), 0);
+    ASSERT_GT(cb, 0);
+    received.append(buffer, cb);
+  }
+  EXPECT_TRUE(received == expected);
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_FALSE(server->has_pending_output());
+    EXPECT_EQ(server->count_bytes_written(), expected.size());
+  });
+  ::close(fd);
+  RunAndWait(thread.get(), [&]() {
+    server->ForceClose();
+    server.reset();
+    acceptor.Close();
+  });
+  thread->Stop();
+  ::unlink(filename.c_str());
+}
+
+TEST(TcpConnection, OutputWatermarks) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  Selector* const selector = thread->selector();
+  TcpAcceptor acceptor(selector, TcpAcceptorParams());
+  std::unique_ptr<Connection> server;
+  std::vector<bool> events;  // accessed in the select loop
+  absl::Notification accepted;
+  acceptor.set_accept_handler(
+      [&server, &events, &accepted](std::unique_ptr<Connection> c) {
+        server = std::move(c);
+        server->set_write_handler([]() { return absl::OkStatus(); })
+            .set_close_handler([](const absl::Status&,
+                                  Connection::CloseDirective) {})
+            .set_output_watermarks(64 << 10, 1 << 20)
+            .set_output_watermark_handler(
+                [&events](bool above_high) { events.push_back(above_high); });
+        accepted.Notify();
+      });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  const int fd = ConnectToLocalPort(acceptor.local_address().port().value());
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(accepted.WaitForNotificationWithTimeout(absl::Seconds(10)));
+
+  // The client does not read, so the output piles up above the high mark.
+  const std::string piece(256 << 10, 'x');
+  size_t num_written = 0;
+  RunAndWait(thread.get(), [&]() {
+    while (!server->output_above_high_watermark()) {
+      server->Write(piece);
+      num_written += piece.size();
+    }
+    EXPECT_EQ(events, std::vector<bool>({true}));
+    EXPECT_GE(server->PendingOutputSize(), size_t{1} << 20);
+    EXPECT_EQ(selector->buffered_output_bytes(),
+              static_cast<int64_t>(server->PendingOutputSize()));
+    EXPECT_EQ(selector->GetStatsSnapshot().buffered_output_bytes,
+              server->PendingOutputSize());
+  });
+  // And drains when the client reads.
+  char buffer[16384];
+  size_t num_received = 0;
+  while (num_received < num_written) {
+    const ssize_t cb = ::recv(fd, buffer, sizeof(buffer), 0);
+    ASSERT_GT(cb, 0);
+    num_received += cb;
+  }
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_EQ(events, std::vector<bool>({true, false}));
+    EXPECT_FALSE(server->output_above_high_watermark());
+    EXPECT_EQ(selector->buffered_output_bytes(), 0);
+  });
+
+  // Over the maximum, the connection is closed - from the next loop step.
+  RunAndWait(thread.get(), [&]() {
+    server->set_max_pending_output(2 << 20);
+    for (size_t i = 0; i < 10; ++i) {
+      server->Write(piece);
+    }
+    EXPECT_EQ(server->state(), Connection::CONNECTED);
+    EXPECT_RAISES(server->last_error(), ResourceExhausted);
+  });
+  // The callbacks queued meanwhile may run before the alarms of a step.
+  for (int i = 0; i < 100 && server->state() != Connection::DISCONNECTED;
+       ++i) {
+    RunAndWait(thread.get(), []() {});
+  }
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_EQ(server->state(), Connection::DISCONNECTED);
+    EXPECT_EQ(selector->buffered_output_bytes(), 0);
+  });
+  ::close(fd);
+  RunAndWait(thread.get(), [&]() {
+    server.reset();
+    acceptor.Close();
+    // Output of a disconnected connection is accounted until it is gone.
+    std::unique_ptr<Connection> unconnected =
+        absl::make_unique<TcpConnection>(selector, TcpConnectionParams());
+    unconnected->Write(piece);
+    EXPECT_EQ(selector->buffered_output_bytes(),
+              static_cast<int64_t>(piece.size()));
+    unconnected.reset();
+    EXPECT_EQ(selector->buffered_output_bytes(), 0);
+  });
+  thread->Stop();
+}
+
+TEST(TcpConnection, CachedResolveDeferred) {
+  // A failed resolve, cached for the negative ttl.
+  const std::string hostname = "nonexistent.invalid";
+  EXPECT_FALSE(DnsResolver::Default().Resolve(hostname).ok());
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  std::unique_ptr<TcpConnection> connection;
+  absl::Notification closed;
+  RunAndWait(thread.get(), [&]() {
+    connection = absl::make_unique<TcpConnection>(thread->selector(),
+                                                  TcpConnectionParams());
+    connection->set_close_handler(
+        [&closed](const absl::Status&, Connection::CloseDirective) {
+          closed.Notify();
+        });
+    EXPECT_OK(connection->Connect(HostPort(hostname, absl::nullopt, 80)));
+    // The cached result is handled only in the next select loop step.
+    EXPECT_FALSE(closed.HasBeenNotified());
+    EXPECT_EQ(connection->state(), Connection::RESOLVING);
+  });
+  ASSERT_TRUE(closed.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  EXPECT_FALSE(connection->last_error().ok());
+  RunAndWait(thread.get(), [&connection]() { connection.reset(); });
+  thread->Stop();
+}
+
+}  // namespace net
+}  // namespace whisper
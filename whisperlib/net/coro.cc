@@ -0,0 +1,199 @@
+#include "whisperlib/net/coro.h"
+
+#include "absl/log/check.h"
+#include "whisperlib/status/status.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+// A coroutine that is not awaited by anyone, and frees its frame when done.
+struct DetachedTask {
+  struct promise_type : public coro_internal::PooledFrame {
+    DetachedTask get_return_object() {
+      return DetachedTask{
+          std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { std::terminate(); }
+  };
+  std::coroutine_handle<promise_type> handle;
+};
+
+DetachedTask RunDetached(Task<void> task) { co_await std::move(task); }
+}  // namespace
+
+void Spawn(Selector* selector, Task<void> task) {
+  const std::coroutine_handle<> handle = RunDetached(std::move(task)).handle;
+  if (selector->IsInSelectThread()) {
+    handle.resume();
+  } else {
+    selector->RunInSelectLoop([handle]() { handle.resume(); });
+  }
+}
+
+CoConnection::CoConnection(std::unique_ptr<Connection> connection)
+    : connection_(std::move(connection)) {
+  connection_->set_connect_handler([this]() { HandleConnect(); })
+      .set_read_handler([this]() { return HandleRead(); })
+      .set_write_handler([this]() { return HandleWrite(); })
+      .set_close_handler(
+          [this](const absl::Status& status,
+                 Connection::CloseDirective directive) {
+            HandleClose(status, directive);
+          });
+}
+
+CoConnection::~CoConnection() {
+  DCHECK(connect_waiter_ == nullptr && read_waiter_ == nullptr &&
+         flush_waiter_ == nullptr)
+      << "Coroutines still waiting on: " << connection_->ToString();
+  closing_ = true;
+  if (connection_->state() != Connection::DISCONNECTED) {
+    connection_->ForceClose();
+  }
+  // We may be called from the handlers of the connection, which should not
+  // reach us (or whoever takes our place in the arena) after we return.
+  connection_->clear_all_handlers();
+  Selector* const selector = connection_->net_selector();
+  selector->DeleteInSelectLoop(std::move(connection_));
+}
+
+void CoConnection::HandleConnect() {
+  if (connect_waiter_ != nullptr) {
+    Resume(std::exchange(connect_waiter_, nullptr), absl::OkStatus());
+  }
+}
+
+absl::Status CoConnection::HandleRead() {
+  if (read_waiter_ != nullptr && connection_->inbuf()->size() >= read_size_) {
+    Resume(std::exchange(read_waiter_, nullptr), absl::OkStatus());
+  }
+  return absl::OkStatus();
+}
+
+absl::Status CoConnection::HandleWrite() {
+  if (flush_waiter_ != nullptr && connection_->PendingOutputSize() == 0) {
+    Resume(std::exchange(flush_waiter_, nullptr), absl::OkStatus());
+  }
+  return absl::OkStatus();
+}
+
+void CoConnection::HandleClose(const absl::Status& status,
+                               Connection::CloseDirective directive) {
+  if (closing_) {
+    return;
+  }
+  // Set all the results first, as the first resumed coroutine may
+  // destroy us.
+  std::coroutine_handle<> handles[3];
+  size_t num_handles = 0;
+  auto finish = [&handles, &num_handles](Waiter* waiter, absl::Status error) {
+    if (waiter != nullptr) {
+      waiter->status = std::move(error);
+      handles[num_handles++] = waiter->handle;
+    }
+  };
+  if (directive != Connection::CLOSE_WRITE) {
+    read_closed_ = true;
+    finish(std::exchange(read_waiter_, nullptr),
+           CloseError(status, "reading all data"));
+  }
+  if (directive != Connection::CLOSE_READ) {
+    write_closed_ = true;
+    finish(std::exchange(flush_waiter_, nullptr),
+           CloseError(status, "flushing the output"));
+  }
+  if (directive == Connection::CLOSE_READ_WRITE) {
+    finish(std::exchange(connect_waiter_, nullptr),
+           CloseError(status, "connecting"));
+  }
+  for (size_t i = 0; i < num_handles; ++i) {
+    handles[i].resume();
+  }
+}
+
+void CoConnection::Resume(Waiter* waiter, absl::Status status) {
+  waiter->status = std::move(status);
+  waiter->handle.resume();
+}
+
+absl::Status CoConnection::CloseError(const absl::Status& status,
+                                      absl::string_view what) const {
+  if (!status.ok()) {
+    return status;
+  }
+  const absl::Status last_error = connection_->last_error();
+  if (!last_error.ok()) {
+    return last_error;
+  }
+  return status::OutOfRangeErrorBuilder()
+         << "Connection closed before " << what << ": "
+         << connection_->ToString();
+}
+
+bool CoConnection::ConnectAwaiter::await_ready() {
+  switch (conn_->connection_->state()) {
+    case Connection::CONNECTED:
+      return true;
+    case Connection::DISCONNECTED:
+      waiter_.status = conn_->CloseError(absl::OkStatus(), "connecting");
+      return true;
+    default:
+      return false;
+  }
+}
+
+void CoConnection::ConnectAwaiter::await_suspend(
+    std::coroutine_handle<> handle) {
+  CHECK(conn_->connect_waiter_ == nullptr)
+      << "Already waiting for the connect of: "
+      << conn_->connection_->ToString();
+  waiter_.handle = handle;
+  conn_->connect_waiter_ = &waiter_;
+}
+
+bool CoConnection::ReadAwaiter::await_ready() {
+  if (conn_->connection_->inbuf()->size() >= size_) {
+    return true;
+  }
+  if (conn_->read_closed_ ||
+      conn_->connection_->state() == Connection::DISCONNECTED) {
+    waiter_.status = conn_->CloseError(absl::OkStatus(), "reading all data");
+    return true;
+  }
+  return false;
+}
+
+void CoConnection::ReadAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  CHECK(conn_->read_waiter_ == nullptr)
+      << "Already reading from: " << conn_->connection_->ToString();
+  waiter_.handle = handle;
+  conn_->read_waiter_ = &waiter_;
+  conn_->read_size_ = size_;
+}
+
+bool CoConnection::FlushAwaiter::await_ready() {
+  if (conn_->connection_->PendingOutputSize() == 0) {
+    return true;
+  }
+  if (conn_->write_closed_ ||
+      conn_->connection_->state() == Connection::DISCONNECTED) {
+    waiter_.status =
+        conn_->CloseError(absl::OkStatus(), "flushing the output");
+    return true;
+  }
+  return false;
+}
+
+void CoConnection::FlushAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  CHECK(conn_->flush_waiter_ == nullptr)
+      << "Already flushing: " << conn_->connection_->ToString();
+  waiter_.handle = handle;
+  conn_->flush_waiter_ = &waiter_;
+}
+
+}  // namespace net
+}  // namespace whisper
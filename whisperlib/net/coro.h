@@ -0,0 +1,305 @@
+#ifndef WHISPERLIB_NET_CORO_H_
+#define WHISPERLIB_NET_CORO_H_
+
+// C++20 coroutines over the Selector and the Connection-s, for writing the
+// request processing as straight code, instead of handler callbacks.
+// Needs to be compiled with -std=c++20 - see the :coro build target.
+#if !defined(__cpp_impl_coroutine)
+#error "whisperlib/net/coro.h requires C++20 coroutines (-std=c++20)"
+#endif
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "whisperlib/net/connection.h"
+#include "whisperlib/net/dns_resolve.h"
+#include "whisperlib/net/selector.h"
+#include "whisperlib/net/selector_arena.h"
+
+namespace whisper {
+namespace net {
+
+// The coroutines run in the select loop of a selector - they are started
+// with Spawn(), and resumed by the awaitables below from the select loop
+// only, w/ no thread hop when the awaited event happens there (i.e. the
+// resume is done right from the connection handlers, or from the alarms).
+// E.g.:
+//
+//   Task<void> Serve(std::unique_ptr<Connection> c) {
+//     CoConnection conn(std::move(c));
+//     while (true) {
+//       if (!(co_await conn.ReadAtLeast(kHeaderSize)).ok()) co_return;
+//       ...
+//       conn->Write(response);
+//       if (!(co_await conn.Flush()).ok()) co_return;
+//     }
+//   }
+//   ...
+//   // From the accept handler, which runs in the connection selector:
+//   Spawn(connection->net_selector(), Serve(std::move(connection)));
+//
+// The coroutine frames are allocated from the arena of the selector that
+// creates them (see Selector::Params::arena_slab_size), as the connections.
+// There is no cancellation: a coroutine runs until it returns, so one
+// suspended on a connection is ended by closing that connection. The frames
+// of the coroutines waiting on a selector that stops are leaked.
+
+namespace coro_internal {
+// Allocates the coroutine frames from the current selector arena.
+struct PooledFrame {
+  static void* operator new(size_t size) { return SelectorArena::New(size); }
+  static void operator delete(void* p) { SelectorArena::Delete(p); }
+};
+
+struct TaskPromiseBase : public PooledFrame {
+  // Resumes the coroutine awaiting the task, when it is done.
+  struct FinalAwaiter {
+    bool await_ready() const noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<Promise> handle) noexcept {
+      std::coroutine_handle<> continuation = handle.promise().continuation;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+  };
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+  // We don't use exceptions.
+  void unhandled_exception() const noexcept { std::terminate(); }
+
+  std::coroutine_handle<> continuation;
+};
+
+template <typename T>
+struct TaskPromise : public TaskPromiseBase {
+  void return_value(T value) { result.emplace(std::move(value)); }
+  T TakeResult() { return std::move(*result); }
+  absl::optional<T> result;
+};
+template <>
+struct TaskPromise<void> : public TaskPromiseBase {
+  void return_void() const noexcept {}
+  void TakeResult() const noexcept {}
+};
+}  // namespace coro_internal
+
+// A coroutine returning a T, which starts when first awaited, and resumes
+// its awaiter when done (w/ no stack growth between the two).
+// Owns the coroutine frame.
+template <typename T = void>
+class [[nodiscard]] Task {
+ public:
+  struct promise_type : public coro_internal::TaskPromise<T> {
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+  };
+
+  Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      if (handle_) handle_.destroy();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+  ~Task() {
+    if (handle_) handle_.destroy();
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<> awaiting) noexcept {
+    handle_.promise().continuation = awaiting;
+    return handle_;
+  }
+  T await_resume() { return handle_.promise().TakeResult(); }
+
+ private:
+  explicit Task(std::coroutine_handle<promise_type> handle)
+      : handle_(handle) {}
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+// Starts the task in the select loop of the selector - right away if
+// called from there. The task frees itself when done.
+void Spawn(Selector* selector, Task<void> task);
+
+// Suspends the coroutine for the duration, with an alarm in the selector.
+class SleepAwaiter {
+ public:
+  SleepAwaiter(Selector* selector, absl::Duration duration)
+      : selector_(selector), duration_(duration) {}
+  bool await_ready() const noexcept {
+    return duration_ <= absl::ZeroDuration();
+  }
+  void await_suspend(std::coroutine_handle<> handle) {
+    selector_->RegisterAlarm([handle]() { handle.resume(); }, duration_);
+  }
+  void await_resume() const noexcept {}
+
+ private:
+  Selector* const selector_;
+  const absl::Duration duration_;
+};
+inline SleepAwaiter Sleep(Selector* selector, absl::Duration duration) {
+  return SleepAwaiter(selector, duration);
+}
+
+// Resolves a host name w/ the resolver, and resumes the coroutine in the
+// select loop of the selector, with the result. Can be awaited from any
+// thread, so this also moves a coroutine to the selector.
+class ResolveAwaiter {
+ public:
+  ResolveAwaiter(Selector* selector, DnsResolver* resolver,
+                 absl::string_view hostname)
+      : selector_(selector), resolver_(resolver), hostname_(hostname) {}
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> handle) {
+    resolver_->ResolveAsync(
+        hostname_,
+        [this, handle](absl::StatusOr<std::shared_ptr<DnsHostInfo>> result) {
+          result_ = std::move(result);
+          selector_->RunInSelectLoop([handle]() { handle.resume(); });
+        });
+  }
+  absl::StatusOr<std::shared_ptr<DnsHostInfo>> await_resume() {
+    return std::move(result_);
+  }
+
+ private:
+  Selector* const selector_;
+  DnsResolver* const resolver_;
+  const std::string hostname_;
+  absl::StatusOr<std::shared_ptr<DnsHostInfo>> result_;
+};
+inline ResolveAwaiter Resolve(Selector* selector, absl::string_view hostname,
+                              DnsResolver* resolver = &DnsResolver::Default()) {
+  return ResolveAwaiter(selector, resolver, hostname);
+}
+
+// Owns a connection, and sets its handlers to resume the coroutines waiting
+// for its data / output / connect. At most one coroutine can wait for reads,
+// and one for the output, at a time.
+// To be used in the selector thread of the connection. On destruction the
+// connection is closed, and deleted in the next select loop step (as we
+// may be called from its handlers).
+class CoConnection {
+ public:
+  explicit CoConnection(std::unique_ptr<Connection> connection);
+  ~CoConnection();
+
+  CoConnection(const CoConnection&) = delete;
+  CoConnection& operator=(const CoConnection&) = delete;
+
+  Connection* connection() const { return connection_.get(); }
+  Connection* operator->() const { return connection_.get(); }
+
+  class ConnectAwaiter;
+  class ReadAwaiter;
+  class FlushAwaiter;
+
+  // Waits for the connection to be established, after a Connect().
+  // Returns the connect error if the connection got closed instead.
+  ConnectAwaiter Connected();
+  // Waits until the inbuf() holds at least size bytes. Returns an OutOfRange
+  // error if the peer closed its side before that, or the close error - the
+  // data read so far stays in the inbuf().
+  ReadAwaiter ReadAtLeast(size_t size);
+  // Waits until all the pending output is handed to the kernel.
+  FlushAwaiter Flush();
+
+ private:
+  // A suspended coroutine, and its result.
+  struct Waiter {
+    std::coroutine_handle<> handle;
+    absl::Status status;
+  };
+
+  // These resume the waiters that are done. As the waiting coroutines may
+  // destroy us, nothing of this is touched after a resume.
+  void HandleConnect();
+  absl::Status HandleRead();
+  absl::Status HandleWrite();
+  void HandleClose(const absl::Status& status,
+                   Connection::CloseDirective directive);
+  // Resumes the waiter, w/ the status.
+  static void Resume(Waiter* waiter, absl::Status status);
+  // The error for the waiters of a closed connection.
+  absl::Status CloseError(const absl::Status& status,
+                          absl::string_view what) const;
+
+  std::unique_ptr<Connection> connection_;
+  Waiter* connect_waiter_ = nullptr;
+  Waiter* read_waiter_ = nullptr;
+  size_t read_size_ = 0;
+  Waiter* flush_waiter_ = nullptr;
+  bool read_closed_ = false;
+  bool write_closed_ = false;
+  bool closing_ = false;
+};
+
+class CoConnection::ConnectAwaiter {
+ public:
+  explicit ConnectAwaiter(CoConnection* conn) : conn_(conn) {}
+  bool await_ready();
+  void await_suspend(std::coroutine_handle<> handle);
+  absl::Status await_resume() { return std::move(waiter_.status); }
+
+ private:
+  CoConnection* const conn_;
+  Waiter waiter_;
+};
+
+class CoConnection::ReadAwaiter {
+ public:
+  ReadAwaiter(CoConnection* conn, size_t size) : conn_(conn), size_(size) {}
+  bool await_ready();
+  void await_suspend(std::coroutine_handle<> handle);
+  absl::Status await_resume() { return std::move(waiter_.status); }
+
+ private:
+  CoConnection* const conn_;
+  const size_t size_;
+  Waiter waiter_;
+};
+
+class CoConnection::FlushAwaiter {
+ public:
+  explicit FlushAwaiter(CoConnection* conn) : conn_(conn) {}
+  bool await_ready();
+  void await_suspend(std::coroutine_handle<> handle);
+  absl::Status await_resume() { return std::move(waiter_.status); }
+
+ private:
+  CoConnection* const conn_;
+  Waiter waiter_;
+};
+
+inline CoConnection::ConnectAwaiter CoConnection::Connected() {
+  return ConnectAwaiter(this);
+}
+inline CoConnection::ReadAwaiter CoConnection::ReadAtLeast(size_t size) {
+  return ReadAwaiter(this, size);
+}
+inline CoConnection::FlushAwaiter CoConnection::Flush() {
+  return FlushAwaiter(this);
+}
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_CORO_H_
@@ -0,0 +1,218 @@
+#include "whisperlib/net/coro.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "absl/strings/cord.h"
+#include "absl/synchronization/notification.h"
+#include "gtest/gtest.h"
+#include "whisperlib/net/testing_util.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+// Waits for the connections and coroutines in the selector arena to be
+// released - they are deleted in the select loop.
+size_t WaitForArenaRelease(SelectorThread* thread) {
+  for (int i = 0; i < 1000; ++i) {
+    size_t num_outstanding = 0;
+    RunAndWait(thread, [thread, &num_outstanding]() {
+      num_outstanding = thread->selector()->arena()->num_outstanding();
+    });
+    if (num_outstanding == 0) {
+      return 0;
+    }
+    absl::SleepFor(absl::Milliseconds(5));
+  }
+  return thread->selector()->arena()->num_outstanding();
+}
+
+Task<int> SleepAndAdd(Selector* selector, int a, int b) {
+  co_await Sleep(selector, absl::Milliseconds(10));
+  co_return a + b;
+}
+
+Task<void> SumAll(Selector* selector, int* sum, size_t* num_outstanding,
+                  absl::Notification* done) {
+  EXPECT_TRUE(selector->IsInSelectThread());
+  const absl::Time start = absl::Now();
+  Task<int> first = SleepAndAdd(selector, 1, 2);
+  // The frame of the task created in the select loop - the frame of this
+  // one, spawned from outside, is on the heap.
+  *num_outstanding = selector->arena()->num_outstanding();
+  *sum = co_await std::move(first);
+  *sum += co_await SleepAndAdd(selector, 3, 4);
+  EXPECT_TRUE(selector->IsInSelectThread());
+  EXPECT_GE(absl::Now() - start, absl::Milliseconds(20));
+  done->Notify();
+}
+
+Task<void> ServeEcho(std::unique_ptr<Connection> connection) {
+  CoConnection conn(std::move(connection));
+  while ((co_await conn.ReadAtLeast(1)).ok()) {
+    conn->Write(*conn->inbuf());
+    conn->inbuf()->Clear();
+    if (!(co_await conn.Flush()).ok()) {
+      break;
+    }
+  }
+}
+
+Task<absl::Status> Echo(Selector* selector, uint16_t port,
+                        const std::string& message, std::string* received) {
+  CoConnection conn(
+      absl::make_unique<TcpConnection>(selector, TcpConnectionParams()));
+  if (auto status = conn->Connect(
+          HostPort(absl::nullopt, IpAddress::kIPv4Localhost, port));
+      !status.ok()) {
+    co_return status;
+  }
+  if (auto status = co_await conn.Connected(); !status.ok()) {
+    co_return status;
+  }
+  conn->Write(message);
+  if (auto status = co_await conn.Flush(); !status.ok()) {
+    co_return status;
+  }
+  if (auto status = co_await conn.ReadAtLeast(message.size());
+      !status.ok()) {
+    co_return status;
+  }
+  *received = std::string(*conn->inbuf());
+  co_return absl::OkStatus();
+}
+
+Task<void> EchoAll(Selector* selector, uint16_t port, absl::Status* status,
+                   std::string* received, absl::Notification* done) {
+  const std::string message(1 << 20, 'x');
+  for (int i = 0; i < 3 && status->ok(); ++i) {
+    received->clear();
+    *status = co_await Echo(selector, port, message, received);
+    EXPECT_EQ(*received, message);
+  }
+  done->Notify();
+}
+
+Task<void> ReadAll(std::unique_ptr<Connection> connection,
+                   absl::Status* status, std::string* received,
+                   absl::Notification* done) {
+  CoConnection conn(std::move(connection));
+  *status = co_await conn.ReadAtLeast(10);
+  *received = std::string(*conn->inbuf());
+  done->Notify();
+}
+
+Task<void> ResolveHost(Selector* selector, std::string hostname,
+                       absl::StatusOr<std::shared_ptr<DnsHostInfo>>* result,
+                       absl::Notification* done) {
+  *result = co_await Resolve(selector, hostname);
+  EXPECT_TRUE(selector->IsInSelectThread());
+  done->Notify();
+}
+
+const Selector::Params kArenaParams =
+    Selector::Params().set_arena_slab_size(1 << 16);
+}  // namespace
+
+TEST(Coro, SleepAndTasks) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create(kArenaParams));
+  ASSERT_TRUE(thread->Start());
+  Selector* const selector = thread->selector();
+  int sum = 0;
+  size_t num_outstanding = 0;
+  absl::Notification done;
+  Spawn(selector, SumAll(selector, &sum, &num_outstanding, &done));
+  done.WaitForNotification();
+  EXPECT_EQ(sum, 10);
+  EXPECT_EQ(num_outstanding, 1);
+  EXPECT_EQ(WaitForArenaRelease(thread.get()), 0);
+  EXPECT_TRUE(thread->Stop());
+}
+
+TEST(Coro, Echo) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create(kArenaParams));
+  ASSERT_TRUE(thread->Start());
+  Selector* const selector = thread->selector();
+  TcpAcceptor acceptor(selector, TcpAcceptorParams());
+  acceptor.set_accept_handler([](std::unique_ptr<Connection> connection) {
+    Selector* const selector = connection->net_selector();
+    Spawn(selector, ServeEcho(std::move(connection)));
+  });
+  RunAndWait(thread.get(), [&acceptor]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  ASSERT_EQ(acceptor.state(), Acceptor::LISTENING);
+  const uint16_t port = acceptor.local_address().port().value();
+
+  absl::Status status;
+  std::string received;
+  absl::Notification done;
+  RunAndWait(thread.get(), [&]() {
+    Spawn(selector, EchoAll(selector, port, &status, &received, &done));
+  });
+  done.WaitForNotification();
+  EXPECT_OK(status);
+  RunAndWait(thread.get(), [&acceptor]() { acceptor.Close(); });
+  EXPECT_EQ(WaitForArenaRelease(thread.get()), 0);
+  EXPECT_TRUE(thread->Stop());
+}
+
+TEST(Coro, ReadClosed) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  ASSERT_TRUE(thread->Start());
+  Selector* const selector = thread->selector();
+  absl::Status status;
+  std::string received;
+  absl::Notification done;
+  TcpAcceptor acceptor(selector, TcpAcceptorParams());
+  acceptor.set_accept_handler(
+      [&](std::unique_ptr<Connection> connection) {
+        Spawn(selector,
+              ReadAll(std::move(connection), &status, &received, &done));
+      });
+  RunAndWait(thread.get(), [&acceptor]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  ASSERT_EQ(acceptor.state(), Acceptor::LISTENING);
+
+  const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_GE(fd, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(acceptor.local_address().port().value());
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)),
+            0);
+  ASSERT_EQ(::send(fd, "abc", 3, 0), 3);
+  ::close(fd);
+  done.WaitForNotification();
+  EXPECT_RAISES(status, OutOfRange);
+  EXPECT_EQ(received, "abc");
+  RunAndWait(thread.get(), [&acceptor]() { acceptor.Close(); });
+  EXPECT_TRUE(thread->Stop());
+}
+
+TEST(Coro, Resolve) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  ASSERT_TRUE(thread->Start());
+  absl::StatusOr<std::shared_ptr<DnsHostInfo>> result;
+  absl::Notification done;
+  Spawn(thread->selector(),
+        ResolveHost(thread->selector(), "localhost", &result, &done));
+  done.WaitForNotification();
+  ASSERT_OK(result.status());
+  EXPECT_TRUE(result.value()->IsValid());
+  EXPECT_TRUE(thread->Stop());
+}
+
+}  // namespace net
+}  // namespace whisper
@@ -0,0 +1,162 @@
+#include "whisperlib/net/dns_cache.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "absl/hash/hash.h"
+#include "absl/log/check.h"
+#include "absl/memory/memory.h"
+
+namespace whisper {
+namespace net {
+
+DnsCache::Params& DnsCache::Params::set_num_shards(size_t value) {
+  num_shards = value;
+  return *this;
+}
+DnsCache::Params& DnsCache::Params::set_max_entries(size_t value) {
+  max_entries = value;
+  return *this;
+}
+DnsCache::Params& DnsCache::Params::set_positive_ttl(absl::Duration value) {
+  positive_ttl = value;
+  return *this;
+}
+DnsCache::Params& DnsCache::Params::set_negative_ttl(absl::Duration value) {
+  negative_ttl = value;
+  return *this;
+}
+
+DnsCache::DnsCache(Params params)
+    : params_(std::move(params)),
+      max_entries_per_shard_(std::max<size_t>(
+          1, params_.max_entries / std::max<size_t>(1, params_.num_shards))) {
+  CHECK_GT(params_.num_shards, 0UL);
+  shards_.reserve(params_.num_shards);
+  for (size_t i = 0; i < params_.num_shards; ++i) {
+    shards_.emplace_back(absl::make_unique<Shard>());
+  }
+}
+
+DnsCache::Shard* DnsCache::GetShard(absl::string_view hostname) const {
+  return shards_[absl::Hash<absl::string_view>()(hostname) % shards_.size()]
+      .get();
+}
+
+absl::optional<DnsCache::Result> DnsCache::LookupLocked(
+    Shard* shard, absl::string_view hostname, absl::Time now) {
+  auto it = shard->entries.find(hostname);
+  if (it == shard->entries.end()) {
+    return {};
+  }
+  if (it->second.expiration <= now) {
+    shard->lru.erase(it->second.lru_it);
+    shard->entries.erase(it);
+    stats_.expirations.fetch_add(1);
+    return {};
+  }
+  shard->lru.splice(shard->lru.begin(), shard->lru, it->second.lru_it);
+  if (it->second.result.ok()) {
+    stats_.hits.fetch_add(1);
+  } else {
+    stats_.negative_hits.fetch_add(1);
+  }
+  return it->second.result;
+}
+
+absl::optional<DnsCache::Result> DnsCache::Lookup(absl::string_view hostname) {
+  Shard* shard = GetShard(hostname);
+  absl::MutexLock l(&shard->mutex);
+  return LookupLocked(shard, hostname, absl::Now());
+}
+
+bool DnsCache::LookupOrWait(absl::string_view hostname, Callback callback) {
+  Shard* shard = GetShard(hostname);
+  absl::optional<Result> result;
+  {
+    absl::MutexLock l(&shard->mutex);
+    result = LookupLocked(shard, hostname, absl::Now());
+    if (!result.has_value()) {
+      auto it = shard->in_flight.find(hostname);
+      const bool is_new = it == shard->in_flight.end();
+      if (is_new) {
+        it = shard->in_flight.emplace(std::string(hostname),
+                                      std::vector<Callback>()).first;
+        stats_.misses.fetch_add(1);
+      } else {
+        stats_.coalesced.fetch_add(1);
+      }
+      it->second.emplace_back(std::move(callback));
+      return is_new;
+    }
+  }
+  // Called outside the lock, as it may very well resolve other names.
+  callback(*std::move(result));
+  return false;
+}
+
+void DnsCache::Complete(absl::string_view hostname, Result result,
+                        absl::optional<absl::Duration> ttl) {
+  Shard* shard = GetShard(hostname);
+  absl::Duration entry_ttl = ttl.has_value() ? *ttl
+                             : result.ok()   ? params_.positive_ttl
+                                             : params_.negative_ttl;
+  // Only the names that do not exist are cached, not the transient errors
+  // (e.g. a name server timing out), which the next resolve may not hit.
+  if (!result.ok() && !absl::IsNotFound(result.status())) {
+    entry_ttl = absl::ZeroDuration();
+  }
+  std::vector<Callback> callbacks;
+  {
+    absl::MutexLock l(&shard->mutex);
+    auto in_flight_it = shard->in_flight.find(hostname);
+    if (in_flight_it != shard->in_flight.end()) {
+      callbacks = std::move(in_flight_it->second);
+      shard->in_flight.erase(in_flight_it);
+    }
+    auto it = shard->entries.find(hostname);
+    if (entry_ttl <= absl::ZeroDuration()) {
+      if (it != shard->entries.end()) {
+        shard->lru.erase(it->second.lru_it);
+        shard->entries.erase(it);
+      }
+    } else if (it != shard->entries.end()) {
+      it->second.result = result;
+      it->second.expiration = absl::Now() + entry_ttl;
+      shard->lru.splice(shard->lru.begin(), shard->lru, it->second.lru_it);
+    } else {
+      while (shard->entries.size() >= max_entries_per_shard_) {
+        shard->entries.erase(shard->lru.back());
+        shard->lru.pop_back();
+        stats_.evictions.fetch_add(1);
+      }
+      shard->lru.emplace_front(hostname);
+      shard->entries.emplace(
+          std::string(hostname),
+          Shard::Entry{result, absl::Now() + entry_ttl, shard->lru.begin()});
+    }
+  }
+  for (auto& callback : callbacks) {
+    callback(result);
+  }
+}
+
+void DnsCache::Clear() {
+  for (auto& shard : shards_) {
+    absl::MutexLock l(&shard->mutex);
+    shard->entries.clear();
+    shard->lru.clear();
+  }
+}
+
+size_t DnsCache::size() const {
+  size_t size = 0;
+  for (const auto& shard : shards_) {
+    absl::MutexLock l(&shard->mutex);
+    size += shard->entries.size();
+  }
+  return size;
+}
+
+}  // namespace net
+}  // namespace whisper
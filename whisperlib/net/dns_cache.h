@@ -0,0 +1,125 @@
+#ifndef WHISPERLIB_NET_DNS_CACHE_H_
+#define WHISPERLIB_NET_DNS_CACHE_H_
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+
+namespace whisper {
+namespace net {
+
+class DnsHostInfo;
+
+// A thread safe cache of DNS resolve results, used by the DnsResolver.
+// Both the successful resolves, and the names not found (negative caching)
+// are kept, each for its own time to live - the other errors are not cached. Concurrent resolves of the same name
+// are coalesced: the first one performs the actual resolve, and the others
+// just wait for its result.
+//
+// The entries are split in shards, each with its own mutex, and the least
+// recently used entries are evicted when a shard is full.
+class DnsCache {
+ public:
+  struct Params {
+    // Number of independently locked shards.
+    size_t num_shards = 16;
+    // Maximum number of names kept, across all shards.
+    size_t max_entries = 10000;
+    // How long we keep a successful resolve, when the resolver does not
+    // provide an explicit time to live (e.g. getaddrinfo).
+    absl::Duration positive_ttl = absl::Minutes(1);
+    // How long we keep a resolve failed w/ NotFound.
+    absl::Duration negative_ttl = absl::Seconds(5);
+
+    Params& set_num_shards(size_t value);
+    Params& set_max_entries(size_t value);
+    Params& set_positive_ttl(absl::Duration value);
+    Params& set_negative_ttl(absl::Duration value);
+  };
+  explicit DnsCache(Params params);
+
+  DnsCache(const DnsCache&) = delete;
+  DnsCache& operator=(const DnsCache&) = delete;
+
+  using Result = absl::StatusOr<std::shared_ptr<DnsHostInfo>>;
+  using Callback = std::function<void(Result)>;
+
+  // Returns the cached result for the hostname, if we have a fresh one.
+  absl::optional<Result> Lookup(absl::string_view hostname);
+
+  // If we have a fresh result for the hostname, the callback is called
+  // right away with it, and we return false. Else, the callback is called
+  // when the resolve of the hostname completes, and we return true if the
+  // caller needs to start that resolve (i.e. no other one is in flight).
+  // In that case the caller needs to call Complete() eventually.
+  bool LookupOrWait(absl::string_view hostname, Callback callback);
+
+  // Completes the in flight resolve of the hostname: caches the result, for
+  // ttl if provided, else for the positive / negative ttl of the params,
+  // and calls all the callbacks waiting for it. Errors other than NotFound
+  // are just passed to the callbacks, and not cached.
+  void Complete(absl::string_view hostname, Result result,
+                absl::optional<absl::Duration> ttl = {});
+
+  // Removes all (completed) entries.
+  void Clear();
+  // Number of entries currently in the cache.
+  size_t size() const;
+
+  struct Statistics {
+    // Lookups that found a fresh entry - successful / failed resolve.
+    std::atomic_size_t hits = ATOMIC_VAR_INIT(0);
+    std::atomic_size_t negative_hits = ATOMIC_VAR_INIT(0);
+    // Lookups that needed a new resolve.
+    std::atomic_size_t misses = ATOMIC_VAR_INIT(0);
+    // Lookups that joined a resolve already in flight.
+    std::atomic_size_t coalesced = ATOMIC_VAR_INIT(0);
+    // Entries that were found expired.
+    std::atomic_size_t expirations = ATOMIC_VAR_INIT(0);
+    // Entries evicted for making room to others.
+    std::atomic_size_t evictions = ATOMIC_VAR_INIT(0);
+  };
+  const Statistics& stats() const { return stats_; }
+
+ private:
+  struct Shard {
+    struct Entry {
+      Result result;
+      absl::Time expiration;
+      std::list<std::string>::iterator lru_it;
+    };
+    mutable absl::Mutex mutex;
+    absl::flat_hash_map<std::string, Entry> entries ABSL_GUARDED_BY(mutex);
+    // Keys, from the most to the least recently used.
+    std::list<std::string> lru ABSL_GUARDED_BY(mutex);
+    // Callbacks waiting for the in flight resolves, by hostname.
+    absl::flat_hash_map<std::string, std::vector<Callback>> in_flight
+        ABSL_GUARDED_BY(mutex);
+  };
+  Shard* GetShard(absl::string_view hostname) const;
+  // Returns the fresh entry result for hostname, removing an expired one.
+  absl::optional<Result> LookupLocked(Shard* shard, absl::string_view hostname,
+                                      absl::Time now)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(shard->mutex);
+
+  const Params params_;
+  const size_t max_entries_per_shard_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  Statistics stats_;
+};
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_DNS_CACHE_H_
@@ -0,0 +1,171 @@
+#include "whisperlib/net/dns_cache.h"
+
+#include <thread>
+
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/notification.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "whisperlib/net/dns_resolve.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+std::shared_ptr<DnsHostInfo> HostInfo(absl::string_view hostname,
+                                      uint32_t ip) {
+  auto hi = std::make_shared<DnsHostInfo>(hostname);
+  hi->SetIpAddress({IpAddress(ip)}, {});
+  return hi;
+}
+}  // namespace
+
+TEST(DnsCache, HitsAndExpiration) {
+  DnsCache cache(DnsCache::Params()
+                     .set_positive_ttl(absl::Milliseconds(200))
+                     .set_negative_ttl(absl::Milliseconds(100)));
+  EXPECT_FALSE(cache.Lookup("foo").has_value());
+  std::vector<DnsCache::Result> results;
+  auto callback = [&results](DnsCache::Result result) {
+    results.emplace_back(std::move(result));
+  };
+  EXPECT_TRUE(cache.LookupOrWait("foo", callback));
+  EXPECT_TRUE(results.empty());
+  cache.Complete("foo", HostInfo("foo", 0x7f000001));
+  ASSERT_EQ(results.size(), 1);
+  ASSERT_OK(results.back().status());
+  EXPECT_EQ(results.back().value()->hostname(), "foo");
+  EXPECT_EQ(cache.size(), 1);
+
+  // Served from the cache.
+  EXPECT_FALSE(cache.LookupOrWait("foo", callback));
+  ASSERT_EQ(results.size(), 2);
+  EXPECT_EQ(results[0].value(), results[1].value());
+  EXPECT_EQ(cache.stats().hits.load(), 1);
+  EXPECT_EQ(cache.stats().misses.load(), 1);
+
+  // Failed resolves are cached too, for a shorter time.
+  EXPECT_TRUE(cache.LookupOrWait("bar", callback));
+  cache.Complete("bar", absl::NotFoundError("No bar"));
+  ASSERT_EQ(results.size(), 3);
+  EXPECT_TRUE(absl::IsNotFound(results.back().status()));
+  auto bar = cache.Lookup("bar");
+  ASSERT_TRUE(bar.has_value());
+  EXPECT_TRUE(absl::IsNotFound(bar->status()));
+  EXPECT_EQ(cache.stats().negative_hits.load(), 1);
+
+  absl::SleepFor(absl::Milliseconds(120));
+  EXPECT_FALSE(cache.Lookup("bar").has_value());
+  EXPECT_TRUE(cache.Lookup("foo").has_value());
+  absl::SleepFor(absl::Milliseconds(100));
+  EXPECT_FALSE(cache.Lookup("foo").has_value());
+  EXPECT_EQ(cache.stats().expirations.load(), 2);
+  EXPECT_EQ(cache.size(), 0);
+
+  // An explicit time to live overrides the one from params.
+  cache.Complete("baz", HostInfo("baz", 0x7f000002), absl::Seconds(10));
+  cache.Complete("qux", HostInfo("qux", 0x7f000003), absl::ZeroDuration());
+  EXPECT_TRUE(cache.Lookup("baz").has_value());
+  EXPECT_FALSE(cache.Lookup("qux").has_value());
+  cache.Clear();
+  EXPECT_EQ(cache.size(), 0);
+}
+
+TEST(DnsCache, TransientErrorsNotCached) {
+  DnsCache cache(DnsCache::Params().set_negative_ttl(absl::Seconds(10)));
+  std::vector<DnsCache::Result> results;
+  auto callback = [&results](DnsCache::Result result) {
+    results.emplace_back(std::move(result));
+  };
+  EXPECT_TRUE(cache.LookupOrWait("foo", callback));
+  EXPECT_TRUE(cache.LookupOrWait("bar", callback));
+  cache.Complete("foo", absl::UnavailableError("Name server timeout"));
+  cache.Complete("bar", absl::InternalError("Permanent failure"),
+                 absl::Seconds(10));
+  // The waiting callbacks get the errors, but the next lookup resolves again.
+  ASSERT_EQ(results.size(), 2);
+  EXPECT_TRUE(absl::IsUnavailable(results[0].status()));
+  EXPECT_TRUE(absl::IsInternal(results[1].status()));
+  EXPECT_FALSE(cache.Lookup("foo").has_value());
+  EXPECT_FALSE(cache.Lookup("bar").has_value());
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_TRUE(cache.LookupOrWait("foo", callback));
+  cache.Complete("foo", HostInfo("foo", 0x7f000001));
+  ASSERT_EQ(results.size(), 3);
+  EXPECT_OK(results.back().status());
+  EXPECT_TRUE(cache.Lookup("foo").has_value());
+}
+
+TEST(DnsCache, LruEviction) {
+  DnsCache cache(DnsCache::Params().set_num_shards(1).set_max_entries(3));
+  for (uint32_t i = 0; i < 3; ++i) {
+    const std::string name = absl::StrCat("host", i);
+    cache.Complete(name, HostInfo(name, i));
+  }
+  EXPECT_EQ(cache.size(), 3);
+  // Makes host0 the most recently used, so host1 is evicted next.
+  EXPECT_TRUE(cache.Lookup("host0").has_value());
+  cache.Complete("host3", HostInfo("host3", 3));
+  EXPECT_EQ(cache.size(), 3);
+  EXPECT_EQ(cache.stats().evictions.load(), 1);
+  EXPECT_TRUE(cache.Lookup("host0").has_value());
+  EXPECT_FALSE(cache.Lookup("host1").has_value());
+  EXPECT_TRUE(cache.Lookup("host2").has_value());
+  EXPECT_TRUE(cache.Lookup("host3").has_value());
+}
+
+TEST(DnsCache, Coalescing) {
+  DnsCache cache(DnsCache::Params{});
+  std::atomic_size_t count(0);
+  std::atomic_size_t leaders(0);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < 8; ++i) {
+    threads.emplace_back([&cache, &count, &leaders]() {
+      for (size_t j = 0; j < 100; ++j) {
+        if (cache.LookupOrWait("foo", [&count](DnsCache::Result result) {
+              ASSERT_OK(result.status());
+              count.fetch_add(1);
+            })) {
+          leaders.fetch_add(1);
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(leaders.load(), 1);
+  EXPECT_EQ(cache.stats().coalesced.load(), 799);
+  EXPECT_EQ(count.load(), 0);
+  cache.Complete("foo", HostInfo("foo", 0x7f000001));
+  EXPECT_EQ(count.load(), 800);
+}
+
+TEST(DnsCache, Resolver) {
+  DnsResolver resolver(DnsResolverOptions().set_num_threads(2));
+  ASSERT_TRUE(resolver.cache() != nullptr);
+  // Resolved locally, no network needed.
+  ASSERT_OK_AND_ASSIGN(auto info, resolver.Resolve("localhost"));
+  ASSERT_OK_AND_ASSIGN(auto cached_info, resolver.Resolve("localhost"));
+  EXPECT_EQ(info, cached_info);
+  EXPECT_EQ(resolver.cache()->stats().misses.load(), 1);
+  EXPECT_EQ(resolver.cache()->stats().hits.load(), 1);
+  absl::Notification done;
+  resolver.ResolveAsync(
+      "localhost", [&done, &info](DnsCache::Result result) {
+        ASSERT_OK(result.status());
+        EXPECT_EQ(result.value(), info);
+        done.Notify();
+      });
+  done.WaitForNotification();
+  EXPECT_EQ(resolver.cache()->stats().hits.load(), 2);
+
+  DnsResolver uncached(DnsResolverOptions().set_enable_cache(false));
+  EXPECT_TRUE(uncached.cache() == nullptr);
+  ASSERT_OK_AND_ASSIGN(auto uncached_info, uncached.Resolve("localhost"));
+  EXPECT_NE(info, uncached_info);
+}
+
+}  // namespace net
+}  // namespace whisper
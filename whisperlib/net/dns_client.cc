@@ -0,0 +1,765 @@
+#include "whisperlib/net/dns_client.h"
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "absl/log/check.h"
+#include "absl/log/log.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "whisperlib/io/errno.h"
+#include "whisperlib/io/file.h"
+#include "whisperlib/status/status.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+constexpr uint16_t kDnsPort = 53;
+constexpr uint16_t kClassIN = 1;
+constexpr uint16_t kFlagResponse = 0x8000;
+constexpr uint16_t kFlagTruncated = 0x0200;
+constexpr uint16_t kFlagRecursionDesired = 0x0100;
+constexpr size_t kHeaderSize = 12;
+constexpr size_t kMaxLabelSize = 63;
+constexpr size_t kMaxNameSize = 255;
+// Bounds the compression pointers we follow, against reference loops.
+constexpr size_t kMaxNameJumps = 64;
+// We can receive messages up to the maximum UDP payload.
+constexpr size_t kReceiveBufferSize = 65536;
+// Limits from resolv.conf(5).
+constexpr size_t kMaxNdots = 15;
+constexpr size_t kMaxAttempts = 5;
+constexpr int64_t kMaxTimeoutSeconds = 30;
+
+// Reads big endian values from a DNS message, keeping track of errors.
+class MessageReader {
+ public:
+  explicit MessageReader(absl::string_view packet) : packet_(packet) {}
+
+  size_t pos() const { return pos_; }
+  bool ok() const { return ok_; }
+
+  uint8_t U8() {
+    if (!Check(1)) return 0;
+    return static_cast<uint8_t>(packet_[pos_++]);
+  }
+  uint16_t U16() {
+    const uint16_t hi = U8();
+    return (hi << 8) | U8();
+  }
+  uint32_t U32() {
+    const uint32_t hi = U16();
+    return (hi << 16) | U16();
+  }
+  absl::string_view Bytes(size_t size) {
+    if (!Check(size)) return {};
+    absl::string_view result = packet_.substr(pos_, size);
+    pos_ += size;
+    return result;
+  }
+  // Reads a possibly compressed name, in dotted form, without the final dot.
+  std::string Name() {
+    std::string name;
+    size_t pos = pos_;
+    size_t num_jumps = 0;
+    bool jumped = false;
+    while (ok_) {
+      if (pos >= packet_.size()) {
+        ok_ = false;
+        break;
+      }
+      const uint8_t len = static_cast<uint8_t>(packet_[pos]);
+      if ((len & 0xc0) == 0xc0) {
+        if (pos + 1 >= packet_.size() || ++num_jumps > kMaxNameJumps) {
+          ok_ = false;
+          break;
+        }
+        const size_t target =
+            (size_t(len & 0x3f) << 8) | static_cast<uint8_t>(packet_[pos + 1]);
+        if (!jumped) {
+          pos_ = pos + 2;
+          jumped = true;
+        }
+        pos = target;
+      } else if ((len & 0xc0) != 0) {
+        ok_ = false;  // Reserved label types.
+      } else if (len == 0) {
+        if (!jumped) {
+          pos_ = pos + 1;
+        }
+        break;
+      } else if (pos + 1 + len > packet_.size() ||
+                 name.size() + len + 1 > kMaxNameSize) {
+        ok_ = false;
+      } else {
+        if (!name.empty()) {
+          name.push_back('.');
+        }
+        name.append(packet_.data() + pos + 1, len);
+        pos += 1 + len;
+      }
+    }
+    return name;
+  }
+
+ private:
+  bool Check(size_t size) {
+    if (ok_ && pos_ + size <= packet_.size()) {
+      return true;
+    }
+    ok_ = false;
+    return false;
+  }
+  const absl::string_view packet_;
+  size_t pos_ = 0;
+  bool ok_ = true;
+};
+
+void AppendU16(uint16_t value, std::string* s) {
+  s->push_back(static_cast<char>(value >> 8));
+  s->push_back(static_cast<char>(value & 0xff));
+}
+
+// The name server address, in the family of our socket.
+sockaddr_storage ToSocketFamilyAddr(const HostPort& server, int family) {
+  sockaddr_storage addr = {};
+  const IpAddress& ip = server.ip().value();
+  if (family == AF_INET6) {
+    // IPv4 addresses are in mapped form in IpAddress, as needed here.
+    auto saddr = reinterpret_cast<sockaddr_in6*>(&addr);
+    saddr->sin6_family = AF_INET6;
+    saddr->sin6_port = htons(server.port().value_or(kDnsPort));
+    memcpy(saddr->sin6_addr.s6_addr, ip.ipv6().data(), IpAddress::kIpV6Size);
+  } else {
+    auto saddr = reinterpret_cast<sockaddr_in*>(&addr);
+    saddr->sin_family = AF_INET;
+    saddr->sin_port = htons(server.port().value_or(kDnsPort));
+    saddr->sin_addr.s_addr = htonl(ip.ipv4());
+  }
+  return addr;
+}
+
+bool SameSockAddr(const sockaddr_storage& a, const sockaddr_storage& b) {
+  if (a.ss_family != b.ss_family) {
+    return false;
+  }
+  if (a.ss_family == AF_INET) {
+    auto pa = reinterpret_cast<const sockaddr_in*>(&a);
+    auto pb = reinterpret_cast<const sockaddr_in*>(&b);
+    return pa->sin_port == pb->sin_port &&
+           pa->sin_addr.s_addr == pb->sin_addr.s_addr;
+  }
+  auto pa = reinterpret_cast<const sockaddr_in6*>(&a);
+  auto pb = reinterpret_cast<const sockaddr_in6*>(&b);
+  return pa->sin6_port == pb->sin6_port &&
+         0 == memcmp(pa->sin6_addr.s6_addr, pb->sin6_addr.s6_addr,
+                     sizeof(pa->sin6_addr.s6_addr));
+}
+}  // namespace
+
+DnsClient::Params& DnsClient::Params::set_nameservers(
+    std::vector<HostPort> value) {
+  nameservers = std::move(value);
+  return *this;
+}
+DnsClient::Params& DnsClient::Params::add_nameserver(HostPort value) {
+  nameservers.emplace_back(std::move(value));
+  return *this;
+}
+DnsClient::Params& DnsClient::Params::set_search_domains(
+    std::vector<std::string> value) {
+  search_domains = std::move(value);
+  return *this;
+}
+DnsClient::Params& DnsClient::Params::set_ndots(size_t value) {
+  ndots = value;
+  return *this;
+}
+DnsClient::Params& DnsClient::Params::set_attempt_timeout(
+    absl::Duration value) {
+  attempt_timeout = value;
+  return *this;
+}
+DnsClient::Params& DnsClient::Params::set_attempts(size_t value) {
+  attempts = value;
+  return *this;
+}
+DnsClient::Params& DnsClient::Params::set_rotate(bool value) {
+  rotate = value;
+  return *this;
+}
+DnsClient::Params& DnsClient::Params::set_query_ipv6(bool value) {
+  query_ipv6 = value;
+  return *this;
+}
+DnsClient::Params& DnsClient::Params::set_max_pending_queries(size_t value) {
+  max_pending_queries = value;
+  return *this;
+}
+DnsClient::Params& DnsClient::Params::set_cache(DnsCache* value) {
+  cache = value;
+  return *this;
+}
+
+absl::StatusOr<DnsClient::Params> DnsClient::ParseResolvConf(
+    absl::string_view content) {
+  Params params;
+  for (absl::string_view line : absl::StrSplit(content, '\n')) {
+    line = line.substr(0, line.find_first_of("#;"));
+    std::vector<absl::string_view> tokens =
+        absl::StrSplit(line, absl::ByAnyChar(" \t\r"), absl::SkipEmpty());
+    if (tokens.size() < 2) {
+      continue;
+    }
+    if (tokens[0] == "nameserver") {
+      auto ip = IpAddress::ParseFromString(tokens[1]);
+      if (!ip.ok()) {
+        LOG(WARNING) << "Skipping unsupported name server address in "
+                        "resolv.conf: `"
+                     << tokens[1] << "`: " << ip.status();
+        continue;
+      }
+      params.nameservers.emplace_back(absl::nullopt, ip.value(), kDnsPort);
+    } else if (tokens[0] == "search" || tokens[0] == "domain") {
+      // The last of these two lines wins.
+      params.search_domains.clear();
+      for (size_t i = 1; i < tokens.size(); ++i) {
+        absl::string_view domain = absl::StripSuffix(tokens[i], ".");
+        if (!domain.empty()) {
+          params.search_domains.emplace_back(domain);
+        }
+      }
+    } else if (tokens[0] == "options") {
+      for (size_t i = 1; i < tokens.size(); ++i) {
+        std::pair<absl::string_view, absl::string_view> option =
+            absl::StrSplit(tokens[i], absl::MaxSplits(':', 1));
+        int64_t value = 0;
+        if (option.first == "rotate") {
+          params.rotate = true;
+        } else if (!absl::SimpleAtoi(option.second, &value) || value < 0) {
+          continue;  // Options we do not support, or invalid values.
+        } else if (option.first == "ndots") {
+          params.ndots = std::min<size_t>(value, kMaxNdots);
+        } else if (option.first == "attempts") {
+          params.attempts = std::max<size_t>(
+              1, std::min<size_t>(value, kMaxAttempts));
+        } else if (option.first == "timeout") {
+          params.attempt_timeout = absl::Seconds(
+              std::max<int64_t>(1, std::min(value, kMaxTimeoutSeconds)));
+        }
+      }
+    }
+  }
+  if (params.nameservers.empty()) {
+    // As the libc resolver does, we use the local name server.
+    params.nameservers.emplace_back(absl::nullopt, IpAddress::kIPv4Localhost,
+                                    kDnsPort);
+  }
+  return params;
+}
+
+absl::StatusOr<DnsClient::Params> DnsClient::ParamsFromResolvConf(
+    absl::string_view path) {
+  ASSIGN_OR_RETURN(auto content, io::File::ReadAsString(path),
+                   _ << "Reading the DNS resolver configuration");
+  return ParseResolvConf(content);
+}
+
+absl::StatusOr<std::string> DnsClient::EncodeQuery(uint16_t id,
+                                                   absl::string_view name,
+                                                   uint16_t type) {
+  name = absl::StripSuffix(name, ".");
+  if (name.empty() || name.size() + 2 > kMaxNameSize) {
+    return status::InvalidArgumentErrorBuilder()
+           << "Invalid size for a DNS name: `" << name << "`";
+  }
+  std::string packet;
+  packet.reserve(kHeaderSize + name.size() + 6);
+  AppendU16(id, &packet);
+  AppendU16(kFlagRecursionDesired, &packet);
+  AppendU16(1, &packet);  // One question, no other records.
+  AppendU16(0, &packet);
+  AppendU16(0, &packet);
+  AppendU16(0, &packet);
+  for (absl::string_view label : absl::StrSplit(name, '.')) {
+    if (label.empty() || label.size() > kMaxLabelSize) {
+      return status::InvalidArgumentErrorBuilder()
+             << "Invalid label in DNS name: `" << name << "`";
+    }
+    packet.push_back(static_cast<char>(label.size()));
+    packet.append(label.data(), label.size());
+  }
+  packet.push_back('\0');
+  AppendU16(type, &packet);
+  AppendU16(kClassIN, &packet);
+  return packet;
+}
+
+absl::StatusOr<DnsClient::Message> DnsClient::ParseMessage(
+    absl::string_view packet) {
+  MessageReader reader(packet);
+  Message message;
+  message.id = reader.U16();
+  const uint16_t flags = reader.U16();
+  message.is_response = (flags & kFlagResponse) != 0;
+  message.truncated = (flags & kFlagTruncated) != 0;
+  message.rcode = flags & 0x0f;
+  const uint16_t num_questions = reader.U16();
+  const uint16_t num_answers = reader.U16();
+  reader.U16();  // authority records
+  reader.U16();  // additional records
+  for (uint16_t i = 0; i < num_questions && reader.ok(); ++i) {
+    std::string name = reader.Name();
+    const uint16_t type = reader.U16();
+    reader.U16();  // class
+    if (i == 0) {
+      message.question_name = std::move(name);
+      message.question_type = type;
+    }
+  }
+  for (uint16_t i = 0; i < num_answers && reader.ok(); ++i) {
+    reader.Name();
+    const uint16_t type = reader.U16();
+    const uint16_t rclass = reader.U16();
+    const uint32_t ttl = reader.U32();
+    const uint16_t size = reader.U16();
+    absl::string_view data = reader.Bytes(size);
+    if (!reader.ok() || rclass != kClassIN) {
+      continue;
+    }
+    if (type == kTypeA && size == 4) {
+      message.addresses.emplace_back(
+          IpAddress((uint32_t(uint8_t(data[0])) << 24) |
+                    (uint32_t(uint8_t(data[1])) << 16) |
+                    (uint32_t(uint8_t(data[2])) << 8) | uint8_t(data[3])));
+    } else if (type == kTypeAAAA && size == IpAddress::kIpV6Size) {
+      IpAddress::IpArray addr;
+      memcpy(addr.data(), data.data(), addr.size());
+      message.addresses.emplace_back(IpAddress(addr));
+    } else {
+      continue;  // CNAME records & co - we use just the final addresses.
+    }
+    // Time to live is a 31 bit value - larger ones mean zero.
+    const absl::Duration record_ttl =
+        absl::Seconds(ttl > 0x7fffffff ? 0 : ttl);
+    message.ttl = message.ttl.has_value() ? std::min(*message.ttl, record_ttl)
+                                          : record_ttl;
+  }
+  if (!reader.ok()) {
+    return status::DataLossErrorBuilder()
+           << "Invalid DNS message, of size: " << packet.size();
+  }
+  return message;
+}
+
+absl::StatusOr<std::unique_ptr<DnsClient>> DnsClient::Create(
+    Selector* selector, Params params) {
+  auto client = absl::WrapUnique(new DnsClient(selector, std::move(params)));
+  RETURN_IF_ERROR(client->Initialize());
+  return client;
+}
+
+DnsClient::DnsClient(Selector* selector, Params params)
+    : Selectable(selector),
+      dns_selector_(selector),
+      params_(std::move(params)),
+      receive_buffer_(new char[kReceiveBufferSize]) {}
+
+DnsClient::~DnsClient() { InternalClose(absl::CancelledError()); }
+
+absl::Status DnsClient::Initialize() {
+  RET_CHECK(dns_selector_ != nullptr);
+  RET_CHECK(!params_.nameservers.empty()) << "No DNS name servers provided.";
+  RET_CHECK(params_.attempts > 0);
+  RET_CHECK(params_.attempt_timeout > absl::ZeroDuration());
+  // A dual stack IPv6 socket, only if we need to reach IPv6 servers.
+  int family = AF_INET;
+  for (const auto& server : params_.nameservers) {
+    RET_CHECK(server.ip().has_value())
+        << "DNS name server with no IP address: " << server.ToString();
+    if (server.ip()->is_ipv6()) {
+      family = AF_INET6;
+    }
+  }
+  for (const auto& server : params_.nameservers) {
+    server_addrs_.emplace_back(ToSocketFamilyAddr(server, family));
+  }
+  const int fd = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::socket failed for the DNS client.";
+  }
+  fd_ = fd;
+  if (family == AF_INET6) {
+    const int off = 0;
+    if (::setsockopt(fd_, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0) {
+      const absl::Status status = error::ErrnoToStatus(error::Errno())
+                                  << "Enabling dual stack DNS client socket.";
+      InternalClose(status);
+      return status;
+    }
+  }
+  const absl::Status status = dns_selector_->Register(this);
+  if (!status.ok()) {
+    InternalClose(status);
+    return status::Annotate(status, "Registering the DNS client.");
+  }
+  return absl::OkStatus();
+}
+
+int DnsClient::GetFd() const { return fd_; }
+
+void DnsClient::Close() { InternalClose(absl::CancelledError()); }
+
+void DnsClient::InternalClose(const absl::Status& status) {
+  if (fd_ != kInvalidFdValue) {
+    if (selector() != nullptr) {
+      LOG_IF_ERROR(WARNING, selector()->Unregister(this))
+          << "Unregistering the DNS client.";
+    }
+    if (::close(fd_) < 0) {
+      LOG(WARNING) << "::close failed for the DNS client: "
+                   << error::ErrnoToString(error::Errno());
+    }
+    fd_ = kInvalidFdValue;
+  }
+  for (const auto& it : queries_) {
+    dns_selector_->UnregisterAlarm(it.second->alarm_id);
+  }
+  queries_.clear();
+  // Callbacks may start new resolves, that fail right away.
+  auto lookups = std::move(lookups_);
+  lookups_.clear();
+  for (auto& it : lookups) {
+    FinishLookup(std::move(it.second),
+                 status::Annotate(status, "DNS client closed"), {});
+  }
+}
+
+void DnsClient::Resolve(absl::string_view hostname, Callback callback) {
+  if (!dns_selector_->IsInSelectThread()) {
+    dns_selector_->RunInSelectLoop(
+        [this, name = std::string(hostname),
+         callback = std::move(callback)]() mutable {
+          ResolveInSelectLoop(std::move(name), std::move(callback));
+        });
+    return;
+  }
+  ResolveInSelectLoop(std::string(hostname), std::move(callback));
+}
+
+void DnsClient::ResolveInSelectLoop(std::string hostname, Callback callback) {
+  stats_.resolves.fetch_add(1);
+  auto info = std::make_shared<DnsHostInfo>(hostname);
+  auto ip = IpAddress::ParseFromString(hostname);
+  if (ip.ok()) {
+    if (ip->is_ipv4()) {
+      info->SetIpAddress({ip.value()}, {});
+    } else {
+      info->SetIpAddress({}, {ip.value()});
+    }
+    callback(std::move(info));
+    return;
+  }
+  auto resolve_name = info->GetDnsResolveName();
+  if (!resolve_name.ok()) {
+    stats_.resolve_errors.fetch_add(1);
+    callback(status::Annotate(
+        resolve_name.status(),
+        absl::StrCat("Obtaining DNS resolve name for `", hostname, "`")));
+    return;
+  }
+  if (params_.cache != nullptr &&
+      !params_.cache->LookupOrWait(hostname, std::move(callback))) {
+    return;  // Cached, or waiting for a resolve in flight.
+  }
+  // With a cache, the callback waits there, for the completion of the lookup.
+  auto lookup = absl::make_unique<Lookup>();
+  lookup->hostname = std::move(hostname);
+  lookup->callback = std::move(callback);
+  const size_t num_queries = params_.query_ipv6 ? 2 : 1;
+  if (fd_ == kInvalidFdValue ||
+      queries_.size() + num_queries > params_.max_pending_queries) {
+    FinishLookup(std::move(lookup),
+                 status::ResourceExhaustedErrorBuilder()
+                     << (fd_ == kInvalidFdValue
+                             ? "DNS client is closed"
+                             : "Too many DNS queries in flight"),
+                 {});
+    return;
+  }
+  lookup->names = CandidateNames(resolve_name.value());
+  const uint64_t lookup_id = next_lookup_id_++;
+  lookups_.emplace(lookup_id, std::move(lookup));
+  StartQueries(lookup_id);
+}
+
+std::vector<std::string> DnsClient::CandidateNames(
+    const std::string& hostname) const {
+  if (absl::EndsWith(hostname, ".")) {
+    return {std::string(absl::StripSuffix(hostname, "."))};
+  }
+  if (params_.search_domains.empty()) {
+    return {hostname};
+  }
+  std::vector<std::string> names;
+  const size_t num_dots = std::count(hostname.begin(), hostname.end(), '.');
+  if (num_dots >= params_.ndots) {
+    names.emplace_back(hostname);
+  }
+  for (const auto& domain : params_.search_domains) {
+    names.emplace_back(absl::StrCat(hostname, ".", domain));
+  }
+  if (num_dots < params_.ndots) {
+    names.emplace_back(hostname);
+  }
+  return names;
+}
+
+void DnsClient::StartQueries(uint64_t lookup_id) {
+  Lookup* const lookup = lookups_[lookup_id].get();
+  std::vector<uint16_t> types = {kTypeA};
+  if (params_.query_ipv6) {
+    types.push_back(kTypeAAAA);
+  }
+  const std::string& name = lookup->names[lookup->name_index];
+  std::vector<uint16_t> query_ids;
+  for (const uint16_t type : types) {
+    // Random ids, as a defense against spoofed responses.
+    uint16_t id;
+    do {
+      id = absl::Uniform<uint16_t>(id_generator_);
+    } while (queries_.contains(id));
+    auto packet = EncodeQuery(id, name, type);
+    if (!packet.ok()) {
+      CompleteLookup(lookup_id,
+                     status::Annotate(packet.status(),
+                                      absl::StrCat("Resolving: `",
+                                                   lookup->hostname, "`")),
+                     {});
+      for (const uint16_t query_id : query_ids) {
+        queries_.erase(query_id);
+      }
+      return;
+    }
+    auto query = absl::make_unique<Query>();
+    query->lookup_id = lookup_id;
+    query->type = type;
+    query->name = name;
+    query->packet = std::move(packet).value();
+    query->first_server = params_.rotate ? next_server_++ : 0;
+    queries_.emplace(id, std::move(query));
+    query_ids.push_back(id);
+  }
+  lookup->pending_queries = query_ids.size();
+  for (const uint16_t query_id : query_ids) {
+    SendQuery(query_id);
+  }
+}
+
+void DnsClient::SendQuery(uint16_t query_id) {
+  Query* const query = queries_[query_id].get();
+  const sockaddr_storage& addr =
+      server_addrs_[(query->first_server + query->num_sent) %
+                    server_addrs_.size()];
+  if (query->num_sent > 0) {
+    stats_.retries.fetch_add(1);
+  }
+  ++query->num_sent;
+  stats_.queries_sent.fetch_add(1);
+  const socklen_t addr_len = addr.ss_family == AF_INET
+                                 ? sizeof(sockaddr_in)
+                                 : sizeof(sockaddr_in6);
+  if (::sendto(fd_, query->packet.data(), query->packet.size(), 0,
+               reinterpret_cast<const sockaddr*>(&addr), addr_len) < 0) {
+    // Handled as a lost packet, i.e. by the timeout below.
+    LOG_EVERY_N(WARNING, 100)
+        << "::sendto failed for DNS query: "
+        << error::ErrnoToString(error::Errno());
+  }
+  const uint64_t serial = next_serial_++;
+  query->serial = serial;
+  query->alarm_id = dns_selector_->RegisterAlarm(
+      [this, query_id, serial]() { HandleQueryTimeout(query_id, serial); },
+      params_.attempt_timeout);
+}
+
+void DnsClient::HandleQueryTimeout(uint16_t query_id, uint64_t serial) {
+  auto it = queries_.find(query_id);
+  if (it == queries_.end() || it->second->serial != serial) {
+    return;  // answered, or sent again in the meantime.
+  }
+  if (it->second->num_sent < params_.attempts * server_addrs_.size()) {
+    SendQuery(query_id);
+    return;
+  }
+  stats_.timeouts.fetch_add(1);
+  CompleteQuery(query_id, status::DeadlineExceededErrorBuilder()
+                              << "Timeout waiting for DNS name servers, "
+                                 "for: `"
+                              << it->second->name << "`");
+}
+
+bool DnsClient::HandleReadEvent(SelectorEventData event) {
+  CHECK(dns_selector_->IsInSelectThread());
+  // Bounded, so we do not starve the other selectables.
+  for (size_t i = 0; i < 64 && fd_ != kInvalidFdValue; ++i) {
+    sockaddr_storage from = {};
+    socklen_t from_len = sizeof(from);
+    const ssize_t cb =
+        ::recvfrom(fd_, receive_buffer_.get(), kReceiveBufferSize, 0,
+                   reinterpret_cast<sockaddr*>(&from), &from_len);
+    if (cb < 0) {
+      const int err = error::Errno();
+      LOG_IF(WARNING, err != EAGAIN && err != EWOULDBLOCK)
+          << "::recvfrom failed for the DNS client: "
+          << error::ErrnoToString(err);
+      break;
+    }
+    HandleResponse(from, absl::string_view(receive_buffer_.get(), cb));
+  }
+  return true;
+}
+
+bool DnsClient::HandleErrorEvent(SelectorEventData event) {
+  // E.g. ICMP errors for previous queries - the timeouts deal with these.
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (::getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err != 0) {
+    LOG_EVERY_N(WARNING, 100)
+        << "Error on the DNS client socket: " << error::ErrnoToString(err);
+  }
+  return true;
+}
+
+void DnsClient::HandleResponse(const sockaddr_storage& from,
+                               absl::string_view packet) {
+  auto message = ParseMessage(packet);
+  if (!message.ok() || !message->is_response) {
+    stats_.invalid_responses.fetch_add(1);
+    return;
+  }
+  auto it = queries_.find(message->id);
+  if (it == queries_.end() ||
+      !absl::EqualsIgnoreCase(message->question_name, it->second->name) ||
+      message->question_type != it->second->type ||
+      std::none_of(server_addrs_.begin(), server_addrs_.end(),
+                   [&from](const sockaddr_storage& addr) {
+                     return SameSockAddr(addr, from);
+                   })) {
+    stats_.invalid_responses.fetch_add(1);
+    return;
+  }
+  stats_.responses.fetch_add(1);
+  if (message->rcode != kRcodeNoError && message->rcode != kRcodeNameError &&
+      it->second->num_sent < params_.attempts * server_addrs_.size()) {
+    // Server failure & co. - we ask the next server in line.
+    dns_selector_->UnregisterAlarm(it->second->alarm_id);
+    SendQuery(message->id);
+    return;
+  }
+  CompleteQuery(message->id, std::move(message));
+}
+
+void DnsClient::CompleteQuery(uint16_t query_id,
+                              absl::StatusOr<Message> result) {
+  auto it = queries_.find(query_id);
+  CHECK(it != queries_.end());
+  const std::unique_ptr<Query> query = std::move(it->second);
+  queries_.erase(it);
+  dns_selector_->UnregisterAlarm(query->alarm_id);
+  auto lookup_it = lookups_.find(query->lookup_id);
+  CHECK(lookup_it != lookups_.end());
+  Lookup* const lookup = lookup_it->second.get();
+  --lookup->pending_queries;
+
+  absl::Status status;
+  if (!result.ok()) {
+    status = std::move(result).status();
+  } else if (result->rcode == kRcodeNoError && !result->addresses.empty()) {
+    for (const auto& ip : result->addresses) {
+      (ip.is_ipv4() ? lookup->ipv4 : lookup->ipv6).push_back(ip);
+    }
+    if (result->ttl.has_value()) {
+      lookup->ttl = lookup->ttl.has_value()
+                        ? std::min(*lookup->ttl, *result->ttl)
+                        : *result->ttl;
+    }
+  } else if (result->rcode == kRcodeNoError ||
+             result->rcode == kRcodeNameError) {
+    status = status::NotFoundErrorBuilder()
+             << "No DNS records found for: `" << query->name << "`";
+    if (result->truncated) {
+      status = status::UnavailableErrorBuilder()
+               << "Truncated DNS response, with no records, for: `"
+               << query->name << "`";
+    }
+  } else {
+    status = status::UnavailableErrorBuilder()
+             << "DNS name servers failed, with response code "
+             << int(result->rcode) << ", for: `" << query->name << "`";
+  }
+  // Not found is the least relevant error, as we may search other names.
+  if (!status.ok() &&
+      (lookup->status.ok() || absl::IsNotFound(lookup->status))) {
+    lookup->status = std::move(status);
+  }
+  if (lookup->pending_queries > 0) {
+    return;
+  }
+  if (!lookup->ipv4.empty() || !lookup->ipv6.empty()) {
+    auto info = std::make_shared<DnsHostInfo>(lookup->hostname);
+    info->SetIpAddress(std::move(lookup->ipv4), std::move(lookup->ipv6));
+    CompleteLookup(query->lookup_id, std::move(info), lookup->ttl);
+    return;
+  }
+  if (lookup->name_index + 1 < lookup->names.size()) {
+    ++lookup->name_index;
+    StartQueries(query->lookup_id);
+    return;
+  }
+  CompleteLookup(query->lookup_id, lookup->status, {});
+}
+
+void DnsClient::CompleteLookup(uint64_t lookup_id, Result result,
+                               absl::optional<absl::Duration> ttl) {
+  auto it = lookups_.find(lookup_id);
+  CHECK(it != lookups_.end());
+  std::unique_ptr<Lookup> lookup = std::move(it->second);
+  lookups_.erase(it);
+  FinishLookup(std::move(lookup), std::move(result), ttl);
+}
+
+void DnsClient::FinishLookup(std::unique_ptr<Lookup> lookup, Result result,
+                             absl::optional<absl::Duration> ttl) {
+  if (!result.ok()) {
+    stats_.resolve_errors.fetch_add(1);
+    result = status::Annotate(
+        result.status(),
+        absl::StrCat("DNS resolving: `", lookup->hostname, "`"));
+    // Only the names that do not exist are cached, not the transient errors.
+    if (!absl::IsNotFound(result.status())) {
+      ttl = absl::ZeroDuration();
+    }
+  }
+  if (params_.cache != nullptr) {
+    params_.cache->Complete(lookup->hostname, std::move(result), ttl);
+  } else {
+    lookup->callback(std::move(result));
+  }
+}
+
+}  // namespace net
+}  // namespace whisper
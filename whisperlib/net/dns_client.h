@@ -0,0 +1,232 @@
+#ifndef WHISPERLIB_NET_DNS_CLIENT_H_
+#define WHISPERLIB_NET_DNS_CLIENT_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "whisperlib/net/address.h"
+#include "whisperlib/net/dns_cache.h"
+#include "whisperlib/net/dns_resolve.h"
+#include "whisperlib/net/selectable.h"
+#include "whisperlib/net/selector.h"
+
+namespace whisper {
+namespace net {
+
+// An asynchronous DNS client, that queries the name servers over UDP for
+// the A and AAAA records of host names. It runs as a Selectable in the
+// provided selector, completing the resolves in its loop, and needs no
+// threads of its own - as opposed to DnsResolver, that blocks its threads
+// in ::getaddrinfo.
+//
+// The name servers, search domains and the resolve options are usually
+// read from /etc/resolv.conf (see ParamsFromResolvConf()). Host names are
+// resolved only by DNS - e.g. /etc/hosts is not consulted. Truncated
+// responses are not retried over TCP, we use the records they contain.
+//
+// Usage example:
+//   ASSIGN_OR_RETURN(auto params, DnsClient::ParamsFromResolvConf());
+//   ASSIGN_OR_RETURN(auto client, DnsClient::Create(selector, params));
+//   client->Resolve("www.example.com", [](DnsClient::Result result) {
+//     ... called in the selector loop ...
+//   });
+//
+class DnsClient : private Selectable {
+ public:
+  struct Params {
+    // The name servers that we query - with port, usually 53.
+    std::vector<HostPort> nameservers;
+    // Domains appended to the names to resolve, in this order (see ndots).
+    std::vector<std::string> search_domains;
+    // Names with fewer dots than this are first tried with the search
+    // domains appended, and only after that as they are. The others are
+    // tried first as they are. Names ending in a dot are never searched.
+    size_t ndots = 1;
+    // How long we wait for a response to a query, before retrying.
+    absl::Duration attempt_timeout = absl::Seconds(5);
+    // How many times we try each name server, for a query.
+    size_t attempts = 2;
+    // Each query starts with the next name server, instead of the first.
+    bool rotate = false;
+    // If we query for the IPv6 (AAAA) addresses too.
+    bool query_ipv6 = true;
+    // Maximum number of queries in flight - new resolves fail when reached.
+    size_t max_pending_queries = 4096;
+    // If set, we cache the results here, with the time to live of the
+    // received records. Not owned, and needs to outlive the client.
+    DnsCache* cache = nullptr;
+
+    Params& set_nameservers(std::vector<HostPort> value);
+    Params& add_nameserver(HostPort value);
+    Params& set_search_domains(std::vector<std::string> value);
+    Params& set_ndots(size_t value);
+    Params& set_attempt_timeout(absl::Duration value);
+    Params& set_attempts(size_t value);
+    Params& set_rotate(bool value);
+    Params& set_query_ipv6(bool value);
+    Params& set_max_pending_queries(size_t value);
+    Params& set_cache(DnsCache* value);
+  };
+
+  // Parses the resolv.conf(5) content: nameserver, search, domain and
+  // options (ndots, timeout, attempts and rotate) lines.
+  static absl::StatusOr<Params> ParseResolvConf(absl::string_view content);
+  // Reads and parses the provided resolv.conf file.
+  static absl::StatusOr<Params> ParamsFromResolvConf(
+      absl::string_view path = "/etc/resolv.conf");
+
+  // Creates a client that runs in the provided selector. Should be called
+  // from the selector thread, or with the selector stopped.
+  static absl::StatusOr<std::unique_ptr<DnsClient>> Create(Selector* selector,
+                                                           Params params);
+  // Should be destroyed in the selector thread, or with the selector stopped.
+  ~DnsClient();
+
+  using Result = absl::StatusOr<std::shared_ptr<DnsHostInfo>>;
+  using Callback = DnsResolver::DnsCallback;
+
+  // Resolves the provided host name, and calls the callback with the result
+  // in the selector loop. The callback may be called before returning, if
+  // the result is already available (e.g. cached, or an IP address).
+  // NOTE: safe to call from any thread.
+  void Resolve(absl::string_view hostname, Callback callback);
+
+  // Closes the socket, failing all the resolves in progress.
+  // Should be called from the selector thread.
+  void Close() override;
+
+  struct Statistics {
+    // Resolves requested, and how many of them failed.
+    std::atomic_size_t resolves = ATOMIC_VAR_INIT(0);
+    std::atomic_size_t resolve_errors = ATOMIC_VAR_INIT(0);
+    // Query packets sent to the name servers, including retries.
+    std::atomic_size_t queries_sent = ATOMIC_VAR_INIT(0);
+    // Queries sent again, after a timeout or a server failure.
+    std::atomic_size_t retries = ATOMIC_VAR_INIT(0);
+    // Queries that received no response, after all attempts.
+    std::atomic_size_t timeouts = ATOMIC_VAR_INIT(0);
+    // Responses accepted for an in flight query.
+    std::atomic_size_t responses = ATOMIC_VAR_INIT(0);
+    // Received packets that are not valid responses to our queries.
+    std::atomic_size_t invalid_responses = ATOMIC_VAR_INIT(0);
+  };
+  const Statistics& stats() const { return stats_; }
+
+  // DNS message helpers - exposed mainly for testing.
+  static constexpr uint16_t kTypeA = 1;
+  static constexpr uint16_t kTypeAAAA = 28;
+  static constexpr uint16_t kTypeCNAME = 5;
+  // Response codes we deal with.
+  static constexpr uint8_t kRcodeNoError = 0;
+  static constexpr uint8_t kRcodeNameError = 3;
+
+  // Encodes a recursive query for name and type (A or AAAA).
+  static absl::StatusOr<std::string> EncodeQuery(uint16_t id,
+                                                 absl::string_view name,
+                                                 uint16_t type);
+  struct Message {
+    uint16_t id = 0;
+    bool is_response = false;
+    bool truncated = false;
+    uint8_t rcode = 0;
+    // The first question in the message.
+    std::string question_name;
+    uint16_t question_type = 0;
+    // The addresses in the A / AAAA answer records, and the minimum time to
+    // live amongst these.
+    std::vector<IpAddress> addresses;
+    absl::optional<absl::Duration> ttl;
+  };
+  // Parses a DNS message.
+  static absl::StatusOr<Message> ParseMessage(absl::string_view packet);
+
+ private:
+  DnsClient(Selector* selector, Params params);
+  absl::Status Initialize();
+
+  ////////// Selectable interface - called from the selector thread.
+  bool HandleReadEvent(SelectorEventData event) override;
+  bool HandleErrorEvent(SelectorEventData event) override;
+  int GetFd() const override;
+
+  // A resolve in progress - tries each candidate name in order, until one
+  // resolves to some addresses.
+  struct Lookup {
+    std::string hostname;
+    // Null when we have a cache - the callbacks wait in there.
+    Callback callback;
+    // The names to query for, with the search domains applied.
+    std::vector<std::string> names;
+    size_t name_index = 0;
+    // Queries in flight, for the current name.
+    size_t pending_queries = 0;
+    std::vector<IpAddress> ipv4;
+    std::vector<IpAddress> ipv6;
+    absl::optional<absl::Duration> ttl;
+    // The most relevant error for the current name, if any.
+    absl::Status status;
+  };
+  // A query for one record type of a name, to the name servers.
+  struct Query {
+    uint64_t lookup_id = 0;
+    uint16_t type = 0;
+    std::string name;
+    std::string packet;
+    // Each (re)transmission has its serial, for matching the timeout alarms.
+    uint64_t serial = 0;
+    size_t first_server = 0;
+    size_t num_sent = 0;
+    Selector::AlarmId alarm_id = 0;
+  };
+
+  void ResolveInSelectLoop(std::string hostname, Callback callback);
+  // Builds the names to query for hostname, according to the search rules.
+  std::vector<std::string> CandidateNames(const std::string& hostname) const;
+  // Starts the queries for the current name of the lookup.
+  void StartQueries(uint64_t lookup_id);
+  // Sends (again) the query, to its next name server.
+  void SendQuery(uint16_t query_id);
+  void HandleQueryTimeout(uint16_t query_id, uint64_t serial);
+  void HandleResponse(const sockaddr_storage& from, absl::string_view packet);
+  // Marks a query done, with the provided result, and advances its lookup.
+  void CompleteQuery(uint16_t query_id, absl::StatusOr<Message> result);
+  // Completes the lookup in progress, calling its callback.
+  void CompleteLookup(uint64_t lookup_id, Result result,
+                      absl::optional<absl::Duration> ttl);
+  // Calls the lookup callback, or completes it in the cache, if we have one.
+  void FinishLookup(std::unique_ptr<Lookup> lookup, Result result,
+                    absl::optional<absl::Duration> ttl);
+  void InternalClose(const absl::Status& status);
+
+  // Where we run - Selectable::selector() is reset upon unregistration.
+  Selector* const dns_selector_;
+  const Params params_;
+  int fd_ = kInvalidFdValue;
+  // Socket address of the name servers, in the socket family.
+  std::vector<sockaddr_storage> server_addrs_;
+  size_t next_server_ = 0;
+
+  absl::flat_hash_map<uint64_t, std::unique_ptr<Lookup>> lookups_;
+  uint64_t next_lookup_id_ = 1;
+  absl::flat_hash_map<uint16_t, std::unique_ptr<Query>> queries_;
+  uint64_t next_serial_ = 1;
+  absl::BitGen id_generator_;
+  std::unique_ptr<char[]> receive_buffer_;
+
+  Statistics stats_;
+};
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_DNS_CLIENT_H_
@@ -0,0 +1,525 @@
+#include "whisperlib/net/dns_client.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <thread>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "whisperlib/net/connection.h"
+#include "whisperlib/net/testing_util.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+// The answer of the fake server to a query: nullopt for no response, else
+// the response code and the addresses from the answer records.
+struct Answer {
+  uint8_t rcode = DnsClient::kRcodeNoError;
+  std::vector<IpAddress> addresses;
+  uint32_t ttl = 300;
+};
+using AnswerFunction =
+    std::function<absl::optional<Answer>(const DnsClient::Message& query)>;
+
+// Builds a response to the query packet, in the way the servers do.
+std::string BuildResponse(absl::string_view query, const Answer& answer) {
+  std::string response(query);
+  response[2] = static_cast<char>(0x81);  // QR & RD
+  response[3] = static_cast<char>(0x80 | answer.rcode);  // RA & rcode
+  response[6] = static_cast<char>(answer.addresses.size() >> 8);
+  response[7] = static_cast<char>(answer.addresses.size() & 0xff);
+  for (const auto& ip : answer.addresses) {
+    response.append("\xc0\x0c", 2);  // pointer to the question name
+    response.push_back('\0');
+    response.push_back(ip.is_ipv4() ? DnsClient::kTypeA
+                                    : DnsClient::kTypeAAAA);
+    response.append("\x00\x01", 2);
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      response.push_back(static_cast<char>((answer.ttl >> shift) & 0xff));
+    }
+    if (ip.is_ipv4()) {
+      response.append("\x00\x04", 2);
+      response.append(reinterpret_cast<const char*>(ip.ipv6().data()) + 12, 4);
+    } else {
+      response.append("\x00\x10", 2);
+      response.append(reinterpret_cast<const char*>(ip.ipv6().data()), 16);
+    }
+  }
+  return response;
+}
+
+// A name server on a local UDP port, answering from a side thread.
+class FakeDnsServer {
+ public:
+  explicit FakeDnsServer(AnswerFunction answer_function)
+      : answer_function_(std::move(answer_function)) {
+    fd_ = ::socket(AF_INET, SOCK_DGRAM, 0);
+    CHECK_GE(fd_, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK_EQ(::bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)),
+             0);
+    socklen_t len = sizeof(addr);
+    CHECK_EQ(::getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len), 0);
+    port_ = ntohs(addr.sin_port);
+    struct timeval tv = {0, 20000};
+    CHECK_EQ(::setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)), 0);
+    thread_ = std::thread(&FakeDnsServer::Run, this);
+  }
+  ~FakeDnsServer() {
+    done_.Notify();
+    thread_.join();
+    ::close(fd_);
+  }
+
+  HostPort address() const {
+    return HostPort(absl::nullopt, IpAddress::kIPv4Localhost, port_);
+  }
+  std::vector<std::string> queried_names() const {
+    absl::MutexLock l(&mutex_);
+    return queried_names_;
+  }
+
+ private:
+  void Run() {
+    char buffer[1024];
+    while (!done_.HasBeenNotified()) {
+      struct sockaddr_storage from;
+      socklen_t from_len = sizeof(from);
+      const ssize_t cb = ::recvfrom(fd_, buffer, sizeof(buffer), 0,
+                                    reinterpret_cast<sockaddr*>(&from),
+                                    &from_len);
+      if (cb <= 0) {
+        continue;
+      }
+      const absl::string_view query(buffer, cb);
+      auto message = DnsClient::ParseMessage(query);
+      if (!message.ok()) {
+        continue;
+      }
+      {
+        absl::MutexLock l(&mutex_);
+        queried_names_.push_back(
+            absl::StrCat(message->question_name, "/",
+                         message->question_type == DnsClient::kTypeA
+                             ? "A"
+                             : "AAAA"));
+      }
+      auto answer = answer_function_(message.value());
+      if (answer.has_value()) {
+        const std::string response = BuildResponse(query, answer.value());
+        ::sendto(fd_, response.data(), response.size(), 0,
+                 reinterpret_cast<sockaddr*>(&from), from_len);
+      }
+    }
+  }
+
+  const AnswerFunction answer_function_;
+  int fd_ = -1;
+  uint16_t port_ = 0;
+  std::thread thread_;
+  absl::Notification done_;
+  mutable absl::Mutex mutex_;
+  std::vector<std::string> queried_names_ ABSL_GUARDED_BY(mutex_);
+};
+
+const IpAddress kIpV4(0x0a000001);
+const IpAddress kIpV6 = IpAddress::ParseFromString("2001:db8::1").value();
+
+// Answers with kIpV4 and kIpV6 for `name`, and no such name for the others.
+AnswerFunction AnswerFor(absl::string_view name) {
+  return [name = std::string(name)](const DnsClient::Message& query) {
+    Answer answer;
+    if (query.question_name != name) {
+      answer.rcode = DnsClient::kRcodeNameError;
+    } else {
+      answer.addresses.push_back(
+          query.question_type == DnsClient::kTypeA ? kIpV4 : kIpV6);
+    }
+    return absl::make_optional(answer);
+  };
+}
+
+// Resolves the hostname with the client in the thread, and waits for it.
+DnsClient::Result ResolveAndWait(DnsClient* client,
+                                 absl::string_view hostname) {
+  absl::Notification done;
+  DnsClient::Result result;
+  client->Resolve(hostname, [&done, &result](DnsClient::Result r) {
+    result = std::move(r);
+    done.Notify();
+  });
+  done.WaitForNotification();
+  return result;
+}
+}  // namespace
+
+TEST(DnsClient, Messages) {
+  ASSERT_OK_AND_ASSIGN(auto query, DnsClient::EncodeQuery(
+                                       0x1234, "www.Example.com.",
+                                       DnsClient::kTypeAAAA));
+  ASSERT_OK_AND_ASSIGN(auto message, DnsClient::ParseMessage(query));
+  EXPECT_EQ(message.id, 0x1234);
+  EXPECT_FALSE(message.is_response);
+  EXPECT_EQ(message.question_name, "www.Example.com");
+  EXPECT_EQ(message.question_type, DnsClient::kTypeAAAA);
+  EXPECT_TRUE(message.addresses.empty());
+
+  Answer answer;
+  answer.addresses = {kIpV6, kIpV4};
+  answer.ttl = 30;
+  const std::string response = BuildResponse(query, answer);
+  ASSERT_OK_AND_ASSIGN(message, DnsClient::ParseMessage(response));
+  EXPECT_TRUE(message.is_response);
+  EXPECT_EQ(message.rcode, DnsClient::kRcodeNoError);
+  EXPECT_EQ(message.question_name, "www.Example.com");
+  EXPECT_THAT(message.addresses, ::testing::ElementsAre(kIpV6, kIpV4));
+  EXPECT_EQ(message.ttl, absl::Seconds(30));
+
+  // Truncated messages, and compression pointer loops are rejected.
+  for (size_t size = 0; size < response.size(); size += 7) {
+    EXPECT_FALSE(DnsClient::ParseMessage(response.substr(0, size)).ok());
+  }
+  std::string loop = query;
+  loop[12] = static_cast<char>(0xc0);
+  loop[13] = 12;
+  EXPECT_FALSE(DnsClient::ParseMessage(loop).ok());
+
+  EXPECT_FALSE(DnsClient::EncodeQuery(1, "", DnsClient::kTypeA).ok());
+  EXPECT_FALSE(DnsClient::EncodeQuery(1, "a..b", DnsClient::kTypeA).ok());
+  EXPECT_FALSE(DnsClient::EncodeQuery(1, std::string(64, 'a'),
+                                      DnsClient::kTypeA)
+                   .ok());
+}
+
+TEST(DnsClient, ParseResolvConf) {
+  ASSERT_OK_AND_ASSIGN(auto params, DnsClient::ParseResolvConf(R"(
+# Generated
+nameserver 10.0.0.2
+nameserver 2001:db8::53  ; comment
+nameserver fe80::1%eth0
+domain foo.com
+search corp.example.com. example.com
+options ndots:2 timeout:3 attempts:10 rotate edns0
+)"));
+  ASSERT_EQ(params.nameservers.size(), 2);
+  EXPECT_EQ(params.nameservers[0].ip().value(), IpAddress(0x0a000002));
+  EXPECT_EQ(params.nameservers[0].port().value(), 53);
+  EXPECT_EQ(params.nameservers[1].ip().value().ToString(), "2001:db8::53");
+  EXPECT_THAT(params.search_domains,
+              ::testing::ElementsAre("corp.example.com", "example.com"));
+  EXPECT_EQ(params.ndots, 2);
+  EXPECT_EQ(params.attempt_timeout, absl::Seconds(3));
+  EXPECT_EQ(params.attempts, 5);
+  EXPECT_TRUE(params.rotate);
+
+  ASSERT_OK_AND_ASSIGN(params, DnsClient::ParseResolvConf(""));
+  ASSERT_EQ(params.nameservers.size(), 1);
+  EXPECT_EQ(params.nameservers[0].ip().value(), IpAddress::kIPv4Localhost);
+  EXPECT_TRUE(params.search_domains.empty());
+  EXPECT_EQ(params.ndots, 1);
+}
+
+TEST(DnsClient, Resolve) {
+  FakeDnsServer server(AnswerFor("host.test"));
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  ASSERT_OK_AND_ASSIGN(
+      auto client,
+      DnsClient::Create(thread->selector(),
+                        DnsClient::Params().add_nameserver(server.address())));
+  thread->Start();
+
+  ASSERT_OK_AND_ASSIGN(auto info, ResolveAndWait(client.get(), "host.test"));
+  EXPECT_EQ(info->hostname(), "host.test");
+  EXPECT_THAT(info->ipv4(), ::testing::ElementsAre(kIpV4));
+  EXPECT_THAT(info->ipv6(), ::testing::ElementsAre(kIpV6));
+  EXPECT_EQ(client->stats().queries_sent.load(), 2);
+  EXPECT_EQ(client->stats().responses.load(), 2);
+
+  auto result = ResolveAndWait(client.get(), "other.test");
+  EXPECT_TRUE(absl::IsNotFound(result.status())) << result.status();
+
+  // The addresses are returned right away.
+  ASSERT_OK_AND_ASSIGN(info, ResolveAndWait(client.get(), "10.1.2.3"));
+  EXPECT_THAT(info->ipv4(), ::testing::ElementsAre(IpAddress(0x0a010203)));
+  EXPECT_EQ(client->stats().queries_sent.load(), 4);
+  EXPECT_EQ(client->stats().resolves.load(), 3);
+  EXPECT_EQ(client->stats().resolve_errors.load(), 1);
+
+  RunAndWait(thread.get(), [&client]() { client.reset(); });
+  thread->Stop();
+}
+
+TEST(DnsClient, SearchDomains) {
+  FakeDnsServer server(AnswerFor("host.corp.test"));
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  ASSERT_OK_AND_ASSIGN(
+      auto client,
+      DnsClient::Create(thread->selector(),
+                        DnsClient::Params()
+                            .add_nameserver(server.address())
+                            .set_search_domains({"test", "corp.test"})
+                            .set_query_ipv6(false)));
+  thread->Start();
+  // Fewer dots than ndots: the search domains first.
+  ASSERT_OK_AND_ASSIGN(auto info, ResolveAndWait(client.get(), "host"));
+  EXPECT_EQ(info->hostname(), "host");
+  EXPECT_THAT(info->ipv4(), ::testing::ElementsAre(kIpV4));
+  EXPECT_THAT(server.queried_names(),
+              ::testing::ElementsAre("host.test/A", "host.corp.test/A"));
+  // Enough dots: first as is, then the search domains.
+  ASSERT_OK_AND_ASSIGN(info, ResolveAndWait(client.get(), "host.corp"));
+  EXPECT_THAT(server.queried_names(),
+              ::testing::ElementsAre("host.test/A", "host.corp.test/A",
+                                     "host.corp/A", "host.corp.test/A"));
+  // Absolute names are not searched.
+  auto result = ResolveAndWait(client.get(), "host.");
+  EXPECT_TRUE(absl::IsNotFound(result.status())) << result.status();
+  EXPECT_EQ(server.queried_names().back(), "host/A");
+
+  RunAndWait(thread.get(), [&client]() { client.reset(); });
+  thread->Stop();
+}
+
+TEST(DnsClient, RetriesAndTimeouts) {
+  // Drops the first attempt of each query.
+  absl::Mutex mutex;
+  absl::flat_hash_map<uint16_t, size_t> attempts;
+  bool drop_all = false;
+  FakeDnsServer server([&](const DnsClient::Message& query) {
+    absl::MutexLock l(&mutex);
+    if (drop_all || attempts[query.id]++ == 0) {
+      return absl::optional<Answer>();
+    }
+    return AnswerFor("host.test")(query);
+  });
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  ASSERT_OK_AND_ASSIGN(
+      auto client,
+      DnsClient::Create(thread->selector(),
+                        DnsClient::Params()
+                            .add_nameserver(server.address())
+                            .set_attempt_timeout(absl::Milliseconds(100))
+                            .set_attempts(3)));
+  thread->Start();
+  ASSERT_OK_AND_ASSIGN(auto info, ResolveAndWait(client.get(), "host.test"));
+  EXPECT_THAT(info->ipv4(), ::testing::ElementsAre(kIpV4));
+  EXPECT_EQ(client->stats().retries.load(), 2);
+  EXPECT_EQ(client->stats().queries_sent.load(), 4);
+
+  {
+    absl::MutexLock l(&mutex);
+    drop_all = true;
+  }
+  const absl::Time start = absl::Now();
+  auto result = ResolveAndWait(client.get(), "host.test");
+  EXPECT_TRUE(absl::IsDeadlineExceeded(result.status())) << result.status();
+  EXPECT_GE(absl::Now() - start, absl::Milliseconds(300));
+  EXPECT_EQ(client->stats().timeouts.load(), 2);
+  EXPECT_EQ(client->stats().queries_sent.load(), 10);
+
+  // Pending resolves fail when closing.
+  absl::Notification done;
+  RunAndWait(thread.get(), [&]() {
+    client->Resolve("host.test", [&done](DnsClient::Result result) {
+      EXPECT_TRUE(absl::IsCancelled(result.status())) << result.status();
+      done.Notify();
+    });
+    client->Close();
+  });
+  EXPECT_TRUE(done.HasBeenNotified());
+  RunAndWait(thread.get(), [&client]() { client.reset(); });
+  thread->Stop();
+}
+
+TEST(DnsClient, CacheWithRecordTtl) {
+  FakeDnsServer server([](const DnsClient::Message& query) {
+    auto answer = AnswerFor("host.test")(query);
+    answer->ttl = query.question_type == DnsClient::kTypeA ? 1 : 100;
+    return answer;
+  });
+  DnsCache cache(DnsCache::Params().set_positive_ttl(absl::Hours(1)));
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  ASSERT_OK_AND_ASSIGN(
+      auto client,
+      DnsClient::Create(thread->selector(),
+                        DnsClient::Params()
+                            .add_nameserver(server.address())
+                            .set_cache(&cache)));
+  thread->Start();
+  ASSERT_OK_AND_ASSIGN(auto info, ResolveAndWait(client.get(), "host.test"));
+  ASSERT_OK_AND_ASSIGN(auto cached_info,
+                       ResolveAndWait(client.get(), "host.test"));
+  EXPECT_EQ(info, cached_info);
+  EXPECT_EQ(client->stats().queries_sent.load(), 2);
+  EXPECT_EQ(cache.stats().hits.load(), 1);
+  // Expires with the smallest time to live of the records.
+  absl::SleepFor(absl::Milliseconds(1100));
+  EXPECT_FALSE(cache.Lookup("host.test").has_value());
+  ASSERT_OK_AND_ASSIGN(info, ResolveAndWait(client.get(), "host.test"));
+  EXPECT_EQ(client->stats().queries_sent.load(), 4);
+
+  RunAndWait(thread.get(), [&client]() { client.reset(); });
+  thread->Stop();
+}
+
+TEST(DnsClient, TcpConnect) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  TcpAcceptor acceptor(thread->selector(), TcpAcceptorParams());
+  std::unique_ptr<Connection> server_connection;
+  acceptor.set_accept_handler([&](std::unique_ptr<Connection> c) {
+    server_connection = std::move(c);
+  });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  FakeDnsServer server([](const DnsClient::Message& query) {
+    Answer answer;
+    if (query.question_type == DnsClient::kTypeA) {
+      answer.addresses.push_back(IpAddress::kIPv4Localhost);
+    }
+    return absl::make_optional(answer);
+  });
+  std::unique_ptr<DnsClient> client;
+  RunAndWait(thread.get(), [&]() {
+    ASSERT_OK_AND_ASSIGN(
+        client,
+        DnsClient::Create(
+            thread->selector(),
+            DnsClient::Params().add_nameserver(server.address())));
+  });
+  TcpConnection connection(thread->selector(),
+                           TcpConnectionParams().set_dns_client(client.get()));
+  absl::Notification connected;
+  connection.set_connect_handler([&connected]() { connected.Notify(); });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(connection.Connect(
+        HostPort("server.test", absl::nullopt,
+                 acceptor.local_address().port().value())));
+  });
+  ASSERT_TRUE(connected.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_EQ(connection.GetRemoteAddress().ip().value(),
+              IpAddress::kIPv4Localhost);
+    connection.ForceClose();
+    if (server_connection) {
+      server_connection->ForceClose();
+      server_connection.reset();
+    }
+    acceptor.Close();
+    client.reset();
+  });
+  thread->Stop();
+}
+
+TEST(DnsClient, HappyEyeballsConnect) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  TcpAcceptor acceptor(thread->selector(), TcpAcceptorParams());
+  std::unique_ptr<Connection> server_connection;
+  acceptor.set_accept_handler([&](std::unique_ptr<Connection> c) {
+    server_connection = std::move(c);
+  });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  const uint16_t port = acceptor.local_address().port().value();
+  // The connect attempts are faked, per address: the IPv6 one fails right
+  // away, the first IPv4 one never completes, and only the local one
+  // actually connects.
+  const IpAddress kBlackHole(0xc0000201);  // 192.0.2.1
+  int hanging_pipe[2];
+  ASSERT_EQ(::pipe(hanging_pipe), 0);
+  std::vector<IpAddress> attempted;
+  auto connect_attempt =
+      [&](const HostPort& address) -> absl::StatusOr<int> {
+    attempted.push_back(address.ip().value());
+    if (address.ip().value() == kIpV6) {
+      return absl::UnavailableError("Network unreachable.");
+    }
+    if (address.ip().value() == kBlackHole) {
+      // Never writable.
+      return ::dup(hanging_pipe[0]);
+    }
+    struct sockaddr_storage addr;
+    RETURN_IF_ERROR(address.ToSockAddr(&addr));
+    const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+      return absl::InternalError("::socket failed.");
+    }
+    if (::connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                  sizeof(struct sockaddr_in)) < 0 &&
+        errno != EINPROGRESS) {
+      ::close(fd);
+      return absl::InternalError("::connect failed.");
+    }
+    return fd;
+  };
+
+  FakeDnsServer server([&](const DnsClient::Message& query) {
+    Answer answer;
+    if (query.question_type == DnsClient::kTypeA) {
+      answer.addresses = {kBlackHole, IpAddress::kIPv4Localhost};
+    } else {
+      answer.addresses = {kIpV6};
+    }
+    return absl::make_optional(answer);
+  });
+  std::unique_ptr<DnsClient> client;
+  RunAndWait(thread.get(), [&]() {
+    ASSERT_OK_AND_ASSIGN(
+        client,
+        DnsClient::Create(
+            thread->selector(),
+            DnsClient::Params().add_nameserver(server.address())));
+  });
+  TcpConnection connection(
+      thread->selector(),
+      TcpConnectionParams()
+          .set_dns_client(client.get())
+          .set_happy_eyeballs(true)
+          .set_connection_attempt_delay(absl::Milliseconds(100))
+          .set_connect_attempt_function(connect_attempt));
+  absl::Notification connected;
+  connection.set_connect_handler([&connected]() { connected.Notify(); });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(connection.Connect(HostPort("server.test", absl::nullopt, port)));
+  });
+  ASSERT_TRUE(connected.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  RunAndWait(thread.get(), [&]() {
+    // IPv6 first, then the hanging IPv4, then the one that works.
+    EXPECT_THAT(attempted,
+                ::testing::ElementsAre(kIpV6, kBlackHole,
+                                       IpAddress::kIPv4Localhost));
+    EXPECT_EQ(connection.GetRemoteAddress().ip().value(),
+              IpAddress::kIPv4Localhost);
+    EXPECT_EQ(connection.connect_attempts(), 3);
+    connection.ForceClose();
+    if (server_connection) {
+      server_connection->ForceClose();
+      server_connection.reset();
+    }
+    acceptor.Close();
+    client.reset();
+  });
+  thread->Stop();
+  ::close(hanging_pipe[0]);
+  ::close(hanging_pipe[1]);
+}
+
+}  // namespace net
+}  // namespace whisper
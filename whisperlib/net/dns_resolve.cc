@@ -7,8 +7,10 @@
 #include <algorithm>
 
 #include "absl/container/flat_hash_set.h"
+#include "absl/synchronization/notification.h"
 #include "unicode/errorcode.h"
 #include "unicode/idna.h"
+#include "whisperlib/base/call_on_return.h"
 #include "whisperlib/io/errno.h"
 #include "whisperlib/status/status.h"
 
@@ -134,6 +136,15 @@ DnsResolverOptions& DnsResolverOptions::set_put_timeout(absl::Duration value) {
   put_timeout = value;
   return *this;
 }
+DnsResolverOptions& DnsResolverOptions::set_enable_cache(bool value) {
+  enable_cache = value;
+  return *this;
+}
+DnsResolverOptions& DnsResolverOptions::set_cache_params(
+    DnsCache::Params value) {
+  cache_params = std::move(value);
+  return *this;
+}
 
 DnsResolver& DnsResolver::Default() {
   static DnsResolver* kResolver = new DnsResolver(DnsResolverOptions());
@@ -144,14 +155,20 @@ DnsResolver::DnsResolver(const DnsResolverOptions& options)
     : options_(options) {
   CHECK_GT(options_.num_threads, 0UL);
   CHECK_GT(options_.queue_size, 0UL);
-  threads_.reserve(options_.num_threads);
+  if (options_.enable_cache) {
+    cache_ = absl::make_unique<DnsCache>(options_.cache_params);
+  }
+  // The queues need to be all in place before the threads start using them.
   resolves_.reserve(options_.num_threads);
   for (size_t i = 0; i < options_.num_threads; ++i) {
-    threads_.emplace_back(
-        absl::make_unique<std::thread>(&DnsResolver::RunResolve, this, i));
     resolves_.emplace_back(
         absl::make_unique<ResolveQueue>(options_.queue_size));
   }
+  threads_.reserve(options_.num_threads);
+  for (size_t i = 0; i < options_.num_threads; ++i) {
+    threads_.emplace_back(
+        absl::make_unique<std::thread>(&DnsResolver::RunResolve, this, i));
+  }
 }
 DnsResolver::~DnsResolver() {
   for (const auto& queue : resolves_) {
@@ -168,16 +185,36 @@ void DnsResolver::RunResolve(size_t index) {
     if (req.first.empty() && req.second == nullptr) {
       break;
     }
-    req.second(Resolve(req.first));
+    req.second(ResolveUncached(req.first));
   }
 }
 
 void DnsResolver::ResolveAsync(absl::string_view hostname,
                                DnsCallback callback) {
+  if (cache_) {
+    if (!cache_->LookupOrWait(hostname, std::move(callback))) {
+      return;  // cached, or waiting for a resolve in flight.
+    }
+    // The callback waits in the cache, for our resolve to complete.
+    callback = [this, name = std::string(hostname)](
+                   absl::StatusOr<std::shared_ptr<DnsHostInfo>> result) {
+      cache_->Complete(name, std::move(result));
+    };
+  }
   const size_t index = resolve_index_.fetch_add(1) % resolves_.size();
-  if (!resolves_[index]->Put(std::make_pair(std::string(hostname), callback),
-                             options_.put_timeout)) {
-    callback(absl::InternalError("Asynchronous resolve queue is full."));
+  // Put() returns the request back when the queue stays full.
+  if (resolves_[index]
+          ->Put(std::make_pair(std::string(hostname), callback),
+                options_.put_timeout)
+          .has_value()) {
+    const absl::Status status =
+        absl::InternalError("Asynchronous resolve queue is full.");
+    if (cache_) {
+      // Just notify the waiters, without caching this error.
+      cache_->Complete(hostname, status, absl::ZeroDuration());
+    } else {
+      callback(status);
+    }
   }
 }
 
@@ -231,6 +268,25 @@ status::StatusWriter AddrInfoToStatus(int err) {
 
 absl::StatusOr<std::shared_ptr<DnsHostInfo>> DnsResolver::Resolve(
     absl::string_view hostname) {
+  if (!cache_) {
+    return ResolveUncached(hostname);
+  }
+  absl::Notification done;
+  absl::StatusOr<std::shared_ptr<DnsHostInfo>> result;
+  if (cache_->LookupOrWait(
+          hostname,
+          [&done, &result](absl::StatusOr<std::shared_ptr<DnsHostInfo>> r) {
+            result = std::move(r);
+            done.Notify();
+          })) {
+    cache_->Complete(hostname, ResolveUncached(hostname));
+  }
+  done.WaitForNotification();
+  return result;
+}
+
+absl::StatusOr<std::shared_ptr<DnsHostInfo>> DnsResolver::ResolveUncached(
+    absl::string_view hostname) {
   auto hi = std::make_shared<DnsHostInfo>(hostname);
   struct addrinfo* result = nullptr;
   ASSIGN_OR_RETURN(auto resolve_name, hi->GetDnsResolveName(),
@@ -240,6 +296,7 @@ absl::StatusOr<std::shared_ptr<DnsHostInfo>> DnsResolver::Resolve(
   if (err != 0) {
     return AddrInfoToStatus(err) << " DNS Resolving: `" << hostname << "`";
   }
+  base::CallOnReturn free_result([result]() { ::freeaddrinfo(result); });
   absl::flat_hash_set<IpAddress> ipv4, ipv6;
   for (struct addrinfo* res = result; res != nullptr; res = res->ai_next) {
     auto ss = reinterpret_cast<const struct sockaddr_storage*>(res->ai_addr);
@@ -11,6 +11,7 @@
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
 #include "whisperlib/net/address.h"
+#include "whisperlib/net/dns_cache.h"
 #include "whisperlib/sync/producer_consumer_queue.h"
 
 namespace whisper {
@@ -78,14 +79,23 @@ struct DnsResolverOptions {
   size_t queue_size = 100;
   // Duration for waiting on 'put' operation on the resolve queue, else fail.
   absl::Duration put_timeout = absl::Milliseconds(1);
+  // If we cache the resolve results (see DnsCache), and coalesce the
+  // concurrent resolves of the same host name.
+  bool enable_cache = true;
+  // Parameters for the resolve cache, when enabled.
+  DnsCache::Params cache_params;
 
   DnsResolverOptions& set_num_threads(size_t value);
   DnsResolverOptions& set_queue_size(size_t value);
   DnsResolverOptions& set_put_timeout(absl::Duration value);
+  DnsResolverOptions& set_enable_cache(bool value);
+  DnsResolverOptions& set_cache_params(DnsCache::Params value);
 };
 
 // DNS resolver object. Internally uses getaddrinfo.
-// The resolves are not cached.
+// The resolves are cached, unless disabled in options. As getaddrinfo does
+// not provide the time to live of the records, these are kept for the
+// durations configured in the cache parameters.
 class DnsResolver {
  public:
   DnsResolver(const DnsResolverOptions& options);
@@ -97,17 +107,25 @@ class DnsResolver {
   // Resolves a host name, returns the resolve information or error status.
   absl::StatusOr<std::shared_ptr<DnsHostInfo>> Resolve(
       absl::string_view hostname);
+  // Same as above, but always performs the resolve, bypassing the cache.
+  absl::StatusOr<std::shared_ptr<DnsHostInfo>> ResolveUncached(
+      absl::string_view hostname);
 
   // Resolves a host name asynchronously, and calls the provided callback
-  // upon completion.
+  // upon completion - from a resolver thread, or right away, from this call,
+  // when the cache has a fresh result.
   using DnsCallback =
       std::function<void(absl::StatusOr<std::shared_ptr<DnsHostInfo>>)>;
   void ResolveAsync(absl::string_view hostname, DnsCallback callback);
 
+  // The resolve cache - null if not enabled.
+  DnsCache* cache() const { return cache_.get(); }
+
  protected:
   void RunResolve(size_t index);
 
   DnsResolverOptions options_;
+  std::unique_ptr<DnsCache> cache_;
   std::vector<std::unique_ptr<std::thread>> threads_;
   using ResolveQueue =
       synch::ProducerConsumerQueue<std::pair<std::string, DnsCallback>>;
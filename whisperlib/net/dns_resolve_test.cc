@@ -148,5 +148,29 @@ TEST(DnsResolver, ResolveAsync) {
   EXPECT_EQ(count.load(), 30);
 }
 
+TEST(DnsResolver, ResolveAsyncCachedOnce) {
+  // localhost resolves w/ no network (from /etc/hosts).
+  static constexpr size_t kNumResolves = 10;
+  std::atomic_size_t num_calls(0);
+  std::atomic_size_t num_ok(0);
+  {
+    DnsResolver resolver(DnsResolverOptions().set_enable_cache(true));
+    for (size_t i = 0; i < kNumResolves; ++i) {
+      resolver.ResolveAsync(
+          "localhost",
+          [&num_calls,
+           &num_ok](absl::StatusOr<std::shared_ptr<DnsHostInfo>> result) {
+            num_calls.fetch_add(1);
+            if (result.ok() && result.value()->IsValid()) {
+              num_ok.fetch_add(1);
+            }
+          });
+    }
+    // The resolver threads finish the resolves before stopping.
+  }
+  EXPECT_EQ(num_calls.load(), kNumResolves);
+  EXPECT_EQ(num_ok.load(), kNumResolves);
+}
+
 }  // namespace net
 }  // namespace whisper
@@ -0,0 +1,207 @@
+#include "whisperlib/net/framed_connection.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "absl/log/check.h"
+#include "whisperlib/status/status.h"
+
+namespace whisper {
+namespace net {
+
+FramedConnection::Params& FramedConnection::Params::set_length_prefix(
+    LengthPrefix value) {
+  length_prefix = value;
+  return *this;
+}
+FramedConnection::Params& FramedConnection::Params::set_max_frame_size(
+    size_t value) {
+  max_frame_size = value;
+  return *this;
+}
+
+FramedConnection::FramedConnection(Connection* connection, Params params)
+    : connection_(connection), params_(std::move(params)) {
+  connection_->set_read_handler([this]() { return HandleRead(); });
+}
+
+FramedConnection::~FramedConnection() {
+  CHECK_EQ(batch_depth_, 0) << "FramedConnection deleted while in a batch.";
+  connection_->clear_read_handler();
+}
+
+FramedConnection& FramedConnection::set_frame_handler(FrameHandler handler) {
+  frame_handler_ = std::move(handler);
+  return *this;
+}
+
+void FramedConnection::AppendLengthPrefix(LengthPrefix length_prefix,
+                                          uint64_t size, absl::Cord* out) {
+  char buffer[kMaxPrefixSize];
+  size_t prefix_size = 0;
+  switch (length_prefix) {
+    case LengthPrefix::FIXED32:
+      buffer[0] = static_cast<char>(size >> 24);
+      buffer[1] = static_cast<char>(size >> 16);
+      buffer[2] = static_cast<char>(size >> 8);
+      buffer[3] = static_cast<char>(size);
+      prefix_size = 4;
+      break;
+    case LengthPrefix::VARINT:
+      while (size >= 0x80) {
+        buffer[prefix_size++] = static_cast<char>((size & 0x7f) | 0x80);
+        size >>= 7;
+      }
+      buffer[prefix_size++] = static_cast<char>(size);
+      break;
+  }
+  out->Append(absl::string_view(buffer, prefix_size));
+}
+
+absl::Status FramedConnection::WriteFrame(absl::Cord frame) {
+  if (ABSL_PREDICT_FALSE(frame.size() > params_.max_frame_size ||
+                         (params_.length_prefix == LengthPrefix::FIXED32 &&
+                          frame.size() > 0xffffffffULL))) {
+    return status::InvalidArgumentErrorBuilder()
+           << "Frame of " << frame.size() << " bytes is over the limit of "
+           << params_.max_frame_size << " bytes.";
+  }
+  AppendLengthPrefix(params_.length_prefix, frame.size(), &batch_);
+  batch_.Append(std::move(frame));
+  ++num_frames_written_;
+  if (batch_depth_ == 0) {
+    FlushBatch();
+  }
+  return absl::OkStatus();
+}
+
+absl::Status FramedConnection::WriteFrame(absl::string_view frame) {
+  return WriteFrame(absl::Cord(frame));
+}
+
+absl::Status FramedConnection::WriteFrames(
+    absl::Span<const absl::Cord> frames) {
+  BeginBatch();
+  absl::Status status;
+  for (const auto& frame : frames) {
+    status = WriteFrame(frame);
+    if (!status.ok()) {
+      break;
+    }
+  }
+  EndBatch();
+  return status;
+}
+
+void FramedConnection::BeginBatch() { ++batch_depth_; }
+
+void FramedConnection::EndBatch() {
+  CHECK_GT(batch_depth_, 0) << "EndBatch() w/o a matching BeginBatch().";
+  if (--batch_depth_ == 0) {
+    FlushBatch();
+  }
+}
+
+void FramedConnection::FlushBatch() {
+  if (!batch_.empty()) {
+    connection_->Write(std::move(batch_));
+    batch_.Clear();
+  }
+}
+
+absl::StatusOr<bool> FramedConnection::ReadLengthPrefix() {
+  absl::Cord* const inbuf = connection_->inbuf();
+  const size_t max_size =
+      params_.length_prefix == LengthPrefix::FIXED32 ? 4 : kMaxPrefixSize;
+  // The prefix may span multiple chunks of the input.
+  uint8_t buffer[kMaxPrefixSize];
+  size_t available = 0;
+  for (absl::string_view chunk : inbuf->Chunks()) {
+    const size_t size = std::min(chunk.size(), max_size - available);
+    memcpy(buffer + available, chunk.data(), size);
+    available += size;
+    if (available == max_size) {
+      break;
+    }
+  }
+  uint64_t frame_size = 0;
+  size_t prefix_size = 0;
+  switch (params_.length_prefix) {
+    case LengthPrefix::FIXED32:
+      if (available < 4) {
+        return false;
+      }
+      frame_size = (uint64_t(buffer[0]) << 24) | (uint64_t(buffer[1]) << 16) |
+                   (uint64_t(buffer[2]) << 8) | uint64_t(buffer[3]);
+      prefix_size = 4;
+      break;
+    case LengthPrefix::VARINT:
+      while (true) {
+        if (prefix_size == available) {
+          if (available == kMaxPrefixSize) {
+            return status::DataLossErrorBuilder()
+                   << "Invalid varint frame length prefix.";
+          }
+          return false;
+        }
+        const uint8_t b = buffer[prefix_size];
+        frame_size |= uint64_t(b & 0x7f) << (7 * prefix_size);
+        ++prefix_size;
+        if ((b & 0x80) == 0) {
+          break;
+        }
+      }
+      break;
+  }
+  if (ABSL_PREDICT_FALSE(frame_size > params_.max_frame_size)) {
+    return status::ResourceExhaustedErrorBuilder()
+           << "Received frame of " << frame_size
+           << " bytes is over the limit of " << params_.max_frame_size
+           << " bytes.";
+  }
+  inbuf->RemovePrefix(prefix_size);
+  next_frame_size_ = frame_size;
+  return true;
+}
+
+absl::Status FramedConnection::HandleRead() {
+  RET_CHECK(frame_handler_ != nullptr)
+      << "No frame handler set for connection: " << connection_->ToString();
+  absl::Cord* const inbuf = connection_->inbuf();
+  absl::Status status;
+  // The frames written by the handler for all the frames received here are
+  // written to the connection together.
+  BeginBatch();
+  while (status.ok()) {
+    if (!next_frame_size_.has_value()) {
+      auto result = ReadLengthPrefix();
+      if (!result.ok()) {
+        status = std::move(result).status();
+        break;
+      }
+      if (!result.value()) {
+        break;
+      }
+    }
+    const size_t frame_size = next_frame_size_.value();
+    if (inbuf->size() < frame_size) {
+      break;
+    }
+    absl::Cord frame;
+    if (inbuf->size() == frame_size) {
+      std::swap(frame, *inbuf);
+    } else {
+      frame = inbuf->Subcord(0, frame_size);
+      inbuf->RemovePrefix(frame_size);
+    }
+    next_frame_size_.reset();
+    ++num_frames_read_;
+    status = frame_handler_(std::move(frame));
+  }
+  EndBatch();
+  return status;
+}
+
+}  // namespace net
+}  // namespace whisper
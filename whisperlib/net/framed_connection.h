@@ -0,0 +1,120 @@
+#ifndef WHISPERLIB_NET_FRAMED_CONNECTION_H_
+#define WHISPERLIB_NET_FRAMED_CONNECTION_H_
+
+#include <cstdint>
+#include <functional>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/cord.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "whisperlib/net/connection.h"
+
+namespace whisper {
+namespace net {
+
+// Sends and receives messages (frames) on a connection, each prefixed by
+// its length - either as a fixed 4 byte (big endian) integer, or as a
+// varint (little endian base 128, as in protocol buffers).
+//
+// The complete frames received are passed to the frame handler as cords
+// that share the memory of the connection input buffer (no copy).
+// The frames written while handling the received ones, or between
+// BeginBatch() / EndBatch(), are gathered and appended to the connection
+// output in one Write().
+//
+// Takes over the read handler of the connection, which needs to outlive
+// this object. Use it only from the selector thread of the connection.
+//
+// Usage example:
+//   FramedConnection framed(connection, FramedConnection::Params());
+//   framed.set_frame_handler([&framed](absl::Cord frame) {
+//     return framed.WriteFrame(ProcessRequest(frame));
+//   });
+class FramedConnection {
+ public:
+  enum class LengthPrefix {
+    // 4 bytes, in network byte order.
+    FIXED32,
+    // 1 to 10 bytes, 7 bits each, least significant first.
+    VARINT,
+  };
+  // Maximum size of the length prefix.
+  static constexpr size_t kMaxPrefixSize = 10;
+
+  struct Params {
+    // How the frame length is encoded.
+    LengthPrefix length_prefix = LengthPrefix::FIXED32;
+    // Frames larger than this are rejected as errors - for both reading and
+    // writing. At most 4GiB - 1 for FIXED32.
+    size_t max_frame_size = 16 << 20;
+
+    Params& set_length_prefix(LengthPrefix value);
+    Params& set_max_frame_size(size_t value);
+  };
+
+  // Receives the complete frames read from the connection. An error status
+  // closes the connection. Should not delete this object - do that from
+  // the close handler of the connection, or later in the select loop.
+  using FrameHandler = std::function<absl::Status(absl::Cord frame)>;
+
+  FramedConnection(Connection* connection, Params params);
+  // Clears the read handler of the connection.
+  ~FramedConnection();
+
+  FramedConnection(const FramedConnection&) = delete;
+  FramedConnection& operator=(const FramedConnection&) = delete;
+
+  FramedConnection& set_frame_handler(FrameHandler handler);
+
+  // Writes a frame to the connection - or adds it to the current batch.
+  // Returns an error for frames over the max_frame_size.
+  absl::Status WriteFrame(absl::Cord frame);
+  absl::Status WriteFrame(absl::string_view frame);
+  // Writes the frames in one batch.
+  absl::Status WriteFrames(absl::Span<const absl::Cord> frames);
+
+  // While in a batch, the frames written are only gathered, and are
+  // written to the connection on the matching EndBatch(). The calls
+  // can be nested.
+  void BeginBatch();
+  void EndBatch();
+
+  // Appends the encoding of the frame length to out.
+  static void AppendLengthPrefix(LengthPrefix length_prefix, uint64_t size,
+                                 absl::Cord* out);
+
+  Connection* connection() const { return connection_; }
+  const Params& params() const { return params_; }
+  // Number of frames received / written so far.
+  size_t num_frames_read() const { return num_frames_read_; }
+  size_t num_frames_written() const { return num_frames_written_; }
+
+ private:
+  // The read handler of the connection.
+  absl::Status HandleRead();
+  // Parses and removes the length prefix at the start of the connection
+  // input into next_frame_size_. Returns false if more data is needed.
+  absl::StatusOr<bool> ReadLengthPrefix();
+  // Writes the gathered frames to the connection.
+  void FlushBatch();
+
+  Connection* const connection_;
+  const Params params_;
+  FrameHandler frame_handler_ = nullptr;
+  // Size of the frame being received, if we got its length prefix.
+  absl::optional<uint64_t> next_frame_size_;
+  // The frames written in the current batch, w/ their length prefixes.
+  absl::Cord batch_;
+  // Number of BeginBatch() calls not matched yet by EndBatch().
+  size_t batch_depth_ = 0;
+  size_t num_frames_read_ = 0;
+  size_t num_frames_written_ = 0;
+};
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_FRAMED_CONNECTION_H_
@@ -0,0 +1,161 @@
+#include "whisperlib/net/framed_connection.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/notification.h"
+#include "gtest/gtest.h"
+#include "whisperlib/net/testing_util.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+std::string Frame(FramedConnection::LengthPrefix length_prefix,
+                  absl::string_view data) {
+  absl::Cord frame;
+  FramedConnection::AppendLengthPrefix(length_prefix, data.size(), &frame);
+  frame.Append(data);
+  return std::string(frame);
+}
+
+// Reads from fd until we get size bytes, or the end of the stream.
+std::string ReceiveAtMost(int fd, size_t size) {
+  std::string received;
+  char buffer[4096];
+  while (received.size() < size) {
+    const ssize_t cb = ::recv(fd, buffer, sizeof(buffer), 0);
+    if (cb <= 0) {
+      break;
+    }
+    received.append(buffer, cb);
+  }
+  return received;
+}
+
+// Accepts one connection, and echoes the frames received on it, prefixed.
+class FramedEchoServer {
+ public:
+  explicit FramedEchoServer(FramedConnection::Params params)
+      : params_(std::move(params)) {}
+
+  void Start() {
+    ASSERT_OK_AND_ASSIGN(thread_, SelectorThread::Create());
+    thread_->Start();
+    acceptor_ = absl::make_unique<TcpAcceptor>(thread_->selector(),
+                                               TcpAcceptorParams());
+    acceptor_->set_accept_handler([this](std::unique_ptr<Connection> c) {
+      connection_ = std::move(c);
+      connection_->set_write_handler([]() { return absl::OkStatus(); });
+      framed_ = absl::make_unique<FramedConnection>(connection_.get(),
+                                                    params_);
+      framed_->set_frame_handler([this](absl::Cord frame) {
+        return framed_->WriteFrame(absl::StrCat("re: ", std::string(frame)));
+      });
+    });
+    RunAndWait(thread_.get(), [this]() {
+      EXPECT_OK(acceptor_->Listen(
+          HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+    });
+  }
+  void Stop() {
+    RunAndWait(thread_.get(), [this]() {
+      framed_.reset();
+      if (connection_ != nullptr) {
+        connection_->ForceClose();
+        connection_.reset();
+      }
+      acceptor_->Close();
+    });
+    thread_->Stop();
+  }
+  uint16_t port() const { return acceptor_->local_address().port().value(); }
+  size_t num_frames_read() {
+    size_t result = 0;
+    RunAndWait(thread_.get(), [this, &result]() {
+      result = framed_ == nullptr ? 0 : framed_->num_frames_read();
+    });
+    return result;
+  }
+
+ private:
+  const FramedConnection::Params params_;
+  std::unique_ptr<SelectorThread> thread_;
+  std::unique_ptr<TcpAcceptor> acceptor_;
+  std::unique_ptr<Connection> connection_;
+  std::unique_ptr<FramedConnection> framed_;
+};
+
+class FramedConnectionTest
+    : public ::testing::TestWithParam<FramedConnection::LengthPrefix> {};
+}  // namespace
+
+TEST(FramedConnection, LengthPrefix) {
+  using LengthPrefix = FramedConnection::LengthPrefix;
+  EXPECT_EQ(Frame(LengthPrefix::FIXED32, "abc"), std::string("\0\0\0\3abc", 7));
+  EXPECT_EQ(Frame(LengthPrefix::VARINT, "abc"), "\3abc");
+  const std::string data(300, 'x');
+  EXPECT_EQ(Frame(LengthPrefix::FIXED32, data),
+            absl::StrCat(std::string("\0\0\1\x2c", 4), data));
+  EXPECT_EQ(Frame(LengthPrefix::VARINT, data), absl::StrCat("\xac\x02", data));
+}
+
+TEST_P(FramedConnectionTest, Echo) {
+  const FramedConnection::LengthPrefix length_prefix = GetParam();
+  FramedEchoServer server(FramedConnection::Params()
+                              .set_length_prefix(length_prefix)
+                              .set_max_frame_size(100000));
+  server.Start();
+  const int fd = ConnectToLocalPort(server.port());
+  ASSERT_GE(fd, 0);
+
+  // Many frames in one send, w/ the last one split in the middle of its
+  // length prefix, then the rest of it.
+  std::string sent;
+  std::string expected;
+  for (size_t i = 0; i < 100; ++i) {
+    const std::string data = absl::StrCat("frame ", i);
+    sent.append(Frame(length_prefix, data));
+    expected.append(Frame(length_prefix, absl::StrCat("re: ", data)));
+  }
+  const std::string large(50000, 'y');
+  const std::string large_frame = Frame(length_prefix, large);
+  sent.append(large_frame.substr(0, 1));
+  expected.append(Frame(length_prefix, absl::StrCat("re: ", large)));
+  ASSERT_EQ(::send(fd, sent.data(), sent.size(), 0), sent.size());
+  while (server.num_frames_read() < 100) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  ASSERT_EQ(::send(fd, large_frame.data() + 1, large_frame.size() - 1, 0),
+            large_frame.size() - 1);
+  // An empty frame.
+  const std::string empty_frame = Frame(length_prefix, "");
+  ASSERT_EQ(::send(fd, empty_frame.data(), empty_frame.size(), 0),
+            empty_frame.size());
+  expected.append(Frame(length_prefix, "re: "));
+  EXPECT_EQ(ReceiveAtMost(fd, expected.size()), expected);
+  EXPECT_EQ(server.num_frames_read(), 102);
+
+  // A frame over the limit closes the connection.
+  const std::string too_large = Frame(length_prefix, std::string(100001, 'z'));
+  ASSERT_EQ(::send(fd, too_large.data(), 10, 0), 10);
+  EXPECT_EQ(ReceiveAtMost(fd, 1), "");
+  ::close(fd);
+  server.Stop();
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    LengthPrefix, FramedConnectionTest,
+    ::testing::Values(FramedConnection::LengthPrefix::FIXED32,
+                      FramedConnection::LengthPrefix::VARINT));
+
+}  // namespace net
+}  // namespace whisper
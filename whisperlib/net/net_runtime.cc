@@ -0,0 +1,483 @@
+#include "whisperlib/net/net_runtime.h"
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>  // NOLINT
+#include <utility>
+
+#include "absl/functional/bind_front.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/strip.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/synchronization/notification.h"
+#include "whisperlib/status/status.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+// The listener handoff goes over a SEQPACKET Unix socket: the serving
+// process sends a record for each listener - the prefix and the name of
+// the acceptor, with its listening sockets attached - then the end record.
+// The fetching process confirms with the ack record.
+constexpr absl::string_view kListenerRecordPrefix = "listener:";
+constexpr absl::string_view kEndRecord = "end";
+constexpr absl::string_view kAckRecord = "ack";
+// Maximum number of descriptors passed in a message - SCM_MAX_FD on Linux.
+constexpr size_t kMaxHandoffFds = 253;
+// How often we check the connections while draining.
+constexpr absl::Duration kDrainCheckInterval = absl::Milliseconds(10);
+
+UnixConnectionParams HandoffConnectionParams() {
+  return UnixConnectionParams()
+      .set_type(UnixConnectionParams::Type::SEQPACKET)
+      .set_max_fds_per_message(kMaxHandoffFds);
+}
+
+// The CPUs this process may run on.
+std::vector<int> AllowedCpus() {
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if (::sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &cpu_set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif  // __linux__
+  return cpus;
+}
+
+void CloseFds(const std::vector<int>& fds) {
+  for (const int fd : fds) {
+    ::close(fd);
+  }
+}
+}  // namespace
+
+NetRuntimeParams& NetRuntimeParams::set_num_threads(size_t value) {
+  num_threads = value;
+  return *this;
+}
+NetRuntimeParams& NetRuntimeParams::set_selector_params(
+    Selector::Params value) {
+  selector_params = std::move(value);
+  return *this;
+}
+NetRuntimeParams& NetRuntimeParams::set_pin_threads(bool value) {
+  pin_threads = value;
+  return *this;
+}
+NetRuntimeParams& NetRuntimeParams::set_thread_name(std::string value) {
+  thread_name = std::move(value);
+  return *this;
+}
+NetRuntimeParams& NetRuntimeParams::set_placement_policy(
+    AcceptorThreads::PlacementPolicy value) {
+  placement_policy = value;
+  return *this;
+}
+
+DrainParams& DrainParams::set_timeout(absl::Duration value) {
+  timeout = value;
+  return *this;
+}
+DrainParams& DrainParams::set_progress_interval(absl::Duration value) {
+  progress_interval = value;
+  return *this;
+}
+DrainParams& DrainParams::set_start_handler(
+    std::function<void(Selector*)> value) {
+  start_handler = std::move(value);
+  return *this;
+}
+DrainParams& DrainParams::set_progress_handler(
+    std::function<void(const DrainProgress&)> value) {
+  progress_handler = std::move(value);
+  return *this;
+}
+
+absl::StatusOr<std::unique_ptr<NetRuntime>> NetRuntime::Create(
+    NetRuntimeParams params) {
+  if (params.num_threads == 0) {
+    params.num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  auto runtime = absl::WrapUnique(new NetRuntime(std::move(params)));
+  const std::vector<int> cpus =
+      runtime->params_.pin_threads ? AllowedCpus() : std::vector<int>();
+  // On error, the destructor stops the threads already started.
+  for (size_t i = 0; i < runtime->params_.num_threads; ++i) {
+    work::ThreadOptions thread_options;
+    thread_options.set_name(absl::StrCat(runtime->params_.thread_name, i));
+    if (!cpus.empty()) {
+      thread_options.set_cpu_affinity({cpus[i % cpus.size()]});
+    }
+    ASSIGN_OR_RETURN(auto thread,
+                     SelectorThread::Create(runtime->params_.selector_params,
+                                            std::move(thread_options)),
+                     _ << "Creating net runtime thread " << i);
+    RET_CHECK(thread->Start()) << "Starting net runtime thread " << i << ": "
+                               << thread->selector_status().ToString();
+    runtime->threads_.emplace_back(std::move(thread));
+  }
+  return {std::move(runtime)};
+}
+
+NetRuntime::NetRuntime(NetRuntimeParams params) : params_(std::move(params)) {}
+
+NetRuntime::~NetRuntime() {
+  Stop();
+  // The threads are stopped - no more access from the main selector.
+  for (const auto& it : fetched_fds_) {
+    CloseFds(it.second);
+  }
+}
+
+AcceptorThreads NetRuntime::acceptor_threads() const {
+  std::vector<SelectorThread*> threads;
+  for (const auto& thread : threads_) {
+    threads.push_back(thread.get());
+  }
+  AcceptorThreads acceptor_threads;
+  acceptor_threads.set_client_threads(std::move(threads))
+      .set_placement_policy(params_.placement_policy);
+  return acceptor_threads;
+}
+
+void NetRuntime::RunInMainAndWait(std::function<void()> f) {
+  CHECK(!main_selector()->IsInSelectThread())
+      << "Waiting for the main selector, from its own thread.";
+  absl::Notification done;
+  main_selector()->RunInSelectLoop([&f, &done]() {
+    f();
+    done.Notify();
+  });
+  done.WaitForNotification();
+}
+
+absl::StatusOr<TcpAcceptor*> NetRuntime::AddTcpAcceptor(
+    absl::string_view name, const HostPort& local_addr,
+    TcpAcceptorParams params, Acceptor::AcceptHandler accept_handler) {
+  RET_CHECK(!stopped_.load()) << "Adding acceptor: " << name
+                              << " to a stopped net runtime.";
+  params.set_acceptor_threads(acceptor_threads());
+  auto acceptor =
+      absl::make_unique<TcpAcceptor>(main_selector(), std::move(params));
+  acceptor->set_accept_handler(std::move(accept_handler));
+  TcpAcceptor* const result = acceptor.get();
+  absl::Status status;
+  RunInMainAndWait([this, name, &local_addr, &acceptor, &status]() {
+    for (const NamedAcceptor& named : acceptors_) {
+      if (named.name == name) {
+        status = status::AlreadyExistsErrorBuilder()
+                 << "Acceptor: " << name << " already added to net runtime.";
+        return;
+      }
+    }
+    auto it = fetched_fds_.find(name);
+    if (it != fetched_fds_.end()) {
+      LOG(INFO) << "Acceptor: " << name << " starts on "
+                << it->second.size() << " fetched listening sockets.";
+      status = acceptor->ListenOnFds(std::move(it->second));
+      fetched_fds_.erase(it);
+    } else {
+      status = acceptor->Listen(local_addr);
+    }
+    if (status.ok()) {
+      acceptors_.push_back(NamedAcceptor{std::string(name),
+                                         std::move(acceptor)});
+    }
+  });
+  RETURN_IF_ERROR(status) << "Adding acceptor: " << name;
+  return result;
+}
+
+size_t NetRuntime::num_registered() const {
+  size_t num_registered = 0;
+  for (const auto& thread : threads_) {
+    num_registered += thread->selector()->num_registered();
+  }
+  return num_registered;
+}
+
+void NetRuntime::CloseAcceptors() {
+  absl::BlockingCounter closed(threads_.size());
+  RunInMainAndWait([this, &closed]() {
+    // Note: the closed acceptors are unregistered, with no selector.
+    if (handoff_acceptor_ != nullptr &&
+        handoff_acceptor_->state() != Acceptor::DISCONNECTED) {
+      handoff_acceptor_->Close();
+    }
+    for (auto& connection : handoff_connections_) {
+      connection->clear_all_handlers();
+      connection->ForceClose();
+    }
+    handoff_connections_.clear();
+    for (const NamedAcceptor& named : acceptors_) {
+      if (named.acceptor->state() != Acceptor::DISCONNECTED) {
+        named.acceptor->Close();
+      }
+    }
+    // The reuse port listeners are closed in their threads, by callbacks
+    // scheduled just now, so they run before these.
+    for (const auto& thread : threads_) {
+      thread->selector()->RunInSelectLoop(
+          [&closed]() { closed.DecrementCount(); });
+    }
+  });
+  closed.Wait();
+}
+
+absl::Status NetRuntime::Drain(DrainParams params) {
+  RET_CHECK(!stopped_.load()) << "Draining a stopped net runtime.";
+  const absl::Time start = absl::Now();
+  LOG(INFO) << "Draining the net runtime, for up to: " << params.timeout;
+  CloseAcceptors();
+  if (params.start_handler != nullptr) {
+    absl::BlockingCounter started(threads_.size());
+    for (const auto& thread : threads_) {
+      Selector* const selector = thread->selector();
+      selector->RunInSelectLoop([&params, &started, selector]() {
+        params.start_handler(selector);
+        started.DecrementCount();
+      });
+    }
+    started.Wait();
+  }
+  const absl::Time deadline = start + params.timeout;
+  absl::Time next_progress = start + params.progress_interval;
+  DrainProgress progress;
+  while (true) {
+    const absl::Time now = absl::Now();
+    progress.num_remaining = num_registered();
+    progress.buffered_output_bytes = 0;
+    for (const auto& thread : threads_) {
+      progress.buffered_output_bytes +=
+          thread->selector()->buffered_output_bytes();
+    }
+    progress.elapsed = now - start;
+    if (progress.num_remaining == 0 || now >= deadline) {
+      break;
+    }
+    if (params.progress_handler != nullptr && now >= next_progress) {
+      params.progress_handler(progress);
+      next_progress = now + params.progress_interval;
+    }
+    absl::SleepFor(std::min(kDrainCheckInterval, deadline - now));
+  }
+  if (params.progress_handler != nullptr) {
+    params.progress_handler(progress);
+  }
+  Stop();
+  if (progress.num_remaining > 0) {
+    return status::DeadlineExceededErrorBuilder()
+           << "Closed " << progress.num_remaining
+           << " connections still open after draining for: "
+           << absl::FormatDuration(params.timeout);
+  }
+  LOG(INFO) << "Net runtime drained in: " << progress.elapsed;
+  return absl::OkStatus();
+}
+
+void NetRuntime::Stop() {
+  if (stopped_.exchange(true) || threads_.empty()) {
+    return;
+  }
+  CloseAcceptors();
+  // The loops close what is still registered on exit.
+  for (auto& thread : threads_) {
+    thread->Stop();
+  }
+}
+
+absl::Status NetRuntime::ServeListenerHandoff(
+    const HostPort& unix_address, ListenerHandoffHandler handoff_handler) {
+  RET_CHECK(!stopped_.load()) << "Serving the listeners of a stopped runtime.";
+  absl::Status status;
+  RunInMainAndWait([this, &unix_address, &handoff_handler, &status]() {
+    if (handoff_acceptor_ != nullptr) {
+      status = status::FailedPreconditionErrorBuilder()
+               << "Already serving the listener handoff on: "
+               << handoff_acceptor_->ToString();
+      return;
+    }
+    auto acceptor = absl::make_unique<UnixAcceptor>(
+        main_selector(),
+        UnixAcceptorParams().set_connection_params(HandoffConnectionParams()));
+    acceptor->set_accept_handler(
+        absl::bind_front(&NetRuntime::HandleHandoffConnection, this));
+    status = acceptor->Listen(unix_address);
+    if (status.ok()) {
+      handoff_acceptor_ = std::move(acceptor);
+      handoff_handler_ = std::move(handoff_handler);
+    }
+  });
+  RETURN_IF_ERROR(status) << "Serving the listener handoff.";
+  return absl::OkStatus();
+}
+
+void NetRuntime::HandleHandoffConnection(
+    std::unique_ptr<Connection> connection) {
+  auto* const c = static_cast<UnixConnection*>(connection.get());
+  c->set_write_handler([]() { return absl::OkStatus(); });
+  c->set_read_handler([this, c]() -> absl::Status {
+    const bool is_ack = (*c->inbuf() == kAckRecord);
+    c->inbuf()->Clear();
+    RET_CHECK(is_ack) << "Unexpected listener handoff record from: "
+                      << c->ToString();
+    LOG(INFO) << "Listeners handed off via: " << c->ToString();
+    if (handoff_handler_ != nullptr) {
+      handoff_handler_();
+    }
+    c->FlushAndClose();
+    return absl::OkStatus();
+  });
+  c->set_close_handler([this, c](const absl::Status& status,
+                                 Connection::CloseDirective directive) {
+    LOG_IF(WARNING, !status.ok())
+        << "Listener handoff connection closed: " << status;
+    if (directive == Connection::CLOSE_READ_WRITE) {
+      ReleaseHandoffConnection(c);
+    } else {
+      c->ForceClose();
+    }
+  });
+  handoff_connections_.emplace_back(std::move(connection));
+  const absl::Status status = SendListeners(c);
+  if (!status.ok()) {
+    LOG(WARNING) << "Sending the listeners via: " << c->ToString() << ": "
+                 << status;
+    c->ForceClose();
+  }
+}
+
+absl::Status NetRuntime::SendListeners(UnixConnection* connection) {
+  for (const NamedAcceptor& named : acceptors_) {
+    if (named.acceptor->state() != Acceptor::LISTENING) {
+      continue;
+    }
+    RETURN_IF_ERROR(connection->WriteMessage(
+        absl::Cord(absl::StrCat(kListenerRecordPrefix, named.name)),
+        named.acceptor->listening_fds()))
+        << "Sending the listening sockets of: " << named.name;
+  }
+  return connection->WriteMessage(absl::Cord(kEndRecord), {});
+}
+
+void NetRuntime::ReleaseHandoffConnection(Connection* connection) {
+  auto it = std::find_if(
+      handoff_connections_.begin(), handoff_connections_.end(),
+      [connection](const std::unique_ptr<Connection>& c) {
+        return c.get() == connection;
+      });
+  if (it != handoff_connections_.end()) {
+    main_selector()->DeleteInSelectLoop(std::move(*it));
+    handoff_connections_.erase(it);
+  }
+}
+
+absl::Status NetRuntime::FetchListeners(const HostPort& unix_address,
+                                        absl::Duration timeout) {
+  RET_CHECK(!stopped_.load()) << "Fetching listeners for a stopped runtime.";
+  // Accessed in the main selector, until the connection is deleted.
+  struct FetchState {
+    absl::flat_hash_map<std::string, std::vector<int>> fds;
+    bool ended = false;
+    absl::Status status;
+    absl::Notification done;
+  };
+  FetchState state;
+  auto connection =
+      absl::make_unique<UnixConnection>(main_selector(),
+                                        HandoffConnectionParams());
+  UnixConnection* const c = connection.get();
+  c->set_connect_handler([]() {});
+  c->set_write_handler([]() { return absl::OkStatus(); });
+  c->set_read_handler([c, &state]() -> absl::Status {
+    absl::string_view record;
+    const std::string data(*c->inbuf());
+    c->inbuf()->Clear();
+    record = data;
+    std::vector<int> fds = c->TakeReceivedFds();
+    if (absl::ConsumePrefix(&record, kListenerRecordPrefix)) {
+      CloseFds(state.fds[record]);
+      state.fds[record] = std::move(fds);
+      return absl::OkStatus();
+    }
+    CloseFds(fds);
+    RET_CHECK(record == kEndRecord && !state.ended)
+        << "Unexpected listener handoff record from: " << c->ToString();
+    state.ended = true;
+    return c->WriteMessage(absl::Cord(kAckRecord), {});
+  });
+  c->set_close_handler(
+      [c, &state](const absl::Status& status, Connection::CloseDirective) {
+        if (!state.ended) {
+          state.status = status::UnavailableErrorBuilder()
+                         << "Listener handoff connection closed before "
+                            "the end: "
+                         << status.ToString();
+        }
+        if (c->state() != Connection::DISCONNECTED) {
+          c->ForceClose();
+        }
+        if (!state.done.HasBeenNotified()) {
+          state.done.Notify();
+        }
+      });
+  absl::Status connect_status;
+  RunInMainAndWait(
+      [c, &unix_address, &connect_status]() {
+        connect_status = c->Connect(unix_address);
+      });
+  if (connect_status.ok() &&
+      !state.done.WaitForNotificationWithTimeout(timeout)) {
+    state.status = status::DeadlineExceededErrorBuilder()
+                   << "Fetching the listeners timed out after: "
+                   << absl::FormatDuration(timeout);
+  }
+  RunInMainAndWait([this, &connection, &state]() {
+    connection->clear_all_handlers();
+    connection->ForceClose();
+    connection.reset();
+    if (!state.ended) {
+      for (const auto& it : state.fds) {
+        CloseFds(it.second);
+      }
+      return;
+    }
+    for (auto& it : state.fds) {
+      CloseFds(fetched_fds_[it.first]);
+      fetched_fds_[it.first] = std::move(it.second);
+    }
+  });
+  RETURN_IF_ERROR(connect_status)
+      << "Connecting for the listener handoff to: " << unix_address.ToString();
+  if (!state.ended) {
+    RETURN_IF_ERROR(state.status) << "Fetching the listeners from: "
+                                  << unix_address.ToString();
+  }
+  LOG(INFO) << "Fetched " << state.fds.size()
+            << " listeners from: " << unix_address;
+  return absl::OkStatus();
+}
+
+std::vector<std::string> NetRuntime::fetched_listener_names() {
+  std::vector<std::string> names;
+  RunInMainAndWait([this, &names]() {
+    for (const auto& it : fetched_fds_) {
+      names.push_back(it.first);
+    }
+  });
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+}  // namespace net
+}  // namespace whisper
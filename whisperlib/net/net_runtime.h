@@ -0,0 +1,180 @@
+#ifndef WHISPERLIB_NET_NET_RUNTIME_H_
+#define WHISPERLIB_NET_NET_RUNTIME_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "whisperlib/net/address.h"
+#include "whisperlib/net/connection.h"
+#include "whisperlib/net/selector.h"
+#include "whisperlib/net/unix_connection.h"
+
+namespace whisper {
+namespace net {
+
+struct NetRuntimeParams {
+  // Number of selector threads. If zero, one per hardware thread.
+  size_t num_threads = 0;
+  // Parameters for the selectors of the threads.
+  Selector::Params selector_params;
+  // Pins each selector thread to one CPU, in turn, from the CPUs this
+  // process may run on. Linux only.
+  bool pin_threads = true;
+  // The threads are named with this prefix, followed by their index.
+  std::string thread_name = "net";
+  // How the accepted connections are placed on the threads.
+  AcceptorThreads::PlacementPolicy placement_policy =
+      AcceptorThreads::PlacementPolicy::ROUND_ROBIN;
+
+  NetRuntimeParams& set_num_threads(size_t value);
+  NetRuntimeParams& set_selector_params(Selector::Params value);
+  NetRuntimeParams& set_pin_threads(bool value);
+  NetRuntimeParams& set_thread_name(std::string value);
+  NetRuntimeParams& set_placement_policy(
+      AcceptorThreads::PlacementPolicy value);
+};
+
+// The state of a NetRuntime::Drain().
+struct DrainProgress {
+  // The selectables (normally the connections) still registered in the
+  // selectors of the runtime.
+  size_t num_remaining = 0;
+  // Output buffered by these, and not yet sent.
+  int64_t buffered_output_bytes = 0;
+  // Since the drain started.
+  absl::Duration elapsed;
+};
+
+struct DrainParams {
+  // How long to wait for the connections to finish, before closing them.
+  absl::Duration timeout = absl::Seconds(30);
+  // The progress handler is called this often while draining.
+  absl::Duration progress_interval = absl::Seconds(1);
+  // Called in each selector thread when the drain starts, after we stopped
+  // accepting - e.g. to close the idle connections, or to tell the peers
+  // to go away (as HTTP/2 GOAWAY).
+  std::function<void(Selector*)> start_handler;
+  // Called from the draining thread every progress_interval, and once at
+  // the end.
+  std::function<void(const DrainProgress&)> progress_handler;
+
+  DrainParams& set_timeout(absl::Duration value);
+  DrainParams& set_progress_interval(absl::Duration value);
+  DrainParams& set_start_handler(std::function<void(Selector*)> value);
+  DrainParams& set_progress_handler(
+      std::function<void(const DrainProgress&)> value);
+};
+
+// Runs the networking of a server: a set of selector threads, pinned to
+// CPUs, that run the connections, and the acceptors that listen for them -
+// all in the first thread, the main selector, with the accepted
+// connections placed on all threads. E.g.:
+//
+//   ASSIGN_OR_RETURN(auto runtime, NetRuntime::Create(NetRuntimeParams()));
+//   RETURN_IF_ERROR(runtime->AddTcpAcceptor("http", address,
+//                                           TcpAcceptorParams(),
+//                                           HandleHttpConnection).status());
+//   ...
+//   // On shutdown, or after handing off the listeners:
+//   LOG_IF_ERROR(WARNING, runtime->Drain(DrainParams()));
+//
+// For restarts without downtime, the running process serves its listening
+// sockets (ServeListenerHandoff()) to the new process, which fetches them
+// (FetchListeners()) before adding its acceptors. The acceptors with the
+// names of the fetched listeners accept on the same sockets - the port is
+// never closed, and the connections waiting in the backlog are not reset.
+// When the new process got the listeners, the old one drains, and exits.
+//
+// The methods are to be called from outside the runtime threads - except
+// for the accessors.
+class NetRuntime {
+ public:
+  // Creates the runtime, and starts its threads.
+  static absl::StatusOr<std::unique_ptr<NetRuntime>> Create(
+      NetRuntimeParams params);
+  ~NetRuntime();
+
+  const NetRuntimeParams& params() const { return params_; }
+  size_t num_threads() const { return threads_.size(); }
+  SelectorThread* thread(size_t index) { return threads_[index].get(); }
+  // The selector of the acceptors - the one of the first thread.
+  Selector* main_selector() { return threads_.front()->selector(); }
+  // All threads, with the placement policy from the params.
+  AcceptorThreads acceptor_threads() const;
+
+  // Adds a TCP acceptor, which listens on local_addr - or on the listening
+  // sockets fetched under this name. The acceptor threads of params are set
+  // to ours, and the accepted connections are passed to accept_handler, in
+  // the thread they run in. The name needs to be unique.
+  // The acceptor is owned by the runtime.
+  absl::StatusOr<TcpAcceptor*> AddTcpAcceptor(
+      absl::string_view name, const HostPort& local_addr,
+      TcpAcceptorParams params, Acceptor::AcceptHandler accept_handler);
+
+  // Stops accepting, lets the open connections finish, for up to the
+  // timeout of params, then closes the ones still open, and stops the
+  // threads. Returns a DeadlineExceeded error if connections were closed.
+  absl::Status Drain(DrainParams params);
+  // Closes the acceptors, and stops the threads - the open connections
+  // are closed abruptly. Done on destruction too.
+  void Stop();
+
+  //////////////////// Listener handoff
+  // Serves our listening sockets on the Unix socket address (see
+  // UnixSocketAddress()), to a new process of the server. Calls the
+  // handoff_handler in the main selector, when a process got them (e.g. to
+  // start the drain - from another thread).
+  using ListenerHandoffHandler = std::function<void()>;
+  absl::Status ServeListenerHandoff(const HostPort& unix_address,
+                                    ListenerHandoffHandler handoff_handler);
+  // Fetches the listening sockets of the previous process of the server,
+  // serving them on unix_address - to be used by the acceptors added next.
+  absl::Status FetchListeners(const HostPort& unix_address,
+                              absl::Duration timeout = absl::Seconds(10));
+  // The names of the fetched listeners, not used by an acceptor yet.
+  std::vector<std::string> fetched_listener_names();
+
+ private:
+  struct NamedAcceptor {
+    std::string name;
+    std::unique_ptr<TcpAcceptor> acceptor;
+  };
+
+  explicit NetRuntime(NetRuntimeParams params);
+  // Runs f in the main selector, and waits for it.
+  void RunInMainAndWait(std::function<void()> f);
+  // Closes the acceptors, and the listener handoff, and waits for all the
+  // listening sockets to be closed.
+  void CloseAcceptors();
+  // The number of selectables registered in all threads.
+  size_t num_registered() const;
+  // Sends the listeners to a process that connected for them.
+  void HandleHandoffConnection(std::unique_ptr<Connection> connection);
+  absl::Status SendListeners(UnixConnection* connection);
+  // Deletes a handoff connection that got closed.
+  void ReleaseHandoffConnection(Connection* connection);
+
+  const NetRuntimeParams params_;
+  std::vector<std::unique_ptr<SelectorThread>> threads_;
+  std::atomic_bool stopped_ = ATOMIC_VAR_INIT(false);
+  // Accessed only from the main selector:
+  std::vector<NamedAcceptor> acceptors_;
+  // The fetched listening sockets, per name, waiting for their acceptors.
+  absl::flat_hash_map<std::string, std::vector<int>> fetched_fds_;
+  std::unique_ptr<UnixAcceptor> handoff_acceptor_;
+  std::vector<std::unique_ptr<Connection>> handoff_connections_;
+  ListenerHandoffHandler handoff_handler_;
+};
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_NET_RUNTIME_H_
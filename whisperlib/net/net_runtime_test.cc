@@ -0,0 +1,224 @@
+#include "whisperlib/net/net_runtime.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "gtest/gtest.h"
+#include "whisperlib/net/testing_util.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+// Sends the message on the blocking socket, and expects it back.
+void ExpectEcho(int fd, const std::string& message) {
+  ASSERT_EQ(::send(fd, message.data(), message.size(), 0), message.size());
+  std::string received;
+  char buffer[256];
+  while (received.size() < message.size()) {
+    const ssize_t cb = ::recv(fd, buffer, sizeof(buffer), 0);
+    ASSERT_GT(cb, 0);
+    received.append(buffer, cb);
+  }
+  EXPECT_EQ(received, message);
+}
+
+// Echoes on the accepted connections, and deletes them when closed.
+class EchoServer {
+ public:
+  void Accept(std::unique_ptr<Connection> connection) {
+    Connection* const c = connection.get();
+    c->set_read_handler([c]() {
+      c->Write(*c->inbuf());
+      c->inbuf()->Clear();
+      return absl::OkStatus();
+    });
+    c->set_write_handler([]() { return absl::OkStatus(); });
+    c->set_close_handler(
+        [this, c](const absl::Status&, Connection::CloseDirective directive) {
+          if (directive != Connection::CLOSE_READ_WRITE) {
+            c->ForceClose();
+            return;
+          }
+          absl::MutexLock l(&mutex_);
+          auto it = connections_.find(c);
+          c->net_selector()->DeleteInSelectLoop(std::move(it->second));
+          connections_.erase(it);
+        });
+    absl::MutexLock l(&mutex_);
+    connections_.emplace(c, std::move(connection));
+  }
+  Acceptor::AcceptHandler handler() {
+    return [this](std::unique_ptr<Connection> connection) {
+      Accept(std::move(connection));
+    };
+  }
+
+ private:
+  absl::Mutex mutex_;
+  absl::flat_hash_map<Connection*, std::unique_ptr<Connection>> connections_
+      ABSL_GUARDED_BY(mutex_);
+};
+
+const HostPort kLocalhost(absl::nullopt, IpAddress::kIPv4Localhost, 0);
+}  // namespace
+
+TEST(NetRuntime, Drain) {
+  EchoServer server;
+  ASSERT_OK_AND_ASSIGN(
+      auto runtime, NetRuntime::Create(NetRuntimeParams().set_num_threads(2)));
+  EXPECT_EQ(runtime->num_threads(), 2);
+  ASSERT_OK_AND_ASSIGN(TcpAcceptor * acceptor,
+                       runtime->AddTcpAcceptor("echo", kLocalhost,
+                                               TcpAcceptorParams(),
+                                               server.handler()));
+  EXPECT_RAISES(runtime->AddTcpAcceptor("echo", kLocalhost,
+                                        TcpAcceptorParams(), server.handler())
+                    .status(),
+                AlreadyExists);
+  const uint16_t port = acceptor->local_address().port().value();
+  std::vector<int> fds;
+  for (size_t i = 0; i < 4; ++i) {
+    fds.push_back(ConnectToLocalPort(port));
+    ASSERT_GE(fds.back(), 0);
+    ExpectEcho(fds.back(), absl::StrCat("hello ", i));
+  }
+
+  std::atomic_size_t num_started = ATOMIC_VAR_INIT(0);
+  std::vector<DrainProgress> progress;
+  absl::Status drain_status;
+  std::thread drainer([&]() {
+    drain_status = runtime->Drain(
+        DrainParams()
+            .set_timeout(absl::Seconds(10))
+            .set_progress_interval(absl::Milliseconds(20))
+            .set_start_handler([&num_started](Selector* selector) {
+              EXPECT_TRUE(selector->IsInSelectThread());
+              num_started.fetch_add(1);
+            })
+            .set_progress_handler([&progress](const DrainProgress& p) {
+              progress.push_back(p);
+            }));
+  });
+  // No more accepting, but the open connections still work.
+  while (acceptor->state() == Acceptor::LISTENING) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  EXPECT_LT(ConnectToLocalPort(port), 0);
+  for (const int fd : fds) {
+    ExpectEcho(fd, "still here");
+  }
+  absl::SleepFor(absl::Milliseconds(100));
+  for (const int fd : fds) {
+    ::close(fd);
+  }
+  drainer.join();
+  EXPECT_OK(drain_status);
+  EXPECT_EQ(num_started.load(), 2);
+  ASSERT_GE(progress.size(), 2);
+  EXPECT_EQ(progress.front().num_remaining, fds.size());
+  EXPECT_EQ(progress.back().num_remaining, 0);
+  EXPECT_FALSE(runtime->thread(0)->is_started());
+}
+
+TEST(NetRuntime, DrainTimeout) {
+  EchoServer server;
+  ASSERT_OK_AND_ASSIGN(
+      auto runtime, NetRuntime::Create(NetRuntimeParams().set_num_threads(2)));
+  ASSERT_OK_AND_ASSIGN(TcpAcceptor * acceptor,
+                       runtime->AddTcpAcceptor("echo", kLocalhost,
+                                               TcpAcceptorParams(),
+                                               server.handler()));
+  const int fd = ConnectToLocalPort(acceptor->local_address().port().value());
+  ASSERT_GE(fd, 0);
+  ExpectEcho(fd, "hello");
+  EXPECT_RAISES(
+      runtime->Drain(DrainParams().set_timeout(absl::Milliseconds(100))),
+      DeadlineExceeded);
+  // Closed by the runtime.
+  char buffer[16];
+  EXPECT_LE(::recv(fd, buffer, sizeof(buffer), 0), 0);
+  ::close(fd);
+  EXPECT_RAISES(runtime->Drain(DrainParams()), FailedPrecondition);
+}
+
+TEST(NetRuntime, ListenerHandoff) {
+  const std::string path = absl::StrCat(::testing::TempDir(), "/handoff.sock");
+  EchoServer old_server;
+  EchoServer new_server;
+  ASSERT_OK_AND_ASSIGN(
+      auto old_runtime,
+      NetRuntime::Create(NetRuntimeParams().set_num_threads(2)));
+  ASSERT_OK_AND_ASSIGN(TcpAcceptor * old_acceptor,
+                       old_runtime->AddTcpAcceptor("echo", kLocalhost,
+                                                   TcpAcceptorParams(),
+                                                   old_server.handler()));
+  ASSERT_OK_AND_ASSIGN(
+      TcpAcceptor * old_sharded,
+      old_runtime->AddTcpAcceptor("sharded", kLocalhost,
+                                  TcpAcceptorParams().set_reuse_port(true),
+                                  old_server.handler()));
+  const uint16_t port = old_acceptor->local_address().port().value();
+  const uint16_t sharded_port = old_sharded->local_address().port().value();
+  absl::Notification handed_off;
+  ASSERT_OK(old_runtime->ServeListenerHandoff(
+      UnixSocketAddress(path), [&handed_off]() { handed_off.Notify(); }));
+  const int old_fd = ConnectToLocalPort(port);
+  ASSERT_GE(old_fd, 0);
+  ExpectEcho(old_fd, "old");
+
+  ASSERT_OK_AND_ASSIGN(
+      auto new_runtime,
+      NetRuntime::Create(NetRuntimeParams().set_num_threads(2)));
+  EXPECT_RAISES(new_runtime->FetchListeners(UnixSocketAddress(path + ".none")),
+                NotFound);
+  ASSERT_OK(new_runtime->FetchListeners(UnixSocketAddress(path)));
+  EXPECT_EQ(new_runtime->fetched_listener_names(),
+            std::vector<std::string>({"echo", "sharded"}));
+  ASSERT_TRUE(handed_off.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  // The address is ignored, as we got the listening socket.
+  ASSERT_OK_AND_ASSIGN(TcpAcceptor * new_acceptor,
+                       new_runtime->AddTcpAcceptor("echo", kLocalhost,
+                                                   TcpAcceptorParams(),
+                                                   new_server.handler()));
+  ASSERT_OK_AND_ASSIGN(
+      TcpAcceptor * new_sharded,
+      new_runtime->AddTcpAcceptor("sharded", kLocalhost,
+                                  TcpAcceptorParams().set_reuse_port(true),
+                                  new_server.handler()));
+  EXPECT_TRUE(new_runtime->fetched_listener_names().empty());
+  EXPECT_EQ(new_acceptor->local_address().port().value(), port);
+  EXPECT_EQ(new_sharded->local_address().port().value(), sharded_port);
+
+  // The old process drains, while the new one accepts.
+  std::thread drainer([&old_runtime]() {
+    EXPECT_OK(old_runtime->Drain(DrainParams().set_timeout(absl::Seconds(10))));
+  });
+  ExpectEcho(old_fd, "old again");
+  ::close(old_fd);
+  drainer.join();
+  for (const uint16_t p : {port, sharded_port}) {
+    const int fd = ConnectToLocalPort(p);
+    ASSERT_GE(fd, 0);
+    ExpectEcho(fd, "new");
+    ::close(fd);
+  }
+  EXPECT_GT(new_acceptor->stats().connections_initialized.load() +
+                new_sharded->stats().connections_initialized.load(),
+            0);
+}
+
+}  // namespace net
+}  // namespace whisper
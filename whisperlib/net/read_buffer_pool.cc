@@ -0,0 +1,79 @@
+#include "whisperlib/net/read_buffer_pool.h"
+
+#include <algorithm>
+
+#include "absl/log/check.h"
+
+namespace whisper {
+namespace net {
+
+std::shared_ptr<ReadBufferPool> ReadBufferPool::Create(size_t buffer_size,
+                                                       size_t max_free_buffers,
+                                                       size_t copy_threshold) {
+  return std::shared_ptr<ReadBufferPool>(
+      new ReadBufferPool(buffer_size, max_free_buffers, copy_threshold));
+}
+
+ReadBufferPool::ReadBufferPool(size_t buffer_size, size_t max_free_buffers,
+                               size_t copy_threshold)
+    : buffer_size_(std::max(buffer_size, size_t(1))),
+      max_free_buffers_(max_free_buffers),
+      copy_threshold_(copy_threshold) {
+  free_buffers_.reserve(max_free_buffers_);
+}
+
+ReadBufferPool::~ReadBufferPool() {
+  for (char* buffer : free_buffers_) {
+    delete[] buffer;
+  }
+}
+
+char* ReadBufferPool::Acquire() {
+  num_outstanding_.fetch_add(1, std::memory_order_acq_rel);
+  {
+    absl::MutexLock l(&mutex_);
+    if (!free_buffers_.empty()) {
+      char* buffer = free_buffers_.back();
+      free_buffers_.pop_back();
+      return buffer;
+    }
+  }
+  num_allocated_.fetch_add(1, std::memory_order_acq_rel);
+  return new char[buffer_size_];
+}
+
+void ReadBufferPool::Release(char* buffer) {
+  if (buffer == nullptr) {
+    return;
+  }
+  CHECK_GT(num_outstanding_.load(), 0UL);
+  num_outstanding_.fetch_sub(1, std::memory_order_acq_rel);
+  {
+    absl::MutexLock l(&mutex_);
+    if (free_buffers_.size() < max_free_buffers_) {
+      free_buffers_.push_back(buffer);
+      return;
+    }
+  }
+  delete[] buffer;
+}
+
+void ReadBufferPool::AppendToCord(char* buffer, size_t size,
+                                  absl::Cord* cord) {
+  if (size < copy_threshold_) {
+    cord->Append(absl::string_view(buffer, size));
+    Release(buffer);
+    return;
+  }
+  cord->Append(absl::MakeCordFromExternal(
+      absl::string_view(buffer, size),
+      [pool = shared_from_this(), buffer]() { pool->Release(buffer); }));
+}
+
+size_t ReadBufferPool::num_free() const {
+  absl::MutexLock l(&mutex_);
+  return free_buffers_.size();
+}
+
+}  // namespace net
+}  // namespace whisper
@@ -0,0 +1,72 @@
+#ifndef WHISPERLIB_NET_READ_BUFFER_POOL_H_
+#define WHISPERLIB_NET_READ_BUFFER_POOL_H_
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/cord.h"
+#include "absl/synchronization/mutex.h"
+
+namespace whisper {
+namespace net {
+
+// A pool of fixed size buffers, used for reading data from file descriptors
+// without a memory allocation per read.
+// The buffers are handed to absl::Cord objects as external memory and
+// return to the pool when the cord releases them - which can happen on
+// any thread, and even after the owner of the pool is gone, as each
+// buffer handed to a cord holds a reference to the pool.
+//
+// Usually one pool is created per Selector (see
+// Selector::Params::max_free_read_buffers), and used by all its selectables.
+class ReadBufferPool : public std::enable_shared_from_this<ReadBufferPool> {
+ public:
+  // Creates a pool of buffers of `buffer_size` bytes, keeping at most
+  // `max_free_buffers` unused buffers around.
+  // Reads with less than `copy_threshold` bytes are copied in the cord,
+  // and their buffer is returned right away to the pool.
+  static std::shared_ptr<ReadBufferPool> Create(size_t buffer_size,
+                                                size_t max_free_buffers,
+                                                size_t copy_threshold = 256);
+  ~ReadBufferPool();
+
+  // Size of the buffers in this pool.
+  size_t buffer_size() const { return buffer_size_; }
+
+  // Returns a buffer of buffer_size() bytes, reusing a free one if possible.
+  char* Acquire();
+  // Returns to the pool a buffer obtained with Acquire().
+  void Release(char* buffer);
+
+  // Appends the first `size` bytes of `buffer` (obtained with Acquire())
+  // to the provided cord. The ownership of the buffer passes to the cord.
+  void AppendToCord(char* buffer, size_t size, absl::Cord* cord);
+
+  // Number of unused buffers kept in the pool.
+  size_t num_free() const;
+  // Number of buffers acquired and not yet released.
+  size_t num_outstanding() const { return num_outstanding_.load(); }
+  // How many times we had to allocate a new buffer.
+  size_t num_allocated() const { return num_allocated_.load(); }
+
+ private:
+  ReadBufferPool(size_t buffer_size, size_t max_free_buffers,
+                 size_t copy_threshold);
+
+  const size_t buffer_size_;
+  const size_t max_free_buffers_;
+  const size_t copy_threshold_;
+
+  mutable absl::Mutex mutex_;
+  std::vector<char*> free_buffers_ ABSL_GUARDED_BY(mutex_);
+
+  std::atomic_size_t num_outstanding_ = ATOMIC_VAR_INIT(0);
+  std::atomic_size_t num_allocated_ = ATOMIC_VAR_INIT(0);
+};
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_READ_BUFFER_POOL_H_
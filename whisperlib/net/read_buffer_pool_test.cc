@@ -0,0 +1,68 @@
+#include "whisperlib/net/read_buffer_pool.h"
+
+#include <cstring>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+namespace whisper {
+namespace net {
+
+TEST(ReadBufferPool, Reuse) {
+  auto pool = ReadBufferPool::Create(1024, 2);
+  EXPECT_EQ(pool->buffer_size(), 1024);
+  char* b1 = pool->Acquire();
+  char* b2 = pool->Acquire();
+  char* b3 = pool->Acquire();
+  EXPECT_EQ(pool->num_outstanding(), 3);
+  EXPECT_EQ(pool->num_allocated(), 3);
+  pool->Release(b1);
+  pool->Release(b2);
+  pool->Release(b3);  // over max_free_buffers - deleted.
+  EXPECT_EQ(pool->num_outstanding(), 0);
+  EXPECT_EQ(pool->num_free(), 2);
+  char* b4 = pool->Acquire();
+  EXPECT_EQ(b4, b2);
+  EXPECT_EQ(pool->num_allocated(), 3);
+  pool->Release(b4);
+}
+
+TEST(ReadBufferPool, CordReleasesBuffer) {
+  auto pool = ReadBufferPool::Create(1024, 4, 16);
+  absl::Cord cord;
+  char* buffer = pool->Acquire();
+  memset(buffer, 'a', 100);
+  pool->AppendToCord(buffer, 100, &cord);
+  EXPECT_EQ(cord.size(), 100);
+  EXPECT_EQ(pool->num_outstanding(), 1);
+  EXPECT_EQ(cord.TryFlat().value().data(), buffer);
+
+  // Small reads are copied and returned right away.
+  char* small = pool->Acquire();
+  memset(small, 'b', 10);
+  pool->AppendToCord(small, 10, &cord);
+  EXPECT_EQ(pool->num_outstanding(), 1);
+  EXPECT_EQ(std::string(cord), std::string(100, 'a') + std::string(10, 'b'));
+
+  cord.Clear();
+  EXPECT_EQ(pool->num_outstanding(), 0);
+  EXPECT_EQ(pool->num_free(), 2);
+}
+
+TEST(ReadBufferPool, CordOutlivesPool) {
+  absl::Cord cord;
+  {
+    auto pool = ReadBufferPool::Create(1024, 4, 0);
+    char* buffer = pool->Acquire();
+    memcpy(buffer, "foobar", 6);
+    pool->AppendToCord(buffer, 6, &cord);
+  }
+  std::thread releaser([cord = std::move(cord)]() mutable {
+    EXPECT_EQ(std::string(cord), "foobar");
+    cord.Clear();
+  });
+  releaser.join();
+}
+
+}  // namespace net
+}  // namespace whisper
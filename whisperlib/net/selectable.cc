@@ -2,10 +2,19 @@
 
 #include <sys/uio.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/socket.h>
+#include <sys/types.h>
+#endif
+
+#include <algorithm>
 
 #include "whisperlib/base/call_on_return.h"
 #include "whisperlib/io/cord_io.h"
 #include "whisperlib/io/errno.h"
+#include "whisperlib/net/selector.h"
 #include "whisperlib/status/status.h"
 
 namespace whisper {
@@ -47,6 +56,11 @@ absl::StatusOr<size_t> Selectable::Read(char* buffer, size_t size) {
 }
 
 absl::StatusOr<size_t> Selectable::ReadToCord(absl::Cord* cord, size_t len) {
+  ReadBufferPool* const pool =
+      selector_ == nullptr ? nullptr : selector_->read_buffer_pool();
+  if (pool != nullptr) {
+    return ReadToCordFromPool(pool, cord, len);
+  }
   char* buffer = new char[len];
   base::CallOnReturn clear_buffer([buffer]() { delete[] buffer; });
   ASSIGN_OR_RETURN(size_t cb, Read(buffer, len));
@@ -58,6 +72,67 @@ absl::StatusOr<size_t> Selectable::ReadToCord(absl::Cord* cord, size_t len) {
   return cb;
 }
 
+absl::StatusOr<size_t> Selectable::ReadToCordVec(absl::Cord* cord,
+                                                 size_t len, char* overflow,
+                                                 size_t overflow_len) {
+  char* buffer = new char[len];
+  base::CallOnReturn clear_buffer([buffer]() { delete[] buffer; });
+  struct ::iovec iov[2];
+  iov[0].iov_base = buffer;
+  iov[0].iov_len = len;
+  iov[1].iov_base = overflow;
+  iov[1].iov_len = overflow_len;
+  const ssize_t cb = ::readv(GetFd(), iov, overflow_len > 0 ? 2 : 1);
+  if (cb < 0) {
+    const int read_error = error::Errno();
+    if (error::IsUnavailableAndShouldRetry(read_error)) {
+      return 0;
+    }
+    return error::ErrnoToStatus(read_error)
+           << "Reading data with readv from file descriptor: " << GetFd()
+           << " size: " << len << " + " << overflow_len;
+  }
+  if (cb == 0) {
+    return 0;
+  }
+  const size_t block_cb = std::min(size_t(cb), len);
+  cord->Append(absl::MakeCordFromExternal(absl::string_view(buffer, block_cb),
+                                          clear_buffer.reset()));
+  if (size_t(cb) > len) {
+    cord->Append(absl::string_view(overflow, cb - len));
+  }
+  return cb;
+}
+
+absl::StatusOr<size_t> Selectable::ReadToCordFromPool(ReadBufferPool* pool,
+                                                      absl::Cord* cord,
+                                                      size_t len) {
+  size_t cb = 0;
+  while (cb < len) {
+    char* buffer = pool->Acquire();
+    const size_t to_read = std::min(len - cb, pool->buffer_size());
+    auto read_result = Read(buffer, to_read);
+    if (ABSL_PREDICT_FALSE(!read_result.ok())) {
+      pool->Release(buffer);
+      if (cb > 0) {
+        break;  // the error will show up again on next read.
+      }
+      return read_result.status();
+    }
+    const size_t crt_cb = read_result.value();
+    if (crt_cb == 0) {
+      pool->Release(buffer);
+      break;
+    }
+    pool->AppendToCord(buffer, crt_cb, cord);
+    cb += crt_cb;
+    if (crt_cb < to_read) {
+      break;
+    }
+  }
+  return cb;
+}
+
 absl::StatusOr<size_t> Selectable::WriteCord(const absl::Cord& cord,
                                              absl::optional<size_t> size) {
   if (cord.empty()) {
@@ -72,33 +147,89 @@ absl::StatusOr<size_t> Selectable::WriteCord(const absl::Cord& cord,
     ASSIGN_OR_RETURN(size_t crt_cb, Write(chunk.data(), chunk.size()),
                      _ << "Writing cord chunk in file.");
     cb += crt_cb;
-    if (cb >= size_to_write || cb == 0) {
-      break;
+    if (cb >= size_to_write || crt_cb < chunk.size()) {
+      break;  // done, or the rest of the chunk would block.
     }
   }
   return cb;
 }
 
-absl::StatusOr<size_t> Selectable::WriteCordVec(const absl::Cord& cord,
-                                                absl::optional<size_t> size) {
-  if (cord.empty()) {
+absl::StatusOr<size_t> Selectable::SendFile(int in_fd, int64_t offset,
+                                             size_t len) {
+  if (len == 0) {
     return 0;
   }
-  const size_t size_to_write = io::CordIo::SizeToWrite(cord, size);
-  auto io_vec_pair = io::CordIo::ToIovec(cord, size_to_write);
-  const ssize_t cb =
-      ::writev(GetFd(), &io_vec_pair.first[0], io_vec_pair.second);
+#if defined(__linux__)
+  off_t file_offset = offset;
+  const ssize_t cb = ::sendfile(GetFd(), in_fd, &file_offset, len);
+  if (cb > 0) {
+    return cb;
+  }
+  const int send_error = cb == 0 ? 0 : error::Errno();
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+  // These return the bytes sent in sent, even when failing with EAGAIN.
+#if defined(__APPLE__)
+  off_t sent = len;
+  const int result = ::sendfile(in_fd, GetFd(), offset, &sent, nullptr, 0);
+#else
+  off_t sent = 0;
+  const int result =
+      ::sendfile(in_fd, GetFd(), offset, len, nullptr, &sent, 0);
+#endif
+  const int send_error = result == 0 ? 0 : error::Errno();
+  if (sent > 0) {
+    return sent;
+  }
+#else
+  // Without a ::sendfile, go through a user space buffer.
+  char buffer[16384];
+  const ssize_t read_cb =
+      ::pread(in_fd, buffer, std::min(len, sizeof(buffer)), offset);
+  if (read_cb < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Reading file descriptor: " << in_fd << " at: " << offset;
+  }
+  if (read_cb > 0) {
+    return Write(buffer, read_cb);
+  }
+  const int send_error = 0;
+#endif
+  if (send_error == 0) {
+    return status::OutOfRangeErrorBuilder()
+           << "File descriptor: " << in_fd << " ended before offset: "
+           << offset << " + " << len;
+  }
+  if (error::IsUnavailableAndShouldRetry(send_error)) {
+    return 0;
+  }
+  return error::ErrnoToStatus(send_error)
+         << "Sending file descriptor: " << in_fd << " to: " << GetFd()
+         << " at: " << offset << " size: " << len;
+}
 
-  if (ABSL_PREDICT_FALSE(cb < 0)) {
-    const int write_error = error::Errno();
-    if (error::IsUnavailableAndShouldRetry(write_error)) {
-      return 0;
+absl::StatusOr<size_t> Selectable::WriteCordVec(const absl::Cord& cord,
+                                                absl::optional<size_t> size) {
+  io::CordIo::IovecBuilder builder(cord, io::CordIo::SizeToWrite(cord, size));
+  size_t written = 0;
+  while (!builder.done()) {
+    const ssize_t cb = ::writev(GetFd(), builder.iovecs(), builder.count());
+    if (ABSL_PREDICT_FALSE(cb < 0)) {
+      const int write_error = error::Errno();
+      if (error::IsUnavailableAndShouldRetry(write_error)) {
+        break;
+      }
+      return error::ErrnoToStatus(write_error)
+             << "Writing data to file descriptor with writev: " << GetFd()
+             << " size: " << builder.batch_size();
+    }
+    const bool partial = size_t(cb) < builder.batch_size();
+    written += cb;
+    builder.Consume(cb);
+    if (partial) {
+      break;  // the rest would block.
     }
-    return error::ErrnoToStatus(error::Errno())
-           << "Writing data to file descriptor with writeev: " << GetFd()
-           << " size: " << size_to_write;
   }
-  return cb;
+  return written;
 }
 
 }  // namespace net
@@ -8,6 +8,7 @@
 namespace whisper {
 namespace net {
 
+class ReadBufferPool;
 class Selector;
 
 class Selectable {
@@ -45,6 +46,13 @@ class Selectable {
   // Closes this selector and its associated file descriptor.
   virtual void Close() = 0;
 
+  // Return true if the object can be watched in edge triggered mode, i.e.
+  // on each read / write event it reads / writes until no more data can be
+  // transferred (EAGAIN). Used only if enabled in the selector.
+  virtual bool SupportsEdgeTriggered() const { return false; }
+  // If this object is currently registered in edge triggered mode.
+  bool edge_triggered() const { return edge_triggered_; }
+
  protected:
   static constexpr int kInvalidFdValue = (-1);
 
@@ -55,22 +63,41 @@ class Selectable {
   absl::StatusOr<size_t> Read(char* buffer, size_t size);
 
   // Reads data from the file descriptor, at most size bytes, and appends it
-  // to the provided Cord.
+  // to the provided Cord. Uses the read buffer pool of the selector, if it
+  // has one.
   absl::StatusOr<size_t> ReadToCord(absl::Cord* cord, size_t len);
+  // Reads, with one ::readv call, at most len bytes in a new block appended
+  // to the cord, and at most overflow_len more in the provided overflow
+  // buffer, which are copied to the cord.
+  absl::StatusOr<size_t> ReadToCordVec(absl::Cord* cord, size_t len,
+                                       char* overflow, size_t overflow_len);
   // Writes data from but from a Cord to the associated file descriptor.
   // If provided, len is the maximum number of bytes to write to the file.
   // Returns the number of bytes written.
   absl::StatusOr<size_t> WriteCord(const absl::Cord& cord,
                                    absl::optional<size_t> len = {});
   // Same as above, but uses vectorized iovec operations, which are
-  // significantly faster for many (smaller) blocks.
+  // significantly faster for many (smaller) blocks. Writes in batches of at
+  // most IOV_MAX chunks, until everything is written or the fd would block.
   // Returns the number of bytes written.
   absl::StatusOr<size_t> WriteCordVec(const absl::Cord& cord,
                                       absl::optional<size_t> len = {});
 
+  // Sends at most len bytes from in_fd (a regular file), starting at
+  // offset, to the associated file descriptor, directly in the kernel
+  // (with ::sendfile). Returns the number of bytes sent.
+  absl::StatusOr<size_t> SendFile(int in_fd, int64_t offset, size_t len);
+
+  // Reads at most len bytes in buffers obtained from the provided pool,
+  // and hands them to the cord without copying.
+  absl::StatusOr<size_t> ReadToCordFromPool(ReadBufferPool* pool,
+                                            absl::Cord* cord, size_t len);
+
   Selector* selector_ = nullptr;
   // the desire for read or write **DO NOT TOUCH** updated by the selector only
   uint32_t desire_ = SelectDesire::kWantRead | SelectDesire::kWantError;
+  // Set by the selector upon registration in edge triggered mode.
+  bool edge_triggered_ = false;
 
   friend class Selector;
 };
@@ -9,6 +9,8 @@
 #include <sys/eventfd.h>
 #endif  // __linux__
 
+#include "absl/log/log.h"
+#include "whisperlib/base/call_on_return.h"
 #include "whisperlib/io/errno.h"
 
 namespace whisper {
@@ -42,6 +44,21 @@ absl::StatusOr<std::unique_ptr<Selector>> Selector::Create(Params params) {
 }
 
 absl::Status Selector::Initialize() {
+  if (params_.alarm_backend == AlarmBackend::TIMING_WHEEL) {
+    absl::MutexLock l(&alarm_mutex_);
+    timing_wheel_ = absl::make_unique<TimingWheel>(
+        params_.timing_wheel_resolution, absl::Now());
+  }
+  if (params_.max_free_read_buffers > 0) {
+    read_buffer_pool_ = ReadBufferPool::Create(params_.read_buffer_size,
+                                               params_.max_free_read_buffers);
+  }
+  if (params_.arena_slab_size > 0) {
+    arena_ = SelectorArena::Create(params_.arena_slab_size);
+  }
+  if (params_.collect_stats) {
+    stats_ = absl::make_unique<SelectorStats>();
+  }
   switch (params_.loop_type) {
     case LoopType::POLL: {
       if (::pipe(signal_pipe_)) {
@@ -54,20 +71,15 @@ absl::Status Selector::Initialize() {
           << "For pipe file descriptor 1.";
       output_signal_fd_ = signal_pipe_[0];
       input_signal_fd_ = signal_pipe_[1];
-      ASSIGN_OR_RETURN(loop_, PollSelectorLoop::Create(output_signal_fd_),
+      ASSIGN_OR_RETURN(loop_,
+                       PollSelectorLoop::Create(output_signal_fd_,
+                                                params_.initial_capacity),
                        _ << "Creating the selector loop based on poll.");
       break;
     }
     case LoopType::EPOLL: {
 #ifdef __linux__
-      event_fd_ = ::eventfd(0, 0);
-      if (event_fd_ < 0) {
-        return error::ErrnoToStatus(error::Errno())
-               << "Creating ::eventfd(..) file descriptor.";
-      }
-      RETURN_IF_ERROR(SetupNonBlocking(event_fd_))
-          << "For event file descriptor.";
-      output_signal_fd_ = input_signal_fd_ = event_fd_;
+      RETURN_IF_ERROR(InitializeEventFd());
       ASSIGN_OR_RETURN(
           loop_,
           EpollSelectorLoop::Create(event_fd_, params_.max_events_per_step),
@@ -78,13 +90,52 @@ absl::Status Selector::Initialize() {
           "epoll(...) not supported on this sytem");
 #endif  // __linux
     }
-    case LoopType::KQUEUE:
+    case LoopType::KQUEUE: {
+#ifdef HAVE_KQUEUE
+      // Woken up through an user event - no signal file descriptors.
+      ASSIGN_OR_RETURN(loop_,
+                       KQueueSelectorLoop::Create(params_.max_events_per_step),
+                       _ << "Creating the selector loop based on kqueue.");
+      break;
+#else
+      return status::UnimplementedErrorBuilder(
+          "kqueue(..) not supported on this sytem");
+#endif  // HAVE_KQUEUE
+    }
+    case LoopType::IO_URING: {
+#ifdef HAVE_IO_URING
+      RETURN_IF_ERROR(InitializeEventFd());
+      ASSIGN_OR_RETURN(
+          loop_,
+          IoUringSelectorLoop::Create(event_fd_, params_.max_events_per_step),
+          _ << "Creating the selector loop based on io_uring.");
+      break;
+#else
       return status::UnimplementedErrorBuilder(
-          "kqueue(..) not implemented on this sytem");
+          "io_uring not supported on this sytem");
+#endif  // HAVE_IO_URING
+    }
   }
+  edge_triggered_ = params_.edge_triggered && loop_->SupportsEdgeTriggered();
   return absl::OkStatus();
 }
 
+absl::Status Selector::InitializeEventFd() {
+#ifdef __linux__
+  event_fd_ = ::eventfd(0, 0);
+  if (event_fd_ < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Creating ::eventfd(..) file descriptor.";
+  }
+  RETURN_IF_ERROR(SetupNonBlocking(event_fd_)) << "For event file descriptor.";
+  output_signal_fd_ = input_signal_fd_ = event_fd_;
+  return absl::OkStatus();
+#else
+  return status::UnimplementedErrorBuilder(
+      "eventfd(...) not supported on this sytem");
+#endif  // __linux__
+}
+
 Selector::~Selector() {
   CHECK(registered_.empty());
   if (input_signal_fd_ >= 0) {
@@ -93,13 +144,93 @@ Selector::~Selector() {
   if (output_signal_fd_ != input_signal_fd_ && output_signal_fd_ > 0) {
     close(output_signal_fd_);
   }
+  if (arena_ != nullptr) {
+    arena_->Unref();
+  }
 }
 
 Selector::Params Selector::params() const { return params_; }
 
+ReadBufferPool* Selector::read_buffer_pool() const {
+  return read_buffer_pool_.get();
+}
+SelectorArena* Selector::arena() const { return arena_; }
+char* Selector::ScratchBuffer(size_t size) {
+  if (size > scratch_buffer_size_) {
+    scratch_buffer_ = absl::make_unique<char[]>(size);
+    scratch_buffer_size_ = size;
+  }
+  return scratch_buffer_.get();
+}
+
 absl::Time Selector::now() const { return absl::FromUnixNanos(now_.load()); }
 void Selector::UpdateNow() { now_.store(absl::GetCurrentTimeNanos()); }
 
+size_t Selector::num_registered() const { return num_registered_.load(); }
+int64_t Selector::buffered_output_bytes() const {
+  return buffered_output_bytes_.load(std::memory_order_relaxed);
+}
+void Selector::AddBufferedOutput(int64_t delta) {
+  buffered_output_bytes_.fetch_add(delta, std::memory_order_relaxed);
+}
+double Selector::loop_utilization() const {
+  return loop_utilization_ppm_.load() * 1e-6;
+}
+
+const SelectorStats* Selector::stats() const { return stats_.get(); }
+
+SelectorStats::Snapshot Selector::GetStatsSnapshot() const {
+  SelectorStats::Snapshot snapshot;
+  if (stats_ != nullptr) {
+    snapshot = stats_->GetSnapshot();
+  }
+  snapshot.loop_utilization = loop_utilization();
+  snapshot.num_registered = num_registered();
+  snapshot.num_alarms = num_registered_alarms_.load();
+  snapshot.buffered_output_bytes =
+      std::max<int64_t>(buffered_output_bytes(), 0);
+  return snapshot;
+}
+
+void Selector::RecordLap(Histogram SelectorStats::*histogram,
+                         absl::Time* lap_start) {
+  if (stats_ == nullptr) {
+    return;
+  }
+  UpdateNow();
+  ((*stats_).*histogram).RecordDuration(now() - *lap_start);
+  *lap_start = now();
+}
+
+void Selector::RecordCallbackRun(absl::Duration duration) {
+  stats_->callback_run_time.RecordDuration(duration);
+  if (ABSL_PREDICT_FALSE(duration > params_.slow_callback_threshold)) {
+    stats_->slow_callbacks.fetch_add(1, std::memory_order_relaxed);
+    LOG_EVERY_N(WARNING, 1000)
+        << "Slow callback in the select loop, ran for: " << duration;
+  }
+}
+
+void Selector::UpdateLoopUtilization(absl::Duration waited) {
+  const absl::Time now = this->now();
+  if (utilization_window_start_ == absl::InfinitePast()) {
+    utilization_window_start_ = now;
+    return;
+  }
+  utilization_window_waited_ += waited;
+  const absl::Duration elapsed = now - utilization_window_start_;
+  if (elapsed < params_.loop_utilization_window ||
+      elapsed <= absl::ZeroDuration()) {
+    return;
+  }
+  const double busy = 1.0 - std::min(1.0, absl::FDivDuration(
+                                              utilization_window_waited_,
+                                              elapsed));
+  loop_utilization_ppm_.store(static_cast<uint32_t>(busy * 1e6));
+  utilization_window_start_ = now;
+  utilization_window_waited_ = absl::ZeroDuration();
+}
+
 absl::Status Selector::EnableWriteCallback(Selectable* s, bool enable) {
   return UpdateDesire(s, enable, SelectDesire::kWantWrite);
 }
@@ -137,7 +268,19 @@ absl::Status Selector::Register(Selectable* s) {
   }
   // Insert in the local set of registered objs
   registered_.insert(s);
-  return loop_->Add(fd, s, s->desire_);
+  num_registered_.store(registered_.size());
+  s->edge_triggered_ = edge_triggered_ && s->SupportsEdgeTriggered();
+  const absl::Status status = loop_->Add(
+      fd, s,
+      s->edge_triggered_ ? s->desire_ | SelectDesire::kEdgeTriggered
+                         : s->desire_);
+  if (!status.ok()) {
+    // Not left registered, as the loop does not know of it.
+    registered_.erase(s);
+    num_registered_.store(registered_.size());
+    s->edge_triggered_ = false;
+  }
+  return status;
 }
 
 absl::Status Selector::Unregister(Selectable* s) {
@@ -146,40 +289,78 @@ absl::Status Selector::Unregister(Selectable* s) {
   RET_CHECK(s->selector() == this)
       << "Selectable registered w/ a different selector.";
   registered_.erase(s);
+  num_registered_.store(registered_.size());
+  edge_events_.erase(s);
+  s->edge_triggered_ = false;
   s->set_selector(nullptr);
   return loop_->Delete(s->GetFd());
 }
 
-void Selector::RunInSelectLoop(std::function<void()> callback) {
-  {
-    absl::MutexLock l(&to_run_mutex_);
-    to_run_.emplace_back(std::move(callback));
-    have_to_run_.store(true);
+void Selector::RunInSelectLoop(Callback callback) {
+  if (stats_ != nullptr &&
+      oldest_to_run_nanos_.load(std::memory_order_relaxed) == 0) {
+    int64_t expected = 0;
+    oldest_to_run_nanos_.compare_exchange_strong(expected,
+                                                 absl::GetCurrentTimeNanos());
   }
-  if (!IsInSelectThread()) {
+  to_run_.enqueue(std::move(callback));
+  have_to_run_.store(true);
+  // No need to wake the loop while busy polling - it picks the callback
+  // on its next step.
+  if (!IsInSelectThread() && !busy_polling_.load() &&
+      !wake_signal_sent_.exchange(true)) {
     SendWakeSignal();
   }
 }
 
-Selector::AlarmId Selector::RegisterAlarm(std::function<void()> callback,
+Selector::AlarmId Selector::RegisterAlarm(Callback callback,
                                           absl::Duration timeout) {
-  absl::Time deadline = absl::Now() + timeout;
+  const absl::Time now = absl::Now();
+  const absl::Time deadline = now + timeout;
   absl::MutexLock l(&alarm_mutex_);
   const AlarmId alarm_id = alarm_id_.fetch_add(1, std::memory_order_acq_rel);
-  alarms_.emplace(alarm_id, std::move(callback));
-  alarm_timeouts_.push_back(std::make_pair(deadline, alarm_id));
-  std::push_heap(alarm_timeouts_.begin(), alarm_timeouts_.end(),
-                 &CompareAlarms);
-  next_alarm_time_.store(absl::ToUnixNanos(alarm_timeouts_.back().first));
-  // std::memory_order_acq_rel);
-  num_registered_alarms_.store(alarms_.size());
+  if (timing_wheel_ != nullptr) {
+    timing_wheel_->Add(alarm_id, now, deadline, std::move(callback));
+  } else {
+    alarms_.emplace(alarm_id, std::move(callback));
+    alarm_timeouts_.push_back(std::make_pair(deadline, alarm_id));
+    std::push_heap(alarm_timeouts_.begin(), alarm_timeouts_.end(),
+                   &CompareAlarms);
+  }
+  UpdateAlarmStats();
   return alarm_id;
 }
 
 void Selector::UnregisterAlarm(AlarmId alarm_id) {
   absl::MutexLock l(&alarm_mutex_);
-  alarms_.erase(alarm_id);
+  if (timing_wheel_ != nullptr) {
+    timing_wheel_->Remove(alarm_id);
+  } else {
+    alarms_.erase(alarm_id);
+  }
+  UpdateAlarmStats();
+}
+
+void Selector::UpdateAlarmStats() {
+  if (timing_wheel_ != nullptr) {
+    num_registered_alarms_.store(timing_wheel_->size());
+    next_alarm_time_.store(absl::ToUnixNanos(timing_wheel_->NextDeadline()));
+    return;
+  }
+  // Drop the cancelled alarms at the top of the heap, which would otherwise
+  // wake up the loop at their deadlines (and, w/ no alarms left to run,
+  // never get popped).
+  while (!alarm_timeouts_.empty() &&
+         !alarms_.contains(alarm_timeouts_.front().second)) {
+    std::pop_heap(alarm_timeouts_.begin(), alarm_timeouts_.end(),
+                  &CompareAlarms);
+    alarm_timeouts_.pop_back();
+  }
   num_registered_alarms_.store(alarms_.size());
+  // The top of the heap is at the front.
+  next_alarm_time_.store(absl::ToUnixNanos(
+      alarm_timeouts_.empty() ? absl::InfiniteFuture()
+                              : alarm_timeouts_.front().first));
 }
 
 absl::Status Selector::CleanAndCloseAll() {
@@ -195,34 +376,45 @@ absl::Status Selector::CleanAndCloseAll() {
   return absl::OkStatus();
 }
 
-std::deque<std::function<void()>> Selector::PopCallbacks(
-    size_t max_num_to_run) {
-  std::deque<std::function<void()>> to_run;
+void Selector::PopCallbacks(size_t max_num_to_run,
+                            std::vector<Callback>* to_run) {
   if (!have_to_run_.load()) {
-    return to_run;
+    return;
+  }
+  // Cleared before dequeueing, so any callback added after this point
+  // turns it on again.
+  have_to_run_.store(false);
+  while (max_num_to_run > to_run->size() && !pending_to_run_.empty()) {
+    to_run->emplace_back(std::move(pending_to_run_.front()));
+    pending_to_run_.pop_front();
+  }
+  const size_t num_popped = to_run->size();
+  if (max_num_to_run > num_popped) {
+    to_run->resize(max_num_to_run);
+    const size_t num_dequeued = to_run_.try_dequeue_bulk(
+        to_run->begin() + num_popped, max_num_to_run - num_popped);
+    to_run->resize(num_popped + num_dequeued);
   }
-  absl::MutexLock m(&to_run_mutex_);
-  while (max_num_to_run > 0u && !to_run_.empty()) {
-    to_run.emplace_back(to_run_.front());
-    to_run_.pop_front();
-    --max_num_to_run;
+  if (!pending_to_run_.empty() || to_run->size() == max_num_to_run) {
+    have_to_run_.store(true);
   }
-  have_to_run_.store(!to_run_.empty());
-  return to_run;
 }
 
-void Selector::PrependCallbacks(std::deque<std::function<void()>>* to_run) {
-  if (!to_run->empty()) {
-    absl::MutexLock m(&to_run_mutex_);
-    while (!to_run->empty()) {
-      to_run_.emplace_front(to_run->back());
-      to_run->pop_back();
+void Selector::PrependCallbacks(std::vector<Callback>* to_run,
+                                size_t begin) {
+  if (begin < to_run->size()) {
+    for (size_t i = to_run->size(); i > begin; --i) {
+      pending_to_run_.emplace_front(std::move((*to_run)[i - 1]));
     }
     have_to_run_.store(true);
   }
+  to_run->clear();
 }
 
 void Selector::ClearSignalFd() {
+  if (output_signal_fd_ < 0) {
+    return;  // the loop has its own wake up mechanism.
+  }
   char buffer[512];
   int cb = 0;
   while ((cb = ::read(output_signal_fd_, buffer, sizeof(buffer))) > 0) {
@@ -230,21 +422,64 @@ void Selector::ClearSignalFd() {
 }
 
 size_t Selector::RunCallbacks(size_t max_num_to_run) {
+  // Producers that come after this need to wake us up again.
+  wake_signal_sent_.store(false);
   ClearSignalFd();
-  std::deque<std::function<void()>> to_run = PopCallbacks(max_num_to_run);
+  std::vector<Callback> to_run;
+  to_run.reserve(max_num_to_run);
+  int64_t oldest_nanos = 0;
+  if (stats_ != nullptr) {
+    stats_->callback_queue_depth.Record(to_run_.size_approx() +
+                                        pending_to_run_.size());
+    // Before popping, so the callbacks added meanwhile get a new timestamp.
+    oldest_nanos = oldest_to_run_nanos_.exchange(0);
+  }
+  PopCallbacks(max_num_to_run, &to_run);
   const absl::Time start_time = absl::Now();
   const absl::Time deadline = start_time + params_.callbacks_timeout_per_event;
+  if (stats_ != nullptr && !to_run.empty()) {
+    if (oldest_nanos != 0) {
+      stats_->callback_wait_time.RecordDuration(
+          start_time - absl::FromUnixNanos(oldest_nanos));
+    }
+    if (have_to_run_.load()) {
+      // Some callbacks are left for the next step - they were queued before
+      // now, which is the best timestamp we have for them.
+      const int64_t start_nanos = absl::ToUnixNanos(start_time);
+      int64_t current = oldest_to_run_nanos_.load();
+      while ((current == 0 || current > start_nanos) &&
+             !oldest_to_run_nanos_.compare_exchange_weak(current,
+                                                         start_nanos)) {
+      }
+    }
+  }
   size_t num_run = 0;
-  while (!to_run.empty() && absl::Time() < deadline) {
-    to_run.front()();
-    to_run.pop_front();
+  absl::Time run_start = start_time;
+  while (num_run < to_run.size() && run_start < deadline) {
+    to_run[num_run]();
     ++num_run;
+    const absl::Time run_end = absl::Now();
+    if (stats_ != nullptr) {
+      RecordCallbackRun(run_end - run_start);
+    }
+    run_start = run_end;
+  }
+  if (stats_ != nullptr) {
+    stats_->callbacks.fetch_add(num_run, std::memory_order_relaxed);
   }
-  PrependCallbacks(&to_run);
+  PrependCallbacks(&to_run, num_run);
   return num_run;
 }
 
 void Selector::SendWakeSignal() {
+  if (input_signal_fd_ < 0) {
+    const absl::Status status = loop_->Wakeup();
+    if (ABSL_PREDICT_FALSE(!status.ok())) {
+      LOG_EVERY_N(WARNING, 1000)
+          << status << " - Error waking up the selector loop.";
+    }
+    return;
+  }
   uint64_t value = 1ULL;
   const int cb = ::write(input_signal_fd_, &value, sizeof(value));
   if (ABSL_PREDICT_FALSE(cb < 0)) {
@@ -268,17 +503,75 @@ absl::Status Selector::UpdateDesire(Selectable* s, bool enable,
   } else {
     s->desire_ &= ~desire;
   }
+  if (s->edge_triggered_) {
+    // No need to update the loop, but the edge for a newly enabled desire
+    // may have been already consumed - so we generate an event for it.
+    if (enable && registered_.contains(s)) {
+      edge_events_[s] |= desire;
+    }
+    return absl::OkStatus();
+  }
   return loop_->Update(s->GetFd(), s, s->desire_);
 }
 
+void Selector::DispatchEvent(Selectable* s, SelectorEventData event) {
+  // During HandleXEvent the obj may be closed loosing so track of
+  // it's fd value.
+  uint32_t desire = event.desires;
+  if (s->edge_triggered_) {
+    // We watch everything, so filter out what is not desired now.
+    desire &= s->desire_ | SelectDesire::kWantError;
+  }
+  bool keep_processing = true;
+  if (desire & SelectDesire::kWantError) {
+    keep_processing =
+        (s->HandleErrorEvent(event) && s->GetFd() != kInvalidFdValue);
+  }
+  if (keep_processing && (desire & SelectDesire::kWantRead)) {
+    keep_processing =
+        (s->HandleReadEvent(event) && s->GetFd() != kInvalidFdValue);
+  }
+  if (keep_processing && (desire & SelectDesire::kWantWrite)) {
+    s->HandleWriteEvent(event);
+  }
+}
+
+void Selector::DispatchEdgeEvents() {
+  if (edge_events_.empty()) {
+    return;
+  }
+  std::vector<std::pair<Selectable*, uint32_t>> events(edge_events_.begin(),
+                                                       edge_events_.end());
+  edge_events_.clear();
+  for (const auto& event : events) {
+    Selectable* const s = event.first;
+    // May have been unregistered by the handlers of a previous one.
+    if (s->selector() != this || !registered_.contains(s)) {
+      continue;
+    }
+    DispatchEvent(s, SelectorEventData{s, event.second, 0, true});
+  }
+}
+
 absl::Status Selector::Loop() {
   should_end_.store(false);
   tid_.store(uint64_t(pthread_self()));
+  SelectorArena* const previous_arena = SelectorArena::SetCurrent(arena_);
+  base::CallOnReturn restore_arena(
+      [previous_arena]() { SelectorArena::SetCurrent(previous_arena); });
 
+  // We busy poll for events until this time - see Params.
+  absl::Time busy_poll_until = absl::InfinitePast();
   while (!should_end_.load()) {
     absl::Duration loop_timeout = params_.default_loop_timeout;
     UpdateNow();
-    if (have_to_run_.load()) {
+    const bool busy_poll = now() < busy_poll_until;
+    if (busy_polling_.load(std::memory_order_relaxed) != busy_poll) {
+      // When we stop busy polling, have_to_run_ is checked below after this
+      // store, so we cannot miss a callback registered w/o a wake signal.
+      busy_polling_.store(busy_poll);
+    }
+    if (busy_poll || have_to_run_.load() || !edge_events_.empty()) {
       loop_timeout = absl::ZeroDuration();
     } else {
       const absl::Duration alarm_delta =
@@ -290,36 +583,43 @@ absl::Status Selector::Loop() {
         loop_timeout = alarm_delta;
       }
     }
-    ASSIGN_OR_RETURN(std::vector<SelectorEventData> events,
+    const absl::Time wait_start = now();
+    ASSIGN_OR_RETURN(absl::Span<const SelectorEventData> events,
                      loop_->LoopStep(loop_timeout),
                      _ << "During selector loop execution.");
     UpdateNow();
-    for (auto event : events) {
+    UpdateLoopUtilization(now() - wait_start);
+    absl::Time lap_start = now();
+    if (stats_ != nullptr) {
+      stats_->loop_steps.fetch_add(1, std::memory_order_relaxed);
+      stats_->events.fetch_add(events.size(), std::memory_order_relaxed);
+      stats_->events_per_step.Record(events.size());
+      stats_->wait_time.RecordDuration(lap_start - wait_start);
+    }
+    for (const SelectorEventData& event : events) {
       Selectable* const s = reinterpret_cast<Selectable*>(event.user_data);
       if (s == nullptr || s->selector() != this) {
         // was probably a wake signal or already unregistered
         continue;
       }
-      // During HandleXEvent the obj may be closed loosing so track of
-      // it's fd value.
-      const uint32_t desire = event.desires;
-      bool keep_processing = true;
-      if (desire & SelectDesire::kWantError) {
-        keep_processing =
-            (s->HandleErrorEvent(event) && s->GetFd() != kInvalidFdValue);
-      }
-      if (keep_processing && (desire & SelectDesire::kWantRead)) {
-        keep_processing =
-            (s->HandleReadEvent(event) && s->GetFd() != kInvalidFdValue);
-      }
-      if (keep_processing && (desire & SelectDesire::kWantWrite)) {
-        s->HandleWriteEvent(event);
-      }
+      DispatchEvent(s, event);
+    }
+    DispatchEdgeEvents();
+    RecordLap(&SelectorStats::event_time, &lap_start);
+    const size_t num_callbacks = LoopCallbacks();
+    if (num_callbacks > 0) {
+      RecordLap(&SelectorStats::callback_time, &lap_start);
+    }
+    const size_t num_alarms = LoopAlarms();
+    if (num_alarms > 0) {
+      RecordLap(&SelectorStats::alarm_time, &lap_start);
+    }
+    if (params_.busy_poll_duration > absl::ZeroDuration() &&
+        (!events.empty() || num_callbacks > 0 || num_alarms > 0)) {
+      busy_poll_until = now() + params_.busy_poll_duration;
     }
-    // TODO(cpopescu): track down long calls and many calls.
-    LoopCallbacks();
-    LoopAlarms();
   }
+  busy_polling_.store(false);
   CleanAndCloseAll().IgnoreError();
   if (call_on_close_) {
     call_on_close_();
@@ -347,31 +647,50 @@ size_t Selector::LoopAlarms() {
     return 0;
   }
   UpdateNow();
-  std::vector<std::function<void()>> to_run;
+  std::vector<Callback> to_run;
   {
     absl::Time end_alarms = now();
     absl::MutexLock l(&alarm_mutex_);
-    while (!alarm_timeouts_.empty() &&
-           alarm_timeouts_.back().first <= end_alarms) {
-      const AlarmId alarm_id = alarm_timeouts_.back().second;
-      std::pop_heap(alarm_timeouts_.begin(), alarm_timeouts_.end(),
-                    &CompareAlarms);
-      alarm_timeouts_.pop_back();
-      auto it = alarms_.find(alarm_id);
-      if (it != alarms_.end()) {
-        to_run.emplace_back(std::move(it->second));
-        alarms_.erase(it);
+    if (timing_wheel_ != nullptr) {
+      const absl::Time first_deadline = timing_wheel_->NextDeadline();
+      if (timing_wheel_->Advance(end_alarms, &to_run) > 0 &&
+          stats_ != nullptr) {
+        stats_->alarm_lateness.RecordDuration(end_alarms - first_deadline);
       }
+    } else {
+      while (!alarm_timeouts_.empty() &&
+             alarm_timeouts_.front().first <= end_alarms) {
+        const AlarmId alarm_id = alarm_timeouts_.front().second;
+        if (stats_ != nullptr && alarms_.contains(alarm_id)) {
+          stats_->alarm_lateness.RecordDuration(
+              end_alarms - alarm_timeouts_.front().first);
+        }
+        std::pop_heap(alarm_timeouts_.begin(), alarm_timeouts_.end(),
+                      &CompareAlarms);
+        alarm_timeouts_.pop_back();
+        auto it = alarms_.find(alarm_id);
+        if (it != alarms_.end()) {
+          to_run.emplace_back(std::move(it->second));
+          alarms_.erase(it);
+        }
+      }
+    }
+    UpdateAlarmStats();
+  }
+  if (stats_ == nullptr) {
+    for (auto& callback : to_run) {
+      callback();
     }
-    num_registered_alarms_.store(alarms_.size());
-    next_alarm_time_.store(absl::ToUnixNanos(
-        alarm_timeouts_.empty()
-            ? absl::InfinitePast()
-            : alarm_timeouts_.back().first));  // , std::memory_order_acq_rel);
+    return to_run.size();
   }
-  for (auto callback : to_run) {
+  absl::Time start = absl::Now();
+  for (auto& callback : to_run) {
     callback();
+    const absl::Time end = absl::Now();
+    RecordCallbackRun(end - start);
+    start = end;
   }
+  stats_->alarms.fetch_add(to_run.size(), std::memory_order_relaxed);
   return to_run.size();
 }
 
@@ -392,13 +711,15 @@ bool Selector::IsInputEvent(int event_value) const {
 }
 
 absl::StatusOr<std::unique_ptr<SelectorThread>> SelectorThread::Create(
-    Selector::Params params) {
-  auto st = absl::WrapUnique(new SelectorThread());
+    Selector::Params params, work::ThreadOptions thread_options) {
+  RET_CHECK(thread_options.joinable) << "Selector threads must be joinable.";
+  auto st = absl::WrapUnique(new SelectorThread(std::move(thread_options)));
   RETURN_IF_ERROR(st->Initialize(std::move(params)));
   return st;
 }
 
-SelectorThread::SelectorThread() {}
+SelectorThread::SelectorThread(work::ThreadOptions thread_options)
+    : thread_options_(std::move(thread_options)) {}
 
 SelectorThread::~SelectorThread() { Stop(); }
 
@@ -407,13 +728,19 @@ bool SelectorThread::Start() {
   if (thread_ != nullptr || is_started_.load()) {
     return false;
   }
-  thread_ = absl::make_unique<std::thread>(&SelectorThread::Run, this);
+  auto thread = work::Thread::Create([this]() { Run(); }, thread_options_);
+  if (!thread.ok()) {
+    LOG(ERROR) << "Cannot start selector thread: " << thread.status();
+    selector_status_ = thread.status();
+    return false;
+  }
+  thread_ = std::move(thread).value();
   is_started_.store(true);
   return true;
 }
 
 bool SelectorThread::Stop() {
-  std::unique_ptr<std::thread> saved_thread;
+  std::unique_ptr<work::Thread> saved_thread;
   {
     absl::WriterMutexLock l(&mutex_);
     saved_thread = std::move(thread_);
@@ -422,7 +749,8 @@ bool SelectorThread::Stop() {
     return false;
   }
   selector_->MakeLoopExit();
-  saved_thread->join();
+  const absl::Status status = saved_thread->Join();
+  LOG_IF(ERROR, !status.ok()) << "Joining selector thread: " << status;
   is_started_.store(false);
   return true;
 }
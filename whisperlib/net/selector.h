@@ -4,6 +4,7 @@
 #include <atomic>
 #include <deque>
 #include <functional>
+#include <memory>
 #include <thread>
 #include <vector>
 
@@ -13,9 +14,16 @@
 #include "absl/status/statusor.h"
 #include "absl/synchronization/mutex.h"
 #include "absl/time/time.h"
+#include "whisperlib/base/inline_function.h"
+#include "whisperlib/net/read_buffer_pool.h"
 #include "whisperlib/net/selectable.h"
+#include "whisperlib/net/selector_arena.h"
 #include "whisperlib/net/selector_event_data.h"
 #include "whisperlib/net/selector_loop.h"
+#include "whisperlib/net/selector_stats.h"
+#include "whisperlib/net/timing_wheel.h"
+#include "whisperlib/sync/moody/concurrentqueue.h"
+#include "whisperlib/sync/thread.h"
 
 namespace whisper {
 namespace net {
@@ -39,10 +47,20 @@ namespace net {
 //
 class Selector {
  public:
+  // Callbacks run in the select loop - move only, and stored inline for
+  // captures of up to 48 bytes (no heap allocation).
+  using Callback = base::InlineFunction<void()>;
+
   enum class LoopType {
     POLL,    // uses poll(..) w/ pipe for signaling
     EPOLL,   // uses epoll(..) w/ eventfd (Linux)
     KQUEUE,  // uses kqueue w/ kevents and EVFILT_USER (MacOS/BSD)
+    IO_URING,  // uses io_uring poll requests w/ eventfd (Linux >= 5.11)
+  };
+
+  enum class AlarmBackend {
+    HEAP,          // binary heap of deadlines - O(log n) operations
+    TIMING_WHEEL,  // hierarchical timing wheel - O(1) add / remove
   };
 
   struct Params {
@@ -58,6 +76,41 @@ class Selector {
     absl::Duration default_loop_timeout = absl::Seconds(1);
     // Which type of loop type to use - system dependent.
     LoopType loop_type = LoopType::POLL;
+    // Size of the buffers in the read buffer pool of this selector.
+    size_t read_buffer_size = 16384;
+    // Maximum number of free buffers kept in the read buffer pool.
+    // If zero, no pool is used, and each read allocates its own buffer.
+    size_t max_free_read_buffers = 0;
+    // How alarms are kept - a heap is better for few alarms, while
+    // the timing wheel scales with many (e.g. per connection timeouts).
+    AlarmBackend alarm_backend = AlarmBackend::HEAP;
+    // The tick of the timing wheel - alarms expire with this precision.
+    absl::Duration timing_wheel_resolution = absl::Milliseconds(1);
+    // The loop utilization is measured over windows of this duration.
+    absl::Duration loop_utilization_window = absl::Milliseconds(100);
+    // Registers the selectables that support it (e.g. TcpConnection) in
+    // edge triggered mode: their file descriptor is armed once for all
+    // events, and enabling / disabling read or write callbacks requires no
+    // system call. Supported only by the EPOLL loop, ignored for the others.
+    bool edge_triggered = false;
+    // After some activity (I/O events, callbacks or alarms), the loop keeps
+    // polling for events with zero timeout for this long, before blocking
+    // again. Trades CPU for wake up latency: while polling, the callbacks
+    // registered from other threads are picked without the wake signal
+    // system calls, and the events are picked without the scheduler delay.
+    // The time spent polling counts as waiting in the loop_utilization.
+    absl::Duration busy_poll_duration = absl::ZeroDuration();
+    // If non zero, the objects that support it (e.g. the connections, and
+    // their per connection state), when created in the select loop, are
+    // allocated from a SelectorArena w/ slabs of this size.
+    size_t arena_slab_size = 0;
+    // Collects the SelectorStats of the loop: counters, and histograms of
+    // the time spent in each phase of the loop steps, callback queueing and
+    // alarm lateness. Costs a few clock reads per loop step.
+    bool collect_stats = false;
+    // When collecting stats, the callbacks and alarms running longer than
+    // this are counted (and logged) as slow.
+    absl::Duration slow_callback_threshold = absl::Milliseconds(50);
 
     Params& set_loop_type(LoopType value) {
       loop_type = value;
@@ -83,6 +136,46 @@ class Selector {
       default_loop_timeout = value;
       return *this;
     }
+    Params& set_read_buffer_size(size_t value) {
+      read_buffer_size = value;
+      return *this;
+    }
+    Params& set_max_free_read_buffers(size_t value) {
+      max_free_read_buffers = value;
+      return *this;
+    }
+    Params& set_alarm_backend(AlarmBackend value) {
+      alarm_backend = value;
+      return *this;
+    }
+    Params& set_timing_wheel_resolution(absl::Duration value) {
+      timing_wheel_resolution = value;
+      return *this;
+    }
+    Params& set_loop_utilization_window(absl::Duration value) {
+      loop_utilization_window = value;
+      return *this;
+    }
+    Params& set_edge_triggered(bool value) {
+      edge_triggered = value;
+      return *this;
+    }
+    Params& set_busy_poll_duration(absl::Duration value) {
+      busy_poll_duration = value;
+      return *this;
+    }
+    Params& set_arena_slab_size(size_t value) {
+      arena_slab_size = value;
+      return *this;
+    }
+    Params& set_collect_stats(bool value) {
+      collect_stats = value;
+      return *this;
+    }
+    Params& set_slow_callback_threshold(absl::Duration value) {
+      slow_callback_threshold = value;
+      return *this;
+    }
   };
   // Creation method - use to create a selector object.
   static absl::StatusOr<std::unique_ptr<Selector>> Create(Params params);
@@ -125,7 +218,7 @@ class Selector {
 
   // Runs this function in the select loop.
   // NOTE: safe to call from any thread.
-  void RunInSelectLoop(std::function<void()> callback);
+  void RunInSelectLoop(Callback callback);
   // Schedules the deletion of the provided object in the select loop.
   template <typename T>
   void DeleteInSelectLoop(T* t) {
@@ -133,16 +226,14 @@ class Selector {
   }
   template <typename T>
   void DeleteInSelectLoop(std::unique_ptr<T> t) {
-    // TODO(cp): use a helper object to be able to move this in c++11.
-    T* pt = t.release();
-    RunInSelectLoop([t]() { delete t; });
+    RunInSelectLoop([t = std::move(t)]() mutable { t.reset(); });
   }
 
   using AlarmId = uint64_t;
   // Runs the provided function after a timeout in the select loop.
   // Returns an alarm_id that can be used to unregister the alarm.
   // NOTE: safe to call from any thread.
-  AlarmId RegisterAlarm(std::function<void()> callback, absl::Duration timeout);
+  AlarmId RegisterAlarm(Callback callback, absl::Duration timeout);
   // Unregistered a previously registered alarm.
   // NOTE: safe to call from any thread.
   void UnregisterAlarm(AlarmId alarm_id);
@@ -150,12 +241,42 @@ class Selector {
   // Parameters of this selector.
   Params params() const;
 
+  // The pool of buffers used by the selectables for reading data.
+  // Null if not enabled in params.
+  ReadBufferPool* read_buffer_pool() const;
+  // The arena for the objects allocated in the select loop.
+  // Null if not enabled in params.
+  SelectorArena* arena() const;
+  // A scratch buffer of at least size bytes, for the selectables to use
+  // while processing in the select loop (e.g. to read past their buffers).
+  // Valid until the next call. Call only from the select loop thread.
+  char* ScratchBuffer(size_t size);
+
   // The last time we were in the select loop not executing anything.
   absl::Time now() const;
 
   // The current moment when the select loop was broken:
   absl::Time loop_now() const;
 
+  // Number of selectables registered with this selector.
+  // NOTE: safe to call from any thread.
+  size_t num_registered() const;
+  // The fraction of time (between 0 and 1) the loop spent processing, and
+  // not waiting for events, in the last loop_utilization_window.
+  // NOTE: safe to call from any thread.
+  double loop_utilization() const;
+  // Bytes buffered for output by the connections in this selector, and
+  // not yet sent - see Connection::set_output_watermarks().
+  // NOTE: safe to call from any thread.
+  int64_t buffered_output_bytes() const;
+  void AddBufferedOutput(int64_t delta);
+  // The live stats of the loop - null if not enabled in params.
+  const SelectorStats* stats() const;
+  // A snapshot of the stats (all zero if not enabled), and the current
+  // loop utilization, registered selectables and alarms.
+  // NOTE: safe to call from any thread.
+  SelectorStats::Snapshot GetStatsSnapshot() const;
+
   // Identifies various signals in the provided event value, based
   // on the underlying loop_ implementation.
   bool IsHangUpEvent(int event_value) const;
@@ -171,8 +292,15 @@ class Selector {
 
   // Initializes the selector object.
   absl::Status Initialize();
+  // Creates the event_fd_ used for signaling, for loops that support it.
+  absl::Status InitializeEventFd();
   // Helper that turns on/off fd desires in the provided selectable.
   absl::Status UpdateDesire(Selectable* s, bool enable, uint32_t desire);
+  // Calls the handlers of the provided selectable for the event.
+  void DispatchEvent(Selectable* s, SelectorEventData event);
+  // Dispatches the events synthesized for the edge triggered selectables
+  // that re-enabled their desires.
+  void DispatchEdgeEvents();
   // This runs functions from to_run_ (if any).
   size_t RunCallbacks(size_t max_num_to_run);
   // Writes a byte in the internal signal_fd_ to make the loop wake up.
@@ -181,12 +309,25 @@ class Selector {
   size_t LoopCallbacks();
   // Runs int the main loop the alarms at this step.
   size_t LoopAlarms();
+  // Updates next_alarm_time_ and num_registered_alarms_ from the alarm
+  // structures.
+  void UpdateAlarmStats() ABSL_EXCLUSIVE_LOCKS_REQUIRED(alarm_mutex_);
   // Updates the now_ to current time.
   void UpdateNow();
-  // Pops some callbacks to be run from to_run_ queue.
-  std::deque<std::function<void()>> PopCallbacks(size_t max_num_to_run);
-  // Prepends the callbacks in to_run to the internal to_run_ queue.
-  void PrependCallbacks(std::deque<std::function<void()>>* to_run);
+  // Accounts the time waited for events in a loop step, publishing the
+  // loop utilization at the end of each window.
+  void UpdateLoopUtilization(absl::Duration waited);
+  // Updates now_, and records in the histogram the time since lap_start,
+  // which is moved to now - when collecting stats.
+  void RecordLap(Histogram SelectorStats::*histogram, absl::Time* lap_start);
+  // Accounts a callback or alarm that ran for the duration.
+  void RecordCallbackRun(absl::Duration duration);
+  // Pops some callbacks to be run from pending_to_run_ and to_run_ queue
+  // into to_run.
+  void PopCallbacks(size_t max_num_to_run, std::vector<Callback>* to_run);
+  // Saves the callbacks in to_run, starting at begin, to be the first ones
+  // to be run in the next step.
+  void PrependCallbacks(std::vector<Callback>* to_run, size_t begin);
   // Cleans the bytes in the signaling file descriptor.
   void ClearSignalFd();
 
@@ -214,26 +355,68 @@ class Selector {
   // Our select loop - does poll / epoll etc on file descriptors.
   std::unique_ptr<SelectorLoop> loop_;
 
+  // Recycled buffers for reading data - if enabled.
+  std::shared_ptr<ReadBufferPool> read_buffer_pool_;
+  // Memory for the objects allocated in the select loop - if enabled.
+  // We hold a reference, released on destruction.
+  SelectorArena* arena_ = nullptr;
+  // Returned by ScratchBuffer() - grows as needed.
+  std::unique_ptr<char[]> scratch_buffer_;
+  size_t scratch_buffer_size_ = 0;
+
   // Selectables registered with us - modified only from the select loop thread.
   absl::flat_hash_set<Selectable*> registered_;
-
-  // Guards the to_run_ deque.
-  absl::Mutex to_run_mutex_;
-  // Registered callbacks to run in the select loop.
-  std::deque<std::function<void()>> to_run_ ABSL_GUARDED_BY(to_run_mutex_);
+  // The size of registered_, for reading from other threads.
+  std::atomic_size_t num_registered_ = ATOMIC_VAR_INIT(0);
+  // If we register in edge triggered mode the selectables supporting it.
+  bool edge_triggered_ = false;
+  // Edge triggered selectables that enabled some desires since their last
+  // edge, so they may miss it: we synthesize the events for these desires
+  // on the next loop step - accessed only from the select loop thread.
+  absl::flat_hash_map<Selectable*, uint32_t> edge_events_;
+
+  // Start of the current loop utilization window, and the time we waited
+  // for events in it - accessed only from the select loop thread.
+  absl::Time utilization_window_start_ = absl::InfinitePast();
+  absl::Duration utilization_window_waited_ = absl::ZeroDuration();
+  // Loop utilization in the last window, in parts per million.
+  std::atomic_uint32_t loop_utilization_ppm_ = ATOMIC_VAR_INIT(0);
+  // Instrumentation of the loop - if enabled.
+  std::unique_ptr<SelectorStats> stats_;
+  // Enqueue time (unix nanos) of the oldest callback not yet popped from
+  // to_run_, or zero - maintained only when collecting stats.
+  std::atomic<int64_t> oldest_to_run_nanos_ = ATOMIC_VAR_INIT(0);
+
+  // Registered callbacks to run in the select loop - a lock free multi
+  // producer queue, consumed by the select loop.
+  // NOTE: callbacks registered from the same thread run in order, but there
+  // is no ordering between callbacks registered from different threads.
+  moodycamel::ConcurrentQueue<Callback> to_run_;
+  // Callbacks popped from to_run_, but not run in a previous loop step.
+  // Accessed only from the select loop thread.
+  std::deque<Callback> pending_to_run_;
   // If we have callbacks to run.
   std::atomic_bool have_to_run_ = ATOMIC_VAR_INIT(false);
+  // Set when a wake signal was sent, and the select loop did not yet
+  // consume the callbacks - so only the first callback registered after
+  // they were consumed needs to write to the signal file descriptor.
+  std::atomic_bool wake_signal_sent_ = ATOMIC_VAR_INIT(false);
+  // Set while the loop busy polls for events, so the callbacks registered
+  // from other threads need no wake signal.
+  std::atomic_bool busy_polling_ = ATOMIC_VAR_INIT(false);
 
   // Guards the alarm structures.
   absl::Mutex alarm_mutex_;
   // Id of the next added alarm.
   std::atomic_uint64_t alarm_id_ = ATOMIC_VAR_INIT(0);
   // Maps from alarm id to alarm callback.
-  absl::flat_hash_map<AlarmId, std::function<void()>> alarms_
-      ABSL_GUARDED_BY(alarm_mutex_);
+  absl::flat_hash_map<AlarmId, Callback> alarms_ ABSL_GUARDED_BY(alarm_mutex_);
   // Heap of alarm times and alarm ids.
   std::vector<std::pair<absl::Time, AlarmId>> alarm_timeouts_
       ABSL_GUARDED_BY(alarm_mutex_);
+  // When using a timing wheel for alarms, this replaces the alarms_ and
+  // alarm_timeouts_ above.
+  std::unique_ptr<TimingWheel> timing_wheel_ ABSL_GUARDED_BY(alarm_mutex_);
   // The next alarm time - top of the alarm_timeouts_ heap.
   // This is the nanos of the time - cannot use atomic<absl::Time> on all
   // architectures.
@@ -241,6 +424,8 @@ class Selector {
       ATOMIC_VAR_INIT(absl::ToUnixNanos(absl::InfiniteFuture()));
   // Number of registered alarms - for quick checking.
   std::atomic_size_t num_registered_alarms_ = ATOMIC_VAR_INIT(0);
+  // Sum of the output buffered in the connections of this selector.
+  std::atomic<int64_t> buffered_output_bytes_ = ATOMIC_VAR_INIT(0);
   // We call this function upon exiting loop.
   std::function<void()> call_on_close_ = nullptr;
   // The last time we broke the loop.
@@ -251,11 +436,14 @@ class Selector {
 class SelectorThread {
  public:
   // Creates a *stopped* selector thread.
+  // The thread_options control the placement of the thread (CPU affinity,
+  // NUMA node, scheduling, name) - it must be joinable.
   static absl::StatusOr<std::unique_ptr<SelectorThread>> Create(
-      Selector::Params params = {});
+      Selector::Params params = {}, work::ThreadOptions thread_options = {});
 
   // Starts the selector in the side thread.
-  // Returns true if started now, false if it is already started.
+  // Returns true if started now, false if it is already started, or if the
+  // thread could not be started (selector_status() has the error).
   bool Start();
   // Ends the selector thread via a MakeLoopExit, then waiting for thread
   // to end.
@@ -277,7 +465,7 @@ class SelectorThread {
   ~SelectorThread();
 
  private:
-  SelectorThread();
+  explicit SelectorThread(work::ThreadOptions thread_options);
   absl::Status Initialize(Selector::Params params);
   void Run();
 
@@ -285,8 +473,10 @@ class SelectorThread {
   std::unique_ptr<Selector> selector_;
   // Locks access to internal members.
   mutable absl::Mutex mutex_;
+  // How to create the thread for the selector loop.
+  const work::ThreadOptions thread_options_;
   // Running thread for the selector loop.
-  std::unique_ptr<std::thread> thread_ ABSL_GUARDED_BY(mutex_);
+  std::unique_ptr<work::Thread> thread_ ABSL_GUARDED_BY(mutex_);
   // Status of the last selector loop.
   absl::Status selector_status_ ABSL_GUARDED_BY(mutex_);
   // If the selector loop is currently running.
@@ -0,0 +1,131 @@
+#include "whisperlib/net/selector_arena.h"
+
+#include <algorithm>
+#include <new>
+
+#include "absl/base/optimization.h"
+#include "absl/log/check.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+thread_local SelectorArena* current_arena = nullptr;
+}  // namespace
+
+SelectorArena* SelectorArena::Create(size_t slab_size) {
+  return new SelectorArena(slab_size);
+}
+
+SelectorArena::SelectorArena(size_t slab_size)
+    : slab_size_(std::max(slab_size, sizeof(Header) + kMaxBlockSize)),
+      free_blocks_(kNumSizeClasses) {}
+
+SelectorArena::~SelectorArena() {
+  for (char* slab : slabs_) {
+    ::operator delete(slab);
+  }
+}
+
+SelectorArena* SelectorArena::Current() { return current_arena; }
+
+SelectorArena* SelectorArena::SetCurrent(SelectorArena* arena) {
+  SelectorArena* const previous = current_arena;
+  current_arena = arena;
+  return previous;
+}
+
+void* SelectorArena::New(size_t size) {
+  SelectorArena* const arena = current_arena;
+  if (ABSL_PREDICT_TRUE(arena != nullptr && size <= kMaxBlockSize)) {
+    const size_t size_class =
+        (std::max(size, size_t(1)) - 1) / kSizeClassGranularity;
+    return arena->Allocate(size_class);
+  }
+  Header* const header =
+      static_cast<Header*>(::operator new(sizeof(Header) + size));
+  header->arena = nullptr;
+  header->size_class = 0;
+  return header + 1;
+}
+
+void SelectorArena::Delete(void* p) {
+  if (p == nullptr) {
+    return;
+  }
+  Header* const header = static_cast<Header*>(p) - 1;
+  if (header->arena == nullptr) {
+    ::operator delete(header);
+  } else {
+    header->arena->Deallocate(header);
+  }
+}
+
+void SelectorArena::Unref() {
+  if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete this;
+  }
+}
+
+void* SelectorArena::Allocate(size_t size_class) {
+  DCHECK_LT(size_class, kNumSizeClasses);
+  refs_.fetch_add(1, std::memory_order_relaxed);
+  if (ABSL_PREDICT_FALSE(has_remote_frees_.load(std::memory_order_relaxed))) {
+    CollectRemoteFrees();
+  }
+  std::vector<Header*>& free_blocks = free_blocks_[size_class];
+  Header* header;
+  if (!free_blocks.empty()) {
+    header = free_blocks.back();
+    free_blocks.pop_back();
+  } else {
+    header = Carve(size_class);
+  }
+  return header + 1;
+}
+
+void SelectorArena::Deallocate(Header* header) {
+  if (current_arena == this) {
+    free_blocks_[header->size_class].push_back(header);
+  } else {
+    absl::MutexLock l(&remote_mutex_);
+    remote_frees_.push_back(header);
+    has_remote_frees_.store(true, std::memory_order_relaxed);
+    num_remote_frees_.fetch_add(1, std::memory_order_relaxed);
+  }
+  Unref();
+}
+
+void SelectorArena::CollectRemoteFrees() {
+  std::vector<Header*> remote_frees;
+  {
+    absl::MutexLock l(&remote_mutex_);
+    remote_frees.swap(remote_frees_);
+    has_remote_frees_.store(false, std::memory_order_relaxed);
+  }
+  for (Header* header : remote_frees) {
+    free_blocks_[header->size_class].push_back(header);
+  }
+}
+
+SelectorArena::Header* SelectorArena::Carve(size_t size_class) {
+  const size_t block_size =
+      sizeof(Header) + (size_class + 1) * kSizeClassGranularity;
+  if (ABSL_PREDICT_FALSE(size_t(slab_free_end_ - slab_free_begin_) <
+                         block_size)) {
+    // The rest of the current slab is lost - at most kMaxBlockSize bytes.
+    char* const slab = static_cast<char*>(::operator new(slab_size_));
+    slabs_.push_back(slab);
+    num_slabs_.fetch_add(1, std::memory_order_relaxed);
+    slab_free_begin_ = slab;
+    slab_free_end_ = slab + slab_size_;
+  }
+  Header* const header = reinterpret_cast<Header*>(slab_free_begin_);
+  slab_free_begin_ += block_size;
+  header->arena = this;
+  header->size_class = size_class;
+  return header;
+}
+
+}  // namespace net
+}  // namespace whisper
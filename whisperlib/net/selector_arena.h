@@ -0,0 +1,141 @@
+#ifndef WHISPERLIB_NET_SELECTOR_ARENA_H_
+#define WHISPERLIB_NET_SELECTOR_ARENA_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+
+namespace whisper {
+namespace net {
+
+// A slab allocator local to a Selector, for the objects created and
+// destroyed in its select loop (e.g. the accepted connections, and their
+// per connection state) - so these need no synchronization with the other
+// threads in the memory allocator, and are kept close in memory.
+//
+// The memory is carved in blocks from slabs of slab_size bytes, and the
+// freed blocks are kept in per size class free lists (as base::FreeList
+// does, but w/ no allocation per object) - the slabs are released only
+// when the arena is destroyed.
+//
+// Each block starts with a small header that identifies its arena, so it
+// can be freed from any thread (through Delete): the blocks freed by other
+// threads are queued, and reused by the select loop on its next allocation.
+// The arena lives on until the last of its blocks is freed, even after
+// its selector is gone.
+//
+// Normally used through Selector::Params::arena_slab_size, and the class
+// operator new / delete of the objects that want to be allocated here.
+class SelectorArena {
+ public:
+  // Blocks larger than this are allocated from the heap.
+  static constexpr size_t kMaxBlockSize = 8192;
+
+  // Creates an arena - owned by the caller, and released w/ Unref().
+  static SelectorArena* Create(size_t slab_size);
+
+  // The arena used for allocations in the current thread (set by the
+  // Selector::Loop running in this thread), or nullptr.
+  static SelectorArena* Current();
+  // Sets the current arena of this thread, returning the previous one.
+  static SelectorArena* SetCurrent(SelectorArena* arena);
+
+  // Allocates size bytes from the current arena, if any, or from the heap.
+  // The memory is aligned to 16 bytes (__STDCPP_DEFAULT_NEW_ALIGNMENT__).
+  static void* New(size_t size);
+  // Frees memory allocated with New(), from any thread.
+  static void Delete(void* p);
+
+  // Releases the reference of the creator - the arena is deleted after all
+  // its blocks are freed.
+  void Unref();
+
+  size_t slab_size() const { return slab_size_; }
+  // Number of slabs allocated by this arena.
+  size_t num_slabs() const { return num_slabs_.load(); }
+  // Number of blocks allocated from this arena and not freed yet.
+  size_t num_outstanding() const { return refs_.load() - 1; }
+  // Number of blocks freed by other threads than the select loop.
+  size_t num_remote_frees() const { return num_remote_frees_.load(); }
+
+ private:
+  // Precedes each block - 16 bytes, to keep the alignment of the data.
+  struct alignas(16) Header {
+    // The arena of the block - nullptr for heap blocks.
+    SelectorArena* arena;
+    // Index of the size class for arena blocks.
+    size_t size_class;
+  };
+  static constexpr size_t kSizeClassGranularity = 64;
+  static constexpr size_t kNumSizeClasses =
+      kMaxBlockSize / kSizeClassGranularity;
+
+  explicit SelectorArena(size_t slab_size);
+  ~SelectorArena();
+
+  // Allocates a block of the given size class - in the arena thread.
+  void* Allocate(size_t size_class);
+  // Frees a block of this arena - from any thread.
+  void Deallocate(Header* header);
+  // Reuses the blocks freed by the other threads.
+  void CollectRemoteFrees();
+  // Carves a new block of the size class from the current slab.
+  Header* Carve(size_t size_class);
+
+  const size_t slab_size_;
+  // One for the creator, plus one per outstanding block.
+  std::atomic<size_t> refs_ = ATOMIC_VAR_INIT(1);
+  std::atomic<size_t> num_slabs_ = ATOMIC_VAR_INIT(0);
+  std::atomic<size_t> num_remote_frees_ = ATOMIC_VAR_INIT(0);
+
+  // Accessed only from the thread for which this is the Current() arena.
+  std::vector<char*> slabs_;
+  // The free space at the end of the last slab.
+  char* slab_free_begin_ = nullptr;
+  char* slab_free_end_ = nullptr;
+  // Free blocks, per size class.
+  std::vector<std::vector<Header*>> free_blocks_;
+
+  // Blocks freed by other threads.
+  absl::Mutex remote_mutex_;
+  std::vector<Header*> remote_frees_ ABSL_GUARDED_BY(remote_mutex_);
+  std::atomic_bool has_remote_frees_ = ATOMIC_VAR_INIT(false);
+};
+
+// A std compatible allocator for containers allocating from the current
+// selector arena (see SelectorArena::New) - e.g. for the containers of the
+// connection objects.
+template <typename T>
+class SelectorArenaAllocator {
+ public:
+  using value_type = T;
+
+  SelectorArenaAllocator() = default;
+  template <typename U>
+  SelectorArenaAllocator(const SelectorArenaAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    static_assert(alignof(T) <= 16, "over aligned types are unsupported");
+    return static_cast<T*>(SelectorArena::New(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t) { SelectorArena::Delete(p); }
+
+  template <typename U>
+  bool operator==(const SelectorArenaAllocator<U>&) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const SelectorArenaAllocator<U>&) const {
+    return false;
+  }
+};
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_SELECTOR_ARENA_H_
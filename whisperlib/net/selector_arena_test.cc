@@ -0,0 +1,143 @@
+#include "whisperlib/net/selector_arena.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/notification.h"
+#include "gtest/gtest.h"
+#include "whisperlib/net/connection.h"
+#include "whisperlib/net/selector.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace net {
+
+TEST(SelectorArena, NoCurrentArena) {
+  EXPECT_EQ(SelectorArena::Current(), nullptr);
+  void* p = SelectorArena::New(100);
+  memset(p, 'a', 100);
+  SelectorArena::Delete(p);
+  SelectorArena::Delete(nullptr);
+}
+
+TEST(SelectorArena, Reuse) {
+  SelectorArena* arena = SelectorArena::Create(1 << 16);
+  EXPECT_EQ(SelectorArena::SetCurrent(arena), nullptr);
+  void* p1 = SelectorArena::New(100);
+  void* p2 = SelectorArena::New(120);
+  void* p3 = SelectorArena::New(10);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(p1) % 16, 0);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(p3) % 16, 0);
+  EXPECT_EQ(arena->num_outstanding(), 3);
+  EXPECT_EQ(arena->num_slabs(), 1);
+  // Large blocks come from the heap.
+  void* large = SelectorArena::New(SelectorArena::kMaxBlockSize + 1);
+  EXPECT_EQ(arena->num_outstanding(), 3);
+  SelectorArena::Delete(large);
+  SelectorArena::Delete(p1);
+  // Same size class.
+  EXPECT_EQ(SelectorArena::New(128), p1);
+  SelectorArena::Delete(p1);
+  SelectorArena::Delete(p2);
+  SelectorArena::Delete(p3);
+  EXPECT_EQ(arena->num_outstanding(), 0);
+  // Fills more slabs.
+  std::vector<void*> blocks;
+  for (int i = 0; i < 100; ++i) {
+    blocks.push_back(SelectorArena::New(4000));
+  }
+  EXPECT_GT(arena->num_slabs(), 1);
+  for (void* p : blocks) {
+    SelectorArena::Delete(p);
+  }
+  EXPECT_EQ(SelectorArena::SetCurrent(nullptr), arena);
+  arena->Unref();
+}
+
+TEST(SelectorArena, RemoteFreesAndLifetime) {
+  SelectorArena* arena = SelectorArena::Create(1 << 16);
+  SelectorArena::SetCurrent(arena);
+  std::vector<void*> blocks;
+  for (int i = 0; i < 10; ++i) {
+    blocks.push_back(SelectorArena::New(64));
+  }
+  std::thread remote([&blocks]() {
+    for (int i = 0; i < 5; ++i) {
+      SelectorArena::Delete(blocks[i]);
+    }
+  });
+  remote.join();
+  EXPECT_EQ(arena->num_remote_frees(), 5);
+  EXPECT_EQ(arena->num_outstanding(), 5);
+  // The next allocation reuses the blocks freed remotely.
+  void* p = SelectorArena::New(64);
+  EXPECT_NE(std::find(blocks.begin(), blocks.begin() + 5, p),
+            blocks.begin() + 5);
+  blocks[0] = p;
+  SelectorArena::SetCurrent(nullptr);
+  // Lives on until all the blocks are freed.
+  arena->Unref();
+  std::thread last([&blocks]() {
+    SelectorArena::Delete(blocks[0]);
+    for (int i = 5; i < 10; ++i) {
+      SelectorArena::Delete(blocks[i]);
+    }
+  });
+  last.join();
+}
+
+TEST(SelectorArena, Allocator) {
+  SelectorArena* arena = SelectorArena::Create(1 << 16);
+  SelectorArena::SetCurrent(arena);
+  {
+    absl::flat_hash_map<int, int, absl::Hash<int>, std::equal_to<int>,
+                        SelectorArenaAllocator<std::pair<const int, int>>>
+        m;
+    for (int i = 0; i < 100; ++i) {
+      m.emplace(i, i);
+    }
+    EXPECT_GT(arena->num_outstanding(), 0);
+  }
+  EXPECT_EQ(arena->num_outstanding(), 0);
+  SelectorArena::SetCurrent(nullptr);
+  arena->Unref();
+}
+
+TEST(SelectorArena, Connections) {
+  ASSERT_OK_AND_ASSIGN(
+      auto thread,
+      SelectorThread::Create(Selector::Params().set_arena_slab_size(1 << 16)));
+  Selector* const selector = thread->selector();
+  ASSERT_NE(selector->arena(), nullptr);
+  ASSERT_TRUE(thread->Start());
+  std::unique_ptr<TcpConnection> connection;
+  absl::Notification created;
+  selector->RunInSelectLoop([selector, &connection, &created]() {
+    connection =
+        absl::make_unique<TcpConnection>(selector, TcpConnectionParams());
+    created.Notify();
+  });
+  created.WaitForNotification();
+  EXPECT_GE(selector->arena()->num_outstanding(), 1);
+  absl::Notification deleted;
+  selector->RunInSelectLoop([&connection, &deleted]() {
+    connection.reset();
+    deleted.Notify();
+  });
+  deleted.WaitForNotification();
+  EXPECT_EQ(selector->arena()->num_outstanding(), 0);
+  EXPECT_EQ(selector->arena()->num_remote_frees(), 0);
+  // Created outside the select loop - from the heap.
+  connection =
+      absl::make_unique<TcpConnection>(selector, TcpConnectionParams());
+  EXPECT_EQ(selector->arena()->num_outstanding(), 0);
+  selector->DeleteInSelectLoop(std::move(connection));
+  EXPECT_TRUE(thread->Stop());
+}
+
+}  // namespace net
+}  // namespace whisper
@@ -0,0 +1,125 @@
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "absl/synchronization/notification.h"
+#include "benchmark/benchmark.h"
+#include "whisperlib/net/selector.h"
+
+namespace whisper {
+namespace net {
+namespace {
+
+// Starts a selector thread w/ the params - null if not available
+// (e.g. the loop type on this system).
+std::unique_ptr<SelectorThread> StartSelectorThread(Selector::Params params) {
+  auto thread = SelectorThread::Create(std::move(params));
+  if (!thread.ok()) {
+    return nullptr;
+  }
+  CHECK(thread.value()->Start());
+  return std::move(thread).value();
+}
+
+// Round trip of a callback posted from another thread to an idle
+// selector, which needs to be woken up (unless busy polling).
+void BM_WakeUp(benchmark::State& state, Selector::LoopType loop_type,
+               absl::Duration busy_poll_duration) {
+  auto thread = StartSelectorThread(
+      Selector::Params()
+          .set_loop_type(loop_type)
+          .set_busy_poll_duration(busy_poll_duration));
+  if (thread == nullptr) {
+    state.SkipWithError("Loop type not available.");
+    return;
+  }
+  Selector* const selector = thread->selector();
+  for (auto _ : state) {
+    absl::Notification done;
+    selector->RunInSelectLoop([&done]() { done.Notify(); });
+    done.WaitForNotification();
+  }
+  thread->Stop();
+}
+
+BENCHMARK_CAPTURE(BM_WakeUp, poll, Selector::LoopType::POLL,
+                  absl::ZeroDuration())
+    ->UseRealTime();
+BENCHMARK_CAPTURE(BM_WakeUp, epoll, Selector::LoopType::EPOLL,
+                  absl::ZeroDuration())
+    ->UseRealTime();
+BENCHMARK_CAPTURE(BM_WakeUp, epoll_busy_poll, Selector::LoopType::EPOLL,
+                  absl::Milliseconds(10))
+    ->UseRealTime();
+BENCHMARK_CAPTURE(BM_WakeUp, io_uring, Selector::LoopType::IO_URING,
+                  absl::ZeroDuration())
+    ->UseRealTime();
+
+// Throughput of the callbacks posted from another thread, in batches of
+// range(0), each waited for completion.
+void BM_RunInSelectLoop(benchmark::State& state) {
+  auto thread = StartSelectorThread(
+      Selector::Params().set_loop_type(Selector::LoopType::EPOLL));
+  if (thread == nullptr) {
+    state.SkipWithError("Loop type not available.");
+    return;
+  }
+  Selector* const selector = thread->selector();
+  const size_t batch_size = state.range(0);
+  size_t num_run = 0;  // accessed from the select loop
+  for (auto _ : state) {
+    for (size_t i = 1; i < batch_size; ++i) {
+      selector->RunInSelectLoop([&num_run]() { ++num_run; });
+    }
+    // Callbacks from the same thread run in order.
+    absl::Notification done;
+    selector->RunInSelectLoop([&num_run, &done]() {
+      ++num_run;
+      done.Notify();
+    });
+    done.WaitForNotification();
+  }
+  thread->Stop();
+  CHECK_EQ(num_run, state.iterations() * batch_size);
+  state.SetItemsProcessed(num_run);
+}
+
+BENCHMARK(BM_RunInSelectLoop)->Arg(1)->Arg(64)->Arg(1024)->UseRealTime();
+
+// Cost of registering and cancelling an alarm, w/ range(0) other alarms
+// registered.
+void BM_AlarmRegisterUnregister(benchmark::State& state,
+                                Selector::AlarmBackend backend) {
+  // The loop is not running - alarms can be registered from any thread.
+  auto selector =
+      Selector::Create(Selector::Params().set_alarm_backend(backend));
+  CHECK(selector.ok()) << selector.status();
+  const size_t num_alarms = state.range(0);
+  for (size_t i = 0; i < num_alarms; ++i) {
+    (*selector)->RegisterAlarm([]() {},
+                               absl::Hours(1) + absl::Milliseconds(i));
+  }
+  int64_t timeout_ms = 0;
+  for (auto _ : state) {
+    const Selector::AlarmId alarm_id = (*selector)->RegisterAlarm(
+        []() {}, absl::Milliseconds(100 + timeout_ms++ % 1000));
+    (*selector)->UnregisterAlarm(alarm_id);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_CAPTURE(BM_AlarmRegisterUnregister, heap,
+                  Selector::AlarmBackend::HEAP)
+    ->Arg(0)
+    ->Arg(1000)
+    ->Arg(100000);
+BENCHMARK_CAPTURE(BM_AlarmRegisterUnregister, timing_wheel,
+                  Selector::AlarmBackend::TIMING_WHEEL)
+    ->Arg(0)
+    ->Arg(1000)
+    ->Arg(100000);
+
+}  // namespace
+}  // namespace net
+}  // namespace whisper
@@ -12,6 +12,9 @@ struct SelectDesire {
   static constexpr uint32_t kWantRead = 1;
   static constexpr uint32_t kWantWrite = 2;
   static constexpr uint32_t kWantError = 4;
+  // Not an operation, but a registration flag: the file descriptor is
+  // watched in edge triggered mode, for all operations at once.
+  static constexpr uint32_t kEdgeTriggered = 8;
 };
 
 // Data associated with an event detected by a select loop.
@@ -24,6 +27,10 @@ struct SelectorEventData {
   // Internal event value - specific to the system implementation.
   // (e.g. for epoll the EPOLL events triggered bitmask etc).
   uint32_t internal_event;
+  // Set for the events synthesized by the selector for edge triggered
+  // selectables, when they re-enable a desire - these do not mean that the
+  // file descriptor is ready, and have no internal_event.
+  bool synthesized = false;
 };
 
 static constexpr int kInvalidFdValue = -1;
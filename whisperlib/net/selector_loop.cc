@@ -1,5 +1,21 @@
 #include "whisperlib/net/selector_loop.h"
 
+#include <algorithm>
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#endif  // HAVE_IO_URING
+
+#ifdef HAVE_KQUEUE
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif  // HAVE_KQUEUE
+
 #include "whisperlib/io/errno.h"
 #include "whisperlib/status/status.h"
 
@@ -7,7 +23,13 @@ namespace whisper {
 namespace net {
 
 int PollTimeout(absl::Duration timeout) {
+  // A zero timeout just polls - the loop asks for this when it has more
+  // work queued, or is busy polling. Positive sub millisecond timeouts are
+  // rounded up, so we do not spin until a close alarm.
   static const absl::Duration kMinTimeout = absl::Milliseconds(1);
+  if (timeout <= absl::ZeroDuration()) {
+    return 0;
+  }
   if (timeout < kMinTimeout) {
     timeout = kMinTimeout;
   }
@@ -24,7 +46,9 @@ absl::StatusOr<std::unique_ptr<EpollSelectorLoop>> EpollSelectorLoop::Create(
 }
 
 EpollSelectorLoop::EpollSelectorLoop(int signal_fd, size_t max_events_per_step)
-    : signal_fd_(signal_fd), events_(max_events_per_step) {}
+    : signal_fd_(signal_fd), events_(max_events_per_step) {
+  step_events_.reserve(max_events_per_step);
+}
 
 EpollSelectorLoop::~EpollSelectorLoop() { close(epfd_); }
 
@@ -60,6 +84,9 @@ absl::Status EpollSelectorLoop::Add(int fd, void* user_data, uint32_t desires) {
 absl::Status EpollSelectorLoop::Update(int fd, void* user_data,
                                        uint32_t desires) {
   RET_CHECK(fd >= 0) << "Invalid file descriptor cannot be updated in epoll.";
+  if (desires & SelectDesire::kEdgeTriggered) {
+    return absl::OkStatus();  // watching for everything already.
+  }
   epoll_event event;
   event.events = static_cast<unsigned int>(DesiresToEpollEvents(desires));
   event.data.ptr = user_data;
@@ -85,6 +112,11 @@ absl::Status EpollSelectorLoop::Delete(int fd) {
 }
 
 uint32_t EpollSelectorLoop::DesiresToEpollEvents(uint32_t desires) {
+  if (desires & SelectDesire::kEdgeTriggered) {
+    // Armed once for everything - the selector filters out the events
+    // not currently desired.
+    return EPOLLIN | EPOLLRDHUP | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLET;
+  }
   uint32_t events = 0;
   if (desires & SelectDesire::kWantRead) {
     events |= EPOLLIN | EPOLLRDHUP;
@@ -98,7 +130,7 @@ uint32_t EpollSelectorLoop::DesiresToEpollEvents(uint32_t desires) {
   return events;
 }
 
-absl::StatusOr<std::vector<SelectorEventData>> EpollSelectorLoop::LoopStep(
+absl::StatusOr<absl::Span<const SelectorEventData>> EpollSelectorLoop::LoopStep(
     absl::Duration timeout) {
   const int num_events =
       epoll_wait(epfd_, &events_[0], events_.size(), PollTimeout(timeout));
@@ -106,8 +138,7 @@ absl::StatusOr<std::vector<SelectorEventData>> EpollSelectorLoop::LoopStep(
     return error::ErrnoToStatus(error::Errno())
            << "Encountered during epoll_wait.";
   }
-  std::vector<SelectorEventData> events;
-  events.reserve(num_events);
+  step_events_.clear();
   for (int i = 0; i < num_events; ++i) {
     const struct epoll_event& event = events_[i];
     uint32_t desire = 0;
@@ -120,9 +151,10 @@ absl::StatusOr<std::vector<SelectorEventData>> EpollSelectorLoop::LoopStep(
     if (event.events & EPOLLOUT) {
       desire |= SelectDesire::kWantWrite;
     }
-    events.push_back(SelectorEventData{event.data.ptr, desire, event.events});
+    step_events_.push_back(
+        SelectorEventData{event.data.ptr, desire, event.events});
   }
-  return events;
+  return absl::MakeConstSpan(step_events_);
 }
 bool EpollSelectorLoop::IsHangUpEvent(int event_value) const {
   return (event_value & EPOLLHUP) != 0;
@@ -141,18 +173,124 @@ bool EpollSelectorLoop::IsInputEvent(int event_value) const {
 }
 #endif  // HAVE_EPOLL
 
-PollSelectorLoop::PollSelectorLoop(int signal_fd) : signal_fd_(signal_fd) {}
+#ifdef HAVE_IO_URING
+namespace {
+// Internal requests (e.g. poll removals) complete with this user data, which
+// never maps to a file descriptor registration.
+constexpr uint64_t kInternalTag = 0;
 
-const size_t PollSelectorLoop::kMaxFds;
+uint64_t MakePollTag(int fd, uint32_t generation) {
+  return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+}
+int PollTagFd(uint64_t tag) { return static_cast<int>(tag & 0xffffffffULL); }
 
-absl::StatusOr<std::unique_ptr<PollSelectorLoop>> PollSelectorLoop::Create(
-    int signal_fd) {
-  auto loop = absl::WrapUnique(new PollSelectorLoop(signal_fd));
+uint32_t RoundUpPowerOfTwo(uint32_t value) {
+  uint32_t result = 1;
+  while (result < value) {
+    result <<= 1;
+  }
+  return result;
+}
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<IoUringSelectorLoop>>
+IoUringSelectorLoop::Create(int signal_fd, size_t max_events_per_step) {
+  auto loop =
+      absl::WrapUnique(new IoUringSelectorLoop(signal_fd, max_events_per_step));
   RETURN_IF_ERROR(loop->Initialize());
   return loop;
 }
 
-absl::Status PollSelectorLoop::Initialize() {
+IoUringSelectorLoop::IoUringSelectorLoop(int signal_fd,
+                                         size_t max_events_per_step)
+    : signal_fd_(signal_fd),
+      max_events_per_step_(std::max(max_events_per_step, size_t(1))) {
+  step_events_.reserve(max_events_per_step_);
+}
+
+IoUringSelectorLoop::~IoUringSelectorLoop() {
+  if (sqes_ != nullptr) {
+    ::munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+    ::munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_ != nullptr) {
+    ::munmap(sq_ring_, sq_ring_size_);
+  }
+  if (ring_fd_ >= 0) {
+    ::close(ring_fd_);
+  }
+}
+
+absl::Status IoUringSelectorLoop::Initialize() {
+  // Each event consumes at most one submission for re-arming, and we leave
+  // room for the updates performed during event processing.
+  const uint32_t num_entries = RoundUpPowerOfTwo(std::min<uint32_t>(
+      std::max<uint32_t>(2 * max_events_per_step_, 256), 4096));
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd_ = ::syscall(__NR_io_uring_setup, num_entries, &params);
+  if (ring_fd_ < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Creating io_uring file descriptor during io_uring_setup(..)";
+  }
+  if (!(params.features & IORING_FEAT_EXT_ARG)) {
+    return status::UnimplementedErrorBuilder()
+           << "The kernel io_uring does not support IORING_FEAT_EXT_ARG "
+              "(linux >= 5.11 required).";
+  }
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+  sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    return error::ErrnoToStatus(error::Errno())
+           << "Mapping io_uring submission queue ring.";
+  }
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = nullptr;
+      return error::ErrnoToStatus(error::Errno())
+             << "Mapping io_uring completion queue ring.";
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Mapping io_uring submission queue entries.";
+  }
+  sqes_ = reinterpret_cast<struct io_uring_sqe*>(sqes);
+
+  char* const sq_ptr = reinterpret_cast<char*>(sq_ring_);
+  sq_head_ = reinterpret_cast<uint32_t*>(sq_ptr + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<uint32_t*>(sq_ptr + params.sq_off.tail);
+  sq_array_ = reinterpret_cast<uint32_t*>(sq_ptr + params.sq_off.array);
+  sq_mask_ = *reinterpret_cast<uint32_t*>(sq_ptr + params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  sq_local_tail_ = *sq_tail_;
+  // We always use the submission entries in order.
+  for (uint32_t i = 0; i < sq_entries_; ++i) {
+    sq_array_[i] = i;
+  }
+  char* const cq_ptr = reinterpret_cast<char*>(cq_ring_);
+  cq_head_ = reinterpret_cast<uint32_t*>(cq_ptr + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<uint32_t*>(cq_ptr + params.cq_off.tail);
+  cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq_ptr + params.cq_off.cqes);
+  cq_mask_ = *reinterpret_cast<uint32_t*>(cq_ptr + params.cq_off.ring_mask);
+
   RETURN_IF_ERROR(Add(signal_fd_, nullptr,
                       SelectDesire::kWantRead | SelectDesire::kWantError))
       << "Adding the signaling file descriptor " << signal_fd_
@@ -161,77 +299,296 @@ absl::Status PollSelectorLoop::Initialize() {
   return absl::OkStatus();
 }
 
-PollSelectorLoop::~PollSelectorLoop() {}
-
-absl::Status PollSelectorLoop::Add(int fd, void* user_data, uint32_t desires) {
-  RET_CHECK(fd >= 0) << "Invalid file descriptor cannot be added to epoll.";
-  if (fds_size_ >= kMaxFds) {
-    return status::ResourceExhaustedErrorBuilder()
-           << "Too many file descriptors in the poll structure. Reached the "
-              "limit "
-              "of "
-           << kMaxFds << " file descriptors.";
-  }
-  fds_[fds_size_].fd = fd;
-  fds_[fds_size_].events = DesiresToPollEvents(desires);
-  fds_[fds_size_].revents = 0;
-  fd_data_.emplace(fd, std::make_pair(fds_size_, user_data));
-  ++fds_size_;
+absl::Status IoUringSelectorLoop::Add(int fd, void* user_data,
+                                      uint32_t desires) {
+  RET_CHECK(fd >= 0) << "Invalid file descriptor cannot be added to io_uring.";
+  auto result = fd_data_.emplace(fd, FdData());
+  if (!result.second) {
+    return status::AlreadyExistsErrorBuilder()
+           << "File descriptor: " << fd
+           << " already added to the io_uring selector.";
+  }
+  FdData* const data = &result.first->second;
+  data->user_data = user_data;
+  data->desires = desires;
+  ScheduleArm(fd, data);
   return absl::OkStatus();
 }
 
-absl::Status PollSelectorLoop::Update(int fd, void* user_data,
-                                      uint32_t desires) {
+absl::Status IoUringSelectorLoop::Update(int fd, void* user_data,
+                                         uint32_t desires) {
   auto it = fd_data_.find(fd);
   if (it == fd_data_.end()) {
     return status::NotFoundErrorBuilder()
            << "Cannot update select data for file descriptor: " << fd
            << " as it "
-              "cannot be found in poll selector registered file descriptors.";
+              "cannot be found in io_uring selector registered file "
+              "descriptors.";
   }
-  const size_t index = it->second.first;
-  fds_[index].events = DesiresToPollEvents(desires);
-  it->second.second = user_data;
+  FdData* const data = &it->second;
+  data->user_data = user_data;
+  if (data->desires == desires) {
+    return absl::OkStatus();
+  }
+  data->desires = desires;
+  RETURN_IF_ERROR(QueuePollRemove(data));
+  ScheduleArm(fd, data);
   return absl::OkStatus();
 }
 
-absl::Status PollSelectorLoop::Delete(int fd) {
+absl::Status IoUringSelectorLoop::Delete(int fd) {
   auto it = fd_data_.find(fd);
   if (it == fd_data_.end()) {
     return status::NotFoundErrorBuilder()
            << "Cannot delete select data for file descriptor: " << fd
            << " as it "
-              "cannot be found in poll selector registered file descriptors.";
+              "cannot be found in io_uring selector registered file "
+              "descriptors.";
   }
-  const size_t index = it->second.first;
-  // We don't compact now, as we may loose processing for these events
-  // if we do this in the middle of a step, however we delete the fd.
-  indices_to_compact_.push_back(index);
-  fds_[index].fd = -1;
+  // Any completion still in flight for this fd becomes stale, as its
+  // tag no longer matches a registration.
+  RETURN_IF_ERROR(QueuePollRemove(&it->second));
   fd_data_.erase(it);
   return absl::OkStatus();
 }
 
-void PollSelectorLoop::Compact() {
-  if (indices_to_compact_.empty()) {
-    return;
+void IoUringSelectorLoop::ScheduleArm(int fd, FdData* data) {
+  if (!data->pending_arm) {
+    data->pending_arm = true;
+    to_arm_.push_back(fd);
   }
-  std::sort(indices_to_compact_.begin(), indices_to_compact_.end());
-  for (size_t i = indices_to_compact_.size(); i > 0 && fds_size_ > 0; --i) {
-    const size_t index = indices_to_compact_[i - 1];
-    --fds_size_;
-    if (ABSL_PREDICT_FALSE(fds_size_ == 0 || index == fds_size_)) {
+}
+
+absl::Status IoUringSelectorLoop::QueuePollRemove(FdData* data) {
+  if (data->armed_tag == 0) {
+    return absl::OkStatus();
+  }
+  ASSIGN_OR_RETURN(struct io_uring_sqe * sqe, GetSqe());
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = data->armed_tag;
+  sqe->user_data = kInternalTag;
+  data->armed_tag = 0;
+  return absl::OkStatus();
+}
+
+absl::StatusOr<struct io_uring_sqe*> IoUringSelectorLoop::GetSqe() {
+  if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >=
+      sq_entries_) {
+    // Full - push what we have to the kernel.
+    RETURN_IF_ERROR(Enter(absl::ZeroDuration()));
+    if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >=
+        sq_entries_) {
+      return status::ResourceExhaustedErrorBuilder()
+             << "io_uring submission queue is full.";
+    }
+  }
+  struct io_uring_sqe* const sqe = &sqes_[sq_local_tail_ & sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  ++sq_local_tail_;
+  return sqe;
+}
+
+absl::Status IoUringSelectorLoop::Enter(absl::Duration timeout) {
+  __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+  const uint32_t to_submit =
+      sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  uint32_t min_complete = 0;
+  uint32_t flags = 0;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (timeout > absl::ZeroDuration() &&
+      __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) == *cq_head_) {
+    const struct timespec spec = absl::ToTimespec(timeout);
+    ts.tv_sec = spec.tv_sec;
+    ts.tv_nsec = spec.tv_nsec;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    min_complete = 1;
+    flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+  }
+  if (to_submit == 0 && min_complete == 0) {
+    return absl::OkStatus();
+  }
+  const int result =
+      ::syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete, flags,
+                (flags & IORING_ENTER_EXT_ARG) ? &arg : nullptr, sizeof(arg));
+  if (result < 0 && errno != EINTR && errno != ETIME && errno != EBUSY &&
+      errno != EAGAIN) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Encountered during io_uring_enter.";
+  }
+  return absl::OkStatus();
+}
+
+uint32_t IoUringSelectorLoop::DesiresToPollEvents(uint32_t desires) {
+  uint32_t events = 0;
+  if (desires & SelectDesire::kWantRead) {
+    events |= POLLIN | POLLRDHUP;
+  }
+  if (desires & SelectDesire::kWantWrite) {
+    events |= POLLOUT;
+  }
+  if (desires & SelectDesire::kWantError) {
+    events |= POLLERR | POLLHUP;
+  }
+  return events;
+}
+
+absl::StatusOr<absl::Span<const SelectorEventData>>
+IoUringSelectorLoop::LoopStep(absl::Duration timeout) {
+  for (const int fd : to_arm_) {
+    auto it = fd_data_.find(fd);
+    if (it == fd_data_.end() || !it->second.pending_arm) {
+      continue;
+    }
+    FdData* const data = &it->second;
+    data->pending_arm = false;
+    if (data->armed_tag != 0 || data->desires == 0) {
+      continue;
+    }
+    ASSIGN_OR_RETURN(struct io_uring_sqe * sqe, GetSqe());
+    if (++generation_ == 0) {
+      ++generation_;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = DesiresToPollEvents(data->desires);
+    sqe->user_data = MakePollTag(fd, generation_);
+    data->armed_tag = sqe->user_data;
+  }
+  to_arm_.clear();
+  RETURN_IF_ERROR(Enter(timeout));
+
+  step_events_.clear();
+  uint32_t head = *cq_head_;
+  const uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  for (; head != tail && step_events_.size() < max_events_per_step_; ++head) {
+    const struct io_uring_cqe& cqe = cqes_[head & cq_mask_];
+    if (cqe.user_data == kInternalTag) {
       continue;
     }
-    auto it = fd_data_.find(fds_[fds_size_].fd);
-    if (ABSL_PREDICT_FALSE(it == fd_data_.end())) {
+    const int fd = PollTagFd(cqe.user_data);
+    auto it = fd_data_.find(fd);
+    if (it == fd_data_.end() || it->second.armed_tag != cqe.user_data) {
+      continue;  // stale completion - deleted or updated fd.
+    }
+    FdData* const data = &it->second;
+    data->armed_tag = 0;
+    ScheduleArm(fd, data);
+    if (cqe.res == -ECANCELED) {
       continue;
     }
-    it->second.first = index;
-    fds_[index].fd = fds_[fds_size_].fd;
-    fds_[index].events = fds_[fds_size_].events;
-    fds_[index].revents = 0;
+    const uint32_t revents = cqe.res < 0 ? POLLERR : uint32_t(cqe.res);
+    uint32_t desire = 0;
+    if (revents & (POLLERR | POLLHUP | POLLRDHUP)) {
+      desire |= SelectDesire::kWantError;
+    }
+    if (revents & (POLLIN | POLLPRI)) {
+      desire |= SelectDesire::kWantRead;
+    }
+    if (revents & POLLOUT) {
+      desire |= SelectDesire::kWantWrite;
+    }
+    step_events_.push_back(SelectorEventData{data->user_data, desire, revents});
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  return absl::MakeConstSpan(step_events_);
+}
+
+bool IoUringSelectorLoop::IsHangUpEvent(int event_value) const {
+  return (event_value & POLLHUP) != 0;
+}
+bool IoUringSelectorLoop::IsRemoteHangUpEvent(int event_value) const {
+  return (event_value & POLLRDHUP) != 0;
+}
+bool IoUringSelectorLoop::IsAnyHangUpEvent(int event_value) const {
+  return (event_value & (POLLHUP | POLLRDHUP)) != 0;
+}
+bool IoUringSelectorLoop::IsErrorEvent(int event_value) const {
+  return (event_value & POLLERR) != 0;
+}
+bool IoUringSelectorLoop::IsInputEvent(int event_value) const {
+  return (event_value & POLLIN) != 0;
+}
+#endif  // HAVE_IO_URING
+
+PollSelectorLoop::PollSelectorLoop(int signal_fd, size_t initial_capacity)
+    : signal_fd_(signal_fd) {
+  fds_.reserve(initial_capacity);
+  user_data_.reserve(initial_capacity);
+  fd_index_.reserve(initial_capacity);
+}
+
+absl::StatusOr<std::unique_ptr<PollSelectorLoop>> PollSelectorLoop::Create(
+    int signal_fd, size_t initial_capacity) {
+  auto loop =
+      absl::WrapUnique(new PollSelectorLoop(signal_fd, initial_capacity));
+  RETURN_IF_ERROR(loop->Initialize());
+  return loop;
+}
+
+absl::Status PollSelectorLoop::Initialize() {
+  RETURN_IF_ERROR(Add(signal_fd_, nullptr,
+                      SelectDesire::kWantRead | SelectDesire::kWantError))
+      << "Adding the signaling file descriptor " << signal_fd_
+      << " while "
+         "creating the selector loop.";
+  return absl::OkStatus();
+}
+
+PollSelectorLoop::~PollSelectorLoop() {}
+
+absl::Status PollSelectorLoop::Add(int fd, void* user_data, uint32_t desires) {
+  RET_CHECK(fd >= 0) << "Invalid file descriptor cannot be added to poll.";
+  if (!fd_index_.emplace(fd, fds_.size()).second) {
+    return status::AlreadyExistsErrorBuilder()
+           << "File descriptor: " << fd
+           << " already registered in the poll selector.";
+  }
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = DesiresToPollEvents(desires);
+  pfd.revents = 0;
+  fds_.push_back(pfd);
+  user_data_.push_back(user_data);
+  return absl::OkStatus();
+}
+
+absl::Status PollSelectorLoop::Update(int fd, void* user_data,
+                                      uint32_t desires) {
+  auto it = fd_index_.find(fd);
+  if (it == fd_index_.end()) {
+    return status::NotFoundErrorBuilder()
+           << "Cannot update select data for file descriptor: " << fd
+           << " as it "
+              "cannot be found in poll selector registered file descriptors.";
   }
+  const size_t index = it->second;
+  fds_[index].events = DesiresToPollEvents(desires);
+  user_data_[index] = user_data;
+  return absl::OkStatus();
+}
+
+absl::Status PollSelectorLoop::Delete(int fd) {
+  auto it = fd_index_.find(fd);
+  if (it == fd_index_.end()) {
+    return status::NotFoundErrorBuilder()
+           << "Cannot delete select data for file descriptor: " << fd
+           << " as it "
+              "cannot be found in poll selector registered file descriptors.";
+  }
+  const size_t index = it->second;
+  fd_index_.erase(it);
+  // Move the last one in place of the deleted one.
+  if (index + 1 < fds_.size()) {
+    fds_[index] = fds_.back();
+    user_data_[index] = user_data_.back();
+    fd_index_[fds_[index].fd] = index;
+  }
+  fds_.pop_back();
+  user_data_.pop_back();
+  return absl::OkStatus();
 }
 
 int PollSelectorLoop::DesiresToPollEvents(uint32_t desires) {
@@ -248,16 +605,15 @@ int PollSelectorLoop::DesiresToPollEvents(uint32_t desires) {
   return events;
 }
 
-absl::StatusOr<std::vector<SelectorEventData>> PollSelectorLoop::LoopStep(
+absl::StatusOr<absl::Span<const SelectorEventData>> PollSelectorLoop::LoopStep(
     absl::Duration timeout) {
-  Compact();
-  int num_events = poll(fds_, fds_size_, PollTimeout(timeout));
+  int num_events = poll(fds_.data(), fds_.size(), PollTimeout(timeout));
   if (num_events < 0 && errno != EINTR) {
     return error::ErrnoToStatus(error::Errno()) << "Encountered during poll.";
   }
-  std::vector<SelectorEventData> events;
-  events.reserve(num_events);
-  for (size_t i = 0; i < fds_size_ && num_events > 0; ++i) {
+  step_events_.clear();
+  // We stop scanning at the last ready file descriptor.
+  for (size_t i = 0; i < fds_.size() && num_events > 0; ++i) {
     const struct pollfd& event = fds_[i];
     if (event.revents == 0) {
       continue;
@@ -269,17 +625,14 @@ absl::StatusOr<std::vector<SelectorEventData>> PollSelectorLoop::LoopStep(
     if (event.revents & (POLLIN | POLLPRI)) {
       desire |= SelectDesire::kWantRead;
     }
-    if (event.events & POLLOUT) {
+    if (event.revents & POLLOUT) {
       desire |= SelectDesire::kWantWrite;
     }
-    const DataMap::iterator it = fd_data_.find(event.fd);
-    if (it != fd_data_.end()) {
-      events.push_back(SelectorEventData{it->second.second, desire,
-                                         uint32_t(event.revents)});
-    }
+    step_events_.push_back(
+        SelectorEventData{user_data_[i], desire, uint32_t(event.revents)});
     --num_events;
   }
-  return events;
+  return absl::MakeConstSpan(step_events_);
 }
 
 bool PollSelectorLoop::IsHangUpEvent(int event_value) const {
@@ -300,20 +653,218 @@ bool PollSelectorLoop::IsInputEvent(int event_value) const {
 
 #ifdef HAVE_KQUEUE
 
-static const int kKQueueHangUp = 1;
-static const int kKQueueErrorEvent = 2;
-static const int kKQueueInputEvent = 4;
+namespace {
+// Bits of our internal event value for kqueue:
+constexpr uint32_t kKQueueHangUp = 1;
+constexpr uint32_t kKQueueErrorEvent = 2;
+constexpr uint32_t kKQueueInputEvent = 4;
+constexpr uint32_t kKQueueRemoteHangUp = 8;
+// Identifier of the EVFILT_USER event used for waking up the loop.
+constexpr uintptr_t kWakeupIdent = 0;
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<KQueueSelectorLoop>> KQueueSelectorLoop::Create(
+    size_t max_events_per_step) {
+  auto loop = absl::WrapUnique(new KQueueSelectorLoop(max_events_per_step));
+  RETURN_IF_ERROR(loop->Initialize());
+  return loop;
+}
+
+KQueueSelectorLoop::KQueueSelectorLoop(size_t max_events_per_step)
+    : max_events_per_step_(std::max(max_events_per_step, size_t(1))) {
+  events_.resize(max_events_per_step_);
+  step_events_.reserve(max_events_per_step_);
+}
+
+KQueueSelectorLoop::~KQueueSelectorLoop() {
+  if (kq_ >= 0) {
+    ::close(kq_);
+  }
+}
+
+absl::Status KQueueSelectorLoop::Initialize() {
+  kq_ = ::kqueue();
+  if (kq_ < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Creating kqueue file descriptor during ::kqueue()";
+  }
+  if (::fcntl(kq_, F_SETFD, FD_CLOEXEC) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Setting close on exec flag on the kqueue file descriptor.";
+  }
+  struct kevent event;
+  EV_SET(&event, kWakeupIdent, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+  if (::kevent(kq_, &event, 1, nullptr, 0, nullptr) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Adding the wake up user event to kqueue.";
+  }
+  return absl::OkStatus();
+}
+
+void KQueueSelectorLoop::QueueChange(int fd, int16_t filter, uint16_t flags,
+                                     void* user_data) {
+  changes_.emplace_back();
+  EV_SET(&changes_.back(), fd, filter, flags, 0, 0, user_data);
+}
+
+absl::Status KQueueSelectorLoop::Add(int fd, void* user_data,
+                                     uint32_t desires) {
+  RET_CHECK(fd >= 0) << "Invalid file descriptor cannot be added to kqueue.";
+  if (!fd_data_.emplace(fd, FdData{user_data, desires}).second) {
+    return status::AlreadyExistsErrorBuilder()
+           << "File descriptor: " << fd
+           << " already registered in the kqueue selector.";
+  }
+  // We add both filters, and just enable / disable them on updates.
+  QueueChange(fd, EVFILT_READ,
+              EV_ADD | ((desires & SelectDesire::kWantRead) ? EV_ENABLE
+                                                             : EV_DISABLE),
+              user_data);
+  QueueChange(fd, EVFILT_WRITE,
+              EV_ADD | ((desires & SelectDesire::kWantWrite) ? EV_ENABLE
+                                                              : EV_DISABLE),
+              user_data);
+  return absl::OkStatus();
+}
+
+absl::Status KQueueSelectorLoop::Update(int fd, void* user_data,
+                                        uint32_t desires) {
+  auto it = fd_data_.find(fd);
+  if (it == fd_data_.end()) {
+    return status::NotFoundErrorBuilder()
+           << "Cannot update select data for file descriptor: " << fd
+           << " as it cannot be found in kqueue registered file descriptors.";
+  }
+  FdData* const data = &it->second;
+  const uint32_t changed = (data->desires ^ desires);
+  const bool user_data_changed = data->user_data != user_data;
+  if (user_data_changed || (changed & SelectDesire::kWantRead)) {
+    QueueChange(fd, EVFILT_READ,
+                EV_ADD | ((desires & SelectDesire::kWantRead) ? EV_ENABLE
+                                                               : EV_DISABLE),
+                user_data);
+  }
+  if (user_data_changed || (changed & SelectDesire::kWantWrite)) {
+    QueueChange(fd, EVFILT_WRITE,
+                EV_ADD | ((desires & SelectDesire::kWantWrite) ? EV_ENABLE
+                                                                : EV_DISABLE),
+                user_data);
+  }
+  data->user_data = user_data;
+  data->desires = desires;
+  return absl::OkStatus();
+}
+
+absl::Status KQueueSelectorLoop::Delete(int fd) {
+  auto it = fd_data_.find(fd);
+  if (it == fd_data_.end()) {
+    return status::NotFoundErrorBuilder()
+           << "Cannot delete select data for file descriptor: " << fd
+           << " as it cannot be found in kqueue registered file descriptors.";
+  }
+  fd_data_.erase(it);
+  // If the fd gets closed before the next step, the kernel removes the
+  // filters itself, and we ignore the errors for these deletes.
+  QueueChange(fd, EVFILT_READ, EV_DELETE, nullptr);
+  QueueChange(fd, EVFILT_WRITE, EV_DELETE, nullptr);
+  return absl::OkStatus();
+}
+
+absl::Status KQueueSelectorLoop::Wakeup() {
+  struct kevent event;
+  EV_SET(&event, kWakeupIdent, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+  if (::kevent(kq_, &event, 1, nullptr, 0, nullptr) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Triggering the wake up user event in kqueue.";
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<absl::Span<const SelectorEventData>>
+KQueueSelectorLoop::LoopStep(absl::Duration timeout) {
+  // Failed changes are reported in the event list, so we need room for them.
+  if (events_.size() < max_events_per_step_ + changes_.size()) {
+    events_.resize(max_events_per_step_ + changes_.size());
+  }
+  const struct timespec wait_time =
+      absl::ToTimespec(std::max(timeout, absl::ZeroDuration()));
+  const int num_events =
+      ::kevent(kq_, changes_.data(), static_cast<int>(changes_.size()),
+               events_.data(), static_cast<int>(events_.size()), &wait_time);
+  // On EINTR the changes were already applied.
+  changes_.clear();
+  if (num_events < 0 && errno != EINTR) {
+    return error::ErrnoToStatus(error::Errno())
+           << "Encountered during kevent wait.";
+  }
+  step_events_.clear();
+  step_index_.clear();
+  for (int i = 0; i < num_events; ++i) {
+    AddStepEvent(events_[i]);
+  }
+  return absl::MakeConstSpan(step_events_);
+}
+
+void KQueueSelectorLoop::AddStepEvent(const struct kevent& event) {
+  if (event.filter == EVFILT_USER) {
+    return;  // just a wake up.
+  }
+  const int fd = static_cast<int>(event.ident);
+  auto it = fd_data_.find(fd);
+  if (it == fd_data_.end()) {
+    return;  // deleted in the mean time.
+  }
+  uint32_t desire = 0;
+  uint32_t value = 0;
+  if (event.flags & EV_ERROR) {
+    if (event.data == ENOENT) {
+      // Deleting the filter of a closed (and maybe reused) fd.
+      return;
+    }
+    desire |= SelectDesire::kWantError;
+    value |= kKQueueErrorEvent;
+  } else if (event.filter == EVFILT_READ) {
+    desire |= SelectDesire::kWantRead;
+    if (event.data > 0) {
+      value |= kKQueueInputEvent;
+    }
+    if (event.flags & EV_EOF) {
+      // The peer closed its write half.
+      desire |= SelectDesire::kWantError;
+      value |= kKQueueRemoteHangUp;
+    }
+  } else if (event.filter == EVFILT_WRITE) {
+    desire |= SelectDesire::kWantWrite;
+    if (event.flags & EV_EOF) {
+      // We cannot write anymore - the peer is gone.
+      desire |= SelectDesire::kWantError;
+      value |= kKQueueHangUp;
+    }
+  }
+  if ((event.flags & EV_EOF) && event.fflags != 0) {
+    value |= kKQueueErrorEvent;  // fflags holds the socket error.
+  }
+  const auto result = step_index_.emplace(fd, step_events_.size());
+  if (result.second) {
+    step_events_.push_back(
+        SelectorEventData{it->second.user_data, desire, value});
+  } else {
+    SelectorEventData* const data = &step_events_[result.first->second];
+    data->desires |= desire;
+    data->internal_event |= value;
+  }
+}
 
 bool KQueueSelectorLoop::IsHangUpEvent(int event_value) const {
   return (event_value & kKQueueHangUp) != 0;
 }
 
 bool KQueueSelectorLoop::IsRemoteHangUpEvent(int event_value) const {
-  return false;
+  return (event_value & kKQueueRemoteHangUp) != 0;
 }
 
 bool KQueueSelectorLoop::IsAnyHangUpEvent(int event_value) const {
-  return (event_value & kKQueueHangUp) != 0;
+  return (event_value & (kKQueueHangUp | kKQueueRemoteHangUp)) != 0;
 }
 
 bool KQueueSelectorLoop::IsErrorEvent(int event_value) const {
@@ -9,6 +9,7 @@
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "whisperlib/net/selector_event_data.h"
 
 #ifdef __linux__
@@ -24,15 +25,33 @@
 
 #include <poll.h>
 
-#elif defined(__APPLE__)
+// io_uring is driven through raw system calls (no liburing dependency),
+// so we only need the kernel uapi header and syscall numbers.
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+// Leaked from <linux/fs.h> - and conflicts with too many other names.
+#ifdef BLOCK_SIZE
+#undef BLOCK_SIZE
+#endif  // BLOCK_SIZE
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING
+#endif  // __NR_io_uring_setup && __NR_io_uring_enter
+#endif  // __has_include(<linux/io_uring.h>)
+#endif  // __has_include
+
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__)
 
 #include <sys/event.h>
 #include <sys/poll.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
-// TODO(cpopescu): continue
-// #define HAVE_KQUEUE
+// We need EVFILT_USER for waking up the loop.
+#ifdef EVFILT_USER
+#define HAVE_KQUEUE
+#endif  // EVFILT_USER
 
 #endif  // __linux__
 
@@ -43,6 +62,11 @@
 namespace whisper {
 namespace net {
 
+// Converts a loop step timeout to the milliseconds of poll / epoll_wait.
+// A zero (or negative) timeout just polls, w/o waiting, while positive
+// sub millisecond timeouts are rounded up to a millisecond.
+int PollTimeout(absl::Duration timeout);
+
 class SelectorLoop {
  public:
   SelectorLoop() = default;
@@ -60,7 +84,9 @@ class SelectorLoop {
   // Run a selector loop step. It fills in events two things:
   //  -- the user data associted with the fd that was triggered
   //  -- the event that happended (an or of Selector desires)
-  virtual absl::StatusOr<std::vector<SelectorEventData>> LoopStep(
+  // The returned events are stored in step_events_, and are valid until
+  // the next call to LoopStep.
+  virtual absl::StatusOr<absl::Span<const SelectorEventData>> LoopStep(
       absl::Duration timeout) = 0;
 
   // Abstracts away identification of signals received through (poll) events:
@@ -69,6 +95,20 @@ class SelectorLoop {
   virtual bool IsAnyHangUpEvent(int event_value) const = 0;
   virtual bool IsErrorEvent(int event_value) const = 0;
   virtual bool IsInputEvent(int event_value) const = 0;
+
+  // If file descriptors can be added with SelectDesire::kEdgeTriggered.
+  virtual bool SupportsEdgeTriggered() const { return false; }
+
+  // Wakes up the loop from the LoopStep wait, for loops that do not need a
+  // signal file descriptor for this. Safe to call from any thread.
+  virtual absl::Status Wakeup() {
+    return absl::UnimplementedError("Loop wakes up on its signal fd.");
+  }
+
+ protected:
+  // The events of the last loop step - reused between steps, to avoid
+  // allocations.
+  std::vector<SelectorEventData> step_events_;
 };
 
 #ifdef HAVE_EPOLL
@@ -83,7 +123,7 @@ class EpollSelectorLoop : public SelectorLoop {
   absl::Status Update(int fd, void* user_data, uint32_t desires) override;
   absl::Status Delete(int fd) override;
 
-  absl::StatusOr<std::vector<SelectorEventData>> LoopStep(
+  absl::StatusOr<absl::Span<const SelectorEventData>> LoopStep(
       absl::Duration timeout) override;
 
   bool IsHangUpEvent(int event_value) const override;
@@ -92,6 +132,10 @@ class EpollSelectorLoop : public SelectorLoop {
   bool IsErrorEvent(int event_value) const override;
   bool IsInputEvent(int event_value) const override;
 
+  // File descriptors added with SelectDesire::kEdgeTriggered are watched
+  // with EPOLLET for all events, and their Update(..) is a no-op.
+  bool SupportsEdgeTriggered() const override { return true; }
+
  private:
   EpollSelectorLoop(int signal_fd, size_t max_events_per_step);
 
@@ -108,29 +152,147 @@ class EpollSelectorLoop : public SelectorLoop {
 };
 #endif  // HAVE_EPOLL
 
+#ifdef HAVE_IO_URING
+// A selector loop implementation based on io_uring - linux >= 5.11.
+// Readiness is tracked with one shot IORING_OP_POLL_ADD requests. The
+// (re)arming of all polls, the removal of stale ones and the wait for
+// completions are batched in a single io_uring_enter(..) per loop step.
+class IoUringSelectorLoop : public SelectorLoop {
+ public:
+  static absl::StatusOr<std::unique_ptr<IoUringSelectorLoop>> Create(
+      int signal_fd, size_t max_events_per_step);
+  ~IoUringSelectorLoop();
+
+  absl::Status Add(int fd, void* user_data, uint32_t desires) override;
+  absl::Status Update(int fd, void* user_data, uint32_t desires) override;
+  absl::Status Delete(int fd) override;
+
+  absl::StatusOr<absl::Span<const SelectorEventData>> LoopStep(
+      absl::Duration timeout) override;
+
+  bool IsHangUpEvent(int event_value) const override;
+  bool IsRemoteHangUpEvent(int event_value) const override;
+  bool IsAnyHangUpEvent(int event_value) const override;
+  bool IsErrorEvent(int event_value) const override;
+  bool IsInputEvent(int event_value) const override;
+
+ private:
+  IoUringSelectorLoop(int signal_fd, size_t max_events_per_step);
+
+  absl::Status Initialize();
+
+  // What we know about a file descriptor added to the loop.
+  struct FdData {
+    void* user_data = nullptr;
+    uint32_t desires = 0;
+    // The user_data of the currently armed poll request, 0 if none.
+    uint64_t armed_tag = 0;
+    // If the fd is already in to_arm_.
+    bool pending_arm = false;
+  };
+
+  // Converts a Selector desire in some poll flags.
+  uint32_t DesiresToPollEvents(uint32_t desires);
+  // Marks the file descriptor to have its poll armed on next step.
+  void ScheduleArm(int fd, FdData* data);
+  // Queues the removal of the armed poll in data (if any).
+  absl::Status QueuePollRemove(FdData* data);
+  // Returns the next free submission queue entry, flushing the
+  // queue to the kernel if full.
+  absl::StatusOr<struct io_uring_sqe*> GetSqe();
+  // Submits all queued entries, waiting at most timeout for completions,
+  // if none is already available.
+  absl::Status Enter(absl::Duration timeout);
+
+  const int signal_fd_;
+  const size_t max_events_per_step_;
+
+  // The io_uring file descriptor.
+  int ring_fd_ = -1;
+  // Memory mapped submission / completion rings and submission entries.
+  void* sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  struct io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  // Pointers inside the rings.
+  uint32_t* sq_head_ = nullptr;
+  uint32_t* sq_tail_ = nullptr;
+  uint32_t* sq_array_ = nullptr;
+  uint32_t sq_mask_ = 0;
+  uint32_t sq_entries_ = 0;
+  uint32_t* cq_head_ = nullptr;
+  uint32_t* cq_tail_ = nullptr;
+  struct io_uring_cqe* cqes_ = nullptr;
+  uint32_t cq_mask_ = 0;
+  // Our local copy of the submission tail (published on Enter).
+  uint32_t sq_local_tail_ = 0;
+
+  // Generation of the poll requests - differentiates between armed and
+  // stale requests for the same file descriptor.
+  uint32_t generation_ = 0;
+  // Maps from fd to registration data.
+  absl::flat_hash_map<int, FdData> fd_data_;
+  // File descriptors that need their poll request (re)armed.
+  std::vector<int> to_arm_;
+};
+#endif  // HAVE_IO_URING
+
 #ifdef HAVE_KQUEUE
-class KQueueSelectorLoop {
+// A selector loop implementation based on kqueue - MacOS / BSD.
+// The changes of the watched file descriptors are batched, and submitted
+// together with the wait for events, in a single kevent(..) call per loop
+// step. The loop is woken up with an EVFILT_USER event, so no signal
+// file descriptor is needed.
+class KQueueSelectorLoop : public SelectorLoop {
  public:
   static absl::StatusOr<std::unique_ptr<KQueueSelectorLoop>> Create(
-      int signal_fd, size_t max_events_per_step);
-  KQueueSelectorLoop(int signal_fd, size_t max_events_per_step);
-  virtual ~KQueueSelectorLoop() = default;
+      size_t max_events_per_step);
+  ~KQueueSelectorLoop();
 
-  virtual absl::Status Add(int fd, void* user_data, uint32_t desires);
-  virtual absl::Status Update(int fd, void* user_data, uint32_t desires);
-  virtual absl::Status Delete(int fd) = 0;
+  absl::Status Add(int fd, void* user_data, uint32_t desires) override;
+  absl::Status Update(int fd, void* user_data, uint32_t desires) override;
+  absl::Status Delete(int fd) override;
 
-  virtual absl::StatusOr<std::vector<SelectorEventData>> LoopStep(
-      absl::Duration timeout);
+  absl::StatusOr<absl::Span<const SelectorEventData>> LoopStep(
+      absl::Duration timeout) override;
 
-  virtual bool IsHangUpEvent(int event_value) const;
-  virtual bool IsRemoteHangUpEvent(int event_value) const;
-  virtual bool IsAnyHangUpEvent(int event_value) const;
-  virtual bool IsErrorEvent(int event_value) const;
-  virtual bool IsInputEvent(int event_value) const;
+  bool IsHangUpEvent(int event_value) const override;
+  bool IsRemoteHangUpEvent(int event_value) const override;
+  bool IsAnyHangUpEvent(int event_value) const override;
+  bool IsErrorEvent(int event_value) const override;
+  bool IsInputEvent(int event_value) const override;
+
+  absl::Status Wakeup() override;
 
  private:
-  // TODO(cpopescu):  continue
+  explicit KQueueSelectorLoop(size_t max_events_per_step);
+  absl::Status Initialize();
+
+  // What we know about a file descriptor added to the loop.
+  struct FdData {
+    void* user_data = nullptr;
+    uint32_t desires = 0;
+  };
+
+  // Queues the changes for a filter of fd, to be submitted on next step.
+  void QueueChange(int fd, int16_t filter, uint16_t flags, void* user_data);
+  // Converts a kevent to selector event data, merged in the events of
+  // the current step - we get separate kevents for read and write.
+  void AddStepEvent(const struct kevent& event);
+
+  const size_t max_events_per_step_;
+  // The kqueue file descriptor.
+  int kq_ = -1;
+  // Maps from fd to registration data.
+  absl::flat_hash_map<int, FdData> fd_data_;
+  // Changes to submit on next step.
+  std::vector<struct kevent> changes_;
+  // Here we get the events that we wait for.
+  std::vector<struct kevent> events_;
+  // Index of the fds in step_events_, for merging their events.
+  absl::flat_hash_map<int, size_t> step_index_;
 };
 #endif  // HAVE_KQUEUE
 
@@ -138,15 +300,16 @@ class KQueueSelectorLoop {
 // but with some limitations and of lower speed.
 class PollSelectorLoop : public SelectorLoop {
  public:
+  // The poll structures grow as needed, initial_capacity is just a hint.
   static absl::StatusOr<std::unique_ptr<PollSelectorLoop>> Create(
-      int signal_fd);
+      int signal_fd, size_t initial_capacity = 64);
   ~PollSelectorLoop();
 
   absl::Status Add(int fd, void* user_data, uint32_t desires) override;
   absl::Status Update(int fd, void* user_data, uint32_t desires) override;
   absl::Status Delete(int fd) override;
 
-  absl::StatusOr<std::vector<SelectorEventData>> LoopStep(
+  absl::StatusOr<absl::Span<const SelectorEventData>> LoopStep(
       absl::Duration timeout) override;
 
   bool IsHangUpEvent(int event_value) const override;
@@ -156,26 +319,21 @@ class PollSelectorLoop : public SelectorLoop {
   bool IsInputEvent(int event_value) const override;
 
  private:
-  PollSelectorLoop(int signal_fd);
+  PollSelectorLoop(int signal_fd, size_t initial_capacity);
   absl::Status Initialize();
 
   const int signal_fd_;
 
   // Converts a Selector desire in some poll flags.
   int DesiresToPollEvents(uint32_t desires);
-  // Compacts the fds table at the end of a loop step
-  void Compact();
-
-  static const size_t kMaxFds = 4096;
-  // poll file descriptors
-  struct pollfd fds_[kMaxFds];
-  // how many in fds are used in fds_
-  size_t fds_size_ = 0;
-  // maps from fd to index in fds_ and user data
-  typedef absl::flat_hash_map<int, std::pair<size_t, void*>> DataMap;
-  DataMap fd_data_;
-  // indices that we need to compact at the end of the step
-  std::vector<size_t> indices_to_compact_;
+
+  // poll file descriptors - deleted ones are replaced by the last one,
+  // which is fine, as the events of a step are collected before processing.
+  std::vector<struct pollfd> fds_;
+  // user data for the file descriptors in fds_, at the same index.
+  std::vector<void*> user_data_;
+  // maps from fd to index in fds_
+  absl::flat_hash_map<int, size_t> fd_index_;
 };
 
 }  // namespace net
@@ -0,0 +1,97 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "benchmark/benchmark.h"
+#include "whisperlib/net/selector_loop.h"
+
+namespace whisper {
+namespace net {
+namespace {
+
+enum class Backend { POLL, EPOLL, IO_URING };
+
+// A loop of the provided backend, with some pipes registered for read,
+// which are always ready (we never read from them).
+class ReadyLoop {
+ public:
+  ReadyLoop(Backend backend, size_t num_ready) {
+    CHECK_EQ(::pipe(signal_pipe_), 0);
+    absl::StatusOr<std::unique_ptr<SelectorLoop>> loop;
+    switch (backend) {
+      case Backend::POLL:
+        loop = PollSelectorLoop::Create(signal_pipe_[0]);
+        break;
+      case Backend::EPOLL:
+#ifdef HAVE_EPOLL
+        loop = EpollSelectorLoop::Create(signal_pipe_[0], num_ready + 1);
+#endif  // HAVE_EPOLL
+        break;
+      case Backend::IO_URING:
+#ifdef HAVE_IO_URING
+        loop = IoUringSelectorLoop::Create(signal_pipe_[0], num_ready + 1);
+#endif  // HAVE_IO_URING
+        break;
+    }
+    if (!loop.ok()) {
+      return;
+    }
+    loop_ = std::move(loop).value();
+    for (size_t i = 0; i < num_ready; ++i) {
+      int fds[2];
+      CHECK_EQ(::pipe(fds), 0);
+      CHECK_EQ(::write(fds[1], "x", 1), 1);
+      CHECK(loop_->Add(fds[0], this, SelectDesire::kWantRead).ok());
+      fds_.push_back(fds[0]);
+      fds_.push_back(fds[1]);
+    }
+  }
+  ~ReadyLoop() {
+    loop_.reset();
+    for (const int fd : fds_) {
+      ::close(fd);
+    }
+    ::close(signal_pipe_[0]);
+    ::close(signal_pipe_[1]);
+  }
+  SelectorLoop* loop() const { return loop_.get(); }
+
+ private:
+  int signal_pipe_[2] = {-1, -1};
+  std::vector<int> fds_;
+  std::unique_ptr<SelectorLoop> loop_;
+};
+
+// Cost of a loop step that returns range(0) ready events.
+void BM_LoopStep(benchmark::State& state, Backend backend) {
+  const size_t num_ready = state.range(0);
+  ReadyLoop ready_loop(backend, num_ready);
+  if (ready_loop.loop() == nullptr) {
+    state.SkipWithError("Backend not available.");
+    return;
+  }
+  size_t num_events = 0;
+  for (auto _ : state) {
+    auto events = ready_loop.loop()->LoopStep(absl::ZeroDuration());
+    CHECK(events.ok());
+    num_events += events.value().size();
+  }
+  state.SetItemsProcessed(num_events);
+}
+
+BENCHMARK_CAPTURE(BM_LoopStep, poll, Backend::POLL)->Arg(1)->Arg(16)->Arg(128);
+BENCHMARK_CAPTURE(BM_LoopStep, epoll, Backend::EPOLL)
+    ->Arg(1)
+    ->Arg(16)
+    ->Arg(128);
+BENCHMARK_CAPTURE(BM_LoopStep, io_uring, Backend::IO_URING)
+    ->Arg(1)
+    ->Arg(16)
+    ->Arg(128);
+
+}  // namespace
+}  // namespace net
+}  // namespace whisper
@@ -0,0 +1,214 @@
+#include "whisperlib/net/selector_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "absl/numeric/bits.h"
+#include "absl/strings/str_cat.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+constexpr double kQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+}  // namespace
+
+Histogram::Histogram() {
+  for (auto& count : counts_) {
+    count.store(0, std::memory_order_relaxed);
+  }
+}
+
+size_t Histogram::BucketIndex(uint64_t value) {
+  if (value < kNumSubBuckets) {
+    return value;
+  }
+  // The first kNumSubBuckets values have a bucket each, then each power of
+  // two range [2^k, 2^(k+1)) is split in kNumSubBuckets.
+  const size_t shift = absl::bit_width(value) - 1 - kSubBucketBits;
+  return ((shift + 1) << kSubBucketBits) +
+         ((value >> shift) & (kNumSubBuckets - 1));
+}
+
+uint64_t Histogram::BucketLowerBound(size_t index) {
+  if (index < kNumSubBuckets) {
+    return index;
+  }
+  const size_t shift = (index >> kSubBucketBits) - 1;
+  return (kNumSubBuckets + (index & (kNumSubBuckets - 1))) << shift;
+}
+
+uint64_t Histogram::BucketUpperBound(size_t index) {
+  if (index + 1 >= kNumBuckets) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+  return BucketLowerBound(index + 1) - 1;
+}
+
+void Histogram::Record(uint64_t value) {
+  Increment(&counts_[BucketIndex(value)], 1);
+  Increment(&sum_, value);
+  if (value > max_.load(std::memory_order_relaxed)) {
+    max_.store(value, std::memory_order_relaxed);
+  }
+}
+
+void Histogram::RecordDuration(absl::Duration duration) {
+  Record(static_cast<uint64_t>(
+      std::max<int64_t>(absl::ToInt64Nanoseconds(duration), 0)));
+}
+
+Histogram::Snapshot Histogram::GetSnapshot() const {
+  Snapshot snapshot;
+  snapshot.counts.resize(kNumBuckets);
+  for (size_t i = 0; i < kNumBuckets; ++i) {
+    snapshot.counts[i] = counts_[i].load(std::memory_order_relaxed);
+    snapshot.count += snapshot.counts[i];
+  }
+  snapshot.sum = sum_.load(std::memory_order_relaxed);
+  snapshot.max = max_.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+double Histogram::Snapshot::Mean() const {
+  return count == 0 ? 0.0 : static_cast<double>(sum) / count;
+}
+
+uint64_t Histogram::Snapshot::Percentile(double p) const {
+  if (count == 0) {
+    return 0;
+  }
+  const uint64_t rank = std::max<uint64_t>(
+      1, static_cast<uint64_t>(std::ceil(std::clamp(p, 0.0, 1.0) * count)));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < counts.size(); ++i) {
+    seen += counts[i];
+    if (seen >= rank) {
+      return std::min(BucketUpperBound(i), max);
+    }
+  }
+  return max;
+}
+
+SelectorStats::Snapshot SelectorStats::GetSnapshot() const {
+  Snapshot snapshot;
+  snapshot.loop_steps = loop_steps.load(std::memory_order_relaxed);
+  snapshot.events = events.load(std::memory_order_relaxed);
+  snapshot.callbacks = callbacks.load(std::memory_order_relaxed);
+  snapshot.alarms = alarms.load(std::memory_order_relaxed);
+  snapshot.slow_callbacks = slow_callbacks.load(std::memory_order_relaxed);
+  snapshot.wait_time = wait_time.GetSnapshot();
+  snapshot.event_time = event_time.GetSnapshot();
+  snapshot.callback_time = callback_time.GetSnapshot();
+  snapshot.alarm_time = alarm_time.GetSnapshot();
+  snapshot.events_per_step = events_per_step.GetSnapshot();
+  snapshot.callback_run_time = callback_run_time.GetSnapshot();
+  snapshot.callback_queue_depth = callback_queue_depth.GetSnapshot();
+  snapshot.callback_wait_time = callback_wait_time.GetSnapshot();
+  snapshot.alarm_lateness = alarm_lateness.GetSnapshot();
+  return snapshot;
+}
+
+std::string SelectorStats::Snapshot::ToPrometheusText(
+    absl::Span<const Snapshot> snapshots, absl::string_view prefix) {
+  std::string out;
+  auto append_header = [&out, prefix](absl::string_view name,
+                                      absl::string_view type,
+                                      absl::string_view help) {
+    absl::StrAppend(&out, "# HELP ", prefix, "_", name, " ", help, "\n",
+                    "# TYPE ", prefix, "_", name, " ", type, "\n");
+  };
+  auto append_values = [&out, prefix, snapshots](
+                           absl::string_view name,
+                           double (*value)(const Snapshot&)) {
+    for (size_t i = 0; i < snapshots.size(); ++i) {
+      absl::StrAppend(&out, prefix, "_", name, "{selector=\"", i, "\"} ",
+                      value(snapshots[i]), "\n");
+    }
+  };
+  auto append_summary = [&out, prefix, snapshots](
+                            absl::string_view name, double scale,
+                            Histogram::Snapshot Snapshot::*histogram) {
+    for (size_t i = 0; i < snapshots.size(); ++i) {
+      const Histogram::Snapshot& h = snapshots[i].*histogram;
+      for (const double q : kQuantiles) {
+        absl::StrAppend(&out, prefix, "_", name, "{selector=\"", i,
+                        "\",quantile=\"", q, "\"} ",
+                        h.Percentile(q) * scale, "\n");
+      }
+      absl::StrAppend(&out, prefix, "_", name, "_sum{selector=\"", i, "\"} ",
+                      h.sum * scale, "\n", prefix, "_", name,
+                      "_count{selector=\"", i, "\"} ", h.count, "\n");
+    }
+  };
+
+  append_header("loop_steps_total", "counter", "Select loop steps.");
+  append_values("loop_steps_total",
+                [](const Snapshot& s) -> double { return s.loop_steps; });
+  append_header("events_total", "counter", "I/O events dispatched.");
+  append_values("events_total",
+                [](const Snapshot& s) -> double { return s.events; });
+  append_header("callbacks_total", "counter",
+                "Callbacks run in the select loop.");
+  append_values("callbacks_total",
+                [](const Snapshot& s) -> double { return s.callbacks; });
+  append_header("alarms_total", "counter", "Alarms run in the select loop.");
+  append_values("alarms_total",
+                [](const Snapshot& s) -> double { return s.alarms; });
+  append_header("slow_callbacks_total", "counter",
+                "Callbacks and alarms that ran over the slow threshold.");
+  append_values("slow_callbacks_total",
+                [](const Snapshot& s) -> double { return s.slow_callbacks; });
+  append_header("loop_utilization", "gauge",
+                "Fraction of time the select loop was not waiting.");
+  append_values("loop_utilization",
+                [](const Snapshot& s) { return s.loop_utilization; });
+  append_header("registered", "gauge", "Registered selectables.");
+  append_values("registered",
+                [](const Snapshot& s) -> double { return s.num_registered; });
+  append_header("registered_alarms", "gauge", "Registered alarms.");
+  append_values("registered_alarms",
+                [](const Snapshot& s) -> double { return s.num_alarms; });
+  append_header("buffered_output_bytes", "gauge",
+                "Output buffered by the connections, not yet sent.");
+  append_values("buffered_output_bytes", [](const Snapshot& s) -> double {
+    return s.buffered_output_bytes;
+  });
+
+  struct SummaryInfo {
+    const char* name;
+    Histogram::Snapshot Snapshot::*histogram;
+    bool is_duration;
+    const char* help;
+  };
+  static constexpr SummaryInfo kSummaries[] = {
+      {"wait_seconds", &Snapshot::wait_time, true,
+       "Time waiting for events per loop step."},
+      {"event_seconds", &Snapshot::event_time, true,
+       "Time dispatching events per loop step."},
+      {"callback_seconds", &Snapshot::callback_time, true,
+       "Time running callbacks per loop step."},
+      {"alarm_seconds", &Snapshot::alarm_time, true,
+       "Time running alarms per loop step."},
+      {"events_per_step", &Snapshot::events_per_step, false,
+       "I/O events per loop step."},
+      {"callback_run_seconds", &Snapshot::callback_run_time, true,
+       "Run time of each callback and alarm."},
+      {"callback_queue_depth", &Snapshot::callback_queue_depth, false,
+       "Callbacks queued when starting to run them."},
+      {"callback_wait_seconds", &Snapshot::callback_wait_time, true,
+       "Time the oldest callback waited in the queue."},
+      {"alarm_lateness_seconds", &Snapshot::alarm_lateness, true,
+       "Time the alarms ran after their deadline."},
+  };
+  for (const SummaryInfo& summary : kSummaries) {
+    append_header(summary.name, "summary", summary.help);
+    append_summary(summary.name, summary.is_duration ? 1e-9 : 1.0,
+                   summary.histogram);
+  }
+  return out;
+}
+
+}  // namespace net
+}  // namespace whisper
@@ -0,0 +1,147 @@
+#ifndef WHISPERLIB_NET_SELECTOR_STATS_H_
+#define WHISPERLIB_NET_SELECTOR_STATS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+namespace whisper {
+namespace net {
+
+// A histogram of non negative integer values (e.g. durations in nanos),
+// w/ log-linear buckets, in the style of HdrHistogram: each power of two
+// range is split in kNumSubBuckets linear buckets, so the values are kept
+// w/ a relative error of at most 1 / kNumSubBuckets, in a fixed space.
+//
+// Recording is lock free and wait free, but it is meant to be done from a
+// single thread (e.g. the select loop) - the snapshots can be taken from
+// any thread, and are consistent up to the values being recorded.
+class Histogram {
+ public:
+  static constexpr size_t kSubBucketBits = 4;
+  static constexpr size_t kNumSubBuckets = size_t(1) << kSubBucketBits;
+  static constexpr size_t kNumBuckets = (65 - kSubBucketBits)
+                                        << kSubBucketBits;
+
+  struct Snapshot {
+    // Number of values in each bucket - see BucketLowerBound().
+    std::vector<uint64_t> counts;
+    // Number of values, their sum, and the maximum value recorded.
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    double Mean() const;
+    // The value at percentile p (between 0 and 1) - in fact the upper bound
+    // of its bucket, capped at max. Zero for empty histograms.
+    uint64_t Percentile(double p) const;
+  };
+
+  Histogram();
+
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  void Record(uint64_t value);
+  // Records the duration in nanoseconds - negative ones as zero.
+  void RecordDuration(absl::Duration duration);
+
+  Snapshot GetSnapshot() const;
+
+  // The bucket of a value, and the smallest / largest value in a bucket.
+  static size_t BucketIndex(uint64_t value);
+  static uint64_t BucketLowerBound(size_t index);
+  static uint64_t BucketUpperBound(size_t index);
+
+ private:
+  // Single writer increment - a plain load / store, w/o the locked
+  // instruction of fetch_add.
+  static void Increment(std::atomic<uint64_t>* value, uint64_t delta) {
+    value->store(value->load(std::memory_order_relaxed) + delta,
+                 std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> counts_[kNumBuckets];
+  std::atomic<uint64_t> sum_ = ATOMIC_VAR_INIT(0);
+  std::atomic<uint64_t> max_ = ATOMIC_VAR_INIT(0);
+};
+
+// Instrumentation of a select loop - the counters and histograms are
+// updated from the selector thread, and can be read from any thread,
+// through GetSnapshot(). Enabled by Selector::Params::collect_stats.
+//
+// The durations are in nanoseconds.
+struct SelectorStats {
+  struct Snapshot {
+    // Number of loop steps (waits for I/O events).
+    uint64_t loop_steps = 0;
+    // Number of I/O events dispatched.
+    uint64_t events = 0;
+    // Number of RunInSelectLoop() callbacks and of alarms run, and how many
+    // of both took longer than Selector::Params::slow_callback_threshold.
+    uint64_t callbacks = 0;
+    uint64_t alarms = 0;
+    uint64_t slow_callbacks = 0;
+    // Gauges, filled in by the Selector (available w/o collect_stats too).
+    double loop_utilization = 0;
+    uint64_t num_registered = 0;
+    uint64_t num_alarms = 0;
+    uint64_t buffered_output_bytes = 0;
+
+    // Per loop step: time waiting for events, time dispatching events,
+    // running callbacks, and running alarms (the last two only for the
+    // steps that ran any).
+    Histogram::Snapshot wait_time;
+    Histogram::Snapshot event_time;
+    Histogram::Snapshot callback_time;
+    Histogram::Snapshot alarm_time;
+    // Number of events returned per loop step.
+    Histogram::Snapshot events_per_step;
+    // Run time of each callback and alarm.
+    Histogram::Snapshot callback_run_time;
+    // Callbacks queued when we start running a batch of them.
+    Histogram::Snapshot callback_queue_depth;
+    // How long the oldest callback of a batch waited in the queue - this is
+    // approximate: a lower bound for the callbacks deferred to the next
+    // step, which are not timestamped individually.
+    Histogram::Snapshot callback_wait_time;
+    // How late the alarms ran, after their deadline. For the timing wheel
+    // backend only the earliest alarm of each step is measured.
+    Histogram::Snapshot alarm_lateness;
+
+    // Formats snapshots (e.g. of all the selectors in a process) in the
+    // Prometheus text exposition format: counters, gauges, and the
+    // histograms as summaries (durations in seconds), each labeled w/
+    // selector="<index in snapshots>".
+    static std::string ToPrometheusText(absl::Span<const Snapshot> snapshots,
+                                        absl::string_view prefix = "selector");
+  };
+
+  Snapshot GetSnapshot() const;
+
+  std::atomic<uint64_t> loop_steps = ATOMIC_VAR_INIT(0);
+  std::atomic<uint64_t> events = ATOMIC_VAR_INIT(0);
+  std::atomic<uint64_t> callbacks = ATOMIC_VAR_INIT(0);
+  std::atomic<uint64_t> alarms = ATOMIC_VAR_INIT(0);
+  std::atomic<uint64_t> slow_callbacks = ATOMIC_VAR_INIT(0);
+
+  Histogram wait_time;
+  Histogram event_time;
+  Histogram callback_time;
+  Histogram alarm_time;
+  Histogram events_per_step;
+  Histogram callback_run_time;
+  Histogram callback_queue_depth;
+  Histogram callback_wait_time;
+  Histogram alarm_lateness;
+};
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_SELECTOR_STATS_H_
@@ -0,0 +1,81 @@
+#include "whisperlib/net/selector_stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace whisper {
+namespace net {
+
+TEST(Histogram, Buckets) {
+  for (size_t i = 0; i < Histogram::kNumBuckets; ++i) {
+    const uint64_t lower = Histogram::BucketLowerBound(i);
+    const uint64_t upper = Histogram::BucketUpperBound(i);
+    ASSERT_LE(lower, upper) << i;
+    EXPECT_EQ(Histogram::BucketIndex(lower), i);
+    EXPECT_EQ(Histogram::BucketIndex(upper), i);
+    if (i + 1 < Histogram::kNumBuckets) {
+      EXPECT_EQ(upper + 1, Histogram::BucketLowerBound(i + 1));
+      // The relative precision of the buckets.
+      EXPECT_LE(upper - lower, lower / Histogram::kNumSubBuckets);
+    }
+  }
+  EXPECT_EQ(Histogram::BucketIndex(std::numeric_limits<uint64_t>::max()),
+            Histogram::kNumBuckets - 1);
+}
+
+TEST(Histogram, Percentiles) {
+  Histogram histogram;
+  EXPECT_EQ(histogram.GetSnapshot().Percentile(0.5), 0);
+  std::mt19937_64 rng(17);
+  std::vector<uint64_t> values;
+  for (int i = 0; i < 10000; ++i) {
+    values.push_back(rng() % 10000000);
+    histogram.Record(values.back());
+  }
+  std::sort(values.begin(), values.end());
+  const Histogram::Snapshot snapshot = histogram.GetSnapshot();
+  EXPECT_EQ(snapshot.count, values.size());
+  EXPECT_EQ(snapshot.max, values.back());
+  for (const double p : {0.1, 0.5, 0.9, 0.99, 0.999}) {
+    const uint64_t expected =
+        values[static_cast<size_t>(p * values.size()) - 1];
+    const uint64_t value = snapshot.Percentile(p);
+    EXPECT_GE(value, expected) << p;
+    EXPECT_LE(value, expected + expected / Histogram::kNumSubBuckets) << p;
+  }
+  EXPECT_EQ(snapshot.Percentile(1.0), values.back());
+}
+
+TEST(SelectorStats, PrometheusText) {
+  SelectorStats stats;
+  stats.loop_steps.store(3);
+  stats.wait_time.RecordDuration(absl::Milliseconds(2));
+  std::vector<SelectorStats::Snapshot> snapshots(2);
+  snapshots[1] = stats.GetSnapshot();
+  snapshots[1].loop_utilization = 0.25;
+  snapshots[1].buffered_output_bytes = 4096;
+  const std::string text =
+      SelectorStats::Snapshot::ToPrometheusText(snapshots, "io");
+  EXPECT_THAT(text, ::testing::HasSubstr(
+                        "# TYPE io_loop_steps_total counter\n"
+                        "io_loop_steps_total{selector=\"0\"} 0\n"
+                        "io_loop_steps_total{selector=\"1\"} 3\n"));
+  EXPECT_THAT(text, ::testing::HasSubstr(
+                        "io_loop_utilization{selector=\"1\"} 0.25\n"));
+  EXPECT_THAT(text, ::testing::HasSubstr(
+                        "io_buffered_output_bytes{selector=\"1\"} 4096\n"));
+  EXPECT_THAT(text, ::testing::HasSubstr(
+                        "io_wait_seconds{selector=\"1\",quantile=\"0.5\"} "
+                        "0.002\n"));
+  EXPECT_THAT(text, ::testing::HasSubstr(
+                        "io_wait_seconds_count{selector=\"1\"} 1\n"));
+}
+
+}  // namespace net
+}  // namespace whisper
@@ -1,8 +1,21 @@
-
 #include "whisperlib/net/selector.h"
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/synchronization/notification.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "whisperlib/net/selector_loop.h"
+#include "whisperlib/net/testing_util.h"
 #include "whisperlib/status/testing.h"
 
 namespace whisper {
@@ -20,5 +33,524 @@ TEST(Selector, BasicLoop) {
   EXPECT_TRUE(called);
 }
 
+// Reads what comes on the read end of a pipe, and exits the selector loop
+// when the expected number of bytes was received.
+class PipeReader : public Selectable {
+ public:
+  PipeReader(int fd, size_t expected) : fd_(fd), expected_(expected) {}
+  ~PipeReader() { Close(); }
+
+  bool HandleReadEvent(SelectorEventData event) override {
+    if (!ReadToCord(&data_, 64).ok()) {
+      selector()->MakeLoopExit();
+    }
+    if (data_.size() >= expected_) {
+      selector()->MakeLoopExit();
+    }
+    return true;
+  }
+  int GetFd() const override { return fd_; }
+  void Close() override {
+    if (fd_ != kInvalidFdValue) {
+      if (selector() != nullptr) {
+        selector()->Unregister(this).IgnoreError();
+      }
+      ::close(fd_);
+      fd_ = kInvalidFdValue;
+    }
+  }
+  std::string data() const { return std::string(data_); }
+  size_t expected() const { return expected_; }
+
+ private:
+  int fd_;
+  const size_t expected_;
+  absl::Cord data_;
+};
+
+class SelectorLoopTypeTest
+    : public ::testing::TestWithParam<Selector::LoopType> {
+ protected:
+  void SetUp() override {
+    auto selector =
+        Selector::Create(Selector::Params().set_loop_type(GetParam()));
+    if (IsLoopTypeUnavailable(selector.status())) {
+      // e.g. io_uring disabled / not available in this kernel.
+      GTEST_SKIP() << "Loop type not available: " << selector.status();
+    }
+    ASSERT_OK(selector.status());
+    selector_ = std::move(selector).value();
+  }
+
+  std::unique_ptr<Selector> selector_;
+};
+
+TEST_P(SelectorLoopTypeTest, WakeUpFromOtherThread) {
+  std::atomic_bool called = ATOMIC_VAR_INIT(false);
+  std::thread runner([this, &called]() {
+    absl::SleepFor(absl::Milliseconds(50));
+    selector_->RunInSelectLoop([this, &called]() {
+      called.store(true);
+      selector_->MakeLoopExit();
+    });
+  });
+  ASSERT_OK(selector_->Loop());
+  runner.join();
+  EXPECT_TRUE(called.load());
+}
+
+TEST_P(SelectorLoopTypeTest, ReadEvents) {
+  int fds[2];
+  ASSERT_EQ(::pipe(fds), 0);
+  PipeReader reader(fds[0], 6);
+  ASSERT_OK(selector_->Register(&reader));
+  std::thread writer([fd = fds[1]]() {
+    ASSERT_EQ(::write(fd, "foo", 3), 3);
+    absl::SleepFor(absl::Milliseconds(20));
+    ASSERT_EQ(::write(fd, "bar", 3), 3);
+  });
+  ASSERT_OK(selector_->Loop());
+  writer.join();
+  EXPECT_EQ(reader.data(), "foobar");
+  ::close(fds[1]);
+}
+
+// Writes a byte to the write end of a pipe on each write event, and exits
+// the selector loop after the expected number of events.
+class PipeWriter : public Selectable {
+ public:
+  PipeWriter(int fd, size_t expected) : fd_(fd), expected_(expected) {}
+  ~PipeWriter() { Close(); }
+
+  bool HandleWriteEvent(SelectorEventData event) override {
+    if (::write(fd_, "x", 1) == 1) {
+      ++num_written_;
+    }
+    if (num_written_ >= expected_) {
+      EXPECT_OK(selector()->EnableWriteCallback(this, false));
+      selector()->MakeLoopExit();
+    }
+    return true;
+  }
+  int GetFd() const override { return fd_; }
+  void Close() override {
+    if (fd_ != kInvalidFdValue) {
+      if (selector() != nullptr) {
+        selector()->Unregister(this).IgnoreError();
+      }
+      ::close(fd_);
+      fd_ = kInvalidFdValue;
+    }
+  }
+  size_t num_written() const { return num_written_; }
+
+ private:
+  int fd_;
+  const size_t expected_;
+  size_t num_written_ = 0;
+};
+
+TEST_P(SelectorLoopTypeTest, WriteEvents) {
+  int fds[2];
+  ASSERT_EQ(::pipe(fds), 0);
+  PipeWriter writer(fds[1], 3);
+  ASSERT_OK(selector_->Register(&writer));
+  ASSERT_OK(selector_->EnableReadCallback(&writer, false));
+  ASSERT_OK(selector_->EnableWriteCallback(&writer, true));
+  ASSERT_OK(selector_->Loop());
+  EXPECT_EQ(writer.num_written(), 3);
+  char buffer[8];
+  EXPECT_EQ(::read(fds[0], buffer, sizeof(buffer)), 3);
+  ::close(fds[0]);
+}
+
+TEST_P(SelectorLoopTypeTest, UpdateDesires) {
+  int fds[2];
+  ASSERT_EQ(::pipe(fds), 0);
+  PipeReader reader(fds[0], 3);
+  ASSERT_OK(selector_->Register(&reader));
+  ASSERT_OK(selector_->EnableReadCallback(&reader, false));
+  ASSERT_EQ(::write(fds[1], "foo", 3), 3);
+  selector_->RegisterAlarm(
+      [this, &reader]() {
+        // Not reading while disabled.
+        EXPECT_EQ(reader.data(), "");
+        // Re-armed for reading - the pending data is picked.
+        EXPECT_OK(selector_->EnableReadCallback(&reader, true));
+      },
+      absl::Milliseconds(50));
+  ASSERT_OK(selector_->Loop());
+  EXPECT_EQ(reader.data(), "foo");
+  ::close(fds[1]);
+}
+
+TEST_P(SelectorLoopTypeTest, DeleteAndAddBack) {
+  int fds[2];
+  ASSERT_EQ(::pipe(fds), 0);
+  PipeReader reader(fds[0], 3);
+  ASSERT_OK(selector_->Register(&reader));
+  ASSERT_OK(selector_->Unregister(&reader));
+  ASSERT_EQ(::write(fds[1], "foo", 3), 3);
+  selector_->RegisterAlarm(
+      [this, &reader]() {
+        // No events after the delete.
+        EXPECT_EQ(reader.data(), "");
+        EXPECT_OK(selector_->Register(&reader));
+      },
+      absl::Milliseconds(50));
+  ASSERT_OK(selector_->Loop());
+  EXPECT_EQ(reader.data(), "foo");
+  ::close(fds[1]);
+}
+
+TEST(Selector, RunInSelectLoopFromManyThreads) {
+  ASSERT_OK_AND_ASSIGN(
+      std::unique_ptr<Selector> selector,
+      Selector::Create(Selector::Params().set_max_num_callbacks_per_event(7)));
+  static constexpr int kNumThreads = 4;
+  static constexpr int kNumCallbacks = 1000;
+  // Updated only from the select loop.
+  std::vector<int> last_seen(kNumThreads, -1);
+  int num_run = 0;
+  bool in_order = true;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < kNumCallbacks; ++i) {
+        selector->RunInSelectLoop([&, t, i]() {
+          in_order = in_order && (last_seen[t] + 1 == i);
+          last_seen[t] = i;
+          if (++num_run == kNumThreads * kNumCallbacks) {
+            selector->MakeLoopExit();
+          }
+        });
+      }
+    });
+  }
+  ASSERT_OK(selector->Loop());
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(num_run, kNumThreads * kNumCallbacks);
+  EXPECT_TRUE(in_order);
+}
+
+TEST(Selector, BusyPoll) {
+  ASSERT_OK_AND_ASSIGN(
+      auto thread,
+      SelectorThread::Create(Selector::Params()
+                                 .set_loop_type(Selector::LoopType::EPOLL)
+                                 .set_default_loop_timeout(absl::Minutes(1))
+                                 .set_busy_poll_duration(
+                                     absl::Milliseconds(20))));
+  ASSERT_TRUE(thread->Start());
+  for (int round = 0; round < 3; ++round) {
+    // Ping pong w/ the loop - all picked while busy polling.
+    for (int i = 0; i < 1000; ++i) {
+      absl::Notification done;
+      thread->selector()->RunInSelectLoop([&done]() { done.Notify(); });
+      ASSERT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(5)));
+    }
+    // The loop blocks, and needs to be woken up.
+    absl::SleepFor(absl::Milliseconds(50));
+    absl::Notification done;
+    thread->selector()->RunInSelectLoop([&done]() { done.Notify(); });
+    ASSERT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(5)));
+  }
+  EXPECT_TRUE(thread->Stop());
+}
+
+TEST(Selector, PollTimeout) {
+  // The loop polls w/ a zero timeout when busy polling, or w/ more work
+  // queued - which should not block.
+  EXPECT_EQ(PollTimeout(absl::ZeroDuration()), 0);
+  EXPECT_EQ(PollTimeout(-absl::Milliseconds(5)), 0);
+  EXPECT_EQ(PollTimeout(absl::Microseconds(10)), 1);
+  EXPECT_EQ(PollTimeout(absl::Milliseconds(25)), 25);
+}
+
+TEST(Selector, CancelledAlarmsDoNotSpin) {
+  ASSERT_OK_AND_ASSIGN(
+      auto thread,
+      SelectorThread::Create(Selector::Params()
+                                 .set_alarm_backend(
+                                     Selector::AlarmBackend::HEAP)
+                                 .set_default_loop_timeout(absl::Seconds(1))
+                                 .set_collect_stats(true)));
+  ASSERT_TRUE(thread->Start());
+  Selector* const selector = thread->selector();
+  absl::Notification cancelled;
+  selector->RunInSelectLoop([selector, &cancelled]() {
+    for (int i = 0; i < 10; ++i) {
+      selector->UnregisterAlarm(
+          selector->RegisterAlarm([]() {}, absl::Milliseconds(i)));
+    }
+    cancelled.Notify();
+  });
+  cancelled.WaitForNotification();
+  // Past the deadlines of the cancelled alarms, the loop should just wait.
+  absl::SleepFor(absl::Milliseconds(20));
+  const uint64_t loop_steps = selector->GetStatsSnapshot().loop_steps;
+  absl::SleepFor(absl::Milliseconds(100));
+  EXPECT_LT(selector->GetStatsSnapshot().loop_steps - loop_steps, 10);
+  EXPECT_TRUE(thread->Stop());
+}
+
+class SelectorAlarmTest
+    : public ::testing::TestWithParam<Selector::AlarmBackend> {};
+
+TEST_P(SelectorAlarmTest, Alarms) {
+  ASSERT_OK_AND_ASSIGN(
+      std::unique_ptr<Selector> selector,
+      Selector::Create(Selector::Params().set_alarm_backend(GetParam())));
+  std::vector<int> fired;
+  selector->RegisterAlarm(
+      [&fired, &selector]() {
+        fired.push_back(3);
+        selector->MakeLoopExit();
+      },
+      absl::Milliseconds(30));
+  selector->RegisterAlarm([&fired]() { fired.push_back(1); },
+                          absl::Milliseconds(10));
+  const Selector::AlarmId cancelled = selector->RegisterAlarm(
+      [&fired]() { fired.push_back(-1); }, absl::Milliseconds(15));
+  selector->RegisterAlarm([&fired]() { fired.push_back(2); },
+                          absl::Milliseconds(20));
+  selector->UnregisterAlarm(cancelled);
+  const absl::Time start = absl::Now();
+  ASSERT_OK(selector->Loop());
+  EXPECT_GE(absl::Now() - start, absl::Milliseconds(30));
+  EXPECT_EQ(fired, std::vector<int>({1, 2, 3}));
+}
+
+TEST_P(SelectorAlarmTest, Stats) {
+  ASSERT_OK_AND_ASSIGN(
+      std::unique_ptr<Selector> selector,
+      Selector::Create(Selector::Params()
+                           .set_alarm_backend(GetParam())
+                           .set_collect_stats(true)
+                           .set_slow_callback_threshold(
+                               absl::Milliseconds(5))));
+  ASSERT_NE(selector->stats(), nullptr);
+  for (int i = 0; i < 10; ++i) {
+    selector->RunInSelectLoop([]() {});
+  }
+  selector->RunInSelectLoop([]() { absl::SleepFor(absl::Milliseconds(10)); });
+  selector->RegisterAlarm([&selector]() { selector->MakeLoopExit(); },
+                          absl::Milliseconds(20));
+  ASSERT_OK(selector->Loop());
+
+  const SelectorStats::Snapshot stats = selector->GetStatsSnapshot();
+  EXPECT_GE(stats.loop_steps, 1);
+  EXPECT_EQ(stats.loop_steps, stats.wait_time.count);
+  EXPECT_EQ(stats.loop_steps, stats.events_per_step.count);
+  EXPECT_EQ(stats.callbacks, 11);
+  EXPECT_EQ(stats.alarms, 1);
+  EXPECT_EQ(stats.slow_callbacks, 1);
+  EXPECT_EQ(stats.callback_run_time.count, 12);
+  EXPECT_GE(stats.callback_run_time.max, absl::ToInt64Nanoseconds(
+                                              absl::Milliseconds(10)));
+  EXPECT_GE(stats.callback_queue_depth.max, 11);
+  EXPECT_EQ(stats.callback_wait_time.count, 1);
+  EXPECT_EQ(stats.alarm_lateness.count, 1);
+  EXPECT_GE(stats.alarm_time.count, 1);
+  EXPECT_GE(stats.callback_time.sum, stats.callback_run_time.max);
+  EXPECT_EQ(stats.num_alarms, 0);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    AlarmBackends, SelectorAlarmTest,
+    ::testing::Values(Selector::AlarmBackend::HEAP,
+                      Selector::AlarmBackend::TIMING_WHEEL));
+
+TEST(Selector, PooledReads) {
+  ASSERT_OK_AND_ASSIGN(
+      std::unique_ptr<Selector> selector,
+      Selector::Create(
+          Selector::Params().set_read_buffer_size(4).set_max_free_read_buffers(
+              8)));
+  ASSERT_NE(selector->read_buffer_pool(), nullptr);
+  int fds[2];
+  ASSERT_EQ(::pipe(fds), 0);
+  PipeReader reader(fds[0], 10);
+  ASSERT_OK(selector->Register(&reader));
+  ASSERT_EQ(::write(fds[1], "0123456789", 10), 10);
+  ASSERT_OK(selector->Loop());
+  EXPECT_EQ(reader.data(), "0123456789");
+  // Small reads are copied, so the same buffer is reused all the time.
+  EXPECT_EQ(selector->read_buffer_pool()->num_allocated(), 1);
+  EXPECT_EQ(selector->read_buffer_pool()->num_outstanding(), 0);
+  ::close(fds[1]);
+}
+
+// Drains the pipe on each read event, as needed in edge triggered mode.
+class EdgePipeReader : public PipeReader {
+ public:
+  using PipeReader::PipeReader;
+  bool HandleReadEvent(SelectorEventData event) override {
+    ++num_events_;
+    if (event.synthesized) {
+      ++num_synthesized_;
+    }
+    absl::StatusOr<size_t> cb;
+    do {
+      cb = ReadToCord(&data_, 64);
+    } while (cb.ok() && cb.value() > 0);
+    if (!cb.ok() || data_.size() >= expected()) {
+      selector()->MakeLoopExit();
+    }
+    return true;
+  }
+  bool SupportsEdgeTriggered() const override { return true; }
+  size_t num_events() const { return num_events_; }
+  size_t num_synthesized() const { return num_synthesized_; }
+  std::string edge_data() const { return std::string(data_); }
+
+ private:
+  absl::Cord data_;
+  size_t num_events_ = 0;
+  size_t num_synthesized_ = 0;
+};
+
+TEST(Selector, EdgeTriggered) {
+  ASSERT_OK_AND_ASSIGN(std::unique_ptr<Selector> selector,
+                       Selector::Create(Selector::Params()
+                                            .set_loop_type(
+                                                Selector::LoopType::EPOLL)
+                                            .set_edge_triggered(true)));
+  int fds[2];
+  ASSERT_EQ(::pipe(fds), 0);
+  ASSERT_EQ(::fcntl(fds[0], F_SETFL, O_NONBLOCK), 0);
+  EdgePipeReader reader(fds[0], 6);
+  ASSERT_OK(selector->Register(&reader));
+  EXPECT_TRUE(reader.edge_triggered());
+  // Data arrived while reads are disabled does not generate events...
+  ASSERT_OK(selector->EnableReadCallback(&reader, false));
+  ASSERT_EQ(::write(fds[1], "foo", 3), 3);
+  selector->RegisterAlarm(
+      [&selector, &reader]() {
+        EXPECT_EQ(reader.num_events(), 0);
+        // ... but we get one synthesized when we re-enable them.
+        EXPECT_OK(selector->EnableReadCallback(&reader, true));
+      },
+      absl::Milliseconds(20));
+  selector->RegisterAlarm(
+      [fd = fds[1]]() { ASSERT_EQ(::write(fd, "bar", 3), 3); },
+      absl::Milliseconds(40));
+  ASSERT_OK(selector->Loop());
+  EXPECT_EQ(reader.edge_data(), "foobar");
+  EXPECT_EQ(reader.num_synthesized(), 1);
+  EXPECT_EQ(reader.num_events(), 2);
+  ::close(fds[1]);
+}
+
+TEST(PollSelectorLoop, ManyFileDescriptors) {
+  static constexpr size_t kNumFds = 5000;
+  struct rlimit limit;
+  ASSERT_EQ(::getrlimit(RLIMIT_NOFILE, &limit), 0);
+  if (limit.rlim_cur < kNumFds + 100) {
+    limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, kNumFds + 100);
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  if (limit.rlim_cur < kNumFds + 100) {
+    GTEST_SKIP() << "Cannot open enough file descriptors.";
+  }
+  int signal_fds[2];
+  ASSERT_EQ(::pipe(signal_fds), 0);
+  ASSERT_OK_AND_ASSIGN(auto loop, PollSelectorLoop::Create(signal_fds[0]));
+  // All duplicates of the read end of this pipe are always readable.
+  int fds[2];
+  ASSERT_EQ(::pipe(fds), 0);
+  ASSERT_EQ(::write(fds[1], "x", 1), 1);
+  std::vector<int> dup_fds;
+  std::vector<int> user_data(kNumFds);
+  for (size_t i = 0; i < kNumFds; ++i) {
+    const int fd = ::dup(fds[0]);
+    ASSERT_GE(fd, 0);
+    dup_fds.push_back(fd);
+    ASSERT_OK(loop->Add(fd, &user_data[i], SelectDesire::kWantRead));
+  }
+  EXPECT_TRUE(absl::IsAlreadyExists(
+      loop->Add(dup_fds[0], nullptr, SelectDesire::kWantRead)));
+  // Delete every third, in reverse order, and stop watching the odd ones.
+  for (size_t i = kNumFds; i > 0; --i) {
+    if ((i - 1) % 3 == 0) {
+      ASSERT_OK(loop->Delete(dup_fds[i - 1]));
+    } else if ((i - 1) % 2 == 1) {
+      ASSERT_OK(loop->Update(dup_fds[i - 1], &user_data[i - 1], 0));
+    }
+  }
+  EXPECT_TRUE(absl::IsNotFound(loop->Delete(dup_fds[0])));
+  ASSERT_OK_AND_ASSIGN(auto events, loop->LoopStep(absl::ZeroDuration()));
+  std::vector<size_t> ready;
+  for (const SelectorEventData& event : events) {
+    ASSERT_NE(event.user_data, nullptr);
+    EXPECT_EQ(event.desires, SelectDesire::kWantRead);
+    ready.push_back(static_cast<int*>(event.user_data) - &user_data[0]);
+  }
+  std::sort(ready.begin(), ready.end());
+  std::vector<size_t> expected;
+  for (size_t i = 0; i < kNumFds; ++i) {
+    if (i % 3 != 0 && i % 2 == 0) {
+      expected.push_back(i);
+    }
+  }
+  EXPECT_EQ(ready, expected);
+  for (const int fd : dup_fds) {
+    ::close(fd);
+  }
+  for (const int fd : {fds[0], fds[1], signal_fds[0], signal_fds[1]}) {
+    ::close(fd);
+  }
+}
+
+TEST(SelectorThread, ThreadOptions) {
+  ASSERT_OK_AND_ASSIGN(
+      auto thread,
+      SelectorThread::Create(
+          Selector::Params(),
+          work::ThreadOptions().set_name("selector-0").set_cpu_affinity({0})));
+  ASSERT_TRUE(thread->Start());
+  std::atomic_bool done = ATOMIC_VAR_INIT(false);
+  std::string name;
+  int cpu = -1;
+  thread->selector()->RunInSelectLoop([&done, &name, &cpu]() {
+    char buffer[16] = {};
+    pthread_getname_np(pthread_self(), buffer, sizeof(buffer));
+    name = buffer;
+#ifdef __linux__
+    cpu = sched_getcpu();
+#endif  // __linux__
+    done.store(true);
+  });
+  while (!done.load()) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  EXPECT_EQ(name, "selector-0");
+#ifdef __linux__
+  EXPECT_EQ(cpu, 0);
+#endif  // __linux__
+  EXPECT_TRUE(thread->Stop());
+
+  EXPECT_FALSE(SelectorThread::Create(Selector::Params(),
+                                      work::ThreadOptions().set_joinable(false))
+                   .ok());
+#ifdef __linux__
+  // Failing to apply the options fails the start.
+  ASSERT_OK_AND_ASSIGN(
+      thread, SelectorThread::Create(
+                  Selector::Params(),
+                  work::ThreadOptions().set_cpu_affinity({CPU_SETSIZE + 1})));
+  EXPECT_FALSE(thread->Start());
+  EXPECT_FALSE(thread->selector_status().ok());
+#endif  // __linux__
+}
+
+INSTANTIATE_TEST_SUITE_P(LoopTypes, SelectorLoopTypeTest,
+                         ::testing::Values(Selector::LoopType::POLL,
+                                           Selector::LoopType::EPOLL,
+                                           Selector::LoopType::KQUEUE,
+                                           Selector::LoopType::IO_URING));
+
 }  // namespace net
 }  // namespace whisper
@@ -1,6 +1,21 @@
 #include "whisperlib/net/ssl_connection.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+
+// Needs SSL_OP_ENABLE_KTLS from openssl/ssl.h, included above. We handle
+// the kTLS BIO controls of the OpenSSL record layer, which are internal to
+// OpenSSL, so this is limited to the versions we know them for - w/ the
+// others, the data is always encrypted in user space.
+#if defined(__linux__) && defined(SSL_OP_ENABLE_KTLS) && \
+    !defined(OPENSSL_NO_KTLS) && OPENSSL_VERSION_MAJOR == 3 && \
+    OPENSSL_VERSION_MINOR <= 3
+#include <linux/tls.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#define HAVE_KTLS
+#endif
 
 #include "absl/functional/bind_front.h"
 #include "absl/strings/escaping.h"
@@ -8,11 +23,61 @@
 #include "absl/strings/str_join.h"
 #include "whisperlib/base/call_on_return.h"
 #include "whisperlib/io/errno.h"
+#include "whisperlib/net/read_buffer_pool.h"
+#include "whisperlib/net/ssl_session_cache.h"
 #include "whisperlib/status/status.h"
 
 namespace whisper {
 namespace net {
 
+namespace {
+// Maximum size of the plain text in a TLS record.
+constexpr size_t kMaxTlsRecordSize = 16384;
+// Size of the chunks read from the queued files, before encryption.
+constexpr size_t kFileReadSize = 4 * kMaxTlsRecordSize;
+
+// Copies to dest up to size bytes from the start of cord, returning
+// how many it copied.
+size_t CopyCordPrefix(const absl::Cord& cord, char* dest, size_t size) {
+  size_t cb = 0;
+  for (absl::string_view chunk : cord.Chunks()) {
+    if (cb >= size) {
+      break;
+    }
+    const size_t to_copy = std::min(chunk.size(), size - cb);
+    ::memcpy(dest + cb, chunk.data(), to_copy);
+    cb += to_copy;
+  }
+  return cb;
+}
+}  // namespace
+
+#ifdef HAVE_KTLS
+namespace {
+// BIO controls used by the OpenSSL record layer to set up kTLS (listed as
+// internal in openssl/bio.h) - the same in OpenSSL 3.0 to 3.3.
+constexpr int kBioCtrlSetKtls = 72;
+constexpr int kBioCtrlSetKtlsSendCtrlMsg = 74;
+constexpr int kBioCtrlClearKtlsCtrlMsg = 75;
+
+// The size of the kernel crypto info structure of the provided cipher,
+// 0 if not known.
+size_t KtlsCryptoInfoSize(const struct tls_crypto_info* info) {
+  switch (info->cipher_type) {
+    case TLS_CIPHER_AES_GCM_128:
+      return sizeof(struct tls12_crypto_info_aes_gcm_128);
+    case TLS_CIPHER_AES_GCM_256:
+      return sizeof(struct tls12_crypto_info_aes_gcm_256);
+    case TLS_CIPHER_AES_CCM_128:
+      return sizeof(struct tls12_crypto_info_aes_ccm_128);
+    case TLS_CIPHER_CHACHA20_POLY1305:
+      return sizeof(struct tls12_crypto_info_chacha20_poly1305);
+  }
+  return 0;
+}
+}  // namespace
+#endif  // HAVE_KTLS
+
 absl::string_view SslUtils::SslErrorName(int err) {
   switch (err) {
     case SSL_ERROR_NONE:
@@ -57,7 +122,13 @@ std::string SslUtils::SslLastError() {
   while (true) {
     int line = 0;
     const char* file = nullptr;
-    const int e = ERR_peek_last_error_line(&file, &line);
+    // Pops the error - peeking would loop forever.
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    const unsigned long e =
+        ERR_get_error_all(&file, &line, nullptr, nullptr, nullptr);
+#else
+    const unsigned long e = ERR_get_error_line(&file, &line);
+#endif
     if (e == 0) {
       break;
     }
@@ -233,7 +304,9 @@ SslAcceptor::~SslAcceptor() {}
 
 absl::Status SslAcceptor::Listen(const HostPort& local_addr) {
   RETURN_IF_ERROR(SslInitialize());
-  return tcp_acceptor_.Listen(local_addr);
+  RETURN_IF_ERROR(tcp_acceptor_.Listen(local_addr));
+  set_local_address(tcp_acceptor_.local_address());
+  return absl::OkStatus();
 }
 void SslAcceptor::Close() { tcp_acceptor_.Close(); }
 std::string SslAcceptor::ToString() const {
@@ -257,7 +330,11 @@ void SslAcceptor::TcpAcceptorAcceptHandler(
           absl::bind_front(&SslAcceptor::SslConnectionConnectHandler, this,
                            ssl_connection.get()))
       .set_close_handler(absl::bind_front(
-          &SslAcceptor::SslConnectionCloseHandler, this, ssl_connection.get()));
+          &SslAcceptor::SslConnectionCloseHandler, this, ssl_connection.get()))
+      // Data received until the application gets the connection stays
+      // in the inbuf(), and nothing gets written.
+      .set_read_handler([]() { return absl::OkStatus(); })
+      .set_write_handler([]() { return absl::OkStatus(); });
   ssl_connection.release();  // the pointer is owned by the handlers.
 }
 
@@ -303,7 +380,7 @@ absl::Status SslAcceptor::SslInitialize() {
 SslConnection::SslConnection(Selector* selector, SslConnectionParams params)
     : Connection(selector), params_(std::move(params)) {}
 
-SslConnection::~SslConnection() {}
+SslConnection::~SslConnection() { SslClear(); }
 
 void SslConnection::SetTcpConnectionHandlers() {
   tcp_connection_
@@ -354,6 +431,14 @@ void SslConnection::FlushAndClose() {
   LOG_IF_ERROR(WARNING, RequestWriteEvents(true));
 }
 
+size_t SslConnection::PendingOutputSize() const {
+  size_t size = Connection::PendingOutputSize();
+  if (ABSL_PREDICT_TRUE(tcp_connection_ != nullptr)) {
+    size += tcp_connection_->PendingOutputSize();
+  }
+  return size;
+}
+
 void SslConnection::ForceClose() {
   SslClear();
   if (ABSL_PREDICT_TRUE(tcp_connection_ != nullptr)) {
@@ -422,17 +507,8 @@ void SslConnection::TcpConnectionConnectHandler() {
 }
 
 absl::Status SslConnection::TcpConnectionReadHandler() {
-  // Read from TCP --> write to SSL
-  for (absl::string_view chunk : tcp_connection_->inbuf()->Chunks()) {
-    const int write_size = BIO_write(p_bio_read_, chunk.data(), chunk.size());
-    if (write_size < int(chunk.size())) {
-      return status::InternalErrorBuilder()
-             << "BIO_write failed, closing connection: "
-             << SslUtils::SslLastError();
-    }
-    ssl_in_count_.fetch_add(write_size);
-  }
-  tcp_connection_->inbuf()->Clear();
+  // SSL reads the encrypted data directly from the inbuf() of the tcp
+  // connection, through p_bio_read_.
   if (state() == CONNECTING) {
     // still in handshake
     return SslHandshake();
@@ -445,26 +521,57 @@ absl::Status SslConnection::TcpConnectionReadHandler() {
   //       So even if you have tons of data in BIO, SSL_pending still returns 0.
 
   // Read from SSL --> write back to inbuf()
-  int pending = 0;
+  // We decrypt directly in (pooled) buffers that become inbuf() chunks. As
+  // an SSL_read returns at most a record, we fill each buffer with as many
+  // records as available before passing it to inbuf().
+  ReadBufferPool* const pool = net_selector()->read_buffer_pool();
+  const size_t buffer_size =
+      pool != nullptr ? pool->buffer_size() : params_.tcp_params.block_size;
+  char* buffer = nullptr;
+  size_t buffer_used = 0;
+  auto release_buffer = [pool, &buffer]() {
+    if (buffer == nullptr) {
+      return;
+    } else if (pool != nullptr) {
+      pool->Release(buffer);
+    } else {
+      delete[] buffer;
+    }
+    buffer = nullptr;
+  };
+  auto append_buffer = [this, pool, &buffer, &buffer_used, &release_buffer]() {
+    if (buffer_used == 0) {
+      release_buffer();
+    } else if (pool != nullptr) {
+      pool->AppendToCord(buffer, buffer_used, inbuf());
+    } else {
+      char* const data = buffer;
+      inbuf()->Append(absl::MakeCordFromExternal(
+          absl::string_view(data, buffer_used), [data]() { delete[] data; }));
+    }
+    buffer = nullptr;
+    buffer_used = 0;
+  };
+  base::CallOnReturn clear_buffer(release_buffer);
   // Note - is essential to take the max of pending bytes in the BIO and SSL -
   // the bytes are moved from the BIO to SSL at SSL_read. At the last SSL_read
   // we may end up with byte in internal SSL buffer, but BIO may be empty (not
   // yet read by SSL_read) so we need to read as long as we have any kind of
   // data in both of them.
-  while ((pending = std::max(BIO_pending(p_bio_read_), SSL_pending(p_ssl_))) >
-         0) {
+  while (std::max(BIO_pending(p_bio_read_), SSL_pending(p_ssl_)) > 0) {
     // If there is no data in p_bio_read_ then avoid calling SSL_read because
     // it would return WANT_READ and we'll get read_blocked.
-    size_t scratch_size =
-        std::min(params_.tcp_params.block_size, size_t(pending));
-    char* buffer = new char[scratch_size];
-    base::CallOnReturn clear_buffer([buffer]() { delete[] buffer; });
-    const int cb = SSL_read(p_ssl_, buffer, scratch_size);
-
+    if (buffer == nullptr) {
+      buffer = pool != nullptr ? pool->Acquire() : new char[buffer_size];
+    }
+    size_t cb = 0;
+    const int result = SSL_read_ex(p_ssl_, buffer + buffer_used,
+                                   buffer_size - buffer_used, &cb);
     read_blocked_.store(false);
     read_blocked_on_write_.store(false);
-    if (cb < 0) {
-      const int error = SSL_get_error(p_ssl_, cb);
+    if (result <= 0) {
+      append_buffer();
+      const int error = SSL_get_error(p_ssl_, result);
       switch (error) {
         case SSL_ERROR_NONE:
           break;
@@ -490,10 +597,13 @@ absl::Status SslConnection::TcpConnectionReadHandler() {
       break;
     }
     // SSL_read was successful
-    inbuf()->Append(absl::MakeCordFromExternal(absl::string_view(buffer, cb),
-                                               clear_buffer.reset()));
+    buffer_used += cb;
+    if (buffer_used == buffer_size) {
+      append_buffer();
+    }
   }
-  if (read_blocked_.load() && !outbuf()->empty()) {
+  append_buffer();
+  if (read_blocked_.load() && has_pending_output()) {
     // the write has been stopped due to read_blocked_
     RETURN_IF_ERROR(RequestWriteEvents(true))
         << "For read blocked in SSL read handler.";
@@ -515,17 +625,43 @@ absl::Status SslConnection::TcpConnectionWriteHandler() {
   if (state() == CONNECTING) {
     RETURN_IF_ERROR(SslHandshake())
         << "During SslHandshake in TcpConnectionWriteHandler.";
-  } else if (!read_blocked_.load() && !read_blocked_on_write_.load()) {
+  } else if (ktls_send_.load()) {
+    // The kernel encrypts what we write to the socket, so the application
+    // data goes as is to the tcp connection (and no partial SSL_read can
+    // be corrupted).
+    if (state() == CONNECTED) {
+      RETURN_IF_ERROR(CallWriteHandler());
+    }
+    // This includes the queued files, that the tcp connection sends with
+    // ::sendfile, as kTLS supports it.
+    ssl_out_count_.fetch_add(MoveOutputTo(tcp_connection_.get()));
+  } else if (!read_blocked_on_write_.load()) {
+    // Note: an SSL_read waiting for the rest of a record (read_blocked_)
+    // does not stop us - OpenSSL buffers the records of each direction
+    // separately, and the peer may send nothing until it gets our data.
     // ask application to write something in our outbuf()
     // [don't ask if we're FLUSHING]
     if (state() == CONNECTED) {
       RETURN_IF_ERROR(CallWriteHandler());
     }
-    size_t bytes_written = 0;
     // Read from outbuf() --> write to SSL
-    for (absl::string_view chunk : outbuf()->Chunks()) {
-      const int cb = SSL_write(p_ssl_, chunk.data(), chunk.size());
-      bytes_written += cb;
+    // Small chunks are gathered in full records, as each SSL_write sends
+    // at least one record, with its own framing and authentication tag.
+    while (has_pending_output()) {
+      if (outbuf()->empty()) {
+        // The queued files go through user space, for encryption.
+        RETURN_IF_ERROR(ReadOutputFile(kFileReadSize).status());
+      }
+      absl::string_view data = *outbuf()->chunk_begin();
+      if (data.size() < kMaxTlsRecordSize && outbuf()->size() > data.size()) {
+        if (record_buffer_ == nullptr) {
+          record_buffer_ = absl::make_unique<char[]>(kMaxTlsRecordSize);
+        }
+        data = absl::string_view(
+            record_buffer_.get(),
+            CopyCordPrefix(*outbuf(), record_buffer_.get(), kMaxTlsRecordSize));
+      }
+      const int cb = SSL_write(p_ssl_, data.data(), data.size());
       // write - the number of encrypted bytes written in BIO, always > read
       write_blocked_on_read_.store(false);
       if (cb <= 0) {
@@ -535,14 +671,12 @@ absl::Status SslConnection::TcpConnectionWriteHandler() {
             write_blocked_on_read_.store(true);
             // we need more data in p_bio_read_ so we're just gonna wait for
             // ReadHandler to happen
-            outbuf()->RemovePrefix(bytes_written);
             return absl::OkStatus();
           case SSL_ERROR_WANT_WRITE:
-            // p_bio_write_ is probably full.
-            // But we use memory BIO, so it should never happen.
+            // The tcp BIO may wait for the socket to flush (e.g. before
+            // switching to kTLS) - we continue on the next write event.
             break;
           default:
-            outbuf()->RemovePrefix(bytes_written);
             return status::InternalErrorBuilder()
                    << "SSL_write fatal, SSL_get_error: " << error << " "
                    << SslUtils::SslErrorName(error) << " , "
@@ -550,34 +684,25 @@ absl::Status SslConnection::TcpConnectionWriteHandler() {
         }
         break;
       }
+      outbuf()->RemovePrefix(cb);
+      if (tcp_connection_->outbuf()->size() >= kFileReadSize) {
+        // Enough encrypted - we continue when the tcp connection sent it,
+        // so the queued files are read only as they are sent.
+        break;
+      }
     }
-    outbuf()->Clear();
   }
-  // Else: a partial SSL_read is in progress. DON'T use SSL_write! or it will
+  // Else: an SSL_read needs to write first. DON'T use SSL_write! or it will
   // corrupt internal ssl structures. If we don't write anything to TCP, the
   // write event will be stopped. The ReadHandler will test outbuf non empty
   // and re-enable write.
 
-  // Read from SSL --> write to TCP
-  int pending = 0;
-  while ((pending = BIO_pending(p_bio_write_)) > 0) {
-    size_t scratch_size =
-        std::min(params_.tcp_params.block_size, size_t(pending));
-    char* buffer = new char[scratch_size];
-    base::CallOnReturn clear_buffer([buffer]() { delete[] buffer; });
-    const int cb = BIO_read(p_bio_write_, buffer, sizeof(scratch_size));
-    if (cb < 0) {
-      return status::InternalErrorBuilder()
-             << "BIO_read failed, closing connection: "
-             << SslUtils::SslLastError();
-    }
-    ssl_out_count_.fetch_add(cb);
-    tcp_connection_->outbuf()->Append(absl::MakeCordFromExternal(
-        absl::string_view(buffer, cb), clear_buffer.reset()));
-  }
-
-  // If we sent every piece of data, and we are shutdown SSL
-  if (state() == FLUSHING && outbuf()->empty()) {
+  CheckPendingOutput();
+  // If we sent every piece of data, and we are shutdown SSL.
+  // With kTLS the close alert goes directly to the socket, so all the data
+  // before it needs to be sent first.
+  if (state() == FLUSHING && !has_pending_output() &&
+      (!ktls_send_.load() || !tcp_connection_->has_pending_output())) {
     RETURN_IF_ERROR(SslShutdown())
         << "During SslShutdown on connection flushing.";
     net_selector_->RunInSelectLoop(
@@ -594,8 +719,17 @@ void SslConnection::TcpConnectionCloseHandler(
     if (!shutdown_status.ok()) {
       set_last_error(shutdown_status);
     }
+    // The tcp connection may be already FLUSHING (on remote hangup), and
+    // nothing else would send the close alert we just produced.
+    if (!tcp_connection_->outbuf()->empty()) {
+      LOG_IF_ERROR(WARNING, RequestWriteEvents(true));
+    }
   } else {
     set_state(DISCONNECTED);
+    // As the tcp connection does, we drop the output not sent.
+    outbuf()->Clear();
+    out_files_.clear();
+    CheckPendingOutput();
     CallCloseHandler(status, directive);
   }
 }
@@ -646,17 +780,31 @@ absl::Status SslConnection::SslInitialize(bool is_server) {
   if (verify_mode != SSL_VERIFY_NONE) {
     SSL_set_verify(p_ssl_, verify_mode, SslConnectionVerifyCallback);
   }
-  p_bio_read_ = BIO_new(BIO_s_mem());
+  // Both BIOs go directly to the buffers of the tcp connection.
+  p_bio_read_ = BIO_new(TcpBioMethod());
   RET_CHECK(p_bio_read_ != nullptr)
-      << "Cannot allocate a new bio_read buffer: " << SslUtils::SslLastError();
-  p_bio_write_ = BIO_new(BIO_s_mem());
+      << "Cannot allocate a new tcp bio_read: " << SslUtils::SslLastError();
+  BIO_set_data(p_bio_read_, this);
+  BIO_set_init(p_bio_read_, 1);
+  p_bio_write_ = BIO_new(TcpBioMethod());
   RET_CHECK(p_bio_write_ != nullptr)
-      << "Cannot allocate a new bio_write buffer: " << SslUtils::SslLastError();
+      << "Cannot allocate a new tcp bio_write: " << SslUtils::SslLastError();
+  BIO_set_data(p_bio_write_, this);
+  BIO_set_init(p_bio_write_, 1);
+#ifdef HAVE_KTLS
+  if (params_.enable_ktls) {
+    SSL_set_options(p_ssl_, SSL_OP_ENABLE_KTLS);
+  }
+#endif  // HAVE_KTLS
   SSL_set_bio(p_ssl_, p_bio_read_, p_bio_write_);
   if (is_server) {
     SSL_set_accept_state(p_ssl_);
   } else {
     SSL_set_connect_state(p_ssl_);
+    // Offer the last session we got from this peer, for resumption.
+    if (SslSessionCache* cache = SslSessionCache::FromContext(p_ctx_)) {
+      cache->SetClientSession(p_ssl_, GetRemoteAddress().ToString());
+    }
   }
   return absl::OkStatus();
 }
@@ -691,19 +839,12 @@ absl::Status SslConnection::SslHandshake() {
     return absl::OkStatus();
   }
   if (SSL_is_init_finished(p_ssl_)) {
-    // SSL completed the handshake but did we empty the ssl buffers?
-    if (BIO_pending(p_bio_write_) > 0) {
-      RETURN_IF_ERROR(RequestWriteEvents(true))
-          << "After SslHandshake finished - delaying connect handler per "
-             "pending "
-             "writed: "
-          << BIO_pending(p_bio_write_);
-      return absl::OkStatus();
-    }
+    // What SSL still has to send is already in the tcp outbuf(), before
+    // any application data.
     handshake_finished_.store(true);
     set_state(CONNECTED);
     net_selector_->RunInSelectLoop(
-        absl::bind_front(&SslConnection::CallConnectHandler, this));
+        absl::bind_front(&SslConnection::SslHandshakeCompleted, this));
     return absl::OkStatus();
   }
   const int result = SSL_do_handshake(p_ssl_);
@@ -725,16 +866,29 @@ absl::Status SslConnection::SslHandshake() {
     return absl::OkStatus();
   }
   // The handshake is completed for this endpoint(SSL_do_handshake returned 1).
-  // But maybe we need to send some data to the other endpoint.
-  int ssl_want = SSL_want(p_ssl_);
+  // The tcp BIO wrote all SSL data to the tcp connection, so we are done -
+  // and there may be no other write event to continue with.
+  const int ssl_want = SSL_want(p_ssl_);
   LOG(INFO).WithVerbosity(1)
       << "ssl_want: " << ssl_want << " " << SslUtils::SslWantName(ssl_want)
-      << ", BIO_pending(p_bio_write_): " << BIO_pending(p_bio_write_)
-      << ", BIO_pending(p_bio_read_): " << BIO_pending(p_bio_read_);
-  RETURN_IF_ERROR(RequestWriteEvents(true));
-  // Next thing TcpConnectionWriteHandler will read from SSl
-  // --> write to TCP and will call SslHandshake again.
-  return absl::OkStatus();
+      << ", tcp outbuf: " << tcp_connection_->outbuf()->size()
+      << ", tcp inbuf: " << tcp_connection_->inbuf()->size();
+  return SslHandshake();
+}
+
+void SslConnection::SslHandshakeCompleted() {
+  CallConnectHandler();
+  // The peer data that came with its last handshake message is already
+  // in p_bio_read_ (or in inbuf(), for the temporary acceptor handlers),
+  // and we may get no other tcp read event for it.
+  if (state() == CONNECTED &&
+      (BIO_pending(p_bio_read_) > 0 || !inbuf()->empty())) {
+    auto read_status = TcpConnectionReadHandler();
+    if (!read_status.ok()) {
+      set_last_error(read_status);
+      ForceClose();
+    }
+  }
 }
 
 absl::Status SslConnection::SslShutdown() {
@@ -747,23 +901,171 @@ absl::Status SslConnection::SslShutdown() {
     LOG(WARNING) << "SSL_shutdown error: " << SslUtils::SslErrorName(error)
                  << " detail: " << SslUtils::SslLastError();
   }
-  // Read from SSL --> write to TCP (the last SSL close signal)
-  int pending = 0;
-  while ((pending = BIO_pending(p_bio_write_)) > 0) {
-    size_t scratch_size =
-        std::min(params_.tcp_params.block_size, size_t(pending));
-    char* buffer = new char[scratch_size];
-    base::CallOnReturn clear_buffer([buffer]() { delete[] buffer; });
-    const int cb = BIO_read(p_bio_write_, buffer, scratch_size);
-    if (cb < 0) {
-      return status::InternalErrorBuilder()
-             << "BIO_read failed on SslShutdown: " << SslUtils::SslLastError();
+  return absl::OkStatus();
+}
+
+BIO_METHOD* SslConnection::TcpBioMethod() {
+  static BIO_METHOD* const method = []() {
+    BIO_METHOD* method =
+        BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+                     "whisper tcp connection");
+    if (method != nullptr) {
+      BIO_meth_set_read(method, &SslConnection::TcpBioRead);
+      BIO_meth_set_write(method, &SslConnection::TcpBioWrite);
+      BIO_meth_set_ctrl(method, &SslConnection::TcpBioCtrl);
     }
-    ssl_out_count_.fetch_add(cb);
-    tcp_connection_->outbuf()->Append(absl::MakeCordFromExternal(
-        absl::string_view(buffer, cb), clear_buffer.reset()));
+    return method;
+  }();
+  return method;
+}
+
+int SslConnection::TcpBioRead(BIO* bio, char* data, int size) {
+  auto conn = reinterpret_cast<SslConnection*>(BIO_get_data(bio));
+  BIO_clear_retry_flags(bio);
+  if (ABSL_PREDICT_FALSE(conn->tcp_connection_ == nullptr)) {
+    return -1;
   }
-  return absl::OkStatus();
+  absl::Cord* const inbuf = conn->tcp_connection_->inbuf();
+  if (inbuf->empty()) {
+    BIO_set_retry_read(bio);
+    return -1;
+  }
+  const size_t cb = CopyCordPrefix(*inbuf, data, size);
+  inbuf->RemovePrefix(cb);
+  conn->ssl_in_count_.fetch_add(cb);
+  return cb;
+}
+
+int SslConnection::TcpBioWrite(BIO* bio, const char* data, int size) {
+  auto conn = reinterpret_cast<SslConnection*>(BIO_get_data(bio));
+  BIO_clear_retry_flags(bio);
+  if (ABSL_PREDICT_FALSE(conn->tcp_connection_ == nullptr)) {
+    return -1;
+  }
+  if (conn->ktls_record_type_ >= 0) {
+    return conn->TcpBioSendControlRecord(bio, data, size);
+  }
+  conn->ssl_out_count_.fetch_add(size);
+  conn->tcp_connection_->outbuf()->Append(absl::string_view(data, size));
+  return size;
+}
+
+long SslConnection::TcpBioCtrl(BIO* bio, int cmd, long num, void* ptr) {
+  auto conn = reinterpret_cast<SslConnection*>(BIO_get_data(bio));
+  switch (cmd) {
+    case BIO_CTRL_FLUSH:
+      return conn->TcpBioFlush(bio);
+    case BIO_CTRL_PENDING:
+      // What SSL can read - we buffer nothing for writing.
+      return bio == conn->p_bio_read_ && conn->tcp_connection_ != nullptr
+                 ? conn->tcp_connection_->inbuf()->size()
+                 : 0;
+    case BIO_CTRL_WPENDING:
+      return 0;
+#ifdef HAVE_KTLS
+    case BIO_CTRL_GET_KTLS_SEND:
+      return conn->ktls_send_.load() ? 1 : 0;
+    case BIO_CTRL_GET_KTLS_RECV:
+      return 0;
+    case kBioCtrlSetKtls:
+      // num is set for transmission - we receive only through p_bio_read_.
+      return num != 0 ? conn->TcpBioEnableKtlsSend(ptr) : 0;
+    case kBioCtrlSetKtlsSendCtrlMsg:
+      conn->ktls_record_type_ = static_cast<int>(num);
+      return 0;
+    case kBioCtrlClearKtlsCtrlMsg:
+      conn->ktls_record_type_ = -1;
+      return 0;
+#endif  // HAVE_KTLS
+  }
+  return 0;
+}
+
+long SslConnection::TcpBioFlush(BIO* bio) {
+  // SSL flushes before switching the encryption to the kernel, and before
+  // sending control records with kTLS on, so we need to write to the socket
+  // now. If we cannot, SSL retries the flush later (our write handler
+  // calls it again), or does not use kTLS.
+  BIO_clear_retry_flags(bio);
+  if (ABSL_PREDICT_FALSE(tcp_connection_ == nullptr)) {
+    return -1;
+  }
+  auto flush_result = tcp_connection_->FlushOutbuf();
+  if (!flush_result.ok()) {
+    LOG(INFO).WithVerbosity(1)
+        << "Flushing the tcp connection failed: " << flush_result.status();
+    return -1;
+  }
+  if (!flush_result.value()) {
+    BIO_set_retry_write(bio);
+    return 0;
+  }
+  return 1;
+}
+
+long SslConnection::TcpBioEnableKtlsSend(const void* crypto_info) {
+#ifdef HAVE_KTLS
+  const size_t crypto_info_size = KtlsCryptoInfoSize(
+      reinterpret_cast<const struct tls_crypto_info*>(crypto_info));
+  if (crypto_info_size == 0) {
+    LOG(INFO).WithVerbosity(1) << "Cipher not supported for kTLS.";
+    return 0;
+  }
+  const int fd = tcp_connection_->GetFd();
+  if (::setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0 &&
+      error::Errno() != EEXIST) {
+    LOG(INFO).WithVerbosity(1)
+        << "kTLS not available: " << error::ErrnoToString(error::Errno());
+    return 0;
+  }
+  if (::setsockopt(fd, SOL_TLS, TLS_TX, crypto_info, crypto_info_size) < 0) {
+    LOG(INFO).WithVerbosity(1) << "kTLS transmission setup failed: "
+                               << error::ErrnoToString(error::Errno());
+    return 0;
+  }
+  ktls_send_.store(true);
+  return 1;
+#else
+  return 0;
+#endif  // HAVE_KTLS
+}
+
+int SslConnection::TcpBioSendControlRecord(BIO* bio, const char* data,
+                                           int size) {
+#ifdef HAVE_KTLS
+  // With kTLS, the record type of non application data is passed in a
+  // control message, so we send the data directly (after SSL flushed us).
+  char control[CMSG_SPACE(sizeof(unsigned char))] = {};
+  struct iovec iov = {const_cast<char*>(data), size_t(size)};
+  struct msghdr msg = {};
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_TLS;
+  cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+  *CMSG_DATA(cmsg) = static_cast<unsigned char>(ktls_record_type_);
+  const ssize_t cb =
+      ::sendmsg(tcp_connection_->GetFd(), &msg, MSG_NOSIGNAL);
+  if (cb < 0) {
+    if (error::IsUnavailableAndShouldRetry(error::Errno())) {
+      BIO_set_retry_write(bio);
+    }
+    return -1;
+  }
+  ssl_out_count_.fetch_add(cb);
+  tcp_connection_->inc_bytes_written(cb);
+  // On a partial write SSL retries w/ the rest of the record, which needs to
+  // go out w/ the same record type.
+  if (cb == size) {
+    ktls_record_type_ = -1;
+  }
+  return static_cast<int>(cb);
+#else
+  return -1;
+#endif  // HAVE_KTLS
 }
 
 }  // namespace net
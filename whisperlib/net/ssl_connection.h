@@ -2,6 +2,7 @@
 #define WHISPERLIB_NET_SSL_CONNECTION_H_
 
 #include <atomic>
+#include <memory>
 #include <string>
 
 #include "absl/status/status.h"
@@ -60,6 +61,13 @@ struct SslConnectionParams {
   bool allow_unchecked_private_key = false;
   // Parameters for the underlying TCP connection.
   TcpConnectionParams tcp_params;
+  // After the handshake, offload the encryption of the sent data to the
+  // kernel (kTLS), so the application data goes to the socket without
+  // going through SSL_write & co. If the kernel or the negotiated cipher
+  // do not support it, we fall back to encrypting it in user space (as we do
+  // for OpenSSL versions other than 3.0 to 3.3).
+  // The received data is always decrypted in user space.
+  bool enable_ktls = false;
 };
 
 struct SslAcceptorParams {
@@ -105,6 +113,10 @@ class SslConnection : public Connection {
   SslConnection(Selector* selector, SslConnectionParams params);
   ~SslConnection() override;
 
+  // Allocated from the selector arena, as TcpConnection.
+  static void* operator new(size_t size) { return SelectorArena::New(size); }
+  static void operator delete(void* p) { SelectorArena::Delete(p); }
+
   ////////// Connection interface methods
   absl::Status Connect(const HostPort& remote_addr) override;
   void FlushAndClose() override;
@@ -116,12 +128,24 @@ class SslConnection : public Connection {
   HostPort GetLocalAddress() const override;
   HostPort GetRemoteAddress() const override;
   std::string ToString() const override;
+  // Includes the encrypted output not yet sent by the tcp connection.
+  size_t PendingOutputSize() const override;
 
   // Used from the depth of the ssl verification callback to set the
   // verification status failed
   void SslSetVerificationFailed() { verification_failed_.store(true); }
   static int SslVerificationIndex() { return verification_index_.load(); }
 
+  // If the encryption of the sent data is done by the kernel (kTLS).
+  bool ktls_send() const { return ktls_send_.load(); }
+  // Encrypted bytes sent to / received from the tcp connection.
+  uint64_t ssl_out_count() const { return ssl_out_count_.load(); }
+  uint64_t ssl_in_count() const { return ssl_in_count_.load(); }
+  // If the handshake resumed a previous session (see SslSessionCache).
+  bool session_reused() const {
+    return p_ssl_ != nullptr && SSL_session_reused(p_ssl_) == 1;
+  }
+
  private:
   // Use an already established tcp connection. Usually obtained by an acceptor.
   // We take ownership of tcp_connection.
@@ -144,9 +168,24 @@ class SslConnection : public Connection {
 
   // Performs the SSL handshake.
   absl::Status SslHandshake();
+  // Calls the connect handler once the handshake completed, then processes
+  // any application data received together with the end of the handshake.
+  void SslHandshakeCompleted();
   // Performs the SSL shutdown.
   absl::Status SslShutdown();
 
+  // The BIO used by SSL for the encrypted data. Instead of buffering in
+  // memory, it reads directly from the inbuf(), and appends directly to the
+  // outbuf() of the tcp connection, and can set up kTLS on its socket.
+  static BIO_METHOD* TcpBioMethod();
+  static int TcpBioRead(BIO* bio, char* data, int size);
+  static int TcpBioWrite(BIO* bio, const char* data, int size);
+  static long TcpBioCtrl(BIO* bio, int cmd, long num, void* ptr);
+  // The ktls related BIO controls, for the underlying socket.
+  long TcpBioFlush(BIO* bio);
+  long TcpBioEnableKtlsSend(const void* crypto_info);
+  int TcpBioSendControlRecord(BIO* bio, const char* data, int size);
+
   // Used to initialize the verification index.
   static absl::Status InitializeSslVerificationIndex();
 
@@ -155,15 +194,12 @@ class SslConnection : public Connection {
   // The underlying TCP connection:
   std::unique_ptr<TcpConnection> tcp_connection_;
 
-  // The maximum size of BIO buffers
-  static const size_t kSslBufferSize = 10000;
-
   // The OpenSSL structures
   // Context - also contains the certificate and key.
   SSL_CTX* p_ctx_ = nullptr;
-  // Network --> SSL , use BIO_write(p_bio_read_, ...)
+  // Network --> SSL, reads from the inbuf() of tcp_connection_.
   BIO* p_bio_read_ = nullptr;
-  // Network <-- SSL , use BIO_read(p_bio_write_, ...)
+  // Network <-- SSL, appends to the outbuf() of tcp_connection_.
   BIO* p_bio_write_ = nullptr;
   // Specific SSL structure for this connextion
   SSL* p_ssl_ = nullptr;
@@ -179,6 +215,9 @@ class SslConnection : public Connection {
   std::atomic_bool read_blocked_on_write_ = ATOMIC_VAR_INIT(false);
   std::atomic_bool write_blocked_on_read_ = ATOMIC_VAR_INIT(false);
 
+  // Buffer for gathering small outbuf() chunks in a full TLS record.
+  std::unique_ptr<char[]> record_buffer_;
+
   // for debug, count output/input bytes
   std::atomic_uint64_t ssl_out_count_ = ATOMIC_VAR_INIT(0);
   std::atomic_uint64_t ssl_in_count_ = ATOMIC_VAR_INIT(0);
@@ -186,6 +225,12 @@ class SslConnection : public Connection {
   // If the ssl verification failed:
   std::atomic_bool verification_failed_ = ATOMIC_VAR_INIT(false);
 
+  // If the kernel encrypts the data we send (kTLS is on for transmission).
+  std::atomic_bool ktls_send_ = ATOMIC_VAR_INIT(false);
+  // With kTLS on, the type of the next (non application data) record
+  // written by SSL in TcpBioWrite, or -1 for application data.
+  int ktls_record_type_ = -1;
+
   // Guards the verification index:
   static absl::Mutex verification_mutex_;
   // Ssl index registerd for setting custom data to SSL object.
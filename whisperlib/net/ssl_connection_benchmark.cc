@@ -0,0 +1,172 @@
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "absl/memory/memory.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "benchmark/benchmark.h"
+#include "whisperlib/net/ssl_connection.h"
+#include "whisperlib/net/testing_util.h"
+
+namespace whisper {
+namespace net {
+namespace {
+// An SSL echo server, and the client side, in the same selector thread.
+class SslEchoSetup {
+ public:
+  explicit SslEchoSetup(bool enable_ktls) {
+    auto server_context = SslUtils::SslCreateContext();
+    CHECK(server_context.ok()) << server_context.status();
+    server_context_ = server_context.value();
+    const absl::Status status = SetSelfSignedCertificate(server_context_);
+    CHECK(status.ok()) << status;
+    auto client_context = SslUtils::SslCreateContext();
+    CHECK(client_context.ok()) << client_context.status();
+    client_params_.ssl_context = client_context.value();
+    client_params_.enable_ktls = enable_ktls;
+
+    auto thread = SelectorThread::Create();
+    CHECK(thread.ok()) << thread.status();
+    thread_ = std::move(thread).value();
+    CHECK(thread_->Start());
+    SslAcceptorParams acceptor_params;
+    acceptor_params.ssl_params.ssl_context = server_context_;
+    acceptor_params.ssl_params.enable_ktls = enable_ktls;
+    acceptor_ =
+        absl::make_unique<SslAcceptor>(thread_->selector(), acceptor_params);
+    acceptor_->set_accept_handler([this](std::unique_ptr<Connection> c) {
+      Connection* const connection = c.get();
+      connection->set_read_handler([connection]() {
+        connection->Write(std::move(*connection->inbuf()));
+        connection->inbuf()->Clear();
+        return absl::OkStatus();
+      });
+      connection->set_write_handler([]() { return absl::OkStatus(); });
+      servers_.emplace_back(std::move(c));
+      num_accepted_.fetch_add(1);
+    });
+    RunAndWait(thread_.get(), [this]() {
+      CHECK(acceptor_
+                ->Listen(HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0))
+                .ok());
+    });
+    address_ = HostPort(absl::nullopt, IpAddress::kIPv4Localhost,
+                        acceptor_->local_address().port().value());
+  }
+  ~SslEchoSetup() {
+    RunAndWait(thread_.get(), [this]() {
+      CloseServers();
+      acceptor_->Close();
+    });
+    thread_->Stop();
+    SslUtils::SslDeleteContext(server_context_);
+    SslUtils::SslDeleteContext(client_params_.ssl_context);
+  }
+
+  SelectorThread* thread() const { return thread_.get(); }
+  const SslConnectionParams& client_params() const { return client_params_; }
+  const HostPort& address() const { return address_; }
+  size_t num_accepted() const { return num_accepted_.load(); }
+  // Closes the accepted connections - call in the select loop.
+  void CloseServers() {
+    for (auto& server : servers_) {
+      server->ForceClose();
+    }
+    servers_.clear();
+  }
+
+ private:
+  SSL_CTX* server_context_ = nullptr;
+  SslConnectionParams client_params_;
+  std::unique_ptr<SelectorThread> thread_;
+  std::unique_ptr<SslAcceptor> acceptor_;
+  HostPort address_;
+  // Accessed from the select loop.
+  std::vector<std::unique_ptr<Connection>> servers_;
+  std::atomic_size_t num_accepted_ = ATOMIC_VAR_INIT(0);
+};
+
+// A full connection: TCP connect and SSL handshake, on both sides.
+void BM_SslHandshake(benchmark::State& state) {
+  SslEchoSetup setup(false);
+  for (auto _ : state) {
+    const size_t num_accepted = setup.num_accepted();
+    auto client = absl::make_unique<SslConnection>(
+        setup.thread()->selector(), setup.client_params());
+    absl::Notification connected;
+    client->set_connect_handler([&connected]() { connected.Notify(); });
+    RunAndWait(setup.thread(),
+               [&]() { CHECK(client->Connect(setup.address()).ok()); });
+    connected.WaitForNotification();
+    while (setup.num_accepted() == num_accepted) {
+      absl::SleepFor(absl::Microseconds(10));
+    }
+    RunAndWait(setup.thread(), [&]() {
+      client->ForceClose();
+      client.reset();
+      setup.CloseServers();
+    });
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_SslHandshake)->UseRealTime();
+
+// Echo of chunks of range(0) bytes, w/ or w/o kernel TLS.
+void BM_SslEchoThroughput(benchmark::State& state, bool enable_ktls) {
+  SslEchoSetup setup(enable_ktls);
+  SslConnection client(setup.thread()->selector(), setup.client_params());
+  const size_t size = state.range(0);
+  const std::string chunk(size, 'x');
+  // The bytes echoed back, vs. written - guarded by mutex.
+  struct Progress {
+    size_t received = 0;
+    size_t expected = 0;
+    bool Done() const { return received >= expected; }
+  };
+  absl::Mutex mutex;
+  Progress progress;
+  absl::Notification connected;
+  client.set_connect_handler([&connected]() { connected.Notify(); });
+  client.set_write_handler([]() { return absl::OkStatus(); });
+  client.set_read_handler([&]() {
+    absl::MutexLock l(&mutex);
+    progress.received += client.inbuf()->size();
+    client.inbuf()->Clear();
+    return absl::OkStatus();
+  });
+  RunAndWait(setup.thread(),
+             [&]() { CHECK(client.Connect(setup.address()).ok()); });
+  connected.WaitForNotification();
+  for (auto _ : state) {
+    {
+      absl::MutexLock l(&mutex);
+      progress.expected += size;
+    }
+    setup.thread()->selector()->RunInSelectLoop(
+        [&client, &chunk]() { client.Write(chunk); });
+    absl::MutexLock l(&mutex);
+    mutex.Await(absl::Condition(&progress, &Progress::Done));
+  }
+  RunAndWait(setup.thread(), [&]() { client.ForceClose(); });
+  state.SetBytesProcessed(state.iterations() * size);
+}
+
+BENCHMARK_CAPTURE(BM_SslEchoThroughput, user_space, false)
+    ->Arg(4096)
+    ->Arg(1 << 16)
+    ->Arg(1 << 20)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(BM_SslEchoThroughput, ktls, true)
+    ->Arg(4096)
+    ->Arg(1 << 16)
+    ->Arg(1 << 20)
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace net
+}  // namespace whisper
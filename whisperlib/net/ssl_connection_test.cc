@@ -0,0 +1,331 @@
+#include "whisperlib/net/ssl_connection.h"
+
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/notification.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "whisperlib/io/file.h"
+#include "whisperlib/net/testing_util.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace net {
+
+// Parametrized on the enable_ktls of the connections.
+class SslConnectionTransferTest : public ::testing::TestWithParam<bool> {};
+
+TEST_P(SslConnectionTransferTest, EchoTransfer) {
+  if (GetParam() && !KtlsAvailable()) {
+    GTEST_SKIP() << "kTLS not available.";
+  }
+  ASSERT_OK_AND_ASSIGN(SSL_CTX * server_context, SslUtils::SslCreateContext());
+  ASSERT_OK(SetSelfSignedCertificate(server_context));
+  ASSERT_OK_AND_ASSIGN(SSL_CTX * client_context, SslUtils::SslCreateContext());
+
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  SslAcceptorParams acceptor_params;
+  acceptor_params.ssl_params.ssl_context = server_context;
+  acceptor_params.ssl_params.enable_ktls = GetParam();
+  SslAcceptor acceptor(thread->selector(), acceptor_params);
+  std::unique_ptr<Connection> server;
+  acceptor.set_accept_handler([&server](std::unique_ptr<Connection> c) {
+    server = std::move(c);
+    Connection* const connection = server.get();
+    connection->set_read_handler([connection]() {
+      connection->Write(std::move(*connection->inbuf()));
+      connection->inbuf()->Clear();
+      return absl::OkStatus();
+    });
+    connection->set_write_handler([]() { return absl::OkStatus(); });
+  });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+  const uint16_t port = acceptor.local_address().port().value();
+
+  static constexpr size_t kSize = 1 << 20;
+  std::string data(kSize, ' ');
+  for (size_t i = 0; i < kSize; ++i) {
+    data[i] = 'a' + (i * 7) % 26;
+  }
+  SslConnectionParams client_params;
+  client_params.ssl_context = client_context;
+  client_params.enable_ktls = GetParam();
+  SslConnection client(thread->selector(), client_params);
+  std::string received;
+  absl::Notification done;
+  client.set_connect_handler([&client, &data]() {
+    LOG(INFO) << "Client connected, kTLS send: " << client.ktls_send();
+    client.Write(data);
+  });
+  client.set_write_handler([]() { return absl::OkStatus(); });
+  client.set_read_handler([&]() {
+    received.append(std::string(*client.inbuf()));
+    client.inbuf()->Clear();
+    if (received.size() >= kSize && !done.HasBeenNotified()) {
+      done.Notify();
+    }
+    return absl::OkStatus();
+  });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(client.Connect(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, port)));
+  });
+  ASSERT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(30)));
+  EXPECT_TRUE(received == data);
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_EQ(client.ktls_send(), GetParam());
+    client.ForceClose();
+    server->ForceClose();
+    server.reset();
+    acceptor.Close();
+  });
+  thread->Stop();
+  SslUtils::SslDeleteContext(server_context);
+  SslUtils::SslDeleteContext(client_context);
+}
+
+INSTANTIATE_TEST_SUITE_P(Ktls, SslConnectionTransferTest, ::testing::Bool());
+
+// With kTLS, the close alert is a control record sent directly to the
+// socket, after all the data.
+TEST(SslConnection, KtlsCloseNotify) {
+  if (!KtlsAvailable()) {
+    GTEST_SKIP() << "kTLS not available.";
+  }
+  ASSERT_OK_AND_ASSIGN(SSL_CTX * server_context, SslUtils::SslCreateContext());
+  ASSERT_OK(SetSelfSignedCertificate(server_context));
+  ASSERT_OK_AND_ASSIGN(SSL_CTX * client_context, SslUtils::SslCreateContext());
+
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  SslAcceptorParams acceptor_params;
+  acceptor_params.ssl_params.ssl_context = server_context;
+  SslAcceptor acceptor(thread->selector(), acceptor_params);
+  std::unique_ptr<Connection> server;
+  std::string received;
+  absl::Status close_status = absl::UnknownError("Not closed.");
+  absl::Notification closed;
+  acceptor.set_accept_handler([&](std::unique_ptr<Connection> c) {
+    server = std::move(c);
+    Connection* const connection = server.get();
+    connection->set_read_handler([&received, connection]() {
+      received.append(std::string(*connection->inbuf()));
+      connection->inbuf()->Clear();
+      return absl::OkStatus();
+    });
+    connection->set_write_handler([]() { return absl::OkStatus(); });
+    connection->set_close_handler(
+        [&, connection](const absl::Status& status,
+                        Connection::CloseDirective directive) {
+          if (directive != Connection::CLOSE_WRITE &&
+              !closed.HasBeenNotified()) {
+            // The data decrypted w/ the alert is left in inbuf().
+            received.append(std::string(*connection->inbuf()));
+            connection->inbuf()->Clear();
+            close_status = status;
+            closed.Notify();
+          }
+        });
+  });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+
+  const std::string data(300000, 'k');
+  SslConnectionParams client_params;
+  client_params.ssl_context = client_context;
+  client_params.enable_ktls = true;
+  SslConnection client(thread->selector(), client_params);
+  bool ktls_send = false;
+  client.set_connect_handler([&]() {
+    ktls_send = client.ktls_send();
+    client.Write(data);
+    client.FlushAndClose();
+  });
+  client.set_write_handler([]() { return absl::OkStatus(); });
+  client.set_read_handler([]() { return absl::OkStatus(); });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(client.Connect(HostPort(absl::nullopt, IpAddress::kIPv4Localhost,
+                                      acceptor.local_address().port())));
+  });
+  ASSERT_TRUE(closed.WaitForNotificationWithTimeout(absl::Seconds(30)));
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_TRUE(ktls_send);
+    // Closed by the alert, after receiving all the data.
+    EXPECT_OK(close_status);
+    EXPECT_TRUE(received == data);
+    client.ForceClose();
+    server->ForceClose();
+    server.reset();
+    acceptor.Close();
+  });
+  thread->Stop();
+  SslUtils::SslDeleteContext(server_context);
+  SslUtils::SslDeleteContext(client_context);
+}
+
+TEST(SslConnection, SmallWritesInFullRecords) {
+  ASSERT_OK_AND_ASSIGN(SSL_CTX * server_context, SslUtils::SslCreateContext());
+  ASSERT_OK(SetSelfSignedCertificate(server_context));
+  ASSERT_OK_AND_ASSIGN(SSL_CTX * client_context, SslUtils::SslCreateContext());
+
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  SslAcceptorParams acceptor_params;
+  acceptor_params.ssl_params.ssl_context = server_context;
+  SslAcceptor acceptor(thread->selector(), acceptor_params);
+  static constexpr size_t kNumWrites = 1000;
+  static constexpr size_t kWriteSize = 100;
+  std::unique_ptr<Connection> server;
+  std::string received;
+  absl::Notification done;
+  acceptor.set_accept_handler([&](std::unique_ptr<Connection> c) {
+    server = std::move(c);
+    Connection* const connection = server.get();
+    connection->set_read_handler([&received, &done, connection]() {
+      received.append(std::string(*connection->inbuf()));
+      connection->inbuf()->Clear();
+      if (received.size() >= kNumWrites * kWriteSize &&
+          !done.HasBeenNotified()) {
+        done.Notify();
+      }
+      return absl::OkStatus();
+    });
+    connection->set_write_handler([]() { return absl::OkStatus(); });
+  });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+
+  SslConnectionParams client_params;
+  client_params.ssl_context = client_context;
+  SslConnection client(thread->selector(), client_params);
+  std::string data;
+  uint64_t handshake_out_count = 0;
+  client.set_connect_handler([&]() {
+    handshake_out_count = client.ssl_out_count();
+    for (size_t i = 0; i < kNumWrites; ++i) {
+      const std::string chunk(kWriteSize, 'a' + i % 26);
+      client.Write(chunk);
+      data.append(chunk);
+    }
+  });
+  client.set_write_handler([]() { return absl::OkStatus(); });
+  client.set_read_handler([]() { return absl::OkStatus(); });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(client.Connect(HostPort(absl::nullopt, IpAddress::kIPv4Localhost,
+                                      acceptor.local_address().port())));
+  });
+  ASSERT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(30)));
+  EXPECT_TRUE(received == data);
+  RunAndWait(thread.get(), [&]() {
+    // At most about 30 bytes of framing per record, in records of 16KiB.
+    static constexpr size_t kMaxRecords = kNumWrites * kWriteSize / 16384 + 1;
+    EXPECT_LE(client.ssl_out_count() - handshake_out_count,
+              kNumWrites * kWriteSize + 32 * kMaxRecords);
+    client.ForceClose();
+    server->ForceClose();
+    server.reset();
+    acceptor.Close();
+  });
+  thread->Stop();
+  SslUtils::SslDeleteContext(server_context);
+  SslUtils::SslDeleteContext(client_context);
+}
+
+// Parametrized on enabling kTLS, when the files are sent with ::sendfile.
+class SslConnectionWriteFileTest : public ::testing::TestWithParam<bool> {};
+
+TEST_P(SslConnectionWriteFileTest, WriteFile) {
+  if (GetParam() && !KtlsAvailable()) {
+    GTEST_SKIP() << "kTLS not available.";
+  }
+  const std::string filename =
+      absl::StrCat(::testing::TempDir(), "/ssl_connection_test_write_file");
+  std::string content(300000, ' ');
+  for (size_t i = 0; i < content.size(); ++i) {
+    content[i] = 'a' + (i * 11) % 26;
+  }
+  ASSERT_OK(io::File::WriteFromString(filename, content).status());
+  ASSERT_OK_AND_ASSIGN(SSL_CTX * server_context, SslUtils::SslCreateContext());
+  ASSERT_OK(SetSelfSignedCertificate(server_context));
+  ASSERT_OK_AND_ASSIGN(SSL_CTX * client_context, SslUtils::SslCreateContext());
+
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  SslAcceptorParams acceptor_params;
+  acceptor_params.ssl_params.ssl_context = server_context;
+  SslAcceptor acceptor(thread->selector(), acceptor_params);
+  const std::string expected =
+      absl::StrCat("head:", content, ":middle:", content.substr(7, 20000),
+                   ":tail");
+  std::unique_ptr<Connection> server;
+  std::string received;
+  absl::Notification done;
+  acceptor.set_accept_handler([&](std::unique_ptr<Connection> c) {
+    server = std::move(c);
+    Connection* const connection = server.get();
+    connection->set_read_handler([&, connection]() {
+      received.append(std::string(*connection->inbuf()));
+      connection->inbuf()->Clear();
+      if (received.size() >= expected.size() && !done.HasBeenNotified()) {
+        done.Notify();
+      }
+      return absl::OkStatus();
+    });
+    connection->set_write_handler([]() { return absl::OkStatus(); });
+  });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(acceptor.Listen(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+  });
+
+  SslConnectionParams client_params;
+  client_params.ssl_context = client_context;
+  client_params.enable_ktls = GetParam();
+  SslConnection client(thread->selector(), client_params);
+  client.set_connect_handler([&]() {
+    auto file = io::File::Open(filename);
+    ASSERT_OK(file.status());
+    client.Write(absl::string_view("head:"));
+    EXPECT_OK(client.WriteFile(*file.value(), 0, content.size()));
+    client.Write(absl::string_view(":middle:"));
+    EXPECT_OK(client.WriteFile(*file.value(), 7, 20000));
+    client.Write(absl::string_view(":tail"));
+  });
+  client.set_write_handler([]() { return absl::OkStatus(); });
+  client.set_read_handler([]() { return absl::OkStatus(); });
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_OK(client.Connect(HostPort(absl::nullopt, IpAddress::kIPv4Localhost,
+                                      acceptor.local_address().port())));
+  });
+  ASSERT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(30)));
+  EXPECT_TRUE(received == expected);
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_FALSE(client.has_pending_output());
+    EXPECT_EQ(client.ktls_send(), GetParam());
+    client.ForceClose();
+    server->ForceClose();
+    server.reset();
+    acceptor.Close();
+  });
+  thread->Stop();
+  SslUtils::SslDeleteContext(server_context);
+  SslUtils::SslDeleteContext(client_context);
+  ::unlink(filename.c_str());
+}
+
+INSTANTIATE_TEST_SUITE_P(Ktls, SslConnectionWriteFileTest, ::testing::Bool());
+
+}  // namespace net
+}  // namespace whisper
@@ -0,0 +1,357 @@
+#include "whisperlib/net/ssl_session_cache.h"
+
+#include <cstring>
+#include <utility>
+
+#include "absl/hash/hash.h"
+#include "absl/log/log.h"
+#include "absl/strings/str_cat.h"
+#include "openssl/evp.h"
+#include "openssl/rand.h"
+#include "whisperlib/status/status.h"
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include "openssl/core_names.h"
+#include "openssl/params.h"
+#endif
+
+namespace whisper {
+namespace net {
+
+namespace {
+// Server side sessions are keyed by their id, client side by peer.
+std::string ServerKey(const unsigned char* id, unsigned int id_size) {
+  return absl::StrCat(
+      "s", absl::string_view(reinterpret_cast<const char*>(id), id_size));
+}
+std::string ClientKey(absl::string_view peer) {
+  return absl::StrCat("c", peer);
+}
+void FreeClientPeer(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx,
+                    long argl, void* argp) {
+  delete reinterpret_cast<std::string*>(ptr);
+}
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<SslSessionCache>> SslSessionCache::Create(
+    Params params) {
+  auto cache = absl::WrapUnique(new SslSessionCache(std::move(params)));
+  RETURN_IF_ERROR(cache->Initialize());
+  return cache;
+}
+
+SslSessionCache::SslSessionCache(Params params)
+    : params_(std::move(params)),
+      max_sessions_per_shard_(
+          params_.num_shards == 0
+              ? 0
+              : std::max<size_t>(1,
+                                 params_.max_sessions / params_.num_shards)) {
+}
+
+SslSessionCache::~SslSessionCache() {
+  for (auto& shard : shards_) {
+    absl::MutexLock l(&shard->mutex);
+    for (auto& it : shard->sessions) {
+      SSL_SESSION_free(it.second.session);
+    }
+    shard->sessions.clear();
+    shard->order.clear();
+  }
+}
+
+absl::Status SslSessionCache::Initialize() {
+  RET_CHECK(params_.num_shards > 0) << "Invalid number of shards.";
+  RET_CHECK(params_.ticket_key_rotation > absl::ZeroDuration())
+      << "Invalid ticket key rotation period: "
+      << absl::FormatDuration(params_.ticket_key_rotation);
+  RET_CHECK(ContextIndex() >= 0 && ClientPeerIndex() >= 0)
+      << "Cannot obtain SSL ex data indices for the session cache.";
+  shards_.reserve(params_.num_shards);
+  for (size_t i = 0; i < params_.num_shards; ++i) {
+    shards_.emplace_back(absl::make_unique<Shard>());
+  }
+  absl::MutexLock l(&ticket_mutex_);
+  return MaybeRotateTicketKeys(absl::Now());
+}
+
+int SslSessionCache::ContextIndex() {
+  static const int index = SSL_CTX_get_ex_new_index(
+      0, const_cast<char*>("SslSessionCache"), nullptr, nullptr, nullptr);
+  return index;
+}
+
+int SslSessionCache::ClientPeerIndex() {
+  static const int index =
+      SSL_get_ex_new_index(0, const_cast<char*>("SslSessionCache::peer"),
+                           nullptr, nullptr, &FreeClientPeer);
+  return index;
+}
+
+absl::Status SslSessionCache::Attach(SSL_CTX* ctx) {
+  RET_CHECK(ctx != nullptr);
+  if (FromContext(ctx) != nullptr) {
+    return status::FailedPreconditionErrorBuilder()
+           << "SSL context already has a session cache attached.";
+  }
+  RET_CHECK(SSL_CTX_set_ex_data(ctx, ContextIndex(), this) == 1)
+      << "Cannot attach the session cache to the SSL context.";
+  // We keep the sessions, for both client and server side connections.
+  SSL_CTX_set_session_cache_mode(
+      ctx, SSL_SESS_CACHE_BOTH | SSL_SESS_CACHE_NO_INTERNAL);
+  SSL_CTX_sess_set_new_cb(ctx, &SslSessionCache::NewSessionCallback);
+  SSL_CTX_sess_set_get_cb(ctx, &SslSessionCache::GetSessionCallback);
+  SSL_CTX_sess_set_remove_cb(ctx, &SslSessionCache::RemoveSessionCallback);
+  // Needed for resuming sessions when verifying the peer certificates.
+  static constexpr unsigned char kSessionIdContext[] = "whisperlib";
+  RET_CHECK(SSL_CTX_set_session_id_context(ctx, kSessionIdContext,
+                                           sizeof(kSessionIdContext) - 1) == 1)
+      << "Cannot set the session id context.";
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  RET_CHECK(SSL_CTX_set_tlsext_ticket_key_evp_cb(
+                ctx, &SslSessionCache::TicketKeyCallback) == 1)
+      << "Cannot set the session ticket key callback.";
+#endif
+  return absl::OkStatus();
+}
+
+SslSessionCache* SslSessionCache::FromContext(SSL_CTX* ctx) {
+  return reinterpret_cast<SslSessionCache*>(
+      SSL_CTX_get_ex_data(ctx, ContextIndex()));
+}
+
+bool SslSessionCache::SetClientSession(SSL* ssl, absl::string_view peer) {
+  // Remember the peer, for the sessions we are going to receive.
+  delete reinterpret_cast<std::string*>(
+      SSL_get_ex_data(ssl, ClientPeerIndex()));
+  SSL_set_ex_data(ssl, ClientPeerIndex(), new std::string(peer));
+  SSL_SESSION* const session = Lookup(ClientKey(peer));
+  if (session == nullptr) {
+    stats_.client_misses.fetch_add(1);
+    return false;
+  }
+  const int result = SSL_set_session(ssl, session);
+  SSL_SESSION_free(session);  // SSL_set_session got its own reference.
+  if (result != 1) {
+    stats_.client_misses.fetch_add(1);
+    return false;
+  }
+  stats_.client_hits.fetch_add(1);
+  return true;
+}
+
+size_t SslSessionCache::size() const {
+  size_t size = 0;
+  for (const auto& shard : shards_) {
+    absl::MutexLock l(&shard->mutex);
+    size += shard->sessions.size();
+  }
+  return size;
+}
+
+SslSessionCache::Shard* SslSessionCache::GetShard(absl::string_view key) const {
+  return shards_[absl::Hash<absl::string_view>()(key) % shards_.size()].get();
+}
+
+void SslSessionCache::Insert(std::string key, SSL_SESSION* session) {
+  Shard* const shard = GetShard(key);
+  absl::MutexLock l(&shard->mutex);
+  auto it = shard->sessions.find(key);
+  if (it != shard->sessions.end()) {
+    SSL_SESSION_free(it->second.session);
+    shard->order.erase(it->second.order_it);
+    shard->sessions.erase(it);
+  }
+  while (!shard->order.empty() &&
+         shard->sessions.size() >= max_sessions_per_shard_) {
+    auto oldest = shard->sessions.find(shard->order.front());
+    SSL_SESSION_free(oldest->second.session);
+    shard->sessions.erase(oldest);
+    shard->order.pop_front();
+    stats_.evictions.fetch_add(1);
+  }
+  shard->order.push_back(key);
+  shard->sessions.emplace(std::move(key),
+                          Shard::Entry{session, std::prev(shard->order.end())});
+}
+
+SSL_SESSION* SslSessionCache::Lookup(absl::string_view key) const {
+  Shard* const shard = GetShard(key);
+  absl::MutexLock l(&shard->mutex);
+  auto it = shard->sessions.find(key);
+  if (it == shard->sessions.end()) {
+    return nullptr;
+  }
+  SSL_SESSION_up_ref(it->second.session);
+  return it->second.session;
+}
+
+void SslSessionCache::Remove(absl::string_view key) {
+  Shard* const shard = GetShard(key);
+  absl::MutexLock l(&shard->mutex);
+  auto it = shard->sessions.find(key);
+  if (it != shard->sessions.end()) {
+    SSL_SESSION_free(it->second.session);
+    shard->order.erase(it->second.order_it);
+    shard->sessions.erase(it);
+  }
+}
+
+int SslSessionCache::NewSessionCallback(SSL* ssl, SSL_SESSION* session) {
+  SslSessionCache* const cache = FromContext(SSL_get_SSL_CTX(ssl));
+  if (cache == nullptr) {
+    return 0;
+  }
+  if (SSL_is_server(ssl)) {
+    unsigned int id_size = 0;
+    const unsigned char* id = SSL_SESSION_get_id(session, &id_size);
+    cache->Insert(ServerKey(id, id_size), session);
+    return 1;  // we keep the reference.
+  }
+  const auto peer =
+      reinterpret_cast<std::string*>(SSL_get_ex_data(ssl, ClientPeerIndex()));
+  if (peer == nullptr || !SSL_SESSION_is_resumable(session)) {
+    return 0;
+  }
+  cache->Insert(ClientKey(*peer), session);
+  return 1;
+}
+
+SSL_SESSION* SslSessionCache::GetSessionCallback(SSL* ssl,
+                                                 const unsigned char* id,
+                                                 int id_size, int* copy) {
+  // We return our own new reference.
+  *copy = 0;
+  SslSessionCache* const cache = FromContext(SSL_get_SSL_CTX(ssl));
+  if (cache == nullptr) {
+    return nullptr;
+  }
+  SSL_SESSION* const session = cache->Lookup(ServerKey(id, id_size));
+  if (session == nullptr) {
+    cache->stats_.misses.fetch_add(1);
+  } else {
+    cache->stats_.hits.fetch_add(1);
+  }
+  return session;
+}
+
+void SslSessionCache::RemoveSessionCallback(SSL_CTX* ctx,
+                                            SSL_SESSION* session) {
+  SslSessionCache* const cache = FromContext(ctx);
+  if (cache == nullptr) {
+    return;
+  }
+  unsigned int id_size = 0;
+  const unsigned char* id = SSL_SESSION_get_id(session, &id_size);
+  cache->Remove(ServerKey(id, id_size));
+}
+
+absl::Status SslSessionCache::MaybeRotateTicketKeys(absl::Time now) {
+  if (!ticket_keys_.empty() &&
+      now - ticket_keys_.back().created < params_.ticket_key_rotation) {
+    return absl::OkStatus();
+  }
+  TicketKey key;
+  RET_CHECK(RAND_bytes(key.name, sizeof(key.name)) == 1 &&
+            RAND_bytes(key.aes_key, sizeof(key.aes_key)) == 1 &&
+            RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) == 1)
+      << "Cannot generate a new session ticket key.";
+  key.created = now;
+  if (!ticket_keys_.empty()) {
+    stats_.ticket_key_rotations.fetch_add(1);
+  }
+  ticket_keys_.push_back(key);
+  if (ticket_keys_.size() > 2) {
+    ticket_keys_.erase(ticket_keys_.begin());
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<SslSessionCache::TicketKey> SslSessionCache::CurrentTicketKey() {
+  const absl::Time now = absl::Now();
+  {
+    absl::ReaderMutexLock l(&ticket_mutex_);
+    if (now - ticket_keys_.back().created < params_.ticket_key_rotation) {
+      return ticket_keys_.back();
+    }
+  }
+  absl::MutexLock l(&ticket_mutex_);
+  RETURN_IF_ERROR(MaybeRotateTicketKeys(now));
+  return ticket_keys_.back();
+}
+
+bool SslSessionCache::FindTicketKey(const unsigned char* name, TicketKey* key,
+                                    bool* is_current) const {
+  const absl::Time now = absl::Now();
+  absl::ReaderMutexLock l(&ticket_mutex_);
+  for (size_t i = 0; i < ticket_keys_.size(); ++i) {
+    const TicketKey& crt = ticket_keys_[i];
+    if (::memcmp(crt.name, name, sizeof(crt.name)) != 0) {
+      continue;
+    }
+    // The encrypting key expires one period after it was replaced.
+    if (now - crt.created >= 2 * params_.ticket_key_rotation) {
+      return false;
+    }
+    *key = crt;
+    *is_current = (i + 1 == ticket_keys_.size() &&
+                   now - crt.created < params_.ticket_key_rotation);
+    return true;
+  }
+  return false;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int SslSessionCache::TicketKeyCallback(SSL* ssl, unsigned char* key_name,
+                                       unsigned char* iv,
+                                       EVP_CIPHER_CTX* cipher_ctx,
+                                       EVP_MAC_CTX* mac_ctx, int encrypt) {
+  SslSessionCache* const cache = FromContext(SSL_get_SSL_CTX(ssl));
+  if (cache == nullptr) {
+    return -1;
+  }
+  const EVP_CIPHER* const cipher = EVP_aes_256_cbc();
+  TicketKey key;
+  bool is_current = true;
+  if (encrypt) {
+    auto key_result = cache->CurrentTicketKey();
+    if (!key_result.ok()) {
+      LOG(WARNING) << "Cannot encrypt session ticket: "
+                   << key_result.status();
+      return -1;
+    }
+    key = std::move(key_result).value();
+    ::memcpy(key_name, key.name, sizeof(key.name));
+    if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(cipher)) != 1 ||
+        EVP_EncryptInit_ex(cipher_ctx, cipher, nullptr, key.aes_key, iv) !=
+            1) {
+      return -1;
+    }
+  } else {
+    if (!cache->FindTicketKey(key_name, &key, &is_current)) {
+      cache->stats_.ticket_misses.fetch_add(1);
+      return 0;  // unknown ticket - do a full handshake.
+    }
+    if (EVP_DecryptInit_ex(cipher_ctx, cipher, nullptr, key.aes_key, iv) !=
+        1) {
+      return -1;
+    }
+    cache->stats_.ticket_hits.fetch_add(1);
+  }
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key,
+                                        sizeof(key.hmac_key)),
+      OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                       const_cast<char*>("sha256"), 0),
+      OSSL_PARAM_construct_end()};
+  if (EVP_MAC_CTX_set_params(mac_ctx, params) != 1) {
+    return -1;
+  }
+  // 2 tells OpenSSL to issue a new ticket, with the current key. TLS 1.3
+  // clients do not reuse the tickets, so they need a new one every time.
+  return is_current && SSL_version(ssl) != TLS1_3_VERSION ? 1 : 2;
+}
+#endif
+
+}  // namespace net
+}  // namespace whisper
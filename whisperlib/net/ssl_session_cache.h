@@ -0,0 +1,164 @@
+#ifndef WHISPERLIB_NET_SSL_SESSION_CACHE_H_
+#define WHISPERLIB_NET_SSL_SESSION_CACHE_H_
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "openssl/ssl.h"
+
+namespace whisper {
+namespace net {
+
+// A thread safe cache of TLS sessions, attached to an SSL_CTX (usually
+// created with SslUtils::SslCreateContext), so the SslConnection objects
+// using it - from all the selector threads of an SslAcceptor - can resume
+// the sessions of reconnecting clients, skipping the asymmetric crypto.
+//
+// On the server side it stores the sessions by id (replacing the OpenSSL
+// internal cache, with its single global lock), and issues session tickets
+// with keys that are periodically rotated. On the client side it stores
+// the last session obtained from a peer address, and the SslConnection
+// offers it when connecting again to that peer.
+//
+// The sessions are split in shards, each with its own mutex, and are
+// evicted in their insertion order when a shard is full.
+// NOTE: the cache needs to outlive the contexts it is attached to.
+class SslSessionCache {
+ public:
+  struct Params {
+    // Number of independently locked shards.
+    size_t num_shards = 16;
+    // Maximum number of sessions kept, across all shards.
+    size_t max_sessions = 20480;
+    // Period after which we start encrypting the session tickets with a new
+    // key. The tickets encrypted with the previous key are still accepted
+    // (and renewed) for one more period.
+    absl::Duration ticket_key_rotation = absl::Hours(1);
+
+    Params& set_num_shards(size_t value) {
+      num_shards = value;
+      return *this;
+    }
+    Params& set_max_sessions(size_t value) {
+      max_sessions = value;
+      return *this;
+    }
+    Params& set_ticket_key_rotation(absl::Duration value) {
+      ticket_key_rotation = value;
+      return *this;
+    }
+  };
+  static absl::StatusOr<std::unique_ptr<SslSessionCache>> Create(
+      Params params);
+  ~SslSessionCache();
+
+  SslSessionCache(const SslSessionCache&) = delete;
+  SslSessionCache& operator=(const SslSessionCache&) = delete;
+
+  // Makes the SSL objects created from the provided context use this cache.
+  // One context can have at most one cache.
+  absl::Status Attach(SSL_CTX* ctx);
+  // Returns the cache attached to ctx, or null.
+  static SslSessionCache* FromContext(SSL_CTX* ctx);
+
+  // Client side: sets the session we have for the provided peer (if any)
+  // to the ssl, before the handshake starts. Returns true if we had one.
+  bool SetClientSession(SSL* ssl, absl::string_view peer);
+
+  struct Statistics {
+    // Server side session lookups, by id, that found / not found a session.
+    std::atomic_size_t hits = ATOMIC_VAR_INIT(0);
+    std::atomic_size_t misses = ATOMIC_VAR_INIT(0);
+    // Session tickets we decrypted / could not (unknown or expired key).
+    std::atomic_size_t ticket_hits = ATOMIC_VAR_INIT(0);
+    std::atomic_size_t ticket_misses = ATOMIC_VAR_INIT(0);
+    // Client side: sessions offered for resumption, and cases with none.
+    std::atomic_size_t client_hits = ATOMIC_VAR_INIT(0);
+    std::atomic_size_t client_misses = ATOMIC_VAR_INIT(0);
+    // Sessions evicted for making room to others.
+    std::atomic_size_t evictions = ATOMIC_VAR_INIT(0);
+    // Number of ticket key rotations.
+    std::atomic_size_t ticket_key_rotations = ATOMIC_VAR_INIT(0);
+  };
+  const Statistics& stats() const { return stats_; }
+  // Number of sessions currently in the cache.
+  size_t size() const;
+
+ private:
+  explicit SslSessionCache(Params params);
+  absl::Status Initialize();
+
+  // A shard of sessions, keyed by server side session id or client peer.
+  struct Shard {
+    struct Entry {
+      SSL_SESSION* session = nullptr;
+      std::list<std::string>::iterator order_it;
+    };
+    mutable absl::Mutex mutex;
+    absl::flat_hash_map<std::string, Entry> sessions ABSL_GUARDED_BY(mutex);
+    // Keys in their insertion order, for eviction.
+    std::list<std::string> order ABSL_GUARDED_BY(mutex);
+  };
+  Shard* GetShard(absl::string_view key) const;
+  // Stores the session (taking ownership of the reference) under key.
+  void Insert(std::string key, SSL_SESSION* session);
+  // Returns a new reference to the session stored under key, or null.
+  SSL_SESSION* Lookup(absl::string_view key) const;
+  void Remove(absl::string_view key);
+
+  struct TicketKey {
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    absl::Time created;
+  };
+  // Generates a new current ticket key, if the current one is too old.
+  absl::Status MaybeRotateTicketKeys(absl::Time now)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(ticket_mutex_);
+  // Key for encrypting a new ticket.
+  absl::StatusOr<TicketKey> CurrentTicketKey();
+  // Key for decrypting a ticket, with the provided name. Sets is_current
+  // if this is the key used for encrypting new tickets.
+  bool FindTicketKey(const unsigned char* name, TicketKey* key,
+                     bool* is_current) const;
+
+  // OpenSSL callbacks.
+  static int NewSessionCallback(SSL* ssl, SSL_SESSION* session);
+  static SSL_SESSION* GetSessionCallback(SSL* ssl, const unsigned char* id,
+                                         int id_size, int* copy);
+  static void RemoveSessionCallback(SSL_CTX* ctx, SSL_SESSION* session);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  static int TicketKeyCallback(SSL* ssl, unsigned char* key_name,
+                               unsigned char* iv, EVP_CIPHER_CTX* cipher_ctx,
+                               EVP_MAC_CTX* mac_ctx, int encrypt);
+#endif
+  // Ex data indices, for us in SSL_CTX and for the peer in client SSL.
+  static int ContextIndex();
+  static int ClientPeerIndex();
+
+  const Params params_;
+  const size_t max_sessions_per_shard_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  mutable absl::Mutex ticket_mutex_;
+  // The current ticket key is the last one, the previous one (if any)
+  // is still accepted for decryption.
+  std::vector<TicketKey> ticket_keys_ ABSL_GUARDED_BY(ticket_mutex_);
+
+  Statistics stats_;
+};
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_SSL_SESSION_CACHE_H_
@@ -0,0 +1,196 @@
+#include "whisperlib/net/ssl_session_cache.h"
+
+#include <memory>
+#include <string>
+
+#include "absl/synchronization/notification.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "whisperlib/net/ssl_connection.h"
+#include "whisperlib/net/testing_util.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+// An echo server for the session cache tests.
+class SessionCacheServer {
+ public:
+  SessionCacheServer(SelectorThread* thread, SSL_CTX* context)
+      : thread_(thread) {
+    SslAcceptorParams params;
+    params.ssl_params.ssl_context = context;
+    acceptor_ = absl::make_unique<SslAcceptor>(thread->selector(), params);
+    acceptor_->set_accept_handler([this](std::unique_ptr<Connection> c) {
+      Connection* const connection = c.get();
+      connection->set_read_handler([connection]() {
+        connection->Write(std::move(*connection->inbuf()));
+        connection->inbuf()->Clear();
+        return absl::OkStatus();
+      });
+      connection->set_write_handler([]() { return absl::OkStatus(); });
+      connection->set_close_handler(
+          [connection](const absl::Status& status,
+                       Connection::CloseDirective directive) {
+            if (directive == Connection::CLOSE_READ) {
+              connection->FlushAndClose();
+            }
+          });
+      connections_.emplace_back(std::move(c));
+    });
+    RunAndWait(thread, [this]() {
+      EXPECT_OK(acceptor_->Listen(
+          HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+    });
+  }
+  ~SessionCacheServer() {
+    RunAndWait(thread_, [this]() {
+      for (auto& connection : connections_) {
+        connection->ForceClose();
+      }
+      connections_.clear();
+      acceptor_->Close();
+    });
+  }
+  uint16_t port() const { return acceptor_->local_address().port().value(); }
+
+ private:
+  SelectorThread* const thread_;
+  std::unique_ptr<SslAcceptor> acceptor_;
+  std::vector<std::unique_ptr<Connection>> connections_;
+};
+
+// Connects a client to the server, exchanges some data, and returns
+// if the client resumed a session.
+bool ConnectAndEcho(SelectorThread* thread, SSL_CTX* context, uint16_t port) {
+  SslConnectionParams params;
+  params.ssl_context = context;
+  SslConnection client(thread->selector(), params);
+  static constexpr absl::string_view kData = "Some session data.";
+  std::string received;
+  absl::Notification done;
+  absl::Notification closed;
+  client.set_connect_handler([&client]() { client.Write(kData); });
+  client.set_write_handler([]() { return absl::OkStatus(); });
+  client.set_close_handler(
+      [&closed](const absl::Status& status, Connection::CloseDirective d) {
+        if (d == Connection::CLOSE_READ_WRITE && !closed.HasBeenNotified()) {
+          closed.Notify();
+        }
+      });
+  client.set_read_handler([&]() {
+    received.append(std::string(*client.inbuf()));
+    client.inbuf()->Clear();
+    if (received.size() >= kData.size() && !done.HasBeenNotified()) {
+      done.Notify();
+    }
+    return absl::OkStatus();
+  });
+  RunAndWait(thread, [&]() {
+    EXPECT_OK(client.Connect(
+        HostPort(absl::nullopt, IpAddress::kIPv4Localhost, port)));
+  });
+  EXPECT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  EXPECT_EQ(received, kData);
+  bool reused = false;
+  // A session is resumable only after a proper SSL shutdown.
+  RunAndWait(thread, [&]() {
+    reused = client.session_reused();
+    client.FlushAndClose();
+  });
+  EXPECT_TRUE(closed.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  return reused;
+}
+}  // namespace
+
+TEST(SslSessionCache, Attach) {
+  ASSERT_OK_AND_ASSIGN(auto cache,
+                       SslSessionCache::Create(SslSessionCache::Params()));
+  ASSERT_OK_AND_ASSIGN(SSL_CTX * context, SslUtils::SslCreateContext());
+  EXPECT_EQ(SslSessionCache::FromContext(context), nullptr);
+  ASSERT_OK(cache->Attach(context));
+  EXPECT_EQ(SslSessionCache::FromContext(context), cache.get());
+  EXPECT_FALSE(cache->Attach(context).ok());
+  EXPECT_EQ(cache->size(), 0);
+  SslUtils::SslDeleteContext(context);
+  EXPECT_FALSE(
+      SslSessionCache::Create(SslSessionCache::Params().set_num_shards(0))
+          .ok());
+}
+
+// Parametrized on disabling the session tickets on the server.
+class SslSessionCacheResumeTest : public ::testing::TestWithParam<bool> {};
+
+TEST_P(SslSessionCacheResumeTest, Resume) {
+  const bool no_tickets = GetParam();
+  ASSERT_OK_AND_ASSIGN(auto server_cache,
+                       SslSessionCache::Create(SslSessionCache::Params()));
+  ASSERT_OK_AND_ASSIGN(auto client_cache,
+                       SslSessionCache::Create(SslSessionCache::Params()));
+  ASSERT_OK_AND_ASSIGN(SSL_CTX * server_context, SslUtils::SslCreateContext());
+  ASSERT_OK(SetSelfSignedCertificate(server_context));
+  if (no_tickets) {
+    SSL_CTX_set_options(server_context, SSL_OP_NO_TICKET);
+  }
+  ASSERT_OK(server_cache->Attach(server_context));
+  ASSERT_OK_AND_ASSIGN(SSL_CTX * client_context, SslUtils::SslCreateContext());
+  ASSERT_OK(client_cache->Attach(client_context));
+
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  {
+    SessionCacheServer server(thread.get(), server_context);
+    EXPECT_FALSE(ConnectAndEcho(thread.get(), client_context, server.port()));
+    EXPECT_EQ(client_cache->stats().client_misses.load(), 1);
+    EXPECT_GT(client_cache->size(), 0);
+    EXPECT_TRUE(ConnectAndEcho(thread.get(), client_context, server.port()));
+    EXPECT_EQ(client_cache->stats().client_hits.load(), 1);
+    EXPECT_TRUE(ConnectAndEcho(thread.get(), client_context, server.port()));
+    EXPECT_EQ(client_cache->stats().client_hits.load(), 2);
+  }
+  thread->Stop();
+  if (no_tickets) {
+    EXPECT_GE(server_cache->stats().hits.load(), 2);
+    EXPECT_GT(server_cache->size(), 0);
+  } else {
+    EXPECT_GE(server_cache->stats().ticket_hits.load(), 2);
+  }
+  SslUtils::SslDeleteContext(server_context);
+  SslUtils::SslDeleteContext(client_context);
+}
+
+INSTANTIATE_TEST_SUITE_P(NoTickets, SslSessionCacheResumeTest,
+                         ::testing::Bool());
+
+TEST(SslSessionCache, ExpiredTicketKey) {
+  ASSERT_OK_AND_ASSIGN(
+      auto server_cache,
+      SslSessionCache::Create(SslSessionCache::Params().set_ticket_key_rotation(
+          absl::Milliseconds(100))));
+  ASSERT_OK_AND_ASSIGN(auto client_cache,
+                       SslSessionCache::Create(SslSessionCache::Params()));
+  ASSERT_OK_AND_ASSIGN(SSL_CTX * server_context, SslUtils::SslCreateContext());
+  ASSERT_OK(SetSelfSignedCertificate(server_context));
+  ASSERT_OK(server_cache->Attach(server_context));
+  ASSERT_OK_AND_ASSIGN(SSL_CTX * client_context, SslUtils::SslCreateContext());
+  ASSERT_OK(client_cache->Attach(client_context));
+
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  {
+    SessionCacheServer server(thread.get(), server_context);
+    EXPECT_FALSE(ConnectAndEcho(thread.get(), client_context, server.port()));
+    // Past two rotation periods the ticket is not accepted anymore.
+    absl::SleepFor(absl::Milliseconds(250));
+    EXPECT_FALSE(ConnectAndEcho(thread.get(), client_context, server.port()));
+    EXPECT_GE(server_cache->stats().ticket_misses.load(), 1);
+    EXPECT_GE(server_cache->stats().ticket_key_rotations.load(), 1);
+  }
+  thread->Stop();
+  SslUtils::SslDeleteContext(server_context);
+  SslUtils::SslDeleteContext(client_context);
+}
+
+}  // namespace net
+}  // namespace whisper
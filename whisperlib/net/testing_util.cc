@@ -0,0 +1,109 @@
+#include "whisperlib/net/testing_util.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "absl/synchronization/notification.h"
+#include "openssl/evp.h"
+#include "openssl/x509.h"
+#include "whisperlib/base/call_on_return.h"
+#include "whisperlib/net/ssl_connection.h"
+#include "whisperlib/status/status.h"
+
+namespace whisper {
+namespace net {
+
+void RunAndWait(SelectorThread* thread, std::function<void()> f) {
+  absl::Notification done;
+  thread->selector()->RunInSelectLoop([&f, &done]() {
+    f();
+    done.Notify();
+  });
+  done.WaitForNotification();
+}
+
+bool IsLoopTypeUnavailable(const absl::Status& status) {
+  return absl::IsUnimplemented(status) || absl::IsPermissionDenied(status);
+}
+
+int ConnectToLocalPort(uint16_t port) {
+  const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return fd;
+  }
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+absl::Status SetSelfSignedCertificate(SSL_CTX* ctx) {
+  EVP_PKEY* key = EVP_EC_gen("prime256v1");
+  RET_CHECK(key != nullptr)
+      << "Generating the key: " << SslUtils::SslLastError();
+  base::CallOnReturn free_key([key]() { EVP_PKEY_free(key); });
+  X509* certificate = X509_new();
+  RET_CHECK(certificate != nullptr) << "Creating the certificate.";
+  base::CallOnReturn free_certificate(
+      [certificate]() { X509_free(certificate); });
+  ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+  X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+  X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+  X509_set_pubkey(certificate, key);
+  X509_NAME* name = X509_get_subject_name(certificate);
+  X509_NAME_add_entry_by_txt(
+      name, "CN", MBSTRING_ASC,
+      reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(certificate, name);
+  RET_CHECK(X509_sign(certificate, key, EVP_sha256()) > 0)
+      << "Signing the certificate: " << SslUtils::SslLastError();
+  RET_CHECK(SSL_CTX_use_certificate(ctx, certificate) == 1)
+      << "Setting the certificate: " << SslUtils::SslLastError();
+  RET_CHECK(SSL_CTX_use_PrivateKey(ctx, key) == 1)
+      << "Setting the key: " << SslUtils::SslLastError();
+  return absl::OkStatus();
+}
+
+bool KtlsAvailable() {
+  // The OpenSSL conditions are the ones of SslConnection.
+#if defined(__linux__) && defined(SSL_OP_ENABLE_KTLS) && \
+    !defined(OPENSSL_NO_KTLS) && OPENSSL_VERSION_MAJOR == 3 && \
+    OPENSSL_VERSION_MINOR <= 3
+  // The upper layer protocol can be set only on connected sockets.
+  const int listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    return false;
+  }
+  base::CallOnReturn close_listen([listen_fd]() { ::close(listen_fd); });
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), addr_len) < 0 ||
+      ::listen(listen_fd, 1) < 0 ||
+      ::getsockname(listen_fd, reinterpret_cast<sockaddr*>(&addr),
+                    &addr_len) < 0) {
+    return false;
+  }
+  const int fd = ConnectToLocalPort(ntohs(addr.sin_port));
+  if (fd < 0) {
+    return false;
+  }
+  const bool available =
+      ::setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+  ::close(fd);
+  return available;
+#else
+  return false;
+#endif
+}
+
+}  // namespace net
+}  // namespace whisper
@@ -0,0 +1,40 @@
+#ifndef WHISPERLIB_NET_TESTING_UTIL_H_
+#define WHISPERLIB_NET_TESTING_UTIL_H_
+
+// Helpers shared by the tests and the benchmarks of the net library.
+
+#include <cstdint>
+#include <functional>
+
+#include "absl/status/status.h"
+#include "openssl/ssl.h"
+#include "whisperlib/net/selector.h"
+
+namespace whisper {
+namespace net {
+
+// Runs the function in the select loop of the thread, and waits for it.
+void RunAndWait(SelectorThread* thread, std::function<void()> f);
+
+// If the error of creating a selector means that its loop type is not
+// available here: not built in, or not provided (ENOSYS) or not permitted
+// (EPERM) by the kernel - e.g. io_uring. Then its tests should be skipped.
+bool IsLoopTypeUnavailable(const absl::Status& status);
+
+// Opens a blocking TCP connection to the local (IPv4 loopback) port.
+// Returns the socket, or -1 on errors.
+int ConnectToLocalPort(uint16_t port);
+
+// Sets a freshly generated, self signed, certificate for "localhost", and
+// its key, to ctx.
+absl::Status SetSelfSignedCertificate(SSL_CTX* ctx);
+
+// If SslConnection-s can use kTLS: OpenSSL is built w/ it (and is a version
+// supported by SslConnection), and the kernel
+// provides the "tls" upper layer protocol for the TCP sockets.
+bool KtlsAvailable();
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_TESTING_UTIL_H_
@@ -7,7 +7,7 @@ namespace net {
 
 Timeouter::Timeouter(Selector* selector, TimeoutCallback callback)
     : selector_(ABSL_DIE_IF_NULL(selector)),
-      callback_(ABSL_DIE_IF_NULL(callback)) {}
+      callback_(ABSL_DIE_IF_NULL(std::move(callback))) {}
 
 Timeouter::~Timeouter() { ClearAllTimeouts(); }
 
@@ -31,6 +31,7 @@ bool Timeouter::ClearTimeout(TimeoutId timeout_id) {
     return false;
   }
   selector_->UnregisterAlarm(it->second);
+  timeouts_.erase(it);
   return true;
 }
 
@@ -2,12 +2,17 @@
 #define WHISPER_NET_TIMEOUTER_H_
 
 #include <cstdint>
+#include <functional>
+#include <utility>
 
 #include "absl/base/thread_annotations.h"
 #include "absl/container/flat_hash_map.h"
+#include "absl/hash/hash.h"
 #include "absl/synchronization/mutex.h"
 #include "absl/time/time.h"
+#include "whisperlib/base/inline_function.h"
 #include "whisperlib/net/selector.h"
+#include "whisperlib/net/selector_arena.h"
 
 namespace whisper {
 namespace net {
@@ -15,7 +20,7 @@ namespace net {
 class Timeouter {
  public:
   using TimeoutId = int64_t;
-  using TimeoutCallback = std::function<void(TimeoutId)>;
+  using TimeoutCallback = base::InlineFunction<void(TimeoutId)>;
 
   // Creates a timeout register with provided selector, which is
   // just a reference pointer. The provided callback will get called
@@ -40,8 +45,12 @@ class Timeouter {
 
   // Protects timeouts.
   absl::Mutex mutex_;
-  using TimeoutMap = absl::flat_hash_map<TimeoutId, Selector::AlarmId>;
-  // Maps from timeout Id to registered alarm ids.
+  using TimeoutMap = absl::flat_hash_map<
+      TimeoutId, Selector::AlarmId, absl::Hash<TimeoutId>,
+      std::equal_to<TimeoutId>,
+      SelectorArenaAllocator<std::pair<const TimeoutId, Selector::AlarmId>>>;
+  // Maps from timeout Id to registered alarm ids - allocated from the
+  // selector arena, when used in its select loop.
   TimeoutMap timeouts_ ABSL_GUARDED_BY(mutex_);
   ;
 };
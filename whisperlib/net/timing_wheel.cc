@@ -0,0 +1,215 @@
+#include "whisperlib/net/timing_wheel.h"
+
+#include <algorithm>
+
+#include "absl/log/check.h"
+
+namespace whisper {
+namespace net {
+
+constexpr int TimingWheel::kLevelBits;
+constexpr int TimingWheel::kNumSlots;
+constexpr int TimingWheel::kNumLevels;
+constexpr int64_t TimingWheel::kSlotMask;
+
+namespace {
+// Number of ticks covered by the entire wheel.
+constexpr int64_t kMaxTicks = int64_t(1)
+                              << (TimingWheel::kLevelBits *
+                                  TimingWheel::kNumLevels);
+}  // namespace
+
+TimingWheel::TimingWheel(absl::Duration resolution, absl::Time start)
+    : resolution_(std::max(resolution, absl::Microseconds(1))),
+      start_(start) {}
+
+TimingWheel::~TimingWheel() {}
+
+int64_t TimingWheel::FloorTick(absl::Time time) const {
+  if (time <= start_) {
+    return 0;
+  }
+  absl::Duration rem;
+  return absl::IDivDuration(time - start_, resolution_, &rem);
+}
+
+int64_t TimingWheel::CeilTick(absl::Time time) const {
+  if (time <= start_) {
+    return 0;
+  }
+  absl::Duration rem;
+  const int64_t tick = absl::IDivDuration(time - start_, resolution_, &rem);
+  return rem > absl::ZeroDuration() ? tick + 1 : tick;
+}
+
+absl::Time TimingWheel::TickToTime(int64_t tick) const {
+  return start_ + tick * resolution_;
+}
+
+bool TimingWheel::Add(Id id, absl::Time now, absl::Time deadline,
+                      Callback callback) {
+  auto result = nodes_.try_emplace(id);
+  if (!result.second) {
+    return false;
+  }
+  if (nodes_.size() == 1) {
+    // Nothing to process in between - we can skip directly to now.
+    current_tick_ = std::max(current_tick_, FloorTick(now));
+  }
+  Node* const node = &result.first->second;
+  node->id = id;
+  node->tick = CeilTick(deadline);
+  node->callback = std::move(callback);
+  Place(node);
+  return true;
+}
+
+bool TimingWheel::Remove(Id id) {
+  auto it = nodes_.find(id);
+  if (it == nodes_.end()) {
+    return false;
+  }
+  Unlink(&it->second);
+  nodes_.erase(it);
+  return true;
+}
+
+void TimingWheel::Place(Node* node) {
+  int64_t tick = std::max(node->tick, current_tick_);
+  const int64_t delta = tick - current_tick_;
+  int level = 0;
+  while (level < kNumLevels - 1 &&
+         delta >= (int64_t(1) << (kLevelBits * (level + 1)))) {
+    ++level;
+  }
+  if (delta >= kMaxTicks) {
+    // Too far in the future - we park it in the farthest slot, and it gets
+    // placed again (maybe in the same place) when cascaded.
+    tick = current_tick_ + kMaxTicks - 1;
+  }
+  const int slot = static_cast<int>((tick >> (kLevelBits * level)) & kSlotMask);
+  node->level = level;
+  node->slot = slot;
+  node->prev = nullptr;
+  node->next = slots_[level][slot];
+  if (node->next != nullptr) {
+    node->next->prev = node;
+  }
+  slots_[level][slot] = node;
+  occupied_[level][slot / 64] |= (uint64_t(1) << (slot % 64));
+}
+
+void TimingWheel::Unlink(Node* node) {
+  if (node->prev != nullptr) {
+    node->prev->next = node->next;
+  } else {
+    DCHECK_EQ(slots_[node->level][node->slot], node);
+    slots_[node->level][node->slot] = node->next;
+  }
+  if (node->next != nullptr) {
+    node->next->prev = node->prev;
+  }
+  if (slots_[node->level][node->slot] == nullptr) {
+    occupied_[node->level][node->slot / 64] &=
+        ~(uint64_t(1) << (node->slot % 64));
+  }
+  node->prev = node->next = nullptr;
+}
+
+void TimingWheel::Cascade() {
+  for (int level = 1; level < kNumLevels; ++level) {
+    const int slot = static_cast<int>(
+        (current_tick_ >> (kLevelBits * level)) & kSlotMask);
+    Node* node = slots_[level][slot];
+    slots_[level][slot] = nullptr;
+    occupied_[level][slot / 64] &= ~(uint64_t(1) << (slot % 64));
+    while (node != nullptr) {
+      Node* const next = node->next;
+      Place(node);
+      node = next;
+    }
+    if (slot != 0) {
+      break;
+    }
+  }
+}
+
+int TimingWheel::FindSlot(int level, int start) const {
+  for (int word = start / 64; word < kBitmapWords; ++word) {
+    uint64_t bits = occupied_[level][word];
+    if (word == start / 64) {
+      bits &= (~uint64_t(0)) << (start % 64);
+    }
+    if (bits != 0) {
+      return word * 64 + __builtin_ctzll(bits);
+    }
+  }
+  return -1;
+}
+
+bool TimingWheel::IsLevelEmpty(int level) const {
+  for (int word = 0; word < kBitmapWords; ++word) {
+    if (occupied_[level][word] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t TimingWheel::Advance(absl::Time now, std::vector<Callback>* expired) {
+  const int64_t now_tick = FloorTick(now);
+  size_t num_expired = 0;
+  while (current_tick_ <= now_tick) {
+    if (nodes_.empty()) {
+      current_tick_ = now_tick + 1;
+      break;
+    }
+    const int slot = static_cast<int>(current_tick_ & kSlotMask);
+    if (slot == 0) {
+      Cascade();
+    }
+    Node* node = slots_[0][slot];
+    slots_[0][slot] = nullptr;
+    occupied_[0][slot / 64] &= ~(uint64_t(1) << (slot % 64));
+    while (node != nullptr) {
+      Node* const next = node->next;
+      DCHECK_LE(node->tick, current_tick_);
+      expired->emplace_back(std::move(node->callback));
+      nodes_.erase(node->id);
+      ++num_expired;
+      node = next;
+    }
+    // Skip the empty slots up to the next used one or the end of rotation.
+    const int next_slot = slot + 1 < kNumSlots ? FindSlot(0, slot + 1) : -1;
+    const int64_t next_tick = next_slot >= 0
+                                  ? (current_tick_ & ~kSlotMask) + next_slot
+                                  : (current_tick_ | kSlotMask) + 1;
+    current_tick_ = std::min(next_tick, now_tick + 1);
+  }
+  return num_expired;
+}
+
+absl::Time TimingWheel::NextDeadline() const {
+  if (nodes_.empty()) {
+    return absl::InfiniteFuture();
+  }
+  for (int level = 0; level < kNumLevels; ++level) {
+    const int shift = kLevelBits * level;
+    const int64_t position = current_tick_ >> shift;
+    const int slot = static_cast<int>(position & kSlotMask);
+    // The current slot of upper levels was already cascaded.
+    const int start = level == 0 ? slot : slot + 1;
+    const int found = start < kNumSlots ? FindSlot(level, start) : -1;
+    if (found >= 0) {
+      return TickToTime(((position & ~kSlotMask) + found) << shift);
+    }
+    if (!IsLevelEmpty(level)) {
+      // Something in the next rotation of this level.
+      return TickToTime(((position & ~kSlotMask) + kNumSlots) << shift);
+    }
+  }
+  return absl::InfiniteFuture();
+}
+
+}  // namespace net
+}  // namespace whisper
@@ -0,0 +1,108 @@
+#ifndef WHISPERLIB_NET_TIMING_WHEEL_H_
+#define WHISPERLIB_NET_TIMING_WHEEL_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "absl/container/node_hash_map.h"
+#include "absl/time/time.h"
+#include "whisperlib/base/inline_function.h"
+
+namespace whisper {
+namespace net {
+
+// A hierarchical hashed timing wheel (Varghese & Lauck), used by the
+// Selector as an alternative to an alarm heap.
+// Time is split in ticks of `resolution` duration. We have kNumLevels wheels
+// of kNumSlots slots each: level 0 holds the alarms expiring in the next
+// kNumSlots ticks, one slot per tick, level 1 the ones expiring in the
+// next kNumSlots^2 ticks, kNumSlots ticks per slot, and so on. When level 0
+// completes a rotation, the next slot of level 1 is cascaded (redistributed)
+// down, and so on for the upper levels.
+//
+// Adding and removing alarms are O(1) operations, and removed alarms are
+// really gone (no tombstones). Alarms never expire earlier than their
+// deadline, but may expire up to one resolution later.
+//
+// NOTE: not thread safe - the Selector guards it with its alarm mutex.
+class TimingWheel {
+ public:
+  using Id = uint64_t;
+  using Callback = base::InlineFunction<void()>;
+
+  // Creates a wheel with the tick of provided resolution, starting
+  // to count the ticks from `start`.
+  TimingWheel(absl::Duration resolution, absl::Time start);
+  ~TimingWheel();
+
+  TimingWheel(const TimingWheel&) = delete;
+  TimingWheel& operator=(const TimingWheel&) = delete;
+
+  // Adds an alarm identified by `id` (which needs to be unique) that
+  // expires at `deadline`. `now` is the current time.
+  // Returns false if an alarm with the same id already exists.
+  bool Add(Id id, absl::Time now, absl::Time deadline, Callback callback);
+  // Removes the alarm with the provided id. Returns true if found.
+  bool Remove(Id id);
+  // Advances the wheel up to `now`, appending the callbacks of the
+  // expired alarms to `expired`. Returns the number of expired alarms.
+  size_t Advance(absl::Time now, std::vector<Callback>* expired);
+
+  // A lower bound of the time of the next alarm expiration, or cascade of
+  // an upper level slot. InfiniteFuture() if no alarms are registered.
+  absl::Time NextDeadline() const;
+
+  // Number of registered alarms.
+  size_t size() const { return nodes_.size(); }
+  bool empty() const { return nodes_.empty(); }
+  absl::Duration resolution() const { return resolution_; }
+
+  static constexpr int kLevelBits = 8;
+  static constexpr int kNumSlots = 1 << kLevelBits;
+  static constexpr int kNumLevels = 4;
+
+ private:
+  struct Node {
+    Id id = 0;
+    int64_t tick = 0;
+    Callback callback;
+    // Position in the wheel:
+    int level = 0;
+    int slot = 0;
+    Node* prev = nullptr;
+    Node* next = nullptr;
+  };
+  static constexpr int64_t kSlotMask = kNumSlots - 1;
+  static constexpr int kBitmapWords = kNumSlots / 64;
+
+  // Time to tick conversions.
+  int64_t FloorTick(absl::Time time) const;
+  int64_t CeilTick(absl::Time time) const;
+  absl::Time TickToTime(int64_t tick) const;
+
+  // Places the node in its level / slot relative to current_tick_.
+  void Place(Node* node);
+  // Removes the node from its current slot list.
+  void Unlink(Node* node);
+  // Redistributes down the upper level slots due at current_tick_.
+  void Cascade();
+  // Returns the first non empty slot >= start in level, or -1.
+  int FindSlot(int level, int start) const;
+  bool IsLevelEmpty(int level) const;
+
+  const absl::Duration resolution_;
+  const absl::Time start_;
+  // The next tick to be processed - all before it were expired.
+  int64_t current_tick_ = 0;
+  // Slot lists - heads of doubly linked lists of nodes.
+  Node* slots_[kNumLevels][kNumSlots] = {};
+  // Marks non empty slots, for quickly skipping over empty ones.
+  uint64_t occupied_[kNumLevels][kBitmapWords] = {};
+  // Owns the nodes - node_hash_map keeps pointers to them stable.
+  absl::node_hash_map<Id, Node> nodes_;
+};
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_TIMING_WHEEL_H_
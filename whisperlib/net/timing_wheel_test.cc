@@ -0,0 +1,125 @@
+#include "whisperlib/net/timing_wheel.h"
+
+#include <map>
+#include <random>
+
+#include "gtest/gtest.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+const absl::Time kStart = absl::FromUnixSeconds(1000000);
+
+size_t RunExpired(TimingWheel* wheel, absl::Time now) {
+  std::vector<TimingWheel::Callback> expired;
+  const size_t n = wheel->Advance(now, &expired);
+  for (auto& callback : expired) {
+    callback();
+  }
+  return n;
+}
+}  // namespace
+
+TEST(TimingWheel, Basic) {
+  TimingWheel wheel(absl::Milliseconds(1), kStart);
+  EXPECT_EQ(wheel.NextDeadline(), absl::InfiniteFuture());
+  std::vector<int> fired;
+  EXPECT_TRUE(wheel.Add(1, kStart, kStart + absl::Milliseconds(10),
+                        [&fired]() { fired.push_back(1); }));
+  EXPECT_TRUE(wheel.Add(2, kStart, kStart + absl::Milliseconds(5),
+                        [&fired]() { fired.push_back(2); }));
+  EXPECT_FALSE(wheel.Add(2, kStart, kStart, []() {}));
+  EXPECT_EQ(wheel.size(), 2);
+  EXPECT_EQ(wheel.NextDeadline(), kStart + absl::Milliseconds(5));
+
+  EXPECT_EQ(RunExpired(&wheel, kStart + absl::Milliseconds(4)), 0);
+  EXPECT_EQ(RunExpired(&wheel, kStart + absl::Milliseconds(5)), 1);
+  EXPECT_EQ(fired, std::vector<int>({2}));
+  EXPECT_EQ(wheel.NextDeadline(), kStart + absl::Milliseconds(10));
+  EXPECT_EQ(RunExpired(&wheel, kStart + absl::Milliseconds(20)), 1);
+  EXPECT_EQ(fired, std::vector<int>({2, 1}));
+  EXPECT_TRUE(wheel.empty());
+}
+
+TEST(TimingWheel, Remove) {
+  TimingWheel wheel(absl::Milliseconds(1), kStart);
+  bool fired = false;
+  EXPECT_TRUE(wheel.Add(1, kStart, kStart + absl::Milliseconds(3),
+                        [&fired]() { fired = true; }));
+  EXPECT_TRUE(wheel.Add(2, kStart, kStart + absl::Hours(3),
+                        [&fired]() { fired = true; }));
+  EXPECT_TRUE(wheel.Remove(1));
+  EXPECT_FALSE(wheel.Remove(1));
+  EXPECT_TRUE(wheel.Remove(2));
+  EXPECT_TRUE(wheel.empty());
+  EXPECT_EQ(wheel.NextDeadline(), absl::InfiniteFuture());
+  EXPECT_EQ(RunExpired(&wheel, kStart + absl::Hours(4)), 0);
+  EXPECT_FALSE(fired);
+}
+
+TEST(TimingWheel, PastDeadline) {
+  TimingWheel wheel(absl::Milliseconds(1), kStart);
+  const absl::Time now = kStart + absl::Seconds(10);
+  bool fired = false;
+  EXPECT_TRUE(wheel.Add(1, now, kStart, [&fired]() { fired = true; }));
+  EXPECT_LE(wheel.NextDeadline(), now);
+  EXPECT_EQ(RunExpired(&wheel, now), 1);
+  EXPECT_TRUE(fired);
+}
+
+TEST(TimingWheel, RandomAgainstReference) {
+  TimingWheel wheel(absl::Milliseconds(1), kStart);
+  std::mt19937 rng(17);
+  // Deadlines spread over all levels, and beyond the span of the wheel.
+  std::uniform_int_distribution<int> level_dist(0, 4);
+  std::uniform_int_distribution<int64_t> step_dist(1, 5000);
+  std::map<TimingWheel::Id, int64_t> expected;  // id -> deadline in ms
+  std::map<TimingWheel::Id, int64_t> fired;     // id -> firing time in ms
+  int64_t now_ms = 0;
+  TimingWheel::Id next_id = 0;
+  for (int round = 0; round < 2000; ++round) {
+    for (int i = 0; i < 5; ++i) {
+      const int level = level_dist(rng);
+      const int64_t span = int64_t(1) << std::min(8 * level + 4, 40);
+      const int64_t delta =
+          std::uniform_int_distribution<int64_t>(0, span)(rng);
+      const TimingWheel::Id id = next_id++;
+      expected[id] = now_ms + delta;
+      const absl::Time now = kStart + absl::Milliseconds(now_ms);
+      ASSERT_TRUE(wheel.Add(id, now, now + absl::Milliseconds(delta),
+                            [id, &fired, &now_ms]() { fired[id] = now_ms; }));
+    }
+    if (round % 3 == 0 && !expected.empty()) {
+      const TimingWheel::Id id = expected.begin()->first;
+      ASSERT_TRUE(wheel.Remove(id));
+      expected.erase(id);
+    }
+    const absl::Time next = wheel.NextDeadline();
+    ASSERT_GT(next,
+              kStart + absl::Milliseconds(now_ms) - absl::Milliseconds(1));
+    // Never jump over the next deadline lower bound, as the selector does.
+    int64_t step = step_dist(rng);
+    if (next != absl::InfiniteFuture()) {
+      step = std::min(step, std::max<int64_t>(
+                                1, absl::ToInt64Milliseconds(
+                                       next - kStart -
+                                       absl::Milliseconds(now_ms))));
+    }
+    now_ms += step;
+    RunExpired(&wheel, kStart + absl::Milliseconds(now_ms));
+    for (auto it = expected.begin(); it != expected.end();) {
+      if (it->second <= now_ms) {
+        ASSERT_TRUE(fired.count(it->first)) << "Id: " << it->first;
+        it = expected.erase(it);
+      } else {
+        ASSERT_FALSE(fired.count(it->first)) << "Id: " << it->first;
+        ++it;
+      }
+    }
+  }
+  EXPECT_EQ(wheel.size(), expected.size());
+}
+
+}  // namespace net
+}  // namespace whisper
@@ -0,0 +1,129 @@
+#include "whisperlib/net/token_bucket.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace whisper {
+namespace net {
+
+TokenBucket::Params& TokenBucket::Params::set_rate(double value) {
+  rate = value;
+  return *this;
+}
+TokenBucket::Params& TokenBucket::Params::set_burst(size_t value) {
+  burst = value;
+  return *this;
+}
+
+TokenBucket::TokenBucket(Params params)
+    : params_(std::move(params)), tokens_(params_.burst) {}
+
+double TokenBucket::TokensAt(absl::Time now) const {
+  const double burst = static_cast<double>(params_.burst);
+  if (now <= last_fill_ || tokens_ >= burst) {
+    // The buckets may be shared between selectors, w/ slightly different
+    // notions of now - we just do not fill for the earlier ones.
+    return std::min(tokens_, burst);
+  }
+  if (last_fill_ == absl::InfinitePast()) {
+    return burst;
+  }
+  return std::min(
+      burst, tokens_ + absl::ToDoubleSeconds(now - last_fill_) * params_.rate);
+}
+
+void TokenBucket::Fill(absl::Time now) {
+  tokens_ = TokensAt(now);
+  last_fill_ = std::max(last_fill_, now);
+}
+
+size_t TokenBucket::Take(size_t max_tokens, absl::Time now) {
+  absl::MutexLock l(&mutex_);
+  Fill(now);
+  const size_t taken =
+      std::min(max_tokens, static_cast<size_t>(std::floor(tokens_)));
+  tokens_ -= taken;
+  return taken;
+}
+
+void TokenBucket::Return(size_t num_tokens) {
+  absl::MutexLock l(&mutex_);
+  tokens_ = std::min(tokens_ + num_tokens, static_cast<double>(params_.burst));
+}
+
+absl::Duration TokenBucket::TimeUntilAvailable(size_t num_tokens,
+                                               absl::Time now) const {
+  absl::ReaderMutexLock l(&mutex_);
+  const double needed =
+      std::min(num_tokens, params_.burst) - std::floor(TokensAt(now));
+  if (needed <= 0) {
+    return absl::ZeroDuration();
+  }
+  if (params_.rate <= 0) {
+    return absl::InfiniteDuration();
+  }
+  return absl::Seconds(needed / params_.rate);
+}
+
+size_t TokenBucket::Available(absl::Time now) const {
+  absl::ReaderMutexLock l(&mutex_);
+  return static_cast<size_t>(std::floor(TokensAt(now)));
+}
+
+TokenBucket::Params TokenBucket::params() const {
+  absl::ReaderMutexLock l(&mutex_);
+  return params_;
+}
+
+void TokenBucket::set_params(Params params) {
+  absl::MutexLock l(&mutex_);
+  if (last_fill_ == absl::InfinitePast()) {
+    // Not used yet - starts full, w/ the new burst.
+    tokens_ = params.burst;
+  }
+  params_ = std::move(params);
+  tokens_ = std::min(tokens_, static_cast<double>(params_.burst));
+}
+
+void RateLimiter::AddBucket(std::shared_ptr<TokenBucket> bucket) {
+  if (bucket != nullptr) {
+    buckets_.emplace_back(std::move(bucket));
+  }
+}
+
+size_t RateLimiter::Acquire(size_t max_size, absl::Time now) {
+  size_t size = max_size;
+  for (size_t i = 0; i < buckets_.size() && size > 0; ++i) {
+    const size_t taken = buckets_[i]->Take(size, now);
+    if (taken < size) {
+      // Put back what the previous buckets gave over this one.
+      for (size_t j = 0; j < i; ++j) {
+        buckets_[j]->Return(size - taken);
+      }
+      size = taken;
+    }
+  }
+  return size;
+}
+
+void RateLimiter::Release(size_t size) {
+  if (size == 0) {
+    return;
+  }
+  for (const auto& bucket : buckets_) {
+    bucket->Return(size);
+  }
+}
+
+absl::Duration RateLimiter::TimeUntilAvailable(size_t size,
+                                               absl::Time now) const {
+  absl::Duration result = absl::ZeroDuration();
+  for (const auto& bucket : buckets_) {
+    result = std::max(result, bucket->TimeUntilAvailable(size, now));
+  }
+  return result;
+}
+
+}  // namespace net
+}  // namespace whisper
@@ -0,0 +1,91 @@
+#ifndef WHISPERLIB_NET_TOKEN_BUCKET_H_
+#define WHISPERLIB_NET_TOKEN_BUCKET_H_
+
+#include <memory>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace whisper {
+namespace net {
+
+// A token bucket, for limiting the rate of something (e.g. the bytes
+// transferred by a connection): it fills w/ tokens at a constant rate, up
+// to a maximum (the burst), and the consumers take tokens from it, as they
+// are available. Thread safe, so it can be shared between connections
+// running in different selectors.
+class TokenBucket {
+ public:
+  struct Params {
+    // Number of tokens added per second.
+    double rate = 0;
+    // Maximum number of tokens in the bucket - the largest burst.
+    size_t burst = 0;
+
+    Params& set_rate(double value);
+    Params& set_burst(size_t value);
+  };
+
+  // The bucket starts full.
+  explicit TokenBucket(Params params);
+
+  TokenBucket(const TokenBucket&) = delete;
+  TokenBucket& operator=(const TokenBucket&) = delete;
+
+  // Takes at most max_tokens from the tokens available at now.
+  // Returns the number of tokens taken - zero when empty.
+  size_t Take(size_t max_tokens, absl::Time now);
+  // Puts back tokens taken, but not used.
+  void Return(size_t num_tokens);
+  // How long until num_tokens (at most the burst) are available.
+  absl::Duration TimeUntilAvailable(size_t num_tokens, absl::Time now) const;
+  // Number of tokens available at now.
+  size_t Available(absl::Time now) const;
+
+  Params params() const;
+  // Changes the rate and burst - the available tokens are kept (up to
+  // the new burst).
+  void set_params(Params params);
+
+ private:
+  // The tokens in the bucket at now.
+  double TokensAt(absl::Time now) const ABSL_SHARED_LOCKS_REQUIRED(mutex_);
+  // Adds the tokens accumulated since last_fill_.
+  void Fill(absl::Time now) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  mutable absl::Mutex mutex_;
+  Params params_ ABSL_GUARDED_BY(mutex_);
+  double tokens_ ABSL_GUARDED_BY(mutex_);
+  absl::Time last_fill_ ABSL_GUARDED_BY(mutex_) = absl::InfinitePast();
+};
+
+// Limits a flow of data through several token buckets at once - e.g. its
+// own, and one shared w/ other flows: the data can go only as fast as
+// the slowest of them allows. Not thread safe (the buckets are).
+class RateLimiter {
+ public:
+  RateLimiter() = default;
+
+  // Adds a bucket to take the tokens from - null is ignored.
+  void AddBucket(std::shared_ptr<TokenBucket> bucket);
+  // If there are any buckets to limit the flow.
+  bool enabled() const { return !buckets_.empty(); }
+
+  // Takes at most max_size tokens from all the buckets. Returns the
+  // number of tokens taken, which is the same for all of them.
+  size_t Acquire(size_t max_size, absl::Time now);
+  // Puts back tokens acquired, but not used.
+  void Release(size_t size);
+  // How long until size tokens are available in all the buckets.
+  absl::Duration TimeUntilAvailable(size_t size, absl::Time now) const;
+
+ private:
+  std::vector<std::shared_ptr<TokenBucket>> buckets_;
+};
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_TOKEN_BUCKET_H_
@@ -0,0 +1,65 @@
+#include "whisperlib/net/token_bucket.h"
+
+#include <memory>
+
+#include "gtest/gtest.h"
+
+namespace whisper {
+namespace net {
+
+TEST(TokenBucket, TakeAndFill) {
+  const absl::Time start = absl::FromUnixSeconds(1000);
+  TokenBucket bucket(TokenBucket::Params().set_rate(1000).set_burst(500));
+  // Starts full.
+  EXPECT_EQ(bucket.Available(start), 500);
+  EXPECT_EQ(bucket.Take(200, start), 200);
+  EXPECT_EQ(bucket.Take(1000, start), 300);
+  EXPECT_EQ(bucket.Take(1000, start), 0);
+  EXPECT_EQ(bucket.TimeUntilAvailable(100, start), absl::Milliseconds(100));
+  // Fills at the rate.
+  EXPECT_EQ(bucket.Available(start + absl::Milliseconds(100)), 100);
+  EXPECT_EQ(bucket.Take(1000, start + absl::Milliseconds(100)), 100);
+  // Up to the burst.
+  EXPECT_EQ(bucket.Available(start + absl::Seconds(10)), 500);
+  EXPECT_EQ(bucket.TimeUntilAvailable(10000, start + absl::Milliseconds(100)),
+            absl::Milliseconds(500));
+  // Earlier times do not add tokens.
+  EXPECT_EQ(bucket.Take(1000, start), 0);
+  bucket.Return(50);
+  EXPECT_EQ(bucket.Take(1000, start + absl::Milliseconds(100)), 50);
+
+  // The tokens available are kept - none here.
+  bucket.set_params(TokenBucket::Params().set_rate(0).set_burst(10));
+  EXPECT_EQ(bucket.Take(1000, start + absl::Seconds(100)), 0);
+  EXPECT_EQ(bucket.TimeUntilAvailable(1, start + absl::Seconds(100)),
+            absl::InfiniteDuration());
+}
+
+TEST(RateLimiter, SharedBucket) {
+  const absl::Time now = absl::FromUnixSeconds(1000);
+  auto shared = std::make_shared<TokenBucket>(
+      TokenBucket::Params().set_rate(100).set_burst(150));
+  RateLimiter limiter1;
+  EXPECT_FALSE(limiter1.enabled());
+  limiter1.AddBucket(std::make_shared<TokenBucket>(
+      TokenBucket::Params().set_rate(100).set_burst(100)));
+  limiter1.AddBucket(shared);
+  limiter1.AddBucket(nullptr);
+  EXPECT_TRUE(limiter1.enabled());
+  RateLimiter limiter2;
+  limiter2.AddBucket(std::make_shared<TokenBucket>(
+      TokenBucket::Params().set_rate(100).set_burst(100)));
+  limiter2.AddBucket(shared);
+
+  // Limited by its own bucket.
+  EXPECT_EQ(limiter1.Acquire(1000, now), 100);
+  // Limited by the shared bucket - the tokens over it go back to its own.
+  EXPECT_EQ(limiter2.Acquire(1000, now), 50);
+  EXPECT_EQ(limiter2.Acquire(1000, now), 0);
+  EXPECT_EQ(limiter2.TimeUntilAvailable(10, now), absl::Milliseconds(100));
+  limiter1.Release(30);
+  EXPECT_EQ(limiter2.Acquire(1000, now), 30);
+}
+
+}  // namespace net
+}  // namespace whisper
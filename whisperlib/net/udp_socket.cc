@@ -0,0 +1,575 @@
+#include "whisperlib/net/udp_socket.h"
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "absl/log/check.h"
+#include "absl/log/log.h"
+#include "absl/memory/memory.h"
+#include "whisperlib/io/errno.h"
+#include "whisperlib/status/status.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+#ifndef __linux__
+// The batch system calls are Linux specific - elsewhere we send / receive
+// the messages one by one, with the same semantics.
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+#endif  // __linux__
+
+// Receives at most n messages - returns how many, or -1 if none (errno set).
+int ReceiveMessages(int fd, mmsghdr* msgs, size_t n) {
+#ifdef __linux__
+  return ::recvmmsg(fd, msgs, n, 0, nullptr);
+#else
+  for (size_t i = 0; i < n; ++i) {
+    const ssize_t cb = ::recvmsg(fd, &msgs[i].msg_hdr, 0);
+    if (cb < 0) {
+      return i > 0 ? static_cast<int>(i) : -1;
+    }
+    msgs[i].msg_len = cb;
+  }
+  return static_cast<int>(n);
+#endif  // __linux__
+}
+
+// Sends at most n messages - returns how many, or -1 if none (errno set).
+int SendMessages(int fd, mmsghdr* msgs, size_t n) {
+#ifdef __linux__
+  return ::sendmmsg(fd, msgs, n, 0);
+#else
+  for (size_t i = 0; i < n; ++i) {
+    const ssize_t cb = ::sendmsg(fd, &msgs[i].msg_hdr, 0);
+    if (cb < 0) {
+      return i > 0 ? static_cast<int>(i) : -1;
+    }
+    msgs[i].msg_len = cb;
+  }
+  return static_cast<int>(n);
+#endif  // __linux__
+}
+
+const sockaddr* AsSockAddr(const sockaddr_storage* addr) {
+  return reinterpret_cast<const sockaddr*>(addr);
+}
+sockaddr* AsSockAddr(sockaddr_storage* addr) {
+  return reinterpret_cast<sockaddr*>(addr);
+}
+socklen_t SockAddrLen(const sockaddr_storage& addr) {
+  return addr.ss_family == AF_INET ? sizeof(struct sockaddr_in)
+                                   : sizeof(struct sockaddr_in6);
+}
+
+// The address of the host port, in the socket family - i.e. IPv4
+// addresses in mapped form for IPv6 sockets. Accepts port 0 (any port).
+absl::Status ToSocketFamilyAddr(const HostPort& host_port, int family,
+                                sockaddr_storage* addr) {
+  if (!host_port.ip().has_value() || !host_port.port().has_value()) {
+    return status::InvalidArgumentErrorBuilder()
+           << "UDP address is not resolved: " << host_port.ToString();
+  }
+  memset(addr, 0, sizeof(*addr));
+  const IpAddress& ip = host_port.ip().value();
+  if (family == AF_INET6) {
+    // IPv4 addresses are in mapped form in IpAddress, as needed here.
+    auto saddr = reinterpret_cast<sockaddr_in6*>(addr);
+    saddr->sin6_family = AF_INET6;
+    saddr->sin6_port = htons(host_port.port().value());
+    memcpy(saddr->sin6_addr.s6_addr, ip.ipv6().data(), IpAddress::kIpV6Size);
+    if (host_port.scope_id().has_value()) {
+      saddr->sin6_scope_id = htonl(host_port.scope_id().value());
+    }
+    return absl::OkStatus();
+  }
+  if (ip.is_ipv6()) {
+    return status::InvalidArgumentErrorBuilder()
+           << "IPv6 address for an IPv4 UDP socket: " << host_port.ToString();
+  }
+  auto saddr = reinterpret_cast<sockaddr_in*>(addr);
+  saddr->sin_family = AF_INET;
+  saddr->sin_port = htons(host_port.port().value());
+  saddr->sin_addr.s_addr = htonl(ip.ipv4());
+  return absl::OkStatus();
+}
+
+// Control data space for the offload segment size, of a message.
+#if defined(UDP_SEGMENT) || defined(UDP_GRO)
+constexpr size_t kControlSize = CMSG_SPACE(sizeof(int));
+#else
+constexpr size_t kControlSize = 0;
+#endif  // UDP_SEGMENT || UDP_GRO
+// Kernel limits for the segmentation offload of a message.
+constexpr size_t kMaxGsoSegments = 64;
+constexpr size_t kMaxGsoSize = 65507;
+// Receive buffer size with the receive offload, for the largest aggregate.
+constexpr size_t kGroBufferSize = 1 << 16;
+}  // namespace
+
+UdpSocketParams& UdpSocketParams::set_batch_size(size_t value) {
+  batch_size = value;
+  return *this;
+}
+UdpSocketParams& UdpSocketParams::set_max_datagram_size(size_t value) {
+  max_datagram_size = value;
+  return *this;
+}
+UdpSocketParams& UdpSocketParams::set_max_receive_batches_per_event(
+    size_t value) {
+  max_receive_batches_per_event = value;
+  return *this;
+}
+UdpSocketParams& UdpSocketParams::set_max_pending_datagrams(size_t value) {
+  max_pending_datagrams = value;
+  return *this;
+}
+UdpSocketParams& UdpSocketParams::set_enable_gro(bool value) {
+  enable_gro = value;
+  return *this;
+}
+UdpSocketParams& UdpSocketParams::set_enable_gso(bool value) {
+  enable_gso = value;
+  return *this;
+}
+UdpSocketParams& UdpSocketParams::set_send_buffer_size(size_t value) {
+  send_buffer_size = value;
+  return *this;
+}
+UdpSocketParams& UdpSocketParams::set_recv_buffer_size(size_t value) {
+  recv_buffer_size = value;
+  return *this;
+}
+UdpSocketParams& UdpSocketParams::set_reuse_port(bool value) {
+  reuse_port = value;
+  return *this;
+}
+
+struct UdpSocket::Batch {
+  explicit Batch(size_t size)
+      : headers(size), addrs(size), control(size * kControlSize) {
+    iovecs.reserve(size);
+  }
+  std::vector<mmsghdr> headers;
+  std::vector<struct iovec> iovecs;
+  // For receiving: the peer addresses.
+  std::vector<sockaddr_storage> addrs;
+  std::vector<char> control;
+  // For sending, per message: the number of datagrams, of iovecs, and the
+  // offload segment size (0 for single datagrams).
+  std::vector<size_t> counts;
+  std::vector<size_t> num_iovecs;
+  std::vector<size_t> segment_sizes;
+};
+
+UdpSocket::UdpSocket(Selector* selector, UdpSocketParams params)
+    : Selectable(selector),
+      udp_selector_(selector),
+      params_(std::move(params)),
+      receive_buffer_size_(params_.enable_gro ? kGroBufferSize
+                                              : params_.max_datagram_size),
+      buffer_pool_(ReadBufferPool::Create(receive_buffer_size_,
+                                          2 * params_.batch_size)),
+      receive_buffers_(params_.batch_size, nullptr),
+      receive_batch_(absl::make_unique<Batch>(params_.batch_size)),
+      send_batch_(absl::make_unique<Batch>(params_.batch_size)) {
+  CHECK_GT(params_.batch_size, 0);
+}
+
+UdpSocket::~UdpSocket() { InternalClose(); }
+
+absl::Status UdpSocket::Bind(const HostPort& local_addr) {
+  RET_CHECK(fd_ == kInvalidFdValue) << "UDP socket already open.";
+  RET_CHECK(local_addr.ip().has_value())
+      << "UDP socket bind address with no IP: " << local_addr.ToString();
+  const int family = local_addr.ip()->is_ipv6() ? AF_INET6 : AF_INET;
+  sockaddr_storage addr;
+  RETURN_IF_ERROR(ToSocketFamilyAddr(local_addr, family, &addr));
+  const int fd = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::socket failed for the UDP socket.";
+  }
+  fd_ = fd;
+  family_ = family;
+  absl::Status status = SetSocketOptions(fd);
+  if (status.ok() && ::bind(fd, AsSockAddr(&addr), SockAddrLen(addr)) < 0) {
+    status = error::ErrnoToStatus(error::Errno())
+             << "::bind failed for the UDP socket, to: "
+             << local_addr.ToString();
+  }
+  if (status.ok()) {
+    sockaddr_storage bound_addr;
+    socklen_t len = sizeof(bound_addr);
+    if (::getsockname(fd, AsSockAddr(&bound_addr), &len) < 0) {
+      status = error::ErrnoToStatus(error::Errno())
+               << "::getsockname failed for the UDP socket.";
+    } else {
+      auto bound = HostPort::ParseFromSockAddr(AsSockAddr(&bound_addr), len);
+      status.Update(bound.status());
+      if (bound.ok()) {
+        local_address_ = std::move(bound).value();
+      }
+    }
+  }
+  if (status.ok()) {
+    status = udp_selector_->Register(this);
+  }
+  if (!status.ok()) {
+    InternalClose();
+  }
+  return status;
+}
+
+absl::Status UdpSocket::SetSocketOptions(int fd) {
+  const int true_flag = 1;
+#ifdef SO_REUSEPORT
+  if (params_.reuse_port &&
+      ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &true_flag,
+                   sizeof(true_flag)) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::setsockopt with SO_REUSEPORT failed for the UDP socket.";
+  }
+#endif  // SO_REUSEPORT
+  if (family_ == AF_INET6) {
+    // Dual stack, so we can talk to IPv4 peers too.
+    const int off = 0;
+    if (::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0) {
+      return error::ErrnoToStatus(error::Errno())
+             << "::setsockopt with IPV6_V6ONLY failed for the UDP socket.";
+    }
+  }
+  if (params_.send_buffer_size.has_value()) {
+    const int size = static_cast<int>(params_.send_buffer_size.value());
+    if (::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0) {
+      return error::ErrnoToStatus(error::Errno())
+             << "::setsockopt with SO_SNDBUF failed for the UDP socket.";
+    }
+  }
+  if (params_.recv_buffer_size.has_value()) {
+    const int size = static_cast<int>(params_.recv_buffer_size.value());
+    if (::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+      return error::ErrnoToStatus(error::Errno())
+             << "::setsockopt with SO_RCVBUF failed for the UDP socket.";
+    }
+  }
+  if (params_.enable_gro) {
+#ifdef UDP_GRO
+    LOG_IF(WARNING, ::setsockopt(fd, IPPROTO_UDP, UDP_GRO, &true_flag,
+                                 sizeof(true_flag)) < 0)
+        << "::setsockopt with UDP_GRO failed for the UDP socket: "
+        << error::ErrnoToString(error::Errno());
+#endif  // UDP_GRO
+  }
+#ifdef UDP_SEGMENT
+  gso_enabled_ = params_.enable_gso;
+#endif  // UDP_SEGMENT
+  return absl::OkStatus();
+}
+
+void UdpSocket::Close() { InternalClose(); }
+
+void UdpSocket::InternalClose() {
+  if (fd_ != kInvalidFdValue) {
+    if (selector() != nullptr) {
+      if (write_events_enabled_) {
+        LOG_IF_ERROR(WARNING, selector()->EnableWriteCallback(this, false))
+            << "Disabling the write events of the UDP socket.";
+      }
+      LOG_IF_ERROR(WARNING, selector()->Unregister(this))
+          << "Unregistering the UDP socket.";
+    }
+    if (::close(fd_) < 0) {
+      LOG(WARNING) << "::close failed for the UDP socket: "
+                   << error::ErrnoToString(error::Errno());
+    }
+    fd_ = kInvalidFdValue;
+  }
+  write_events_enabled_ = false;
+  pending_.clear();
+  for (char*& buffer : receive_buffers_) {
+    if (buffer != nullptr) {
+      buffer_pool_->Release(buffer);
+      buffer = nullptr;
+    }
+  }
+}
+
+UdpSocket& UdpSocket::set_receive_handler(ReceiveHandler handler) {
+  receive_handler_ = std::move(handler);
+  return *this;
+}
+
+bool UdpSocket::is_open() const { return fd_ != kInvalidFdValue; }
+HostPort UdpSocket::local_address() const { return local_address_; }
+size_t UdpSocket::num_pending_datagrams() const { return pending_.size(); }
+int UdpSocket::GetFd() const { return fd_; }
+
+absl::Status UdpSocket::Send(const HostPort& peer, absl::Cord data) {
+  if (fd_ == kInvalidFdValue) {
+    return status::FailedPreconditionErrorBuilder()
+           << "UDP socket is not open.";
+  }
+  if (pending_.size() >= params_.max_pending_datagrams) {
+    return status::ResourceExhaustedErrorBuilder()
+           << "Too many UDP datagrams pending to send: " << pending_.size();
+  }
+  PendingDatagram datagram;
+  RETURN_IF_ERROR(ToSocketFamilyAddr(peer, family_, &datagram.addr));
+  datagram.addr_len = SockAddrLen(datagram.addr);
+  datagram.data = std::move(data);
+  pending_.emplace_back(std::move(datagram));
+  if (pending_.size() >= params_.batch_size) {
+    return Flush();
+  }
+  return UpdateWriteEvents();
+}
+
+absl::Status UdpSocket::Flush() {
+  while (!pending_.empty() && fd_ != kInvalidFdValue) {
+    PrepareSendBatch();
+    const int sent = SendMessages(fd_, send_batch_->headers.data(),
+                                  send_batch_->counts.size());
+    if (sent >= 0) {
+      stats_.send_calls.fetch_add(1);
+      PopSent(sent);
+      continue;
+    }
+    const int err = error::Errno();
+    if (error::IsUnavailableAndShouldRetry(err)) {
+      break;  // continued on the write event
+    }
+    if (err == EINTR) {
+      continue;
+    }
+    if (send_batch_->counts.front() > 1 && (err == EIO || err == EINVAL)) {
+      // The device (or the kernel) does not support the segmentation.
+      LOG(WARNING) << "Disabling the UDP segmentation offload, after: "
+                   << error::ErrnoToString(err);
+      gso_enabled_ = false;
+      continue;
+    }
+    // The first message failed (e.g. too large) - we drop it, and go on.
+    LOG_EVERY_N(WARNING, 100) << "::sendmmsg failed for the UDP socket: "
+                              << error::ErrnoToString(err);
+    stats_.send_errors.fetch_add(send_batch_->counts.front());
+    PopSent(1);
+  }
+  return UpdateWriteEvents();
+}
+
+void UdpSocket::PrepareSendBatch() {
+  Batch* const batch = send_batch_.get();
+  batch->counts.clear();
+  batch->num_iovecs.clear();
+  batch->segment_sizes.clear();
+  batch->iovecs.clear();
+  size_t index = 0;
+  while (index < pending_.size() && batch->counts.size() < params_.batch_size) {
+    const PendingDatagram& first = pending_[index];
+    const size_t segment_size = first.data.size();
+    size_t count = 1;
+    if (gso_enabled_ && segment_size > 0) {
+      // Same peer, same size - except for the last one, that can be shorter.
+      size_t total_size = segment_size;
+      while (index + count < pending_.size() && count < kMaxGsoSegments) {
+        const PendingDatagram& next = pending_[index + count];
+        const size_t size = next.data.size();
+        if (size == 0 || size > segment_size ||
+            total_size + size > kMaxGsoSize ||
+            next.addr_len != first.addr_len ||
+            memcmp(&next.addr, &first.addr, first.addr_len) != 0) {
+          break;
+        }
+        total_size += size;
+        ++count;
+        if (size < segment_size) {
+          break;
+        }
+      }
+    }
+    const size_t iovecs_begin = batch->iovecs.size();
+    for (size_t i = index; i < index + count; ++i) {
+      for (absl::string_view chunk : pending_[i].data.Chunks()) {
+        batch->iovecs.push_back(
+            {const_cast<char*>(chunk.data()), chunk.size()});
+      }
+    }
+    batch->counts.push_back(count);
+    batch->num_iovecs.push_back(batch->iovecs.size() - iovecs_begin);
+    batch->segment_sizes.push_back(count > 1 ? segment_size : 0);
+    index += count;
+  }
+  // The iovecs are in place now, we can point to them.
+  size_t iovec_index = 0;
+  index = 0;
+  for (size_t i = 0; i < batch->counts.size(); ++i) {
+    PendingDatagram& first = pending_[index];
+    msghdr* const header = &batch->headers[i].msg_hdr;
+    memset(header, 0, sizeof(*header));
+    header->msg_name = &first.addr;
+    header->msg_namelen = first.addr_len;
+    header->msg_iov = batch->iovecs.data() + iovec_index;
+    header->msg_iovlen = batch->num_iovecs[i];
+#ifdef UDP_SEGMENT
+    if (batch->segment_sizes[i] > 0) {
+      header->msg_control = &batch->control[i * kControlSize];
+      header->msg_controllen = kControlSize;
+      cmsghdr* const cmsg = CMSG_FIRSTHDR(header);
+      cmsg->cmsg_level = IPPROTO_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      const uint16_t gso_size = static_cast<uint16_t>(batch->segment_sizes[i]);
+      memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    }
+#endif  // UDP_SEGMENT
+    iovec_index += batch->num_iovecs[i];
+    index += batch->counts[i];
+  }
+}
+
+void UdpSocket::PopSent(size_t num_messages) {
+  for (size_t i = 0; i < num_messages; ++i) {
+    for (size_t j = 0; j < send_batch_->counts[i]; ++j) {
+      stats_.datagrams_sent.fetch_add(1);
+      stats_.bytes_sent.fetch_add(pending_.front().data.size());
+      pending_.pop_front();
+    }
+  }
+}
+
+absl::Status UdpSocket::UpdateWriteEvents() {
+  const bool enable = !pending_.empty() && fd_ != kInvalidFdValue;
+  if (enable != write_events_enabled_) {
+    RETURN_IF_ERROR(udp_selector_->EnableWriteCallback(this, enable))
+        << "Updating the write events of the UDP socket.";
+    write_events_enabled_ = enable;
+  }
+  return absl::OkStatus();
+}
+
+bool UdpSocket::HandleReadEvent(SelectorEventData event) {
+  for (size_t i = 0; i < params_.max_receive_batches_per_event; ++i) {
+    if (fd_ == kInvalidFdValue || ReceiveBatch() < params_.batch_size) {
+      break;
+    }
+  }
+  return fd_ != kInvalidFdValue;
+}
+
+bool UdpSocket::HandleWriteEvent(SelectorEventData event) {
+  LOG_IF_ERROR(WARNING, Flush()) << "Flushing the UDP socket.";
+  return fd_ != kInvalidFdValue;
+}
+
+bool UdpSocket::HandleErrorEvent(SelectorEventData event) {
+  // E.g. ICMP errors for previous datagrams - nothing to do for these.
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (::getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err != 0) {
+    LOG_EVERY_N(WARNING, 100)
+        << "Error on the UDP socket: " << error::ErrnoToString(err);
+  }
+  return true;
+}
+
+size_t UdpSocket::ReceiveBatch() {
+  Batch* const batch = receive_batch_.get();
+  const size_t batch_size = params_.batch_size;
+  batch->iovecs.resize(batch_size);
+  for (size_t i = 0; i < batch_size; ++i) {
+    if (receive_buffers_[i] == nullptr) {
+      receive_buffers_[i] = buffer_pool_->Acquire();
+    }
+    batch->iovecs[i] = {receive_buffers_[i], receive_buffer_size_};
+    msghdr* const header = &batch->headers[i].msg_hdr;
+    memset(header, 0, sizeof(*header));
+    header->msg_name = &batch->addrs[i];
+    header->msg_namelen = sizeof(batch->addrs[i]);
+    header->msg_iov = &batch->iovecs[i];
+    header->msg_iovlen = 1;
+    if (params_.enable_gro && kControlSize > 0) {
+      header->msg_control = &batch->control[i * kControlSize];
+      header->msg_controllen = kControlSize;
+    }
+  }
+  const int received = ReceiveMessages(fd_, batch->headers.data(), batch_size);
+  if (received < 0) {
+    const int err = error::Errno();
+    if (!error::IsUnavailableAndShouldRetry(err) && err != EINTR) {
+      LOG_EVERY_N(WARNING, 100) << "::recvmmsg failed for the UDP socket: "
+                                << error::ErrnoToString(err);
+    }
+    return 0;
+  }
+  stats_.receive_calls.fetch_add(1);
+  for (int i = 0; i < received && fd_ != kInvalidFdValue; ++i) {
+    const msghdr& header = batch->headers[i].msg_hdr;
+    if (header.msg_flags & MSG_TRUNC) {
+      stats_.datagrams_truncated.fetch_add(1);
+    }
+    size_t gro_size = 0;
+#ifdef UDP_GRO
+    if (header.msg_controllen > 0) {
+      for (const cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr;
+           cmsg = CMSG_NXTHDR(const_cast<msghdr*>(&header),
+                              const_cast<cmsghdr*>(cmsg))) {
+        if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+          int size = 0;
+          memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+          gro_size = size;
+        }
+      }
+    }
+#endif  // UDP_GRO
+    char* const buffer = receive_buffers_[i];
+    receive_buffers_[i] = nullptr;
+    HandleReceived(buffer, batch->headers[i].msg_len, gro_size,
+                   batch->addrs[i], header.msg_namelen);
+  }
+  return received;
+}
+
+void UdpSocket::HandleReceived(char* buffer, size_t size, size_t gro_size,
+                               const sockaddr_storage& from,
+                               socklen_t from_len) {
+  stats_.bytes_received.fetch_add(size);
+  absl::Cord data;
+  buffer_pool_->AppendToCord(buffer, size, &data);
+  auto peer = HostPort::ParseFromSockAddr(AsSockAddr(&from), from_len);
+  if (!peer.ok()) {
+    LOG_EVERY_N(WARNING, 100) << "Invalid UDP datagram source: "
+                              << peer.status();
+    return;
+  }
+  if (gro_size == 0 || size <= gro_size) {
+    stats_.datagrams_received.fetch_add(1);
+    if (receive_handler_) {
+      receive_handler_(Datagram{std::move(peer).value(), std::move(data)});
+    }
+    return;
+  }
+  // A receive offload aggregate - all segments have gro_size, except for
+  // the last one, which can be shorter.
+  for (size_t offset = 0; offset < size && fd_ != kInvalidFdValue;
+       offset += gro_size) {
+    stats_.datagrams_received.fetch_add(1);
+    if (receive_handler_) {
+      receive_handler_(
+          Datagram{peer.value(),
+                   data.Subcord(offset, std::min(gro_size, size - offset))});
+    }
+  }
+}
+
+}  // namespace net
+}  // namespace whisper
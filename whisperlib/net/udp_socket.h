@@ -0,0 +1,188 @@
+#ifndef WHISPERLIB_NET_UDP_SOCKET_H_
+#define WHISPERLIB_NET_UDP_SOCKET_H_
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/cord.h"
+#include "absl/types/optional.h"
+#include "whisperlib/net/address.h"
+#include "whisperlib/net/read_buffer_pool.h"
+#include "whisperlib/net/selectable.h"
+#include "whisperlib/net/selector.h"
+
+namespace whisper {
+namespace net {
+
+struct UdpSocketParams {
+  // Maximum number of datagrams received / sent with one system call
+  // (::recvmmsg / ::sendmmsg on Linux).
+  size_t batch_size = 64;
+  // Maximum size of a received datagram - larger ones are truncated.
+  size_t max_datagram_size = 2048;
+  // Maximum number of receive batches in a row, on one read event, so we
+  // do not starve the other selectables.
+  size_t max_receive_batches_per_event = 16;
+  // Maximum number of datagrams waiting to be sent - Send() fails when
+  // reached.
+  size_t max_pending_datagrams = 4096;
+  // Enables UDP_GRO (Linux): the kernel coalesces consecutive datagrams from
+  // the same peer in one receive buffer (of 64KiB), which we split back
+  // into datagrams. Fewer, larger, receives under heavy traffic.
+  bool enable_gro = false;
+  // Enables UDP_SEGMENT (Linux): consecutive datagrams of the same size to
+  // the same peer are sent as one large buffer, segmented by the kernel
+  // (or the network card). Disabled by itself when the kernel refuses it.
+  bool enable_gso = false;
+  // Buffer size for send operation for the underlying socket.
+  absl::optional<size_t> send_buffer_size;
+  // Buffer size for receive operation for the underlying socket.
+  absl::optional<size_t> recv_buffer_size;
+  // Binds with SO_REUSEPORT, so several sockets (e.g. one per selector
+  // thread) share the port, and the kernel distributes the datagrams.
+  bool reuse_port = false;
+
+  UdpSocketParams& set_batch_size(size_t value);
+  UdpSocketParams& set_max_datagram_size(size_t value);
+  UdpSocketParams& set_max_receive_batches_per_event(size_t value);
+  UdpSocketParams& set_max_pending_datagrams(size_t value);
+  UdpSocketParams& set_enable_gro(bool value);
+  UdpSocketParams& set_enable_gso(bool value);
+  UdpSocketParams& set_send_buffer_size(size_t value);
+  UdpSocketParams& set_recv_buffer_size(size_t value);
+  UdpSocketParams& set_reuse_port(bool value);
+};
+
+// A UDP socket, running in a selector. The datagrams are received and
+// sent in batches, and the received ones are handed out in cords backed
+// by the buffers of a pool (small ones are copied, see ReadBufferPool).
+//
+// The datagrams to send are queued, and sent together when the socket is
+// writable (i.e. at the next loop step), when a full batch is queued, or
+// on Flush().
+//
+// All the methods should be called from the selector thread.
+//
+// Usage example:
+//   UdpSocket socket(selector, UdpSocketParams().set_enable_gro(true));
+//   socket.set_receive_handler([&socket](UdpSocket::Datagram datagram) {
+//     LOG_IF_ERROR(WARNING, socket.Send(datagram.peer, datagram.data));
+//   });
+//   RETURN_IF_ERROR(socket.Bind(HostPort(absl::nullopt, ip, 5353)));
+//
+class UdpSocket : private Selectable {
+ public:
+  explicit UdpSocket(Selector* selector,
+                     UdpSocketParams params = UdpSocketParams());
+  ~UdpSocket();
+
+  // Opens the socket, in the family of the local address, binds it to the
+  // local address (use port 0 for any port), and registers it with the
+  // selector.
+  absl::Status Bind(const HostPort& local_addr);
+  // Closes the socket, dropping the datagrams not yet sent.
+  void Close() override;
+
+  struct Datagram {
+    HostPort peer;
+    absl::Cord data;
+  };
+  // Called for each received datagram. The socket can be closed from here.
+  using ReceiveHandler = std::function<void(Datagram)>;
+  UdpSocket& set_receive_handler(ReceiveHandler handler);
+
+  // Queues a datagram to be sent to the peer (which needs to be resolved).
+  absl::Status Send(const HostPort& peer, absl::Cord data);
+  // Sends the queued datagrams right away, as many as the socket accepts.
+  absl::Status Flush();
+
+  // If the socket is open.
+  bool is_open() const;
+  // The address we are bound to.
+  HostPort local_address() const;
+  // Number of datagrams waiting to be sent.
+  size_t num_pending_datagrams() const;
+
+  struct Statistics {
+    // Datagrams received, and their bytes.
+    std::atomic_size_t datagrams_received = ATOMIC_VAR_INIT(0);
+    std::atomic_size_t bytes_received = ATOMIC_VAR_INIT(0);
+    // Datagrams longer than max_datagram_size, received truncated.
+    std::atomic_size_t datagrams_truncated = ATOMIC_VAR_INIT(0);
+    // System calls that received some datagrams.
+    std::atomic_size_t receive_calls = ATOMIC_VAR_INIT(0);
+    // Datagrams sent, and their bytes.
+    std::atomic_size_t datagrams_sent = ATOMIC_VAR_INIT(0);
+    std::atomic_size_t bytes_sent = ATOMIC_VAR_INIT(0);
+    // System calls that sent some datagrams.
+    std::atomic_size_t send_calls = ATOMIC_VAR_INIT(0);
+    // Datagrams dropped because of a send error (other than a full buffer).
+    std::atomic_size_t send_errors = ATOMIC_VAR_INIT(0);
+  };
+  const Statistics& stats() const { return stats_; }
+
+ private:
+  ////////// Selectable interface - called from the selector thread.
+  bool HandleReadEvent(SelectorEventData event) override;
+  bool HandleWriteEvent(SelectorEventData event) override;
+  bool HandleErrorEvent(SelectorEventData event) override;
+  int GetFd() const override;
+
+  // The system call headers and buffers, for a batch of datagrams.
+  struct Batch;
+
+  absl::Status SetSocketOptions(int fd);
+  void InternalClose();
+  // Receives one batch of datagrams, and calls the handler for them.
+  // Returns the number of datagrams received.
+  size_t ReceiveBatch();
+  // Calls the receive handler for the datagrams in a received buffer,
+  // splitting it in segments of gro_size, if set.
+  void HandleReceived(char* buffer, size_t size, size_t gro_size,
+                      const sockaddr_storage& from, socklen_t from_len);
+  // Prepares the messages for the next batch of queued datagrams, grouping
+  // them for segmentation offload when enabled.
+  void PrepareSendBatch();
+  // Drops the datagrams of the first n prepared messages from the queue.
+  void PopSent(size_t num_messages);
+  absl::Status UpdateWriteEvents();
+
+  // Unregistering resets the selector of the Selectable - this stays.
+  Selector* const udp_selector_;
+  const UdpSocketParams params_;
+  int fd_ = kInvalidFdValue;
+  int family_ = AF_UNSPEC;
+  HostPort local_address_;
+  ReceiveHandler receive_handler_ = nullptr;
+  bool write_events_enabled_ = false;
+  // Cleared if the kernel refuses the segmentation offload.
+  bool gso_enabled_ = false;
+
+  // The pool of our receive buffers, and the buffers acquired for the next
+  // receive batch - reset when handed to the received cords.
+  const size_t receive_buffer_size_;
+  std::shared_ptr<ReadBufferPool> buffer_pool_;
+  std::vector<char*> receive_buffers_;
+  std::unique_ptr<Batch> receive_batch_;
+
+  struct PendingDatagram {
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    absl::Cord data;
+  };
+  std::deque<PendingDatagram> pending_;
+  std::unique_ptr<Batch> send_batch_;
+
+  Statistics stats_;
+};
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_UDP_SOCKET_H_
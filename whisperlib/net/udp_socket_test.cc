@@ -0,0 +1,136 @@
+#include "whisperlib/net/udp_socket.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/notification.h"
+#include "gtest/gtest.h"
+#include "whisperlib/net/testing_util.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+// A datagram of size bytes, starting with its index.
+std::string MakeDatagram(size_t index, size_t size) {
+  std::string data = absl::StrCat(index, ":");
+  data.resize(std::max(size, data.size()), 'x');
+  return data;
+}
+
+// Parameterized by enable_gro and enable_gso.
+class UdpSocketTest : public ::testing::TestWithParam<std::tuple<bool, bool>> {
+};
+}  // namespace
+
+TEST_P(UdpSocketTest, Echo) {
+  const UdpSocketParams params =
+      UdpSocketParams()
+          .set_batch_size(16)
+          .set_max_datagram_size(1000)
+          .set_enable_gro(std::get<0>(GetParam()))
+          .set_enable_gso(std::get<1>(GetParam()));
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  Selector* const selector = thread->selector();
+  auto server = absl::make_unique<UdpSocket>(selector, params);
+  auto client = absl::make_unique<UdpSocket>(selector, params);
+  std::vector<std::string> received;  // accessed in the select loop
+  server->set_receive_handler([&server](UdpSocket::Datagram datagram) {
+    EXPECT_OK(server->Send(datagram.peer, std::move(datagram.data)));
+  });
+  client->set_receive_handler([&received](UdpSocket::Datagram datagram) {
+    received.emplace_back(std::string(datagram.data));
+  });
+  const HostPort localhost(absl::nullopt, IpAddress::kIPv4Localhost, 0);
+  RunAndWait(thread.get(), [&]() {
+    ASSERT_OK(server->Bind(localhost));
+    ASSERT_OK(client->Bind(localhost));
+  });
+  const HostPort server_address = server->local_address();
+  ASSERT_NE(server_address.port().value(), 0);
+
+  // Rounds of datagrams of the same size, w/ a shorter one at the end,
+  // as grouped for the segmentation offload.
+  constexpr size_t kNumRounds = 10;
+  constexpr size_t kRoundSize = 50;
+  std::vector<std::string> expected;
+  for (size_t round = 0; round < kNumRounds; ++round) {
+    std::vector<std::string> sent;
+    for (size_t i = 0; i < kRoundSize; ++i) {
+      const size_t index = round * kRoundSize + i;
+      sent.emplace_back(MakeDatagram(index, i + 1 < kRoundSize ? 500 : 100));
+    }
+    RunAndWait(thread.get(), [&]() {
+      for (const std::string& data : sent) {
+        ASSERT_OK(client->Send(server_address, absl::Cord(data)));
+      }
+    });
+    expected.insert(expected.end(), sent.begin(), sent.end());
+    size_t num_received = 0;
+    while (num_received < expected.size()) {
+      absl::SleepFor(absl::Milliseconds(1));
+      RunAndWait(thread.get(), [&]() { num_received = received.size(); });
+    }
+  }
+  RunAndWait(thread.get(), [&]() {
+    std::sort(received.begin(), received.end());
+    std::sort(expected.begin(), expected.end());
+    EXPECT_EQ(received, expected);
+    EXPECT_EQ(client->stats().datagrams_sent.load(), expected.size());
+    EXPECT_EQ(server->stats().datagrams_received.load(), expected.size());
+    EXPECT_EQ(server->stats().datagrams_sent.load(), expected.size());
+    EXPECT_EQ(client->stats().datagrams_received.load(), expected.size());
+    EXPECT_EQ(client->stats().send_errors.load(), 0);
+    // Sent in batches.
+    EXPECT_LT(client->stats().send_calls.load(), expected.size() / 4);
+    EXPECT_EQ(client->num_pending_datagrams(), 0);
+    server.reset();
+    client.reset();
+  });
+  thread->Stop();
+}
+
+INSTANTIATE_TEST_SUITE_P(Offload, UdpSocketTest,
+                         ::testing::Combine(::testing::Bool(),
+                                            ::testing::Bool()));
+
+TEST(UdpSocket, Errors) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  RunAndWait(thread.get(), [&thread]() {
+    UdpSocket socket(thread->selector(),
+                     UdpSocketParams().set_max_pending_datagrams(2));
+    const HostPort peer(absl::nullopt, IpAddress::kIPv4Localhost, 9);
+    EXPECT_RAISES(socket.Send(peer, absl::Cord("x")), FailedPrecondition);
+    ASSERT_OK(
+        socket.Bind(HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 0)));
+    EXPECT_TRUE(socket.is_open());
+    EXPECT_RAISES(socket.Bind(socket.local_address()), FailedPrecondition);
+    EXPECT_RAISES(socket.Send(HostPort("localhost", absl::nullopt, 9),
+                              absl::Cord("x")),
+                  InvalidArgument);
+    EXPECT_RAISES(
+        socket.Send(HostPort(absl::nullopt, IpAddress::kIPv6Localhost, 9),
+                    absl::Cord("x")),
+        InvalidArgument);
+    EXPECT_OK(socket.Send(peer, absl::Cord("x")));
+    EXPECT_OK(socket.Send(peer, absl::Cord("y")));
+    EXPECT_RAISES(socket.Send(peer, absl::Cord("z")), ResourceExhausted);
+    EXPECT_EQ(socket.num_pending_datagrams(), 2);
+    socket.Close();
+    EXPECT_FALSE(socket.is_open());
+    EXPECT_EQ(socket.num_pending_datagrams(), 0);
+  });
+  thread->Stop();
+}
+
+}  // namespace net
+}  // namespace whisper
@@ -0,0 +1,984 @@
+#include "whisperlib/net/unix_connection.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#include "absl/functional/bind_front.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "whisperlib/base/call_on_return.h"
+#include "whisperlib/io/cord_io.h"
+#include "whisperlib/io/errno.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+// Reads under this size are copied in the inbuf(), the larger ones hand
+// over their buffer.
+constexpr size_t kMaxCopiedReadSize = 4096;
+// Unused read buffers kept around by a connection.
+constexpr size_t kMaxFreeReadBuffers = 2;
+
+#ifdef MSG_NOSIGNAL
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0;
+#endif  // MSG_NOSIGNAL
+#ifdef MSG_CMSG_CLOEXEC
+constexpr int kReceiveFlags = MSG_CMSG_CLOEXEC;
+#else
+constexpr int kReceiveFlags = 0;
+#endif  // MSG_CMSG_CLOEXEC
+
+int SocketType(UnixConnectionParams::Type type) {
+  return type == UnixConnectionParams::Type::SEQPACKET ? SOCK_SEQPACKET
+                                                       : SOCK_STREAM;
+}
+sockaddr* AsUnixSockAddr(sockaddr_un* addr) {
+  return reinterpret_cast<sockaddr*>(addr);
+}
+void CloseFds(const std::vector<int>& fds) {
+  for (const int fd : fds) {
+    ::close(fd);
+  }
+}
+}  // namespace
+
+HostPort UnixSocketAddress(absl::string_view path) {
+  return HostPort(std::string(path), absl::nullopt, absl::nullopt);
+}
+
+absl::Status ToUnixSockAddr(const HostPort& address, sockaddr_un* addr,
+                            socklen_t* addr_len) {
+  if (!address.host().has_value() || address.host().value().empty() ||
+      address.ip().has_value() || address.port().has_value()) {
+    return status::InvalidArgumentErrorBuilder()
+           << "Expecting just a socket path for a Unix socket address: "
+           << address.ToString();
+  }
+  const std::string& path = address.host().value();
+  if (path.size() >= sizeof(addr->sun_path)) {
+    return status::InvalidArgumentErrorBuilder()
+           << "Unix socket path too long: " << path;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, path.data(), path.size());
+  if (path[0] != '@') {
+    *addr_len = offsetof(sockaddr_un, sun_path) + path.size() + 1;
+    return absl::OkStatus();
+  }
+#ifdef __linux__
+  // The abstract names start with a null, and are not null terminated.
+  addr->sun_path[0] = '\0';
+  *addr_len = offsetof(sockaddr_un, sun_path) + path.size();
+  return absl::OkStatus();
+#else
+  return status::UnimplementedErrorBuilder()
+         << "Abstract Unix socket addresses not available on this system: "
+         << path;
+#endif  // __linux__
+}
+
+HostPort ParseUnixSockAddr(const sockaddr_un& addr, socklen_t addr_len) {
+  const size_t path_offset = offsetof(sockaddr_un, sun_path);
+  if (addr_len <= path_offset || addr.sun_family != AF_UNIX) {
+    return UnixSocketAddress("");
+  }
+  const size_t size =
+      std::min<size_t>(addr_len - path_offset, sizeof(addr.sun_path));
+  if (addr.sun_path[0] == '\0') {
+    return UnixSocketAddress(
+        absl::StrCat("@", absl::string_view(addr.sun_path + 1, size - 1)));
+  }
+  return UnixSocketAddress(
+      absl::string_view(addr.sun_path, strnlen(addr.sun_path, size)));
+}
+
+UnixConnectionParams& UnixConnectionParams::set_type(Type value) {
+  type = value;
+  return *this;
+}
+UnixConnectionParams& UnixConnectionParams::set_block_size(size_t value) {
+  block_size = value;
+  return *this;
+}
+UnixConnectionParams& UnixConnectionParams::set_max_record_size(size_t value) {
+  max_record_size = value;
+  return *this;
+}
+UnixConnectionParams& UnixConnectionParams::set_max_fds_per_message(
+    size_t value) {
+  max_fds_per_message = value;
+  return *this;
+}
+UnixConnectionParams& UnixConnectionParams::set_max_records_per_event(
+    size_t value) {
+  max_records_per_event = value;
+  return *this;
+}
+UnixConnectionParams& UnixConnectionParams::set_shutdown_linger_timeout(
+    absl::Duration value) {
+  shutdown_linger_timeout = value;
+  return *this;
+}
+UnixConnectionParams& UnixConnectionParams::set_detail_log(bool value) {
+  detail_log = value;
+  return *this;
+}
+
+struct UnixConnection::OutputMark {
+  OutputMark(int64_t position, std::vector<int> fds)
+      : position(position), fds(std::move(fds)) {}
+  OutputMark(const OutputMark&) = delete;
+  OutputMark& operator=(const OutputMark&) = delete;
+  ~OutputMark() { CloseFds(fds); }
+
+  const int64_t position;
+  // Duplicates of the descriptors to send, owned by us.
+  const std::vector<int> fds;
+};
+
+UnixConnection::UnixConnection(Selector* selector, UnixConnectionParams params)
+    : Connection(ABSL_DIE_IF_NULL(selector)),
+      Selectable(ABSL_DIE_IF_NULL(selector)),
+      params_(std::move(params)),
+      timeouter_(selector,
+                 absl::bind_front(&UnixConnection::HandleTimeoutEvent, this)),
+      control_buffer_(
+          CMSG_SPACE(sizeof(int) * std::max<size_t>(
+                                       params_.max_fds_per_message, 1))),
+      read_buffer_pool_(ReadBufferPool::Create(
+          is_seqpacket() ? params_.max_record_size : params_.block_size,
+          kMaxFreeReadBuffers, kMaxCopiedReadSize)) {
+  detail_log_ = params_.detail_log;
+}
+
+UnixConnection::~UnixConnection() {
+  CHECK_EQ(state(), DISCONNECTED)
+      << "Can only delete disconnected connections.";
+  CHECK_EQ(fd_.load(), kInvalidFdValue);
+  stats_.fds_dropped.fetch_add(received_fds_.size());
+  CloseFds(received_fds_);
+}
+
+absl::Status UnixConnection::Wrap(int fd) {
+  CHECK(net_selector()->IsInSelectThread());
+  RET_CHECK(fd_.load() == kInvalidFdValue)
+      << "Should wrap only on unconnected connection.";
+  RET_CHECK(state() == DISCONNECTED) << "Illegal state: " << state_name();
+  fd_.store(fd);
+  base::CallOnReturn close_fd([this]() { fd_.store(kInvalidFdValue); });
+  RETURN_IF_ERROR(SetSocketOptions(fd));
+  RETURN_IF_ERROR(InitializeAddresses());
+  RETURN_IF_ERROR(net_selector()->Register(this));
+  RETURN_IF_ERROR(RequestReadEvents(true));
+  close_fd.reset();
+
+  read_closed_.store(false);
+  write_closed_.store(false);
+  set_state(CONNECTED);
+  return absl::OkStatus();
+}
+
+absl::Status UnixConnection::Connect(const HostPort& remote_addr) {
+  CHECK(net_selector()->IsInSelectThread());
+  RET_CHECK(state() == DISCONNECTED) << "Illegal state: " << state_name();
+  RET_CHECK(fd_.load() == kInvalidFdValue) << "Connection fd already created";
+  sockaddr_un addr;
+  socklen_t addr_len = 0;
+  RETURN_IF_ERROR(ToUnixSockAddr(remote_addr, &addr, &addr_len))
+      << "Setting the address for Unix connection.";
+
+  const int fd = ::socket(AF_UNIX, SocketType(params_.type), 0);
+  if (fd < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::socket failed for connecting to: " << remote_addr.ToString();
+  }
+  fd_.store(fd);
+  base::CallOnReturn close_fd([this]() {
+    if (::close(fd_.load())) {
+      LOG(WARNING) << ToString() << " - ::close failed for Connect error: "
+                   << error::ErrnoToString(error::Errno());
+    }
+    fd_.store(kInvalidFdValue);
+  });
+  RETURN_IF_ERROR(SetSocketOptions(fd));
+  RETURN_IF_ERROR(net_selector()->Register(this));
+  close_fd.reset();
+
+  {
+    absl::WriterMutexLock l(&mutex_);
+    remote_address_ = remote_addr;
+  }
+  set_state(CONNECTING);
+  read_closed_.store(false);
+  write_closed_.store(false);
+
+  // Connecting to a local socket completes (or fails) right away, except
+  // for a full backlog, which fails w/ EAGAIN on Linux.
+  if (::connect(fd, AsUnixSockAddr(&addr), addr_len) < 0 &&
+      error::Errno() != EINPROGRESS) {
+    const absl::Status status = error::ErrnoToStatus(error::Errno())
+                                << "::connect failed for: " << ToString();
+    InternalClose(status, false);
+    return status;
+  }
+  // We complete the connect on the first event, as the TcpConnection.
+  RETURN_IF_ERROR(RequestWriteEvents(true));
+  RETURN_IF_ERROR(RequestReadEvents(true));
+  LOG_IF(INFO, detail_log_) << ToString() << " - Connecting";
+  return absl::OkStatus();
+}
+
+void UnixConnection::FlushAndClose() {
+  if (!net_selector()->IsInSelectThread()) {
+    net_selector()->RunInSelectLoop(
+        absl::bind_front(&UnixConnection::FlushAndClose, this));
+  } else {
+    LOG_IF(INFO, detail_log_) << ToString() << " - Flush and close.";
+    CloseCommunication(CLOSE_WRITE);
+  }
+}
+void UnixConnection::ForceClose() {
+  if (state() == DISCONNECTED) {
+    return;
+  }
+  if (!net_selector()->IsInSelectThread()) {
+    net_selector()->RunInSelectLoop(
+        absl::bind_front(&UnixConnection::ForceClose, this));
+  } else {
+    LOG_IF(INFO, detail_log_) << ToString() << " - Force close.";
+    InternalClose(absl::OkStatus(), true);
+  }
+}
+absl::Status UnixConnection::SetSendBufferSize(int size) {
+  if (::setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size))) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::Setting send buffer size of: " << size
+           << " for: " << ToString();
+  }
+  return absl::OkStatus();
+}
+absl::Status UnixConnection::SetRecvBufferSize(int size) {
+  if (::setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size))) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::Setting recv buffer size of: " << size
+           << " for: " << ToString();
+  }
+  return absl::OkStatus();
+}
+absl::Status UnixConnection::RequestReadEvents(bool enable) {
+  return net_selector()->EnableReadCallback(this, enable);
+}
+absl::Status UnixConnection::RequestWriteEvents(bool enable) {
+  return net_selector()->EnableWriteCallback(this, enable);
+}
+HostPort UnixConnection::GetLocalAddress() const {
+  absl::ReaderMutexLock l(&mutex_);
+  return local_address_;
+}
+HostPort UnixConnection::GetRemoteAddress() const {
+  absl::ReaderMutexLock l(&mutex_);
+  return remote_address_;
+}
+std::string UnixConnection::ToString() const {
+  return absl::StrCat("UnixConnection [ ", GetLocalAddress().ToString(),
+                      " => ", GetRemoteAddress().ToString(),
+                      " (fd: ", fd_.load(), ", state: ", state_name(),
+                      is_seqpacket() ? ", seqpacket" : "", ") ]");
+}
+
+void UnixConnection::CloseCommunication(CloseDirective directive) {
+  if (fd_.load() == kInvalidFdValue) {
+    CHECK_EQ(state(), DISCONNECTED);
+    return;
+  }
+  if (!net_selector()->IsInSelectThread()) {
+    net_selector()->RunInSelectLoop(absl::bind_front(
+        &UnixConnection::CloseCommunication, this, directive));
+    return;
+  }
+  LOG_IF(INFO, detail_log_)
+      << ToString()
+      << " - Close communication: " << CloseDirectiveName(directive);
+  if ((directive == CLOSE_WRITE || directive == CLOSE_READ_WRITE) &&
+      !write_closed_.load() && state() == CONNECTED) {
+    set_state(FLUSHING);
+    LOG_IF_ERROR(WARNING, RequestWriteEvents(true));
+  }
+}
+
+absl::Status UnixConnection::WriteMessage(absl::Cord data,
+                                          absl::Span<const int> fds) {
+  RET_CHECK(!data.empty())
+      << "Cannot attach file descriptors to empty data for: " << ToString();
+  RET_CHECK(fds.size() <= params_.max_fds_per_message)
+      << "Too many file descriptors in a message: " << fds.size()
+      << " for: " << ToString();
+  RET_CHECK(!is_seqpacket() || data.size() <= params_.max_record_size)
+      << "Message of: " << data.size()
+      << " bytes over the max_record_size of: " << params_.max_record_size
+      << " for: " << ToString();
+  std::vector<int> fd_copies;
+  base::CallOnReturn close_copies([&fd_copies]() { CloseFds(fd_copies); });
+  for (const int fd : fds) {
+    const int fd_copy = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (fd_copy < 0) {
+      return error::ErrnoToStatus(error::Errno())
+             << "Duplicating file descriptor: " << fd
+             << " to send on: " << ToString();
+    }
+    fd_copies.push_back(fd_copy);
+  }
+  close_copies.reset();
+  const int64_t position = count_bytes_written() + PendingOutputSize();
+  if (!fd_copies.empty() || is_seqpacket()) {
+    out_marks_.emplace_back(
+        absl::make_unique<OutputMark>(position, std::move(fd_copies)));
+  }
+  if (is_seqpacket()) {
+    // The record ends here, whatever is written next.
+    out_marks_.emplace_back(absl::make_unique<OutputMark>(
+        position + data.size(), std::vector<int>()));
+  }
+  Write(std::move(data));
+  return absl::OkStatus();
+}
+
+std::vector<int> UnixConnection::TakeReceivedFds() {
+  std::vector<int> fds;
+  fds.swap(received_fds_);
+  return fds;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+int UnixConnection::GetFd() const { return fd_.load(); }
+
+bool UnixConnection::HandleReadEvent(SelectorEventData event) {
+  CHECK(net_selector()->IsInSelectThread());
+  CHECK(state() != DISCONNECTED) << "Invalid state: " << state_name();
+  if (state() == CONNECTING) {
+    return PerformConnectOnFirstOperation();
+  }
+  CHECK(state() == CONNECTED || state() == FLUSHING)
+      << "Illegal state during read: " << state_name();
+  // The records are read one by one, so the read handler can tell them
+  // apart.
+  const size_t max_reads =
+      is_seqpacket() ? std::max<size_t>(params_.max_records_per_event, 1) : 1;
+  for (size_t i = 0; i < max_reads; ++i) {
+    auto read_result = PerformRead();
+    if (!read_result.ok()) {
+      InternalClose(read_result.status(), true);
+      return false;
+    }
+    if (!read_result.value().has_value()) {
+      break;  // nothing more to read now
+    }
+    if (read_result.value().value() == 0) {
+      read_closed_.store(true);
+      break;
+    }
+    auto read_handler_status = CallReadHandler();
+    if (ABSL_PREDICT_FALSE(!read_handler_status.ok())) {
+      InternalClose(read_handler_status, true);
+      return false;
+    }
+    if (state() == DISCONNECTED) {
+      return false;  // closed by the read handler
+    }
+  }
+  if (read_closed_.load()) {
+    CallCloseHandler(absl::OkStatus(), CLOSE_READ);
+    if (fd_.load() != kInvalidFdValue) {
+      // we need this because (E)POLLIN continuously fires
+      auto read_enable_status = RequestReadEvents(false);
+      if (ABSL_PREDICT_FALSE(!read_enable_status.ok())) {
+        InternalClose(read_enable_status, true);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool UnixConnection::HandleWriteEvent(SelectorEventData event) {
+  CHECK(net_selector()->IsInSelectThread());
+  CHECK(state() != DISCONNECTED) << "Invalid state: " << state_name();
+  if (state() == CONNECTING) {
+    return PerformConnectOnFirstOperation();
+  }
+  CHECK(state() == CONNECTED || state() == FLUSHING)
+      << "Illegal state during write: " << state_name();
+  // Each send stops at a mark, so we continue until the socket is full.
+  while (has_pending_output()) {
+    auto write_result = WriteOutput();
+    if (!write_result.ok()) {
+      InternalClose(write_result.status(), true);
+      return false;
+    }
+    if (!write_result.value()) {
+      break;
+    }
+  }
+  CheckPendingOutput();
+  if (state() == DISCONNECTED) {
+    return false;  // Closed by the watermark handler.
+  }
+  if (state() != FLUSHING) {
+    auto write_handler_status = CallWriteHandler();
+    if (ABSL_PREDICT_FALSE(!write_handler_status.ok())) {
+      InternalClose(write_handler_status, true);
+      return false;
+    }
+    if (state() == DISCONNECTED) {
+      return false;
+    }
+  }
+  if (has_pending_output()) {
+    return true;  // Continue writing & the connection - we have more data.
+  }
+  auto write_request_status = RequestWriteEvents(false);
+  if (ABSL_PREDICT_FALSE(!write_request_status.ok())) {
+    InternalClose(write_request_status, true);
+    return false;
+  }
+  if (state() != FLUSHING) {
+    return true;
+  }
+  // We are in FLUSHING, and we finished sending all buffered data.
+  if (::shutdown(fd_, SHUT_WR) < 0) {
+    InternalClose(error::ErrnoToStatus(error::Errno())
+                      << " - ::shutdown after flush failed for: " << ToString(),
+                  true);
+    return false;
+  }
+  write_closed_.store(true);
+  // Wait for the peer to close too, up to the linger timeout.
+  timeouter_.SetTimeout(kShutdownTimeoutId, params_.shutdown_linger_timeout);
+  return true;
+}
+
+bool UnixConnection::HandleErrorEvent(SelectorEventData event) {
+  CHECK(net_selector()->IsInSelectThread());
+  CHECK_NE(state(), DISCONNECTED);
+  const int value = event.internal_event;
+  if (net_selector()->IsErrorEvent(value)) {
+    const int err = ExtractSocketErrno(fd_.load());
+    InternalClose(absl::Status(error::ErrnoToStatus(err)
+                               << " - error detected on connection socket"
+                               << " for: " << ToString()),
+                  true);
+    return false;
+  }
+  // See TcpConnection::HandleErrorEvent for the hang up sequence.
+  if (net_selector()->IsHangUpEvent(value)) {
+    write_closed_.store(true);
+    if (state() != CONNECTING && net_selector()->IsInputEvent(value)) {
+      return true;  // the next HandleReadEvent reads the pending data.
+    }
+    LOG_IF(INFO, detail_log_) << ToString() << " - HUP detected - stopping";
+    InternalClose(absl::OkStatus(), true);
+    return false;
+  }
+  if (net_selector()->IsRemoteHangUpEvent(value)) {
+    set_state(FLUSHING);
+    if (state() != CONNECTING && net_selector()->IsInputEvent(value)) {
+      return true;
+    }
+    LOG_IF(INFO, detail_log_)
+        << ToString() << " - Remote HUP detected - stopping";
+    InternalClose(absl::OkStatus(), true);
+    return false;
+  }
+  return true;
+}
+
+void UnixConnection::Close() {
+  // this call comes from Selectable interface
+  LOG_IF(INFO, detail_log_) << ToString() << " - External close requested.";
+  InternalClose(absl::OkStatus(), true);
+}
+
+absl::Status UnixConnection::SetSocketOptions(int fd) {
+  const int flags = ::fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::fcntl setting O_NONBLOCK failed for: " << ToString();
+  }
+  if (::fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::fcntl setting FD_CLOEXEC failed for: " << ToString();
+  }
+#ifdef SO_NOSIGPIPE
+  const int true_flag = 1;
+  if (::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &true_flag,
+                   sizeof(true_flag))) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::setsockopt with SO_NOSIGPIPE failed for: " << ToString();
+  }
+#endif  // SO_NOSIGPIPE
+  return absl::OkStatus();
+}
+
+absl::Status UnixConnection::InitializeAddresses() {
+  sockaddr_un local_addr;
+  socklen_t local_len = sizeof(local_addr);
+  if (::getsockname(fd_.load(), AsUnixSockAddr(&local_addr), &local_len) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::getsockname failed for: " << ToString();
+  }
+  sockaddr_un remote_addr;
+  socklen_t remote_len = sizeof(remote_addr);
+  if (::getpeername(fd_.load(), AsUnixSockAddr(&remote_addr), &remote_len) <
+      0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::getpeername failed for: " << ToString();
+  }
+  absl::WriterMutexLock l(&mutex_);
+  local_address_ = ParseUnixSockAddr(local_addr, local_len);
+  remote_address_ = ParseUnixSockAddr(remote_addr, remote_len);
+  return absl::OkStatus();
+}
+
+void UnixConnection::InternalClose(const absl::Status& status,
+                                   bool call_close_handler) {
+  if (state() == DISCONNECTED) {
+    CHECK_EQ(fd_.load(), kInvalidFdValue);
+    return;
+  }
+  CHECK(net_selector()->IsInSelectThread());
+  set_last_error(status);
+  if (fd_.load() != kInvalidFdValue) {
+    LOG_IF_ERROR(WARNING, net_selector()->Unregister(this))
+        << "Unregistering connection from selector: " << ToString();
+    if (::close(fd_) < 0) {
+      LOG(WARNING) << ToString() << " - ::close failed: "
+                   << error::ErrnoToString(error::Errno());
+    }
+    fd_.store(kInvalidFdValue);
+  }
+  set_state(DISCONNECTED);
+  read_closed_.store(true);
+  write_closed_.store(true);
+  timeouter_.ClearAllTimeouts();
+  LOG_IF(WARNING, ABSL_PREDICT_FALSE(has_pending_output()))
+      << "Connection: " << ToString()
+      << " is closed w/o all output written: " << PendingOutputSize();
+  inbuf()->Clear();
+  outbuf()->Clear();
+  out_files_.clear();
+  out_marks_.clear();
+  CheckPendingOutput();
+  if (call_close_handler) {
+    CallCloseHandler(status, CLOSE_READ_WRITE);
+  }
+}
+
+void UnixConnection::HandleTimeoutEvent(int64_t timeout_id) {
+  LOG_IF(WARNING, ABSL_PREDICT_FALSE(timeout_id != kShutdownTimeoutId))
+      << "Unknown timeout_id received by " << ToString() << ": " << timeout_id;
+  InternalClose(absl::OkStatus(), true);
+}
+
+bool UnixConnection::PerformConnectOnFirstOperation() {
+  const int err = ExtractSocketErrno(fd_.load());
+  if (err != 0) {
+    InternalClose(error::ErrnoToStatus(err)
+                      << "Connecting Unix socket for: " << ToString(),
+                  true);
+    return false;
+  }
+  set_state(CONNECTED);
+  LOG_IF_ERROR(WARNING, InitializeAddresses())
+      << "Initializing addresses while becoming connected.";
+  CallConnectHandler();
+  CHECK(state() == CONNECTED || state() == DISCONNECTED || state() == FLUSHING)
+      << "Application changed the status to an invalid state: " << state_name();
+  LOG_IF(INFO, detail_log_) << ToString() << " - Connected.";
+  return state() == CONNECTED;
+}
+
+absl::StatusOr<absl::optional<size_t>> UnixConnection::PerformRead() {
+  const size_t size = read_buffer_pool_->buffer_size();
+  char* buffer = read_buffer_pool_->Acquire();
+  base::CallOnReturn release_buffer(
+      [this, buffer]() { read_buffer_pool_->Release(buffer); });
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = size;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control_buffer_.data();
+  msg.msg_controllen = control_buffer_.size();
+  const ssize_t cb = ::recvmsg(fd_.load(), &msg, kReceiveFlags);
+  if (cb < 0) {
+    if (error::IsUnavailableAndShouldRetry(error::Errno())) {
+      return absl::nullopt;
+    }
+    return error::ErrnoToStatus(error::Errno())
+           << "::recvmsg failed for: " << ToString();
+  }
+  // Take the descriptors first, so none leak on errors.
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    const size_t num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const unsigned char* data = CMSG_DATA(cmsg);
+    for (size_t i = 0; i < num_fds; ++i) {
+      int fd;
+      memcpy(&fd, data + i * sizeof(int), sizeof(fd));
+      if (kReceiveFlags == 0) {
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+      received_fds_.push_back(fd);
+    }
+    stats_.fds_received.fetch_add(num_fds);
+  }
+  if (ABSL_PREDICT_FALSE(msg.msg_flags & MSG_CTRUNC)) {
+    stats_.truncated_controls.fetch_add(1);
+    LOG_EVERY_N(WARNING, 100)
+        << ToString() << " - File descriptors lost, as more than "
+        << params_.max_fds_per_message << " were received in a message.";
+  }
+  if (is_seqpacket() && ABSL_PREDICT_FALSE(msg.msg_flags & MSG_TRUNC)) {
+    return status::DataLossErrorBuilder()
+           << "Received record larger than: " << params_.max_record_size
+           << " for: " << ToString();
+  }
+  if (cb == 0) {
+    return 0;
+  }
+  release_buffer.reset();
+  read_buffer_pool_->AppendToCord(buffer, cb, inbuf());
+  if (is_seqpacket()) {
+    stats_.records_received.fetch_add(1);
+  }
+  inc_bytes_read(cb);
+  return cb;
+}
+
+absl::StatusOr<bool> UnixConnection::WriteOutput() {
+  const int64_t position = count_bytes_written();
+  // The marks left behind are record boundaries.
+  while (!out_marks_.empty() && out_marks_.front()->position <= position &&
+         (out_marks_.front()->position < position ||
+          out_marks_.front()->fds.empty())) {
+    CHECK(out_marks_.front()->fds.empty());
+    out_marks_.pop_front();
+  }
+  const OutputMark* const mark =
+      out_marks_.empty() || out_marks_.front()->position > position
+          ? nullptr
+          : out_marks_.front().get();
+  // Send up to the next mark.
+  size_t to_write = SIZE_MAX;
+  const size_t next_mark = mark == nullptr ? 0 : 1;
+  if (out_marks_.size() > next_mark) {
+    to_write = out_marks_[next_mark]->position - position;
+  }
+  if (outbuf()->empty()) {
+    // Files are read in our memory first.
+    RET_CHECK(!out_files_.empty());
+    ASSIGN_OR_RETURN(const size_t cb_read,
+                     ReadOutputFile(std::min(to_write, params_.block_size)));
+    to_write = std::min(to_write, cb_read);
+  }
+  to_write = std::min(to_write, outbuf()->size());
+  if (is_seqpacket()) {
+    to_write = std::min(to_write, params_.max_record_size);
+  }
+
+  io::CordIo::IovecBuilder builder(*outbuf(), to_write);
+  absl::Cord flat_record;
+  if (is_seqpacket() && builder.batch_size() < to_write) {
+    // Too many chunks for one ::sendmsg - the record needs to go in one.
+    flat_record = outbuf()->Subcord(0, to_write);
+    flat_record.Flatten();
+  }
+  io::CordIo::IovecBuilder flat_builder(flat_record, flat_record.size());
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  (flat_record.empty() ? builder : flat_builder).PrepareMsghdr(&msg);
+  std::vector<char> control;
+  if (mark != nullptr && !mark->fds.empty()) {
+    const size_t fds_size = sizeof(int) * mark->fds.size();
+    control.resize(CMSG_SPACE(fds_size));
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fds_size);
+    memcpy(CMSG_DATA(cmsg), mark->fds.data(), fds_size);
+  }
+  const ssize_t cb = ::sendmsg(fd_.load(), &msg, kSendFlags);
+  if (cb < 0) {
+    if (error::IsUnavailableAndShouldRetry(error::Errno())) {
+      return false;
+    }
+    return error::ErrnoToStatus(error::Errno())
+           << "::sendmsg failed for: " << ToString();
+  }
+  if (mark != nullptr && cb > 0) {
+    // The descriptors went with the first byte - we close our copies.
+    if (!mark->fds.empty()) {
+      stats_.fd_messages_sent.fetch_add(1);
+      stats_.fds_sent.fetch_add(mark->fds.size());
+    }
+    out_marks_.pop_front();
+  }
+  outbuf()->RemovePrefix(cb);
+  inc_bytes_written(cb);
+  return size_t(cb) == to_write;
+}
+
+void UnixConnection::CallCloseHandler(const absl::Status& status,
+                                      CloseDirective directive) {
+  CHECK(read_closed_.load() ||
+        (directive != CLOSE_READ && directive != CLOSE_READ_WRITE));
+  CHECK(write_closed_.load() ||
+        (directive != CLOSE_WRITE && directive != CLOSE_READ_WRITE));
+  Connection::CallCloseHandler(status, directive);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+UnixAcceptorParams& UnixAcceptorParams::set_acceptor_threads(
+    AcceptorThreads value) {
+  acceptor_threads = std::move(value);
+  return *this;
+}
+UnixAcceptorParams& UnixAcceptorParams::set_connection_params(
+    UnixConnectionParams value) {
+  connection_params = std::move(value);
+  return *this;
+}
+UnixAcceptorParams& UnixAcceptorParams::set_max_backlog(size_t value) {
+  max_backlog = value;
+  return *this;
+}
+UnixAcceptorParams& UnixAcceptorParams::set_max_accepts_per_event(
+    size_t value) {
+  max_accepts_per_event = value;
+  return *this;
+}
+UnixAcceptorParams& UnixAcceptorParams::set_unlink_existing(bool value) {
+  unlink_existing = value;
+  return *this;
+}
+UnixAcceptorParams& UnixAcceptorParams::set_detail_log(bool value) {
+  detail_log = value;
+  return *this;
+}
+
+UnixAcceptor::UnixAcceptor(Selector* selector, UnixAcceptorParams params)
+    : Acceptor(),
+      Selectable(ABSL_DIE_IF_NULL(selector)),
+      params_(std::move(params)) {
+  detail_log_ = params_.detail_log;
+}
+UnixAcceptor::~UnixAcceptor() {
+  CHECK_EQ(state(), DISCONNECTED) << "Can only delete disconnected acceptors.";
+  CHECK_EQ(fd_.load(), kInvalidFdValue);
+}
+
+absl::Status UnixAcceptor::Listen(const HostPort& local_addr) {
+  RET_CHECK(fd_ == kInvalidFdValue && state() == DISCONNECTED)
+      << "Attempting listening again, with valid socket: " << ToString();
+  sockaddr_un addr;
+  socklen_t addr_len = 0;
+  RETURN_IF_ERROR(ToUnixSockAddr(local_addr, &addr, &addr_len))
+      << "Setting listening address for Unix acceptor";
+  const std::string& path = local_addr.host().value();
+  const bool is_abstract = path[0] == '@';
+
+  const int fd =
+      ::socket(AF_UNIX, SocketType(params_.connection_params.type), 0);
+  if (fd < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::socket failed for: " << ToString();
+  }
+  fd_.store(fd);
+  base::CallOnReturn close_fd([this]() {
+    if (::close(fd_.load())) {
+      LOG(WARNING) << ToString() << " - ::close failed for Listen error: "
+                   << error::ErrnoToString(error::Errno());
+    }
+    fd_.store(kInvalidFdValue);
+    if (!socket_path_.empty()) {
+      ::unlink(socket_path_.c_str());
+      socket_path_.clear();
+    }
+  });
+  const int flags = ::fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+      ::fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::fcntl failed for: " << ToString();
+  }
+  if (!is_abstract && params_.unlink_existing && ::unlink(path.c_str()) < 0 &&
+      error::Errno() != ENOENT) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::unlink of existing socket: " << path << " failed for "
+           << ToString();
+  }
+  if (::bind(fd, AsUnixSockAddr(&addr), addr_len) < 0) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::bind on: " << path << " failed for: " << ToString();
+  }
+  if (!is_abstract) {
+    socket_path_ = path;
+  }
+  if (::listen(fd, params_.max_backlog)) {
+    return error::ErrnoToStatus(error::Errno())
+           << "::listen failed for: " << ToString();
+  }
+  RETURN_IF_ERROR(selector()->Register(this))
+      << "Registering acceptor with selector for: " << ToString();
+  set_local_address(UnixSocketAddress(path));
+  LOG_IF(INFO, detail_log_) << ToString() << " - Bound and listening.";
+  set_state(LISTENING);
+  close_fd.reset();
+  return absl::OkStatus();
+}
+
+void UnixAcceptor::Close() {
+  if (!selector()->IsInSelectThread()) {
+    selector()->RunInSelectLoop(absl::bind_front(&UnixAcceptor::Close, this));
+  } else {
+    LOG_IF(INFO, detail_log_) << ToString() << " - Closing acceptor.";
+    InternalClose(absl::OkStatus());
+  }
+}
+
+std::string UnixAcceptor::ToString() const {
+  return absl::StrCat("UnixAcceptor [ ", local_address().ToString(),
+                      " state: ", state_name(), " fd: ", fd_.load(), " ]");
+}
+
+int UnixAcceptor::GetFd() const { return fd_.load(); }
+
+bool UnixAcceptor::HandleReadEvent(SelectorEventData event) {
+  CHECK(selector()->IsInSelectThread());
+  const size_t max_accepts = std::max<size_t>(params_.max_accepts_per_event, 1);
+  for (size_t i = 0; i < max_accepts; ++i) {
+    sockaddr_un addr;
+    socklen_t addr_len = sizeof(addr);
+#ifdef __linux__
+    const int client_fd =
+        ::accept4(fd_.load(), AsUnixSockAddr(&addr), &addr_len, SOCK_CLOEXEC);
+#else
+    const int client_fd =
+        ::accept(fd_.load(), AsUnixSockAddr(&addr), &addr_len);
+#endif  // __linux__
+    if (client_fd < 0) {
+      const int err = error::Errno();
+      if (err == EAGAIN || err == EWOULDBLOCK) {
+        return true;
+      }
+      if (err == EINTR || err == ECONNABORTED) {
+        continue;
+      }
+      LOG(WARNING) << ToString()
+                   << " - ::accept failed: " << error::ErrnoToString(err);
+      return false;
+    }
+    const HostPort peer_address = ParseUnixSockAddr(addr, addr_len);
+    if (!CallFilterHandler(peer_address)) {
+      LOG_IF(INFO, detail_log_) << ToString() << " - Connection filtered out: "
+                                << peer_address.ToString();
+      ::close(client_fd);
+      continue;
+    }
+    Selector* const selector_to_use =
+        params_.acceptor_threads.GetNextSelector();
+    if (selector_to_use == nullptr) {
+      InitializeAcceptedConnection(selector(), client_fd);
+      continue;
+    }
+    selector_to_use->RunInSelectLoop([this, selector_to_use, client_fd]() {
+      InitializeAcceptedConnection(selector_to_use, client_fd);
+    });
+  }
+  return true;
+}
+
+bool UnixAcceptor::HandleWriteEvent(SelectorEventData event) {
+  CHECK(selector()->IsInSelectThread());
+  LOG(WARNING) << ToString() << " - HandleWriteEvent called on server socket";
+  return false;
+}
+
+bool UnixAcceptor::HandleErrorEvent(SelectorEventData event) {
+  CHECK(selector()->IsInSelectThread());
+  const int value = event.internal_event;
+  if (selector()->IsErrorEvent(value)) {
+    const int err = ExtractSocketErrno(fd_.load());
+    InternalClose(error::ErrnoToStatus(err)
+                  << " - error detected on accept socket for: " << ToString());
+    return false;
+  }
+  return true;
+}
+
+void UnixAcceptor::InitializeAcceptedConnection(Selector* net_selector,
+                                                int client_fd) {
+  CHECK(net_selector->IsInSelectThread());
+  auto client = absl::make_unique<UnixConnection>(net_selector,
+                                                  params_.connection_params);
+  const absl::Status wrap_status = client->Wrap(client_fd);
+  if (!wrap_status.ok()) {
+    LOG(WARNING) << "Failed to wrap incoming client fd: " << client_fd << " - "
+                 << wrap_status;
+    if (::close(client_fd) < 0) {
+      LOG(WARNING) << ToString() << " - ::close failed on unwrapped client fd: "
+                   << error::ErrnoToString(error::Errno());
+    }
+    return;
+  }
+  LOG_IF(INFO, detail_log_)
+      << ToString()
+      << " - Incoming connection accepted: " << client->ToString();
+  CallAcceptHandler(std::move(client));
+}
+
+void UnixAcceptor::InternalClose(const absl::Status& status) {
+  CHECK(selector()->IsInSelectThread());
+  const int fd = fd_.load();
+  set_last_error(status);
+  if (fd == kInvalidFdValue) {
+    CHECK_EQ(state(), DISCONNECTED);
+    return;
+  }
+  LOG_IF_ERROR(WARNING, selector()->Unregister(this))
+      << "Unregistering acceptor from selector: " << ToString();
+  fd_.store(kInvalidFdValue);
+  if (::close(fd) < 0) {
+    LOG(WARNING) << ToString() << " - ::close failed: "
+                 << error::ErrnoToString(error::Errno());
+  }
+  if (!socket_path_.empty() && ::unlink(socket_path_.c_str()) < 0) {
+    LOG(WARNING) << ToString() << " - ::unlink of: " << socket_path_
+                 << " failed: " << error::ErrnoToString(error::Errno());
+  }
+  socket_path_.clear();
+  set_state(DISCONNECTED);
+  CallCloseHandler(status);
+}
+
+}  // namespace net
+}  // namespace whisper
@@ -0,0 +1,254 @@
+#ifndef WHISPERLIB_NET_UNIX_CONNECTION_H_
+#define WHISPERLIB_NET_UNIX_CONNECTION_H_
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/cord.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "whisperlib/net/address.h"
+#include "whisperlib/net/connection.h"
+#include "whisperlib/net/read_buffer_pool.h"
+#include "whisperlib/net/selectable.h"
+#include "whisperlib/net/selector.h"
+#include "whisperlib/net/timeouter.h"
+
+namespace whisper {
+namespace net {
+
+// The Unix domain sockets are addressed by HostPort-s with the socket path
+// as host, and no ip or port. A path starting with '@' names a socket in
+// the abstract namespace (Linux), with no file on disk.
+HostPort UnixSocketAddress(absl::string_view path);
+// Fills in the socket address for a Unix socket HostPort, as built above.
+absl::Status ToUnixSockAddr(const HostPort& address, sockaddr_un* addr,
+                            socklen_t* addr_len);
+// Parses the Unix socket address, as returned by ::getsockname & co.
+// The unnamed sockets (e.g. the connecting ones) have an empty path.
+HostPort ParseUnixSockAddr(const sockaddr_un& addr, socklen_t addr_len);
+
+struct UnixConnectionParams {
+  enum class Type {
+    // Byte stream, as TCP.
+    STREAM,
+    // Records, with their boundaries preserved - each record is received
+    // in full, by one read.
+    SEQPACKET,
+  };
+  Type type = Type::STREAM;
+  // Size of the buffer for a stream read. The SEQPACKET connections read
+  // in buffers of max_record_size, and truncated records are errors.
+  size_t block_size = 16384UL;
+  size_t max_record_size = 65536UL;
+  // Maximum number of file descriptors received / sent with one message.
+  // The kernel limits this to 253 (SCM_MAX_FD) on Linux.
+  size_t max_fds_per_message = 16;
+  // Maximum number of records read on one read event (SEQPACKET).
+  size_t max_records_per_event = 16;
+  // During unconfirmed shutdown, linger this long before closing.
+  absl::Duration shutdown_linger_timeout = absl::Seconds(5);
+  // If detail description should be logged about this connection.
+  bool detail_log = false;
+
+  UnixConnectionParams& set_type(Type value);
+  UnixConnectionParams& set_block_size(size_t value);
+  UnixConnectionParams& set_max_record_size(size_t value);
+  UnixConnectionParams& set_max_fds_per_message(size_t value);
+  UnixConnectionParams& set_max_records_per_event(size_t value);
+  UnixConnectionParams& set_shutdown_linger_timeout(absl::Duration value);
+  UnixConnectionParams& set_detail_log(bool value);
+};
+
+// A connection over a Unix domain socket, that can also pass file
+// descriptors to the peer (as SCM_RIGHTS ancillary data) - e.g. for handing
+// accepted TCP sockets to another process, which adopts them with
+// TcpConnection::Wrap(), without any data copying.
+//
+// In SEQPACKET mode each WriteMessage() is sent as one record, and so is
+// the data gathered by Write() calls between two sends (i.e. in one select
+// loop step, or while corked), in records of at most max_record_size.
+// The read handler is called after each
+// received record - if it consumes all the inbuf(), it sees the records
+// one by one. Files queued with WriteFile() are read in block_size records.
+//
+// Should be used from the selector thread, as the TcpConnection.
+class UnixConnection : public Connection, private Selectable {
+ public:
+  UnixConnection(Selector* selector, UnixConnectionParams params);
+  ~UnixConnection() override;
+
+  ////////// Connection interface methods
+  absl::Status Connect(const HostPort& remote_addr) override;
+  void FlushAndClose() override;
+  void ForceClose() override;
+  absl::Status SetSendBufferSize(int size) override;
+  absl::Status SetRecvBufferSize(int size) override;
+  absl::Status RequestReadEvents(bool enable) override;
+  absl::Status RequestWriteEvents(bool enable) override;
+  HostPort GetLocalAddress() const override;
+  HostPort GetRemoteAddress() const override;
+  std::string ToString() const override;
+
+  // Starts the process of closing of the communication, and of the
+  // eventual closing of the connection, for a connected connection.
+  void CloseCommunication(CloseDirective directive);
+
+  // Not the Selectable ones.
+  using Connection::Write;
+  // Writes the data (which needs to be non empty), as Write() does, with the
+  // file descriptors attached to it. The descriptors are duplicated, so
+  // they can be closed right away. On a stream, the peer receives the
+  // descriptors with the read that returns the first byte of the data.
+  // In SEQPACKET mode the data should fit in a max_record_size record.
+  absl::Status WriteMessage(absl::Cord data, absl::Span<const int> fds);
+
+  // Returns the file descriptors received so far, in order, and passes their
+  // ownership to the caller. The ones not taken are closed with the
+  // connection. Should be called from the selector thread (e.g. from the
+  // read handler).
+  std::vector<int> TakeReceivedFds();
+  size_t num_received_fds() const { return received_fds_.size(); }
+
+  // Sets up the connection on an already connected Unix socket - e.g. one
+  // end of a ::socketpair(). Takes ownership of fd.
+  absl::Status Wrap(int fd);
+
+  struct Statistics {
+    // Messages sent with file descriptors, and the descriptors sent.
+    std::atomic_size_t fd_messages_sent = ATOMIC_VAR_INIT(0);
+    std::atomic_size_t fds_sent = ATOMIC_VAR_INIT(0);
+    // Descriptors received, and those closed because nobody took them.
+    std::atomic_size_t fds_received = ATOMIC_VAR_INIT(0);
+    std::atomic_size_t fds_dropped = ATOMIC_VAR_INIT(0);
+    // Reads with the ancillary data truncated (the descriptors past
+    // max_fds_per_message are lost).
+    std::atomic_size_t truncated_controls = ATOMIC_VAR_INIT(0);
+    // SEQPACKET records received.
+    std::atomic_size_t records_received = ATOMIC_VAR_INIT(0);
+  };
+  const Statistics& stats() const { return stats_; }
+
+ private:
+  ////////// Selectable interface methods
+  // - Should be called from the selector thread.
+  bool HandleReadEvent(SelectorEventData event) override;
+  bool HandleWriteEvent(SelectorEventData event) override;
+  bool HandleErrorEvent(SelectorEventData event) override;
+  int GetFd() const override;
+  void Close() override;
+
+  // A position in the output stream (in bytes written since the start)
+  // where a message begins, with the file descriptors to send along, or
+  // just ends (a record boundary, in SEQPACKET mode). The sends stop at
+  // these positions.
+  struct OutputMark;
+
+  bool is_seqpacket() const {
+    return params_.type == UnixConnectionParams::Type::SEQPACKET;
+  }
+  // Sets the socket non blocking & co.
+  absl::Status SetSocketOptions(int fd);
+  // Reads the local and the remote addresses from the socket.
+  absl::Status InitializeAddresses();
+  void InternalClose(const absl::Status& status, bool call_close_handler);
+  void HandleTimeoutEvent(int64_t timeout_id);
+  // A deferred connect completion, that is scheduled on the first i/o event.
+  bool PerformConnectOnFirstOperation();
+  // Receives one message / record, with its file descriptors.
+  // Returns the number of bytes read, 0 on end of stream, or nullopt if
+  // nothing is available now.
+  absl::StatusOr<absl::optional<size_t>> PerformRead();
+  // Sends the next part of the output, up to the next mark, w/ one
+  // ::sendmsg. Returns true if all attempted was sent (so we can continue
+  // sending).
+  absl::StatusOr<bool> WriteOutput();
+  // We need some extra checks for CallCloseHandler.
+  void CallCloseHandler(const absl::Status& status, CloseDirective directive);
+
+  static constexpr int64_t kShutdownTimeoutId = -100;
+
+  const UnixConnectionParams params_;
+  std::atomic_int fd_ = ATOMIC_VAR_INIT(kInvalidFdValue);
+  HostPort local_address_ ABSL_GUARDED_BY(mutex_);
+  HostPort remote_address_ ABSL_GUARDED_BY(mutex_);
+  std::atomic_bool write_closed_ = ATOMIC_VAR_INIT(false);
+  std::atomic_bool read_closed_ = ATOMIC_VAR_INIT(false);
+  Timeouter timeouter_;
+  // The marks in the output not yet sent, in order.
+  std::deque<std::unique_ptr<OutputMark>> out_marks_;
+  // Received descriptors, not yet taken.
+  std::vector<int> received_fds_;
+  // Buffer for the ancillary data of the reads.
+  std::vector<char> control_buffer_;
+  // The buffers for the data of the reads.
+  std::shared_ptr<ReadBufferPool> read_buffer_pool_;
+  Statistics stats_;
+};
+
+struct UnixAcceptorParams {
+  // Threads that run the accepted connections.
+  AcceptorThreads acceptor_threads;
+  // Parameters for the accepted connections - the acceptor listens for
+  // connections of their type.
+  UnixConnectionParams connection_params;
+  // Maximum number of connections to have in waiting, and not yet accepted.
+  size_t max_backlog = 100;
+  // Maximum number of connections accepted in a row, on one read event.
+  size_t max_accepts_per_event = 64;
+  // Removes an existing socket file at the listening path before binding
+  // (e.g. left behind by a crashed process). The file is removed on Close()
+  // in any case.
+  bool unlink_existing = true;
+  // If detail description should be logged about this acceptor.
+  bool detail_log = false;
+
+  UnixAcceptorParams& set_acceptor_threads(AcceptorThreads value);
+  UnixAcceptorParams& set_connection_params(UnixConnectionParams value);
+  UnixAcceptorParams& set_max_backlog(size_t value);
+  UnixAcceptorParams& set_max_accepts_per_event(size_t value);
+  UnixAcceptorParams& set_unlink_existing(bool value);
+  UnixAcceptorParams& set_detail_log(bool value);
+};
+
+// Accepts UnixConnection-s on a Unix socket path - see UnixSocketAddress().
+// The filter handler receives the (usually empty) address of the peer.
+class UnixAcceptor : public Acceptor, private Selectable {
+ public:
+  UnixAcceptor(Selector* selector, UnixAcceptorParams params);
+  ~UnixAcceptor() override;
+
+  ////////// Acceptor interface override:
+  absl::Status Listen(const HostPort& local_addr) override;
+  void Close() override;
+  std::string ToString() const override;
+
+ private:
+  ////////// Selectable interface override - private.
+  bool HandleReadEvent(SelectorEventData event) override;
+  bool HandleWriteEvent(SelectorEventData event) override;
+  bool HandleErrorEvent(SelectorEventData event) override;
+  int GetFd() const override;
+
+  // Initializes a new connection in the provided selector.
+  void InitializeAcceptedConnection(Selector* selector, int client_fd);
+  void InternalClose(const absl::Status& status);
+
+  UnixAcceptorParams params_;
+  std::atomic_int fd_ = ATOMIC_VAR_INIT(kInvalidFdValue);
+  // The socket file we created, removed on close.
+  std::string socket_path_;
+};
+
+}  // namespace net
+}  // namespace whisper
+
+#endif  // WHISPERLIB_NET_UNIX_CONNECTION_H_
@@ -0,0 +1,299 @@
+#include "whisperlib/net/unix_connection.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/synchronization/notification.h"
+#include "gtest/gtest.h"
+#include "whisperlib/net/testing_util.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace net {
+
+namespace {
+std::string SocketPath(absl::string_view name) {
+  return absl::StrCat(::testing::TempDir(), name, ".", ::getpid());
+}
+}  // namespace
+
+TEST(UnixConnection, Addresses) {
+  const HostPort address = UnixSocketAddress("/run/test.sock");
+  EXPECT_EQ(address.host().value(), "/run/test.sock");
+  sockaddr_un addr;
+  socklen_t addr_len = 0;
+  ASSERT_OK(ToUnixSockAddr(address, &addr, &addr_len));
+  EXPECT_EQ(ParseUnixSockAddr(addr, addr_len).host().value(),
+            "/run/test.sock");
+#ifdef __linux__
+  ASSERT_OK(ToUnixSockAddr(UnixSocketAddress("@test"), &addr, &addr_len));
+  EXPECT_EQ(addr.sun_path[0], '\0');
+  EXPECT_EQ(ParseUnixSockAddr(addr, addr_len).host().value(), "@test");
+#endif  // __linux__
+  EXPECT_RAISES(ToUnixSockAddr(UnixSocketAddress(""), &addr, &addr_len),
+                InvalidArgument);
+  EXPECT_RAISES(ToUnixSockAddr(UnixSocketAddress(std::string(200, 'x')),
+                               &addr, &addr_len),
+                InvalidArgument);
+  EXPECT_RAISES(
+      ToUnixSockAddr(HostPort(absl::nullopt, IpAddress::kIPv4Localhost, 80),
+                     &addr, &addr_len),
+      InvalidArgument);
+}
+
+// Parameterized by the connection type.
+class UnixConnectionTest
+    : public ::testing::TestWithParam<UnixConnectionParams::Type> {};
+
+TEST_P(UnixConnectionTest, Echo) {
+  const bool is_seqpacket =
+      GetParam() == UnixConnectionParams::Type::SEQPACKET;
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  const UnixConnectionParams params =
+      UnixConnectionParams().set_type(GetParam());
+  UnixAcceptor acceptor(thread->selector(),
+                        UnixAcceptorParams().set_connection_params(params));
+  std::unique_ptr<Connection> server;
+  acceptor.set_accept_handler([&server](std::unique_ptr<Connection> c) {
+    server = std::move(c);
+    auto* const connection = static_cast<UnixConnection*>(server.get());
+    connection->set_read_handler([connection]() -> absl::Status {
+      // Each record is echoed back as a record.
+      RETURN_IF_ERROR(connection->WriteMessage(*connection->inbuf(), {}));
+      connection->inbuf()->Clear();
+      return absl::OkStatus();
+    });
+    connection->set_write_handler([]() { return absl::OkStatus(); });
+  });
+  const std::string path = SocketPath("echo");
+  RunAndWait(thread.get(),
+             [&]() { ASSERT_OK(acceptor.Listen(UnixSocketAddress(path))); });
+  EXPECT_EQ(::access(path.c_str(), F_OK), 0);
+
+  UnixConnection client(thread->selector(), params);
+  constexpr size_t kNumMessages = 100;
+  std::vector<std::string> sent;
+  std::vector<std::string> received;
+  size_t received_size = 0;
+  size_t expected_size = 0;
+  absl::Notification done;
+  client.set_connect_handler([&]() {
+    for (size_t i = 0; i < kNumMessages; ++i) {
+      sent.emplace_back(absl::StrCat("message ", i, std::string(i * 100, '.')));
+      expected_size += sent.back().size();
+      ASSERT_OK(client.WriteMessage(absl::Cord(sent.back()), {}));
+    }
+  });
+  client.set_write_handler([]() { return absl::OkStatus(); });
+  client.set_read_handler([&]() {
+    received_size += client.inbuf()->size();
+    received.emplace_back(std::string(*client.inbuf()));
+    client.inbuf()->Clear();
+    if (received_size == expected_size) {
+      done.Notify();
+    }
+    return absl::OkStatus();
+  });
+  RunAndWait(thread.get(),
+             [&]() { ASSERT_OK(client.Connect(UnixSocketAddress(path))); });
+  ASSERT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  RunAndWait(thread.get(), [&]() {
+    if (is_seqpacket) {
+      // The records come back one by one.
+      EXPECT_EQ(received, sent);
+      EXPECT_EQ(client.stats().records_received.load(), kNumMessages);
+    } else {
+      EXPECT_EQ(absl::StrJoin(received, ""), absl::StrJoin(sent, ""));
+    }
+    EXPECT_EQ(client.GetRemoteAddress().host().value(), path);
+    EXPECT_EQ(server->GetLocalAddress().host().value(), path);
+    client.ForceClose();
+    server->ForceClose();
+    server.reset();
+    acceptor.Close();
+  });
+  // The socket file is removed with the acceptor.
+  EXPECT_NE(::access(path.c_str(), F_OK), 0);
+  thread->Stop();
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Type, UnixConnectionTest,
+    ::testing::Values(UnixConnectionParams::Type::STREAM,
+                      UnixConnectionParams::Type::SEQPACKET));
+
+TEST(UnixConnection, PassFds) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  int fds[2];
+  ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  UnixConnection sender(thread->selector(), UnixConnectionParams());
+  UnixConnection receiver(thread->selector(), UnixConnectionParams());
+  std::string received;
+  std::vector<int> received_fds;
+  absl::Notification done;
+  sender.set_write_handler([]() { return absl::OkStatus(); });
+  sender.set_read_handler([]() { return absl::OkStatus(); });
+  receiver.set_write_handler([]() { return absl::OkStatus(); });
+  receiver.set_read_handler([&]() {
+    received.append(std::string(*receiver.inbuf()));
+    receiver.inbuf()->Clear();
+    for (const int fd : receiver.TakeReceivedFds()) {
+      received_fds.push_back(fd);
+    }
+    if (received == "before:pipe:after" && !done.HasBeenNotified()) {
+      done.Notify();
+    }
+    return absl::OkStatus();
+  });
+  int pipe_fds[2];
+  ASSERT_EQ(::pipe(pipe_fds), 0);
+  RunAndWait(thread.get(), [&]() {
+    ASSERT_OK(sender.Wrap(fds[0]));
+    ASSERT_OK(receiver.Wrap(fds[1]));
+    sender.Write(absl::string_view("before:"));
+    ASSERT_OK(sender.WriteMessage(absl::Cord("pipe:"), {pipe_fds[0]}));
+    sender.Write(absl::string_view("after"));
+    EXPECT_RAISES(sender.WriteMessage(absl::Cord(), {pipe_fds[0]}),
+                  FailedPrecondition);
+  });
+  // Our copy can go, the peer got its own.
+  ::close(pipe_fds[0]);
+  ASSERT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  ASSERT_EQ(received_fds.size(), 1);
+  ASSERT_EQ(::write(pipe_fds[1], "through", 7), 7);
+  char buffer[16];
+  ASSERT_EQ(::read(received_fds[0], buffer, sizeof(buffer)), 7);
+  EXPECT_EQ(std::string(buffer, 7), "through");
+  ::close(pipe_fds[1]);
+  ::close(received_fds[0]);
+  RunAndWait(thread.get(), [&]() {
+    EXPECT_EQ(sender.stats().fds_sent.load(), 1);
+    EXPECT_EQ(receiver.stats().fds_received.load(), 1);
+    sender.ForceClose();
+    receiver.ForceClose();
+  });
+  thread->Stop();
+}
+
+TEST(UnixConnection, HandOffTcpSocket) {
+  // A TCP connection accepted on one side, and served by a TcpConnection
+  // on the other side of a Unix socket.
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  const int listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_GE(listen_fd, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr),
+                   sizeof(addr)),
+            0);
+  ASSERT_EQ(::listen(listen_fd, 1), 0);
+  socklen_t addr_len = sizeof(addr);
+  ASSERT_EQ(::getsockname(listen_fd, reinterpret_cast<sockaddr*>(&addr),
+                          &addr_len),
+            0);
+  const int client_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_EQ(::connect(client_fd, reinterpret_cast<sockaddr*>(&addr),
+                      sizeof(addr)),
+            0);
+  const int accepted_fd = ::accept(listen_fd, nullptr, nullptr);
+  ASSERT_GE(accepted_fd, 0);
+  ::close(listen_fd);
+
+  int fds[2];
+  ASSERT_EQ(::socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds), 0);
+  const UnixConnectionParams params =
+      UnixConnectionParams().set_type(UnixConnectionParams::Type::SEQPACKET);
+  UnixConnection sender(thread->selector(), params);
+  UnixConnection receiver(thread->selector(), params);
+  std::unique_ptr<TcpConnection> tcp_server;
+  sender.set_write_handler([]() { return absl::OkStatus(); });
+  sender.set_read_handler([]() { return absl::OkStatus(); });
+  receiver.set_write_handler([]() { return absl::OkStatus(); });
+  receiver.set_read_handler([&]() -> absl::Status {
+    receiver.inbuf()->Clear();
+    for (const int fd : receiver.TakeReceivedFds()) {
+      tcp_server =
+          absl::make_unique<TcpConnection>(receiver.net_selector(),
+                                           TcpConnectionParams());
+      RETURN_IF_ERROR(tcp_server->Wrap(fd, false));
+      Connection* const server = tcp_server.get();
+      server->set_write_handler([]() { return absl::OkStatus(); });
+      server->set_read_handler([server]() {
+        server->Write(std::move(*server->inbuf()));
+        server->inbuf()->Clear();
+        return absl::OkStatus();
+      });
+    }
+    return absl::OkStatus();
+  });
+  RunAndWait(thread.get(), [&]() {
+    ASSERT_OK(sender.Wrap(fds[0]));
+    ASSERT_OK(receiver.Wrap(fds[1]));
+    ASSERT_OK(sender.WriteMessage(absl::Cord("take it"), {accepted_fd}));
+  });
+  ::close(accepted_fd);
+
+  ASSERT_EQ(::write(client_fd, "hello", 5), 5);
+  char buffer[16];
+  ASSERT_EQ(::read(client_fd, buffer, sizeof(buffer)), 5);
+  EXPECT_EQ(std::string(buffer, 5), "hello");
+  ::close(client_fd);
+  RunAndWait(thread.get(), [&]() {
+    ASSERT_NE(tcp_server, nullptr);
+    EXPECT_EQ(tcp_server->GetRemoteAddress().ip().value(),
+              IpAddress::kIPv4Localhost);
+    tcp_server->ForceClose();
+    tcp_server.reset();
+    sender.ForceClose();
+    receiver.ForceClose();
+  });
+  thread->Stop();
+}
+
+TEST(UnixConnection, Errors) {
+  ASSERT_OK_AND_ASSIGN(auto thread, SelectorThread::Create());
+  thread->Start();
+  RunAndWait(thread.get(), [&thread]() {
+    UnixConnection connection(thread->selector(), UnixConnectionParams());
+    EXPECT_RAISES(connection.Connect(UnixSocketAddress(SocketPath("none"))),
+                  NotFound);
+    EXPECT_EQ(connection.state(), Connection::DISCONNECTED);
+    EXPECT_RAISES(connection.Connect(HostPort(
+                      absl::nullopt, IpAddress::kIPv4Localhost, 80)),
+                  InvalidArgument);
+    UnixAcceptor acceptor(thread->selector(), UnixAcceptorParams());
+    const std::string path = SocketPath("errors");
+    ASSERT_OK(acceptor.Listen(UnixSocketAddress(path)));
+    UnixAcceptor other(thread->selector(),
+                       UnixAcceptorParams().set_unlink_existing(false));
+    EXPECT_RAISES(other.Listen(UnixSocketAddress(path)), AlreadyExists);
+    acceptor.Close();
+    // A message needs to fit in one record.
+    UnixConnection seqpacket(
+        thread->selector(),
+        UnixConnectionParams()
+            .set_type(UnixConnectionParams::Type::SEQPACKET)
+            .set_max_record_size(16));
+    EXPECT_RAISES(seqpacket.WriteMessage(absl::Cord(std::string(17, 'x')), {}),
+                  FailedPrecondition);
+    EXPECT_FALSE(seqpacket.has_pending_output());
+  });
+  thread->Stop();
+}
+
+}  // namespace net
+}  // namespace whisper
@@ -4,15 +4,13 @@ namespace whisper {
 namespace status {
 
 absl::Status Annotate(const absl::Status& status, absl::string_view message) {
-  absl::Status result(status.code(),
-                      status.message().empty()
-                          ? message
-                          : absl::StrCat(status.message(), "; ", message));
-  status.ForEachPayload(
-      [&result](absl::string_view name, const absl::Cord& payload) {
-        result.SetPayload(name, payload);
-      });
-  return result;
+  if (status.message().empty()) {
+    return ReplaceMessage(status, message);
+  }
+  // E.g. the errno descriptions end in a space.
+  return ReplaceMessage(
+      status, absl::StrCat(absl::StripTrailingAsciiWhitespace(status.message()),
+                           "; ", message));
 }
 
 absl::Status& UpdateOrAnnotate(absl::Status& status,
@@ -29,5 +27,15 @@ absl::Status& UpdateOrAnnotate(absl::Status& status,
   return status;
 }
 
+absl::Status ReplaceMessage(const absl::Status& status,
+                            absl::string_view message) {
+  absl::Status result(status.code(), message);
+  status.ForEachPayload(
+      [&result](absl::string_view name, const absl::Cord& payload) {
+        result.SetPayload(name, payload);
+      });
+  return result;
+}
+
 }  // namespace status
 }  // namespace whisper
@@ -5,11 +5,14 @@
 #include <utility>
 
 #include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "absl/container/inlined_vector.h"
 #include "absl/log/check.h"
 #include "absl/log/die_if_null.h"
 #include "absl/log/log.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/strings/ascii.h"
 #include "absl/strings/str_cat.h"
 
 namespace whisper {
@@ -20,6 +23,16 @@ absl::Status Annotate(const absl::Status& status, absl::string_view message);
 absl::Status& UpdateOrAnnotate(absl::Status& status,
                                const absl::Status& annotation);
 
+// Returns a status w/ the code and payloads of status, and the provided
+// message instead of its own.
+absl::Status ReplaceMessage(const absl::Status& status,
+                            absl::string_view message);
+
+// Annotates a status w/ the values streamed to it, as Annotate would.
+// The annotated message is formatted in place in a buffer that stays on
+// the stack for the usual sizes, so the only allocation on the error path
+// is the one of the resulting status. Values streamed to an ok status are
+// not formatted at all, as they would be dropped anyway.
 class StatusWriter {
  public:
   explicit StatusWriter(absl::Status status) : status_(std::move(status)) {}
@@ -28,17 +41,35 @@ class StatusWriter {
     if (message_.empty() || status_.ok()) {
       return status_;
     }
-    return Annotate(status_, message_);
+    return ReplaceMessage(status_,
+                          absl::string_view(message_.data(), message_.size()));
   }
   template <class T>
   StatusWriter& operator<<(const T& value) {
-    absl::StrAppend(&message_, value);
+    if (ABSL_PREDICT_TRUE(!status_.ok())) {
+      Append(absl::AlphaNum(value).Piece());
+    }
     return *this;
   }
 
  protected:
+  // Inline size of the message buffer - fits most of the annotated errors.
+  static constexpr size_t kInlineMessageSize = 160;
+
+  void Append(absl::string_view piece) {
+    if (message_.empty() && !status_.message().empty()) {
+      // The message is built as Annotate would: "<message>; <annotation>".
+      const absl::string_view message =
+          absl::StripTrailingAsciiWhitespace(status_.message());
+      message_.assign(message.begin(), message.end());
+      message_.push_back(';');
+      message_.push_back(' ');
+    }
+    message_.insert(message_.end(), piece.begin(), piece.end());
+  }
+
   mutable absl::Status status_;
-  std::string message_;
+  absl::InlinedVector<char, kInlineMessageSize> message_;
 };
 // Logs the status built so far to the error log.
 class LogToError {};
@@ -0,0 +1,63 @@
+#include <cerrno>
+
+#include "benchmark/benchmark.h"
+#include "whisperlib/io/errno.h"
+#include "whisperlib/status/status.h"
+
+namespace whisper {
+namespace status {
+namespace {
+
+absl::Status ReadError(int fd, size_t size) {
+  return error::ErrnoToStatus(ECONNRESET)
+         << "Reading data to file descriptor: " << fd << " size: " << size;
+}
+
+absl::Status ReadAndProcess(int fd, size_t size) {
+  RETURN_IF_ERROR(ReadError(fd, size)) << "While processing the request.";
+  return absl::OkStatus();
+}
+
+// A plain status, for reference.
+void BM_PlainStatus(benchmark::State& state) {
+  for (auto _ : state) {
+    absl::Status status = absl::UnavailableError("Connection reset by peer");
+    benchmark::DoNotOptimize(status);
+  }
+}
+
+BENCHMARK(BM_PlainStatus);
+
+// The status of a system error, as is.
+void BM_ErrnoToStatus(benchmark::State& state) {
+  for (auto _ : state) {
+    absl::Status status = error::ErrnoToStatus(ECONNRESET);
+    benchmark::DoNotOptimize(status);
+  }
+}
+
+BENCHMARK(BM_ErrnoToStatus);
+
+// The status of a system error, annotated as in Selectable::Read.
+void BM_ErrnoToStatusAnnotated(benchmark::State& state) {
+  for (auto _ : state) {
+    absl::Status status = ReadError(17, 16384);
+    benchmark::DoNotOptimize(status);
+  }
+}
+
+BENCHMARK(BM_ErrnoToStatusAnnotated);
+
+// The above, annotated again on the way up by RETURN_IF_ERROR.
+void BM_ReturnIfError(benchmark::State& state) {
+  for (auto _ : state) {
+    absl::Status status = ReadAndProcess(17, 16384);
+    benchmark::DoNotOptimize(status);
+  }
+}
+
+BENCHMARK(BM_ReturnIfError);
+
+}  // namespace
+}  // namespace status
+}  // namespace whisper
@@ -43,6 +43,8 @@ namespace status {
 TEST(Status, Anootate) {
   EXPECT_RAISES_WITH_MESSAGE(Annotate(absl::NotFoundError("A"), "B"), NotFound,
                              "NOT_FOUND: A; B");
+  EXPECT_RAISES_WITH_MESSAGE(Annotate(absl::NotFoundError("A "), "B"),
+                             NotFound, "NOT_FOUND: A; B");
   {
     absl::Status status = absl::NotFoundError("A");
     status.SetPayload("Y", absl::Cord("X_Y"));
@@ -82,3 +84,34 @@ TEST(Status, Anootate) {
 
 }  // namespace status
 }  // namespace whisper
+
+namespace whisper {
+namespace status {
+
+TEST(Status, Writer) {
+  EXPECT_OK(absl::Status(StatusWriter(absl::OkStatus()) << "A" << 1));
+  EXPECT_RAISES_WITH_MESSAGE(absl::Status(NotFoundErrorBuilder() << "A" << 1),
+                             NotFound, "NOT_FOUND: A1");
+  EXPECT_RAISES_WITH_MESSAGE(
+      absl::Status(NotFoundErrorBuilder("A") << "B" << 2.5), NotFound,
+      "NOT_FOUND: A; B2.5");
+  EXPECT_RAISES_WITH_MESSAGE(
+      absl::Status(NotFoundErrorBuilder("A \n") << "B"), NotFound,
+      "NOT_FOUND: A; B");
+  // Past the inline size of the message.
+  const std::string long_message(1000, 'x');
+  EXPECT_RAISES_WITH_MESSAGE(
+      absl::Status(NotFoundErrorBuilder("A") << long_message << "B"), NotFound,
+      absl::StrCat("NOT_FOUND: A; ", long_message, "B"));
+  {
+    absl::Status status = absl::NotFoundError("A");
+    status.SetPayload("Y", absl::Cord("X_Y"));
+    EXPECT_EQ(absl::Status(StatusWriter(status) << "B").ToString(),
+              "NOT_FOUND: A; B [Y='X_Y']");
+    EXPECT_EQ(absl::Status(StatusWriter(status)).ToString(),
+              "NOT_FOUND: A [Y='X_Y']");
+  }
+}
+
+}  // namespace status
+}  // namespace whisper
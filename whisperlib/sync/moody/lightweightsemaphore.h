@@ -9,6 +9,15 @@
 #include <cstddef>      // For std::size_t
 #include <type_traits>  // For std::make_signed<T>
 
+// Normally defined by concurrentqueue.h - needed when included by itself.
+#ifndef MOODYCAMEL_DELETE_FUNCTION
+#if defined(_MSC_VER) && _MSC_VER < 1800
+#define MOODYCAMEL_DELETE_FUNCTION
+#else
+#define MOODYCAMEL_DELETE_FUNCTION = delete
+#endif
+#endif
+
 #if defined(_WIN32)
 // Avoid including windows.h in a header; we only need a handful of
 // items, so we'll redeclare them here (this is relatively safe since
@@ -1,7 +1,9 @@
 #ifndef WHISPERLIB_SYNC_PRODUCER_CONSUMER_QUEUE_H_
 #define WHISPERLIB_SYNC_PRODUCER_CONSUMER_QUEUE_H_
 
+#include <algorithm>
 #include <deque>
+#include <iterator>
 #include <utility>
 #include <vector>
 
@@ -9,6 +11,7 @@
 #include "absl/synchronization/mutex.h"
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
+#include "absl/types/span.h"
 #include "whisperlib/status/status.h"
 
 namespace whisper {
@@ -51,6 +54,41 @@ class ProducerConsumerQueue {
     }
     return {};
   }
+  // Places the data into the queue, under a single lock, as the policy
+  // requires. If timeout is not infinite, we bail out when the queue still
+  // has no empty space after that duration.
+  // Returns the number of elements placed - the first ones in data, which
+  // are moved from. The rest are left untouched.
+  size_t PutMany(absl::Span<C> data,
+                 absl::Duration timeout = absl::InfiniteDuration())
+      ABSL_LOCKS_EXCLUDED(mutex_) {
+    const absl::Time deadline = absl::Now() + timeout;
+    size_t num_put = 0;
+    absl::MutexLock l(&mutex_);
+    while (num_put < data.size()) {
+      if (!HasEmptySpace()) {
+        mutex_.AwaitWithDeadline(
+            absl::Condition(this, &ProducerConsumerQueue<C>::HasEmptySpace),
+            deadline);
+        if (!HasEmptySpace()) {
+          break;
+        }
+      }
+      const size_t count =
+          max_size_ == 0 ? data.size() - num_put
+                         : std::min(data.size() - num_put,
+                                    max_size_ - data_.size());
+      for (size_t i = 0; i < count; ++i) {
+        if (fifo_policy_) {
+          data_.emplace_back(std::move(data[num_put + i]));
+        } else {
+          data_.emplace_front(std::move(data[num_put + i]));
+        }
+      }
+      num_put += count;
+    }
+    return num_put;
+  }
   // Returns the first available element at the front of the queue.
   ABSL_MUST_USE_RESULT C Get() ABSL_LOCKS_EXCLUDED(mutex_) {
     absl::MutexLock l(&mutex_);
@@ -79,6 +117,28 @@ class ProducerConsumerQueue {
     data_.pop_front();
     return true;
   }
+  // Returns at most max_count elements from the front of the queue, waiting
+  // at most timeout duration for the first one to be available. Returns
+  // an empty vector if none is available.
+  ABSL_MUST_USE_RESULT std::vector<C> GetUpTo(
+      size_t max_count, absl::Duration timeout = absl::InfiniteDuration())
+      ABSL_LOCKS_EXCLUDED(mutex_) {
+    std::vector<C> result;
+    absl::MutexLock l(&mutex_);
+    if (!HasData()) {
+      mutex_.AwaitWithTimeout(
+          absl::Condition(this, &ProducerConsumerQueue<C>::HasData), timeout);
+      if (!HasData()) {
+        return result;
+      }
+    }
+    const size_t count = std::min(max_count, data_.size());
+    result.reserve(count);
+    std::move(data_.begin(), data_.begin() + count,
+              std::back_inserter(result));
+    data_.erase(data_.begin(), data_.begin() + count);
+    return result;
+  }
   // Empties the queue, returning everything that is stored in it.
   ABSL_MUST_USE_RESULT std::vector<C> GetAll() ABSL_LOCKS_EXCLUDED(mutex_) {
     std::vector<C> result;
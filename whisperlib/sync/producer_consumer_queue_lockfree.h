@@ -10,6 +10,7 @@
 #include <vector>
 
 #include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "whisperlib/sync/moody/lightweightsemaphore.h"
 
 /**
@@ -64,29 +65,11 @@ class LockFreeProducerConsumerQueue {
     // >> [[LT]]   Acquire: last_tail_
     size_t pos_min = last_tail_.load(std::memory_order_acquire);
     while (ABSL_PREDICT_FALSE(my_head >= pos_min + q_size_)) {
-      //
-      // >> [[LT]]   Acquire: last_tail_
-      pos_min = tail_.load(std::memory_order_acquire);
-      for (size_t i = 0; i < num_consumers_; ++i) {
-        //
-        // >> [[C-T]]    Acquire: clients_[i].tail_
-        const size_t tmp_tail =
-            clients_[i].tail_.load(std::memory_order_acquire);
-        if (tmp_tail < pos_min) {
-          pos_min = tmp_tail;
-        }
-      }
-      //
-      // << [[LT]]   Release: last_tail_
-      last_tail_.store(pos_min, std::memory_order_release);
+      pos_min = UpdateLastTail();
       if (my_head < pos_min + q_size_) {
         break;
       }
-      if (ABSL_PREDICT_TRUE(wait_duration_ > absl::ZeroDuration())) {
-        get_semaphore_.timed_wait(absl::ToInt64Microseconds(wait_duration_));
-      } else {
-        _mm_pause();
-      }
+      WaitForGet();
     }
     data_[my_head & q_mask_] = std::move(data);
     // << [[C-H]]    Release: Clear reservation on clients_[producer_id].head_
@@ -116,29 +99,11 @@ class LockFreeProducerConsumerQueue {
     // >> [[LH]]     Acquire: last_head_
     size_t pos_min = last_head_.load(std::memory_order_acquire);
     while (ABSL_PREDICT_FALSE(my_tail >= pos_min)) {
-      //
-      // >> [H] Acquire: head_
-      pos_min = head_.load(std::memory_order_acquire);
-      for (size_t i = 0; i < num_producers_; ++i) {
-        //
-        // >> [[C-H]]    Acquire: clients_[i].head_
-        const size_t tmp_head =
-            clients_[i].head_.load(std::memory_order_acquire);
-        if (tmp_head < pos_min) {
-          pos_min = tmp_head;
-        }
-      }
-      //
-      // << [[LH]]   Release: last_head_
-      last_head_.store(pos_min, std::memory_order_release);
+      pos_min = UpdateLastHead();
       if (my_tail < pos_min) {
         break;
       }
-      if (ABSL_PREDICT_TRUE(wait_duration_ > absl::ZeroDuration())) {
-        put_semaphore_.timed_wait(absl::ToInt64Microseconds(wait_duration_));
-      } else {
-        _mm_pause();
-      }
+      WaitForPut();
     }
     //
     // >> [[C-T]]  Consume: clients_[consumer_id].tail_
@@ -153,6 +118,100 @@ class LockFreeProducerConsumerQueue {
     }
     return ret;
   }
+  // Places all the data in the queue, as Put() would, but reserving the
+  // positions for a whole chunk (up to the queue size) with a single atomic
+  // operation, and waking up the consumers once per chunk.
+  void PutMany(absl::Span<const C> data, size_t producer_id) {
+    CHECK_LT(producer_id, num_producers_);
+    while (!data.empty()) {
+      const size_t count = std::min(data.size(), q_size_);
+      //
+      // << [[C-H]]  Release: clients_[producer_id].head_
+      clients_[producer_id].head_.store(head_.load(std::memory_order_acquire),
+                                        std::memory_order_release);
+      //
+      // <<>> [[H]]  Acquire & Release: head_
+      const size_t my_head = head_.fetch_add(count, std::memory_order_acq_rel);
+      //
+      // << [[C-H]]  Release: clients_[producer_id].head_
+      clients_[producer_id].head_.store(my_head, std::memory_order_release);
+      const size_t my_last = my_head + count - 1;
+      //
+      // >> [[LT]]   Acquire: last_tail_
+      size_t pos_min = last_tail_.load(std::memory_order_acquire);
+      while (ABSL_PREDICT_FALSE(my_last >= pos_min + q_size_)) {
+        pos_min = UpdateLastTail();
+        if (my_last < pos_min + q_size_) {
+          break;
+        }
+        WaitForGet();
+      }
+      for (size_t i = 0; i < count; ++i) {
+        data_[(my_head + i) & q_mask_] = data[i];
+      }
+      // << [[C-H]]    Release: Clear reservation on clients_[producer_id].head_
+      clients_[producer_id].head_.store(std::numeric_limits<size_t>::max(),
+                                        std::memory_order_release);
+      if (last_head_.load(std::memory_order_acquire) <= my_last &&
+          wait_duration_ > absl::ZeroDuration()) {
+        put_semaphore_.signal(count);
+      }
+      data.remove_prefix(count);
+    }
+  }
+
+  // Moves into out at most out.size() elements, waiting at most timeout
+  // duration for the first one to be available. Unlike Get(), the positions
+  // are reserved only when the elements are already there, so the call
+  // can time out. Returns the number of elements placed in out.
+  size_t GetUpTo(absl::Span<C> out, size_t consumer_id,
+                 absl::Duration timeout = absl::InfiniteDuration()) {
+    CHECK_LT(consumer_id, num_consumers_);
+    if (out.empty()) {
+      return 0;
+    }
+    const absl::Time deadline = absl::Now() + timeout;
+    while (true) {
+      size_t my_tail = tail_.load(std::memory_order_acquire);
+      //
+      // << [[C-T]]    Release: clients_[consumer_id].tail_
+      // A lower bound of the position we reserve below, keeping the producers
+      // off it while we try. Refreshed on each attempt, so we don't hold
+      // back the producers while waiting.
+      clients_[consumer_id].tail_.store(my_tail, std::memory_order_release);
+      const size_t pos_min = UpdateLastHead();
+      if (my_tail < pos_min) {
+        const size_t count = std::min(out.size(), pos_min - my_tail);
+        //
+        // <<>> [[T]]    Acquire && Release: tail_
+        if (!tail_.compare_exchange_weak(my_tail, my_tail + count,
+                                         std::memory_order_acq_rel)) {
+          continue;
+        }
+        //
+        // >> [[C-T]]  Consume: clients_[consumer_id].tail_
+        for (size_t i = 0; i < count; ++i) {
+          out[i] = std::move(data_[(my_tail + i) & q_mask_]);
+        }
+        //
+        // << [[C-T]]  Release: clients_[consumer_id].tail_
+        clients_[consumer_id].tail_.store(std::numeric_limits<size_t>::max(),
+                                          std::memory_order_release);
+        if (last_tail_.load(std::memory_order_acquire) < my_tail + count &&
+            wait_duration_ > absl::ZeroDuration()) {
+          get_semaphore_.signal(count);
+        }
+        return count;
+      }
+      if (absl::Now() >= deadline) {
+        clients_[consumer_id].tail_.store(std::numeric_limits<size_t>::max(),
+                                          std::memory_order_release);
+        return 0;
+      }
+      WaitForPut();
+    }
+  }
+
   // Approximately:
   size_t Size() const { return head_.load() - tail_.load(); }
   std::string ToString() const {
@@ -180,6 +239,59 @@ class LockFreeProducerConsumerQueue {
     while (ret < sz) ret <<= 1;
     return ret;
   }
+  // Recomputes the position before which all consumers are done.
+  size_t UpdateLastTail() {
+    //
+    // >> [[LT]]   Acquire: last_tail_
+    size_t pos_min = tail_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < num_consumers_; ++i) {
+      //
+      // >> [[C-T]]    Acquire: clients_[i].tail_
+      const size_t tmp_tail = clients_[i].tail_.load(std::memory_order_acquire);
+      if (tmp_tail < pos_min) {
+        pos_min = tmp_tail;
+      }
+    }
+    //
+    // << [[LT]]   Release: last_tail_
+    last_tail_.store(pos_min, std::memory_order_release);
+    return pos_min;
+  }
+  // Recomputes the position before which all producers are done.
+  size_t UpdateLastHead() {
+    //
+    // >> [H] Acquire: head_
+    size_t pos_min = head_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < num_producers_; ++i) {
+      //
+      // >> [[C-H]]    Acquire: clients_[i].head_
+      const size_t tmp_head = clients_[i].head_.load(std::memory_order_acquire);
+      if (tmp_head < pos_min) {
+        pos_min = tmp_head;
+      }
+    }
+    //
+    // << [[LH]]   Release: last_head_
+    last_head_.store(pos_min, std::memory_order_release);
+    return pos_min;
+  }
+  // Waits a bit for a consumer to make room.
+  void WaitForGet() {
+    if (ABSL_PREDICT_TRUE(wait_duration_ > absl::ZeroDuration())) {
+      get_semaphore_.timed_wait(absl::ToInt64Microseconds(wait_duration_));
+    } else {
+      _mm_pause();
+    }
+  }
+  // Waits a bit for a producer to add some data.
+  void WaitForPut() {
+    if (ABSL_PREDICT_TRUE(wait_duration_ > absl::ZeroDuration())) {
+      put_semaphore_.timed_wait(absl::ToInt64Microseconds(wait_duration_));
+    } else {
+      _mm_pause();
+    }
+  }
+
   static inline bool HasBeenNotified(const std::atomic<bool>* notified_yet) {
     return notified_yet->load(std::memory_order_acquire);
   }
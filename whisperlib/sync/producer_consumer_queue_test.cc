@@ -59,6 +59,34 @@ TEST(ProducerConsumerQueue, GetAll) {
   }
 }
 
+TEST(ProducerConsumerQueue, PutManyGetUpTo) {
+  ProducerConsumerQueue<int> q(10);
+  std::vector<int> data(15);
+  for (int i = 0; i < 15; ++i) {
+    data[i] = i;
+  }
+  EXPECT_EQ(q.PutMany(absl::MakeSpan(data), absl::ZeroDuration()), 10);
+  EXPECT_TRUE(q.IsFull());
+  auto res = q.GetUpTo(4);
+  ASSERT_EQ(res.size(), 4);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(res[i], i);
+  }
+  EXPECT_EQ(q.PutMany(absl::MakeSpan(data).subspan(10), absl::ZeroDuration()),
+            4);
+  res = q.GetUpTo(100);
+  ASSERT_EQ(res.size(), 10);
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(res[i], i + 4);
+  }
+  EXPECT_TRUE(q.GetUpTo(100, absl::Milliseconds(10)).empty());
+
+  ProducerConsumerQueue<int> lifo(10, false);
+  EXPECT_EQ(lifo.PutMany(absl::MakeSpan(data).subspan(0, 3)), 3);
+  res = lifo.GetUpTo(2);
+  EXPECT_THAT(res, ::testing::ElementsAre(2, 1));
+}
+
 TEST(ProducerConsumerQueue, Clear) {
   ProducerConsumerQueue<int> q(100);
   for (int i = 0; i < 100; ++i) {
@@ -297,6 +325,160 @@ TEST(LockFreeProducerConsumerQueue, LockfreeMultiProducersConsumersSpin) {
   RunLockfreeMultiProducersConsumers(absl::ZeroDuration());
 }
 
+// Batched versions of the above.
+static constexpr const size_t kBatchSize = 64;
+
+void ProduceBatched(ProducerConsumerQueue<int>* q, int num) {
+  std::vector<int> batch;
+  batch.reserve(kBatchSize);
+  for (int i = 0; i < num; ++i) {
+    batch.push_back(i);
+    if (batch.size() == kBatchSize || i + 1 == num) {
+      CHECK_EQ(q->PutMany(absl::MakeSpan(batch)), batch.size());
+      batch.clear();
+    }
+  }
+}
+void ConsumeBatched(ProducerConsumerQueue<int>* q, int num) {
+  int64_t sum = 0;
+  for (int i = 0; i < num;) {
+    for (int v : q->GetUpTo(std::min<size_t>(kBatchSize, num - i))) {
+      sum += v;
+      ++i;
+    }
+  }
+  std::cout << "Consumer sum: " << sum << std::endl;
+}
+
+TEST(ProducerConsumerQueue, MultithreadMultiProducersConsumersBatched) {
+  ProducerConsumerQueue<int> q(100 * kBatchSize);
+  static constexpr const int kNumItems = kManyItems;
+  static constexpr const int kNumProducers = 8;
+  static constexpr const int kNumConsumers = 8;
+  std::vector<std::unique_ptr<work::Thread>> threads;
+  static constexpr const int kNumPerProducer = kNumItems / kNumProducers;
+  const absl::Time start = absl::Now();
+  for (size_t i = 0; i < kNumProducers; ++i) {
+    ASSERT_OK_AND_ASSIGN(auto produce,
+                         work::Thread::Create(absl::bind_front(
+                             &ProduceBatched, &q, kNumPerProducer)));
+    threads.emplace_back(std::move(produce));
+  }
+  static constexpr const int kNumPerConsumer = kNumItems / kNumConsumers;
+  for (size_t i = 0; i < kNumConsumers; ++i) {
+    ASSERT_OK_AND_ASSIGN(auto consume,
+                         work::Thread::Create(absl::bind_front(
+                             &ConsumeBatched, &q, kNumPerConsumer)));
+    threads.emplace_back(std::move(consume));
+  }
+  for (auto it = threads.rbegin(); it != threads.rend(); ++it) {
+    ASSERT_OK((*it)->Join());
+  }
+  std::cout << "Batched ProducerConsumerQueue: "
+            << kNumItems / absl::ToDoubleSeconds(absl::Now() - start) /
+                   (kNumProducers + kNumConsumers)
+            << " ops / sec / thread" << std::endl;
+  EXPECT_EQ(q.Size(), 0);
+}
+
+TEST(LockFreeProducerConsumerQueue, PutManyGetUpTo) {
+  LockFreeProducerConsumerQueue<int> q(16, 1, 1);
+  std::vector<int> data(40);
+  for (int i = 0; i < 40; ++i) {
+    data[i] = i;
+  }
+  q.PutMany(absl::MakeConstSpan(data).subspan(0, 12), 0);
+  EXPECT_EQ(q.Size(), 12);
+  std::vector<int> out(10);
+  ASSERT_EQ(q.GetUpTo(absl::MakeSpan(out), 0), 10);
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(out[i], i);
+  }
+  ASSERT_EQ(q.GetUpTo(absl::MakeSpan(out), 0), 2);
+  EXPECT_EQ(out[0], 10);
+  EXPECT_EQ(out[1], 11);
+  EXPECT_EQ(q.GetUpTo(absl::MakeSpan(out), 0, absl::Milliseconds(10)), 0);
+  // Mixed with the single element calls.
+  q.Put(100, 0);
+  EXPECT_EQ(q.Get(0), 100);
+  q.PutMany(absl::MakeConstSpan(data).subspan(0, 3), 0);
+  EXPECT_EQ(q.Get(0), 0);
+  ASSERT_EQ(q.GetUpTo(absl::MakeSpan(out), 0), 2);
+  EXPECT_EQ(out[0], 1);
+  EXPECT_EQ(out[1], 2);
+  EXPECT_EQ(q.Size(), 0);
+}
+
+void LockfreeProduceBatched(LockFreeProducerConsumerQueue<int>* q, size_t id,
+                            int num) {
+  std::vector<int> batch;
+  batch.reserve(kBatchSize);
+  for (int i = 0; i < num; ++i) {
+    batch.push_back(i);
+    if (batch.size() == kBatchSize || i + 1 == num) {
+      q->PutMany(batch, id);
+      batch.clear();
+    }
+  }
+}
+
+void LockfreeConsumeBatched(LockFreeProducerConsumerQueue<int>* q, size_t id,
+                            int num) {
+  int64_t sum = 0;
+  std::vector<int> out(kBatchSize);
+  for (int i = 0; i < num;) {
+    const size_t count = q->GetUpTo(
+        absl::MakeSpan(out).subspan(0, std::min<size_t>(kBatchSize, num - i)),
+        id);
+    for (size_t j = 0; j < count; ++j) {
+      sum += out[j];
+    }
+    i += count;
+  }
+  std::cout << "Consumer: " << id << " sum: " << sum << std::endl;
+}
+
+void RunLockfreeMultiProducersConsumersBatched(absl::Duration wait_duration) {
+  static constexpr const int kNumItems = kManyItems;
+  static constexpr const int kNumProducers = 8;
+  static constexpr const int kNumConsumers = 8;
+  LockFreeProducerConsumerQueue<int> q(100 * kBatchSize, kNumProducers,
+                                       kNumConsumers, wait_duration);
+  static constexpr const int kNumPerProducer = kNumItems / kNumProducers;
+  std::vector<std::unique_ptr<work::Thread>> threads;
+  const absl::Time start = absl::Now();
+  for (size_t i = 0; i < kNumProducers; ++i) {
+    ASSERT_OK_AND_ASSIGN(auto produce,
+                         work::Thread::Create(absl::bind_front(
+                             &LockfreeProduceBatched, &q, i, kNumPerProducer)));
+    threads.emplace_back(std::move(produce));
+  }
+  static constexpr const int kNumPerConsumer = kNumItems / kNumConsumers;
+  for (size_t i = 0; i < kNumConsumers; ++i) {
+    ASSERT_OK_AND_ASSIGN(auto consume,
+                         work::Thread::Create(absl::bind_front(
+                             &LockfreeConsumeBatched, &q, i, kNumPerConsumer)));
+    threads.emplace_back(std::move(consume));
+  }
+  for (auto it = threads.rbegin(); it != threads.rend(); ++it) {
+    ASSERT_OK((*it)->Join());
+  }
+  std::cout << "Batched LockFreeProducerConsumerQueue: "
+            << kNumItems / absl::ToDoubleSeconds(absl::Now() - start) /
+                   (kNumProducers + kNumConsumers)
+            << " ops / sec / thread" << std::endl;
+  EXPECT_EQ(q.Size(), 0);
+}
+
+TEST(LockFreeProducerConsumerQueue, LockfreeMultiProducersConsumersBatched) {
+  RunLockfreeMultiProducersConsumersBatched(absl::Microseconds(50));
+}
+
+TEST(LockFreeProducerConsumerQueue,
+     LockfreeMultiProducersConsumersBatchedSpin) {
+  RunLockfreeMultiProducersConsumersBatched(absl::ZeroDuration());
+}
+
 void MoodyProduce(
     moodycamel::BlockingConcurrentQueue<int>* q,
     moodycamel::BlockingConcurrentQueue<int>::producer_token_t* token,
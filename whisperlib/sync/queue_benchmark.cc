@@ -0,0 +1,116 @@
+#include <cstdint>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "benchmark/benchmark.h"
+#include "whisperlib/sync/moody/blockingconcurrentqueue.h"
+#include "whisperlib/sync/producer_consumer_queue.h"
+#include "whisperlib/sync/producer_consumer_queue_lockfree.h"
+#include "whisperlib/sync/spsc_queue.h"
+
+namespace whisper {
+namespace synch {
+namespace {
+
+constexpr size_t kQueueSize = 1024;
+// Put by each producer when done.
+constexpr uint64_t kEndMarker = std::numeric_limits<uint64_t>::max();
+
+// Adapters to a common interface: Put(value, producer_id) and Get(),
+// both blocking.
+class PcqAdapter {
+ public:
+  explicit PcqAdapter(size_t /*num_producers*/) : queue_(kQueueSize) {}
+  void Put(uint64_t value, size_t /*producer_id*/) {
+    queue_.Put(value);
+  }
+  uint64_t Get() { return queue_.Get(); }
+
+ private:
+  ProducerConsumerQueue<uint64_t> queue_;
+};
+
+class LockFreeAdapter {
+ public:
+  explicit LockFreeAdapter(size_t num_producers)
+      : queue_(kQueueSize, num_producers, 1) {}
+  void Put(uint64_t value, size_t producer_id) {
+    queue_.Put(value, producer_id);
+  }
+  uint64_t Get() { return queue_.Get(0); }
+
+ private:
+  LockFreeProducerConsumerQueue<uint64_t> queue_;
+};
+
+class SpscAdapter {
+ public:
+  explicit SpscAdapter(size_t num_producers) : queue_(kQueueSize) {
+    CHECK_EQ(num_producers, 1);
+  }
+  void Put(uint64_t value, size_t /*producer_id*/) { queue_.Put(value); }
+  uint64_t Get() { return queue_.Get(); }
+
+ private:
+  SpscQueue<uint64_t> queue_;
+};
+
+// The moodycamel queue used by the Selector, for reference.
+class MoodyAdapter {
+ public:
+  explicit MoodyAdapter(size_t /*num_producers*/) : queue_(kQueueSize) {}
+  void Put(uint64_t value, size_t /*producer_id*/) { queue_.enqueue(value); }
+  uint64_t Get() {
+    uint64_t value;
+    queue_.wait_dequeue(value);
+    return value;
+  }
+
+ private:
+  moodycamel::BlockingConcurrentQueue<uint64_t> queue_;
+};
+
+// Throughput of passing values from range(0) producer threads to the
+// benchmark thread, which consumes one value per iteration.
+template <typename Queue>
+void BM_Queue(benchmark::State& state) {
+  const size_t num_producers = state.range(0);
+  Queue queue(num_producers);
+  std::atomic_bool stop(false);
+  std::vector<std::thread> producers;
+  for (size_t i = 0; i < num_producers; ++i) {
+    producers.emplace_back([&queue, &stop, i]() {
+      for (uint64_t value = 0; !stop.load(std::memory_order_relaxed);
+           ++value) {
+        queue.Put(value, i);
+      }
+      queue.Put(kEndMarker, i);
+    });
+  }
+  uint64_t sum = 0;
+  for (auto _ : state) {
+    sum += queue.Get();
+  }
+  stop.store(true);
+  for (size_t num_ended = 0; num_ended < num_producers;) {
+    if (queue.Get() == kEndMarker) {
+      ++num_ended;
+    }
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+  benchmark::DoNotOptimize(sum);
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_TEMPLATE(BM_Queue, PcqAdapter)->Arg(1)->Arg(4)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Queue, LockFreeAdapter)->Arg(1)->Arg(4)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Queue, SpscAdapter)->Arg(1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Queue, MoodyAdapter)->Arg(1)->Arg(4)->UseRealTime();
+
+}  // namespace
+}  // namespace synch
+}  // namespace whisper
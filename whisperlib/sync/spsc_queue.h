@@ -0,0 +1,244 @@
+#ifndef WHISPERLIB_SYNC_SPSC_QUEUE_H_
+#define WHISPERLIB_SYNC_SPSC_QUEUE_H_
+
+#include <atomic>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/log/check.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "whisperlib/sync/moody/lightweightsemaphore.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Bounded, wait free, single producer / single consumer ring queue.
+ *
+ * Unlike LockFreeProducerConsumerQueue, it takes any movable type, and it
+ * needs no producer / consumer ids - but exactly one thread may put, and
+ * exactly one thread may get at any given time.
+ *
+ * The head (producer side) and tail (consumer side) live on their own
+ * cache lines, each with a cached copy of the other side index, so in the
+ * common case Put and Get touch no cache line written by the other side.
+ *
+ * With a wait_duration of zero, the blocking calls spin. Else they park on
+ * a semaphore, for at most wait_duration at a time, and the other side
+ * signals them when it makes progress.
+ */
+namespace whisper {
+namespace synch {
+
+template <typename T>
+class SpscQueue {
+ public:
+  static_assert(std::is_nothrow_move_constructible<T>::value,
+                "SpscQueue requires nothrow movable types");
+
+  explicit SpscQueue(size_t q_size,
+                     absl::Duration wait_duration = absl::Microseconds(10))
+      : q_size_(NextPow2(q_size)),
+        q_mask_(q_size_ - 1),
+        wait_duration_(wait_duration),
+        data_(new Slot[q_size_]) {
+    CHECK_GT(q_size, 0);
+  }
+  ~SpscQueue() {
+    const size_t head = producer_.head_.load(std::memory_order_acquire);
+    for (size_t i = consumer_.tail_.load(std::memory_order_acquire); i < head;
+         ++i) {
+      data_[i & q_mask_].Get()->~T();
+    }
+  }
+
+  // Producer side:
+
+  // Constructs an element at the end of the queue, if there is room for it.
+  template <typename... Args>
+  bool TryEmplace(Args&&... args) {
+    const size_t head = producer_.head_.load(std::memory_order_relaxed);
+    if (ABSL_PREDICT_FALSE(head - producer_.cached_tail_ >= q_size_)) {
+      producer_.cached_tail_ = consumer_.tail_.load(std::memory_order_acquire);
+      if (head - producer_.cached_tail_ >= q_size_) {
+        return false;
+      }
+    }
+    new (data_[head & q_mask_].storage) T(std::forward<Args>(args)...);
+    producer_.head_.store(head + 1, std::memory_order_release);
+    Notify(&consumer_waiting_, &put_semaphore_);
+    return true;
+  }
+  // Moves data in the queue if there is room for it, else leaves it alone.
+  bool TryPut(T&& data) { return TryEmplace(std::move(data)); }
+  bool TryPut(const T& data) { return TryEmplace(data); }
+
+  // Places data in the queue, waiting for room as long as needed.
+  void Put(T data) {
+    while (!TryEmplace(std::move(data))) {
+      Wait(&producer_waiting_, &get_semaphore_, &SpscQueue<T>::HasEmptySpace);
+    }
+  }
+
+  // Consumer side:
+
+  // Moves the first element of the queue in data, if there is one.
+  bool TryGet(T* data) {
+    T* const elem = Front();
+    if (elem == nullptr) {
+      return false;
+    }
+    *data = std::move(*elem);
+    PopFront(elem);
+    return true;
+  }
+  // Returns the first element of the queue, waiting for it as long as needed.
+  T Get() {
+    T* elem;
+    while ((elem = Front()) == nullptr) {
+      Wait(&consumer_waiting_, &put_semaphore_, &SpscQueue<T>::HasData);
+    }
+    T ret(std::move(*elem));
+    PopFront(elem);
+    return ret;
+  }
+  // Moves the first element of the queue in data, waiting at most timeout
+  // for one to be available.
+  bool Get(T* data, absl::Duration timeout) {
+    if (TryGet(data)) {
+      return true;
+    }
+    const absl::Time deadline = absl::Now() + timeout;
+    do {
+      Wait(&consumer_waiting_, &put_semaphore_, &SpscQueue<T>::HasData);
+      if (TryGet(data)) {
+        return true;
+      }
+    } while (absl::Now() < deadline);
+    return false;
+  }
+
+  // Approximately, if not called from the producer or consumer:
+  size_t Size() const {
+    return producer_.head_.load(std::memory_order_acquire) -
+           consumer_.tail_.load(std::memory_order_acquire);
+  }
+  bool IsEmpty() const { return !HasData(); }
+  size_t Capacity() const { return q_size_; }
+  std::string ToString() const {
+    return absl::StrCat(
+        "SpscQueue{ q_size_: ", q_size_,
+        ", head_: ", producer_.head_.load(std::memory_order_acquire),
+        ", tail_: ", consumer_.tail_.load(std::memory_order_acquire), " }");
+  }
+
+ private:
+  struct Slot {
+    T* Get() { return std::launder(reinterpret_cast<T*>(storage)); }
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+  // Each side writes only its own cache line.
+  struct ABSL_CACHELINE_ALIGNED ProducerSide {
+    std::atomic<size_t> head_{0};
+    // Last tail_ the producer saw - the consumer is at least there.
+    size_t cached_tail_ = 0;
+  };
+  struct ABSL_CACHELINE_ALIGNED ConsumerSide {
+    std::atomic<size_t> tail_{0};
+    // Last head_ the consumer saw - the producer is at least there.
+    size_t cached_head_ = 0;
+  };
+
+  static size_t NextPow2(size_t sz) {
+    size_t ret = 1;
+    while (ret < sz) ret <<= 1;
+    return ret;
+  }
+  // Consumer only: the first element of the queue, or nullptr if empty.
+  T* Front() {
+    const size_t tail = consumer_.tail_.load(std::memory_order_relaxed);
+    if (ABSL_PREDICT_FALSE(tail >= consumer_.cached_head_)) {
+      consumer_.cached_head_ = producer_.head_.load(std::memory_order_acquire);
+      if (tail >= consumer_.cached_head_) {
+        return nullptr;
+      }
+    }
+    return data_[tail & q_mask_].Get();
+  }
+  // Consumer only: destroys the element returned by Front() and releases
+  // its slot to the producer.
+  void PopFront(T* elem) {
+    elem->~T();
+    consumer_.tail_.store(consumer_.tail_.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_release);
+    Notify(&producer_waiting_, &get_semaphore_);
+  }
+  bool HasData() const { return Size() > 0; }
+  bool HasEmptySpace() const { return Size() < q_size_; }
+
+  static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+  // Parks the caller until ready(), the other side signals it, or for at most
+  // wait_duration_. With a zero wait_duration_ it just spins a bit.
+  void Wait(std::atomic<bool>* waiting,
+            moodycamel::LightweightSemaphore* semaphore,
+            bool (SpscQueue<T>::*ready)() const) {
+    if (wait_duration_ <= absl::ZeroDuration()) {
+      CpuRelax();
+      return;
+    }
+    waiting->store(true, std::memory_order_relaxed);
+    // Pairs w/ the fence in Notify: either we see the new index here,
+    // or the other side sees us waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!(this->*ready)()) {
+      semaphore->wait(absl::ToInt64Microseconds(wait_duration_));
+    }
+    waiting->store(false, std::memory_order_relaxed);
+  }
+  // Wakes up the other side, if parked.
+  void Notify(std::atomic<bool>* waiting,
+              moodycamel::LightweightSemaphore* semaphore) {
+    if (wait_duration_ <= absl::ZeroDuration()) {
+      return;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting->load(std::memory_order_relaxed)) {
+      semaphore->signal();
+    }
+  }
+
+  const size_t q_size_;
+  const size_t q_mask_;
+  const absl::Duration wait_duration_;
+  const std::unique_ptr<Slot[]> data_;
+
+  ProducerSide producer_;
+  ConsumerSide consumer_;
+
+  // Consumer waits on put_semaphore_, producer on get_semaphore_.
+  ABSL_CACHELINE_ALIGNED std::atomic<bool> consumer_waiting_{false};
+  std::atomic<bool> producer_waiting_{false};
+  moodycamel::LightweightSemaphore put_semaphore_;
+  moodycamel::LightweightSemaphore get_semaphore_;
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+};
+
+}  // namespace synch
+}  // namespace whisper
+
+#endif  // WHISPERLIB_SYNC_SPSC_QUEUE_H_
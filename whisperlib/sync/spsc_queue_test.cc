@@ -0,0 +1,159 @@
+#include "whisperlib/sync/spsc_queue.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/functional/bind_front.h"
+#include "gtest/gtest.h"
+#include "whisperlib/status/testing.h"
+#include "whisperlib/sync/moody/blockingconcurrentqueue.h"
+#include "whisperlib/sync/producer_consumer_queue.h"
+#include "whisperlib/sync/producer_consumer_queue_lockfree.h"
+#include "whisperlib/sync/thread.h"
+
+namespace whisper {
+namespace synch {
+
+TEST(SpscQueue, General) {
+  SpscQueue<int> q(100);
+  EXPECT_EQ(q.Capacity(), 128);
+  EXPECT_TRUE(q.IsEmpty());
+  for (int i = 0; i < 128; ++i) {
+    EXPECT_TRUE(q.TryPut(i));
+  }
+  EXPECT_EQ(q.Size(), 128);
+  EXPECT_FALSE(q.TryPut(128));
+  for (int i = 0; i < 128; ++i) {
+    EXPECT_EQ(q.Get(), i);
+  }
+  EXPECT_TRUE(q.IsEmpty());
+  int k;
+  EXPECT_FALSE(q.TryGet(&k));
+  EXPECT_FALSE(q.Get(&k, absl::Milliseconds(10)));
+  // Wrap around a few times.
+  for (int i = 0; i < 1000; ++i) {
+    q.Put(i);
+    ASSERT_TRUE(q.Get(&k, absl::ZeroDuration()));
+    EXPECT_EQ(k, i);
+  }
+}
+
+TEST(SpscQueue, MovableTypes) {
+  SpscQueue<std::unique_ptr<std::string>> q(4);
+  auto s = std::make_unique<std::string>("foo");
+  EXPECT_TRUE(q.TryPut(std::move(s)));
+  EXPECT_TRUE(q.TryEmplace(new std::string("bar")));
+  q.Put(std::make_unique<std::string>("baz"));
+  EXPECT_EQ(*q.Get(), "foo");
+  std::unique_ptr<std::string> p;
+  ASSERT_TRUE(q.TryGet(&p));
+  EXPECT_EQ(*p, "bar");
+  EXPECT_TRUE(q.TryEmplace(new std::string("qux")));
+  EXPECT_TRUE(q.TryEmplace(new std::string("quux")));
+  EXPECT_TRUE(q.TryEmplace(new std::string("corge")));
+  auto extra = std::make_unique<std::string>("grault");
+  EXPECT_FALSE(q.TryPut(std::move(extra)));
+  ASSERT_NE(extra, nullptr);  // untouched when full
+  EXPECT_EQ(*extra, "grault");
+  EXPECT_EQ(q.Size(), 4);
+  // The rest are released by the queue destructor.
+}
+
+// A bit of a benchmark of the queues on a single producer / consumer pair.
+static constexpr const int kNumItems = 5000000;
+
+void SpscProduce(SpscQueue<int>* q) {
+  for (int i = 0; i < kNumItems; ++i) {
+    q->Put(i);
+  }
+}
+void SpscConsume(SpscQueue<int>* q) {
+  for (int i = 0; i < kNumItems; ++i) {
+    CHECK_EQ(q->Get(), i);
+  }
+}
+
+void RunSpsc(absl::Duration wait_duration) {
+  SpscQueue<int> q(1024, wait_duration);
+  const absl::Time start = absl::Now();
+  ASSERT_OK_AND_ASSIGN(auto consume, work::Thread::Create(
+                                         absl::bind_front(&SpscConsume, &q)));
+  ASSERT_OK_AND_ASSIGN(auto produce, work::Thread::Create(
+                                         absl::bind_front(&SpscProduce, &q)));
+  ASSERT_OK(produce->Join());
+  ASSERT_OK(consume->Join());
+  std::cout << "SpscQueue: "
+            << kNumItems / absl::ToDoubleSeconds(absl::Now() - start) / 2
+            << " ops / sec / thread" << std::endl;
+  EXPECT_TRUE(q.IsEmpty());
+}
+
+TEST(SpscQueue, SingleProducerConsumer) { RunSpsc(absl::Microseconds(50)); }
+
+TEST(SpscQueue, SingleProducerConsumerSpin) { RunSpsc(absl::ZeroDuration()); }
+
+TEST(SpscQueue, CompareProducerConsumerQueue) {
+  ProducerConsumerQueue<int> q(1024);
+  const absl::Time start = absl::Now();
+  ASSERT_OK_AND_ASSIGN(auto consume, work::Thread::Create([&q]() {
+                         for (int i = 0; i < kNumItems / 10; ++i) {
+                           CHECK_EQ(q.Get(), i);
+                         }
+                       }));
+  ASSERT_OK_AND_ASSIGN(auto produce, work::Thread::Create([&q]() {
+                         for (int i = 0; i < kNumItems / 10; ++i) {
+                           CHECK(!q.Put(i).has_value());
+                         }
+                       }));
+  ASSERT_OK(produce->Join());
+  ASSERT_OK(consume->Join());
+  std::cout << "ProducerConsumerQueue: "
+            << kNumItems / 10 / absl::ToDoubleSeconds(absl::Now() - start) / 2
+            << " ops / sec / thread" << std::endl;
+}
+
+TEST(SpscQueue, CompareLockFreeProducerConsumerQueue) {
+  LockFreeProducerConsumerQueue<int> q(1024, 1, 1, absl::Microseconds(50));
+  const absl::Time start = absl::Now();
+  ASSERT_OK_AND_ASSIGN(auto consume, work::Thread::Create([&q]() {
+                         for (int i = 0; i < kNumItems; ++i) {
+                           CHECK_EQ(q.Get(0), i);
+                         }
+                       }));
+  ASSERT_OK_AND_ASSIGN(auto produce, work::Thread::Create([&q]() {
+                         for (int i = 0; i < kNumItems; ++i) {
+                           q.Put(i, 0);
+                         }
+                       }));
+  ASSERT_OK(produce->Join());
+  ASSERT_OK(consume->Join());
+  std::cout << "LockFreeProducerConsumerQueue: "
+            << kNumItems / absl::ToDoubleSeconds(absl::Now() - start) / 2
+            << " ops / sec / thread" << std::endl;
+}
+
+TEST(SpscQueue, CompareMoody) {
+  moodycamel::BlockingConcurrentQueue<int> q(1024);
+  const absl::Time start = absl::Now();
+  ASSERT_OK_AND_ASSIGN(auto consume, work::Thread::Create([&q]() {
+                         int v;
+                         for (int i = 0; i < kNumItems; ++i) {
+                           q.wait_dequeue(v);
+                           CHECK_EQ(v, i);
+                         }
+                       }));
+  ASSERT_OK_AND_ASSIGN(auto produce, work::Thread::Create([&q]() {
+                         for (int i = 0; i < kNumItems; ++i) {
+                           q.enqueue(i);
+                         }
+                       }));
+  ASSERT_OK(produce->Join());
+  ASSERT_OK(consume->Join());
+  std::cout << "Moody BlockingConcurrentQueue: "
+            << kNumItems / absl::ToDoubleSeconds(absl::Now() - start) / 2
+            << " ops / sec / thread" << std::endl;
+}
+
+}  // namespace synch
+}  // namespace whisper
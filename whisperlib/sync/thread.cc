@@ -1,40 +1,218 @@
 #include "whisperlib/sync/thread.h"
 
+#include <sched.h>
 #include <signal.h>
 #ifdef __linux__
-#include <sched.h>
+#include <linux/mempolicy.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #endif  // __linux__
 
+#include <fstream>
+#include <sstream>
 #include <string>
 #include <utility>
 
 #include "absl/log/die_if_null.h"
+#include "absl/log/log.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
 #include "whisperlib/status/status.h"
 
 namespace whisper {
 namespace work {
 
+absl::StatusOr<std::vector<int>> ParseCpuList(absl::string_view cpu_list) {
+  std::vector<int> cpus;
+  for (absl::string_view range :
+       absl::StrSplit(absl::StripAsciiWhitespace(cpu_list), ',',
+                      absl::SkipWhitespace())) {
+    const size_t dash = range.find('-');
+    int first, last;
+    if (!absl::SimpleAtoi(range.substr(0, dash), &first) ||
+        !absl::SimpleAtoi(
+            dash == absl::string_view::npos ? range : range.substr(dash + 1),
+            &last) ||
+        first < 0 || last < first) {
+      return status::InvalidArgumentErrorBuilder()
+             << "Invalid cpu range: `" << range << "` in cpu list: `"
+             << cpu_list << "`";
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+namespace {
+#ifdef __linux__
+absl::StatusOr<std::vector<int>> NumaNodeCpus(int numa_node) {
+  const std::string path =
+      absl::StrFormat("/sys/devices/system/node/node%d/cpulist", numa_node);
+  std::ifstream f(path);
+  if (!f) {
+    return status::NotFoundErrorBuilder()
+           << "Cannot read the CPUs of NUMA node " << numa_node
+           << " from: " << path;
+  }
+  std::stringstream content;
+  content << f.rdbuf();
+  return ParseCpuList(content.str());
+}
+
+absl::Status SetNumaMemoryPolicy(int numa_node) {
+  static constexpr size_t kBitsPerWord = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> node_mask(numa_node / kBitsPerWord + 1);
+  node_mask[numa_node / kBitsPerWord] |= 1UL << (numa_node % kBitsPerWord);
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, node_mask.data(),
+              node_mask.size() * kBitsPerWord + 1) != 0) {
+    return status::InternalErrorBuilder()
+           << "set_mempolicy() failed for NUMA node " << numa_node
+           << ", errno: " << errno;
+  }
+  return absl::OkStatus();
+}
+
+absl::Status SetCpuAffinity(const std::vector<int>& cpus) {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (int cpu : cpus) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+      return status::InvalidArgumentErrorBuilder()
+             << "Invalid CPU for thread affinity: " << cpu;
+    }
+    CPU_SET(cpu, &cpu_set);
+  }
+  const int error =
+      pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+  if (ABSL_PREDICT_FALSE(error != 0)) {
+    return status::InternalErrorBuilder()
+           << "pthread_setaffinity_np() failed, error: " << error;
+  }
+  return absl::OkStatus();
+}
+#endif  // __linux__
+
+absl::StatusOr<int> ToSchedPolicy(ThreadOptions::SchedPolicy policy) {
+  switch (policy) {
+    case ThreadOptions::SchedPolicy::DEFAULT:
+    case ThreadOptions::SchedPolicy::OTHER:
+      return SCHED_OTHER;
+    case ThreadOptions::SchedPolicy::FIFO:
+      return SCHED_FIFO;
+    case ThreadOptions::SchedPolicy::RR:
+      return SCHED_RR;
+#ifdef __linux__
+    case ThreadOptions::SchedPolicy::BATCH:
+      return SCHED_BATCH;
+    case ThreadOptions::SchedPolicy::IDLE:
+      return SCHED_IDLE;
+#endif  // __linux__
+    default:
+      break;
+  }
+  return absl::UnimplementedError(
+      "Scheduling policy not supported on this system");
+}
+}  // namespace
+
+absl::Status ApplyThreadOptions(const ThreadOptions& options) {
+  if (!options.name.empty()) {
+    // Includes the terminating zero:
+    static constexpr size_t kMaxThreadNameSize = 16;
+    const std::string name = options.name.substr(0, kMaxThreadNameSize - 1);
+#if defined(__APPLE__)
+    const int error = pthread_setname_np(name.c_str());
+#else
+    const int error = pthread_setname_np(pthread_self(), name.c_str());
+#endif
+    if (ABSL_PREDICT_FALSE(error != 0)) {
+      return status::InternalErrorBuilder()
+             << "pthread_setname_np() failed, error: " << error;
+    }
+  }
+#ifdef __linux__
+  std::vector<int> cpus = options.cpu_affinity;
+  if (options.numa_node.has_value()) {
+    if (cpus.empty()) {
+      ASSIGN_OR_RETURN(cpus, NumaNodeCpus(options.numa_node.value()));
+    }
+    RETURN_IF_ERROR(SetNumaMemoryPolicy(options.numa_node.value()));
+  }
+  if (!cpus.empty()) {
+    RETURN_IF_ERROR(SetCpuAffinity(cpus));
+  }
+  if (options.nice.has_value()) {
+    // On Linux the nice value is per thread.
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), options.nice.value()) !=
+        0) {
+      return status::InternalErrorBuilder()
+             << "setpriority() failed for nice: " << options.nice.value()
+             << ", errno: " << errno;
+    }
+  }
+#else
+  if (!options.cpu_affinity.empty() || options.numa_node.has_value() ||
+      options.nice.has_value()) {
+    LOG(WARNING) << "Skipping setting thread affinity, NUMA node or nice "
+                    "level - not supported on this system.";
+  }
+#endif  // __linux__
+  if (options.sched_policy != ThreadOptions::SchedPolicy::DEFAULT) {
+    ASSIGN_OR_RETURN(const int policy, ToSchedPolicy(options.sched_policy));
+    struct sched_param param = {};
+    param.sched_priority = options.sched_priority;
+    const int error = pthread_setschedparam(pthread_self(), policy, &param);
+    if (ABSL_PREDICT_FALSE(error != 0)) {
+      return status::InternalErrorBuilder()
+             << "pthread_setschedparam() failed for policy: " << policy
+             << " priority: " << options.sched_priority
+             << ", error: " << error;
+    }
+  }
+  return absl::OkStatus();
+}
+
 absl::StatusOr<std::unique_ptr<Thread>> Thread::Create(
     absl::AnyInvocable<void()> thread_function,
     absl::optional<absl::AnyInvocable<void() &&>> completion_callback,
     absl::optional<size_t> stack_size, bool joinable, bool low_priority) {
+  ThreadOptions options;
+  options.stack_size = stack_size;
+  options.joinable = joinable;
+  options.low_priority = low_priority;
+  return Create(std::move(thread_function), std::move(options),
+                std::move(completion_callback));
+}
+
+absl::StatusOr<std::unique_ptr<Thread>> Thread::Create(
+    absl::AnyInvocable<void()> thread_function, ThreadOptions options,
+    absl::optional<absl::AnyInvocable<void() &&>> completion_callback) {
   auto thr = absl::WrapUnique(new Thread(std::move(thread_function),
                                          std::move(completion_callback),
-                                         stack_size, joinable, low_priority));
+                                         std::move(options)));
   RETURN_IF_ERROR(thr->Initialize());
+  thr->started_.WaitForNotification();
+  if (!thr->start_status_.ok()) {
+    if (thr->options_.joinable) {
+      thr->Join().IgnoreError();
+    }
+    return status::Annotate(thr->start_status_, "Applying thread options");
+  }
   return {std::move(thr)};
 }
 
 Thread::Thread(
     absl::AnyInvocable<void()> thread_function,
     absl::optional<absl::AnyInvocable<void() &&>> completion_callback,
-    absl::optional<size_t> stack_size, bool joinable, bool low_priority)
+    ThreadOptions options)
     : thread_function_(ABSL_DIE_IF_NULL(std::move(thread_function))),
       completion_callback_(std::move(completion_callback)),
-      stack_size_(stack_size),
-      joinable_(joinable),
-      low_priority_(low_priority) {}
+      options_(std::move(options)) {}
 
 Thread::~Thread() {
   if (attr_created_) {
@@ -55,13 +233,14 @@ absl::Status Thread::Initialize() {
            << "pthread_attr_init() failed, error: " << error;
   }
   attr_created_ = true;
-  error = pthread_attr_setdetachstate(
-      &attr_, joinable_ ? PTHREAD_CREATE_JOINABLE : PTHREAD_CREATE_DETACHED);
+  error = pthread_attr_setdetachstate(&attr_, options_.joinable
+                                                  ? PTHREAD_CREATE_JOINABLE
+                                                  : PTHREAD_CREATE_DETACHED);
   if (ABSL_PREDICT_FALSE(error != 0)) {
     return status::InternalErrorBuilder()
            << "pthread_attr_setdetachstate() failed, error: " << error;
   }
-  if (low_priority_) {
+  if (options_.low_priority) {
 #ifdef __linux__
     struct sched_param param;
     param.sched_priority = sched_get_priority_min(SCHED_RR);
@@ -76,17 +255,17 @@ absl::Status Thread::Initialize() {
 #endif
   }
 
-  if (stack_size_.has_value()) {
+  if (options_.stack_size.has_value()) {
 #if defined(__linux__) || defined(__APPLE__)
 #if defined(PTHREAD_STACK_MIN) && defined(PAGE_SIZE)
-    RET_CHECK_LE(PTHREAD_STACK_MIN, stack_size_.value())
+    RET_CHECK_LE(PTHREAD_STACK_MIN, options_.stack_size.value())
         << "Invalid stack size for system.";
 #endif
-    error = pthread_attr_setstacksize(&attr_, stack_size_.value());
+    error = pthread_attr_setstacksize(&attr_, options_.stack_size.value());
     if (ABSL_PREDICT_FALSE(error != 0)) {
       return status::InternalErrorBuilder()
              << "pthread_attr_setstacksize() failed, error: " << error
-             << " for a stack size of: " << stack_size_.value();
+             << " for a stack size of: " << options_.stack_size.value();
     }
 #endif
   }
@@ -122,7 +301,7 @@ absl::StatusOr<bool> Thread::IsJoinable() const {
   }
   return state == PTHREAD_CREATE_JOINABLE;
 #else
-  return joinable_;
+  return options_.joinable;
 #endif
 }
 
@@ -137,7 +316,7 @@ absl::StatusOr<size_t> Thread::GetStackSize() const {
   }
   return stack_size;
 #else
-  return stack_size_.has_value() ? stack_size_.value() : 0;
+  return options_.stack_size.has_value() ? options_.stack_size.value() : 0;
 #endif
 }
 
@@ -161,6 +340,13 @@ absl::Status Thread::Kill() {
 
 void* Thread::InternalRun(void* param) {
   Thread* th = reinterpret_cast<Thread*>(param);
+  th->start_status_ = ApplyThreadOptions(th->options_);
+  const bool started = th->start_status_.ok();
+  // On error, th may be gone right after this.
+  th->started_.Notify();
+  if (!started) {
+    pthread_exit(nullptr);
+  }
   th->thread_function_();
   if (th->completion_callback_.has_value()) {
     std::move(th->completion_callback_.value())();
@@ -7,14 +7,99 @@
 #include <pthread.h>
 
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "absl/functional/any_invocable.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/notification.h"
+#include "absl/types/optional.h"
 
 namespace whisper {
 namespace work {
 
+// How a thread is created and placed.
+// The placement options (affinity, NUMA node, scheduling and name) are
+// applied by the thread itself, before running anything else, and an
+// error in applying them fails the creation of the thread.
+struct ThreadOptions {
+  enum class SchedPolicy {
+    DEFAULT,  // leave it as inherited
+    OTHER,    // SCHED_OTHER - normal time sharing
+    FIFO,     // SCHED_FIFO - realtime, needs privileges
+    RR,       // SCHED_RR - realtime, round robin, needs privileges
+    BATCH,    // SCHED_BATCH - Linux only
+    IDLE,     // SCHED_IDLE - Linux only
+  };
+
+  // Stack size for the thread - see Thread::Create.
+  absl::optional<size_t> stack_size;
+  // If the thread can be joined, else it is created detached.
+  bool joinable = true;
+  // Sets the thread to the minimum priority of the scheduler.
+  bool low_priority = false;
+  // The CPUs on which this thread may run. Empty for any (or for all the
+  // CPUs of numa_node, if that is set). Linux only.
+  std::vector<int> cpu_affinity;
+  // If set, the thread memory is preferably allocated on this NUMA node,
+  // and, if no cpu_affinity is set, it runs only on the CPUs of this node.
+  // Linux only.
+  absl::optional<int> numa_node;
+  // Scheduling policy and priority (for FIFO / RR) of the thread.
+  SchedPolicy sched_policy = SchedPolicy::DEFAULT;
+  int sched_priority = 0;
+  // The nice level of the thread - Linux only, where it is per thread.
+  absl::optional<int> nice;
+  // Thread name, as shown by profilers, top, gdb etc. Truncated to 15
+  // characters (system limit).
+  std::string name;
+
+  ThreadOptions& set_stack_size(size_t value) {
+    stack_size = value;
+    return *this;
+  }
+  ThreadOptions& set_joinable(bool value) {
+    joinable = value;
+    return *this;
+  }
+  ThreadOptions& set_low_priority(bool value) {
+    low_priority = value;
+    return *this;
+  }
+  ThreadOptions& set_cpu_affinity(std::vector<int> value) {
+    cpu_affinity = std::move(value);
+    return *this;
+  }
+  ThreadOptions& set_numa_node(int value) {
+    numa_node = value;
+    return *this;
+  }
+  ThreadOptions& set_sched_policy(SchedPolicy value, int priority = 0) {
+    sched_policy = value;
+    sched_priority = priority;
+    return *this;
+  }
+  ThreadOptions& set_nice(int value) {
+    nice = value;
+    return *this;
+  }
+  ThreadOptions& set_name(absl::string_view value) {
+    name = std::string(value);
+    return *this;
+  }
+};
+
+// Applies the placement options (all but stack_size, joinable and
+// low_priority) to the calling thread.
+absl::Status ApplyThreadOptions(const ThreadOptions& options);
+
+// Parses a Linux cpu list (e.g. "0-3,8,10-11"), as found in
+// /sys/devices/system/node/node*/cpulist.
+absl::StatusOr<std::vector<int>> ParseCpuList(absl::string_view cpu_list);
+
 class Thread {
  public:
   // Create and starts a thread that runs the given function.
@@ -28,6 +113,10 @@ class Thread {
       absl::optional<absl::AnyInvocable<void() &&>> completion_callback = {},
       absl::optional<size_t> stack_size = {}, bool joinable = true,
       bool low_priority = false);
+  // Same as above, with all the options.
+  static absl::StatusOr<std::unique_ptr<Thread>> Create(
+      absl::AnyInvocable<void()> thread_function, ThreadOptions options,
+      absl::optional<absl::AnyInvocable<void() &&>> completion_callback = {});
 
   ~Thread();
 
@@ -46,10 +135,13 @@ class Thread {
   // Test if the caller is in this thread context.
   bool IsInThread() const;
 
+  // The options this thread was created with.
+  const ThreadOptions& options() const { return options_; }
+
  private:
   Thread(absl::AnyInvocable<void()> thread_function,
          absl::optional<absl::AnyInvocable<void() &&>> completion_callback,
-         absl::optional<size_t> stack_size, bool joinable, bool low_priority);
+         ThreadOptions options);
 
   // Prepares and runs the thread:
   absl::Status Initialize();
@@ -61,12 +153,13 @@ class Thread {
 
   absl::AnyInvocable<void()> thread_function_;
   absl::optional<absl::AnyInvocable<void() &&>> completion_callback_;
-  const absl::optional<size_t> stack_size_;
-  const bool joinable_;
-  const bool low_priority_;
+  const ThreadOptions options_;
   pthread_t thread_id_{};
   pthread_attr_t attr_;
   bool attr_created_ = false;
+  // Set by the thread once it applied its options, w/ the result.
+  absl::Notification started_;
+  absl::Status start_status_;
 };
 
 }  // namespace work
@@ -0,0 +1,157 @@
+#include "whisperlib/sync/thread_pool.h"
+
+#include <algorithm>
+#include <thread>
+#include <utility>
+
+#include "absl/functional/bind_front.h"
+#include "absl/log/check.h"
+#include "absl/log/log.h"
+#include "whisperlib/status/status.h"
+
+namespace whisper {
+namespace work {
+
+namespace {
+struct CurrentWorker {
+  const ThreadPool* pool = nullptr;
+  size_t index = 0;
+};
+thread_local CurrentWorker current_worker;
+
+uint64_t XorShift(uint64_t* state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<ThreadPool>> ThreadPool::Create(
+    Params params) {
+  if (params.num_threads == 0) {
+    params.num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  auto pool = absl::WrapUnique(new ThreadPool(std::move(params)));
+  // On error, the destructor stops the workers already started.
+  for (size_t i = 0; i < pool->workers_.size(); ++i) {
+    ASSIGN_OR_RETURN(pool->workers_[i]->thread,
+                     Thread::Create(absl::bind_front(&ThreadPool::WorkerLoop,
+                                                     pool.get(), i)),
+                     _ << "Starting thread pool worker " << i);
+  }
+  return {std::move(pool)};
+}
+
+ThreadPool::ThreadPool(Params params) : params_(std::move(params)) {
+  workers_.reserve(params_.num_threads);
+  for (size_t i = 0; i < params_.num_threads; ++i) {
+    workers_.emplace_back(std::make_unique<Worker>(params_.deque_initial_size));
+    workers_.back()->random_state = 0x9e3779b97f4a7c15ULL * (i + 1);
+  }
+}
+
+ThreadPool::~ThreadPool() { Shutdown(); }
+
+bool ThreadPool::IsInPool() const { return current_worker.pool == this; }
+
+void ThreadPool::Submit(Task task) {
+  Task* const t = new Task(std::move(task));
+  // Counted before being queued, so a worker that finds it zero before
+  // parking is sure to be woken up below.
+  num_queued_.fetch_add(1, std::memory_order_seq_cst);
+  if (IsInPool()) {
+    workers_[current_worker.index]->deque.Push(t);
+  } else {
+    DCHECK(!stopping_.load(std::memory_order_relaxed))
+        << "Submitting to a thread pool that is shut down";
+    injection_queue_.enqueue(t);
+  }
+  WakeUpWorker();
+}
+
+void ThreadPool::WakeUpWorker() {
+  if (num_parked_.load(std::memory_order_seq_cst) > 0) {
+    park_semaphore_.signal();
+  }
+}
+
+ThreadPool::Task* ThreadPool::FindTask(size_t index) {
+  Worker* const worker = workers_[index].get();
+  Task* task = nullptr;
+  if (auto t = worker->deque.Take(); t.has_value()) {
+    task = *t;
+  } else if (!injection_queue_.try_dequeue(task)) {
+    const size_t num_workers = workers_.size();
+    const size_t start = XorShift(&worker->random_state) % num_workers;
+    for (size_t i = 0; i < num_workers && task == nullptr; ++i) {
+      const size_t victim = (start + i) % num_workers;
+      if (victim != index) {
+        task = workers_[victim]->deque.Steal().value_or(nullptr);
+      }
+    }
+  }
+  if (task != nullptr) {
+    num_queued_.fetch_sub(1, std::memory_order_relaxed);
+  }
+  return task;
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+  current_worker.pool = this;
+  current_worker.index = index;
+  size_t num_spins = 0;
+  while (true) {
+    if (Task* const task = FindTask(index); task != nullptr) {
+      std::unique_ptr<Task> to_run(task);
+      std::move(*to_run)();
+      num_spins = 0;
+      continue;
+    }
+    if (num_queued_.load(std::memory_order_acquire) == 0 &&
+        stopping_.load(std::memory_order_acquire)) {
+      break;
+    }
+    if (++num_spins < params_.num_spins_before_park) {
+      std::this_thread::yield();
+      continue;
+    }
+    num_spins = 0;
+    // Pairs with Submit: either we see the task counted, or the submitter
+    // sees us parked.
+    num_parked_.fetch_add(1, std::memory_order_seq_cst);
+    if (num_queued_.load(std::memory_order_seq_cst) == 0 &&
+        !stopping_.load(std::memory_order_acquire)) {
+      park_semaphore_.wait();
+    }
+    num_parked_.fetch_sub(1, std::memory_order_seq_cst);
+  }
+  current_worker.pool = nullptr;
+}
+
+void ThreadPool::Shutdown() {
+  if (stopped_) {
+    return;
+  }
+  CHECK(!IsInPool()) << "Cannot shut down a thread pool from its workers";
+  stopped_ = true;
+  stopping_.store(true, std::memory_order_release);
+  park_semaphore_.signal(workers_.size());
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    if (workers_[i]->thread != nullptr) {
+      const absl::Status status = workers_[i]->thread->Join();
+      LOG_IF(ERROR, !status.ok())
+          << "Joining thread pool worker " << i << ": " << status;
+    }
+  }
+  // Left only if some workers failed to start.
+  Task* task;
+  while (injection_queue_.try_dequeue(task)) {
+    delete task;
+  }
+}
+
+}  // namespace work
+}  // namespace whisper
@@ -0,0 +1,145 @@
+// A work stealing pool of worker threads.
+
+#ifndef WHISPERLIB_SYNC_THREAD_POOL_H_
+#define WHISPERLIB_SYNC_THREAD_POOL_H_
+
+#include <atomic>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "absl/functional/any_invocable.h"
+#include "absl/status/statusor.h"
+#include "whisperlib/sync/moody/concurrentqueue.h"
+#include "whisperlib/sync/moody/lightweightsemaphore.h"
+#include "whisperlib/sync/thread.h"
+#include "whisperlib/sync/work_stealing_deque.h"
+
+namespace whisper {
+namespace work {
+
+// Runs tasks on a fixed set of worker threads, without a central lock:
+//  - each worker has its own Chase-Lev deque: the tasks submitted from a
+//    worker go to its deque, and are run by it in LIFO order (hot caches),
+//  - the tasks submitted from other threads go to a global, lock free,
+//    injection queue,
+//  - an idle worker first drains its deque, then the injection queue, then
+//    steals from the top of the other workers' deques,
+//  - workers with nothing to do spin a bit, then park on a semaphore; they
+//    are woken only when there are parked workers on submit.
+//
+// Example - running some CPU heavy processing for a connection, and
+// handling the result in the selector loop:
+//
+//   pool->SubmitWithReply(
+//       selector, [request = std::move(request)]() {
+//         return ProcessRequest(request);
+//       },
+//       [connection](Response response) {
+//         connection->Write(response.data());
+//       });
+//
+class ThreadPool {
+ public:
+  using Task = absl::AnyInvocable<void() &&>;
+
+  struct Params {
+    // Number of worker threads. If zero, one per hardware thread.
+    size_t num_threads = 0;
+    // Initial size of the per worker deques - they grow as needed.
+    size_t deque_initial_size = 256;
+    // How many rounds a worker looks for tasks before parking.
+    size_t num_spins_before_park = 64;
+
+    Params& set_num_threads(size_t value) {
+      num_threads = value;
+      return *this;
+    }
+    Params& set_deque_initial_size(size_t value) {
+      deque_initial_size = value;
+      return *this;
+    }
+    Params& set_num_spins_before_park(size_t value) {
+      num_spins_before_park = value;
+      return *this;
+    }
+  };
+
+  // Creates the pool and starts its worker threads.
+  static absl::StatusOr<std::unique_ptr<ThreadPool>> Create(Params params);
+
+  // Runs all the tasks still queued, then stops the workers.
+  ~ThreadPool();
+
+  // Schedules a task for running in one of the workers.
+  // Must not be called after (or during) Shutdown() from outside the pool.
+  void Submit(Task task);
+
+  // Runs task in the pool, then calls reply with its result (if any) in the
+  // select loop of loop - normally a net::Selector, or anything else with
+  // a RunInSelectLoop(callback) method.
+  template <typename Loop, typename F, typename Reply>
+  void SubmitWithReply(Loop* loop, F task, Reply reply) {
+    using R = std::invoke_result_t<F&&>;
+    Submit([loop, task = std::move(task), reply = std::move(reply)]() mutable {
+      if constexpr (std::is_void<R>::value) {
+        std::move(task)();
+        loop->RunInSelectLoop(
+            [reply = std::move(reply)]() mutable { std::move(reply)(); });
+      } else {
+        loop->RunInSelectLoop(
+            [reply = std::move(reply), result = std::move(task)()]() mutable {
+              std::move(reply)(std::move(result));
+            });
+      }
+    });
+  }
+
+  // Waits for all the queued tasks to complete, and stops the workers.
+  // Tasks submitted by the running tasks are still run.
+  void Shutdown();
+
+  size_t num_threads() const { return workers_.size(); }
+  // Approximate number of tasks waiting to run.
+  size_t NumQueued() const {
+    return num_queued_.load(std::memory_order_relaxed);
+  }
+  // If the caller is a worker thread of this pool.
+  bool IsInPool() const;
+
+ private:
+  struct Worker {
+    explicit Worker(size_t deque_initial_size) : deque(deque_initial_size) {}
+    synch::WorkStealingDeque<Task*> deque;
+    std::unique_ptr<Thread> thread;
+    // For picking the first victim when stealing.
+    uint64_t random_state = 0;
+  };
+
+  explicit ThreadPool(Params params);
+
+  void WorkerLoop(size_t index);
+  // Returns the next task to be run by the given worker, or nullptr.
+  Task* FindTask(size_t index);
+  // Wakes up a parked worker, if any.
+  void WakeUpWorker();
+
+  const Params params_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  moodycamel::ConcurrentQueue<Task*> injection_queue_;
+  moodycamel::LightweightSemaphore park_semaphore_;
+  // Tasks in the deques or the injection queue.
+  std::atomic<size_t> num_queued_{0};
+  std::atomic<size_t> num_parked_{0};
+  std::atomic<bool> stopping_{false};
+  bool stopped_ = false;
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+};
+
+}  // namespace work
+}  // namespace whisper
+
+#endif  // WHISPERLIB_SYNC_THREAD_POOL_H_
@@ -0,0 +1,88 @@
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "absl/functional/any_invocable.h"
+#include "absl/log/check.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "benchmark/benchmark.h"
+#include "whisperlib/sync/producer_consumer_queue.h"
+#include "whisperlib/sync/thread.h"
+#include "whisperlib/sync/thread_pool.h"
+
+namespace whisper {
+namespace work {
+namespace {
+
+// Tasks submitted per iteration, waited to complete before the next one.
+constexpr int kBatchSize = 10000;
+
+// Throughput of the ThreadPool with range(0) workers, on trivial tasks
+// submitted from outside the pool.
+void BM_ThreadPool(benchmark::State& state) {
+  auto pool = ThreadPool::Create(
+      ThreadPool::Params().set_num_threads(state.range(0)));
+  CHECK(pool.ok()) << pool.status();
+  std::atomic<int64_t> sum{0};
+  for (auto _ : state) {
+    absl::BlockingCounter done(kBatchSize);
+    for (int i = 0; i < kBatchSize; ++i) {
+      (*pool)->Submit([&sum, &done, i]() {
+        sum.fetch_add(i, std::memory_order_relaxed);
+        done.DecrementCount();
+      });
+    }
+    done.Wait();
+  }
+  (*pool)->Shutdown();
+  benchmark::DoNotOptimize(sum.load());
+  state.SetItemsProcessed(state.iterations() * kBatchSize);
+}
+
+// The same, for reference, vs. a pool of range(0) threads on a single
+// locked queue.
+void BM_SingleQueue(benchmark::State& state) {
+  const size_t num_threads = state.range(0);
+  synch::ProducerConsumerQueue<absl::AnyInvocable<void() &&>> q(1024);
+  std::vector<std::unique_ptr<Thread>> threads;
+  for (size_t i = 0; i < num_threads; ++i) {
+    auto thread = Thread::Create([&q]() {
+      while (true) {
+        auto task = q.Get();
+        if (task == nullptr) {
+          break;
+        }
+        std::move(task)();
+      }
+    });
+    CHECK(thread.ok()) << thread.status();
+    threads.emplace_back(*std::move(thread));
+  }
+  std::atomic<int64_t> sum{0};
+  for (auto _ : state) {
+    absl::BlockingCounter done(kBatchSize);
+    for (int i = 0; i < kBatchSize; ++i) {
+      CHECK(!q.Put([&sum, &done, i]() {
+                sum.fetch_add(i, std::memory_order_relaxed);
+                done.DecrementCount();
+              }).has_value());
+    }
+    done.Wait();
+  }
+  for (size_t i = 0; i < num_threads; ++i) {
+    CHECK(!q.Put(nullptr).has_value());
+  }
+  for (auto& thread : threads) {
+    CHECK_OK(thread->Join());
+  }
+  benchmark::DoNotOptimize(sum.load());
+  state.SetItemsProcessed(state.iterations() * kBatchSize);
+}
+
+BENCHMARK(BM_ThreadPool)->Arg(1)->Arg(4)->UseRealTime();
+BENCHMARK(BM_SingleQueue)->Arg(1)->Arg(4)->UseRealTime();
+
+}  // namespace
+}  // namespace work
+}  // namespace whisper
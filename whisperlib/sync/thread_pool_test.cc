@@ -0,0 +1,175 @@
+#include "whisperlib/sync/thread_pool.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/synchronization/notification.h"
+#include "gtest/gtest.h"
+#include "whisperlib/status/testing.h"
+#include "whisperlib/sync/producer_consumer_queue.h"
+#include "whisperlib/sync/work_stealing_deque.h"
+
+namespace whisper {
+namespace work {
+
+TEST(WorkStealingDeque, General) {
+  synch::WorkStealingDeque<int*> q(2);
+  std::vector<int> data(100);
+  for (int i = 0; i < 100; ++i) {
+    data[i] = i;
+    q.Push(&data[i]);
+  }
+  EXPECT_EQ(q.Size(), 100);
+  // Owner takes from the bottom, thieves from the top.
+  EXPECT_EQ(*q.Take().value(), 99);
+  EXPECT_EQ(*q.Steal().value(), 0);
+  EXPECT_EQ(*q.Steal().value(), 1);
+  EXPECT_EQ(*q.Take().value(), 98);
+  for (int i = 97; i >= 2; --i) {
+    EXPECT_EQ(*q.Take().value(), i);
+  }
+  EXPECT_TRUE(q.IsEmpty());
+  EXPECT_FALSE(q.Take().has_value());
+  EXPECT_FALSE(q.Steal().has_value());
+}
+
+TEST(WorkStealingDeque, Thieves) {
+  static constexpr int kNumItems = 1000000;
+  static constexpr int kNumThieves = 3;
+  synch::WorkStealingDeque<intptr_t> q;
+  std::atomic<int64_t> sum{0};
+  std::atomic<int> num_taken{0};
+  std::vector<std::unique_ptr<Thread>> thieves;
+  for (int i = 0; i < kNumThieves; ++i) {
+    ASSERT_OK_AND_ASSIGN(auto thief, Thread::Create([&q, &sum, &num_taken]() {
+                           while (num_taken.load() < kNumItems) {
+                             auto v = q.Steal();
+                             if (v.has_value()) {
+                               sum.fetch_add(*v);
+                               num_taken.fetch_add(1);
+                             }
+                           }
+                         }));
+    thieves.emplace_back(std::move(thief));
+  }
+  for (intptr_t i = 1; i <= kNumItems; ++i) {
+    q.Push(i);
+    if (i % 3 == 0) {
+      auto v = q.Take();
+      if (v.has_value()) {
+        sum.fetch_add(*v);
+        num_taken.fetch_add(1);
+      }
+    }
+  }
+  while (num_taken.load() < kNumItems) {
+    auto v = q.Take();
+    if (v.has_value()) {
+      sum.fetch_add(*v);
+      num_taken.fetch_add(1);
+    }
+  }
+  for (auto& thief : thieves) {
+    ASSERT_OK(thief->Join());
+  }
+  EXPECT_EQ(num_taken.load(), kNumItems);
+  EXPECT_EQ(sum.load(), int64_t(kNumItems) * (kNumItems + 1) / 2);
+}
+
+TEST(ThreadPool, General) {
+  ASSERT_OK_AND_ASSIGN(
+      auto pool, ThreadPool::Create(ThreadPool::Params().set_num_threads(4)));
+  EXPECT_EQ(pool->num_threads(), 4);
+  EXPECT_FALSE(pool->IsInPool());
+  std::atomic<int> num_run{0};
+  std::atomic<int> num_in_pool{0};
+  for (int i = 0; i < 10000; ++i) {
+    pool->Submit([&pool, &num_run, &num_in_pool]() {
+      if (pool->IsInPool()) {
+        num_in_pool.fetch_add(1);
+      }
+      num_run.fetch_add(1);
+    });
+  }
+  pool->Shutdown();
+  EXPECT_EQ(num_run.load(), 10000);
+  EXPECT_EQ(num_in_pool.load(), 10000);
+  EXPECT_EQ(pool->NumQueued(), 0);
+}
+
+// Recursive fan out - the sub tasks go to the local deques, and are stolen.
+void FanOut(ThreadPool* pool, int depth, std::atomic<int>* num_leaves) {
+  if (depth == 0) {
+    num_leaves->fetch_add(1);
+    return;
+  }
+  for (int i = 0; i < 2; ++i) {
+    pool->Submit([pool, depth, num_leaves]() {
+      FanOut(pool, depth - 1, num_leaves);
+    });
+  }
+}
+
+TEST(ThreadPool, FanOut) {
+  ASSERT_OK_AND_ASSIGN(
+      auto pool, ThreadPool::Create(ThreadPool::Params().set_num_threads(4)));
+  std::atomic<int> num_leaves{0};
+  pool->Submit([&pool, &num_leaves]() { FanOut(pool.get(), 16, &num_leaves); });
+  // Tasks submitted by running tasks are run before shutting down.
+  pool->Shutdown();
+  EXPECT_EQ(num_leaves.load(), 1 << 16);
+}
+
+TEST(ThreadPool, ParkAndWakeUp) {
+  ASSERT_OK_AND_ASSIGN(auto pool,
+                       ThreadPool::Create(ThreadPool::Params()
+                                              .set_num_threads(2)
+                                              .set_num_spins_before_park(1)));
+  for (int i = 0; i < 10; ++i) {
+    absl::SleepFor(absl::Milliseconds(5));  // all parked by now
+    absl::Notification done;
+    pool->Submit([&done]() { done.Notify(); });
+    EXPECT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  }
+}
+
+// Stands for a net::Selector - runs the callbacks in the calling thread.
+class FakeLoop {
+ public:
+  void RunInSelectLoop(absl::AnyInvocable<void() &&> callback) {
+    CHECK(!callbacks_.Put(std::move(callback)).has_value());
+  }
+  void RunOne() { std::move(callbacks_.Get())(); }
+
+ private:
+  synch::ProducerConsumerQueue<absl::AnyInvocable<void() &&>> callbacks_{100};
+};
+
+TEST(ThreadPool, SubmitWithReply) {
+  ASSERT_OK_AND_ASSIGN(
+      auto pool, ThreadPool::Create(ThreadPool::Params().set_num_threads(2)));
+  FakeLoop loop;
+  std::string result;
+  auto data = std::make_unique<std::string>("foo");
+  pool->SubmitWithReply(
+      &loop,
+      [data = std::move(data), &pool]() {
+        CHECK(pool->IsInPool());
+        return *data + "bar";
+      },
+      [&result, &pool](std::string s) {
+        CHECK(!pool->IsInPool());
+        result = std::move(s);
+      });
+  loop.RunOne();
+  EXPECT_EQ(result, "foobar");
+  bool done = false;
+  pool->SubmitWithReply(&loop, []() {}, [&done]() { done = true; });
+  loop.RunOne();
+  EXPECT_TRUE(done);
+}
+
+}  // namespace work
+}  // namespace whisper
@@ -0,0 +1,117 @@
+#include "whisperlib/sync/thread.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "whisperlib/status/testing.h"
+
+namespace whisper {
+namespace work {
+
+namespace {
+// The first CPU we are allowed to run on - not necessarily CPU 0, e.g. in
+// a container.
+int FirstAllowedCpu() {
+#ifdef __linux__
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &cpus)) {
+        return cpu;
+      }
+    }
+  }
+#endif  // __linux__
+  return 0;
+}
+}  // namespace
+
+TEST(Thread, General) {
+  std::atomic<int> num_run{0};
+  bool completed = false;
+  ASSERT_OK_AND_ASSIGN(
+      auto thread,
+      Thread::Create([&num_run]() { num_run.fetch_add(1); },
+                     [&completed]() { completed = true; }));
+  ASSERT_OK(thread->Join());
+  EXPECT_EQ(num_run.load(), 1);
+  EXPECT_TRUE(completed);
+  ASSERT_OK_AND_ASSIGN(const bool joinable, thread->IsJoinable());
+  EXPECT_TRUE(joinable);
+}
+
+TEST(Thread, Options) {
+  const int allowed_cpu = FirstAllowedCpu();
+  std::string name;
+  int cpu = -1;
+  ASSERT_OK_AND_ASSIGN(
+      auto thread,
+      Thread::Create(
+          [&name, &cpu]() {
+            char buffer[16] = {};
+            pthread_getname_np(pthread_self(), buffer, sizeof(buffer));
+            name = buffer;
+#ifdef __linux__
+            cpu = sched_getcpu();
+#endif  // __linux__
+          },
+          ThreadOptions()
+              .set_name("a-very-long-thread-name")
+              .set_cpu_affinity({allowed_cpu})
+              .set_stack_size(1 << 20)
+              .set_sched_policy(ThreadOptions::SchedPolicy::OTHER)));
+  ASSERT_OK(thread->Join());
+  EXPECT_EQ(name, "a-very-long-thr");
+#ifdef __linux__
+  EXPECT_EQ(cpu, allowed_cpu);
+#endif  // __linux__
+  ASSERT_OK_AND_ASSIGN(const size_t stack_size, thread->GetStackSize());
+  EXPECT_EQ(stack_size, 1 << 20);
+}
+
+#ifdef __linux__
+TEST(Thread, BadOptions) {
+  bool run = false;
+  EXPECT_THAT(
+      Thread::Create([&run]() { run = true; },
+                     ThreadOptions().set_cpu_affinity({CPU_SETSIZE + 1}))
+          .status(),
+      ::testing::Property(&absl::Status::code,
+                          absl::StatusCode::kInvalidArgument));
+  EXPECT_FALSE(
+      Thread::Create([&run]() { run = true; },
+                     ThreadOptions().set_numa_node(1 << 20).set_joinable(false))
+          .ok());
+  EXPECT_FALSE(run);
+}
+
+TEST(Thread, NumaNode) {
+  bool run = false;
+  auto thread = Thread::Create([&run]() { run = true; },
+                               ThreadOptions().set_numa_node(0));
+  if (!thread.ok()) {
+    GTEST_SKIP() << "No NUMA support: " << thread.status();
+  }
+  ASSERT_OK((*thread)->Join());
+  EXPECT_TRUE(run);
+}
+#endif  // __linux__
+
+TEST(Thread, ParseCpuList) {
+  ASSERT_OK_AND_ASSIGN(auto cpus, ParseCpuList("0-3,8,10-11\n"));
+  EXPECT_THAT(cpus, ::testing::ElementsAre(0, 1, 2, 3, 8, 10, 11));
+  ASSERT_OK_AND_ASSIGN(cpus, ParseCpuList(""));
+  EXPECT_TRUE(cpus.empty());
+  EXPECT_FALSE(ParseCpuList("3-1").ok());
+  EXPECT_FALSE(ParseCpuList("a").ok());
+  EXPECT_FALSE(ParseCpuList("1-").ok());
+}
+
+}  // namespace work
+}  // namespace whisper
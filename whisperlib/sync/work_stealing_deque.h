@@ -0,0 +1,152 @@
+#ifndef WHISPERLIB_SYNC_WORK_STEALING_DEQUE_H_
+#define WHISPERLIB_SYNC_WORK_STEALING_DEQUE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/types/optional.h"
+
+/**
+ * Chase-Lev work stealing deque.
+ *
+ * The owner thread pushes and takes at the bottom (LIFO), while any other
+ * thread may steal from the top (FIFO). The owner operations touch only the
+ * bottom index in the common case, and synchronize with the thieves only
+ * when a single element is left.
+ *
+ * Follows "Correct and Efficient Work-Stealing for Weak Memory Models",
+ * Le, Pop, Cohen, Zappa Nardelli - PPoPP 2013.
+ *
+ * The elements are stored in atomics, so T must be trivially copyable -
+ * normally a pointer. The ring grows as needed, by doubling; the old rings
+ * are kept until destruction, as thieves may still read from them.
+ */
+namespace whisper {
+namespace synch {
+
+template <typename T>
+class WorkStealingDeque {
+ public:
+  static_assert(std::is_trivially_copyable<T>::value,
+                "WorkStealingDeque requires trivially copyable types");
+
+  explicit WorkStealingDeque(size_t initial_size = 256) {
+    size_t size = 1;
+    while (size < initial_size) size <<= 1;
+    rings_.emplace_back(std::make_unique<Ring>(size));
+    ring_.store(rings_.back().get(), std::memory_order_relaxed);
+  }
+
+  // Owner only: adds an element at the bottom.
+  void Push(T value) {
+    const int64_t b = bottom_.load(std::memory_order_relaxed);
+    const int64_t t = top_.load(std::memory_order_acquire);
+    Ring* ring = ring_.load(std::memory_order_relaxed);
+    if (ABSL_PREDICT_FALSE(b - t >= ring->size())) {
+      ring = Grow(ring, t, b);
+    }
+    ring->Put(b, value);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+  }
+
+  // Owner only: removes the last pushed element, if any.
+  absl::optional<T> Take() {
+    const int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Ring* const ring = ring_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    if (t > b) {
+      // Empty.
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return {};
+    }
+    T value = ring->Get(b);
+    if (t == b) {
+      // Last one - race the thieves for it.
+      const bool won = top_.compare_exchange_strong(
+          t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      if (!won) {
+        return {};
+      }
+    }
+    return value;
+  }
+
+  // Any thread: removes the first pushed element, if any. May fail
+  // spuriously when racing with other thieves or the owner.
+  absl::optional<T> Steal() {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return {};
+    }
+    Ring* const ring = ring_.load(std::memory_order_acquire);
+    T value = ring->Get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return {};
+    }
+    return value;
+  }
+
+  // Approximately, if not called by the owner:
+  size_t Size() const {
+    const int64_t b = bottom_.load(std::memory_order_relaxed);
+    const int64_t t = top_.load(std::memory_order_relaxed);
+    return b > t ? static_cast<size_t>(b - t) : 0;
+  }
+  bool IsEmpty() const { return Size() == 0; }
+
+ private:
+  class Ring {
+   public:
+    explicit Ring(int64_t size)
+        : size_(size), mask_(size - 1), data_(new std::atomic<T>[size]) {}
+    int64_t size() const { return size_; }
+    void Put(int64_t index, T value) {
+      data_[index & mask_].store(value, std::memory_order_relaxed);
+    }
+    T Get(int64_t index) const {
+      return data_[index & mask_].load(std::memory_order_relaxed);
+    }
+
+   private:
+    const int64_t size_;
+    const int64_t mask_;
+    const std::unique_ptr<std::atomic<T>[]> data_;
+  };
+
+  Ring* Grow(Ring* ring, int64_t t, int64_t b) {
+    auto new_ring = std::make_unique<Ring>(ring->size() * 2);
+    for (int64_t i = t; i < b; ++i) {
+      new_ring->Put(i, ring->Get(i));
+    }
+    ring = new_ring.get();
+    rings_.emplace_back(std::move(new_ring));
+    ring_.store(ring, std::memory_order_release);
+    return ring;
+  }
+
+  ABSL_CACHELINE_ALIGNED std::atomic<int64_t> top_{0};
+  ABSL_CACHELINE_ALIGNED std::atomic<int64_t> bottom_{0};
+  std::atomic<Ring*> ring_{nullptr};
+  // All rings ever used - accessed only by the owner.
+  std::vector<std::unique_ptr<Ring>> rings_;
+
+  WorkStealingDeque(const WorkStealingDeque&) = delete;
+  WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+};
+
+}  // namespace synch
+}  // namespace whisper
+
+#endif  // WHISPERLIB_SYNC_WORK_STEALING_DEQUE_H_